@@ -9,15 +9,22 @@
 
 #include "BeringeiClientImpl.h"
 
+#include <stdexcept>
+
+#include <folly/Random.h>
 #include <folly/String.h>
 #include <folly/container/Enumerate.h>
 #include <folly/gen/Base.h>
 #include <folly/synchronization/LifoSem.h>
 #include <thrift/lib/cpp2/async/RequestChannel.h>
 
+#include "beringei/lib/Aggregation.h"
 #include "beringei/lib/GorillaStatsManager.h"
+#include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/PartialAggregate.h"
 #include "beringei/lib/TimeSeries.h"
 #include "beringei/lib/Timer.h"
+#include "beringei/lib/Tracing.h"
 
 using namespace apache::thrift;
 using namespace folly::gen;
@@ -37,24 +44,44 @@ namespace gorilla {
 
 struct BeringeiFutureContext {
   BeringeiFutureContext()
-      : readClients{}, clientNames{}, oneComplete(), getFutures{}, either{} {}
+      : readClients{},
+        clientNames{},
+        oneComplete(),
+        getFutures{},
+        either{},
+        waitAfterComplete(true),
+        traceId(0),
+        startUs(0) {}
   std::vector<std::shared_ptr<BeringeiNetworkClient>> readClients;
   std::vector<std::string> clientNames;
   // Fulfilled when we've received one full copy of the data.
   folly::Promise<folly::Unit> oneComplete;
   std::vector<folly::Future<folly::Unit>> getFutures;
   std::vector<folly::Future<folly::Unit>> either;
+  // Keep waiting for the other results for a while after one full
+  // copy of the data arrived.
+  bool waitAfterComplete;
+  // The trace of the request, or 0 if it isn't traced.
+  uint64_t traceId;
+  int64_t startUs;
 };
 
 namespace {
 struct BeringeiFutureGetContext : public BeringeiFutureContext {
   BeringeiFutureGetContext() = delete;
   explicit BeringeiFutureGetContext(const GetDataRequest& request)
-      : readRequest(request), resultCollector(nullptr), getRequests{} {}
+      : readRequest(request),
+        resultCollector(nullptr),
+        getRequests{},
+        complete(false) {}
 
   GetDataRequest readRequest;
   std::unique_ptr<BeringeiGetResultCollector> resultCollector;
+  std::shared_ptr<BlockCache> blockCache;
   std::vector<BeringeiNetworkClient::MultiGetRequestMap> getRequests;
+
+  // Set with `oneComplete`.
+  std::atomic<bool> complete;
 };
 
 struct BeringeiFutureScanShardContext : public BeringeiFutureContext {
@@ -66,6 +93,8 @@ struct BeringeiFutureScanShardContext : public BeringeiFutureContext {
 };
 } // namespace
 
+DECLARE_int32(gorilla_max_batch_size);
+
 DEFINE_int32(
     gorilla_client_writer_threads,
     0,
@@ -94,7 +123,17 @@ DEFINE_int32(
     55,
     "Retry delay for failed sends. Keeping this under one minute will "
     "still allow data points to arrive in the correct order (assuming "
-    "one minute data)");
+    "one minute data). The delays are jittered between half of this and "
+    "all of it, and doubled for each retry after the first one.");
+DEFINE_int32(
+    gorilla_retry_max_delay_secs,
+    120,
+    "Maximum delay between retries of failed sends");
+DEFINE_int32(
+    gorilla_retry_max_attempts,
+    3,
+    "Number of times the data points of failed sends are retried before "
+    "they are dropped");
 DEFINE_int32(
     gorilla_write_retry_threads,
     4,
@@ -105,6 +144,89 @@ DEFINE_int32(
     "Size ratio between the queue capacity and the actual queue size. "
     "Needed because the queue stores vectors");
 DEFINE_bool(gorilla_parallel_scan_shard, false, "Fan-out scanShard operations");
+DEFINE_bool(
+    gorilla_hedged_reads,
+    false,
+    "Send reads to the read service that has been the fastest, and to the "
+    "next one only once the first takes longer than usual");
+DEFINE_int32(
+    gorilla_hedge_min_delay_ms,
+    20,
+    "Minimum wait before sending a hedged read to the next read service");
+DEFINE_bool(
+    gorilla_shard_batching,
+    false,
+    "Sort the points by shard when they are queued and send the batch of a "
+    "shard once it reaches --gorilla_batch_max_bytes or has waited "
+    "--gorilla_batch_linger_ms");
+DEFINE_int32(
+    gorilla_batch_max_bytes,
+    64 * 1024,
+    "Approximate size of a batch of one shard that is sent right away with "
+    "--gorilla_shard_batching");
+DEFINE_int32(
+    gorilla_batch_linger_ms,
+    100,
+    "How long the points of a shard wait for more with "
+    "--gorilla_shard_batching");
+DEFINE_int32(
+    gorilla_put_window,
+    0,
+    "Number of put requests each writer thread keeps in flight to each host "
+    "while it keeps sending the next batches. 0 waits for all the responses "
+    "to a batch before sending the next one.");
+DEFINE_string(
+    gorilla_client_aggregation,
+    "",
+    "Combine the points of each key in windows of "
+    "--gorilla_client_aggregation_window_secs before they are queued, with "
+    "one of: last, sum, max. Empty sends every point.");
+DEFINE_int32(
+    gorilla_client_aggregation_window_secs,
+    60,
+    "Length of the windows of --gorilla_client_aggregation. Should be at "
+    "least the minimum timestamp delta of the services.");
+
+DEFINE_string(
+    gorilla_client_spool_dir,
+    "",
+    "Directory for keeping the data points that don't fit in the queues "
+    "or in the retry queue until they can be sent. Empty drops them.");
+DEFINE_int32(
+    gorilla_client_spool_memory_mb,
+    16,
+    "Memory for the spooled data points of each write service before they "
+    "are written to disk in one write");
+DEFINE_int32(
+    gorilla_client_spool_disk_mb,
+    1024,
+    "Disk space for the spooled data points of each write service");
+DEFINE_int32(
+    gorilla_client_spool_segment_mb,
+    64,
+    "Size of the files of spooled data points");
+DEFINE_int32(
+    gorilla_client_spool_drain_rate,
+    100000,
+    "Maximum number of spooled data points queued per second for each "
+    "write service");
+
+DEFINE_int32(
+    gorilla_client_block_cache_mb,
+    0,
+    "Memory for caching the blocks of old buckets read from each service, "
+    "so that reading them again only fetches the newer data. 0 disables "
+    "the cache.");
+DEFINE_int32(
+    gorilla_client_block_cache_bucket_secs,
+    2 * kGorillaSecondsPerHour,
+    "Length of the buckets in the block cache. Should match --bucket_size "
+    "of the services.");
+DEFINE_int32(
+    gorilla_client_block_cache_min_age_secs,
+    kGorillaSecondsPerHour,
+    "How long after a bucket ends it's cached, to leave time for late data "
+    "points");
 
 const static std::string kEnqueueDroppedKey = "gorilla_client.enqueue_dropped.";
 const static std::string kEnqueuedKey = "gorilla_client.enqueued.";
@@ -120,6 +242,13 @@ const static std::string kRetryQueueSizeKey = "gorilla_client.retry_queue_size";
 const static std::string kBadReadServices = "gorilla_client.bad_read_services";
 const static std::string kRedirectForMissingData =
     "gorilla_client.redirect_for_missing_data";
+const static std::string kHedgedReads = "gorilla_client.hedged_reads";
+const static std::string kAggregatedPoints =
+    "gorilla_client.aggregated_points";
+const static std::string kAggregationKeys = "gorilla_client.aggregation_keys";
+const static std::string kSpooledKey = "gorilla_client.spooled.";
+const static std::string kSpoolBytesKey = "gorilla_client.spool_bytes.";
+const static std::string kSpoolLagKey = "gorilla_client.spool_lag_secs.";
 
 const int BeringeiClientImpl::kDefaultReadServicesUpdateInterval = 15;
 const int BeringeiClientImpl::kNoWriterThreads = -1;
@@ -132,6 +261,15 @@ const static int kRetryQueueCapacitySizeRatio = 100;
 const static int kMinQueueSize = 10;
 const static int kMaxRetryBatchSize = 10000;
 
+// How often pipelined writers check for responses while the queue is
+// empty.
+const static int kPipelinePollUs = 1000;
+
+// Each host only reduces the keys of its own shards, and get results
+// have no place for the reduction, so it's only done by aggregate().
+const static std::string kCrossKeyGetError =
+    "Cross key functions are only supported by aggregate()";
+
 BeringeiClientImpl::BeringeiClientImpl(
     std::shared_ptr<BeringeiConfigurationAdapterIf> asyncClientAdapter,
     bool throwExceptionOnTransientFailure)
@@ -142,7 +280,26 @@ BeringeiClientImpl::BeringeiClientImpl(
           (int)FLAGS_gorilla_retry_queue_capacity /
               kRetryQueueCapacitySizeRatio,
           kMinQueueSize)),
-      numRetryQueuedDataPoints_(0) {}
+      numRetryQueuedDataPoints_(0) {
+  if (FLAGS_gorilla_client_block_cache_mb > 0) {
+    blockCache_ = std::make_shared<BlockCache>(
+        (size_t)FLAGS_gorilla_client_block_cache_mb * 1024 * 1024,
+        FLAGS_gorilla_client_block_cache_bucket_secs,
+        FLAGS_gorilla_client_block_cache_min_age_secs);
+  }
+
+  if (!FLAGS_gorilla_client_aggregation.empty()) {
+    PointAggregator::Function function;
+    if (PointAggregator::parseFunction(
+            FLAGS_gorilla_client_aggregation, function)) {
+      aggregator_.reset(new PointAggregator(
+          function, FLAGS_gorilla_client_aggregation_window_secs));
+    } else {
+      LOG(ERROR) << "Unknown aggregation: "
+                 << FLAGS_gorilla_client_aggregation;
+    }
+  }
+}
 
 void BeringeiClientImpl::initialize(
     int queueCapacity,
@@ -192,6 +349,8 @@ void BeringeiClientImpl::initialize(
   }
 
   startWriterThreads(writerThreads);
+  startAggregation();
+  startSpool();
 
   // Initialize counters.
   GorillaStatsManager::addStatExportType(kRetryQueueSizeKey, AVG);
@@ -200,6 +359,7 @@ void BeringeiClientImpl::initialize(
   GorillaStatsManager::addStatExportType(kRetryQueueWriteFailures, SUM);
   GorillaStatsManager::addStatExportType(kBadReadServices, SUM);
   GorillaStatsManager::addStatExportType(kRedirectForMissingData, SUM);
+  GorillaStatsManager::addStatExportType(kHedgedReads, SUM);
 
   for (auto& writeClient : writeClients_) {
     const std::string service = writeClient->client->getServiceName();
@@ -241,9 +401,13 @@ void BeringeiClientImpl::initializeTestClients(
   }
   maxNumShards_ = getMaxNumShards(writeClients_);
   startWriterThreads(writerThreads);
+  startAggregation();
+  startSpool();
 }
 
 BeringeiClientImpl::~BeringeiClientImpl() {
+  aggregationScheduler_.shutdown();
+  spoolScheduler_.shutdown();
   stopWriterThreads();
   readServicesUpdateScheduler_.shutdown();
 }
@@ -265,9 +429,19 @@ void BeringeiClientImpl::getLastUpdateTimes(
 void BeringeiClientImpl::startWriterThreads(int numWriterThreads) {
   if (numWriterThreads > 0) {
     for (auto& writeClient : writeClients_) {
+      if (FLAGS_gorilla_shard_batching && !writeClient->shardQueue) {
+        writeClient->shardQueue.reset(new ShardBatchingQueue(
+            writeClient->getNumShards(),
+            writeClient->queueCapacity,
+            FLAGS_gorilla_batch_max_bytes,
+            FLAGS_gorilla_batch_linger_ms));
+      }
+
       for (int i = 0; i < numWriterThreads; i++) {
         writers_.emplace_back(
-            &BeringeiClientImpl::writeDataPointsForever,
+            writeClient->shardQueue
+                ? &BeringeiClientImpl::writeShardBatchesForever
+                : &BeringeiClientImpl::writeDataPointsForever,
             this,
             writeClient.get());
       }
@@ -279,11 +453,17 @@ void BeringeiClientImpl::startWriterThreads(int numWriterThreads) {
 }
 
 void BeringeiClientImpl::stopWriterThreads() {
+  flushAggregatedPoints(true);
+
   // Terminate all the writer threads.
   if (writeClients_.size()) {
     int writerThreadsPerClient = writers_.size() / writeClients_.size();
     for (auto& writeClient : writeClients_) {
-      writeClient->queue.flush(writerThreadsPerClient);
+      if (writeClient->shardQueue) {
+        writeClient->shardQueue->flush(writerThreadsPerClient);
+      } else {
+        writeClient->queue.flush(writerThreadsPerClient);
+      }
     }
   }
 
@@ -294,8 +474,10 @@ void BeringeiClientImpl::stopWriterThreads() {
 
   for (auto& thread : retryWriters_) {
     RetryOperation op;
-    // Empty data points vector will stop the thread.
-    retryQueue_.write(std::move(op));
+    // Empty data points vector will stop the thread. The points that are
+    // due later than now are left for the next retry threads.
+    retryQueue_.push(
+        std::move(op), DelayQueue<RetryOperation>::Clock::now(), true);
   }
 
   for (auto& thread : retryWriters_) {
@@ -355,29 +537,170 @@ void BeringeiClientImpl::initBeringeiNetworkClients(
 }
 
 bool BeringeiClientImpl::putDataPoints(std::vector<DataPoint>& values) {
-  int numPoints = values.size();
-  if (numPoints == 0) {
+  if (values.empty()) {
     LOG(ERROR) << "Empty request";
     return true;
   }
 
+  if (!aggregator_ || writeClients_.empty()) {
+    return enqueue(values);
+  }
+
+  // The points are kept by the aggregator, so only the windows that
+  // are complete can be given back.
+  GorillaStatsManager::addStatValue(kAggregatedPoints, values.size());
+  std::vector<DataPoint> complete;
+  aggregator_->add(values, complete);
+  if (complete.empty()) {
+    return true;
+  }
+
+  bool success = enqueue(complete);
+  if (!success) {
+    values = std::move(complete);
+  }
+  return success;
+}
+
+void BeringeiClientImpl::startAggregation() {
+  if (!aggregator_ || writeClients_.empty()) {
+    return;
+  }
+
+  GorillaStatsManager::addStatExportType(kAggregatedPoints, SUM);
+  aggregationScheduler_.addFunction(
+      [this]() { flushAggregatedPoints(false); },
+      std::chrono::seconds(1),
+      "flushAggregatedPoints");
+  aggregationScheduler_.start();
+}
+
+void BeringeiClientImpl::flushAggregatedPoints(bool all) {
+  if (!aggregator_) {
+    return;
+  }
+
+  std::vector<DataPoint> complete;
+  if (all) {
+    aggregator_->flushAll(complete);
+  } else {
+    aggregator_->flush(time(nullptr), complete);
+  }
+  GorillaStatsManager::setCounter(kAggregationKeys, aggregator_->size());
+  if (!complete.empty()) {
+    enqueue(complete);
+  }
+}
+
+void BeringeiClientImpl::startSpool() {
+  if (FLAGS_gorilla_client_spool_dir.empty() || writeClients_.empty()) {
+    return;
+  }
+
+  for (int i = 0; i < writeClients_.size(); i++) {
+    auto& writeClient = writeClients_[i];
+    if (!writeClient->spool) {
+      writeClient->spool.reset(new PointSpool(
+          FLAGS_gorilla_client_spool_dir,
+          i,
+          (size_t)FLAGS_gorilla_client_spool_memory_mb << 20,
+          (size_t)FLAGS_gorilla_client_spool_disk_mb << 20,
+          (size_t)FLAGS_gorilla_client_spool_segment_mb << 20));
+    }
+
+    const std::string service = writeClient->client->getServiceName();
+    GorillaStatsManager::addStatExportType(kSpooledKey + service, SUM);
+  }
+
+  spoolScheduler_.addFunction(
+      [this]() { drainSpool(); }, std::chrono::seconds(1), "drainSpool");
+  spoolScheduler_.start();
+}
+
+void BeringeiClientImpl::drainSpool() {
+  for (auto& writeClient : writeClients_) {
+    PointSpool* spool = writeClient->spool.get();
+    if (!spool) {
+      continue;
+    }
+
+    // The points that are being retried show that the services haven't
+    // recovered yet. The queues are only filled up to half so that new
+    // points still fit.
+    size_t queueSize = writeClient->shardQueue
+        ? writeClient->shardQueue->size()
+        : writeClient->queue.size();
+    size_t room = writeClient->queueCapacity / 2;
+    if (numRetryQueuedDataPoints_ == 0 && queueSize < room) {
+      std::vector<DataPoint> points;
+      size_t maxPoints = std::min<size_t>(
+          room - queueSize, FLAGS_gorilla_client_spool_drain_rate);
+      spool->read(maxPoints, points);
+
+      bool success = !points.empty();
+      if (success && writeClient->shardQueue) {
+        success = writeClient->shardQueue->push(points);
+      } else if (success) {
+        success = writeClient->queue.push(points);
+      }
+      if (!points.empty() && !success && !spool->write(points)) {
+        logDroppedDataPoints(
+            writeClient->client.get(), points.size(), "spool is full");
+      }
+    }
+
+    const std::string service = writeClient->client->getServiceName();
+    GorillaStatsManager::setCounter(
+        kSpoolBytesKey + service, spool->getBytes());
+    GorillaStatsManager::setCounter(
+        kSpoolLagKey + service, spool->getLagSecs(time(nullptr)));
+  }
+}
+
+bool BeringeiClientImpl::spool(
+    BeringeiNetworkClient* client,
+    std::vector<DataPoint>& points) {
+  for (auto& writeClient : writeClients_) {
+    if (writeClient->client.get() == client && writeClient->spool) {
+      if (!writeClient->spool->write(points)) {
+        return false;
+      }
+      GorillaStatsManager::addStatValue(
+          kSpooledKey + client->getServiceName(), points.size());
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BeringeiClientImpl::enqueue(std::vector<DataPoint>& values) {
+  int numPoints = values.size();
+
+  // All the write services share one copy of the points.
+  auto batch = std::make_shared<std::vector<DataPoint>>(std::move(values));
+
   bool allPushedToAnyScope = false;
   for (int i = 0; i < writeClients_.size(); i++) {
     auto& writeClient = writeClients_[i];
 
     bool success = false;
-    if (i < writeClients_.size() - 1) {
-      // Pushing does std::move, need to copy because this is not the
-      // last iteration of the loop.
-      std::vector<DataPoint> valuesCopy = values;
-      success = writeClient->queue.push(valuesCopy);
+    if (writeClient->shardQueue) {
+      // Points are moved into the shard batches, so they're copied.
+      std::vector<DataPoint> valuesCopy = *batch;
+      success = writeClient->shardQueue->push(valuesCopy);
     } else {
-      success = writeClient->queue.push(values);
+      success = writeClient->queue.push(
+          RequestBatchingQueue::SharedPoints(batch));
     }
 
-    size_t queueSize = writeClient->queue.size();
+    size_t queueSize = writeClient->shardQueue
+        ? writeClient->shardQueue->size()
+        : writeClient->queue.size();
     const std::string service = writeClient->client->getServiceName();
-    if (success) {
+    if (!success && writeClient->spool && writeClient->spool->write(*batch)) {
+      GorillaStatsManager::addStatValue(kSpooledKey + service, numPoints);
+      success = true;
+    } else if (success) {
       GorillaStatsManager::addStatValue(kEnqueuedKey + service, numPoints);
     } else {
       GorillaStatsManager::addStatValue(
@@ -390,9 +713,28 @@ bool BeringeiClientImpl::putDataPoints(std::vector<DataPoint>& values) {
     }
   }
 
+  // Give the points back so the caller can retry them.
+  if (!allPushedToAnyScope && batch.use_count() == 1) {
+    values = std::move(*batch);
+  }
   return allPushedToAnyScope;
 }
 
+bool BeringeiClientImpl::putRegisteredDataPoints(
+    const std::vector<RegisteredDataPoint>& values) {
+  if (values.empty()) {
+    LOG(ERROR) << "Empty request";
+    return true;
+  }
+
+  std::vector<DataPoint> dataPoints;
+  bool allValid = keyRegistry_.getDataPoints(values, dataPoints) == 0;
+  if (dataPoints.empty()) {
+    return false;
+  }
+  return putDataPoints(dataPoints) && allValid;
+}
+
 void BeringeiClientImpl::getWithClient(
     BeringeiNetworkClient& readClient,
     const GetDataRequest& request,
@@ -410,6 +752,7 @@ void BeringeiClientImpl::getWithClient(
   for (auto& iter : requests) {
     iter.second.first.begin = request.begin;
     iter.second.first.end = request.end;
+    iter.second.first.aggregation = request.aggregation;
   }
 
   // Perform the fetch in parallel.
@@ -483,6 +826,15 @@ void BeringeiClientImpl::get(
     GetDataRequest& request,
     GetDataResult& result,
     const std::string& serviceOverride) {
+  // Retries regroup the keys by key name, which can't keep the ranges.
+  if (!request.ranges.empty()) {
+    throw std::invalid_argument(
+        "Per key ranges are only supported by futureGet()");
+  }
+  if (request.aggregation.crossKeyFunction != AggregationFunction::NONE) {
+    throw std::invalid_argument(kCrossKeyGetError);
+  }
+
   auto readClientCopies = getAllReadClients(serviceOverride);
   std::unordered_map<std::string, int64_t> keyShards;
   for (const auto& key : request.keys) {
@@ -601,6 +953,10 @@ void BeringeiClientImpl::futureContextInit(
   }
   context.clientNames = from(context.readClients) | dereference |
       member(&BeringeiNetworkClient::getServiceName) | as<std::vector>();
+  context.traceId = Tracing::sample();
+  if (context.traceId != 0) {
+    context.startUs = Tracing::nowUs();
+  }
 }
 
 template <typename R, typename F>
@@ -622,67 +978,255 @@ auto BeringeiClientImpl::futureContextFinalize(
   // Futures madness.
   // Block until either every result has arrived or we received enough results
   // to construct a full data set and then a timeout occurred.
-  context.either.push_back(context.oneComplete.getFuture().then([]() {
-    return folly::futures::sleep(
-        std::chrono::milliseconds(BeringeiNetworkClient::getTimeoutMs()));
-  }));
+  if (context.waitAfterComplete) {
+    context.either.push_back(context.oneComplete.getFuture().then([]() {
+      return folly::futures::sleep(
+          std::chrono::milliseconds(BeringeiNetworkClient::getTimeoutMs()));
+    }));
+  } else {
+    context.either.push_back(context.oneComplete.getFuture());
+  }
   context.either.push_back(
       collectAll(context.getFutures)
           .then([](const std::vector<folly::Try<folly::Unit>>&) {}));
   return folly::collectAny(context.either).then(std::forward<F>(fn));
 }
 
+// Sends the get requests of one read service and records how long it
+// took to get all the answers.
+static folly::Future<folly::Unit> futureGetFromService(
+    std::shared_ptr<BeringeiFutureGetContext> getContext,
+    std::shared_ptr<ReadLatencyTracker> readLatency,
+    size_t clientId,
+    folly::EventBase* eb,
+    folly::Executor* workExecutor) {
+  const auto& request = getContext->readRequest;
+  auto& client = getContext->readClients[clientId];
+  auto& getRequests = getContext->getRequests[clientId];
+  bool perKeyRanges = !request.ranges.empty();
+  for (const auto& key : folly::enumerate(request.keys)) {
+    if (perKeyRanges) {
+      client->addKeyToGetRequest(
+          key.index, *key, request.ranges[key.index], getRequests);
+    } else {
+      client->addKeyToGetRequest(key.index, *key, getRequests);
+    }
+  }
+
+  // Downsampled blocks can't be split into buckets, and the cache only
+  // works with one range for all the keys.
+  auto& blockCache = getContext->blockCache;
+  bool useCache = blockCache && !perKeyRanges &&
+      !Aggregation::isValid(request.aggregation, request.begin, request.end);
+  int64_t now = time(nullptr);
+
+  Timer timer(true);
+  auto failed = std::make_shared<std::atomic<bool>>(false);
+  std::vector<folly::Future<folly::Unit>> futures;
+  for (auto& r : getRequests) {
+    auto& keys = r.second.first.keys;
+    auto& indices = r.second.second;
+
+    // Only the buckets after the ones that every key of the request has
+    // cached are read from the service.
+    std::shared_ptr<std::vector<std::vector<TimeSeriesBlock>>> cached;
+    int64_t begin = request.begin;
+    if (useCache) {
+      cached = std::make_shared<std::vector<std::vector<TimeSeriesBlock>>>(
+          keys.size());
+      int64_t firstBucket = blockCache->getBucketStart(request.begin);
+      int64_t missing = request.end + 1;
+      for (size_t i = 0; i < keys.size(); i++) {
+        missing = blockCache->getBlocks(
+            getContext->clientNames[clientId],
+            keys[i].key,
+            request.begin,
+            missing - 1,
+            now,
+            (*cached)[i]);
+      }
+      for (auto& blocks : *cached) {
+        blocks.resize(
+            std::max<int64_t>(missing - firstBucket, 0) /
+            blockCache->getBucketSecs());
+      }
+      begin = std::max(request.begin, missing);
+
+      if (begin > request.end) {
+        GetDataResult result;
+        result.results.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+          result.results[i].data = std::move((*cached)[i]);
+        }
+        if (getContext->resultCollector->addResults(
+                std::move(result), indices, clientId)) {
+          getContext->complete = true;
+          getContext->oneComplete.setValue();
+        }
+        continue;
+      }
+    }
+
+    r.second.first.begin = begin;
+    r.second.first.end = request.end;
+    r.second.first.aggregation = request.aggregation;
+    futures.push_back(
+        client->performGet(r.first, std::move(r.second.first), eb)
+            .via(workExecutor)
+            .then([getContext,
+                   clientId,
+                   indices = std::move(indices),
+                   cached,
+                   begin,
+                   now](GetDataResult&& result) {
+              Tracing::TraceScope trace(getContext->traceId);
+              Tracing::SpanScope span("client_merge");
+              if (cached && result.results.size() == indices.size()) {
+                const auto& request = getContext->readRequest;
+                for (size_t i = 0; i < indices.size(); i++) {
+                  auto& data = result.results[i];
+                  if (data.status != StatusCode::OK) {
+                    continue;
+                  }
+
+                  getContext->blockCache->putBlocks(
+                      getContext->clientNames[clientId],
+                      request.keys[indices[i]].key,
+                      data.data,
+                      begin,
+                      request.end,
+                      now);
+                  if (begin > request.begin) {
+                    // The first block may still start in a cached bucket.
+                    TimeSeries::trimBlocks(data.data, begin, request.end);
+                    data.data.insert(
+                        data.data.begin(),
+                        std::make_move_iterator((*cached)[i].begin()),
+                        std::make_move_iterator((*cached)[i].end()));
+                  }
+                }
+              }
+
+              if (getContext->resultCollector->addResults(
+                      std::move(result), indices, clientId)) {
+                getContext->complete = true;
+                getContext->oneComplete.setValue();
+              }
+            })
+            .onError([failed](const std::exception& e) {
+              LOG(ERROR) << e.what();
+              *failed = true;
+            }));
+  }
+
+  return collectAll(futures).then(
+      [getContext, readLatency, clientId, timer, failed](
+          const std::vector<folly::Try<folly::Unit>>&) {
+        // Failures count as timeouts so that the service isn't picked
+        // first again right away.
+        int64_t latencyUs = *failed
+            ? BeringeiNetworkClient::getTimeoutMs() * kGorillaUsecPerMs
+            : timer.get();
+        readLatency->record(getContext->clientNames[clientId], latencyUs);
+      });
+}
+
 folly::Future<BeringeiGetResult> BeringeiClientImpl::futureGet(
     GetDataRequest& getDataRequest,
     folly::EventBase* eb,
     folly::Executor* workExecutor,
-    const std::string& serviceOverride) {
+    const std::string& serviceOverride,
+    BeringeiGetResult reuse) {
+  if (!getDataRequest.ranges.empty() &&
+      getDataRequest.ranges.size() != getDataRequest.keys.size()) {
+    return folly::makeFuture<BeringeiGetResult>(std::invalid_argument(
+        "A get request needs one range per key or none"));
+  }
+  if (getDataRequest.aggregation.crossKeyFunction !=
+      AggregationFunction::NONE) {
+    return folly::makeFuture<BeringeiGetResult>(
+        std::invalid_argument(kCrossKeyGetError));
+  }
+
   auto getContext = std::make_shared<BeringeiFutureGetContext>(getDataRequest);
   futureContextInit(*getContext, true /* parallel */, serviceOverride);
 
   const auto& request = getContext->readRequest;
-  auto& getRequests = getContext->getRequests;
   auto& readClients = getContext->readClients;
+  auto& clientNames = getContext->clientNames;
+
+  // Hedged reads go to the fastest service first, and to the next one
+  // each time the ones before it take longer than usual.
+  bool hedged = FLAGS_gorilla_hedged_reads && serviceOverride.empty() &&
+      readClients.size() > 1;
+  if (hedged) {
+    std::vector<std::shared_ptr<BeringeiNetworkClient>> sortedClients;
+    std::vector<std::string> sortedNames;
+    for (size_t i : readLatency_->order(clientNames)) {
+      sortedClients.push_back(readClients[i]);
+      sortedNames.push_back(clientNames[i]);
+    }
+    readClients.swap(sortedClients);
+    clientNames.swap(sortedNames);
+    getContext->waitAfterComplete = false;
+  }
 
   getContext->getRequests =
       std::vector<BeringeiNetworkClient::MultiGetRequestMap>(
           readClients.size());
   getContext->resultCollector = std::make_unique<BeringeiGetResultCollector>(
       request.keys.size(), readClients.size(), request.begin, request.end);
-
-  for (const auto& client : folly::enumerate(readClients)) {
-    for (const auto& key : folly::enumerate(request.keys)) {
-      (*client)->addKeyToGetRequest(key.index, *key, getRequests[client.index]);
+  if (!request.ranges.empty()) {
+    getContext->resultCollector->setRanges(request.ranges);
+  }
+  if (!reuse.results.empty()) {
+    getContext->resultCollector->reuse(std::move(reuse));
+  }
+  getContext->blockCache = blockCache_;
+
+  std::chrono::microseconds delay(0);
+  if (hedged) {
+    int64_t minDelayUs = FLAGS_gorilla_hedge_min_delay_ms * kGorillaUsecPerMs;
+    delay = std::chrono::microseconds(std::max(
+        minDelayUs,
+        readLatency_->getHighLatencyUs(clientNames[0], minDelayUs)));
+  }
+  Tracing::TraceScope trace(getContext->traceId);
+  for (size_t clientId = 0; clientId < readClients.size(); clientId++) {
+    if (!hedged || clientId == 0) {
+      getContext->getFutures.push_back(futureGetFromService(
+          getContext, readLatency_, clientId, eb, workExecutor));
+      continue;
     }
 
-    for (auto& r : getRequests[client.index]) {
-      r.second.first.begin = request.begin;
-      r.second.first.end = request.end;
-      // TODO: BeringeiGetResult::addResults() blocks on a lock, which we
-      //       shouldn't do in the CPU thread pool. Though this approach still
-      //       reduces latency compared to everything in one thread.
-      //       Maybe split the decompression and merging steps?
-      futureContextAddFn(
-          *getContext,
-          workExecutor,
-          (*client)->performGet(r.first, std::move(r.second.first), eb),
-          [getContext,
-           clientId = client.index,
-           indices = std::move(r.second.second)](GetDataResult&& result) {
-            if (getContext->resultCollector->addResults(
-                    result, indices, clientId)) {
-              getContext->oneComplete.setValue();
-            }
-          });
-    }
+    // Requests are only sent from the thread of `eb`.
+    auto readLatency = readLatency_;
+    getContext->getFutures.push_back(
+        folly::futures::sleep(delay * clientId)
+            .via(eb)
+            .then([getContext, readLatency, clientId, eb, workExecutor]() {
+              if (getContext->complete) {
+                return folly::makeFuture();
+              }
+              Tracing::TraceScope trace(getContext->traceId);
+              GorillaStatsManager::addStatValue(kHedgedReads);
+              return futureGetFromService(
+                  getContext, readLatency, clientId, eb, workExecutor);
+            })
+            .onError([](const std::exception& e) { LOG(ERROR) << e.what(); }));
   }
 
   return futureContextFinalize(
       *getContext,
-      [getContext, shouldThrow = throwExceptionOnTransientFailure_](
+      [getContext, shouldThrow = throwExceptionOnTransientFailure_, hedged](
           std::pair<unsigned long, folly::Try<folly::Unit>>&&) {
-        return getContext->resultCollector->finalize(
-            shouldThrow, getContext->clientNames);
+        int64_t decodeUs = getContext->traceId ? Tracing::nowUs() : 0;
+        auto result = getContext->resultCollector->finalize(
+            shouldThrow, getContext->clientNames, hedged);
+        Tracing::record(getContext->traceId, "client_decode", decodeUs);
+        Tracing::record(
+            getContext->traceId, "client_get", getContext->startUs);
+        return result;
       });
 }
 
@@ -694,13 +1238,70 @@ BeringeiGetResult BeringeiClientImpl::get(
       .getVia(eb);
 }
 
+BeringeiGetResult BeringeiClientImpl::get(
+    GetDataRequest& request,
+    BeringeiGetResult&& reuse,
+    const std::string& serviceOverride) {
+  auto eb = BeringeiNetworkClient::getEventBase();
+  return futureGet(
+             request,
+             eb,
+             folly::getCPUExecutor().get(),
+             serviceOverride,
+             std::move(reuse))
+      .getVia(eb);
+}
+
+void BeringeiClientImpl::queueRetry(
+    BeringeiNetworkClient* client,
+    std::vector<DataPoint>&& dataPoints,
+    int attempt) {
+  // Retry and send the failed data points in another thread after a
+  // delay to allow the server to come back up if it's down. The delays
+  // are jittered so that the clients that failed together don't all
+  // retry at the same time.
+  int64_t delayMs = HostHealth::backoffMs(
+      attempt,
+      FLAGS_gorilla_retry_delay_secs * 1000LL,
+      FLAGS_gorilla_retry_max_delay_secs * 1000LL,
+      folly::Random::rand32());
+  size_t droppedCount = dataPoints.size();
+  RetryOperation op;
+  op.client = client;
+  op.dataPoints = std::move(dataPoints);
+  op.retryTimeSecs = time(nullptr) + delayMs / 1000;
+  op.attempt = attempt;
+  auto due = DelayQueue<RetryOperation>::Clock::now() +
+      std::chrono::milliseconds(delayMs);
+  if (numRetryQueuedDataPoints_ + droppedCount >=
+          FLAGS_gorilla_retry_queue_capacity ||
+      !retryQueue_.push(std::move(op), due)) {
+    if (spool(client, op.dataPoints)) {
+      return;
+    }
+    logDroppedDataPoints(client, droppedCount, "retry queue is full");
+    GorillaStatsManager::addStatValue(kRetryQueueWriteFailures);
+  } else {
+    numRetryQueuedDataPoints_ += droppedCount;
+    GorillaStatsManager::addStatValue(
+        kPutRetryKey + client->getServiceName(), droppedCount);
+    GorillaStatsManager::addStatValue(
+        kRetryQueueSizeKey, numRetryQueuedDataPoints_);
+  }
+}
+
 void BeringeiClientImpl::writeDataPointsForever(WriteClient* writeClient) {
+  if (FLAGS_gorilla_put_window > 0) {
+    writeDataPointsPipelined(writeClient);
+    return;
+  }
+
   bool keepWriting = true;
   while (keepWriting) {
     BeringeiNetworkClient::PutRequestMap requests;
     std::vector<DataPoint> droppedDataPoints;
     try {
-      auto points = writeClient->queue.pop([&](DataPoint& dp) {
+      auto points = writeClient->queue.pop([&](const DataPoint& dp) {
         // Add each popped data point to the right request.
         bool addMorePoints = true;
         bool dropped = false;
@@ -735,28 +1336,7 @@ void BeringeiClientImpl::writeDataPointsForever(WriteClient* writeClient) {
       }
 
       if (droppedDataPoints.size() > 0) {
-        // Retry and send the failed data points in another thread
-        // after a delay to allow the server to come back up if it's
-        // down.
-        size_t droppedCount = droppedDataPoints.size();
-        RetryOperation op;
-        op.client = writeClient->client.get();
-        op.dataPoints = std::move(droppedDataPoints);
-        op.retryTimeSecs = time(nullptr) + FLAGS_gorilla_retry_delay_secs;
-        if (numRetryQueuedDataPoints_ + droppedCount >=
-                FLAGS_gorilla_retry_queue_capacity ||
-            !retryQueue_.write(std::move(op))) {
-          logDroppedDataPoints(
-              writeClient->client.get(), droppedCount, "retry queue is full");
-          GorillaStatsManager::addStatValue(kRetryQueueWriteFailures);
-        } else {
-          numRetryQueuedDataPoints_ += droppedCount;
-          GorillaStatsManager::addStatValue(
-              kPutRetryKey + writeClient->client->getServiceName(),
-              droppedCount);
-          GorillaStatsManager::addStatValue(
-              kRetryQueueSizeKey, numRetryQueuedDataPoints_);
-        }
+        queueRetry(writeClient->client.get(), std::move(droppedDataPoints));
       }
 
       size_t queueSize = writeClient->queue.size();
@@ -773,6 +1353,171 @@ void BeringeiClientImpl::writeDataPointsForever(WriteClient* writeClient) {
   }
 }
 
+void BeringeiClientImpl::writeShardBatchesForever(WriteClient* writeClient) {
+  BeringeiNetworkClient* client = writeClient->client.get();
+  const std::string service = client->getServiceName();
+
+  // Both are kept between batches so that their buffers are reused.
+  std::vector<ShardBatchingQueue::Batch> batches;
+  BeringeiNetworkClient::PutRequestMap requests;
+
+  bool keepWriting = true;
+  while (keepWriting) {
+    try {
+      if (!writeClient->shardQueue->pop(
+              batches, FLAGS_gorilla_max_batch_size)) {
+        LOG(WARNING) << "Shutting down Beringei writer thread.";
+        keepWriting = false;
+        continue;
+      }
+
+      int numPoints = 0;
+      std::vector<DataPoint> droppedDataPoints;
+      for (auto& batch : batches) {
+        numPoints += batch.points.size();
+        bool dropped = false;
+        client->addDataPointsToRequest(
+            batch.shardId, batch.points, requests, dropped);
+        if (dropped) {
+          droppedDataPoints.insert(
+              droppedDataPoints.end(),
+              std::make_move_iterator(batch.points.begin()),
+              std::make_move_iterator(batch.points.end()));
+        }
+      }
+      writeClient->shardQueue->recycle(batches);
+
+      std::vector<DataPoint> dropped =
+          putWithStats(client, numPoints, requests);
+      for (auto& request : requests) {
+        request.second.data.clear();
+        request.second.dataWithKeyIds.clear();
+        request.second.encodedData.clear();
+      }
+
+      droppedDataPoints.insert(
+          droppedDataPoints.end(),
+          std::make_move_iterator(dropped.begin()),
+          std::make_move_iterator(dropped.end()));
+      if (droppedDataPoints.size() > 0) {
+        queueRetry(client, std::move(droppedDataPoints));
+      }
+
+      GorillaStatsManager::addStatValue(
+          kQueueSizeKey + service, writeClient->shardQueue->size());
+    } catch (std::exception& e) {
+      LOG(ERROR) << e.what();
+    }
+  }
+}
+
+void BeringeiClientImpl::writeDataPointsPipelined(WriteClient* writeClient) {
+  BeringeiNetworkClient* client = writeClient->client.get();
+  const std::string service = client->getServiceName();
+  folly::EventBase* eb = BeringeiNetworkClient::getEventBase();
+
+  // Requests in flight to each host. The responses complete in the
+  // thread of `eb`, which is this one, so there's no locking.
+  std::unordered_map<std::pair<std::string, int>, int> inFlight;
+  int pending = 0;
+
+  // Handles responses for `us` microseconds.
+  auto handleResponses = [&](int64_t us) {
+    Timer timer(true);
+    eb->loopOnce(EVLOOP_NONBLOCK);
+    while (pending > 0 && timer.get() < us) {
+      usleep(std::min<int64_t>(kPipelinePollUs, us - timer.get()));
+      eb->loopOnce(EVLOOP_NONBLOCK);
+    }
+    if (timer.get() < us) {
+      usleep(us - timer.get());
+    }
+  };
+
+  bool keepWriting = true;
+  while (keepWriting) {
+    BeringeiNetworkClient::PutRequestMap requests;
+    std::vector<DataPoint> droppedDataPoints;
+    try {
+      // Only block on the queue when no responses are outstanding.
+      auto points = writeClient->queue.pop(
+          [&](const DataPoint& dp) {
+            bool addMorePoints = true;
+            bool dropped = false;
+
+            if (!client->addDataPointToRequest(dp, requests, dropped)) {
+              addMorePoints = false;
+            }
+            if (dropped) {
+              droppedDataPoints.push_back(dp);
+            }
+
+            return addMorePoints &&
+                droppedDataPoints.size() < kMaxRetryBatchSize;
+          },
+          pending == 0);
+
+      if (!points.first) {
+        LOG(WARNING) << "Shutting down Beringei writer thread.";
+        keepWriting = false;
+      }
+      if (points.second == 0) {
+        if (keepWriting) {
+          handleResponses(kPipelinePollUs);
+        }
+        continue;
+      }
+
+      for (auto& request : requests) {
+        auto host = request.first;
+        while (inFlight[host] >= FLAGS_gorilla_put_window) {
+          eb->loopOnce();
+        }
+
+        inFlight[host]++;
+        pending++;
+        int numPoints = request.second.data.size();
+        Timer timer(true);
+        client->performPut(host, std::move(request.second), eb)
+            .then([this, &inFlight, &pending, host, numPoints, timer, client](
+                      std::vector<DataPoint> dropped) {
+              inFlight[host]--;
+              pending--;
+              const std::string service = client->getServiceName();
+              GorillaStatsManager::addStatValue(
+                  kUsPerPut + service, timer.get());
+              GorillaStatsManager::addStatValue(
+                  kPutKey + service, numPoints - dropped.size());
+              if (!dropped.empty()) {
+                queueRetry(client, std::move(dropped));
+              }
+            });
+      }
+
+      if (droppedDataPoints.size() > 0) {
+        queueRetry(client, std::move(droppedDataPoints));
+      }
+
+      size_t queueSize = writeClient->queue.size();
+      GorillaStatsManager::addStatValue(kQueueSizeKey + service, queueSize);
+
+      // Wait for a bit if there isn't much in the queue, but keep
+      // handling the responses meanwhile.
+      handleResponses(
+          queueSize < FLAGS_gorilla_min_queue_size
+              ? FLAGS_gorilla_sleep_per_put_us
+              : 0);
+    } catch (std::exception& e) {
+      LOG(ERROR) << e.what();
+    }
+  }
+
+  // Wait for the responses to everything that was sent.
+  while (pending > 0) {
+    eb->loopOnce();
+  }
+}
+
 std::vector<std::string> BeringeiClientImpl::selectReadServices() {
   return configurationAdapter_->getReadServices();
 }
@@ -797,7 +1542,7 @@ void BeringeiClientImpl::retryThread() {
     try {
       BeringeiNetworkClient::PutRequestMap requestMap;
       RetryOperation op;
-      retryQueue_.blockingRead(op);
+      retryQueue_.pop(op);
       numRetryQueuedDataPoints_ -= op.dataPoints.size();
       GorillaStatsManager::addStatValue(
           kRetryQueueSizeKey, numRetryQueuedDataPoints_);
@@ -813,27 +1558,35 @@ void BeringeiClientImpl::retryThread() {
         continue;
       }
 
-      if (op.retryTimeSecs > time(nullptr)) {
-        // Sleeping is fine because it's a FIFO queue with a constant delay.
-        sleep(op.retryTimeSecs - time(nullptr));
-      }
-
-      // Build the request.
-      uint32_t totalDropped = 0;
+      // Build the request. The points of hosts that are still down are
+      // kept back without sending them.
+      std::vector<DataPoint> droppedDataPoints;
       for (auto& dp : op.dataPoints) {
         bool dropped = false;
         op.client->addDataPointToRequest(dp, requestMap, dropped);
         if (dropped) {
-          totalDropped++;
+          droppedDataPoints.push_back(std::move(dp));
         }
       }
 
       // Send the data points.
       std::vector<DataPoint> dropped = putWithStats(
-          op.client, op.dataPoints.size() - totalDropped, requestMap);
-      totalDropped += dropped.size();
-      if (totalDropped > 0) {
-        logDroppedDataPoints(op.client, totalDropped, "retry send failed");
+          op.client,
+          op.dataPoints.size() - droppedDataPoints.size(),
+          requestMap);
+      droppedDataPoints.insert(
+          droppedDataPoints.end(),
+          std::make_move_iterator(dropped.begin()),
+          std::make_move_iterator(dropped.end()));
+      if (droppedDataPoints.empty()) {
+        continue;
+      }
+
+      if (op.attempt + 1 < FLAGS_gorilla_retry_max_attempts) {
+        queueRetry(op.client, std::move(droppedDataPoints), op.attempt + 1);
+      } else {
+        logDroppedDataPoints(
+            op.client, droppedDataPoints.size(), "retry send failed");
       }
 
     } catch (std::exception& e) {
@@ -936,6 +1689,61 @@ int64_t BeringeiClientImpl::getNumShardsFromWriteClient() {
   return writeClients_[0]->client->getNumShards();
 }
 
+bool BeringeiClientImpl::backfill(
+    const std::vector<BackfillData>& data,
+    int64_t& added,
+    int64_t& dropped) {
+  bool success = true;
+  for (auto& writeClient : writeClients_) {
+    std::vector<BackfillData> remaining = data;
+    for (int attempt = 0; attempt < 2 && !remaining.empty(); attempt++) {
+      remaining =
+          writeClient->client->performBackfill(remaining, added, dropped);
+    }
+
+    if (!remaining.empty()) {
+      LOG(ERROR) << remaining.size() << " keys weren't backfilled to "
+                 << writeClient->client->getServiceName();
+      success = false;
+    }
+  }
+  return success;
+}
+
+bool BeringeiClientImpl::aggregate(
+    const AggregateRequest& request,
+    std::vector<TimeValuePair>& out) {
+  out.clear();
+  AggregationType type;
+  if (!Aggregation::isValid(request.aggregation, request.begin, request.end) ||
+      !Aggregation::fromThrift(request.aggregation.crossKeyFunction, type)) {
+    LOG(ERROR) << "An aggregate request needs a step and a cross key "
+               << "function";
+    return false;
+  }
+
+  auto readClientCopy = getReadClientCopy();
+  if (!readClientCopy) {
+    return false;
+  }
+
+  uint64_t traceId = Tracing::sample();
+  int64_t startUs = traceId ? Tracing::nowUs() : 0;
+  Tracing::TraceScope trace(traceId);
+
+  std::vector<AggregateResult> results;
+  bool complete = readClientCopy->performAggregate(request, results);
+
+  Tracing::SpanScope span("client_merge");
+  PartialAggregate partial(type);
+  for (const auto& result : results) {
+    partial.merge(result.values, result.counts);
+  }
+  partial.finish(request.begin, request.aggregation.step, out);
+  Tracing::record(traceId, "client_aggregate", startUs);
+  return complete;
+}
+
 void BeringeiClientImpl::scanShard(
     const ScanShardRequest& request,
     ScanShardResult& result) {
@@ -960,19 +1768,28 @@ folly::Future<BeringeiScanShardResult> BeringeiClientImpl::futureScanShard(
   context->resultCollector = std::make_unique<BeringeiScanShardResultCollector>(
       context->readClients.size(), request);
 
+  Tracing::TraceScope trace(context->traceId);
   for (const auto& client : folly::enumerate(context->readClients)) {
     std::pair<std::string, int> hostInfo;
     if ((*client)->getHostForScanShard(request, hostInfo)) {
+      // Chunks of a paginated scan are merged as they arrive.
       futureContextAddFn(
           *context,
           workExecutor,
-          (*client)->performScanShard(hostInfo, request, eb),
-          [context, clientId = client.index](ScanShardResult&& result) {
-            if (context->resultCollector->addResult(
-                    std::move(result), clientId)) {
-              context->oneComplete.setValue();
-            }
-          });
+          (*client)->performScanShardChunks(
+              hostInfo,
+              request,
+              eb,
+              workExecutor,
+              [context, clientId = client.index](ScanShardResult&& result) {
+                Tracing::SpanScope span(
+                    "client_merge", context->request.shardId);
+                if (context->resultCollector->addResult(
+                        std::move(result), clientId)) {
+                  context->oneComplete.setValue();
+                }
+              }),
+          []() {});
     }
   }
 
@@ -980,8 +1797,20 @@ folly::Future<BeringeiScanShardResult> BeringeiClientImpl::futureScanShard(
       *context,
       [context, shouldThrow = throwExceptionOnTransientFailure_](
           std::pair<unsigned long, folly::Try<folly::Unit>>&&) {
-        return context->resultCollector->finalize(
+        int64_t decodeUs = context->traceId ? Tracing::nowUs() : 0;
+        auto result = context->resultCollector->finalize(
             shouldThrow, context->clientNames);
+        Tracing::record(
+            context->traceId,
+            "client_decode",
+            decodeUs,
+            context->request.shardId);
+        Tracing::record(
+            context->traceId,
+            "client_scan_shard",
+            context->startUs,
+            context->request.shardId);
+        return result;
       });
 }
 
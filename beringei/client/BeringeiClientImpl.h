@@ -21,7 +21,14 @@
 #include "beringei/client/BeringeiGetResult.h"
 #include "beringei/client/BeringeiNetworkClient.h"
 #include "beringei/client/BeringeiScanShardResult.h"
+#include "beringei/client/BlockCache.h"
+#include "beringei/client/DelayQueue.h"
+#include "beringei/client/KeyRegistry.h"
+#include "beringei/client/PointAggregator.h"
+#include "beringei/client/PointSpool.h"
+#include "beringei/client/ReadLatencyTracker.h"
 #include "beringei/client/RequestBatchingQueue.h"
+#include "beringei/client/ShardBatchingQueue.h"
 
 namespace facebook {
 namespace fb303 {
@@ -63,6 +70,28 @@ class BeringeiClientImpl {
   // was definitely dropped.
   virtual bool putDataPoints(std::vector<DataPoint>& values);
 
+  // Returns a handle for a key that is written often. The handle can be
+  // used with putRegisteredDataPoints() for the lifetime of the client.
+  KeyHandle registerKey(const Key& key) {
+    return keyRegistry_.registerKey(key);
+  }
+
+  // Same as putDataPoints() for points of registered keys. Points with
+  // invalid handles are dropped.
+  bool putRegisteredDataPoints(const std::vector<RegisteredDataPoint>& values);
+
+  // Writes pre-encoded blocks of past data points, e.g., from
+  // TimeSeries::writeValues(), straight into the finalized buckets of
+  // every write service, bypassing the queues. The entries that weren't
+  // written are sent once more after looking up their shards again.
+  // Returns false if some of them still weren't written to one of the
+  // services. Adds the points written and dropped to `added` and
+  // `dropped`.
+  bool backfill(
+      const std::vector<BackfillData>& data,
+      int64_t& added,
+      int64_t& dropped);
+
   // @see BeringeiNetworkClient
   void getLastUpdateTimes(
       uint32_t minLastUpdateTime,
@@ -72,6 +101,7 @@ class BeringeiClientImpl {
 
   // Get compressed data points from Gorilla.
   // If set, serviceOverride bypasses the gorilla_read_services property.
+  // None of the get functions take a cross key function, see aggregate().
   virtual void get(
       GetDataRequest& request,
       GetDataResult& result,
@@ -90,11 +120,29 @@ class BeringeiClientImpl {
       GetDataRequest& request,
       const std::string& serviceOverride = "");
 
+  // Same as above, but fills `reuse`, the result of an earlier query,
+  // keeping the memory of its point vectors.
+  BeringeiGetResult get(
+      GetDataRequest& request,
+      BeringeiGetResult&& reuse,
+      const std::string& serviceOverride = "");
+
+  // A non-empty `reuse` is filled as with get() above.
   folly::Future<BeringeiGetResult> futureGet(
       GetDataRequest& request,
       folly::EventBase* eb,
       folly::Executor* workExecutor = folly::getCPUExecutor().get(),
-      const std::string& serviceOverride = "");
+      const std::string& serviceOverride = "",
+      BeringeiGetResult reuse = BeringeiGetResult());
+
+  // Reduces the keys of the request and the keys that start with its
+  // prefix into one series on the hosts that own them, and merges the
+  // results of the hosts into `out`, one point per window with values.
+  // Only one value per window and host is sent back instead of the data
+  // of every key. Returns false if `out` is missing some of the keys.
+  bool aggregate(
+      const AggregateRequest& request,
+      std::vector<TimeValuePair>& out);
 
   // Returns true if reading from gorilla is enabled, false otherwise.
   bool isReadingEnabled() {
@@ -126,6 +174,11 @@ class BeringeiClientImpl {
 
   void flushQueue();
 
+  // Number of data points waiting to be retried after a failed put.
+  int getNumRetryQueuedDataPoints() const {
+    return numRetryQueuedDataPoints_;
+  }
+
   virtual std::shared_ptr<BeringeiNetworkClient> createNetworkClient(
       const std::string& serviceName,
       std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter,
@@ -141,18 +194,30 @@ class BeringeiClientImpl {
         std::unique_ptr<BeringeiNetworkClient> networkClient,
         size_t queueCapacity,
         size_t queueSize)
-        : queue(queueCapacity, queueSize), client(std::move(networkClient)) {}
+        : queue(queueCapacity, queueSize),
+          queueCapacity(queueCapacity),
+          client(std::move(networkClient)) {}
     WriteClient(
         BeringeiNetworkClient* networkClient,
         size_t queueCapacity,
         size_t queueSize)
-        : queue(queueCapacity, queueSize), client(networkClient) {}
+        : queue(queueCapacity, queueSize),
+          queueCapacity(queueCapacity),
+          client(networkClient) {}
 
     size_t getNumShards() const {
       return client->getNumShards();
     }
 
     RequestBatchingQueue queue;
+    const size_t queueCapacity;
+
+    // Used instead of `queue` with --gorilla_shard_batching.
+    std::unique_ptr<ShardBatchingQueue> shardQueue;
+
+    // Keeps the points that don't fit in the queue or in the retry queue
+    // with --gorilla_client_spool_dir.
+    std::unique_ptr<PointSpool> spool;
     std::unique_ptr<BeringeiNetworkClient> client;
   };
 
@@ -224,8 +289,46 @@ class BeringeiClientImpl {
       std::vector<Key>* partialDataKeys);
 
   // Send data until reading an empty request.
+  // Queues the points for every write service. Gives them back if none
+  // of the queues took them.
+  bool enqueue(std::vector<DataPoint>& values);
+
+  // Flushes the windows of --gorilla_client_aggregation that are over
+  // every second.
+  void startAggregation();
+
+  // Queues the aggregated windows that are over, or all of them.
+  void flushAggregatedPoints(bool all);
+
+  // Creates the spools of --gorilla_client_spool_dir and drains them
+  // every second.
+  void startSpool();
+
+  // Moves spooled points to the queues that have room, unless puts are
+  // failing.
+  void drainSpool();
+
+  // Returns false if the points couldn't be spooled for the service.
+  bool spool(BeringeiNetworkClient* client, std::vector<DataPoint>& points);
+
   void writeDataPointsForever(WriteClient* writeClient);
 
+  // Same as writeDataPointsForever() but keeps popping and sending
+  // batches while up to --gorilla_put_window requests to each host are
+  // waiting for their responses.
+  void writeDataPointsPipelined(WriteClient* writeClient);
+
+  // Same as writeDataPointsForever() for clients with a shardQueue.
+  // Sends batches as they become ready and reuses their buffers.
+  void writeShardBatchesForever(WriteClient* writeClient);
+
+  // Queues points that failed to be sent for the retry threads. The
+  // delay grows with `attempt`, which counts the previous retries.
+  void queueRetry(
+      BeringeiNetworkClient* client,
+      std::vector<DataPoint>&& dataPoints,
+      int attempt = 0);
+
   std::vector<std::string> selectReadServices();
 
   void updateReadServices();
@@ -258,6 +361,19 @@ class BeringeiClientImpl {
 
   std::vector<std::thread> writers_;
 
+  // Shared with the hedged reads that are still waiting to be sent.
+  std::shared_ptr<ReadLatencyTracker> readLatency_ =
+      std::make_shared<ReadLatencyTracker>();
+
+  // Null unless --gorilla_client_block_cache_mb is set.
+  std::shared_ptr<BlockCache> blockCache_;
+
+  // Used with --gorilla_client_aggregation.
+  std::unique_ptr<PointAggregator> aggregator_;
+  folly::FunctionScheduler aggregationScheduler_;
+
+  folly::FunctionScheduler spoolScheduler_;
+
   std::vector<std::string> currentReadServices_;
   folly::FunctionScheduler readServicesUpdateScheduler_;
   folly::RWSpinLock readClientLock_;
@@ -266,10 +382,13 @@ class BeringeiClientImpl {
     BeringeiNetworkClient* client;
     std::vector<DataPoint> dataPoints;
     uint32_t retryTimeSecs;
+    int attempt = 0;
   };
 
+  KeyRegistry keyRegistry_;
+
   bool throwExceptionOnTransientFailure_;
-  folly::MPMCQueue<RetryOperation> retryQueue_;
+  DelayQueue<RetryOperation> retryQueue_;
   std::atomic<int> numRetryQueuedDataPoints_;
   std::vector<std::thread> retryWriters_;
 };
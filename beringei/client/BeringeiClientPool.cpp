@@ -0,0 +1,189 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/BeringeiClientPool.h"
+
+#include <folly/SocketAddress.h>
+#include <thrift/lib/cpp/async/TAsyncSocket.h>
+#include <thrift/lib/cpp/transport/THeader.h>
+
+#include "beringei/lib/GorillaStatsManager.h"
+
+DEFINE_int32(
+    gorilla_client_idle_timeout_secs,
+    60,
+    "Pooled connections to Beringei hosts are closed after this long "
+    "without requests");
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kConnectionsCreated =
+    "gorilla_network_client.connections_created";
+static const std::string kConnectionsReplaced =
+    "gorilla_network_client.bad_connections_replaced";
+static const std::string kCompressedConnectionsCreated =
+    "gorilla_network_client.compressed_connections_created";
+static const std::string kCompressedBytesReceived =
+    "gorilla_network_client.compressed_bytes_received";
+
+class BeringeiClientPool::DropOnDestruction
+    : public folly::EventBase::LoopCallback {
+ public:
+  DropOnDestruction(std::weak_ptr<Pools> pools, folly::EventBase* eb)
+      : pools_(std::move(pools)), eb_(eb) {}
+
+  void runLoopCallback() noexcept override {
+    auto pools = pools_.lock();
+    if (pools) {
+      // Destroyed outside of the lock, still in the thread of `eb_`.
+      Connections connections;
+      {
+        std::lock_guard<std::mutex> guard(pools->mutex);
+        auto it = pools->pools.find(eb_);
+        if (it != pools->pools.end()) {
+          connections.swap(it->second.connections);
+          pools->pools.erase(it);
+        }
+      }
+    }
+    delete this;
+  }
+
+ private:
+  std::weak_ptr<Pools> pools_;
+  folly::EventBase* eb_;
+};
+
+BeringeiClientPool::BeringeiClientPool() : pools_(std::make_shared<Pools>()) {
+  GorillaStatsManager::addStatExportType(kConnectionsCreated, SUM);
+  GorillaStatsManager::addStatExportType(kConnectionsReplaced, SUM);
+  GorillaStatsManager::addStatExportType(kCompressedConnectionsCreated, SUM);
+  GorillaStatsManager::addStatExportType(kCompressedBytesReceived, SUM);
+}
+
+BeringeiClientPool::~BeringeiClientPool() {
+  std::lock_guard<std::mutex> guard(pools_->mutex);
+  for (auto& pool : pools_->pools) {
+    if (pool.first->isInEventBaseThread()) {
+      continue;
+    }
+
+    // The EventBase is still alive because its DropOnDestruction
+    // callback hasn't erased it yet.
+    auto connections =
+        std::make_shared<Connections>(std::move(pool.second.connections));
+    pool.first->runInEventBaseThread(
+        [connections]() mutable { connections.reset(); });
+  }
+  pools_->pools.clear();
+}
+
+std::shared_ptr<BeringeiServiceAsyncClient> BeringeiClientPool::newClient(
+    const std::pair<std::string, int>& hostInfo,
+    folly::EventBase* eb,
+    uint32_t timeoutMs,
+    uint32_t compressionMinBytes,
+    apache::thrift::HeaderClientChannel** channel) {
+  folly::SocketAddress address(hostInfo.first, hostInfo.second, true);
+  auto socket = apache::thrift::async::TAsyncSocket::newSocket(eb, address);
+  auto headerChannel =
+      apache::thrift::HeaderClientChannel::newChannel(std::move(socket));
+  headerChannel->setTimeout(timeoutMs);
+  if (compressionMinBytes > 0) {
+    // Hosts with --transport_compression_min_bytes compress their large
+    // responses with the transform of the request.
+    headerChannel->setTransform(
+        apache::thrift::transport::THeader::ZSTD_TRANSFORM);
+    headerChannel->setMinCompressBytes(compressionMinBytes);
+    GorillaStatsManager::addStatValue(kCompressedConnectionsCreated);
+  }
+  if (channel) {
+    *channel = headerChannel.get();
+  }
+  GorillaStatsManager::addStatValue(kConnectionsCreated);
+  return std::make_shared<BeringeiServiceAsyncClient>(
+      std::move(headerChannel));
+}
+
+std::shared_ptr<BeringeiServiceAsyncClient> BeringeiClientPool::getClient(
+    const std::pair<std::string, int>& hostInfo,
+    folly::EventBase* eb,
+    uint32_t timeoutMs,
+    uint32_t compressionMinBytes) {
+  time_t now = time(nullptr);
+
+  // Bad and idle connections are destroyed after releasing the lock.
+  std::vector<std::shared_ptr<BeringeiServiceAsyncClient>> dropped;
+  {
+    std::lock_guard<std::mutex> guard(pools_->mutex);
+    auto it = pools_->pools.find(eb);
+    if (it == pools_->pools.end()) {
+      it = pools_->pools.emplace(eb, EventBaseConnections()).first;
+      it->second.lastEviction = now;
+      eb->runOnDestruction(new DropOnDestruction(pools_, eb));
+    }
+    auto& pool = it->second;
+
+    // Look for idle connections at most once a second.
+    if (now > pool.lastEviction) {
+      pool.lastEviction = now;
+      for (auto conn = pool.connections.begin();
+           conn != pool.connections.end();) {
+        if (now - conn->second.lastUsed >
+            FLAGS_gorilla_client_idle_timeout_secs) {
+          dropped.push_back(std::move(conn->second.client));
+          conn = pool.connections.erase(conn);
+        } else {
+          ++conn;
+        }
+      }
+    }
+
+    auto conn = pool.connections.find(hostInfo);
+    if (conn != pool.connections.end()) {
+      bool good = conn->second.channel->good();
+      if (good && conn->second.compressionMinBytes == compressionMinBytes) {
+        conn->second.lastUsed = now;
+        auto transport = conn->second.channel->getTransport();
+        if (compressionMinBytes > 0 && transport) {
+          // Compare with the compressible bytes that the callers count
+          // to see how much compression saves.
+          size_t received = transport->getRawBytesReceived();
+          GorillaStatsManager::addStatValue(
+              kCompressedBytesReceived,
+              (int64_t)(received - conn->second.bytesReceived));
+          conn->second.bytesReceived = received;
+        }
+        return conn->second.client;
+      }
+
+      if (!good) {
+        GorillaStatsManager::addStatValue(kConnectionsReplaced);
+      }
+      dropped.push_back(std::move(conn->second.client));
+      pool.connections.erase(conn);
+    }
+  }
+
+  // Resolving the host can block, so it's done without the lock. Only
+  // the thread of `eb` adds connections for it.
+  Connection connection;
+  connection.client = newClient(
+      hostInfo, eb, timeoutMs, compressionMinBytes, &connection.channel);
+  connection.lastUsed = now;
+  connection.compressionMinBytes = compressionMinBytes;
+  connection.bytesReceived = 0;
+
+  std::lock_guard<std::mutex> guard(pools_->mutex);
+  pools_->pools[eb].connections[hostInfo] = connection;
+  return connection.client;
+}
+}
+} // facebook::gorilla
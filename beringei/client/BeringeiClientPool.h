@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <folly/hash/Hash.h>
+#include <folly/io/async/EventBase.h>
+#include <thrift/lib/cpp2/async/HeaderClientChannel.h>
+
+#include "beringei/if/gen-cpp2/BeringeiService.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class BeringeiClientPool
+//
+// Keeps one long lived client per host for each EventBase, so that
+// requests to a host share a connection instead of opening a new one
+// each time. A client is replaced once its connection goes bad or its
+// compression changes and dropped after
+// --gorilla_client_idle_timeout_secs without requests.
+// Clients are only handed out and destroyed in the thread of their
+// EventBase, and the clients of an EventBase are dropped when it is
+// destroyed.
+class BeringeiClientPool {
+ public:
+  BeringeiClientPool();
+  ~BeringeiClientPool();
+
+  // Returns the pooled client of `hostInfo` for `eb`, connecting a new
+  // one if there is none or its connection is bad. Must be called in
+  // the thread of `eb`.
+  std::shared_ptr<BeringeiServiceAsyncClient> getClient(
+      const std::pair<std::string, int>& hostInfo,
+      folly::EventBase* eb,
+      uint32_t timeoutMs,
+      uint32_t compressionMinBytes = 0);
+
+  // Connects a client that isn't pooled. Requests of at least
+  // `compressionMinBytes` are compressed with zstd, which also asks the
+  // host to compress its large responses. 0 disables compression. Sets
+  // `channel` to its channel if not null.
+  static std::shared_ptr<BeringeiServiceAsyncClient> newClient(
+      const std::pair<std::string, int>& hostInfo,
+      folly::EventBase* eb,
+      uint32_t timeoutMs,
+      uint32_t compressionMinBytes = 0,
+      apache::thrift::HeaderClientChannel** channel = nullptr);
+
+ private:
+  struct Connection {
+    std::shared_ptr<BeringeiServiceAsyncClient> client;
+
+    // Owned by `client`.
+    apache::thrift::HeaderClientChannel* channel;
+    time_t lastUsed;
+    uint32_t compressionMinBytes;
+
+    // Bytes received on the connection when it was last handed out.
+    size_t bytesReceived;
+  };
+
+  typedef std::unordered_map<std::pair<std::string, int>, Connection>
+      Connections;
+
+  struct EventBaseConnections {
+    Connections connections;
+    time_t lastEviction;
+  };
+
+  struct Pools {
+    std::mutex mutex;
+    std::unordered_map<folly::EventBase*, EventBaseConnections> pools;
+  };
+
+  // Drops the connections of an EventBase when it is destroyed.
+  class DropOnDestruction;
+
+  // Shared with the DropOnDestruction callbacks, which can outlive
+  // the pool.
+  std::shared_ptr<Pools> pools_;
+};
+}
+} // facebook::gorilla
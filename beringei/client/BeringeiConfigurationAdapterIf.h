@@ -10,15 +10,21 @@
 #pragma once
 
 #include <folly/Range.h>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace facebook {
 namespace gorilla {
 
 class BeringeiConfigurationAdapterIf {
  public:
+  // The seed that clients pass to getShardForKey() to assign keys to
+  // shards, so that writers and readers agree on the shard of a key.
+  static constexpr uint64_t kClientShardSeed = 0;
+
   virtual ~BeringeiConfigurationAdapterIf() {}
 
   // Return the total number of shards.
@@ -38,6 +44,23 @@ class BeringeiConfigurationAdapterIf {
       const std::string& serviceName,
       std::set<int64_t>& shardList) = 0;
 
+  // Return the hosts that keep read replicas of the shard, as pairs of
+  // <hostname, port>. Empty if the shard has no followers.
+  virtual void getFollowersForShardId(
+      int /* shardId */,
+      const std::string& /* serviceName */,
+      std::vector<std::pair<std::string, int>>& followers) {
+    followers.clear();
+  }
+
+  // Return the list of shards a particular beringei host follows.
+  virtual void getFollowedShardsForHost(
+      const std::pair<std::string, int>& /* hostInfo */,
+      const std::string& /* serviceName */,
+      std::set<int64_t>& shardList) {
+    shardList.clear();
+  }
+
   // Return a shard ID given a key and a total number of shards.
   // This is used internally by Beringei, in particular for sub-sharding the
   // scanShard() thrift call.
@@ -77,6 +100,32 @@ class BeringeiConfigurationAdapterIf {
   // Return whether the service name is a valid beringei service. Checks
   // against a static list.
   virtual bool isValidReadService(const std::string& serviceName) = 0;
+
+  // Requests to and responses from the hosts of the service of at least
+  // this many bytes are compressed by the transport, e.g. for services
+  // in other regions. 0 disables it.
+  virtual uint32_t getTransportCompressionMinBytes(
+      const std::string& /* serviceName */) {
+    return 0;
+  }
+
+  // Called with a service and the shards of it that moved to another
+  // host or went away.
+  using ShardsChangedCallback = std::function<void(
+      const std::string& serviceName,
+      const std::vector<int64_t>& shardIds)>;
+
+  // Calls the callback each time shards move, until the returned id is
+  // passed to unsubscribeFromShardChanges(). Returns 0 if the adapter
+  // doesn't know when shards move, in which case callers have to rely
+  // on expiring what they cached.
+  virtual int64_t subscribeToShardChanges(ShardsChangedCallback /* cb */) {
+    return 0;
+  }
+
+  // The callback isn't called anymore once this returns. Must not be
+  // called from the callback.
+  virtual void unsubscribeFromShardChanges(int64_t /* id */) {}
 };
 }
 } // facebook::gorilla
@@ -10,6 +10,7 @@
 #include "beringei/client/BeringeiGetResult.h"
 
 #include <algorithm>
+#include <thread>
 #include <vector>
 
 #include <folly/container/Enumerate.h>
@@ -41,6 +42,16 @@ namespace facebook {
 namespace gorilla {
 
 static const std::string kMismatchesKey = "gorilla_client.mismatches";
+static const std::string kReusedResultsKey = "gorilla_client.reused_results";
+
+void BeringeiGetResult::reset(size_t size) {
+  results.resize(size);
+  for (auto& points : results) {
+    points.clear();
+  }
+  allSuccess = false;
+  stats = BeringeiGetStats();
+}
 
 BeringeiGetResultCollector::BeringeiGetResultCollector(
     size_t size,
@@ -52,8 +63,11 @@ BeringeiGetResultCollector::BeringeiGetResultCollector(
       numServices_(services),
       remainingKeys_(size),
       complete_(size),
+      answers_(size * services),
+      answered_(0),
       drops_(1ull << services),
       mismatches_(1ull << services),
+      adding_(0),
       done_(false),
       result_(size) {
   // This would require an insane amount of memory anyway, but at least make
@@ -61,20 +75,42 @@ BeringeiGetResultCollector::BeringeiGetResultCollector(
   CHECK_LT(numServices_, 32);
 }
 
+void BeringeiGetResultCollector::reuse(BeringeiGetResult&& result) {
+  result_ = std::move(result);
+  result_.reset(complete_.size());
+  GorillaStatsManager::addStatValue(kReusedResultsKey, 1, SUM);
+}
+
 bool BeringeiGetResultCollector::addResults(
     const GetDataResult& results,
     const std::vector<size_t>& indices,
     size_t serviceId) {
+  GetDataResult copy = results;
+  return addResults(std::move(copy), indices, serviceId);
+}
+
+bool BeringeiGetResultCollector::addResults(
+    GetDataResult&& results,
+    const std::vector<size_t>& indices,
+    size_t serviceId) {
   bool ret = false;
 
-  lock_.lock();
+  // finalize() waits for the calls that got past this point.
+  adding_++;
   if (done_) {
-    lock_.unlock();
+    adding_--;
     return false;
   }
 
+  answered_ |= 1u << serviceId;
   for (auto result : folly::enumerate(results.results)) {
     size_t i = indices[result.index];
+    Answer& answer = answers_[i * numServices_ + serviceId];
+    if (answer.answered) {
+      continue;
+    }
+
+    KeyStats& stats = complete_[i];
     switch (result->status) {
       case StatusCode::OK:
       case StatusCode::MISSING_TOO_MUCH_DATA:
@@ -82,9 +118,9 @@ bool BeringeiGetResultCollector::addResults(
         // We can't count MISSING_TOO_MUCH_DATA as an incomplete result
         // because it's not a transient failure. We don't want to fail the query
         // completely if all replicas are missing data at different time points.
-        merge(i, serviceId, *result);
-        complete_[i].received.set(serviceId);
-        ret |= ++complete_[i].count == 1 && --remainingKeys_ == 0;
+        answer.blocks = std::move(result->data);
+        stats.received |= 1u << serviceId;
+        ret |= stats.count++ == 0 && --remainingKeys_ == 0;
         break;
       case StatusCode::DONT_OWN_SHARD:
         // While in theory we would want to invalidate the shard map cache and
@@ -95,14 +131,14 @@ bool BeringeiGetResultCollector::addResults(
         break;
       case StatusCode::KEY_MISSING:
         // We successfully found that there was no data.
-        complete_[i].received.set(serviceId);
-        ret |= ++complete_[i].count == 1 && --remainingKeys_ == 0;
+        stats.received |= 1u << serviceId;
+        ret |= stats.count++ == 0 && --remainingKeys_ == 0;
         break;
       case StatusCode::SHARD_IN_PROGRESS:
         // Include the data in the results, but don't count it as a complete
         // copy.
-        merge(i, serviceId, *result);
-        complete_[i].received.set(serviceId);
+        answer.blocks = std::move(result->data);
+        stats.received |= 1u << serviceId;
         break;
       case StatusCode::RPC_FAIL:
       case StatusCode::BUCKET_NOT_FINALIZED:
@@ -113,27 +149,43 @@ bool BeringeiGetResultCollector::addResults(
                           result->status);
         break;
     }
+
+    answer.status = result->status;
+    answer.answered = true;
+    if (++stats.answers == numServices_) {
+      mergeKey(i);
+    }
   }
-  lock_.unlock();
+
+  adding_--;
   return ret;
 }
 
 BeringeiGetResult BeringeiGetResultCollector::finalize(
     bool validate,
-    const std::vector<std::string>& serviceNames) {
+    const std::vector<std::string>& serviceNames,
+    bool onlyAnsweredServices) {
   // From here on out, future calls to addResults() will do nothing.
-  lock_.lock();
   done_ = true;
-  lock_.unlock();
+  while (adding_ > 0) {
+    std::this_thread::yield();
+  }
+
+  // Merge the keys that didn't get an answer from every service.
+  for (size_t i = 0; i < complete_.size(); i++) {
+    if (complete_[i].answers < numServices_) {
+      mergeKey(i);
+    }
+  }
 
   CHECK_EQ(serviceNames.size(), numServices_);
 
   uint32_t min = numServices_;
   std::vector<int> resultSets(1ull << numServices_);
 
-  for (auto c : complete_) {
-    min = std::min(min, c.count);
-    resultSets[c.received.to_ulong()]++;
+  for (const auto& c : complete_) {
+    min = std::min(min, c.count.load());
+    resultSets[c.received]++;
   }
 
   std::vector<int> drops(numServices_);
@@ -152,6 +204,10 @@ BeringeiGetResult BeringeiGetResultCollector::finalize(
 
   BeringeiGetStats& stats = result_.stats;
   for (size_t i = 0; i < numServices_; i++) {
+    if (onlyAnsweredServices && !(answered_ & (1u << i))) {
+      continue;
+    }
+
     if (drops[i] > 0) {
       GorillaStatsManager::addStatValue(
           "gorilla_client.missing_points." + serviceNames[i], drops[i], SUM);
@@ -166,7 +222,8 @@ BeringeiGetResult BeringeiGetResultCollector::finalize(
           "gorilla_client.failed_keys." + serviceNames[i], 1, COUNT);
     }
 
-    stats.mismatches = std::max(stats.mismatches, mismatches_[1ull << i]);
+    stats.mismatches =
+        std::max<int64_t>(stats.mismatches, mismatches_[1ull << i]);
     stats.missingPoints = std::max<int64_t>(stats.missingPoints, drops[i]);
     stats.failedKeys = std::max<int64_t>(stats.failedKeys, missings[i]);
   }
@@ -187,10 +244,11 @@ BeringeiGetResult BeringeiGetResultCollector::finalize(
   GorillaStatsManager::addStatValue("gorilla_client.num_queries", 1, SUM);
 
   result_.stats.memoryEstimate = sizeof(this) + vectorMemory(result_.results) +
-      vectorMemory(complete_) + vectorMemory(drops_);
+      vectorMemory(complete_) + vectorMemory(answers_) + vectorMemory(drops_);
 
   std::vector<KeyStats>().swap(complete_);
-  std::vector<int>().swap(drops_);
+  std::vector<Answer>().swap(answers_);
+  std::vector<std::atomic<int>>().swap(drops_);
 
   // Call the query successful if we got results from half the services.
   result_.allSuccess = min > 0;
@@ -201,36 +259,78 @@ BeringeiGetResult BeringeiGetResultCollector::finalize(
   return std::move(result_);
 }
 
-void BeringeiGetResultCollector::merge(
-    size_t i,
-    size_t service,
-    const TimeSeriesData& result) {
-  int64_t inSize = 0;
-  int64_t mismatches = 0;
-  const size_t oldSize = result_.results[i].size();
-
-  TimeSeries::mergeValues(
-      result.data,
-      result_.results[i],
-      beginTime_,
-      endTime_,
-      FLAGS_mintimestampdelta,
-      FLAGS_gorilla_compare_reads,
-      FLAGS_gorilla_compare_epsilon,
-      &inSize,
-      &mismatches);
-
-  // Count the un-matched data points.
-  // Missing in existing
-  drops_[complete_[i].received.to_ulong()] +=
-      (result_.results[i].size() - oldSize);
-  // Missing in current result
-  drops_[1ull << service] += (result_.results[i].size() - inSize);
-
-  if (complete_[i].count == 1) {
-    mismatches_[complete_[i].received.to_ulong()] += mismatches;
+void BeringeiGetResultCollector::mergeKey(size_t i) {
+  // Merged in the order of the services, whatever order they answered
+  // in. For each merged service, `received` has the services before it
+  // and `complete` is how many of them had complete results.
+  struct Merged {
+    size_t service;
+    uint32_t received;
+    uint32_t complete;
+  };
+  std::vector<Merged> merged;
+  std::vector<const std::vector<TimeSeriesBlock>*> blocks;
+
+  uint32_t received = 0;
+  uint32_t complete = 0;
+  for (size_t service = 0; service < numServices_; service++) {
+    Answer& answer = answers_[i * numServices_ + service];
+    if (!answer.answered) {
+      continue;
+    }
+
+    switch (answer.status) {
+      case StatusCode::OK:
+      case StatusCode::MISSING_TOO_MUCH_DATA:
+        merged.push_back({service, received, complete});
+        blocks.push_back(&answer.blocks);
+        received |= 1u << service;
+        complete++;
+        break;
+      case StatusCode::KEY_MISSING:
+        received |= 1u << service;
+        complete++;
+        break;
+      case StatusCode::SHARD_IN_PROGRESS:
+        merged.push_back({service, received, complete});
+        blocks.push_back(&answer.blocks);
+        received |= 1u << service;
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (!blocks.empty()) {
+    std::vector<TimeSeries::MergeStats> stats;
+    TimeSeries::mergeValues(
+        blocks,
+        result_.results[i],
+        ranges_.empty() ? beginTime_ : ranges_[i].begin,
+        ranges_.empty() ? endTime_ : ranges_[i].end,
+        FLAGS_mintimestampdelta,
+        FLAGS_gorilla_compare_reads,
+        FLAGS_gorilla_compare_epsilon,
+        &stats);
+
+    for (size_t j = 0; j < merged.size(); j++) {
+      // Count the un-matched data points.
+      // Missing in existing
+      drops_[merged[j].received] += stats[j].added;
+      // Missing in current result
+      drops_[1ull << merged[j].service] += stats[j].missing;
+
+      if (merged[j].complete == 1) {
+        mismatches_[merged[j].received] += stats[j].mismatches;
+      }
+      mismatches_[1ull << merged[j].service] += stats[j].mismatches;
+    }
+  }
+
+  for (size_t service = 0; service < numServices_; service++) {
+    std::vector<TimeSeriesBlock>().swap(
+        answers_[i * numServices_ + service].blocks);
   }
-  mismatches_[1ull << service] += mismatches;
 }
 
 } // namespace gorilla
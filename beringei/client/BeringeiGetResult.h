@@ -9,10 +9,9 @@
 
 #pragma once
 
-#include <bitset>
+#include <atomic>
 #include <vector>
 
-#include <folly/fibers/TimedMutex.h>
 #include <folly/futures/Future.h>
 
 #include "beringei/client/BeringeiNetworkClient.h"
@@ -38,6 +37,10 @@ struct BeringeiGetStats {
 // Keys that were not found have empty result vectors.
 //
 // allSuccess is set to true if we were able to get a full copy of the results.
+//
+// A result can be passed back to the next query to keep the memory of its
+// point vectors, so that a client that runs the same queries over and over
+// doesn't allocate them again every time.
 struct BeringeiGetResult {
   BeringeiGetResult() : allSuccess(false) {}
   explicit BeringeiGetResult(size_t size) : results(size), allSuccess(false) {}
@@ -46,6 +49,10 @@ struct BeringeiGetResult {
   BeringeiGetResult(BeringeiGetResult&&) = default;
   BeringeiGetResult& operator=(BeringeiGetResult&&) = default;
 
+  // Empties the result for a query of `size` keys, keeping the capacity of
+  // the point vectors of the first `size` keys.
+  void reset(size_t size);
+
   std::vector<std::vector<TimeValuePair>> results;
   bool allSuccess;
   BeringeiGetStats stats;
@@ -54,6 +61,12 @@ struct BeringeiGetResult {
 // This class records results for a Beringei query as they arrive from multiple
 // replicas of the service, tracking how much data was lost from each replica.
 //
+// The results for a key are kept compressed until every service has
+// answered for it, and are then merged by the thread that added the last
+// one, so threads adding results for different keys don't wait for each
+// other. The keys that some services didn't answer for are merged by
+// `finalize()`.
+//
 // Note: to do this quickly, it uses memory exponential in the number of
 // replicas. As a typical setup is unlikely to have more than 3 replicas of the
 // data, this is probably fine.
@@ -65,6 +78,15 @@ class BeringeiGetResultCollector {
       int64_t begin,
       int64_t end);
 
+  // Sets the time range of each key, for requests with per key ranges.
+  void setRanges(const std::vector<TimeRange>& ranges) {
+    ranges_ = ranges;
+  }
+
+  // Fills `result` instead of a new result, reusing the memory of its
+  // point vectors. Must be called before any results are added.
+  void reuse(BeringeiGetResult&& result);
+
   // Insert data and return true if we just finished the first complete copy
   // of the results.
   bool addResults(
@@ -72,46 +94,77 @@ class BeringeiGetResultCollector {
       const std::vector<size_t>& indices,
       size_t service);
 
+  // Same as above, but moves the blocks instead of copying them.
+  bool addResults(
+      GetDataResult&& results,
+      const std::vector<size_t>& indices,
+      size_t service);
+
   // Finalize data, record stats, and extract the result structure.
   // Throws an exception on incomplete results if requested to do so.
   // After this point, further calls to `addResults()` will be ignored.
+  // With `onlyAnsweredServices`, the services that haven't answered yet,
+  // like the hedged reads that weren't needed, don't count as missing
+  // data in the stats.
   BeringeiGetResult finalize(
       bool validate,
-      const std::vector<std::string>& serviceNames);
+      const std::vector<std::string>& serviceNames,
+      bool onlyAnsweredServices = false);
 
   // Use in tests only.
-  const std::vector<int64_t>& getMismatchesForTesting() const {
-    return mismatches_;
+  std::vector<int64_t> getMismatchesForTesting() const {
+    return std::vector<int64_t>(mismatches_.begin(), mismatches_.end());
   }
 
  private:
-  // Add results.
-  void merge(size_t i, size_t service, const TimeSeriesData& result);
+  // Merges the results of all the services that answered for key `i`
+  // in one pass.
+  void mergeKey(size_t i);
 
   // Begin and end time for the query to remove extraneous data.
   int64_t beginTime_, endTime_;
 
+  // The time range of each key instead of the above if not empty.
+  std::vector<TimeRange> ranges_;
+
   // How many copies we're expecting for each key.
   size_t numServices_;
 
   // How many keys have no results.
-  size_t remainingKeys_;
+  std::atomic<size_t> remainingKeys_;
 
   // Which services have reported which keys.
   struct KeyStats {
-    uint32_t count;
-    std::bitset<32> received;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> received;
+
+    // How many services have answered, complete or not.
+    std::atomic<uint32_t> answers;
   };
   std::vector<KeyStats> complete_;
 
+  // The answer of one service for one key, at `key * numServices_ +
+  // service`. Only written by the thread adding the results of that
+  // service.
+  struct Answer {
+    bool answered = false;
+    StatusCode status;
+    std::vector<TimeSeriesBlock> blocks;
+  };
+  std::vector<Answer> answers_;
+
+  // Which services have answered at least once.
+  std::atomic<uint32_t> answered_;
+
   // How much data was missing from each service.
-  std::vector<int> drops_;
+  std::vector<std::atomic<int>> drops_;
 
   // Mismatches per each service's first merge, indexed by 1ull << service.
-  std::vector<int64_t> mismatches_;
+  std::vector<std::atomic<int64_t>> mismatches_;
 
-  folly::fibers::TimedMutex lock_;
-  bool done_;
+  // Calls to `addResults()` that haven't returned.
+  std::atomic<int> adding_;
+  std::atomic<bool> done_;
   BeringeiGetResult result_;
 };
 
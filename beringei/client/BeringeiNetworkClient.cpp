@@ -10,15 +10,17 @@
 #include "beringei/client/BeringeiNetworkClient.h"
 
 #include <atomic>
+#include <chrono>
 
 #include <folly/Conv.h>
-#include <folly/SocketAddress.h>
-#include <thrift/lib/cpp/async/TAsyncSocket.h>
 #include <thrift/lib/cpp2/async/HeaderClientChannel.h>
 
 #include "beringei/client/BeringeiConfigurationAdapterIf.h"
+#include "beringei/client/BeringeiScanShardResult.h"
+#include "beringei/lib/CaseUtils.h"
 #include "beringei/lib/GorillaStatsManager.h"
 #include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/Tracing.h"
 
 DEFINE_int32(
     gorilla_max_batch_size,
@@ -26,6 +28,48 @@ DEFINE_int32(
     "approximate max data points to send to one gorilla service");
 DEFINE_int32(gorilla_shard_cache_ttl, 5, "Shard cache TTL");
 DEFINE_int32(gorilla_negative_shard_cache_ttl, 5, "Negative shard cache TTL");
+DEFINE_bool(
+    gorilla_client_connection_pool,
+    true,
+    "Reuse connections to Beringei hosts instead of connecting for each "
+    "request");
+DEFINE_bool(
+    gorilla_client_key_ids,
+    false,
+    "Send puts with the ids that Beringei hosts return for keys instead of "
+    "the keys, once the ids are known");
+DEFINE_bool(
+    gorilla_client_encode_puts,
+    false,
+    "Send the points of keys that have many of them in a put request as one "
+    "encoded block per key");
+DEFINE_int32(
+    gorilla_client_encode_min_points,
+    2,
+    "Minimum number of points of a key in a put request to encode them");
+DEFINE_int32(
+    gorilla_client_max_key_ids,
+    1000000,
+    "Maximum number of key ids remembered for each Beringei host");
+DEFINE_int32(
+    gorilla_circuit_failure_threshold,
+    3,
+    "Number of put requests to a host that fail in a row before the host is "
+    "skipped for a while. 0 never skips hosts.");
+DEFINE_int32(
+    gorilla_circuit_backoff_ms,
+    1000,
+    "How long a host is skipped the first time its puts keep failing. "
+    "Doubles each time the host is skipped again.");
+DEFINE_int32(
+    gorilla_circuit_max_backoff_ms,
+    60000,
+    "Maximum time a host is skipped when its puts keep failing");
+DEFINE_bool(
+    gorilla_follower_reads,
+    false,
+    "Spread the reads of the keys of a shard over its owner and the hosts "
+    "that follow it");
 DEFINE_int32(
     gorilla_processing_timeout,
     0,
@@ -38,11 +82,33 @@ using std::vector;
 namespace facebook {
 namespace gorilla {
 
+static int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 static const std::string kStaleShardInfoUsed =
     "gorilla_network_client.stale_shard_info_used";
+static const std::string kShardsMoved = "gorilla_network_client.shards_moved";
+static const std::string kPutCircuitOpen =
+    "gorilla_network_client.put_circuit_open";
+static const std::string kPutOverloaded =
+    "gorilla_network_client.put_overloaded";
+
+// Data received in getData and scanShard responses from services with
+// transport compression, to compare with
+// gorilla_network_client.compressed_bytes_received.
+static const std::string kCompressibleBytesReceived =
+    "gorilla_network_client.compressible_bytes_received";
 
 static const int kDefaultThriftTimeoutMs = 2 * kGorillaMsPerSecond;
 
+// Picks the replica of a key with --gorilla_follower_reads. Differs from
+// the seed that assigns keys to shards, so that the keys of one shard are
+// spread over its replicas.
+static const uint64_t kReplicaSeed = 0x5EAD5EAD;
+
 const static int kSleepBetweenRetrySecs = 10;
 
 BeringeiNetworkClient::BeringeiNetworkClient(
@@ -52,13 +118,50 @@ BeringeiNetworkClient::BeringeiNetworkClient(
     : configurationAdapter_(configurationAdapter),
       serviceName_(serviceName),
       stopRequests_(false),
-      isShadow_(shadow) {
+      isShadow_(shadow),
+      keyIds_(FLAGS_gorilla_client_max_key_ids),
+      encoder_(FLAGS_gorilla_client_encode_min_points) {
+  if (FLAGS_gorilla_circuit_failure_threshold > 0) {
+    health_.reset(new HostHealth(
+        FLAGS_gorilla_circuit_failure_threshold,
+        FLAGS_gorilla_circuit_backoff_ms,
+        FLAGS_gorilla_circuit_max_backoff_ms));
+  }
+
   int shardCount = configurationAdapter_->getShardCount(serviceName_);
   LOG(INFO) << shardCount << " shards in " << serviceName_;
-  shardCache_.resize(shardCount);
+  shardCache_ =
+      std::vector<folly::atomic_shared_ptr<const ShardCacheEntry>>(shardCount);
+
+  // Moved shards are looked up again right away instead of when their
+  // cache entries expire.
+  shardChangesSubscription_ = configurationAdapter_->subscribeToShardChanges(
+      [this](
+          const std::string& serviceName,
+          const std::vector<int64_t>& shardIds) {
+        if (serviceName == serviceName_) {
+          GorillaStatsManager::addStatValue(
+              kShardsMoved, (int64_t)shardIds.size());
+          // Not virtual, so that it's safe while subclasses are being
+          // destroyed.
+          BeringeiNetworkClient::invalidateCache(
+              std::unordered_set<int64_t>(shardIds.begin(), shardIds.end()));
+        }
+      });
 
   // Initialize counters.
   GorillaStatsManager::addStatExportType(kStaleShardInfoUsed, SUM);
+  GorillaStatsManager::addStatExportType(kPutOverloaded, SUM);
+  GorillaStatsManager::addStatExportType(kPutCircuitOpen, SUM);
+  GorillaStatsManager::addStatExportType(kShardsMoved, SUM);
+  GorillaStatsManager::addStatExportType(kCompressibleBytesReceived, SUM);
+}
+
+BeringeiNetworkClient::~BeringeiNetworkClient() {
+  if (shardChangesSubscription_ != 0) {
+    configurationAdapter_->unsubscribeFromShardChanges(
+        shardChangesSubscription_);
+  }
 }
 
 class RequestHandler : public apache::thrift::RequestCallback {
@@ -96,9 +199,25 @@ vector<DataPoint> BeringeiNetworkClient::performPut(PutRequestMap& requests) {
   std::vector<DataPoint> dropped;
   std::mutex droppedMutex;
 
+  // The points that are sent with key ids, by host.
+  std::unordered_map<std::pair<std::string, int>, std::vector<DataPoint>>
+      sentWithKeyIds;
+
   for (auto& request : requests) {
+    // Requests are kept around empty when their buffers are reused.
+    if (request.second.data.empty()) {
+      continue;
+    }
+
+    auto& sent = sentWithKeyIds[request.first];
     try {
       auto client = getBeringeiThriftClient(request.first);
+      if (FLAGS_gorilla_client_key_ids) {
+        keyIds_.encode(request.first, request.second, sent);
+      }
+      if (FLAGS_gorilla_client_encode_puts) {
+        encoder_.encode(request.second, sent);
+      }
 
       // Keep clients alive
       clients.push_back(client);
@@ -110,29 +229,60 @@ vector<DataPoint> BeringeiNetworkClient::performPut(PutRequestMap& requests) {
                     PutDataResult putDataResult;
                     client->recv_putDataPoints(putDataResult, state);
 
+                    // The points of an overloaded server are retried
+                    // after a delay like the ones that failed to send.
+                    if (putDataResult.status == StatusCode::OVERLOADED) {
+                      GorillaStatsManager::addStatValue(kPutOverloaded);
+                    }
+                    recordPutResult(
+                        request.first,
+                        putDataResult.status != StatusCode::OVERLOADED);
+
                     std::lock_guard<std::mutex> guard(droppedMutex);
                     dropped.insert(
                         dropped.end(),
                         std::make_move_iterator(putDataResult.data.begin()),
                         std::make_move_iterator(putDataResult.data.end()));
+                    keyIds_.decode(
+                        request.first,
+                        request.second,
+                        putDataResult,
+                        sent,
+                        dropped);
+                    PutEncoder::decode(
+                        request.second,
+                        putDataResult,
+                        request.second.dataWithKeyIds.size(),
+                        sent,
+                        dropped);
                   } catch (const std::exception& e) {
                     LOG(ERROR) << "Exception from recv_putData: " << e.what();
+                    recordPutResult(request.first, false);
                     std::lock_guard<std::mutex> guard(droppedMutex);
                     dropped.insert(
                         dropped.end(),
                         std::make_move_iterator(request.second.data.begin()),
                         std::make_move_iterator(request.second.data.end()));
+                    dropped.insert(
+                        dropped.end(),
+                        std::make_move_iterator(sent.begin()),
+                        std::make_move_iterator(sent.end()));
                   }
                 } else {
                   auto exn = state.exception();
                   auto error = exn.what().toStdString();
                   LOG(ERROR) << "putDataPoints Failed. Reason: " << error;
+                  recordPutResult(request.first, false);
 
                   std::lock_guard<std::mutex> guard(droppedMutex);
                   dropped.insert(
                       dropped.end(),
                       std::make_move_iterator(request.second.data.begin()),
                       std::make_move_iterator(request.second.data.end()));
+                  dropped.insert(
+                      dropped.end(),
+                      std::make_move_iterator(sent.begin()),
+                      std::make_move_iterator(sent.end()));
                 }
 
                 if (--numActiveRequests == 0) {
@@ -144,11 +294,16 @@ vector<DataPoint> BeringeiNetworkClient::performPut(PutRequestMap& requests) {
       numActiveRequests++;
     } catch (std::exception& e) {
       LOG(ERROR) << e.what();
+      recordPutResult(request.first, false);
       std::lock_guard<std::mutex> guard(droppedMutex);
       dropped.insert(
           dropped.end(),
           std::make_move_iterator(request.second.data.begin()),
           std::make_move_iterator(request.second.data.end()));
+      dropped.insert(
+          dropped.end(),
+          std::make_move_iterator(sent.begin()),
+          std::make_move_iterator(sent.end()));
     }
   }
 
@@ -158,6 +313,111 @@ vector<DataPoint> BeringeiNetworkClient::performPut(PutRequestMap& requests) {
   return dropped;
 }
 
+folly::Future<std::vector<DataPoint>> BeringeiNetworkClient::performPut(
+    const std::pair<std::string, int>& hostInfo,
+    PutDataRequest&& request,
+    folly::EventBase* eb) {
+  auto req = std::make_shared<PutDataRequest>(std::move(request));
+  std::shared_ptr<BeringeiServiceAsyncClient> client;
+  try {
+    client = getBeringeiThriftClient(hostInfo, eb);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << e.what();
+    recordPutResult(hostInfo, false);
+    return folly::makeFuture(std::move(req->data));
+  }
+
+  auto sent = std::make_shared<std::vector<DataPoint>>();
+  if (FLAGS_gorilla_client_key_ids) {
+    keyIds_.encode(hostInfo, *req, *sent);
+  }
+  if (FLAGS_gorilla_client_encode_puts) {
+    encoder_.encode(*req, *sent);
+  }
+
+  return client->future_putDataPoints(*req).then(
+      [this, client, req, sent, hostInfo](
+          folly::Try<PutDataResult>&& result) -> std::vector<DataPoint> {
+        if (result.hasException()) {
+          LOG(ERROR) << "putDataPoints Failed. Reason: "
+                     << result.exception().what().toStdString();
+          recordPutResult(hostInfo, false);
+          req->data.insert(
+              req->data.end(),
+              std::make_move_iterator(sent->begin()),
+              std::make_move_iterator(sent->end()));
+          return std::move(req->data);
+        }
+
+        if (result->status == StatusCode::OVERLOADED) {
+          GorillaStatsManager::addStatValue(kPutOverloaded);
+        }
+        recordPutResult(hostInfo, result->status != StatusCode::OVERLOADED);
+        keyIds_.decode(hostInfo, *req, *result, *sent, result->data);
+        PutEncoder::decode(
+            *req, *result, req->dataWithKeyIds.size(), *sent, result->data);
+        return std::move(result->data);
+      });
+}
+
+// Options of a request that carry the trace of the calling thread to the
+// server.
+static RpcOptions getTraceOptions(uint64_t traceId) {
+  RpcOptions options;
+  if (traceId != 0) {
+    options.setWriteHeader(Tracing::kHeader, Tracing::format(traceId));
+  }
+  return options;
+}
+
+// Records the RPC as a span once it's done.
+template <typename T>
+static folly::Future<T> traceRpc(
+    folly::Future<T>&& future,
+    uint64_t traceId,
+    const char* name,
+    int64_t shardId) {
+  if (traceId == 0) {
+    return std::move(future);
+  }
+  int64_t startUs = Tracing::nowUs();
+  return future.ensure([traceId, name, startUs, shardId]() {
+    Tracing::record(traceId, name, startUs, shardId);
+  });
+}
+
+static int64_t blockBytes(const std::vector<TimeSeriesBlock>& blocks) {
+  int64_t bytes = 0;
+  for (const auto& block : blocks) {
+    bytes += block.data.size() + block.checkpoints.size();
+  }
+  return bytes;
+}
+
+// Most of the size of a response is in its blocks.
+static int64_t responseBytes(const GetDataResult& result) {
+  int64_t bytes = blockBytes(result.reduced.data);
+  for (const auto& data : result.results) {
+    bytes += blockBytes(data.data);
+  }
+  return bytes;
+}
+
+static int64_t responseBytes(const ScanShardResult& result) {
+  int64_t bytes = 0;
+  for (const auto& key : result.keys) {
+    bytes += key.size();
+  }
+  for (const auto& blocks : result.data) {
+    bytes += blockBytes(blocks);
+  }
+  return bytes;
+}
+
+static void countCompressibleBytes(int64_t bytes) {
+  GorillaStatsManager::addStatValue(kCompressibleBytesReceived, bytes);
+}
+
 void markRequestResultFailed(const GetDataRequest& req, GetDataResult& res) {
   res.results.clear();
   res.results.resize(req.keys.size());
@@ -167,6 +427,7 @@ void markRequestResultFailed(const GetDataRequest& req, GetDataResult& res) {
 }
 
 void BeringeiNetworkClient::performGet(GetRequestMap& requests) {
+  bool compressed = getTransportCompressionMinBytes() > 0;
   std::atomic<int> numActiveRequests(0);
   std::vector<std::shared_ptr<BeringeiServiceAsyncClient>> clients;
 
@@ -190,6 +451,9 @@ void BeringeiNetworkClient::performGet(GetRequestMap& requests) {
           if (success) {
             try {
               client->recv_getData(request.second.second, state);
+              if (compressed) {
+                countCompressibleBytes(responseBytes(request.second.second));
+              }
             } catch (const std::exception& e) {
               LOG(ERROR) << "Exception from recv_getData: " << e.what();
               // Mark all the results as RPC_FAIL
@@ -210,7 +474,8 @@ void BeringeiNetworkClient::performGet(GetRequestMap& requests) {
           }
         }));
 
-    client->getData(std::move(callback), request.second.first);
+    auto options = getTraceOptions(Tracing::current());
+    client->getData(options, std::move(callback), request.second.first);
     numActiveRequests++;
   }
 
@@ -223,7 +488,106 @@ folly::Future<GetDataResult> BeringeiNetworkClient::performGet(
     const std::pair<std::string, int>& hostInfo,
     const GetDataRequest& request,
     folly::EventBase* eb) {
-  return getBeringeiThriftClient(hostInfo, eb)->future_getData(request);
+  uint64_t traceId = Tracing::current();
+  auto options = getTraceOptions(traceId);
+  auto future = traceRpc(
+      getBeringeiThriftClient(hostInfo, eb)->future_getData(options, request),
+      traceId,
+      "client_get_data_rpc",
+      -1);
+  if (getTransportCompressionMinBytes() == 0) {
+    return future;
+  }
+  return future.then([](GetDataResult&& result) {
+    countCompressibleBytes(responseBytes(result));
+    return std::move(result);
+  });
+}
+
+bool BeringeiNetworkClient::performAggregate(
+    const AggregateRequest& request,
+    std::vector<AggregateResult>& results) {
+  bool complete = true;
+  std::unordered_map<std::pair<std::string, int>, AggregateRequest> requests;
+  for (const auto& key : request.keys) {
+    std::pair<std::string, int> hostInfo;
+    if (getHostForShard(key.shardId, hostInfo)) {
+      requests[hostInfo].keys.push_back(key);
+    } else {
+      complete = false;
+    }
+  }
+
+  std::vector<int64_t> prefixShards;
+  if (!request.prefix.empty()) {
+    prefixShards = request.prefixShards;
+    if (prefixShards.empty()) {
+      for (int64_t shardId = 0; shardId < getNumShards(); shardId++) {
+        prefixShards.push_back(shardId);
+      }
+    }
+  }
+  for (int64_t shardId : prefixShards) {
+    std::pair<std::string, int> hostInfo;
+    if (getHostForShard(shardId, hostInfo)) {
+      requests[hostInfo].prefixShards.push_back(shardId);
+    } else {
+      complete = false;
+    }
+  }
+
+  auto eb = getEventBase();
+  uint64_t traceId = Tracing::current();
+  auto options = getTraceOptions(traceId);
+  std::vector<folly::Future<AggregateResult>> futures;
+  for (auto& host : requests) {
+    AggregateRequest& hostRequest = host.second;
+    if (!hostRequest.prefixShards.empty()) {
+      hostRequest.prefix = request.prefix;
+    }
+    hostRequest.begin = request.begin;
+    hostRequest.end = request.end;
+    hostRequest.aggregation = request.aggregation;
+
+    try {
+      futures.push_back(traceRpc(
+          getBeringeiThriftClient(host.first, eb)
+              ->future_aggregate(options, hostRequest),
+          traceId,
+          "client_aggregate_rpc",
+          -1));
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Failed to construct BeringeiServiceAsyncClient for"
+                 << " host:port " << host.first.first << ":"
+                 << host.first.second << " with exception: " << e.what();
+      complete = false;
+    }
+  }
+
+  std::unordered_set<int64_t> unowned;
+  for (auto& result : folly::collectAll(futures).getVia(eb)) {
+    if (result.hasException()) {
+      LOG(ERROR) << "aggregate failed. Reason: " << result.exception().what();
+      complete = false;
+      continue;
+    }
+
+    AggregateResult& hostResult = result.value();
+    if (hostResult.status != StatusCode::OK) {
+      complete = false;
+    }
+    unowned.insert(
+        hostResult.unownedShards.begin(), hostResult.unownedShards.end());
+    if (hostResult.status != StatusCode::RPC_FAIL) {
+      results.push_back(std::move(hostResult));
+    }
+  }
+
+  if (!unowned.empty()) {
+    invalidateCache(unowned);
+    complete = false;
+  }
+  return complete;
 }
 
 void BeringeiNetworkClient::performScanShard(
@@ -249,8 +613,25 @@ void BeringeiNetworkClient::performScanShard(
     return;
   }
 
+  bool compressed = getTransportCompressionMinBytes() > 0;
   try {
-    client->sync_scanShard(result, request);
+    auto options = getTraceOptions(Tracing::current());
+    client->sync_scanShard(options, result, request);
+    if (compressed) {
+      countCompressibleBytes(responseBytes(result));
+    }
+
+    // Fetch the rest of a paginated scan.
+    ScanShardRequest next = request;
+    while (result.status == StatusCode::OK && result.moreEntries) {
+      next.offset = result.nextOffset;
+      ScanShardResult chunk;
+      client->sync_scanShard(options, chunk, next);
+      if (compressed) {
+        countCompressibleBytes(responseBytes(chunk));
+      }
+      appendScanShardChunk(result, std::move(chunk));
+    }
   } catch (const std::exception& e) {
     result.status = StatusCode::RPC_FAIL;
     LOG(ERROR) << "Got exception talking to Gorilla: " << e.what();
@@ -261,7 +642,43 @@ folly::Future<ScanShardResult> BeringeiNetworkClient::performScanShard(
     const std::pair<std::string, int>& hostInfo,
     const ScanShardRequest& request,
     folly::EventBase* eb) {
-  return getBeringeiThriftClient(hostInfo, eb)->future_scanShard(request);
+  uint64_t traceId = Tracing::current();
+  auto options = getTraceOptions(traceId);
+  auto future = traceRpc(
+      getBeringeiThriftClient(hostInfo, eb)->future_scanShard(options, request),
+      traceId,
+      "client_scan_shard_rpc",
+      request.shardId);
+  if (getTransportCompressionMinBytes() == 0) {
+    return future;
+  }
+  return future.then([](ScanShardResult&& result) {
+    countCompressibleBytes(responseBytes(result));
+    return std::move(result);
+  });
+}
+
+folly::Future<folly::Unit> BeringeiNetworkClient::performScanShardChunks(
+    const std::pair<std::string, int>& hostInfo,
+    const ScanShardRequest& request,
+    folly::EventBase* eb,
+    folly::Executor* workExecutor,
+    std::function<void(ScanShardResult&&)> fn) {
+  uint64_t traceId = Tracing::current();
+  return performScanShard(hostInfo, request, eb)
+      .via(workExecutor)
+      .then([this, hostInfo, request, eb, workExecutor, fn, traceId](
+                ScanShardResult&& result) mutable {
+        Tracing::TraceScope trace(traceId);
+        bool more = result.status == StatusCode::OK && result.moreEntries;
+        request.offset = result.nextOffset;
+        fn(std::move(result));
+        if (!more) {
+          return folly::makeFuture();
+        }
+        return performScanShardChunks(
+            hostInfo, request, eb, workExecutor, std::move(fn));
+      });
 }
 
 bool BeringeiNetworkClient::getShardKeys(
@@ -289,8 +706,91 @@ bool BeringeiNetworkClient::getShardKeys(
   return result.moreResults;
 }
 
+bool BeringeiNetworkClient::searchShardKeys(
+    const SearchKeysRequest& req,
+    SearchKeysResult& result) {
+  std::pair<std::string, int> hostInfo;
+  if (!getHostForShard(req.shardId, hostInfo)) {
+    throw std::runtime_error(
+        folly::format("Couldn't find shard owner {}", req.shardId).str());
+  }
+
+  std::shared_ptr<BeringeiServiceAsyncClient> client =
+      getBeringeiThriftClient(hostInfo);
+  client->sync_searchKeys(result, req);
+  if (result.status == StatusCode::DONT_OWN_SHARD) {
+    invalidateCache({req.shardId});
+  }
+  return result.moreResults;
+}
+
+bool BeringeiNetworkClient::getDeviatingKeys(
+    const GetDeviatingKeysRequest& req,
+    GetDeviatingKeysResult& result) {
+  std::pair<std::string, int> hostInfo;
+  if (!getHostForShard(req.shardId, hostInfo)) {
+    throw std::runtime_error(
+        folly::format("Couldn't find shard owner {}", req.shardId).str());
+  }
+
+  std::shared_ptr<BeringeiServiceAsyncClient> client =
+      getBeringeiThriftClient(hostInfo);
+  client->sync_getDeviatingKeys(result, req);
+  if (result.status == StatusCode::DONT_OWN_SHARD) {
+    invalidateCache({req.shardId});
+  }
+  return result.moreResults;
+}
+
+std::vector<BackfillData> BeringeiNetworkClient::performBackfill(
+    std::vector<BackfillData>& data,
+    int64_t& added,
+    int64_t& dropped) {
+  std::vector<BackfillData> failed;
+  std::unordered_map<std::pair<std::string, int>, BackfillRequest> requests;
+  for (auto& entry : data) {
+    std::pair<std::string, int> hostInfo;
+    if (getHostForShard(entry.key.shardId, hostInfo)) {
+      requests[hostInfo].data.push_back(std::move(entry));
+    } else {
+      failed.push_back(std::move(entry));
+    }
+  }
+
+  std::unordered_set<int64_t> unowned;
+  for (auto& request : requests) {
+    auto& entries = request.second.data;
+    BackfillResult result;
+    try {
+      auto client = getBeringeiThriftClient(request.first);
+      client->sync_backfill(result, request.second);
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "backfill failed. Reason: " << e.what();
+      failed.insert(
+          failed.end(),
+          std::make_move_iterator(entries.begin()),
+          std::make_move_iterator(entries.end()));
+      continue;
+    }
+
+    added += result.pointsAdded;
+    dropped += result.pointsDropped;
+    for (int32_t i : result.rejected) {
+      if (i >= 0 && i < entries.size()) {
+        unowned.insert(entries[i].key.shardId);
+        failed.push_back(std::move(entries[i]));
+      }
+    }
+  }
+
+  if (!unowned.empty()) {
+    invalidateCache(unowned);
+  }
+  return failed;
+}
+
 void BeringeiNetworkClient::getLastUpdateTimesForHost(
-    uint32_t /*minLastUpdateTime*/,
+    uint32_t minLastUpdateTime,
     uint32_t maxKeysPerRequest,
     const std::string& host,
     int port,
@@ -311,6 +811,8 @@ void BeringeiNetworkClient::getLastUpdateTimesForHost(
       req.offset = 0;
       req.shardId = shard;
       req.limit = maxKeysPerRequest;
+      req.minLastUpdateTime = minLastUpdateTime;
+      req.useCursor = true;
       bool continueOperation = true;
 
       do {
@@ -327,7 +829,10 @@ void BeringeiNetworkClient::getLastUpdateTimesForHost(
           if (!result.moreResults) {
             break;
           }
-          req.offset += maxKeysPerRequest;
+          // Servers without the cursor leave nextOffset unset.
+          req.offset = result.nextOffset > req.offset
+              ? result.nextOffset
+              : req.offset + maxKeysPerRequest;
         }
 
         if (continueOperation) {
@@ -392,12 +897,12 @@ void BeringeiNetworkClient::getLastUpdateTimes(
 }
 
 bool BeringeiNetworkClient::addDataPointToRequest(
-    DataPoint& dp,
+    const DataPoint& dp,
     PutRequestMap& requests,
     bool& dropped) {
   std::pair<std::string, int> hostInfo;
   bool success = getHostForShard(dp.key.shardId, hostInfo);
-  if (!success) {
+  if (!success || !hostAllowed(hostInfo, 1)) {
     if (!isShadow_) {
       dropped = true;
     }
@@ -408,10 +913,54 @@ bool BeringeiNetworkClient::addDataPointToRequest(
   return requests[hostInfo].data.size() < FLAGS_gorilla_max_batch_size;
 }
 
+void BeringeiNetworkClient::addDataPointsToRequest(
+    int64_t shardId,
+    std::vector<DataPoint>& points,
+    PutRequestMap& requests,
+    bool& dropped) {
+  std::pair<std::string, int> hostInfo;
+  if (!getHostForShard(shardId, hostInfo) ||
+      !hostAllowed(hostInfo, points.size())) {
+    dropped = !isShadow_;
+    return;
+  }
+
+  auto& data = requests[hostInfo].data;
+  data.insert(
+      data.end(),
+      std::make_move_iterator(points.begin()),
+      std::make_move_iterator(points.end()));
+}
+
+bool BeringeiNetworkClient::hostAllowed(
+    const std::pair<std::string, int>& hostInfo,
+    size_t points) {
+  if (!health_ || health_->allow(hostInfo, nowMs())) {
+    return true;
+  }
+  GorillaStatsManager::addStatValue(kPutCircuitOpen, points);
+  return false;
+}
+
+void BeringeiNetworkClient::recordPutResult(
+    const std::pair<std::string, int>& hostInfo,
+    bool success) {
+  if (!health_) {
+    return;
+  } else if (success) {
+    health_->onSuccess(hostInfo);
+  } else {
+    health_->onFailure(hostInfo, nowMs());
+  }
+}
+
 void BeringeiNetworkClient::addKeyToGetRequest(
     const Key& key,
     GetRequestMap& requests) {
-  addKeyToRequest<GetRequestMap>(key, requests);
+  std::pair<std::string, int> hostInfo;
+  if (getReadHostForKey(key, hostInfo)) {
+    requests[hostInfo].first.keys.push_back(key);
+  }
 }
 
 void BeringeiNetworkClient::addKeyToGetRequest(
@@ -419,7 +968,7 @@ void BeringeiNetworkClient::addKeyToGetRequest(
     const Key& key,
     MultiGetRequestMap& requests) {
   std::pair<std::string, int> hostInfo;
-  bool success = getHostForShard(key.shardId, hostInfo);
+  bool success = getReadHostForKey(key, hostInfo);
   if (!success) {
     return;
   }
@@ -428,6 +977,23 @@ void BeringeiNetworkClient::addKeyToGetRequest(
   requests[hostInfo].second.push_back(index);
 }
 
+void BeringeiNetworkClient::addKeyToGetRequest(
+    size_t index,
+    const Key& key,
+    const TimeRange& range,
+    MultiGetRequestMap& requests) {
+  std::pair<std::string, int> hostInfo;
+  bool success = getReadHostForKey(key, hostInfo);
+  if (!success) {
+    return;
+  }
+
+  auto& request = requests[hostInfo];
+  request.first.keys.push_back(key);
+  request.first.ranges.push_back(range);
+  request.second.push_back(index);
+}
+
 uint32_t BeringeiNetworkClient::getTimeoutMs() {
   return (FLAGS_gorilla_processing_timeout == 0)
       ? kDefaultThriftTimeoutMs
@@ -438,26 +1004,29 @@ std::shared_ptr<BeringeiServiceAsyncClient>
 BeringeiNetworkClient::getBeringeiThriftClient(
     const std::pair<std::string, int>& hostInfo,
     folly::EventBase* eb) {
-  folly::SocketAddress address(hostInfo.first, hostInfo.second, true);
-  auto socket = apache::thrift::async::TAsyncSocket::newSocket(eb, address);
-  auto channel =
-      apache::thrift::HeaderClientChannel::newChannel(std::move(socket));
-  channel->setTimeout(getTimeoutMs());
-  return std::make_shared<BeringeiServiceAsyncClient>(std::move(channel));
+  uint32_t compressionMinBytes = getTransportCompressionMinBytes();
+
+  // Pooled clients can only be used in the thread of their EventBase.
+  if (FLAGS_gorilla_client_connection_pool && eb->isInEventBaseThread()) {
+    return clientPool_.getClient(
+        hostInfo, eb, getTimeoutMs(), compressionMinBytes);
+  }
+  return BeringeiClientPool::newClient(
+      hostInfo, eb, getTimeoutMs(), compressionMinBytes);
+}
+
+uint32_t BeringeiNetworkClient::getTransportCompressionMinBytes() {
+  return configurationAdapter_->getTransportCompressionMinBytes(serviceName_);
 }
 
 void BeringeiNetworkClient::invalidateCache(
     const std::unordered_set<int64_t>& shardIds) {
-  folly::RWSpinLock::WriteHolder guard(&shardCacheLock_);
   for (int64_t shardId : shardIds) {
     if (shardId < 0 || shardId >= shardCache_.size()) {
       // Ignore invalid shardId
       continue;
     }
-    auto& entry = shardCache_[shardId];
-    if (entry) {
-      entry.reset(nullptr);
-    }
+    shardCache_[shardId].store(nullptr);
   }
 }
 
@@ -472,25 +1041,21 @@ bool BeringeiNetworkClient::getHostForShard(
   }
 
   bool cachedEntry = false;
-  {
-    folly::RWSpinLock::ReadHolder guard(&shardCacheLock_);
-
-    auto& entry = shardCache_[shardId];
-    if (entry) {
-      cachedEntry = true;
-      hostInfo = make_pair(entry->hostAddress, entry->port);
-      if (hostInfo.first != "" &&
-          entry->updateTime > time(nullptr) - FLAGS_gorilla_shard_cache_ttl) {
-        return true;
-      } else if (
-          hostInfo.first == "" &&
-          entry->updateTime >
-              time(nullptr) - FLAGS_gorilla_negative_shard_cache_ttl) {
-        // Negatively cached entry to avoid querying servicerouter
-        // constantly.
-        return false;
-      } // else the cached entry has outlived its TTL.
-    }
+  auto entry = shardCache_[shardId].load();
+  if (entry) {
+    cachedEntry = true;
+    hostInfo = make_pair(entry->hostAddress, entry->port);
+    if (hostInfo.first != "" &&
+        entry->updateTime > time(nullptr) - FLAGS_gorilla_shard_cache_ttl) {
+      return true;
+    } else if (
+        hostInfo.first == "" &&
+        entry->updateTime >
+            time(nullptr) - FLAGS_gorilla_negative_shard_cache_ttl) {
+      // Negatively cached entry to avoid querying servicerouter
+      // constantly.
+      return false;
+    } // else the cached entry has outlived its TTL.
   }
 
   try {
@@ -500,7 +1065,12 @@ bool BeringeiNetworkClient::getHostForShard(
     // information is really fast.
     if (configurationAdapter_->getHostForShardId(
             shardId, serviceName_, hostInfo)) {
-      addCacheEntry(shardId, hostInfo);
+      std::vector<std::pair<std::string, int>> followers;
+      if (FLAGS_gorilla_follower_reads) {
+        configurationAdapter_->getFollowersForShardId(
+            shardId, serviceName_, followers);
+      }
+      addCacheEntry(shardId, hostInfo, std::move(followers));
       return true;
     } else {
       LOG(WARNING) << "No host in directory service for shard : " << shardId;
@@ -514,6 +1084,33 @@ bool BeringeiNetworkClient::getHostForShard(
   return false;
 }
 
+bool BeringeiNetworkClient::getReadHostForKey(
+    const Key& key,
+    std::pair<std::string, int>& hostInfo) {
+  if (!getHostForShard(key.shardId, hostInfo)) {
+    return false;
+  }
+  if (!FLAGS_gorilla_follower_reads || key.shardId >= shardCache_.size()) {
+    return true;
+  }
+
+  // getHostForShard() just cached the entry unless it was overridden.
+  auto entry = shardCache_[key.shardId].load();
+  if (!entry || entry->followers.empty() ||
+      entry->hostAddress != hostInfo.first || entry->port != hostInfo.second) {
+    return true;
+  }
+
+  // The same key always goes to the same host, so that its blocks stay
+  // in the caches of that host.
+  size_t replica =
+      CaseHash::hash(key.key, kReplicaSeed) % (entry->followers.size() + 1);
+  if (replica > 0) {
+    hostInfo = entry->followers[replica - 1];
+  }
+  return true;
+}
+
 bool BeringeiNetworkClient::getHostForShardOnFailure(
     bool cachedEntry,
     int64_t shardId,
@@ -541,16 +1138,16 @@ void BeringeiNetworkClient::useStaleCacheEntry(
 
 void BeringeiNetworkClient::addCacheEntry(
     int64_t shardId,
-    const std::pair<std::string, int>& hostInfo) {
-  ShardCacheEntry* entryPtr = new ShardCacheEntry;
+    const std::pair<std::string, int>& hostInfo,
+    std::vector<std::pair<std::string, int>> followers) {
+  auto entry = std::make_shared<ShardCacheEntry>();
 
-  entryPtr->hostAddress = hostInfo.first;
-  entryPtr->port = hostInfo.second;
-  entryPtr->updateTime = time(nullptr);
+  entry->hostAddress = hostInfo.first;
+  entry->port = hostInfo.second;
+  entry->followers = std::move(followers);
+  entry->updateTime = time(nullptr);
 
-  folly::RWSpinLock::WriteHolder guard(&shardCacheLock_);
-  auto& entry = shardCache_[shardId];
-  entry.reset(entryPtr);
+  shardCache_[shardId].store(std::move(entry));
 }
 
 void BeringeiNetworkClient::stopRequests() {
@@ -10,14 +10,19 @@
 #pragma once
 
 #include <condition_variable>
+#include <functional>
 #include <string>
 #include <unordered_set>
 #include <vector>
 
+#include <folly/concurrency/AtomicSharedPtr.h>
 #include <folly/io/async/EventBaseManager.h>
-#include <folly/synchronization/RWSpinLock.h>
 
+#include "beringei/client/BeringeiClientPool.h"
 #include "beringei/client/BeringeiConfigurationAdapterIf.h"
+#include "beringei/client/HostHealth.h"
+#include "beringei/client/KeyIdCache.h"
+#include "beringei/client/PutEncoder.h"
 #include "beringei/if/gen-cpp2/BeringeiService.h"
 
 using folly::EventBaseManager;
@@ -38,7 +43,7 @@ class BeringeiNetworkClient {
       std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter,
       bool shadow);
 
-  virtual ~BeringeiNetworkClient() {}
+  virtual ~BeringeiNetworkClient();
 
   typedef std::unordered_map<std::pair<std::string, int>, PutDataRequest>
       PutRequestMap;
@@ -57,6 +62,24 @@ class BeringeiNetworkClient {
   // points. Might move data points from the requests.
   virtual std::vector<DataPoint> performPut(PutRequestMap& requests);
 
+  // Sends one putData request without waiting for the response. The
+  // future completes in the thread of `eb` with the points that weren't
+  // stored, which are all of them if the request failed.
+  virtual folly::Future<std::vector<DataPoint>> performPut(
+      const std::pair<std::string, int>& hostInfo,
+      PutDataRequest&& request,
+      folly::EventBase* eb = getEventBase());
+
+  // Sends the entries to the owners of their shards with backfill(),
+  // one request per host. Returns the entries that weren't written
+  // because the request failed or the host didn't own the shard. Adds
+  // the points written and dropped by the hosts to `added` and
+  // `dropped`. Moves the entries out of `data`.
+  virtual std::vector<BackfillData> performBackfill(
+      std::vector<BackfillData>& data,
+      int64_t& added,
+      int64_t& dropped);
+
   // Fire off a getData request.
   virtual void performGet(GetRequestMap& requests);
 
@@ -65,6 +88,16 @@ class BeringeiNetworkClient {
       const GetDataRequest& request,
       folly::EventBase* eb = getEventBase());
 
+  // Splits an aggregate request by the hosts of its keys and of its
+  // prefix shards, or of every shard if it has a prefix but no prefix
+  // shards, and sends it to all of them in parallel. Adds the results of
+  // the hosts that answered to `results`. Returns false if some keys or
+  // shards weren't reduced because their host isn't known, failed or
+  // doesn't own them anymore.
+  virtual bool performAggregate(
+      const AggregateRequest& request,
+      std::vector<AggregateResult>& results);
+
   // Fetches the last update times from all the servers in parallel
   // and calls the callback multiple times with partial results. The
   // callback should return false if it doesn't want more results, and
@@ -81,8 +114,18 @@ class BeringeiNetworkClient {
   // Adds a data point to a request. Returns true if more points should be
   // added to this request, false otherwise. `dropped` will be set to true
   // if the data point was not added to the request.
-  virtual bool
-  addDataPointToRequest(DataPoint& dp, PutRequestMap& requests, bool& dropped);
+  virtual bool addDataPointToRequest(
+      const DataPoint& dp,
+      PutRequestMap& requests,
+      bool& dropped);
+
+  // Same as above for points that all belong to `shardId`, looking up
+  // the host once. Moves the points unless `dropped` is set.
+  virtual void addDataPointsToRequest(
+      int64_t shardId,
+      std::vector<DataPoint>& points,
+      PutRequestMap& requests,
+      bool& dropped);
 
   // Adds a key to a get request.
   virtual void addKeyToGetRequest(const Key& key, GetRequestMap& requests);
@@ -94,6 +137,15 @@ class BeringeiNetworkClient {
       const Key& key,
       MultiGetRequestMap& requests);
 
+  // Same as above for a key with its own time range, which is added to
+  // the `ranges` of the request of the host. All the ranges of a host
+  // go in one request.
+  virtual void addKeyToGetRequest(
+      size_t index,
+      const Key& key,
+      const TimeRange& range,
+      MultiGetRequestMap& requests);
+
   // Invalidate the DirectoryService cache for a certain set of shard ids
   virtual void invalidateCache(const std::unordered_set<int64_t>& shardIds);
 
@@ -117,6 +169,16 @@ class BeringeiNetworkClient {
       const ScanShardRequest& request,
       folly::EventBase* eb = getEventBase());
 
+  // Performs a scan that might be paginated, requesting one chunk at a
+  // time and calling `fn` on `workExecutor` with each chunk as it
+  // arrives. The returned future completes after the last chunk.
+  folly::Future<folly::Unit> performScanShardChunks(
+      const std::pair<std::string, int>& hostInfo,
+      const ScanShardRequest& request,
+      folly::EventBase* eb,
+      folly::Executor* workExecutor,
+      std::function<void(ScanShardResult&&)> fn);
+
   static uint32_t getTimeoutMs();
 
   virtual std::shared_ptr<BeringeiServiceAsyncClient> getBeringeiThriftClient(
@@ -131,6 +193,20 @@ class BeringeiNetworkClient {
       int offset,
       std::vector<KeyUpdateTime>& keys);
 
+  // Finds the keys of `req.shardId` matching `req.pattern` on the owner
+  // of the shard. Returns true if there are more keys after
+  // `result.lastKey`.
+  virtual bool searchShardKeys(
+      const SearchKeysRequest& req,
+      SearchKeysResult& result);
+
+  // Finds the keys of `req.shardId` that deviated from their mean in the
+  // minutes of the request on the owner of the shard. Returns true if
+  // there are more than `req.limit` keys.
+  virtual bool getDeviatingKeys(
+      const GetDeviatingKeysRequest& req,
+      GetDeviatingKeysResult& result);
+
   static folly::EventBase* getEventBase() {
     return folly::EventBaseManager::get()->getEventBase();
   }
@@ -152,6 +228,10 @@ class BeringeiNetworkClient {
       int64_t shardId,
       std::pair<std::string, int>& hostInfo);
 
+  // The host to read the key from. With --gorilla_follower_reads, the
+  // keys of a shard are spread over its owner and its followers.
+  bool getReadHostForKey(const Key& key, std::pair<std::string, int>& hostInfo);
+
   template <typename T>
   void addKeyToRequest(const Key& key, T& requests) {
     std::pair<std::string, int> hostInfo;
@@ -175,7 +255,16 @@ class BeringeiNetworkClient {
 
   void addCacheEntry(
       int64_t shardId,
-      const std::pair<std::string, int>& hostInfo);
+      const std::pair<std::string, int>& hostInfo,
+      std::vector<std::pair<std::string, int>> followers = {});
+
+  // Returns false and counts the points as skipped if the circuit
+  // breaker of the host is open.
+  bool hostAllowed(const std::pair<std::string, int>& hostInfo, size_t points);
+
+  void recordPutResult(
+      const std::pair<std::string, int>& hostInfo,
+      bool success);
 
   void getLastUpdateTimesForHost(
       uint32_t minLastUpdateTime,
@@ -186,9 +275,16 @@ class BeringeiNetworkClient {
       uint32_t timeoutSeconds,
       std::function<bool(const std::vector<KeyUpdateTime>& keys)> callback);
 
+  // The transport compression threshold of the service, 0 if it isn't
+  // compressed.
+  uint32_t getTransportCompressionMinBytes();
+
   struct ShardCacheEntry {
     std::string hostAddress;
     int port;
+
+    // Set with --gorilla_follower_reads.
+    std::vector<std::pair<std::string, int>> followers;
     time_t updateTime;
   };
 
@@ -200,9 +296,23 @@ class BeringeiNetworkClient {
   std::mutex stoppingMutex_;
 
  private:
-  std::vector<std::unique_ptr<ShardCacheEntry>> shardCache_;
-  folly::RWSpinLock shardCacheLock_;
+  // The entries are immutable and replaced whole, so looking up the host
+  // of a shard doesn't take any lock.
+  std::vector<folly::atomic_shared_ptr<const ShardCacheEntry>> shardCache_;
   bool isShadow_ = false;
+  BeringeiClientPool clientPool_;
+
+  // Used with --gorilla_client_key_ids.
+  KeyIdCache keyIds_;
+
+  // Used with --gorilla_client_encode_puts.
+  PutEncoder encoder_;
+
+  // Null if --gorilla_circuit_failure_threshold is 0.
+  std::unique_ptr<HostHealth> health_;
+
+  // 0 if the configuration adapter doesn't tell when shards move.
+  int64_t shardChangesSubscription_ = 0;
 };
 
 } // namespace gorilla
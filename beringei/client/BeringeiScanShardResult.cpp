@@ -31,8 +31,16 @@ struct KeyData {
       std::vector<facebook::gorilla::TimeSeriesBlock>&& rhs,
       bool queriedRecently) {
     CHECK_LT(service, data_.size());
-    CHECK(!have_[service]);
-    data_[service] = std::move(rhs);
+    if (have_[service]) {
+      // A key shows up twice in a paginated scan if it was deleted and
+      // added back between two chunks.
+      data_[service].insert(
+          data_[service].end(),
+          std::make_move_iterator(rhs.begin()),
+          std::make_move_iterator(rhs.end()));
+    } else {
+      data_[service] = std::move(rhs);
+    }
     have_[service] = true;
     queriedRecently_ |= queriedRecently;
   }
@@ -186,40 +194,31 @@ std::vector<TimeValuePair> BeringeiScanShardResult::getUncompressedData(
         std::make_unique<BeringeiScanStats>(numServices, serviceDataValid);
   }
 
-  for (unsigned service = 0; service < data[key].size(); ++service) {
-    int64_t oldSize = ret.size();
-    int64_t inSize;
-    int64_t mismatches = 0;
-
-    TimeSeries::mergeValues(
-        data[key][service],
-        ret,
-        beginTime,
-        endTime,
-        FLAGS_mintimestampdelta,
-        FLAGS_gorilla_compare_reads,
-        FLAGS_gorilla_compare_epsilon,
-        &inSize,
-        &mismatches);
-
-    if (newStats) {
-      const int64_t added = ret.size() - oldSize;
-      const int64_t missing = ret.size() - inSize;
-
-      if (added >= 0 && missing >= 0) {
-        newStats->updateByService(service, ret.size(), added, missing);
-      } else {
-        newStats.reset();
-        if (mergeDeletedDataKeys) {
-          if (*mergeDeletedDataKeys == 0) {
-            LOG(INFO) << "scanShard request to service " << service << " of "
-                      << numServices << " " << serviceNames[service] << " "
-                      << request << " data shrunk on merge key " << keys[key]
-                      << " added " << added << " missing " << missing;
-          }
-          ++*mergeDeletedDataKeys;
-        }
-      }
+  std::vector<const std::vector<TimeSeriesBlock>*> blocks;
+  for (const auto& serviceBlocks : data[key]) {
+    blocks.push_back(&serviceBlocks);
+  }
+
+  std::vector<TimeSeries::MergeStats> mergeStats;
+  TimeSeries::mergeValues(
+      blocks,
+      ret,
+      beginTime,
+      endTime,
+      FLAGS_mintimestampdelta,
+      FLAGS_gorilla_compare_reads,
+      FLAGS_gorilla_compare_epsilon,
+      &mergeStats);
+
+  if (newStats) {
+    int64_t total = 0;
+    for (unsigned service = 0; service < mergeStats.size(); ++service) {
+      total += mergeStats[service].added;
+      newStats->updateByService(
+          service,
+          total,
+          mergeStats[service].added,
+          mergeStats[service].missing);
     }
   }
 
@@ -239,6 +238,129 @@ std::vector<TimeValuePair> BeringeiScanShardResult::takeUncompressedData(
   return ret;
 }
 
+std::vector<std::vector<TimeValuePair>>
+BeringeiScanShardResult::takeUncompressedData(
+    folly::Executor* executor,
+    BeringeiScanStats* stats,
+    int64_t* mergeDeletedDataKeys) {
+  std::vector<std::vector<TimeValuePair>> ret(keys.size());
+  BeringeiScanShardDecoder decoder(*this, executor);
+  size_t index;
+  std::vector<TimeValuePair> values;
+  while (decoder.next(index, values)) {
+    ret[index] = std::move(values);
+  }
+
+  if (stats) {
+    if (!stats->getNumServices()) {
+      *stats = BeringeiScanStats(numServices, serviceDataValid);
+    }
+    if (decoder.getStats().getNumServices()) {
+      stats->merge(decoder.getStats());
+    }
+  }
+  if (mergeDeletedDataKeys) {
+    *mergeDeletedDataKeys += decoder.getMergeDeletedDataKeys();
+  }
+  return ret;
+}
+
+BeringeiScanShardDecoder::BeringeiScanShardDecoder(
+    BeringeiScanShardResult& result,
+    folly::Executor* executor,
+    size_t keysPerBatch,
+    size_t batchesAhead)
+    : result_(result),
+      executor_(executor),
+      keysPerBatch_(std::max<size_t>(keysPerBatch, 1)),
+      batchesAhead_(std::max<size_t>(batchesAhead, 1)),
+      nextKey_(0),
+      position_(0),
+      mergeDeletedDataKeys_(0) {
+  schedule();
+}
+
+BeringeiScanShardDecoder::~BeringeiScanShardDecoder() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (const auto& batch : batches_) {
+    ready_.wait(lock, [&]() { return batch->ready; });
+  }
+}
+
+void BeringeiScanShardDecoder::schedule() {
+  while (batches_.size() < batchesAhead_ && nextKey_ < result_.keys.size()) {
+    batches_.push_back(std::make_unique<Batch>());
+    Batch* batch = batches_.back().get();
+    batch->begin = nextKey_;
+    size_t end = std::min(nextKey_ + keysPerBatch_, result_.keys.size());
+    nextKey_ = end;
+
+    // Each key is only touched by the batch it's in, and the stats of
+    // the batch are only merged once it's ready.
+    executor_->add([this, batch, end]() {
+      batch->values.reserve(end - batch->begin);
+      for (size_t i = batch->begin; i < end; i++) {
+        batch->values.push_back(result_.takeUncompressedData(
+            i, &batch->stats, &batch->mergeDeletedDataKeys));
+      }
+
+      std::lock_guard<std::mutex> guard(mutex_);
+      batch->ready = true;
+      ready_.notify_all();
+    });
+  }
+}
+
+bool BeringeiScanShardDecoder::next(
+    size_t& index,
+    std::vector<TimeValuePair>& values) {
+  if (batches_.empty()) {
+    return false;
+  }
+
+  Batch* batch = batches_.front().get();
+  if (position_ == 0) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_.wait(lock, [&]() { return batch->ready; });
+    }
+
+    if (!stats_.getNumServices()) {
+      stats_ = batch->stats;
+    } else {
+      stats_.merge(batch->stats);
+    }
+    mergeDeletedDataKeys_ += batch->mergeDeletedDataKeys;
+  }
+
+  index = batch->begin + position_;
+  values = std::move(batch->values[position_]);
+  if (++position_ == batch->values.size()) {
+    position_ = 0;
+    batches_.pop_front();
+    schedule();
+  }
+  return true;
+}
+
+void appendScanShardChunk(ScanShardResult& result, ScanShardResult&& chunk) {
+  result.keys.insert(
+      result.keys.end(),
+      std::make_move_iterator(chunk.keys.begin()),
+      std::make_move_iterator(chunk.keys.end()));
+  result.data.insert(
+      result.data.end(),
+      std::make_move_iterator(chunk.data.begin()),
+      std::make_move_iterator(chunk.data.end()));
+  result.queriedRecently.insert(
+      result.queriedRecently.end(),
+      chunk.queriedRecently.begin(),
+      chunk.queriedRecently.end());
+  result.status = chunk.status;
+  result.moreEntries = chunk.moreEntries;
+  result.nextOffset = chunk.nextOffset;
+}
+
 BeringeiScanShardResultCollector::BeringeiScanShardResultCollector(
     size_t services,
     const ScanShardRequest& request)
@@ -260,6 +382,7 @@ bool BeringeiScanShardResultCollector::addResult(
   }
 
   StatusCode resultStatus = result.status;
+  bool moreChunks = result.moreEntries && result.status == StatusCode::OK;
 
   std::string mismatchName;
   size_t mismatchValue;
@@ -279,6 +402,8 @@ bool BeringeiScanShardResultCollector::addResult(
     if (resultStatus == StatusCode::OK) {
       resultStatus = StatusCode::RPC_FAIL;
     }
+  } else if (results_[service]) {
+    appendScanShardChunk(*results_[service], std::move(result));
   } else {
     results_[service] = std::make_unique<ScanShardResult>(std::move(result));
   }
@@ -292,6 +417,10 @@ bool BeringeiScanShardResultCollector::addResult(
     allSuccess_ = false;
   }
 
+  if (moreChunks && mismatchName.empty()) {
+    return false;
+  }
+
   CHECK_GE(remainingServices_, 1);
   --remainingServices_;
   return remainingServices_ == 0;
@@ -9,10 +9,15 @@
 
 #pragma once
 
+#include <bitset>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <folly/Executor.h>
 #include <folly/fibers/TimedMutex.h>
 
 #include "beringei/if/gen-cpp2/beringei_data_types.h"
@@ -141,12 +146,21 @@ struct BeringeiScanShardResult {
   // @param[inout] stats *stats is updated when stats is non-null and
   // data[index][key] merge without dropping data points for
   // 0 <= key < numServices.  On the first call, stats must reference a default
-  // constructed BeringeiScanStats object.
+  // constructed BeringeiScanStats object. The services are merged in one
+  // pass, so the points of a service are never lost by merging the ones
+  // after it and *mergeDeletedDataKeys is left unchanged.
   std::vector<TimeValuePair> takeUncompressedData(
       size_t index,
       BeringeiScanStats* stats = nullptr,
       int64_t* mergeDeletedDataKeys = nullptr);
 
+  // Return uncompressed time series for all the keys, decoding batches of
+  // keys in parallel on `executor`. Same stats as above.
+  std::vector<std::vector<TimeValuePair>> takeUncompressedData(
+      folly::Executor* executor,
+      BeringeiScanStats* stats = nullptr,
+      int64_t* mergeDeletedDataKeys = nullptr);
+
   // Return uncompressed time series for key[index] with no ownership transfer
   // Only for testing
   std::vector<TimeValuePair> getUncompressedData(
@@ -182,6 +196,75 @@ struct BeringeiScanShardResult {
   bool allSuccess;
 };
 
+// class BeringeiScanShardDecoder
+//
+// Yields the uncompressed time series of a BeringeiScanShardResult in key
+// order. Batches of keys are decoded on an executor, at most
+// `batchesAhead` batches ahead of the reader, and the compressed data of
+// each key is dropped once it has been decoded, so a large shard never
+// has to be held uncompressed all at once. The result must outlive the
+// decoder.
+class BeringeiScanShardDecoder {
+ public:
+  BeringeiScanShardDecoder(
+      BeringeiScanShardResult& result,
+      folly::Executor* executor,
+      size_t keysPerBatch = 1000,
+      size_t batchesAhead = 4);
+
+  // Waits for the batches that are still being decoded.
+  ~BeringeiScanShardDecoder();
+
+  // Moves the uncompressed time series of the next key to `values` and
+  // sets `index` to its index in `result.keys`. Returns false after the
+  // last key.
+  bool next(size_t& index, std::vector<TimeValuePair>& values);
+
+  // The stats of the keys returned so far, as with takeUncompressedData().
+  const BeringeiScanStats& getStats() const {
+    return stats_;
+  }
+
+  int64_t getMergeDeletedDataKeys() const {
+    return mergeDeletedDataKeys_;
+  }
+
+ private:
+  struct Batch {
+    size_t begin;
+    std::vector<std::vector<TimeValuePair>> values;
+    BeringeiScanStats stats;
+    int64_t mergeDeletedDataKeys = 0;
+    bool ready = false;
+  };
+
+  // Starts decoding batches until `batchesAhead_` are queued.
+  void schedule();
+
+  BeringeiScanShardResult& result_;
+  folly::Executor* executor_;
+  const size_t keysPerBatch_;
+  const size_t batchesAhead_;
+
+  // The first key of the next batch to schedule.
+  size_t nextKey_;
+
+  // The position of the reader in the front batch.
+  size_t position_;
+
+  BeringeiScanStats stats_;
+  int64_t mergeDeletedDataKeys_;
+
+  // Protects `ready` in the batches.
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::unique_ptr<Batch>> batches_;
+};
+
+// Append the keys and data of the next chunk of a paginated scan to
+// `result`. The status and pagination fields are taken from `chunk`.
+void appendScanShardChunk(ScanShardResult& result, ScanShardResult&& chunk);
+
 // Accumulate and consolidate Beringei ScanShard responses
 class BeringeiScanShardResultCollector {
  public:
@@ -189,6 +272,10 @@ class BeringeiScanShardResultCollector {
       size_t services,
       const ScanShardRequest& request);
 
+  // Chunks of a paginated scan can be added one at a time as they
+  // arrive. A service is complete once a result without `moreEntries`
+  // or with an error is added for it.
+  //
   // @return true on completion
   bool addResult(ScanShardResult&& result, size_t service);
 
@@ -0,0 +1,170 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/BlockCache.h"
+
+#include <algorithm>
+
+#include "beringei/lib/GorillaStatsManager.h"
+#include "beringei/lib/TimeSeries.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kHits = "gorilla_client.block_cache_hits";
+static const std::string kMisses = "gorilla_client.block_cache_misses";
+static const std::string kEvictions = "gorilla_client.block_cache_evictions";
+static const std::string kBytes = "gorilla_client.block_cache_bytes";
+
+// Approximate overhead of an entry in the list and the map.
+static const size_t kEntryOverhead = 128;
+
+size_t BlockCache::EntryKeyHash::operator()(const EntryKey& key) const {
+  size_t hash = std::hash<std::string>()(*key.service);
+  hash = hash * 31 + std::hash<std::string>()(*key.key);
+  return hash * 31 + std::hash<int64_t>()(key.bucketStart);
+}
+
+BlockCache::BlockCache(size_t maxBytes, int64_t bucketSecs, int64_t minAgeSecs)
+    : maxBytes_(maxBytes),
+      bucketSecs_(std::max<int64_t>(bucketSecs, 1)),
+      minAgeSecs_(minAgeSecs),
+      bytes_(0) {
+  GorillaStatsManager::addStatExportType(kHits, SUM);
+  GorillaStatsManager::addStatExportType(kMisses, SUM);
+  GorillaStatsManager::addStatExportType(kEvictions, SUM);
+}
+
+int64_t BlockCache::getBucketStart(int64_t unixTime) const {
+  int64_t bucketStart = unixTime - unixTime % bucketSecs_;
+  return bucketStart > unixTime ? bucketStart - bucketSecs_ : bucketStart;
+}
+
+int64_t BlockCache::getBlocks(
+    const std::string& service,
+    const std::string& key,
+    int64_t begin,
+    int64_t end,
+    int64_t now,
+    std::vector<TimeSeriesBlock>& blocks) {
+  int64_t bucketStart = getBucketStart(begin);
+  int hits = 0;
+  bool missed = false;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (; bucketStart <= end && isFinal(bucketStart, now);
+         bucketStart += bucketSecs_) {
+      auto it = entries_.find({&service, &key, bucketStart});
+      if (it == entries_.end()) {
+        missed = true;
+        break;
+      }
+
+      lru_.splice(lru_.begin(), lru_, it->second);
+      blocks.push_back(it->second->block);
+      hits++;
+    }
+  }
+
+  if (hits > 0) {
+    GorillaStatsManager::addStatValue(kHits, hits);
+  }
+  if (missed) {
+    GorillaStatsManager::addStatValue(kMisses);
+  }
+  return bucketStart;
+}
+
+void BlockCache::putBlocks(
+    const std::string& service,
+    const std::string& key,
+    const std::vector<TimeSeriesBlock>& blocks,
+    int64_t begin,
+    int64_t end,
+    int64_t now) {
+  int64_t first = getBucketStart(begin);
+  if (first < begin) {
+    first += bucketSecs_;
+  }
+
+  int64_t last = first;
+  while (last + bucketSecs_ - 1 <= end && isFinal(last, now)) {
+    last += bucketSecs_;
+  }
+  if (last == first) {
+    return;
+  }
+
+  std::vector<TimeValuePair> values;
+  TimeSeries::getValues(blocks, values, first, last - 1);
+
+  std::vector<Entry> newEntries;
+  auto value = values.begin();
+  for (int64_t bucketStart = first; bucketStart < last;
+       bucketStart += bucketSecs_) {
+    auto bucketEnd = std::find_if(value, values.end(), [&](const auto& tv) {
+      return tv.unixTime >= bucketStart + bucketSecs_;
+    });
+
+    newEntries.emplace_back();
+    Entry& entry = newEntries.back();
+    entry.service = service;
+    entry.key = key;
+    entry.bucketStart = bucketStart;
+    if (bucketEnd != value) {
+      TimeSeries::writeValues({value, bucketEnd}, entry.block);
+    }
+    value = bucketEnd;
+  }
+
+  int evictions = 0;
+  size_t bytes;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto& entry : newEntries) {
+      size_t size = getMemoryUsage(entry);
+      if (size > maxBytes_ ||
+          entries_.count({&service, &key, entry.bucketStart})) {
+        continue;
+      }
+
+      while (bytes_ + size > maxBytes_ && !lru_.empty()) {
+        const Entry& last = lru_.back();
+        entries_.erase({&last.service, &last.key, last.bucketStart});
+        bytes_ -= getMemoryUsage(last);
+        lru_.pop_back();
+        evictions++;
+      }
+
+      lru_.push_front(std::move(entry));
+      const Entry& cached = lru_.front();
+      entries_[{&cached.service, &cached.key, cached.bucketStart}] =
+          lru_.begin();
+      bytes_ += size;
+    }
+    bytes = bytes_;
+  }
+
+  if (evictions > 0) {
+    GorillaStatsManager::addStatValue(kEvictions, evictions);
+  }
+  GorillaStatsManager::setCounter(kBytes, bytes);
+}
+
+size_t BlockCache::getMemoryUsage() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return bytes_;
+}
+
+size_t BlockCache::getMemoryUsage(const Entry& entry) {
+  return kEntryOverhead + entry.service.size() + entry.key.size() +
+      entry.block.data.size() + entry.block.checkpoints.size();
+}
+}
+} // facebook::gorilla
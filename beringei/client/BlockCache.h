@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class BlockCache
+//
+// Keeps the compressed blocks of the buckets that a read service won't
+// change anymore, so that reading the same time range again only fetches
+// the newest data. Buckets are `bucketSecs` long and can be cached once
+// they ended more than `minAgeSecs` ago. The least recently used buckets
+// are evicted once the blocks take more than `maxBytes`.
+class BlockCache {
+ public:
+  BlockCache(size_t maxBytes, int64_t bucketSecs, int64_t minAgeSecs);
+
+  int64_t getBucketSecs() const {
+    return bucketSecs_;
+  }
+
+  // Returns the start of the bucket that contains `unixTime`.
+  int64_t getBucketStart(int64_t unixTime) const;
+
+  // Appends one block for each bucket from the one that contains `begin`
+  // to `blocks`, for as long as they are cached. Stops after the bucket
+  // that contains `end`. Returns the start of the first bucket that
+  // wasn't appended.
+  int64_t getBlocks(
+      const std::string& service,
+      const std::string& key,
+      int64_t begin,
+      int64_t end,
+      int64_t now,
+      std::vector<TimeSeriesBlock>& blocks);
+
+  // Caches the values of `blocks` in each bucket that is entirely
+  // between `begin` and `end` inclusive and ended long enough before
+  // `now`.
+  void putBlocks(
+      const std::string& service,
+      const std::string& key,
+      const std::vector<TimeSeriesBlock>& blocks,
+      int64_t begin,
+      int64_t end,
+      int64_t now);
+
+  size_t getMemoryUsage();
+
+ private:
+  struct Entry {
+    std::string service;
+    std::string key;
+    int64_t bucketStart;
+    TimeSeriesBlock block;
+  };
+
+  struct EntryKey {
+    const std::string* service;
+    const std::string* key;
+    int64_t bucketStart;
+
+    bool operator==(const EntryKey& other) const {
+      return *service == *other.service && *key == *other.key &&
+          bucketStart == other.bucketStart;
+    }
+  };
+
+  struct EntryKeyHash {
+    size_t operator()(const EntryKey& key) const;
+  };
+
+  static size_t getMemoryUsage(const Entry& entry);
+
+  bool isFinal(int64_t bucketStart, int64_t now) const {
+    return bucketStart + bucketSecs_ + minAgeSecs_ <= now;
+  }
+
+  const size_t maxBytes_;
+  const int64_t bucketSecs_;
+  const int64_t minAgeSecs_;
+
+  std::mutex mutex_;
+
+  // The most recently used entry first. The keys of `entries_` point to
+  // the strings in the list.
+  std::list<Entry> lru_;
+  std::unordered_map<EntryKey, std::list<Entry>::iterator, EntryKeyHash>
+      entries_;
+  size_t bytes_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+namespace facebook {
+namespace gorilla {
+
+// class DelayQueue
+//
+// A bounded queue of items that become ready at a given time. pop()
+// returns the item that is due first, waiting until it's due, so items
+// with a short delay don't wait behind ones with a long delay. Items
+// that are due at the same time come out in the order they were pushed.
+//
+// All the functions can be called from any number of threads.
+template <typename T>
+class DelayQueue {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit DelayQueue(size_t capacity) : capacity_(capacity), sequence_(0) {}
+
+  // Returns false if the queue is full, unless `force` is set. `item` is
+  // only moved from when it's pushed.
+  bool push(T&& item, Clock::time_point due, bool force = false) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (!force && items_.size() >= capacity_) {
+        return false;
+      }
+      items_.push({due, sequence_++, std::move(item)});
+    }
+
+    // Every waiter has to look again if the new item is due first.
+    ready_.notify_all();
+    return true;
+  }
+
+  // Blocks until the first item is due and moves it to `item`.
+  void pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (items_.empty()) {
+        ready_.wait(lock);
+      } else if (items_.top().due > Clock::now()) {
+        ready_.wait_until(lock, items_.top().due);
+      } else {
+        break;
+      }
+    }
+
+    // The top of a priority_queue is const, but the item is popped right
+    // after being moved.
+    item = std::move(const_cast<Entry&>(items_.top()).item);
+    items_.pop();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return items_.size();
+  }
+
+ private:
+  struct Entry {
+    Clock::time_point due;
+    uint64_t sequence;
+    T item;
+
+    bool operator<(const Entry& other) const {
+      // Reversed to make the earliest entry the top.
+      if (due != other.due) {
+        return due > other.due;
+      }
+      return sequence > other.sequence;
+    }
+  };
+
+  const size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::priority_queue<Entry> items_;
+  uint64_t sequence_;
+};
+}
+} // facebook::gorilla
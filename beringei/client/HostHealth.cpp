@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "beringei/client/HostHealth.h"
+
+#include <algorithm>
+
+#include <folly/Random.h>
+
+#include "beringei/lib/GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kCircuitOpened = "gorilla_client.circuit_opened";
+
+HostHealth::HostHealth(
+    int failureThreshold,
+    int64_t baseBackoffMs,
+    int64_t maxBackoffMs)
+    : failureThreshold_(std::max(failureThreshold, 1)),
+      baseBackoffMs_(baseBackoffMs),
+      maxBackoffMs_(std::max(maxBackoffMs, baseBackoffMs)),
+      numHosts_(0) {
+  GorillaStatsManager::addStatExportType(kCircuitOpened, SUM);
+}
+
+bool HostHealth::allow(const HostInfo& host, int64_t nowMs) {
+  if (numHosts_.load(std::memory_order_relaxed) == 0) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = hosts_.find(host);
+  if (it == hosts_.end() || it->second.failures < failureThreshold_) {
+    return true;
+  }
+
+  Health& health = it->second;
+  if (health.openUntilMs > nowMs) {
+    return false;
+  }
+
+  // Let one probe through. Another one follows after the base backoff
+  // if it never reports back.
+  health.openUntilMs = nowMs + baseBackoffMs_;
+  health.probing = true;
+  return true;
+}
+
+void HostHealth::onSuccess(const HostInfo& host) {
+  if (numHosts_.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (hosts_.erase(host) > 0) {
+    numHosts_ = hosts_.size();
+  }
+}
+
+void HostHealth::onFailure(const HostInfo& host, int64_t nowMs) {
+  bool opened = false;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Health& health = hosts_[host];
+    numHosts_ = hosts_.size();
+    health.failures++;
+
+    // Requests that were sent before the breaker opened don't open it
+    // again, only the probes do.
+    bool open = health.failures > failureThreshold_ && !health.probing &&
+        health.openUntilMs > nowMs;
+    if (health.failures >= failureThreshold_ && !open) {
+      int64_t backoff = backoffMs(
+          health.opened,
+          baseBackoffMs_,
+          maxBackoffMs_,
+          folly::Random::rand32());
+      health.openUntilMs = nowMs + backoff;
+      health.opened++;
+      health.probing = false;
+      opened = true;
+    }
+  }
+
+  if (opened) {
+    GorillaStatsManager::addStatValue(kCircuitOpened);
+  }
+}
+
+int HostHealth::numOpen(int64_t nowMs) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  int open = 0;
+  for (const auto& host : hosts_) {
+    if (host.second.failures >= failureThreshold_ &&
+        host.second.openUntilMs > nowMs) {
+      open++;
+    }
+  }
+  return open;
+}
+
+int64_t HostHealth::backoffMs(
+    int attempt,
+    int64_t baseMs,
+    int64_t maxMs,
+    uint32_t random) {
+  int64_t delay = baseMs;
+  for (int i = 0; i < attempt && delay < maxMs; i++) {
+    delay *= 2;
+  }
+  delay = std::min(delay, maxMs);
+
+  int64_t half = delay / 2;
+  if (half == 0) {
+    return delay;
+  }
+  return delay - half + random % (half + 1);
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <folly/hash/Hash.h>
+
+namespace facebook {
+namespace gorilla {
+
+// class HostHealth
+//
+// A circuit breaker per host. After `failureThreshold` requests to a
+// host fail in a row, the host is skipped for a backoff that doubles
+// with each time it opens again, up to `maxBackoffMs`, and is jittered
+// so that clients don't all come back at once. When the backoff is over
+// a single request is let through to probe the host, and the first
+// success closes the breaker again.
+//
+// Hosts that never failed aren't kept, so checking them only costs an
+// atomic load while all the hosts are healthy.
+class HostHealth {
+ public:
+  typedef std::pair<std::string, int> HostInfo;
+
+  HostHealth(int failureThreshold, int64_t baseBackoffMs, int64_t maxBackoffMs);
+
+  // Returns false if requests to the host should be skipped for now.
+  bool allow(const HostInfo& host, int64_t nowMs);
+
+  void onSuccess(const HostInfo& host);
+  void onFailure(const HostInfo& host, int64_t nowMs);
+
+  // Returns the number of hosts that are being skipped.
+  int numOpen(int64_t nowMs);
+
+  // Returns a delay of `baseMs` doubled `attempt` times, capped at
+  // `maxMs`, of which the second half is chosen by `random`.
+  static int64_t backoffMs(
+      int attempt,
+      int64_t baseMs,
+      int64_t maxMs,
+      uint32_t random);
+
+ private:
+  struct Health {
+    int failures = 0;
+    int opened = 0;
+    int64_t openUntilMs = 0;
+    bool probing = false;
+  };
+
+  const int failureThreshold_;
+  const int64_t baseBackoffMs_;
+  const int64_t maxBackoffMs_;
+
+  std::mutex mutex_;
+  std::unordered_map<HostInfo, Health> hosts_;
+  std::atomic<int> numHosts_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/KeyIdCache.h"
+
+namespace facebook {
+namespace gorilla {
+
+void KeyIdCache::encode(
+    const HostInfo& host,
+    PutDataRequest& request,
+    std::vector<DataPoint>& sent) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto& ids = ids_[host];
+  if (!ids.empty()) {
+    // The points that keep their keys are compacted in place.
+    size_t withKeys = 0;
+    for (auto& dp : request.data) {
+      auto it = ids.find(dp.key.key);
+      if (it == ids.end()) {
+        if (&request.data[withKeys] != &dp) {
+          request.data[withKeys] = std::move(dp);
+        }
+        withKeys++;
+        continue;
+      }
+
+      request.dataWithKeyIds.emplace_back();
+      DataPointWithKeyId& point = request.dataWithKeyIds.back();
+      point.shardId = dp.key.shardId;
+      point.keyId = it->second;
+      point.value = dp.value;
+      point.categoryId = dp.categoryId;
+      sent.push_back(std::move(dp));
+    }
+    request.data.resize(withKeys);
+  }
+
+  request.wantKeyIds = !request.data.empty() && ids.size() < maxKeysPerHost_;
+}
+
+void KeyIdCache::decode(
+    const HostInfo& host,
+    const PutDataRequest& request,
+    const PutDataResult& result,
+    std::vector<DataPoint>& sent,
+    std::vector<DataPoint>& dropped) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto& ids = ids_[host];
+  if (result.keyIds.size() == request.data.size()) {
+    for (int i = 0; i < result.keyIds.size(); i++) {
+      if (result.keyIds[i].id >= 0 && ids.size() < maxKeysPerHost_) {
+        ids[request.data[i].key.key] = result.keyIds[i];
+      }
+    }
+  }
+
+  for (int i : result.rejectedKeyIds) {
+    if (i < 0 || i >= sent.size()) {
+      continue;
+    }
+
+    // Overloaded hosts reject the points without looking at the ids.
+    if (result.status != StatusCode::OVERLOADED) {
+      ids.erase(sent[i].key.key);
+    }
+    dropped.push_back(std::move(sent[i]));
+  }
+}
+
+size_t KeyIdCache::size(const HostInfo& host) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = ids_.find(host);
+  return it == ids_.end() ? 0 : it->second.size();
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <folly/hash/Hash.h>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class KeyIdCache
+//
+// Remembers the key ids that Beringei hosts return for put requests, so
+// that later points for the same keys can be sent with an id instead of
+// the key. A host rejects ids once they are no longer valid, for
+// example after the shard moved or the host restarted, and the points
+// are then sent again with their keys.
+class KeyIdCache {
+ public:
+  typedef std::pair<std::string, int> HostInfo;
+
+  // Stops learning new ids for a host once it has `maxKeysPerHost`.
+  explicit KeyIdCache(size_t maxKeysPerHost = 1000000)
+      : maxKeysPerHost_(maxKeysPerHost) {}
+
+  // Moves the points of `request` that have ids on `host` to
+  // `request.dataWithKeyIds`, and appends the original points to `sent`
+  // in the same order. Asks for the ids of the points left in
+  // `request.data`.
+  void encode(
+      const HostInfo& host,
+      PutDataRequest& request,
+      std::vector<DataPoint>& sent);
+
+  // Learns the ids returned for the points in `request.data`, and
+  // appends the points of `sent` that were rejected to `dropped`.
+  void decode(
+      const HostInfo& host,
+      const PutDataRequest& request,
+      const PutDataResult& result,
+      std::vector<DataPoint>& sent,
+      std::vector<DataPoint>& dropped);
+
+  size_t size(const HostInfo& host);
+
+ private:
+  const size_t maxKeysPerHost_;
+
+  std::mutex mutex_;
+  std::unordered_map<HostInfo, std::unordered_map<std::string, KeyId>> ids_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/KeyRegistry.h"
+
+#include <limits>
+
+#include <glog/logging.h>
+
+namespace facebook {
+namespace gorilla {
+
+const KeyHandle KeyRegistry::kInvalidHandle =
+    std::numeric_limits<KeyHandle>::max();
+
+KeyHandle KeyRegistry::registerKey(const Key& key) {
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    auto it = handles_.find(key.key);
+    if (it != handles_.end() && keys_[it->second].shardId == key.shardId) {
+      return it->second;
+    }
+  }
+
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  auto it = handles_.find(key.key);
+  if (it != handles_.end() && keys_[it->second].shardId == key.shardId) {
+    return it->second;
+  }
+
+  if (keys_.size() >= kInvalidHandle) {
+    LOG(ERROR) << "Too many registered keys";
+    return kInvalidHandle;
+  }
+
+  KeyHandle handle = keys_.size();
+  keys_.push_back(key);
+  handles_[key.key] = handle;
+  return handle;
+}
+
+const Key* KeyRegistry::getKey(KeyHandle handle) {
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  return handle < keys_.size() ? &keys_[handle] : nullptr;
+}
+
+int KeyRegistry::getDataPoints(
+    const std::vector<RegisteredDataPoint>& points,
+    std::vector<DataPoint>& dataPoints) {
+  int invalid = 0;
+  dataPoints.reserve(dataPoints.size() + points.size());
+
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  for (const auto& point : points) {
+    if (point.key >= keys_.size()) {
+      invalid++;
+      continue;
+    }
+
+    dataPoints.emplace_back();
+    DataPoint& dp = dataPoints.back();
+    dp.key = keys_[point.key];
+    dp.value = point.value;
+    dp.categoryId = point.categoryId;
+  }
+
+  if (invalid > 0) {
+    LOG(ERROR) << "Skipped " << invalid << " points with invalid key handles";
+  }
+  return invalid;
+}
+
+size_t KeyRegistry::size() {
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  return keys_.size();
+}
+}
+} // facebook::gorilla
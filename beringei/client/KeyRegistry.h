@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <folly/synchronization/RWSpinLock.h>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+typedef uint32_t KeyHandle;
+
+// A data point for a key that was registered with a KeyRegistry.
+struct RegisteredDataPoint {
+  KeyHandle key;
+  TimeValuePair value;
+  int32_t categoryId;
+};
+
+// class KeyRegistry
+//
+// Hands out small integer handles for keys that are written over and
+// over again, so that writers keep the key text and its shard id in one
+// place instead of building them again for every point. Keys are never
+// unregistered.
+class KeyRegistry {
+ public:
+  static const KeyHandle kInvalidHandle;
+
+  // Returns the handle of `key`, registering it the first time.
+  // Registering a key again with another shard id gives it a new handle,
+  // and the old one keeps pointing to the old shard.
+  KeyHandle registerKey(const Key& key);
+
+  // Returns the key of `handle`, or nullptr if it was never handed out.
+  // The key stays valid for the lifetime of the registry.
+  const Key* getKey(KeyHandle handle);
+
+  // Appends a DataPoint for each of `points` to `dataPoints`. Returns
+  // the number of points that were skipped because of an invalid
+  // handle.
+  int getDataPoints(
+      const std::vector<RegisteredDataPoint>& points,
+      std::vector<DataPoint>& dataPoints);
+
+  size_t size();
+
+ private:
+  folly::RWSpinLock lock_;
+
+  // Indexed by handle. A deque doesn't move the keys as it grows.
+  std::deque<Key> keys_;
+  std::unordered_map<std::string, KeyHandle> handles_;
+};
+}
+} // facebook::gorilla
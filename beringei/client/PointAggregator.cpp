@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/PointAggregator.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+namespace facebook {
+namespace gorilla {
+
+constexpr int PointAggregator::kStripes;
+
+bool PointAggregator::parseFunction(
+    const std::string& name,
+    Function& function) {
+  if (name == "last") {
+    function = LAST;
+  } else if (name == "sum") {
+    function = SUM;
+  } else if (name == "max") {
+    function = MAX;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+PointAggregator::PointAggregator(Function function, int64_t windowSecs)
+    : function_(function),
+      windowSecs_(std::max<int64_t>(windowSecs, 1)),
+      stripes_(new Stripe[kStripes]) {}
+
+void PointAggregator::add(
+    std::vector<DataPoint>& points,
+    std::vector<DataPoint>& out) {
+  // The points are grouped by stripe so that each lock is taken once.
+  std::vector<std::vector<uint32_t>> byStripe(kStripes);
+  for (uint32_t i = 0; i < points.size(); i++) {
+    if (points[i].value.unixTime <= 0) {
+      out.push_back(std::move(points[i]));
+      continue;
+    }
+    size_t hash = std::hash<std::string>()(points[i].key.key);
+    byStripe[hash % kStripes].push_back(i);
+  }
+
+  for (int s = 0; s < kStripes; s++) {
+    if (byStripe[s].empty()) {
+      continue;
+    }
+
+    Stripe& stripe = stripes_[s];
+    std::lock_guard<std::mutex> guard(stripe.mutex);
+    for (uint32_t i : byStripe[s]) {
+      DataPoint& dp = points[i];
+      int64_t start = dp.value.unixTime - dp.value.unixTime % windowSecs_;
+      auto it = stripe.windows.find(dp.key.key);
+      if (it == stripe.windows.end()) {
+        Window window;
+        window.start = start;
+        window.point = std::move(dp);
+        stripe.windows.emplace(window.point.key.key, std::move(window));
+        continue;
+      }
+
+      Window& window = it->second;
+      if (start < window.start) {
+        out.push_back(std::move(dp));
+      } else if (start == window.start) {
+        combine(window.point, dp);
+      } else {
+        out.push_back(std::move(window.point));
+        window.start = start;
+        window.point = std::move(dp);
+      }
+    }
+  }
+  points.clear();
+}
+
+void PointAggregator::flush(int64_t now, std::vector<DataPoint>& out) {
+  for (int s = 0; s < kStripes; s++) {
+    Stripe& stripe = stripes_[s];
+    std::lock_guard<std::mutex> guard(stripe.mutex);
+    for (auto it = stripe.windows.begin(); it != stripe.windows.end();) {
+      if (it->second.start + windowSecs_ <= now) {
+        out.push_back(std::move(it->second.point));
+        it = stripe.windows.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+void PointAggregator::flushAll(std::vector<DataPoint>& out) {
+  flush(std::numeric_limits<int64_t>::max() - windowSecs_, out);
+}
+
+size_t PointAggregator::size() {
+  size_t size = 0;
+  for (int s = 0; s < kStripes; s++) {
+    std::lock_guard<std::mutex> guard(stripes_[s].mutex);
+    size += stripes_[s].windows.size();
+  }
+  return size;
+}
+
+void PointAggregator::combine(DataPoint& aggregate, const DataPoint& dp)
+    const {
+  switch (function_) {
+    case LAST:
+      if (dp.value.unixTime >= aggregate.value.unixTime) {
+        aggregate.value.value = dp.value.value;
+      }
+      break;
+    case SUM:
+      aggregate.value.value += dp.value.value;
+      break;
+    case MAX:
+      aggregate.value.value = std::max(aggregate.value.value, dp.value.value);
+      break;
+  }
+  aggregate.value.unixTime =
+      std::max(aggregate.value.unixTime, dp.value.unixTime);
+  aggregate.categoryId = dp.categoryId;
+}
+}
+} // facebook::gorilla
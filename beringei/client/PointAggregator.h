@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class PointAggregator
+//
+// Combines the points of each key in fixed windows of time before they
+// are queued, so that writers that produce many points per key within
+// the minimum timestamp delta of the services don't send points that
+// would be dropped as spam. A window of a key is sent as one point with
+// the timestamp of its newest point once a point of a newer window
+// arrives or once the window is over.
+//
+// The keys are split into stripes, each with its own lock, so writers
+// on many threads only contend for the keys of the same stripe.
+class PointAggregator {
+ public:
+  enum Function {
+    LAST,
+    SUM,
+    MAX,
+  };
+
+  // Returns false if `name` isn't "last", "sum" or "max".
+  static bool parseFunction(const std::string& name, Function& function);
+
+  PointAggregator(Function function, int64_t windowSecs);
+
+  // Adds `points` to the windows of their keys and clears it. Appends
+  // the windows that are complete to `out`, as well as the points that
+  // can't be aggregated because they are older than the window of their
+  // key or have no timestamp.
+  void add(std::vector<DataPoint>& points, std::vector<DataPoint>& out);
+
+  // Appends the windows that end at or before `now` to `out`.
+  void flush(int64_t now, std::vector<DataPoint>& out);
+
+  // Appends all the windows to `out`.
+  void flushAll(std::vector<DataPoint>& out);
+
+  // The number of keys with an open window.
+  size_t size();
+
+ private:
+  struct Window {
+    int64_t start;
+    DataPoint point;
+  };
+
+  static constexpr int kStripes = 64;
+  struct Stripe {
+    std::mutex mutex;
+    std::unordered_map<std::string, Window> windows;
+  };
+
+  void combine(DataPoint& aggregate, const DataPoint& dp) const;
+
+  const Function function_;
+  const int64_t windowSecs_;
+  std::unique_ptr<Stripe[]> stripes_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,300 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "beringei/client/PointSpool.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "beringei/lib/GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kSpoolPointsWritten =
+    "gorilla_client.spool_points_written";
+static const std::string kSpoolPointsRead = "gorilla_client.spool_points_read";
+static const std::string kSpoolPointsRejected =
+    "gorilla_client.spool_points_rejected";
+
+static const std::string kSpoolPrefix = "spool";
+
+// The length of the key, the shard, the timestamp, the value and the
+// category.
+static const size_t kFixedBytes = sizeof(uint32_t) + sizeof(int64_t) +
+    sizeof(int64_t) + sizeof(double) + sizeof(int32_t);
+
+template <typename T>
+static void append(std::string& out, T value) {
+  out.append((const char*)&value, sizeof(value));
+}
+
+template <typename T>
+static T extract(const std::string& data, size_t& offset) {
+  T value;
+  memcpy(&value, data.data() + offset, sizeof(value));
+  offset += sizeof(value);
+  return value;
+}
+
+PointSpool::PointSpool(
+    const std::string& directory,
+    int64_t id,
+    size_t maxMemoryBytes,
+    size_t maxDiskBytes,
+    size_t segmentBytes)
+    : maxMemoryBytes_(maxMemoryBytes),
+      maxDiskBytes_(maxDiskBytes),
+      segmentBytes_(segmentBytes),
+      files_(id, kSpoolPrefix, directory),
+      bufferOffset_(0),
+      out_({nullptr, ""}),
+      outId_(0),
+      outBytes_(0),
+      nextId_(0),
+      diskBytes_(0),
+      readOffset_(0),
+      readId_(-1),
+      oldestUnixTime_(0) {
+  GorillaStatsManager::addStatExportType(kSpoolPointsWritten, SUM);
+  GorillaStatsManager::addStatExportType(kSpoolPointsRead, SUM);
+  GorillaStatsManager::addStatExportType(kSpoolPointsRejected, SUM);
+
+  files_.createDirectories();
+  for (int64_t segment : files_.ls()) {
+    auto file = files_.open(segment, "rb", 0);
+    if (!file.file) {
+      continue;
+    }
+    fseek(file.file, 0, SEEK_END);
+    long size = ftell(file.file);
+    fclose(file.file);
+
+    if (size > 0) {
+      segments_.emplace_back(segment, size);
+      diskBytes_ += size;
+    } else {
+      files_.remove(segment);
+    }
+    nextId_ = segment + 1;
+  }
+
+  if (!segments_.empty()) {
+    LOG(INFO) << "Found " << diskBytes_ << " bytes of spooled data points in "
+              << segments_.size() << " segments";
+  }
+}
+
+PointSpool::~PointSpool() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  flushLocked();
+  if (out_.file) {
+    closeSegmentLocked();
+  }
+}
+
+void PointSpool::encode(const DataPoint& dp, std::string& out) {
+  append<uint32_t>(out, dp.key.key.size());
+  out += dp.key.key;
+  append<int64_t>(out, dp.key.shardId);
+  append<int64_t>(out, dp.value.unixTime);
+  append<double>(out, dp.value.value);
+  append<int32_t>(out, dp.categoryId);
+}
+
+bool PointSpool::decode(
+    const std::string& data,
+    size_t& offset,
+    DataPoint& dp) {
+  if (data.size() - offset < kFixedBytes) {
+    return false;
+  }
+
+  size_t end = offset;
+  uint32_t keySize = extract<uint32_t>(data, end);
+  if (data.size() - end < kFixedBytes - sizeof(uint32_t) + keySize) {
+    return false;
+  }
+
+  dp.key.key.assign(data, end, keySize);
+  end += keySize;
+  dp.key.shardId = extract<int64_t>(data, end);
+  dp.value.unixTime = extract<int64_t>(data, end);
+  dp.value.value = extract<double>(data, end);
+  dp.categoryId = extract<int32_t>(data, end);
+  offset = end;
+  return true;
+}
+
+bool PointSpool::write(const std::vector<DataPoint>& points) {
+  std::string records;
+  for (const auto& dp : points) {
+    encode(dp, records);
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  size_t pending = buffer_.size() - bufferOffset_ + records.size();
+  if (pending > maxMemoryBytes_ &&
+      diskBytes_ + outBytes_ + pending > maxDiskBytes_) {
+    GorillaStatsManager::addStatValue(kSpoolPointsRejected, points.size());
+    return false;
+  }
+
+  if (getBytesLocked() == 0 && !points.empty()) {
+    oldestUnixTime_ = points.front().value.unixTime;
+  }
+  buffer_ += records;
+  if (pending >= maxMemoryBytes_) {
+    flushLocked();
+  }
+  GorillaStatsManager::addStatValue(kSpoolPointsWritten, points.size());
+  return true;
+}
+
+size_t PointSpool::read(size_t maxPoints, std::vector<DataPoint>& points) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  size_t read = 0;
+  DataPoint dp;
+  while (read < maxPoints && readFromDiskLocked(dp)) {
+    points.push_back(std::move(dp));
+    read++;
+  }
+
+  // The disk is empty, so the rest of the points are in memory.
+  while (read < maxPoints && decode(buffer_, bufferOffset_, dp)) {
+    points.push_back(std::move(dp));
+    read++;
+  }
+  if (bufferOffset_ == buffer_.size()) {
+    buffer_.clear();
+    bufferOffset_ = 0;
+  }
+
+  if (read > 0) {
+    oldestUnixTime_ = points.back().value.unixTime;
+    GorillaStatsManager::addStatValue(kSpoolPointsRead, read);
+  }
+  return read;
+}
+
+bool PointSpool::readFromDiskLocked(DataPoint& dp) {
+  while (true) {
+    if (readId_ >= 0) {
+      if (decode(readData_, readOffset_, dp)) {
+        if (readOffset_ == readData_.size()) {
+          files_.remove(readId_);
+          readId_ = -1;
+          readData_.clear();
+        }
+        return true;
+      }
+
+      if (readOffset_ < readData_.size()) {
+        LOG(ERROR) << "Skipping " << readData_.size() - readOffset_
+                   << " bytes at the end of spool segment " << readId_;
+      }
+      files_.remove(readId_);
+      readId_ = -1;
+      readData_.clear();
+    }
+
+    // Points that were written to the current segment are read before
+    // the ones in memory.
+    if (segments_.empty() && out_.file) {
+      closeSegmentLocked();
+    }
+    if (segments_.empty()) {
+      return false;
+    }
+
+    readId_ = segments_.front().first;
+    diskBytes_ -= segments_.front().second;
+    segments_.pop_front();
+    readOffset_ = 0;
+    if (!files_.read(readId_, readData_)) {
+      readData_.clear();
+    }
+  }
+}
+
+void PointSpool::flush() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  flushLocked();
+}
+
+bool PointSpool::flushLocked() {
+  size_t pending = buffer_.size() - bufferOffset_;
+  if (pending == 0) {
+    return true;
+  }
+  if (diskBytes_ + outBytes_ + pending > maxDiskBytes_) {
+    return false;
+  }
+
+  if (!out_.file) {
+    outId_ = nextId_++;
+    out_ = files_.open(outId_, "wb", 0);
+    if (!out_.file) {
+      return false;
+    }
+  }
+
+  size_t written =
+      fwrite(buffer_.data() + bufferOffset_, 1, pending, out_.file);
+  outBytes_ += written;
+  if (written != pending) {
+    PLOG(ERROR) << "Failed to write to " << out_.name;
+    closeSegmentLocked();
+    return false;
+  }
+
+  buffer_.clear();
+  bufferOffset_ = 0;
+  if (outBytes_ >= segmentBytes_) {
+    closeSegmentLocked();
+  }
+  return true;
+}
+
+void PointSpool::closeSegmentLocked() {
+  FileUtils::closeFile(out_, false);
+  out_.file = nullptr;
+  if (outBytes_ > 0) {
+    segments_.emplace_back(outId_, outBytes_);
+    diskBytes_ += outBytes_;
+  } else {
+    files_.remove(outId_);
+  }
+  outBytes_ = 0;
+}
+
+size_t PointSpool::getBytes() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return getBytesLocked();
+}
+
+size_t PointSpool::getBytesLocked() const {
+  size_t bytes = diskBytes_ + outBytes_ + buffer_.size() - bufferOffset_;
+  if (readId_ >= 0) {
+    bytes += readData_.size() - readOffset_;
+  }
+  return bytes;
+}
+
+int64_t PointSpool::getLagSecs(int64_t now) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (getBytesLocked() == 0) {
+    return 0;
+  }
+  return std::max<int64_t>(now - oldestUnixTime_, 0);
+}
+}
+} // facebook::gorilla
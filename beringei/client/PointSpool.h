@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+#include "beringei/lib/FileUtils.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class PointSpool
+//
+// Keeps data points that didn't fit in the queues of a write service
+// until they can be sent. The points are buffered in memory up to
+// `maxMemoryBytes` and then appended to segment files of about
+// `segmentBytes` in `directory`/`id`, in one write each. Points are
+// read back oldest first and segments are removed once they have been
+// read. Segments left from before a restart are read after it.
+//
+// Points that don't fit in memory or on disk are rejected. Points that
+// have been read are not written back, so a crash while sending them
+// loses them.
+//
+// All the functions can be called from any number of threads.
+class PointSpool {
+ public:
+  PointSpool(
+      const std::string& directory,
+      int64_t id,
+      size_t maxMemoryBytes,
+      size_t maxDiskBytes,
+      size_t segmentBytes);
+
+  // Writes the buffered points to disk.
+  ~PointSpool();
+
+  // Returns false if the points don't fit.
+  bool write(const std::vector<DataPoint>& points);
+
+  // Moves up to `maxPoints` of the oldest points to `points`. Returns
+  // the number of points read.
+  size_t read(size_t maxPoints, std::vector<DataPoint>& points);
+
+  // Writes the buffered points to disk.
+  void flush();
+
+  // Returns the size of the points that haven't been read.
+  size_t getBytes();
+
+  // Returns how far behind `now` the timestamps of the next points to
+  // be read are, in seconds. 0 when the spool is empty.
+  int64_t getLagSecs(int64_t now);
+
+  static void encode(const DataPoint& dp, std::string& out);
+
+  // Decodes the point at `offset` and moves `offset` past it. Returns
+  // false if `data` ends before the point does.
+  static bool decode(const std::string& data, size_t& offset, DataPoint& dp);
+
+ private:
+  size_t getBytesLocked() const;
+
+  // Returns false if the points couldn't be written.
+  bool flushLocked();
+  void closeSegmentLocked();
+
+  // Reads the next point from the disk. Returns false if there aren't
+  // any.
+  bool readFromDiskLocked(DataPoint& dp);
+
+  const size_t maxMemoryBytes_;
+  const size_t maxDiskBytes_;
+  const size_t segmentBytes_;
+
+  std::mutex mutex_;
+  FileUtils files_;
+
+  // Points that aren't on disk yet, from `bufferOffset_`.
+  std::string buffer_;
+  size_t bufferOffset_;
+
+  // The segment being written.
+  FileUtils::File out_;
+  int64_t outId_;
+  size_t outBytes_;
+  int64_t nextId_;
+
+  // The complete segments that haven't been read, oldest first, with
+  // their sizes.
+  std::deque<std::pair<int64_t, size_t>> segments_;
+  size_t diskBytes_;
+
+  // The segment being read.
+  std::string readData_;
+  size_t readOffset_;
+  int64_t readId_;
+
+  int64_t oldestUnixTime_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/PutEncoder.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+#include "beringei/lib/TimeSeriesStream.h"
+
+namespace facebook {
+namespace gorilla {
+
+void PutEncoder::encode(PutDataRequest& request, std::vector<DataPoint>& sent)
+    const {
+  // The points of each key with a timestamp, in the order they were
+  // added.
+  std::unordered_map<std::string, std::vector<uint32_t>> pointsByKey;
+  for (uint32_t i = 0; i < request.data.size(); i++) {
+    if (request.data[i].value.unixTime > 0) {
+      pointsByKey[request.data[i].key.key].push_back(i);
+    }
+  }
+
+  std::vector<bool> encoded(request.data.size(), false);
+  for (auto& key : pointsByKey) {
+    auto& points = key.second;
+    if (points.size() < minPointsPerKey_) {
+      continue;
+    }
+
+    std::stable_sort(points.begin(), points.end(), [&](uint32_t a, uint32_t b) {
+      return request.data[a].value.unixTime < request.data[b].value.unixTime;
+    });
+
+    // Points of another category than the first one stay in `data`.
+    const DataPoint& first = request.data[points[0]];
+    EncodedDataPoints entry;
+    entry.key = first.key;
+    entry.categoryId = first.categoryId;
+    TimeSeriesStream stream;
+    size_t begin = sent.size();
+    for (uint32_t i : points) {
+      DataPoint& dp = request.data[i];
+      if (dp.categoryId == entry.categoryId && stream.append(dp.value, 0)) {
+        entry.block.count++;
+        encoded[i] = true;
+        sent.push_back(dp);
+      }
+    }
+
+    if (entry.block.count == 0 || entry.block.count < minPointsPerKey_) {
+      for (uint32_t i : points) {
+        encoded[i] = false;
+      }
+      sent.resize(begin);
+      continue;
+    }
+
+    stream.readData(entry.block.data);
+    request.encodedData.push_back(std::move(entry));
+  }
+
+  size_t left = 0;
+  for (size_t i = 0; i < request.data.size(); i++) {
+    if (!encoded[i]) {
+      if (left != i) {
+        request.data[left] = std::move(request.data[i]);
+      }
+      left++;
+    }
+  }
+  request.data.resize(left);
+}
+
+void PutEncoder::decode(
+    const PutDataRequest& request,
+    const PutDataResult& result,
+    size_t offset,
+    std::vector<DataPoint>& sent,
+    std::vector<DataPoint>& dropped) {
+  std::vector<size_t> begins(request.encodedData.size());
+  size_t begin = offset;
+  for (size_t i = 0; i < request.encodedData.size(); i++) {
+    begins[i] = begin;
+    begin += request.encodedData[i].block.count;
+  }
+  if (begin > sent.size()) {
+    return;
+  }
+
+  for (int i : result.rejectedEncoded) {
+    if (i < 0 || i >= begins.size()) {
+      continue;
+    }
+
+    auto first = sent.begin() + begins[i];
+    dropped.insert(
+        dropped.end(),
+        std::make_move_iterator(first),
+        std::make_move_iterator(first + request.encodedData[i].block.count));
+  }
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class PutEncoder
+//
+// Sends the points of keys that have many of them in a put request as
+// one TimeSeriesStream block per key instead of one DataPoint each. The
+// host decodes each block once and adds its points with one lock
+// acquisition per key.
+class PutEncoder {
+ public:
+  // Only keys with at least `minPointsPerKey` points are encoded.
+  explicit PutEncoder(size_t minPointsPerKey = 2)
+      : minPointsPerKey_(minPointsPerKey) {}
+
+  // Moves the points of the keys with enough points in `request.data`
+  // to `request.encodedData`, and appends the original points to
+  // `sent`, the points of each entry together and in the order of the
+  // entries. Points that can't be encoded, e.g., ones without a
+  // timestamp or ones that are out of order, are left in
+  // `request.data`.
+  void encode(PutDataRequest& request, std::vector<DataPoint>& sent) const;
+
+  // Appends the points of the rejected entries to `dropped`. The points
+  // of the first entry start at `offset` in `sent`.
+  static void decode(
+      const PutDataRequest& request,
+      const PutDataResult& result,
+      size_t offset,
+      std::vector<DataPoint>& sent,
+      std::vector<DataPoint>& dropped);
+
+ private:
+  const size_t minPointsPerKey_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/ReadLatencyTracker.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace facebook {
+namespace gorilla {
+
+// Weights of new samples, as in RFC 6298.
+static const double kMeanWeight = 0.125;
+static const double kDeviationWeight = 0.25;
+
+// The mean deviation of a normal distribution is about 0.8 standard
+// deviations, so this is about 1.6 standard deviations above the mean.
+static const double kHighLatencyDeviations = 2;
+
+void ReadLatencyTracker::record(const std::string& service, int64_t latencyUs) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = latencies_.find(service);
+  if (it == latencies_.end()) {
+    latencies_[service] = {(double)latencyUs, latencyUs / 2.0};
+    return;
+  }
+
+  Latency& latency = it->second;
+  double error = latencyUs - latency.meanUs;
+  latency.meanUs += kMeanWeight * error;
+  latency.deviationUs +=
+      kDeviationWeight * (std::abs(error) - latency.deviationUs);
+}
+
+std::vector<size_t> ReadLatencyTracker::order(
+    const std::vector<std::string>& services) {
+  std::vector<double> means(services.size(), 0);
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (size_t i = 0; i < services.size(); i++) {
+      auto it = latencies_.find(services[i]);
+      if (it != latencies_.end()) {
+        means[i] = it->second.meanUs;
+      }
+    }
+  }
+
+  std::vector<size_t> indexes(services.size());
+  for (size_t i = 0; i < indexes.size(); i++) {
+    indexes[i] = i;
+  }
+  std::stable_sort(indexes.begin(), indexes.end(), [&](size_t a, size_t b) {
+    return means[a] < means[b];
+  });
+  return indexes;
+}
+
+int64_t ReadLatencyTracker::getHighLatencyUs(
+    const std::string& service,
+    int64_t defaultUs) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = latencies_.find(service);
+  if (it == latencies_.end()) {
+    return defaultUs;
+  }
+  return it->second.meanUs + kHighLatencyDeviations * it->second.deviationUs;
+}
+}
+} // facebook::gorilla
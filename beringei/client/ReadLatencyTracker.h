@@ -0,0 +1,50 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace gorilla {
+
+// class ReadLatencyTracker
+//
+// Keeps a moving average of how long each read service takes to answer
+// a get request, and of how far the latencies stray from it, the same
+// way TCP estimates round trip times. Used to send reads to the fastest
+// service first and to decide when to send a backup request to
+// another one.
+class ReadLatencyTracker {
+ public:
+  void record(const std::string& service, int64_t latencyUs);
+
+  // Returns the indexes of `services` from the fastest to the slowest.
+  // Services without any latencies come first so that they get
+  // measured.
+  std::vector<size_t> order(const std::vector<std::string>& services);
+
+  // Returns about the 95th percentile of the latency of `service`, or
+  // `defaultUs` if it hasn't been measured.
+  int64_t getHighLatencyUs(const std::string& service, int64_t defaultUs);
+
+ private:
+  struct Latency {
+    double meanUs;
+    double deviationUs;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Latency> latencies_;
+};
+}
+} // facebook::gorilla
@@ -13,7 +13,21 @@ namespace facebook {
 namespace gorilla {
 
 bool RequestBatchingQueue::push(std::vector<DataPoint>& points) {
-  int numPoints = points.size();
+  // Ignore empty vectors, as these are shutdown markers.
+  if (points.empty()) {
+    return true;
+  }
+
+  auto shared = std::make_shared<std::vector<DataPoint>>(std::move(points));
+  if (!push(shared)) {
+    points = std::move(*shared);
+    return false;
+  }
+  return true;
+}
+
+bool RequestBatchingQueue::push(SharedPoints points) {
+  int numPoints = points ? points->size() : 0;
 
   // Ignore empty vectors, as these are shutdown markers.
   if (numPoints == 0) {
@@ -40,19 +54,24 @@ bool RequestBatchingQueue::push(std::vector<DataPoint>& points) {
 }
 
 std::pair<bool, int> RequestBatchingQueue::pop(
-    std::function<bool(DataPoint& dp)> popCallback) {
-  std::vector<DataPoint> points;
-  queue_.blockingRead(points);
+    std::function<bool(const DataPoint& dp)> popCallback,
+    bool blocking) {
+  SharedPoints points;
+  if (blocking) {
+    queue_.blockingRead(points);
+  } else if (!queue_.read(points)) {
+    return {true, 0};
+  }
   int popped = 0;
   bool continuePopping = true;
   do {
-    if (points.size() == 0) {
+    if (!points || points->empty()) {
       // Signals shutdown.
       return {false, popped};
     }
-    numQueuedDataPoints_ -= points.size();
+    numQueuedDataPoints_ -= points->size();
 
-    for (auto& dp : points) {
+    for (const auto& dp : *points) {
       if (!popCallback(dp)) {
         // Callback has had enough, but still push all the points in
         // this vector.
@@ -69,8 +88,7 @@ std::pair<bool, int> RequestBatchingQueue::pop(
 void RequestBatchingQueue::flush(int n) {
   // Add one empty vector per thread.
   for (int i = 0; i < n; i++) {
-    std::vector<DataPoint> points;
-    queue_.blockingWrite(std::move(points));
+    queue_.blockingWrite(nullptr);
   }
 }
 
@@ -10,6 +10,7 @@
 #pragma once
 
 #include <functional>
+#include <memory>
 #include <vector>
 
 #include <folly/MPMCQueue.h>
@@ -27,12 +28,19 @@ class RequestBatchingQueue {
   explicit RequestBatchingQueue(size_t queueCapacity, size_t queueSize)
       : capacity_(queueCapacity), queue_(queueSize), numQueuedDataPoints_(0) {}
 
+  // Points that can be in several queues at once. They are never
+  // modified once pushed.
+  typedef std::shared_ptr<const std::vector<DataPoint>> SharedPoints;
+
   // Pushes points in the queue. Returns true when all the points were
   // pushed to the queue. Returns false when the points were not
   // pushed. The vector is modified (points are moved) on a successful
   // call.
   bool push(std::vector<DataPoint>& points);
 
+  // Same as above, but the queue only keeps a reference to the points.
+  bool push(SharedPoints points);
+
   // Pops elements from the queue and calls the callback for each data
   // point. Callback should return false when popping should be
   // stopped. Some items will still be sent to the callback after this
@@ -40,8 +48,11 @@ class RequestBatchingQueue {
   // points.
   //
   // Returns the number of points popped and whether the caller should continue
-  // asking for more data in the future.
-  std::pair<bool, int> pop(std::function<bool(DataPoint& dp)> popCallback);
+  // asking for more data in the future. Returns right away with nothing
+  // popped if `blocking` is false and the queue is empty.
+  std::pair<bool, int> pop(
+      std::function<bool(const DataPoint& dp)> popCallback,
+      bool blocking = true);
 
   // Causes n future calls to pop() to return false once everything currently in
   // the queue has been processed.
@@ -53,7 +64,7 @@ class RequestBatchingQueue {
 
  private:
   const size_t capacity_;
-  folly::MPMCQueue<std::vector<DataPoint>> queue_;
+  folly::MPMCQueue<SharedPoints> queue_;
   std::atomic<int> numQueuedDataPoints_;
 };
 
@@ -0,0 +1,173 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/client/ShardBatchingQueue.h"
+
+#include <glog/logging.h>
+
+namespace facebook {
+namespace gorilla {
+
+// Emptied vectors beyond this many are freed.
+static const size_t kMaxFreeVectors = 1024;
+
+ShardBatchingQueue::ShardBatchingQueue(
+    size_t numShards,
+    size_t capacity,
+    size_t maxBatchBytes,
+    uint32_t lingerMs)
+    : numShards_(numShards),
+      capacity_(capacity),
+      maxBatchBytes_(maxBatchBytes),
+      linger_(lingerMs),
+      partitions_(numShards + 1),
+      stops_(0),
+      numQueuedDataPoints_(0) {
+  for (auto& partition : partitions_) {
+    partition.bytes = 0;
+    partition.generation = 0;
+  }
+}
+
+bool ShardBatchingQueue::push(std::vector<DataPoint>& points) {
+  if (points.empty()) {
+    return true;
+  }
+
+  // capacity_ isn't a hard capacity, like in RequestBatchingQueue.
+  int numPoints = points.size();
+  if (numQueuedDataPoints_ + numPoints > static_cast<int>(capacity_)) {
+    LOG(ERROR) << "Queue does not have any more capacity! "
+               << numQueuedDataPoints_ << " + " << numPoints << " > "
+               << capacity_;
+    return false;
+  }
+
+  bool notify = false;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto now = Clock::now();
+    for (auto& dp : points) {
+      int64_t shardId = dp.key.shardId;
+      size_t index = shardId >= 0 && shardId < static_cast<int64_t>(numShards_)
+          ? shardId
+          : numShards_;
+      Partition& partition = partitions_[index];
+      if (partition.points.empty()) {
+        lingering_.push_back({index, partition.generation, now + linger_});
+        notify |= lingering_.size() == 1;
+      }
+
+      size_t bytes = sizeof(DataPoint) + dp.key.key.size();
+      if (partition.bytes < maxBatchBytes_ &&
+          partition.bytes + bytes >= maxBatchBytes_) {
+        full_.push_back(index);
+        notify = true;
+      }
+      partition.bytes += bytes;
+      partition.points.push_back(std::move(dp));
+    }
+    numQueuedDataPoints_ += numPoints;
+  }
+
+  points.clear();
+  if (notify) {
+    ready_.notify_all();
+  }
+  return true;
+}
+
+size_t ShardBatchingQueue::take(
+    size_t partition,
+    std::vector<Batch>& batches) {
+  Partition& p = partitions_[partition];
+  if (p.points.empty()) {
+    return 0;
+  }
+
+  batches.emplace_back();
+  Batch& batch = batches.back();
+  batch.shardId = partition < numShards_ ? partition : -1;
+  batch.points.swap(p.points);
+  if (!free_.empty()) {
+    p.points.swap(free_.back());
+    free_.pop_back();
+  }
+
+  p.bytes = 0;
+  p.generation++;
+  numQueuedDataPoints_ -= batch.points.size();
+  return batch.points.size();
+}
+
+bool ShardBatchingQueue::pop(std::vector<Batch>& batches, size_t maxPoints) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    size_t popped = 0;
+    while (!full_.empty() && popped < maxPoints) {
+      popped += take(full_.back(), batches);
+      full_.pop_back();
+    }
+
+    auto now = Clock::now();
+    while (!lingering_.empty() && popped < maxPoints) {
+      const Lingering& first = lingering_.front();
+      if (partitions_[first.partition].generation == first.generation) {
+        // Everything is ready while flushing.
+        if (stops_ == 0 && first.deadline > now) {
+          break;
+        }
+        popped += take(first.partition, batches);
+      }
+      lingering_.pop_front();
+    }
+
+    if (popped > 0) {
+      // Leave the rest to the other writers.
+      if (!full_.empty()) {
+        ready_.notify_one();
+      }
+      return true;
+    }
+
+    if (stops_ > 0 && lingering_.empty()) {
+      stops_--;
+      return false;
+    }
+
+    if (lingering_.empty()) {
+      ready_.wait(lock);
+    } else {
+      ready_.wait_until(lock, lingering_.front().deadline);
+    }
+  }
+}
+
+void ShardBatchingQueue::recycle(std::vector<Batch>& batches) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto& batch : batches) {
+      if (free_.size() < kMaxFreeVectors) {
+        batch.points.clear();
+        free_.push_back(std::move(batch.points));
+      }
+    }
+  }
+  batches.clear();
+}
+
+void ShardBatchingQueue::flush(int n) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stops_ += n;
+  }
+  ready_.notify_all();
+}
+}
+} // facebook::gorilla
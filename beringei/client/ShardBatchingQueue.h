@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class ShardBatchingQueue
+//
+// Alternative to RequestBatchingQueue that sorts the points into one
+// batch per shard as they are pushed, so that writers look up the host
+// of a batch instead of the host of each point. A batch is ready to be
+// sent once it holds about `maxBatchBytes` or its first point has
+// waited `lingerMs`. The vectors of sent batches are reused.
+class ShardBatchingQueue {
+ public:
+  struct Batch {
+    // -1 for points with an invalid shard id.
+    int64_t shardId;
+    std::vector<DataPoint> points;
+  };
+
+  // `capacity` is the total number of points the queue can hold.
+  ShardBatchingQueue(
+      size_t numShards,
+      size_t capacity,
+      size_t maxBatchBytes,
+      uint32_t lingerMs);
+
+  // Moves the points into the batches of their shards. Returns false
+  // and leaves the points alone if the queue doesn't have room for all
+  // of them.
+  bool push(std::vector<DataPoint>& points);
+
+  // Waits until some batches are ready and moves them into `batches`,
+  // stopping once they have `maxPoints` points or more. Returns false
+  // with nothing popped for each of the calls asked for by flush().
+  bool pop(std::vector<Batch>& batches, size_t maxPoints);
+
+  // Takes back the vectors of popped batches to reuse them, and clears
+  // `batches`.
+  void recycle(std::vector<Batch>& batches);
+
+  // Makes all the batches ready and makes n future calls to pop()
+  // return false once everything that was pushed has been popped.
+  void flush(int n);
+
+  int size() const {
+    return numQueuedDataPoints_;
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Partition {
+    std::vector<DataPoint> points;
+    size_t bytes;
+
+    // Incremented each time the batch is popped.
+    uint64_t generation;
+  };
+
+  // A batch that has been waiting since its first point was pushed.
+  struct Lingering {
+    size_t partition;
+    uint64_t generation;
+    Clock::time_point deadline;
+  };
+
+  // Moves the batch of `partition` to `batches`. Caller must hold the
+  // lock.
+  size_t take(size_t partition, std::vector<Batch>& batches);
+
+  const size_t numShards_;
+  const size_t capacity_;
+  const size_t maxBatchBytes_;
+  const std::chrono::milliseconds linger_;
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+
+  // One per shard, and one more for invalid shard ids.
+  std::vector<Partition> partitions_;
+
+  // Non-empty batches in the order of their first points.
+  std::deque<Lingering> lingering_;
+
+  // Batches that reached `maxBatchBytes_`.
+  std::vector<size_t> full_;
+
+  // Emptied vectors to reuse.
+  std::vector<std::vector<DataPoint>> free_;
+
+  // Calls to pop() that should return false.
+  int stops_;
+
+  std::atomic<int> numQueuedDataPoints_;
+};
+}
+} // facebook::gorilla
@@ -145,12 +145,16 @@ class BeringeiClientMock : public BeringeiNetworkClient {
 
   MOCK_METHOD1(invalidateCache, void(const std::unordered_set<int64_t>&));
 
+  MOCK_METHOD2(
+      performAggregate,
+      bool(const AggregateRequest&, std::vector<AggregateResult>&));
+
   MOCK_METHOD1(
       performPut,
       vector<DataPoint>(BeringeiNetworkClient::PutRequestMap& requests));
 
   bool addDataPointToRequest(
-      DataPoint& dp,
+      const DataPoint& dp,
       BeringeiNetworkClient::PutRequestMap& requests,
       bool& /*dropped*/) override {
     auto& request = requests[make_pair("", dp.key.shardId)];
@@ -722,6 +726,67 @@ TEST_F(BeringeiClientTest, MultiMasterGet) {
   EXPECT_GT(result.stats.memoryEstimate, 0);
 }
 
+TEST_F(BeringeiClientTest, Aggregate) {
+  auto client = std::make_shared<StrictMock<BeringeiClientMock>>(2);
+  auto adapterMock = std::make_shared<StrictMock<MockConfigurationAdapter>>();
+  auto beringeiClient =
+      createBeringeiClient(adapterMock, 1, false, {client, client}, {});
+
+  AggregateRequest req;
+  req.prefix = "cpu.";
+  req.begin = 600;
+  req.end = 899;
+  req.aggregation.step = 100;
+  req.aggregation.function = AggregationFunction::AVG;
+  req.aggregation.crossKeyFunction = AggregationFunction::AVG;
+
+  // The partial results of two hosts, the second one without a value in
+  // the first window.
+  std::vector<AggregateResult> results(2);
+  results[0].values = {3, 4, 5};
+  results[0].counts = {1, 2, 1};
+  results[1].values = {std::numeric_limits<double>::quiet_NaN(), 8, 1};
+  results[1].counts = {0, 2, 3};
+  EXPECT_CALL(*client, performAggregate(_, _))
+      .WillOnce(DoAll(SetArgReferee<1>(results), Return(true)));
+
+  std::vector<TimeValuePair> out;
+  EXPECT_TRUE(beringeiClient->aggregate(req, out));
+  ASSERT_EQ(3, out.size());
+  EXPECT_EQ(600, out[0].unixTime);
+  EXPECT_EQ(3, out[0].value);
+  EXPECT_EQ(700, out[1].unixTime);
+  EXPECT_EQ(3, out[1].value);
+  EXPECT_EQ(800, out[2].unixTime);
+  EXPECT_EQ(1.5, out[2].value);
+
+  // Requests without a cross key function aren't sent.
+  req.aggregation.crossKeyFunction = AggregationFunction::NONE;
+  EXPECT_FALSE(beringeiClient->aggregate(req, out));
+  EXPECT_TRUE(out.empty());
+}
+
+TEST_F(BeringeiClientTest, GetRejectsCrossKeyFunction) {
+  auto client = std::make_shared<StrictMock<BeringeiClientMock>>(2);
+  auto adapterMock = std::make_shared<StrictMock<MockConfigurationAdapter>>();
+  auto beringeiClient =
+      createBeringeiClient(adapterMock, 1, false, {client, client}, {});
+
+  GetDataRequest req;
+  req.keys.emplace_back();
+  req.keys.back().key = "cpu.user";
+  req.begin = 600;
+  req.end = 899;
+  req.aggregation.step = 100;
+  req.aggregation.function = AggregationFunction::AVG;
+  req.aggregation.crossKeyFunction = AggregationFunction::SUM;
+
+  // Nothing is sent to the hosts.
+  GetDataResult result;
+  EXPECT_THROW(beringeiClient->get(req, result), std::invalid_argument);
+  EXPECT_THROW(beringeiClient->get(req), std::invalid_argument);
+}
+
 TEST_F(BeringeiClientTest, NetworkClientHandleException) {
   auto client = std::make_shared<StrictMock<BeringeiClientMock>>(8);
   auto adapterMock = std::make_shared<StrictMock<MockConfigurationAdapter>>();
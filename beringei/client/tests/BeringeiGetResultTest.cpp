@@ -108,6 +108,31 @@ TEST_F(BeringeiGetResultTest, Merge) {
   EXPECT_THAT(result.results, ContainerEq(expected));
 }
 
+TEST_F(BeringeiGetResultTest, Ranges) {
+  BeringeiGetResultCollector collector(2, 1, 60, 240);
+  vector<TimeRange> ranges(2);
+  ranges[0].begin = 60;
+  ranges[0].end = 120;
+  ranges[1].begin = 180;
+  ranges[1].end = 300;
+  collector.setRanges(ranges);
+
+  collector.addResults(
+      result(
+          {{{0, 0}, {60, 1}, {120, 2}, {180, 3}},
+           {{120, 2}, {180, 3}, {240, 4}, {300, 5}}},
+          StatusCode::OK),
+      {0, 1},
+      0);
+
+  auto result = collector.finalize(true, {""});
+
+  vector<vector<TimeValuePair>> expected = {
+      {tvp(60, 1), tvp(120, 2)}, {tvp(180, 3), tvp(240, 4), tvp(300, 5)}};
+
+  EXPECT_THAT(result.results, ContainerEq(expected));
+}
+
 TEST_F(BeringeiGetResultTest, MergeCompare) {
   FLAGS_gorilla_compare_reads = true;
   FLAGS_gorilla_compare_epsilon = 0.01;
@@ -186,3 +211,51 @@ TEST_F(BeringeiGetResultTest, Incomplete) {
   EXPECT_FALSE(collector.addResults(unowned, {1}, 1));
   EXPECT_FALSE(collector.finalize(false, {"", ""}).allSuccess);
 }
+
+TEST_F(BeringeiGetResultTest, MergeOutOfOrder) {
+  BeringeiGetResultCollector collector(2, 3, 60, 240);
+
+  // Service 1 answers first, and service 2 never answers for the second
+  // key, so it's only merged by finalize().
+  EXPECT_TRUE(collector.addResults(
+      result({{{60, 1}, {180, 3}}, {{120, 2}}}, StatusCode::OK), {0, 1}, 1));
+  EXPECT_FALSE(collector.addResults(
+      result({{{60, 1}, {120, 2}}, {{60, 1}}}, StatusCode::OK), {0, 1}, 0));
+  EXPECT_FALSE(collector.addResults(
+      result({{{240, 4}}}, StatusCode::OK), {0}, 2));
+
+  auto result = collector.finalize(true, {"", "", ""});
+
+  vector<vector<TimeValuePair>> expected = {
+      {tvp(60, 1), tvp(120, 2), tvp(180, 3), tvp(240, 4)},
+      {tvp(60, 1), tvp(120, 2)}};
+
+  EXPECT_THAT(result.results, ContainerEq(expected));
+  EXPECT_EQ(result.stats.missingPoints, 3);
+  EXPECT_EQ(result.stats.failedKeys, 1);
+}
+
+TEST_F(BeringeiGetResultTest, Reuse) {
+  BeringeiGetResultCollector first(2, 1, 60, 240);
+  first.addResults(
+      result({{{60, 1}, {120, 2}, {180, 3}}, {{60, 4}}}, StatusCode::OK),
+      {0, 1},
+      0);
+  auto reused = first.finalize(true, {""});
+  reused.results.emplace_back(100);
+  const TimeValuePair* points = reused.results[0].data();
+  size_t capacity = reused.results[0].capacity();
+
+  // The second key is missing this time, and the third isn't queried.
+  BeringeiGetResultCollector second(2, 1, 60, 240);
+  second.reuse(std::move(reused));
+  second.addResults(result({{{60, 5}, {120, 6}}}, StatusCode::OK), {0}, 0);
+  second.addResults(missing, {1}, 0);
+  auto result = second.finalize(true, {""});
+
+  vector<vector<TimeValuePair>> expected = {{tvp(60, 5), tvp(120, 6)}, {}};
+  EXPECT_THAT(result.results, ContainerEq(expected));
+  EXPECT_EQ(points, result.results[0].data());
+  EXPECT_EQ(capacity, result.results[0].capacity());
+  EXPECT_TRUE(result.allSuccess);
+}
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2018-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <gtest/gtest.h>
+
+#include "beringei/client/BeringeiScanShardResult.h"
+#include "beringei/lib/TimeSeries.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+class BeringeiScanShardResultTest : public testing::Test {
+ protected:
+  // Two services, where the second one is missing every third point.
+  BeringeiScanShardResult result(size_t keys) {
+    ScanShardRequest request;
+    request.begin = 0;
+    request.end = 1000000;
+    BeringeiScanShardResult ret(request, keys, {"a", "b"}, 3);
+    for (size_t i = 0; i < keys; i++) {
+      ret.keys[i] = "key" + to_string(i);
+      ret.data[i].resize(2);
+      for (int service = 0; service < 2; service++) {
+        vector<TimeValuePair> values;
+        for (int j = 0; j < 10; j++) {
+          if (service == 1 && j % 3 == 0) {
+            continue;
+          }
+          TimeValuePair tv;
+          tv.unixTime = 60 * (j + 1);
+          tv.value = i + j;
+          values.push_back(tv);
+        }
+        ret.data[i][service].emplace_back();
+        TimeSeries::writeValues(values, ret.data[i][service].back());
+      }
+    }
+    return ret;
+  }
+};
+
+TEST_F(BeringeiScanShardResultTest, Decoder) {
+  auto expected = result(25);
+  auto actual = result(25);
+  folly::CPUThreadPoolExecutor executor(4);
+
+  BeringeiScanShardDecoder decoder(actual, &executor, 3, 2);
+  size_t index;
+  vector<TimeValuePair> values;
+  BeringeiScanStats stats;
+  for (size_t i = 0; i < 25; i++) {
+    ASSERT_TRUE(decoder.next(index, values));
+    EXPECT_EQ(i, index);
+    EXPECT_EQ(expected.takeUncompressedData(i, &stats), values);
+    EXPECT_TRUE(actual.data[i].empty());
+  }
+  EXPECT_FALSE(decoder.next(index, values));
+
+  EXPECT_EQ(250, decoder.getStats().getTotal());
+  int64_t missing;
+  ASSERT_TRUE(decoder.getStats().getMissingByService(1, &missing));
+  EXPECT_EQ(100, missing);
+  EXPECT_EQ(stats.getTotal(), decoder.getStats().getTotal());
+  EXPECT_EQ(0, decoder.getMergeDeletedDataKeys());
+}
+
+TEST_F(BeringeiScanShardResultTest, TakeAllUncompressedData) {
+  auto expected = result(10);
+  auto actual = result(10);
+  folly::CPUThreadPoolExecutor executor(2);
+
+  BeringeiScanStats stats;
+  auto values = actual.takeUncompressedData(&executor, &stats);
+  ASSERT_EQ(10, values.size());
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(expected.takeUncompressedData(i), values[i]);
+  }
+  EXPECT_EQ(100, stats.getTotal());
+
+  BeringeiScanShardResult empty;
+  EXPECT_TRUE(empty.takeUncompressedData(&executor).empty());
+}
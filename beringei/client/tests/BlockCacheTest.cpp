@@ -0,0 +1,101 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/BlockCache.h"
+#include "beringei/lib/TimeSeries.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static const int64_t kBucket = 100;
+static const int64_t kNow = 10000;
+
+// One point every 10 seconds between begin and end inclusive.
+static vector<TimeSeriesBlock> makeBlocks(int64_t begin, int64_t end) {
+  vector<TimeValuePair> values;
+  for (int64_t t = begin; t <= end; t += 10) {
+    TimeValuePair tv;
+    tv.unixTime = t;
+    tv.value = t;
+    values.push_back(tv);
+  }
+  vector<TimeSeriesBlock> blocks(1);
+  TimeSeries::writeValues(values, blocks[0]);
+  return blocks;
+}
+
+static vector<TimeValuePair> getValues(const vector<TimeSeriesBlock>& blocks) {
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(blocks, values, 0, kNow);
+  return values;
+}
+
+TEST(BlockCacheTest, CachesCompleteFinalBuckets) {
+  BlockCache cache(1 << 20, kBucket, 1000);
+
+  // The buckets from 1000 to 8900 are entirely in the range and ended at
+  // least 1000 seconds ago.
+  cache.putBlocks("s", "key", makeBlocks(950, 9990), 950, 9990, kNow);
+
+  vector<TimeSeriesBlock> blocks;
+  EXPECT_EQ(900, cache.getBlocks("s", "key", 950, 9990, kNow, blocks));
+  EXPECT_TRUE(blocks.empty());
+
+  EXPECT_EQ(9000, cache.getBlocks("s", "key", 1050, 9990, kNow, blocks));
+  EXPECT_EQ(80, blocks.size());
+  auto values = getValues(blocks);
+  ASSERT_EQ(800, values.size());
+  EXPECT_EQ(1000, values.front().unixTime);
+  EXPECT_EQ(8990, values.back().unixTime);
+
+  // Stops after the bucket that contains `end`.
+  blocks.clear();
+  EXPECT_EQ(1300, cache.getBlocks("s", "key", 1000, 1250, kNow, blocks));
+  EXPECT_EQ(3, blocks.size());
+
+  // Services and keys are cached separately.
+  blocks.clear();
+  EXPECT_EQ(1000, cache.getBlocks("t", "key", 1000, 1250, kNow, blocks));
+  EXPECT_EQ(1000, cache.getBlocks("s", "other", 1000, 1250, kNow, blocks));
+  EXPECT_TRUE(blocks.empty());
+}
+
+TEST(BlockCacheTest, EmptyBuckets) {
+  BlockCache cache(1 << 20, kBucket, 1000);
+  cache.putBlocks("s", "key", makeBlocks(1000, 1090), 1000, 1299, kNow);
+
+  vector<TimeSeriesBlock> blocks;
+  EXPECT_EQ(1300, cache.getBlocks("s", "key", 1000, 1299, kNow, blocks));
+  ASSERT_EQ(3, blocks.size());
+  EXPECT_EQ(10, blocks[0].count);
+  EXPECT_EQ(0, blocks[1].count);
+  EXPECT_EQ(0, blocks[2].count);
+}
+
+TEST(BlockCacheTest, EvictsLeastRecentlyUsed) {
+  BlockCache cache(1 << 20, kBucket, 1000);
+  cache.putBlocks("s", "a", makeBlocks(1000, 1099), 1000, 1099, kNow);
+  size_t entrySize = cache.getMemoryUsage();
+
+  BlockCache small(entrySize * 2, kBucket, 1000);
+  small.putBlocks("s", "a", makeBlocks(1000, 1099), 1000, 1099, kNow);
+  small.putBlocks("s", "b", makeBlocks(1000, 1099), 1000, 1099, kNow);
+
+  vector<TimeSeriesBlock> blocks;
+  EXPECT_EQ(1100, small.getBlocks("s", "a", 1000, 1099, kNow, blocks));
+
+  small.putBlocks("s", "c", makeBlocks(1000, 1099), 1000, 1099, kNow);
+  EXPECT_EQ(entrySize * 2, small.getMemoryUsage());
+  EXPECT_EQ(1100, small.getBlocks("s", "a", 1000, 1099, kNow, blocks));
+  EXPECT_EQ(1000, small.getBlocks("s", "b", 1000, 1099, kNow, blocks));
+  EXPECT_EQ(1100, small.getBlocks("s", "c", 1000, 1099, kNow, blocks));
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/DelayQueue.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+typedef DelayQueue<int>::Clock Clock;
+
+TEST(DelayQueueTest, DueFirst) {
+  DelayQueue<int> queue(10);
+  auto now = Clock::now();
+  ASSERT_TRUE(queue.push(1, now + chrono::milliseconds(30)));
+  ASSERT_TRUE(queue.push(2, now));
+  ASSERT_TRUE(queue.push(3, now + chrono::milliseconds(10)));
+  ASSERT_TRUE(queue.push(4, now));
+
+  int item;
+  vector<int> items;
+  for (int i = 0; i < 4; i++) {
+    queue.pop(item);
+    items.push_back(item);
+  }
+  ASSERT_EQ(vector<int>({2, 4, 3, 1}), items);
+  ASSERT_GE(Clock::now(), now + chrono::milliseconds(30));
+  ASSERT_EQ(0, queue.size());
+}
+
+TEST(DelayQueueTest, Capacity) {
+  DelayQueue<int> queue(2);
+  auto now = Clock::now();
+  ASSERT_TRUE(queue.push(1, now));
+  ASSERT_TRUE(queue.push(2, now));
+  ASSERT_FALSE(queue.push(3, now));
+  ASSERT_TRUE(queue.push(4, now, true));
+  ASSERT_EQ(3, queue.size());
+}
+
+TEST(DelayQueueTest, WakesForEarlierItem) {
+  DelayQueue<int> queue(10);
+  queue.push(1, Clock::now() + chrono::hours(1));
+
+  int item = 0;
+  thread popper([&]() { queue.pop(item); });
+  this_thread::sleep_for(chrono::milliseconds(10));
+  queue.push(2, Clock::time_point());
+  popper.join();
+  ASSERT_EQ(2, item);
+}
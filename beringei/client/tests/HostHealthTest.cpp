@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/HostHealth.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+TEST(HostHealthTest, OpensAfterFailures) {
+  HostHealth health(3, 1000, 8000);
+  HostHealth::HostInfo host("host", 9999);
+  HostHealth::HostInfo other("other", 9999);
+
+  ASSERT_TRUE(health.allow(host, 0));
+  health.onFailure(host, 0);
+  health.onFailure(host, 0);
+  ASSERT_TRUE(health.allow(host, 0));
+  health.onFailure(host, 0);
+
+  // Open for between half of the backoff and all of it.
+  ASSERT_FALSE(health.allow(host, 0));
+  ASSERT_FALSE(health.allow(host, 499));
+  ASSERT_TRUE(health.allow(other, 0));
+  ASSERT_EQ(1, health.numOpen(0));
+
+  // One probe goes through once the backoff is over.
+  ASSERT_TRUE(health.allow(host, 1000));
+  ASSERT_FALSE(health.allow(host, 1000));
+
+  health.onSuccess(host);
+  ASSERT_TRUE(health.allow(host, 1000));
+  ASSERT_TRUE(health.allow(host, 1000));
+  ASSERT_EQ(0, health.numOpen(1000));
+}
+
+TEST(HostHealthTest, FailedProbesBackOff) {
+  HostHealth health(1, 1000, 4000);
+  HostHealth::HostInfo host("host", 9999);
+  health.onFailure(host, 0);
+
+  // Failures of requests sent before the breaker opened don't count.
+  health.onFailure(host, 100);
+  ASSERT_TRUE(health.allow(host, 1000));
+
+  // Each failed probe opens it for twice as long, up to the maximum.
+  health.onFailure(host, 1000);
+  ASSERT_FALSE(health.allow(host, 1999));
+  ASSERT_TRUE(health.allow(host, 3000));
+  health.onFailure(host, 3000);
+  ASSERT_FALSE(health.allow(host, 4999));
+  ASSERT_TRUE(health.allow(host, 7000));
+  health.onFailure(host, 7000);
+  ASSERT_FALSE(health.allow(host, 8999));
+  ASSERT_TRUE(health.allow(host, 11000));
+}
+
+TEST(HostHealthTest, Backoff) {
+  ASSERT_EQ(500, HostHealth::backoffMs(0, 1000, 10000, 0));
+  ASSERT_EQ(1000, HostHealth::backoffMs(0, 1000, 10000, 500));
+  ASSERT_EQ(1000, HostHealth::backoffMs(1, 1000, 10000, 0));
+  ASSERT_EQ(2000, HostHealth::backoffMs(1, 1000, 10000, 1000));
+  ASSERT_EQ(5000, HostHealth::backoffMs(10, 1000, 10000, 0));
+  ASSERT_EQ(10000, HostHealth::backoffMs(100, 1000, 10000, 5000));
+  ASSERT_EQ(1, HostHealth::backoffMs(3, 1, 1, 7));
+}
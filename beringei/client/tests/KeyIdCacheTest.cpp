@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/KeyIdCache.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static const KeyIdCache::HostInfo kHost("host", 1234);
+
+static PutDataRequest makeRequest(const vector<string>& keys) {
+  PutDataRequest request;
+  for (int i = 0; i < keys.size(); i++) {
+    DataPoint dp;
+    dp.key.key = keys[i];
+    dp.key.shardId = 7;
+    dp.value.unixTime = 100 + i;
+    dp.value.value = i;
+    request.data.push_back(dp);
+  }
+  return request;
+}
+
+static KeyId makeKeyId(int32_t id) {
+  KeyId keyId;
+  keyId.id = id;
+  keyId.tag = id * 10;
+  return keyId;
+}
+
+TEST(KeyIdCacheTest, SendsKnownKeysWithIds) {
+  KeyIdCache cache;
+  auto request = makeRequest({"a", "b"});
+  vector<DataPoint> sent;
+  cache.encode(kHost, request, sent);
+  ASSERT_TRUE(request.wantKeyIds);
+  ASSERT_EQ(2, request.data.size());
+  ASSERT_TRUE(sent.empty());
+
+  // Only "a" has an id so far.
+  PutDataResult result;
+  result.keyIds = {makeKeyId(3), makeKeyId(-1)};
+  vector<DataPoint> dropped;
+  cache.decode(kHost, request, result, sent, dropped);
+  ASSERT_TRUE(dropped.empty());
+  ASSERT_EQ(1, cache.size(kHost));
+  ASSERT_EQ(0, cache.size(KeyIdCache::HostInfo("other", 1234)));
+
+  request = makeRequest({"b", "a", "c"});
+  cache.encode(kHost, request, sent);
+  ASSERT_EQ(2, request.data.size());
+  EXPECT_EQ("b", request.data[0].key.key);
+  EXPECT_EQ("c", request.data[1].key.key);
+  ASSERT_EQ(1, request.dataWithKeyIds.size());
+  EXPECT_EQ(7, request.dataWithKeyIds[0].shardId);
+  EXPECT_EQ(3, request.dataWithKeyIds[0].keyId.id);
+  EXPECT_EQ(30, request.dataWithKeyIds[0].keyId.tag);
+  EXPECT_EQ(101, request.dataWithKeyIds[0].value.unixTime);
+  ASSERT_EQ(1, sent.size());
+  EXPECT_EQ("a", sent[0].key.key);
+}
+
+TEST(KeyIdCacheTest, RejectedIdsAreForgotten) {
+  KeyIdCache cache;
+  auto request = makeRequest({"a", "b"});
+  vector<DataPoint> sent;
+  cache.encode(kHost, request, sent);
+  PutDataResult result;
+  result.keyIds = {makeKeyId(1), makeKeyId(2)};
+  vector<DataPoint> dropped;
+  cache.decode(kHost, request, result, sent, dropped);
+
+  // Overloaded hosts don't check the ids.
+  request = makeRequest({"a", "b"});
+  cache.encode(kHost, request, sent);
+  ASSERT_EQ(2, sent.size());
+  result = PutDataResult();
+  result.status = StatusCode::OVERLOADED;
+  result.rejectedKeyIds = {0, 1};
+  cache.decode(kHost, request, result, sent, dropped);
+  ASSERT_EQ(2, dropped.size());
+  ASSERT_EQ(2, cache.size(kHost));
+
+  request = makeRequest({"a", "b"});
+  sent.clear();
+  dropped.clear();
+  cache.encode(kHost, request, sent);
+  result = PutDataResult();
+  result.rejectedKeyIds = {1};
+  cache.decode(kHost, request, result, sent, dropped);
+  ASSERT_EQ(1, dropped.size());
+  EXPECT_EQ("b", dropped[0].key.key);
+  EXPECT_EQ(101, dropped[0].value.unixTime);
+  ASSERT_EQ(1, cache.size(kHost));
+}
+
+TEST(KeyIdCacheTest, MaxKeys) {
+  KeyIdCache cache(1);
+  auto request = makeRequest({"a", "b"});
+  vector<DataPoint> sent;
+  cache.encode(kHost, request, sent);
+  PutDataResult result;
+  result.keyIds = {makeKeyId(1), makeKeyId(2)};
+  vector<DataPoint> dropped;
+  cache.decode(kHost, request, result, sent, dropped);
+  ASSERT_EQ(1, cache.size(kHost));
+
+  request = makeRequest({"a", "b"});
+  cache.encode(kHost, request, sent);
+  ASSERT_EQ(1, request.data.size());
+  ASSERT_FALSE(request.wantKeyIds);
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/KeyRegistry.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static Key makeKey(const string& name, int64_t shardId) {
+  Key key;
+  key.key = name;
+  key.shardId = shardId;
+  return key;
+}
+
+TEST(KeyRegistryTest, RegisterKeys) {
+  KeyRegistry registry;
+  KeyHandle a = registry.registerKey(makeKey("a", 1));
+  KeyHandle b = registry.registerKey(makeKey("b", 2));
+  ASSERT_NE(a, b);
+  ASSERT_EQ(a, registry.registerKey(makeKey("a", 1)));
+  ASSERT_EQ(2, registry.size());
+  ASSERT_EQ(makeKey("b", 2), *registry.getKey(b));
+  ASSERT_EQ(nullptr, registry.getKey(b + 1));
+
+  // Another shard gets a new handle, and the old handle doesn't change.
+  KeyHandle moved = registry.registerKey(makeKey("a", 3));
+  ASSERT_NE(a, moved);
+  ASSERT_EQ(moved, registry.registerKey(makeKey("a", 3)));
+  ASSERT_EQ(1, registry.getKey(a)->shardId);
+  ASSERT_EQ(3, registry.getKey(moved)->shardId);
+}
+
+TEST(KeyRegistryTest, GetDataPoints) {
+  KeyRegistry registry;
+  KeyHandle a = registry.registerKey(makeKey("a", 1));
+  KeyHandle b = registry.registerKey(makeKey("b", 2));
+
+  vector<RegisteredDataPoint> points(3);
+  points[0].key = b;
+  points[0].value.unixTime = 10;
+  points[0].value.value = 1.5;
+  points[0].categoryId = 4;
+  points[1].key = KeyRegistry::kInvalidHandle;
+  points[2].key = a;
+  points[2].value.unixTime = 20;
+  points[2].categoryId = 0;
+
+  vector<DataPoint> dataPoints;
+  ASSERT_EQ(1, registry.getDataPoints(points, dataPoints));
+  ASSERT_EQ(2, dataPoints.size());
+  EXPECT_EQ(makeKey("b", 2), dataPoints[0].key);
+  EXPECT_EQ(10, dataPoints[0].value.unixTime);
+  EXPECT_EQ(1.5, dataPoints[0].value.value);
+  EXPECT_EQ(4, dataPoints[0].categoryId);
+  EXPECT_EQ(makeKey("a", 1), dataPoints[1].key);
+  EXPECT_EQ(20, dataPoints[1].value.unixTime);
+}
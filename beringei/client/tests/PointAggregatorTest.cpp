@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/PointAggregator.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static DataPoint makePoint(const string& key, int64_t unixTime, double value) {
+  DataPoint dp;
+  dp.key.key = key;
+  dp.key.shardId = 3;
+  dp.value.unixTime = unixTime;
+  dp.value.value = value;
+  return dp;
+}
+
+TEST(PointAggregatorTest, CombinesPointsOfAWindow) {
+  PointAggregator::Function function;
+  ASSERT_FALSE(PointAggregator::parseFunction("avg", function));
+  ASSERT_TRUE(PointAggregator::parseFunction("sum", function));
+
+  PointAggregator aggregator(function, 60);
+  vector<DataPoint> points = {makePoint("a", 600, 1),
+                              makePoint("b", 610, 5),
+                              makePoint("a", 630, 2),
+                              makePoint("a", 0, 7)};
+  vector<DataPoint> out;
+  aggregator.add(points, out);
+  ASSERT_TRUE(points.empty());
+
+  // Points without a timestamp are sent as they are.
+  ASSERT_EQ(1, out.size());
+  EXPECT_EQ(7, out[0].value.value);
+  EXPECT_EQ(2, aggregator.size());
+
+  // A point of the next window sends the previous one, and a point of
+  // an older window is sent as it is.
+  points = {makePoint("a", 665, 4), makePoint("a", 540, 9)};
+  out.clear();
+  aggregator.add(points, out);
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(630, out[0].value.unixTime);
+  EXPECT_EQ(3, out[0].value.value);
+  EXPECT_EQ(540, out[1].value.unixTime);
+
+  out.clear();
+  aggregator.flush(660, out);
+  ASSERT_EQ(1, out.size());
+  EXPECT_EQ("b", out[0].key.key);
+  EXPECT_EQ(3, out[0].key.shardId);
+  EXPECT_EQ(5, out[0].value.value);
+
+  out.clear();
+  aggregator.flushAll(out);
+  ASSERT_EQ(1, out.size());
+  EXPECT_EQ(4, out[0].value.value);
+  EXPECT_EQ(0, aggregator.size());
+}
+
+TEST(PointAggregatorTest, LastAndMax) {
+  PointAggregator last(PointAggregator::LAST, 60);
+  PointAggregator max(PointAggregator::MAX, 60);
+  vector<DataPoint> out;
+  for (auto* aggregator : {&last, &max}) {
+    vector<DataPoint> points = {makePoint("a", 620, 1),
+                                makePoint("a", 610, 5),
+                                makePoint("a", 630, 2)};
+    aggregator->add(points, out);
+    aggregator->flushAll(out);
+  }
+
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(630, out[0].value.unixTime);
+  EXPECT_EQ(2, out[0].value.value);
+  EXPECT_EQ(630, out[1].value.unixTime);
+  EXPECT_EQ(5, out[1].value.value);
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/PointSpool.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static vector<DataPoint> makePoints(int first, int count) {
+  vector<DataPoint> points(count);
+  for (int i = 0; i < count; i++) {
+    points[i].key.key = "key" + to_string(first + i);
+    points[i].key.shardId = first + i;
+    points[i].value.unixTime = 1000 + first + i;
+    points[i].value.value = (first + i) * 1.5;
+    points[i].categoryId = 3;
+  }
+  return points;
+}
+
+TEST(PointSpoolTest, EncodeDecode) {
+  auto points = makePoints(0, 2);
+  string data;
+  PointSpool::encode(points[0], data);
+  PointSpool::encode(points[1], data);
+
+  size_t offset = 0;
+  DataPoint dp;
+  ASSERT_TRUE(PointSpool::decode(data, offset, dp));
+  ASSERT_EQ(points[0], dp);
+  ASSERT_TRUE(PointSpool::decode(data, offset, dp));
+  ASSERT_EQ(points[1], dp);
+  ASSERT_EQ(data.size(), offset);
+  ASSERT_FALSE(PointSpool::decode(data, offset, dp));
+
+  // Truncated points aren't decoded.
+  data.resize(data.size() - 1);
+  offset = 0;
+  ASSERT_TRUE(PointSpool::decode(data, offset, dp));
+  ASSERT_FALSE(PointSpool::decode(data, offset, dp));
+}
+
+TEST(PointSpoolTest, MemoryAndDisk) {
+  TemporaryDirectory dir("gorilla_test");
+  PointSpool spool(dir.dirname(), 0, 200, 100000, 500);
+
+  // The first batch stays in memory and the rest goes to disk in
+  // segments.
+  vector<DataPoint> expected;
+  for (int i = 0; i < 10; i++) {
+    auto points = makePoints(i * 5, 5);
+    ASSERT_TRUE(spool.write(points));
+    expected.insert(expected.end(), points.begin(), points.end());
+  }
+  ASSERT_GT(spool.getBytes(), 0);
+  ASSERT_EQ(50, spool.getLagSecs(1050));
+
+  vector<DataPoint> points;
+  ASSERT_EQ(7, spool.read(7, points));
+  ASSERT_EQ(44, spool.getLagSecs(1050));
+  ASSERT_EQ(43, spool.read(100, points));
+  ASSERT_EQ(expected, points);
+  ASSERT_EQ(0, spool.getBytes());
+  ASSERT_EQ(0, spool.getLagSecs(1050));
+  ASSERT_EQ(0, spool.read(100, points));
+}
+
+TEST(PointSpoolTest, Caps) {
+  TemporaryDirectory dir("gorilla_test");
+  PointSpool spool(dir.dirname(), 0, 100, 200, 1000);
+
+  size_t written = 0;
+  while (spool.write(makePoints(written, 1))) {
+    written++;
+  }
+  ASSERT_GT(written, 0);
+  ASSERT_LE(spool.getBytes(), 300);
+
+  vector<DataPoint> points;
+  ASSERT_EQ(written, spool.read(1000, points));
+  ASSERT_EQ(makePoints(0, written), points);
+  ASSERT_TRUE(spool.write(makePoints(0, 1)));
+}
+
+TEST(PointSpoolTest, Restart) {
+  TemporaryDirectory dir("gorilla_test");
+  auto points = makePoints(0, 20);
+  {
+    PointSpool spool(dir.dirname(), 1, 1000, 100000, 200);
+    ASSERT_TRUE(spool.write(points));
+
+    vector<DataPoint> read;
+    ASSERT_EQ(5, spool.read(5, read));
+  }
+
+  // Only the segments that were read completely are gone.
+  PointSpool spool(dir.dirname(), 1, 1000, 100000, 200);
+  vector<DataPoint> read;
+  size_t count = spool.read(100, read);
+  ASSERT_LE(count, 20);
+  ASSERT_GE(count, 15);
+  ASSERT_EQ(vector<DataPoint>(points.end() - count, points.end()), read);
+}
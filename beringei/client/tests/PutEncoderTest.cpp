@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/PutEncoder.h"
+#include "beringei/lib/TimeSeries.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static DataPoint makePoint(const string& key, int64_t unixTime, double value) {
+  DataPoint dp;
+  dp.key.key = key;
+  dp.key.shardId = 7;
+  dp.value.unixTime = unixTime;
+  dp.value.value = value;
+  return dp;
+}
+
+TEST(PutEncoderTest, EncodesKeysWithManyPoints) {
+  PutDataRequest request;
+  request.data.push_back(makePoint("a", 160, 3));
+  request.data.push_back(makePoint("b", 100, 1));
+  request.data.push_back(makePoint("a", 100, 1));
+  request.data.push_back(makePoint("a", 130, 2));
+  request.data.push_back(makePoint("a", 0, 4));
+
+  PutEncoder encoder;
+  vector<DataPoint> sent;
+  encoder.encode(request, sent);
+
+  // The point without a timestamp and the only point of "b" are sent
+  // as they are.
+  ASSERT_EQ(2, request.data.size());
+  EXPECT_EQ("b", request.data[0].key.key);
+  EXPECT_EQ(0, request.data[1].value.unixTime);
+
+  ASSERT_EQ(1, request.encodedData.size());
+  const auto& entry = request.encodedData[0];
+  EXPECT_EQ("a", entry.key.key);
+  EXPECT_EQ(7, entry.key.shardId);
+  ASSERT_EQ(3, entry.block.count);
+  ASSERT_EQ(3, sent.size());
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(entry.block, values, 0, 1000);
+  ASSERT_EQ(3, values.size());
+  for (int i = 0; i < values.size(); i++) {
+    EXPECT_EQ(sent[i].value.unixTime, values[i].unixTime);
+    EXPECT_EQ(i + 1, values[i].value);
+  }
+}
+
+TEST(PutEncoderTest, ReturnsRejectedEntries) {
+  PutDataRequest request;
+  for (int i = 0; i < 3; i++) {
+    request.data.push_back(makePoint("a", 100 + i * 60, i));
+    request.data.push_back(makePoint("b", 100 + i * 60, i));
+  }
+
+  // Points already sent with key ids come first.
+  vector<DataPoint> sent;
+  sent.push_back(makePoint("c", 100, 0));
+  request.dataWithKeyIds.resize(1);
+
+  PutEncoder encoder;
+  encoder.encode(request, sent);
+  ASSERT_TRUE(request.data.empty());
+  ASSERT_EQ(2, request.encodedData.size());
+  ASSERT_EQ(7, sent.size());
+
+  PutDataResult result;
+  result.rejectedEncoded = {1, 5};
+  vector<DataPoint> dropped;
+  PutEncoder::decode(request, result, 1, sent, dropped);
+  ASSERT_EQ(3, dropped.size());
+  for (const auto& dp : dropped) {
+    EXPECT_EQ(request.encodedData[1].key.key, dp.key.key);
+  }
+}
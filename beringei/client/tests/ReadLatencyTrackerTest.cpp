@@ -0,0 +1,50 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/ReadLatencyTracker.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+TEST(ReadLatencyTrackerTest, Order) {
+  ReadLatencyTracker tracker;
+  tracker.record("slow", 5000);
+  tracker.record("fast", 1000);
+  tracker.record("medium", 3000);
+
+  // Services that haven't been measured come first.
+  vector<string> services = {"slow", "fast", "new", "medium"};
+  ASSERT_EQ(vector<size_t>({2, 1, 3, 0}), tracker.order(services));
+
+  // The averages follow the latencies.
+  for (int i = 0; i < 50; i++) {
+    tracker.record("slow", 500);
+  }
+  ASSERT_EQ(vector<size_t>({2, 0, 1, 3}), tracker.order(services));
+}
+
+TEST(ReadLatencyTrackerTest, HighLatency) {
+  ReadLatencyTracker tracker;
+  ASSERT_EQ(123, tracker.getHighLatencyUs("service", 123));
+
+  for (int i = 0; i < 100; i++) {
+    tracker.record("service", 1000);
+  }
+  int64_t steady = tracker.getHighLatencyUs("service", 0);
+  EXPECT_NEAR(1000, steady, 10);
+
+  // Latencies that vary push the estimate above the average.
+  for (int i = 0; i < 100; i++) {
+    tracker.record("service", i % 2 ? 500 : 1500);
+  }
+  EXPECT_GT(tracker.getHighLatencyUs("service", 0), 1500);
+}
@@ -15,10 +15,10 @@ using namespace ::testing;
 using namespace facebook::gorilla;
 using namespace std;
 
-std::function<bool(DataPoint& dp)> getPopCallback(
+std::function<bool(const DataPoint& dp)> getPopCallback(
     std::vector<PutDataRequest>& requests,
     int limit) {
-  return [&requests, limit](DataPoint& dp) {
+  return [&requests, limit](const DataPoint& dp) {
     requests[dp.key.shardId].data.push_back(dp);
     return requests[dp.key.shardId].data.size() < limit;
   };
@@ -123,3 +123,33 @@ TEST(BatchingQueueTest, Flush) {
   }
   EXPECT_EQ(0, queue.size());
 }
+
+TEST(BatchingQueueTest, NonBlockingPop) {
+  RequestBatchingQueue queue(10, 10);
+  std::vector<PutDataRequest> requests(3);
+  EXPECT_EQ(
+      std::make_pair(true, 0), queue.pop(getPopCallback(requests, 5), false));
+
+  vector<DataPoint> points = {DataPoint{}, DataPoint{}};
+  queue.push(points);
+  EXPECT_EQ(
+      std::make_pair(true, 2), queue.pop(getPopCallback(requests, 5), false));
+  EXPECT_EQ(0, queue.size());
+}
+
+TEST(BatchingQueueTest, SharedPoints) {
+  RequestBatchingQueue first(10, 10);
+  RequestBatchingQueue second(2, 10);
+
+  vector<DataPoint> points(3);
+  points[1].key.shardId = 1;
+  auto shared = std::make_shared<const std::vector<DataPoint>>(points);
+  EXPECT_TRUE(first.push(shared));
+  EXPECT_FALSE(second.push(shared));
+  EXPECT_EQ(2, shared.use_count());
+
+  std::vector<PutDataRequest> requests(3);
+  EXPECT_EQ(3, first.pop(getPopCallback(requests, 5)).second);
+  EXPECT_EQ(1, shared.use_count());
+  EXPECT_EQ(points, *shared);
+}
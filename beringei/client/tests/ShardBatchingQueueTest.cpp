@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/client/ShardBatchingQueue.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static vector<DataPoint> points(const vector<int64_t>& shards) {
+  vector<DataPoint> result;
+  for (int64_t shard : shards) {
+    DataPoint dp;
+    dp.key.key = "key";
+    dp.key.shardId = shard;
+    result.push_back(dp);
+  }
+  return result;
+}
+
+TEST(ShardBatchingQueueTest, FullBatchesFirst) {
+  // Two points fill a batch, and the others wait for a long time.
+  ShardBatchingQueue queue(4, 100, 2 * (sizeof(DataPoint) + 3), 100000);
+  auto first = points({1, 2, 1, 9});
+  ASSERT_TRUE(queue.push(first));
+  ASSERT_TRUE(first.empty());
+  ASSERT_EQ(4, queue.size());
+
+  vector<ShardBatchingQueue::Batch> batches;
+  ASSERT_TRUE(queue.pop(batches, 100));
+  ASSERT_EQ(1, batches.size());
+  ASSERT_EQ(1, batches[0].shardId);
+  ASSERT_EQ(2, batches[0].points.size());
+  ASSERT_EQ(2, queue.size());
+  queue.recycle(batches);
+  ASSERT_TRUE(batches.empty());
+
+  // Flushing makes the rest ready, invalid shards last.
+  queue.flush(1);
+  ASSERT_TRUE(queue.pop(batches, 100));
+  ASSERT_EQ(2, batches.size());
+  EXPECT_EQ(2, batches[0].shardId);
+  EXPECT_EQ(-1, batches[1].shardId);
+  ASSERT_EQ(0, queue.size());
+
+  batches.clear();
+  ASSERT_FALSE(queue.pop(batches, 100));
+  ASSERT_TRUE(batches.empty());
+}
+
+TEST(ShardBatchingQueueTest, Linger) {
+  ShardBatchingQueue queue(4, 100, 1 << 20, 10);
+  auto first = points({3});
+  ASSERT_TRUE(queue.push(first));
+
+  vector<ShardBatchingQueue::Batch> batches;
+  ASSERT_TRUE(queue.pop(batches, 100));
+  ASSERT_EQ(1, batches.size());
+  EXPECT_EQ(3, batches[0].shardId);
+}
+
+TEST(ShardBatchingQueueTest, Capacity) {
+  ShardBatchingQueue queue(4, 3, 1 << 20, 10);
+  auto tooMany = points({0, 1, 2, 3});
+  ASSERT_FALSE(queue.push(tooMany));
+  ASSERT_EQ(4, tooMany.size());
+  ASSERT_EQ(0, queue.size());
+}
@@ -4,6 +4,7 @@
 # FOLLY_FOUND
 # FOLLY_INCLUDE_DIR
 # FOLLY_LIBRARIES
+# FOLLY_BENCHMARK_LIBRARY
 #
 
 find_package(DoubleConversion REQUIRED)
@@ -22,13 +23,21 @@ find_library(
         "/usr/local/facebook/lib"
 )
 
+find_library(
+    FOLLY_BENCHMARK_LIBRARY
+    NAMES follybenchmark
+    HINTS
+        "/usr/local/facebook/lib"
+)
+
 set(FOLLY_LIBRARIES ${FOLLY_LIBRARY} ${DOUBLE_CONVERSION_LIBRARY})
 
 include(FindPackageHandleStandardArgs)
 find_package_handle_standard_args(
     FOLLY DEFAULT_MSG FOLLY_INCLUDE_DIR FOLLY_LIBRARIES)
 
-mark_as_advanced(FOLLY_INCLUDE_DIR FOLLY_LIBRARIES FOLLY_FOUND)
+mark_as_advanced(
+    FOLLY_INCLUDE_DIR FOLLY_LIBRARIES FOLLY_BENCHMARK_LIBRARY FOLLY_FOUND)
 
 if(FOLLY_FOUND AND NOT FOLLY_FIND_QUIETLY)
     message(STATUS "FOLLY: ${FOLLY_INCLUDE_DIR}")
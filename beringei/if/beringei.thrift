@@ -12,17 +12,42 @@ include "beringei/if/beringei_data.thrift"
 namespace cpp2 facebook.gorilla
 namespace py facebook.gorilla.beringei
 
+/**
+ * The priorities pick the thread pool of each call when the server runs
+ * with separate pools for reads, writes and scans. See
+ * --num_thrift_read_threads.
+ */
 service BeringeiService {
   /**
    * Get data for a group of timeseries between two timestamps.
-   * This can over-fetch.
+   * The blocks are trimmed to the time range unless the server runs
+   * without --trim_get_data_blocks, in which case this can over-fetch.
+   */
+  beringei_data.GetDataResult getData(1: beringei_data.GetDataRequest req)
+    (priority = 'HIGH'),
+
+  /**
+   * Same as getData() but packs all the blocks into one buffer. Cheaper
+   * to send and decode when querying many keys. The blocks are served
+   * straight from the storage pages, so they are not trimmed.
    */
-  beringei_data.GetDataResult getData(1: beringei_data.GetDataRequest req),
+  beringei_data.GetDataColumnarResult getDataColumnar(
+      1: beringei_data.GetDataRequest req) (priority = 'HIGH'),
+
+  /**
+   * Reduces the keys of a request on this host into one series, to be
+   * merged with the results of the other hosts, so that rollups over
+   * many keys don't send the data of every key to the client.
+   */
+  beringei_data.AggregateResult aggregate(
+      1: beringei_data.AggregateRequest req) (priority = 'HIGH'),
+
   /**
    * Append data points to their respective timeseries.
    * Unowned points will be returned back to the client.
    */
-  beringei_data.PutDataResult putDataPoints(1: beringei_data.PutDataRequest req),
+  beringei_data.PutDataResult putDataPoints(1: beringei_data.PutDataRequest req)
+    (priority = 'IMPORTANT'),
 
   /**
    * DEPRECATED
@@ -33,17 +58,84 @@ service BeringeiService {
    * blacklisted items were filtered out or that's the last batch.
    */
   beringei_data.GetShardDataBucketResult getShardDataBucket(
-      1: i64 begin, 2: i64 end, 3: i64 shardId, 4: i32 offset, 5: i32 limit),
+      1: i64 begin, 2: i64 end, 3: i64 shardId, 4: i32 offset, 5: i32 limit)
+    (priority = 'BEST_EFFORT'),
 
   /**
    * Get all data for a shard between two timestamps.
    */
   beringei_data.ScanShardResult scanShard(
-      1: beringei_data.ScanShardRequest req),
+      1: beringei_data.ScanShardRequest req) (priority = 'BEST_EFFORT'),
 
   /**
    * Gets the last update times for time series.
    */
   beringei_data.GetLastUpdateTimesResult getLastUpdateTimes(
       1: beringei_data.GetLastUpdateTimesRequest req),
+
+  /**
+   * Finds the keys of a shard matching a prefix or a glob, optionally
+   * with their data, using the sorted key index of the shard.
+   */
+  beringei_data.SearchKeysResult searchKeys(
+      1: beringei_data.SearchKeysRequest req),
+
+  /**
+   * Finds the keys of a shard whose values were far from their mean,
+   * from the deviation index that --deviation_index_interval_secs keeps
+   * up to date, without scanning the shard.
+   */
+  beringei_data.GetDeviatingKeysResult getDeviatingKeys(
+      1: beringei_data.GetDeviatingKeysRequest req),
+
+  /**
+   * Reports the memory and traffic of shards, to find the hot ones.
+   */
+  beringei_data.GetResourceUsageResult getResourceUsage(
+      1: beringei_data.GetResourceUsageRequest req) (priority = 'BEST_EFFORT'),
+
+  /**
+   * Copies the files of a shard to the host that is taking it over.
+   */
+  beringei_data.TransferShardResult transferShard(
+      1: beringei_data.TransferShardRequest req),
+
+  /**
+   * Follows new data points of some keys. The points are kept on the
+   * server as they are added and returned by pollSubscription(), which
+   * waits for new points, so followers don't have to read the open
+   * buckets again and again. Subscriptions are per host: subscribe on
+   * every host that owns one of the shards.
+   */
+  beringei_data.SubscribeResult subscribe(
+      1: beringei_data.SubscribeRequest req) (priority = 'HIGH'),
+
+  beringei_data.PollSubscriptionResult pollSubscription(
+      1: beringei_data.PollSubscriptionRequest req) (priority = 'HIGH'),
+
+  void unsubscribe(1: i64 subscriptionId),
+
+  /**
+   * Writes the points of past buckets straight into the finalized
+   * buckets and their block files, bypassing the open bucket and the
+   * data log, to import history or fill gaps after an outage. Points
+   * already in the buckets are kept unless a backfilled point has the
+   * same timestamp.
+   */
+  beringei_data.BackfillResult backfill(1: beringei_data.BackfillRequest req)
+    (priority = 'BEST_EFFORT'),
+
+  /**
+   * Sent by the owner of some shards to the hosts that follow them.
+   * Adds the keys the owner created at the ids it gave them. The keys
+   * are always sent before the data points that use their ids.
+   */
+  beringei_data.ReplicationResult appendKeys(
+      1: beringei_data.AppendKeysRequest req) (priority = 'HIGH'),
+
+  /**
+   * Adds the data points the owner of some shards added to them.
+   */
+  beringei_data.ReplicationResult logDataPoints(
+      1: beringei_data.LogDataPointsRequest req) (priority = 'HIGH'),
 }
@@ -26,6 +26,13 @@ struct TimeSeriesBlock {
   1: Compression compression,
   2: i32 count,
   3: binary data,
+
+  // Optional decoder checkpoints into `data`. Empty if the block has
+  // none, in which case `data` is always decoded from the beginning.
+  // Each checkpoint is 32 bytes of little-endian fields, see
+  // TimeSeriesStream::Checkpoint. getData adds them to the blocks with
+  // more than --get_data_checkpoint_interval values.
+  4: binary checkpoints,
 }
 
 enum StatusCode {
@@ -37,6 +44,8 @@ enum StatusCode {
   BUCKET_NOT_FINALIZED = 5,
   ZIPPY_STORAGE_FAIL = 6,
   MISSING_TOO_MUCH_DATA = 7,
+  // The server is shedding load. Retry after a delay.
+  OVERLOADED = 8,
 }
 
 struct TimeSeriesData {
@@ -44,14 +53,113 @@ struct TimeSeriesData {
   2: StatusCode status = OK,
 }
 
+enum AggregationFunction {
+  NONE = 0,
+  SUM = 1,
+  MIN = 2,
+  MAX = 3,
+  COUNT = 4,
+  AVG = 5,
+  LAST = 6,
+}
+
+// Asks the server to downsample the data before returning it. The data
+// of each key is then returned as a single block with one point per
+// non-empty window of `step` seconds, the first window starting at
+// `begin`. Each point is timestamped with the beginning of its window.
+// Ignored if `step` or `function` isn't set or if it would produce more
+// than about a million windows.
+struct AggregationSpec {
+  1: i64 step = 0,
+  2: AggregationFunction function = NONE,
+
+  // If set, the downsampled series of all the keys in the request are
+  // also reduced into `GetDataResult.reduced` by applying this function
+  // to the values of each window. Only covers the keys sent to one
+  // host.
+  3: AggregationFunction crossKeyFunction = NONE,
+}
+
+struct TimeRange {
+  1: i64 begin,
+  2: i64 end,
+}
+
 struct GetDataRequest {
   1: list<Key> keys,
   2: i64 begin,
   3: i64 end,
+  4: AggregationSpec aggregation,
+
+  // If set, the time range of each key in `keys`, used instead of
+  // `begin` and `end`. The same key can be asked for with different
+  // ranges. The keys with the same range are read together, and the
+  // cross key reduction is not done.
+  5: list<TimeRange> ranges,
 }
 
 struct GetDataResult {
   1: list<TimeSeriesData> results,
+
+  // Set only if `AggregationSpec.crossKeyFunction` was requested.
+  2: TimeSeriesData reduced,
+}
+
+// Columnar alternative to GetDataResult for requests with many keys.
+// The data of all the blocks of all the keys is concatenated into a
+// single buffer instead of one TimeSeriesBlock per block. Decode it
+// with TimeSeries.h.
+//
+// Block j is `data[blockOffsets[j], blockOffsets[j + 1])` and holds
+// `blockCounts[j]` points. Key i owns blocks
+// `[keyBlockOffsets[i], keyBlockOffsets[i + 1])`. The last block ends
+// at the end of `data` and the blocks of the last key end at the end of
+// `blockOffsets`.
+struct GetDataColumnarResult {
+  1: binary data,
+  2: list<i32> blockOffsets,
+  3: list<i32> blockCounts,
+  4: list<i32> keyBlockOffsets,
+  5: list<StatusCode> statuses,
+}
+
+// Reduces many keys to one series on the hosts that own them, without
+// sending their data back. Each key is downsampled with
+// `aggregation.function` into windows of `aggregation.step` seconds
+// from `begin`, and the windows of all the keys are reduced with
+// `aggregation.crossKeyFunction`, which must be set.
+struct AggregateRequest {
+  1: list<Key> keys,
+
+  // If set, also reduces all the keys starting with it, ignoring case,
+  // on `prefixShards`. Glob wildcards match as in searchKeys().
+  2: string prefix,
+  3: list<i64> prefixShards,
+
+  4: i64 begin,
+  5: i64 end,
+  6: AggregationSpec aggregation,
+}
+
+// The reduction of the keys of one host, for the client to merge with
+// the results of the other hosts. Window i starts at
+// `begin + i * aggregation.step`.
+struct AggregateResult {
+  1: StatusCode status,
+
+  // The sum of the values of the keys in each window for SUM and AVG,
+  // their min for MIN, max for MAX and the value of the last key for
+  // LAST. NaN in windows without values.
+  2: list<double> values,
+
+  // The number of keys with a value in each window.
+  3: list<i64> counts,
+
+  // Shards of the request that this host doesn't own. Their keys aren't
+  // included.
+  4: list<i64> unownedShards,
+
+  5: i64 keysReduced,
 }
 
 // putData structs
@@ -59,6 +167,9 @@ struct GetDataResult {
 struct TimeValuePair {
   1: i64 unixTime,
   2: double value,
+  // Milliseconds past `unixTime`, from 0 to 999. Only kept for the
+  // categories in --gorilla_millisecond_categories.
+  3: i16 ms = 0,
 }
 
 struct DataPoint {
@@ -67,13 +178,59 @@ struct DataPoint {
   3: i32 categoryId,
 }
 
+// Identifies a key on the host that handed it out. `tag` lets the host
+// check that the id still belongs to the same key.
+struct KeyId {
+  1: i32 id,
+  2: i64 tag,
+}
+
+// A data point sent with the id of its key instead of the key.
+struct DataPointWithKeyId {
+  1: i64 shardId,
+  2: KeyId keyId,
+  3: TimeValuePair value,
+  4: i32 categoryId,
+}
+
+// The points of one key encoded as a TimeSeriesStream, oldest first.
+struct EncodedDataPoints {
+  1: Key key,
+  2: TimeSeriesBlock block,
+  3: i32 categoryId,
+}
+
 struct PutDataRequest {
   1: list<DataPoint> data,
+
+  // Points for keys whose ids were returned by this host before.
+  2: list<DataPointWithKeyId> dataWithKeyIds,
+
+  // Asks for the ids of the keys in `data`.
+  3: bool wantKeyIds = false,
+
+  // Points of keys that have many of them in the request.
+  4: list<EncodedDataPoints> encodedData,
 }
 
 struct PutDataResult {
-  // return not owned data points
+  // return not owned data points, or all of them with OVERLOADED
   1: list<DataPoint> data,
+  2: StatusCode status = OK,
+
+  // With `wantKeyIds`, one per point in `data`. Keys that don't have an
+  // id yet get a negative id.
+  3: list<KeyId> keyIds,
+
+  // Indexes in `dataWithKeyIds` of the points that weren't added. The
+  // ids are no longer valid, unless the status is OVERLOADED, and the
+  // points should be sent again with their keys.
+  4: list<i32> rejectedKeyIds,
+
+  // Indexes in `encodedData` of the entries that weren't handled because
+  // the shard isn't owned, or all of them with OVERLOADED. The points
+  // of the entries should be sent again.
+  5: list<i32> rejectedEncoded,
 }
 
 struct GetShardDataBucketResult {
@@ -91,12 +248,26 @@ struct GetShardDataBucketResult {
 // It is possible to request a fraction of the data via subsharding.
 // Issuing multiple requests with `numSubshards` == n and `subshard` scanning
 // over [0, n) will return each key once.
+//
+// Large shards can be scanned in chunks by setting `limit` or
+// `maxBytes`. While `ScanShardResult.moreEntries` is set, issue the same
+// request again with `offset` set to `ScanShardResult.nextOffset`.
 struct ScanShardRequest {
   1: i64 shardId,
   2: i64 begin,
   3: i64 end,
   4: i64 subshard = 0,
   5: i64 numSubshards = 1,
+
+  // Position in the shard to continue scanning from.
+  6: i64 offset = 0,
+
+  // Maximum number of time series to scan. No limit if zero.
+  7: i32 limit = 0,
+
+  // Stop scanning once the returned blocks hold at least this many
+  // bytes. No limit if zero.
+  8: i64 maxBytes = 0,
 }
 
 struct ScanShardResult {
@@ -106,10 +277,50 @@ struct ScanShardResult {
 
   // True for each key if data for that key has been queried recently.
   4: list<bool> queriedRecently,
+
+  // Set if the scan stopped early because of `limit` or `maxBytes`.
+  5: bool moreEntries,
+  6: i64 nextOffset,
+}
+
+// Copies the files of a shard from its previous owner, so that the next
+// owner doesn't have to rebuild it from the logs. The previous owner
+// must still have the shard, even if it's about to drop it.
+//
+// Leave `file` empty to get the list of files to copy. Then request each
+// of them in turn from `offset` zero until `endOfFile` is set, moving
+// `offset` past the data received so far.
+struct ShardFile {
+  1: string prefix,
+  2: i64 id,
+}
+
+struct TransferShardRequest {
+  1: i64 shardId,
+  2: ShardFile file,
+  3: i64 offset = 0,
+
+  // Maximum number of bytes to return. The server may return less.
+  4: i32 maxBytes = 0,
+}
+
+struct TransferShardResult {
+  1: StatusCode status,
+
+  // Set when the request has an empty file.
+  2: list<ShardFile> files,
+  3: binary data,
+  4: bool endOfFile,
 }
 
 // Structs that represent the configuration of Beringei services.
 
+// A host that follows a shard.
+struct ShardFollower {
+  1: string hostAddress,
+  2: i32 port,
+}
+
 // Represents which shard is owned by which host
 struct ShardInfo {
   // Zero based index.
@@ -120,6 +331,11 @@ struct ShardInfo {
 
   // Port on which the Beringei service is running on.
   3: i32 port,
+
+  // Hosts that keep read replicas of the shard. The owner streams new
+  // keys and data points to them and clients spread reads over the
+  // owner and its followers.
+  4: list<ShardFollower> followers,
 }
 
 // Represents a Beringie service and it's shard ownership information.
@@ -136,6 +352,11 @@ struct ServiceMap {
 
   // Shard ownership information for the service.
   4: list<ShardInfo> shardMap,
+
+  // Requests to and responses from the hosts of the service of at least
+  // this many bytes are compressed with zstd by the transport. 0 leaves
+  // them uncompressed.
+  5: i32 transportCompressionMinBytes,
 }
 
 // Represents all Beringie services.
@@ -160,6 +381,11 @@ struct GetLastUpdateTimesRequest {
   // The maximum number of results that will be returned. There might still be
   // more results even if the number of results is less than this value.
   4: i32 limit,
+
+  // If set, rows that weren't updated since minLastUpdateTime are skipped
+  // without counting toward `limit`, and the next call should start at
+  // `nextOffset` of the result instead of `offset + limit`.
+  5: bool useCursor,
 }
 
 struct KeyUpdateTime {
@@ -177,6 +403,204 @@ struct GetLastUpdateTimesResult {
 
   // Set to true if there are more results in the shard.
   2: bool moreResults,
+
+  // Where to continue with `useCursor`.
+  3: i32 nextOffset,
+}
+
+struct SearchKeysRequest {
+  // Which shard to query.
+  1: i64 shardId,
+
+  // Glob of the keys, ignoring case. '*' matches any characters and '?'
+  // any one character. The part before the first wildcard is looked up
+  // in the key index of the shard, so patterns should start with a
+  // prefix.
+  2: string pattern,
+
+  // Only keys updated at or after `begin` are returned. With `withData`
+  // their blocks between `begin` and `end` are returned too.
+  3: i64 begin,
+  4: i64 end,
+
+  // The keys are returned in case-insensitive order. Set to the
+  // `lastKey` of the previous result to get the next page.
+  5: string after,
+
+  // The maximum number of keys looked at.
+  6: i32 limit,
+
+  7: bool withData,
+}
+
+struct SearchKeysResult {
+  1: StatusCode status,
+  2: list<KeyUpdateTime> keys,
+
+  // The data of each key in `keys` if asked for.
+  3: list<TimeSeriesData> data,
+
+  // Set to true if there are more matching keys after `lastKey`.
+  4: bool moreResults,
+  5: string lastKey,
+}
+
+struct GetDeviatingKeysRequest {
+  1: i64 shardId,
+
+  // The minutes from the one of `begin` to the one of `end`. Only the
+  // minutes of the buckets in memory are indexed.
+  2: i64 begin,
+  3: i64 end,
+
+  // The maximum number of keys returned.
+  4: i32 limit,
+
+  // Also returns the blocks of each key between `begin` and `end`.
+  5: bool withData,
+}
+
+struct DeviatingKey {
+  1: string key,
+
+  // The beginning of each minute the key deviated in, oldest first.
+  2: list<i64> times,
+}
+
+struct GetDeviatingKeysResult {
+  1: StatusCode status,
+
+  // In the order of their first deviation.
+  2: list<DeviatingKey> keys,
+
+  // The data of each key in `keys` if asked for.
+  3: list<TimeSeriesData> data,
+
+  // Set to true if there were more than `limit` keys.
+  4: bool moreResults,
+}
+
+struct GetResourceUsageRequest {
+  // The shards to report. All the owned shards if empty.
+  1: list<i64> shardIds,
+
+  // The active streams are measured for every `sampleEvery`th time
+  // series and scaled up. 1 looks at all of them.
+  2: i32 sampleEvery = 100,
+}
+
+struct CategoryResourceUsage {
+  1: i64 numSeries,
+  2: i64 activeStreamBytes,
+}
+
+struct ShardResourceUsage {
+  1: i64 shardId,
+  2: i64 numSeries,
+
+  // In-memory page bytes of each bucket, keyed by bucket number.
+  3: map<i32, i64> pageBytesPerBucket,
+
+  // Bytes used and allocated but unused by the open streams.
+  4: i64 activeStreamBytes,
+  5: i64 activeStreamSlackBytes,
+
+  // Percentage of duplicate blocks in the last finalized bucket.
+  6: i32 dedupHitRate,
+
+  // Totals since the shard was loaded and their rates over the last
+  // finalized bucket.
+  7: i64 pointsAdded,
+  8: i64 keysQueried,
+  9: double pointsAddedPerSecond,
+  10: double keysQueriedPerSecond,
+
+  // Records in the key list, including the dead ones.
+  11: i64 keyListRecords,
+
+  12: map<i32, CategoryResourceUsage> categories,
+}
+
+struct GetResourceUsageResult {
+  // Shards that are not owned are not included.
+  1: list<ShardResourceUsage> shards,
+}
+
+// subscribe structs
+
+struct SubscribeRequest {
+  // Keys to follow, on the shards in `Key.shardId`. Matched ignoring
+  // case.
+  1: list<Key> keys,
+
+  // If set, also follows all the keys starting with it, ignoring case,
+  // on `prefixShards`.
+  2: string prefix,
+  3: list<i64> prefixShards,
+
+  // The points kept between polls. The oldest ones are dropped when it
+  // is full. 0 or more than the server's limit uses the limit.
+  4: i32 bufferSize = 0,
+}
+
+struct SubscribeResult {
+  // DONT_OWN_SHARD if one of the shards isn't owned by this host and
+  // OVERLOADED if the host has too many subscriptions.
+  1: StatusCode status,
+  2: i64 subscriptionId,
+}
+
+struct PollSubscriptionRequest {
+  1: i64 subscriptionId,
+
+  // How long to wait for new points if there are none yet.
+  2: i32 timeoutMs = 0,
+
+  // The most points returned. 0 returns all of them.
+  3: i32 maxPoints = 0,
+}
+
+struct PollSubscriptionResult {
+  // KEY_MISSING if the subscription doesn't exist anymore, e.g., it
+  // wasn't polled for too long. Subscribe again in that case.
+  1: StatusCode status,
+
+  // The points added since the last poll, in the order they were added.
+  2: list<DataPoint> points,
+
+  // Points dropped since the last poll because the buffer was full.
+  3: i64 droppedPoints,
+}
+
+// backfill structs
+
+struct BackfillData {
+  1: Key key,
+
+  // The points of the key, sorted by time, e.g., encoded with
+  // TimeSeries::writeValues(). Only the points in the finalized buckets
+  // that the host still has in memory are written.
+  2: TimeSeriesBlock block,
+  3: i32 categoryId,
+}
+
+struct BackfillRequest {
+  1: list<BackfillData> data,
+}
+
+struct BackfillResult {
+  // DONT_OWN_SHARD if some of the data was rejected.
+  1: StatusCode status = OK,
+
+  // Indexes in `data` of the keys whose shards aren't owned by this
+  // host or are still being read. They should be sent again later.
+  2: list<i32> rejected,
+
+  3: i64 pointsAdded,
+
+  // Points outside of the finalized buckets in memory, or that could
+  // not be stored.
+  4: i64 pointsDropped,
 }
 
 // Key and Data Logging Structures
@@ -221,3 +645,9 @@ struct DataPointWithID {
 struct LogDataPointsRequest {
   1: list<DataPointWithID> points,
 }
+
+struct ReplicationResult {
+  // Shards that this host doesn't follow or isn't ready for yet. Their
+  // entries should be sent again later.
+  1: list<i64> rejectedShards,
+}
@@ -40,8 +40,8 @@ namespace py facebook.gorilla.beringei_grafana
     "maxDataPoints": 550
   }
 
-  We don't need thrift structures for the responses because we are using folly::dynamic
-  and folly::toJson().
+  We don't need thrift structures for the responses because QueryHandler
+  writes the JSON itself.
 
 */
 
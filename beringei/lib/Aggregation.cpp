@@ -0,0 +1,590 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "Aggregation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+#include <folly/CpuId.h>
+
+#include "TimeSeries.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+const double kInfinity = std::numeric_limits<double>::infinity();
+
+// Limits the memory used by server side downsampling.
+const int64_t kMaxAggregationSteps = 1 << 20;
+
+// The portable kernels use four independent accumulators to break the
+// dependency chain between iterations.
+
+double sumScalar(const double* values, size_t n) {
+  double acc[4] = {0, 0, 0, 0};
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc[0] += values[i];
+    acc[1] += values[i + 1];
+    acc[2] += values[i + 2];
+    acc[3] += values[i + 3];
+  }
+
+  double result = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  for (; i < n; i++) {
+    result += values[i];
+  }
+  return result;
+}
+
+template <typename Compare>
+double extremeScalar(const double* values, size_t n, double init) {
+  Compare compare;
+  double acc[4] = {init, init, init, init};
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int j = 0; j < 4; j++) {
+      acc[j] = compare(values[i + j], acc[j]) ? values[i + j] : acc[j];
+    }
+  }
+
+  double result = init;
+  for (int j = 0; j < 4; j++) {
+    result = compare(acc[j], result) ? acc[j] : result;
+  }
+  for (; i < n; i++) {
+    result = compare(values[i], result) ? values[i] : result;
+  }
+  return result;
+}
+
+// Decodes all the points between begin and end into the given arrays.
+size_t decode(
+    const std::vector<facebook::gorilla::TimeSeriesBlock>& blocks,
+    int64_t begin,
+    int64_t end,
+    std::vector<int64_t>& timestamps,
+    std::vector<double>& values) {
+  size_t total = 0;
+  for (const auto& block : blocks) {
+    total += block.count;
+  }
+
+  timestamps.resize(total);
+  values.resize(total);
+  return facebook::gorilla::TimeSeries::getValues(
+      blocks, timestamps.data(), values.data(), begin, end);
+}
+
+template <facebook::gorilla::AggregationType kType>
+void visitAndDownsample(
+    const std::vector<facebook::gorilla::TimeSeriesBlock>& blocks,
+    int64_t begin,
+    int64_t end,
+    int64_t step,
+    size_t numSteps,
+    std::vector<double>& out) {
+  facebook::gorilla::StepAggregator<kType> aggregator(begin, step, numSteps);
+  facebook::gorilla::TimeSeries::visitValues(blocks, begin, end, aggregator);
+  aggregator.getValues(out);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((__target__("avx2"))) double horizontalSum(__m256d v) {
+  double lanes[4];
+  _mm256_storeu_pd(lanes, v);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((__target__("avx2"))) double sumAvx2(
+    const double* values,
+    size_t n) {
+  __m256d acc0 = _mm256_setzero_pd();
+  __m256d acc1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+    acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(values + i + 4));
+  }
+
+  double result = horizontalSum(_mm256_add_pd(acc0, acc1));
+  for (; i < n; i++) {
+    result += values[i];
+  }
+  return result;
+}
+
+// _mm256_min_pd and _mm256_max_pd return the second operand if either
+// one is NaN, which skips NaN values the same way the scalar kernels
+// do.
+template <bool kMin>
+__attribute__((__target__("avx2"))) double extremeAvx2(
+    const double* values,
+    size_t n,
+    double init) {
+  __m256d acc0 = _mm256_set1_pd(init);
+  __m256d acc1 = _mm256_set1_pd(init);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256d v0 = _mm256_loadu_pd(values + i);
+    __m256d v1 = _mm256_loadu_pd(values + i + 4);
+    if (kMin) {
+      acc0 = _mm256_min_pd(v0, acc0);
+      acc1 = _mm256_min_pd(v1, acc1);
+    } else {
+      acc0 = _mm256_max_pd(v0, acc0);
+      acc1 = _mm256_max_pd(v1, acc1);
+    }
+  }
+
+  double lanes[8];
+  _mm256_storeu_pd(lanes, acc0);
+  _mm256_storeu_pd(lanes + 4, acc1);
+  double result = init;
+  for (int j = 0; j < 8; j++) {
+    result = (kMin ? lanes[j] < result : lanes[j] > result) ? lanes[j] : result;
+  }
+  for (; i < n; i++) {
+    result =
+        (kMin ? values[i] < result : values[i] > result) ? values[i] : result;
+  }
+  return result;
+}
+
+const bool kHasAvx2 = folly::CpuId().avx2();
+#endif
+} // namespace
+
+namespace facebook {
+namespace gorilla {
+
+double Aggregation::sum(const double* values, size_t n) {
+#if defined(__x86_64__)
+  if (kHasAvx2) {
+    return sumAvx2(values, n);
+  }
+#endif
+  return sumScalar(values, n);
+}
+
+double Aggregation::min(const double* values, size_t n) {
+  if (n == 0) {
+    return kNaN;
+  }
+#if defined(__x86_64__)
+  if (kHasAvx2) {
+    return extremeAvx2<true>(values, n, kInfinity);
+  }
+#endif
+  return extremeScalar<std::less<double>>(values, n, kInfinity);
+}
+
+double Aggregation::max(const double* values, size_t n) {
+  if (n == 0) {
+    return kNaN;
+  }
+#if defined(__x86_64__)
+  if (kHasAvx2) {
+    return extremeAvx2<false>(values, n, -kInfinity);
+  }
+#endif
+  return extremeScalar<std::greater<double>>(values, n, -kInfinity);
+}
+
+double Aggregation::avg(const double* values, size_t n) {
+  if (n == 0) {
+    return kNaN;
+  }
+  return sum(values, n) / n;
+}
+
+double Aggregation::last(const double* values, size_t n) {
+  return n == 0 ? kNaN : values[n - 1];
+}
+
+double
+Aggregation::aggregate(AggregationType type, const double* values, size_t n) {
+  switch (type) {
+    case AggregationType::SUM:
+      return sum(values, n);
+    case AggregationType::MIN:
+      return min(values, n);
+    case AggregationType::MAX:
+      return max(values, n);
+    case AggregationType::COUNT:
+      return n;
+    case AggregationType::AVG:
+      return avg(values, n);
+    case AggregationType::LAST:
+      return last(values, n);
+  }
+  return kNaN;
+}
+
+void Aggregation::downsample(
+    const int64_t* timestamps,
+    const double* values,
+    size_t n,
+    int64_t begin,
+    int64_t step,
+    size_t numSteps,
+    AggregationType type,
+    std::vector<double>& out) {
+  if (step <= 0) {
+    out.assign(numSteps, kNaN);
+    return;
+  }
+  out.assign(numSteps, 0);
+
+  // Number of points per window. Needed for the averages and to tell
+  // empty windows apart.
+  std::vector<uint32_t> counts(numSteps, 0);
+
+  size_t i = 0;
+  while (i < n) {
+    int64_t unixTime = timestamps[i];
+    if (unixTime < begin || (uint64_t)((unixTime - begin) / step) >= numSteps) {
+      i++;
+      continue;
+    }
+
+    // Find the run of points that falls in the same window and
+    // aggregate it with a single kernel call.
+    size_t window = (unixTime - begin) / step;
+    int64_t windowBegin = begin + window * step;
+    int64_t windowEnd = windowBegin + step;
+    size_t runEnd = i + 1;
+    while (runEnd < n && timestamps[runEnd] >= windowBegin &&
+           timestamps[runEnd] < windowEnd) {
+      runEnd++;
+    }
+
+    size_t runLength = runEnd - i;
+    const double* run = values + i;
+    bool first = counts[window] == 0;
+    double& result = out[window];
+    switch (type) {
+      case AggregationType::SUM:
+      case AggregationType::AVG:
+        result += sum(run, runLength);
+        break;
+      case AggregationType::MIN: {
+        double value = min(run, runLength);
+        result = first || value < result ? value : result;
+        break;
+      }
+      case AggregationType::MAX: {
+        double value = max(run, runLength);
+        result = first || value > result ? value : result;
+        break;
+      }
+      case AggregationType::COUNT:
+        result += runLength;
+        break;
+      case AggregationType::LAST:
+        result = run[runLength - 1];
+        break;
+    }
+
+    counts[window] += runLength;
+    i = runEnd;
+  }
+
+  for (size_t window = 0; window < numSteps; window++) {
+    if (type == AggregationType::COUNT) {
+      continue;
+    }
+
+    if (counts[window] == 0) {
+      out[window] = kNaN;
+    } else if (type == AggregationType::AVG) {
+      out[window] /= counts[window];
+    }
+  }
+}
+
+double Aggregation::aggregate(
+    AggregationType type,
+    const std::vector<TimeSeriesBlock>& blocks,
+    int64_t begin,
+    int64_t end) {
+  std::vector<int64_t> timestamps;
+  std::vector<double> values;
+  size_t n = decode(blocks, begin, end, timestamps, values);
+  return aggregate(type, values.data(), n);
+}
+
+void Aggregation::downsample(
+    const std::vector<TimeSeriesBlock>& blocks,
+    int64_t begin,
+    int64_t end,
+    int64_t step,
+    AggregationType type,
+    std::vector<double>& out) {
+  if (step <= 0 || end < begin) {
+    out.clear();
+    return;
+  }
+
+  size_t numSteps = (end - begin) / step + 1;
+  switch (type) {
+    case AggregationType::SUM:
+      visitAndDownsample<AggregationType::SUM>(
+          blocks, begin, end, step, numSteps, out);
+      break;
+    case AggregationType::MIN:
+      visitAndDownsample<AggregationType::MIN>(
+          blocks, begin, end, step, numSteps, out);
+      break;
+    case AggregationType::MAX:
+      visitAndDownsample<AggregationType::MAX>(
+          blocks, begin, end, step, numSteps, out);
+      break;
+    case AggregationType::COUNT:
+      visitAndDownsample<AggregationType::COUNT>(
+          blocks, begin, end, step, numSteps, out);
+      break;
+    case AggregationType::AVG:
+      visitAndDownsample<AggregationType::AVG>(
+          blocks, begin, end, step, numSteps, out);
+      break;
+    case AggregationType::LAST:
+      visitAndDownsample<AggregationType::LAST>(
+          blocks, begin, end, step, numSteps, out);
+      break;
+  }
+}
+
+bool Aggregation::fromThrift(
+    AggregationFunction function,
+    AggregationType& type) {
+  switch (function) {
+    case AggregationFunction::SUM:
+      type = AggregationType::SUM;
+      return true;
+    case AggregationFunction::MIN:
+      type = AggregationType::MIN;
+      return true;
+    case AggregationFunction::MAX:
+      type = AggregationType::MAX;
+      return true;
+    case AggregationFunction::COUNT:
+      type = AggregationType::COUNT;
+      return true;
+    case AggregationFunction::AVG:
+      type = AggregationType::AVG;
+      return true;
+    case AggregationFunction::LAST:
+      type = AggregationType::LAST;
+      return true;
+    case AggregationFunction::NONE:
+      break;
+  }
+  return false;
+}
+
+bool Aggregation::isValid(
+    const AggregationSpec& spec,
+    int64_t begin,
+    int64_t end) {
+  AggregationType type;
+  return spec.step > 0 && end >= begin &&
+      (end - begin) / spec.step < kMaxAggregationSteps &&
+      fromThrift(spec.function, type);
+}
+
+bool Aggregation::downsampleBlocks(
+    const AggregationSpec& spec,
+    int64_t begin,
+    int64_t end,
+    std::vector<TimeSeriesBlock>& blocks,
+    std::vector<double>& windows) {
+  AggregationType type;
+  if (!isValid(spec, begin, end) || !fromThrift(spec.function, type)) {
+    return false;
+  }
+
+  downsample(blocks, begin, end, spec.step, type, windows);
+  windowsToBlocks(type, begin, spec.step, windows, blocks);
+  return true;
+}
+
+void Aggregation::windowsToBlocks(
+    AggregationType type,
+    int64_t begin,
+    int64_t step,
+    const std::vector<double>& windows,
+    std::vector<TimeSeriesBlock>& blocks) {
+  std::vector<TimeValuePair> points;
+  for (size_t window = 0; window < windows.size(); window++) {
+    // Empty COUNT windows are zero rather than NaN.
+    if (!std::isnan(windows[window]) &&
+        (type != AggregationType::COUNT || windows[window] > 0)) {
+      points.emplace_back();
+      points.back().unixTime = begin + window * step;
+      points.back().value = windows[window];
+    }
+  }
+
+  blocks.clear();
+  if (!points.empty()) {
+    blocks.emplace_back();
+    TimeSeries::writeValues(points, blocks.back());
+  }
+}
+
+void Aggregation::reduce(
+    AggregationType type,
+    int64_t begin,
+    int64_t step,
+    const std::vector<std::vector<double>>& windows,
+    std::vector<TimeSeriesBlock>& out) {
+  size_t numSteps = 0;
+  for (const auto& keyWindows : windows) {
+    numSteps = std::max(numSteps, keyWindows.size());
+  }
+
+  std::vector<TimeValuePair> points;
+  std::vector<double> values;
+  values.reserve(windows.size());
+  for (size_t window = 0; window < numSteps; window++) {
+    values.clear();
+    for (const auto& keyWindows : windows) {
+      if (window < keyWindows.size() && !std::isnan(keyWindows[window])) {
+        values.push_back(keyWindows[window]);
+      }
+    }
+
+    if (!values.empty()) {
+      points.emplace_back();
+      points.back().unixTime = begin + window * step;
+      points.back().value = aggregate(type, values.data(), values.size());
+    }
+  }
+
+  out.clear();
+  if (!points.empty()) {
+    out.emplace_back();
+    TimeSeries::writeValues(points, out.back());
+  }
+}
+
+void Aggregation::largestTriangleThreeBuckets(
+    const std::vector<TimeValuePair>& in,
+    size_t maxPoints,
+    std::vector<TimeValuePair>& out) {
+  out.clear();
+  if (in.size() <= maxPoints || maxPoints < 3) {
+    out = in;
+    return;
+  }
+
+  // The points between the first and the last one are split into
+  // `maxPoints - 2` buckets, and the point of each bucket that makes the
+  // largest triangle with the point picked from the previous bucket and
+  // the average of the next one is kept.
+  out.reserve(maxPoints);
+  const double every = (double)(in.size() - 2) / (maxPoints - 2);
+  size_t picked = 0;
+  out.push_back(in[0]);
+
+  for (size_t bucket = 0; bucket < maxPoints - 2; bucket++) {
+    size_t begin = (size_t)(bucket * every) + 1;
+    size_t end = (size_t)((bucket + 1) * every) + 1;
+
+    size_t nextEnd = std::min((size_t)((bucket + 2) * every) + 1, in.size());
+    double avgTime = 0;
+    double avgValue = 0;
+    for (size_t i = end; i < nextEnd; i++) {
+      avgTime += in[i].unixTime;
+      avgValue += in[i].value;
+    }
+    if (nextEnd > end) {
+      avgTime /= nextEnd - end;
+      avgValue /= nextEnd - end;
+    } else {
+      avgTime = in.back().unixTime;
+      avgValue = in.back().value;
+    }
+
+    const double pickedTime = in[picked].unixTime;
+    const double pickedValue = in[picked].value;
+    double maxArea = -1;
+    size_t next = begin;
+    for (size_t i = begin; i < end; i++) {
+      // Twice the area, which doesn't change the order.
+      double area = std::abs(
+          (pickedTime - avgTime) * (in[i].value - pickedValue) -
+          (pickedTime - in[i].unixTime) * (avgValue - pickedValue));
+      if (area > maxArea) {
+        maxArea = area;
+        next = i;
+      }
+    }
+
+    out.push_back(in[next]);
+    picked = next;
+  }
+
+  out.push_back(in.back());
+}
+
+void Aggregation::swingingDoor(
+    const std::vector<TimeValuePair>& in,
+    double maxError,
+    int64_t maxGap,
+    std::vector<TimeValuePair>& out) {
+  out.clear();
+  if (in.empty()) {
+    return;
+  }
+
+  size_t pivot = 0;
+  out.push_back(in[0]);
+  while (pivot + 1 < in.size()) {
+    const TimeValuePair& from = in[pivot];
+
+    // The slopes from the pivot that pass within `maxError` of all the
+    // points seen so far. The next point is always a valid end.
+    double lower = -std::numeric_limits<double>::infinity();
+    double upper = std::numeric_limits<double>::infinity();
+    size_t end = pivot + 1;
+    for (size_t i = pivot + 1; i < in.size(); i++) {
+      double dt = in[i].unixTime - from.unixTime;
+      if (i > pivot + 1 &&
+          ((maxGap > 0 && dt > maxGap) || dt <= 0 || std::isnan(from.value))) {
+        break;
+      }
+
+      double slope = (in[i].value - from.value) / dt;
+      if (slope >= lower && slope <= upper) {
+        end = i;
+      }
+      lower = std::max(lower, (in[i].value - maxError - from.value) / dt);
+      upper = std::min(upper, (in[i].value + maxError - from.value) / dt);
+      if (lower > upper || std::isnan(in[i].value)) {
+        // The door closed, or no line can pass over a NaN.
+        break;
+      }
+    }
+
+    out.push_back(in[end]);
+    pivot = end;
+  }
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,229 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+enum class AggregationType {
+  SUM,
+  MIN,
+  MAX,
+  COUNT,
+  AVG,
+  LAST,
+};
+
+// class Aggregation
+//
+// Aggregation kernels that work on the columnar output of
+// `TimeSeriesStream::readValues` and `TimeSeries::getValues`. The
+// sum, min and max kernels use AVX2 when the CPU supports it.
+//
+// NaN values propagate through sum and avg and are skipped by min and
+// max.
+class Aggregation {
+ public:
+  // Returns zero if there are no values.
+  static double sum(const double* values, size_t n);
+
+  // Min, max, avg and last return NaN if there are no values.
+  static double min(const double* values, size_t n);
+  static double max(const double* values, size_t n);
+  static double avg(const double* values, size_t n);
+  static double last(const double* values, size_t n);
+
+  static double aggregate(AggregationType type, const double* values, size_t n);
+
+  // Aggregates the points into `numSteps` windows of `step` seconds,
+  // the first one starting at `begin`. `out` gets one value per
+  // window. Windows without points are NaN, except for COUNT where
+  // they are zero. Points outside of the windows are ignored.
+  //
+  // Works in one pass when the timestamps are sorted, which they are
+  // for decoded blocks.
+  static void downsample(
+      const int64_t* timestamps,
+      const double* values,
+      size_t n,
+      int64_t begin,
+      int64_t step,
+      size_t numSteps,
+      AggregationType type,
+      std::vector<double>& out);
+
+  // Decodes the blocks and aggregates all the points that are between
+  // begin and end inclusive.
+  static double aggregate(
+      AggregationType type,
+      const std::vector<TimeSeriesBlock>& blocks,
+      int64_t begin,
+      int64_t end);
+
+  // Downsamples the points in the blocks between begin and end
+  // inclusive into windows of `step` seconds. The points are
+  // aggregated while decoding with a StepAggregator, so memory use
+  // depends on the number of windows and not the number of points.
+  static void downsample(
+      const std::vector<TimeSeriesBlock>& blocks,
+      int64_t begin,
+      int64_t end,
+      int64_t step,
+      AggregationType type,
+      std::vector<double>& out);
+
+  // Maps the thrift enum. Returns false for NONE.
+  static bool fromThrift(AggregationFunction function, AggregationType& type);
+
+  // True if `spec` asks for downsampling between begin and end.
+  static bool isValid(const AggregationSpec& spec, int64_t begin, int64_t end);
+
+  // Server side downsampling for getData. Replaces `blocks` with a
+  // single block holding one point per non-empty window and moves the
+  // value of every window to `windows`. Does nothing and returns false
+  // if `spec` is not valid.
+  static bool downsampleBlocks(
+      const AggregationSpec& spec,
+      int64_t begin,
+      int64_t end,
+      std::vector<TimeSeriesBlock>& blocks,
+      std::vector<double>& windows);
+
+  // Replaces `blocks` with a single block holding one point per
+  // non-empty window of `windows`, as downsampleBlocks() does.
+  static void windowsToBlocks(
+      AggregationType type,
+      int64_t begin,
+      int64_t step,
+      const std::vector<double>& windows,
+      std::vector<TimeSeriesBlock>& blocks);
+
+  // Reduces the window values of several keys, as returned by
+  // downsampleBlocks(), into `out` with one point per window that has
+  // a value for at least one key. NaN values are skipped.
+  static void reduce(
+      AggregationType type,
+      int64_t begin,
+      int64_t step,
+      const std::vector<std::vector<double>>& windows,
+      std::vector<TimeSeriesBlock>& out);
+
+  // Picks at most `maxPoints` of the time ordered `in` with the Largest
+  // Triangle Three Buckets algorithm, which keeps the points that shape
+  // a line chart unlike averaging windows. The first and last points are
+  // always kept. Copies `in` if it has no more than `maxPoints` points or
+  // `maxPoints` is less than 3.
+  static void largestTriangleThreeBuckets(
+      const std::vector<TimeValuePair>& in,
+      size_t maxPoints,
+      std::vector<TimeValuePair>& out);
+
+  // Keeps the points of the time ordered `in` that the line between two
+  // consecutive kept points can't pass within `maxError` of, with the
+  // swinging door algorithm. The kept points are at most `maxGap`
+  // seconds apart unless there's nothing between them, and `maxGap`
+  // of 0 doesn't limit them. The first and last points and the points
+  // next to NaNs are always kept.
+  static void swingingDoor(
+      const std::vector<TimeValuePair>& in,
+      double maxError,
+      int64_t maxGap,
+      std::vector<TimeValuePair>& out);
+};
+
+// class StepAggregator
+//
+// Aggregates points into `numSteps` windows of `step` seconds as they
+// are visited, e.g. by `TimeSeries::visitValues`, without storing the
+// points. The aggregation type is a template parameter so that the
+// work per point gets inlined into the decoding loop. Produces the
+// same results as `Aggregation::downsample`.
+template <AggregationType kType>
+class StepAggregator {
+ public:
+  StepAggregator(int64_t begin, int64_t step, size_t numSteps)
+      : begin_(begin),
+        step_(step),
+        values_(numSteps, initialValue()),
+        counts_(numSteps, 0) {}
+
+  void operator()(int64_t unixTime, double value) {
+    if (unixTime < begin_) {
+      return;
+    }
+
+    uint64_t window = (unixTime - begin_) / step_;
+    if (window >= values_.size()) {
+      return;
+    }
+
+    double& result = values_[window];
+    switch (kType) {
+      case AggregationType::SUM:
+      case AggregationType::AVG:
+        result += value;
+        break;
+      case AggregationType::MIN:
+        result = value < result ? value : result;
+        break;
+      case AggregationType::MAX:
+        result = value > result ? value : result;
+        break;
+      case AggregationType::COUNT:
+        break;
+      case AggregationType::LAST:
+        result = value;
+        break;
+    }
+    counts_[window]++;
+  }
+
+  // Moves the aggregated window values to `out`. The aggregator can't
+  // be used after this.
+  void getValues(std::vector<double>& out) {
+    for (size_t window = 0; window < values_.size(); window++) {
+      if (kType == AggregationType::COUNT) {
+        values_[window] = counts_[window];
+      } else if (counts_[window] == 0) {
+        values_[window] = std::numeric_limits<double>::quiet_NaN();
+      } else if (kType == AggregationType::AVG) {
+        values_[window] /= counts_[window];
+      }
+    }
+    out = std::move(values_);
+  }
+
+ private:
+  static double initialValue() {
+    switch (kType) {
+      case AggregationType::MIN:
+        return std::numeric_limits<double>::infinity();
+      case AggregationType::MAX:
+        return -std::numeric_limits<double>::infinity();
+      default:
+        return 0;
+    }
+  }
+
+  const int64_t begin_;
+  const int64_t step_;
+  std::vector<double> values_;
+  std::vector<uint32_t> counts_;
+};
+}
+} // facebook::gorilla
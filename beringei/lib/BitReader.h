@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdexcept>
+
+#include <folly/Likely.h>
+#include <folly/Range.h>
+#include <folly/lang/Bits.h>
+
+namespace facebook {
+namespace gorilla {
+
+// class BitReader
+//
+// Reads values from a bit string written by
+// `BitUtil::addValueToBitString`. Bits are consumed from a cached
+// 64-bit window that is refilled with unaligned big endian loads, so
+// a read is usually a couple of shifts instead of a loop over
+// individual bits.
+//
+// Produces exactly the same values as the `BitUtil::read*` functions
+// and throws std::runtime_error when trying to read past the end of
+// the data.
+class BitReader {
+ public:
+  explicit BitReader(folly::StringPiece data)
+      : data_(reinterpret_cast<const uint8_t*>(data.data())),
+        size_(data.size()),
+        nextByte_(0),
+        window_(0),
+        bitsInWindow_(0) {}
+
+  // Position of the next bit to read from the beginning of the data.
+  uint64_t bitPos() const {
+    return nextByte_ * 8 - bitsInWindow_;
+  }
+
+  // Moves the read position to `bitPos` bits from the beginning of
+  // the data.
+  void seek(uint64_t bitPos) {
+    if (bitPos > size_ * 8) {
+      throw std::runtime_error("Trying to seek past the end");
+    }
+
+    nextByte_ = bitPos >> 3;
+    window_ = 0;
+    bitsInWindow_ = 0;
+    refill();
+    consume(bitPos & 0x7);
+  }
+
+  // Reads `bitsToRead` bits, most significant bit first. `bitsToRead`
+  // must be 64 or less.
+  uint64_t read(uint32_t bitsToRead) {
+    if (UNLIKELY(bitsToRead == 0)) {
+      return 0;
+    }
+
+    if (UNLIKELY(bitsToRead > bitsInWindow_)) {
+      refill();
+      if (bitsToRead > bitsInWindow_) {
+        if (nextByte_ == size_) {
+          throw std::runtime_error("Trying to read too many bits");
+        }
+
+        // Only reads of more than 56 bits get here because a refill
+        // leaves at least 56 bits in the window unless the data ends.
+        uint64_t high = read(bitsToRead - 32);
+        return (high << 32) | read(32);
+      }
+    }
+
+    uint64_t value = window_ >> (64 - bitsToRead);
+    consume(bitsToRead);
+    return value;
+  }
+
+  // Finds the first zero bit and returns its distance from the
+  // current position. Consumes the zero bit. If not found within
+  // `limit` bits, consumes `limit` bits and returns `limit`. `limit`
+  // must be 32 or less.
+  uint32_t findTheFirstZeroBit(uint32_t limit) {
+    if (UNLIKELY(limit > bitsInWindow_)) {
+      refill();
+    }
+
+    uint64_t inverted = ~window_;
+    uint32_t ones = inverted == 0 ? 64 : __builtin_clzll(inverted);
+    if (ones < limit && ones < bitsInWindow_) {
+      consume(ones + 1);
+      return ones;
+    }
+
+    if (UNLIKELY(limit > bitsInWindow_)) {
+      throw std::runtime_error("Trying to read too many bits");
+    }
+
+    consume(limit);
+    return limit;
+  }
+
+  // Reads a value until the first zero bit is found or limit
+  // reached. The zero is included in the value as the least
+  // significant bit. `limit` must be 32 or less.
+  uint32_t readValueThroughFirstZero(uint32_t limit) {
+    uint32_t ones = findTheFirstZeroBit(limit);
+    if (ones < limit) {
+      return ((1ULL << ones) - 1) << 1;
+    }
+    return (1ULL << limit) - 1;
+  }
+
+ private:
+  // Loads as many whole bytes into the window as fit. Leaves at least
+  // 56 bits in the window unless there is no more data.
+  void refill() {
+    if (LIKELY(nextByte_ + sizeof(uint64_t) <= size_)) {
+      uint64_t word =
+          folly::Endian::big(folly::loadUnaligned<uint64_t>(data_ + nextByte_));
+      uint32_t bytes = (63 - bitsInWindow_) >> 3;
+
+      // Bits past the last whole byte are real data and will be
+      // loaded again with the same value on the next refill.
+      window_ |= word >> bitsInWindow_;
+      nextByte_ += bytes;
+      bitsInWindow_ += bytes * 8;
+      return;
+    }
+
+    while (bitsInWindow_ <= 56 && nextByte_ < size_) {
+      window_ |= (uint64_t)data_[nextByte_++] << (56 - bitsInWindow_);
+      bitsInWindow_ += 8;
+    }
+  }
+
+  void consume(uint32_t bits) {
+    window_ = bits == 64 ? 0 : window_ << bits;
+    bitsInWindow_ -= bits;
+  }
+
+  const uint8_t* data_;
+  size_t size_;
+
+  // Offset of the next byte to load into the window.
+  size_t nextByte_;
+
+  // Unread bits aligned to the most significant bit.
+  uint64_t window_;
+  uint32_t bitsInWindow_;
+};
+}
+} // facebook::gorilla
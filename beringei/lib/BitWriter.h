@@ -0,0 +1,199 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <folly/FBString.h>
+#include <folly/Likely.h>
+#include <folly/lang/Bits.h>
+
+namespace facebook {
+namespace gorilla {
+
+// class BasicBitWriter
+//
+// Appends values to a bit string in the same format as
+// `BitUtil::addValueToBitString`, but collects the bits in a 64-bit
+// register and only touches the string when a whole word is full or
+// when the writer is flushed. The string can be of any type with
+// `size()`, `operator[]` and `append(const char*, size_t)`.
+//
+// The writer is meant to be short lived: create it on the stack for
+// the duration of one encoded record or point. The bit string is
+// complete only after `flush()` has been called, which the destructor
+// does automatically.
+template <typename BitString>
+class BasicBitWriter {
+ public:
+  BasicBitWriter(BitString& bitString, uint32_t& numBits)
+      : bitString_(bitString),
+        numBits_(numBits),
+        windowStart_(numBits >> 3),
+        window_(0),
+        bitsInWindow_(numBits & 0x7) {
+    if (bitsInWindow_ > 0) {
+      // Continue from the partially filled last byte. The stale byte
+      // is left in the string and overwritten on the next flush.
+      window_ = (uint64_t)(uint8_t)bitString_[windowStart_] << 56;
+    }
+  }
+
+  ~BasicBitWriter() {
+    flush();
+  }
+
+  BasicBitWriter(const BasicBitWriter&) = delete;
+  BasicBitWriter& operator=(const BasicBitWriter&) = delete;
+
+  // Adds the `bitsInValue` least significant bits of `value`, most
+  // significant bit first. `bitsInValue` must be 64 or less.
+  void write(uint64_t value, uint32_t bitsInValue) {
+    if (UNLIKELY(bitsInValue == 0)) {
+      return;
+    }
+
+    if (bitsInValue < 64) {
+      value &= (1ULL << bitsInValue) - 1;
+    }
+    numBits_ += bitsInValue;
+
+    uint32_t room = 64 - bitsInWindow_;
+    if (LIKELY(bitsInValue < room)) {
+      window_ |= value << (room - bitsInValue);
+      bitsInWindow_ += bitsInValue;
+      return;
+    }
+
+    // Fill the rest of the window, write it out and start a new
+    // window with the remaining bits.
+    uint32_t remaining = bitsInValue - room;
+    window_ |= value >> remaining;
+    writeWord();
+    window_ = remaining == 0 ? 0 : value << (64 - remaining);
+    bitsInWindow_ = remaining;
+  }
+
+  // Writes all the pending bits to the bit string. The last byte is
+  // padded with zeros if needed. The writer can still be used after
+  // flushing.
+  void flush() {
+    if (bitsInWindow_ == 0) {
+      return;
+    }
+
+    uint64_t word = folly::Endian::big(window_);
+    writeBytes(reinterpret_cast<const char*>(&word), (bitsInWindow_ + 7) >> 3);
+
+    // Keep the partially filled byte in the window so that later
+    // writes can continue from it.
+    uint32_t fullBytes = bitsInWindow_ >> 3;
+    windowStart_ += fullBytes;
+    window_ = fullBytes == 0 ? window_ : window_ << (fullBytes * 8);
+    bitsInWindow_ -= fullBytes * 8;
+  }
+
+ private:
+  void writeWord() {
+    uint64_t word = folly::Endian::big(window_);
+    writeBytes(reinterpret_cast<const char*>(&word), sizeof(word));
+    windowStart_ += sizeof(word);
+  }
+
+  // Writes `length` bytes at `windowStart_`. The first byte might
+  // already be in the string as a partially filled byte from a
+  // previous flush, in which case it is overwritten in place.
+  void writeBytes(const char* bytes, size_t length) {
+    if (bitString_.size() > windowStart_) {
+      bitString_[windowStart_] = bytes[0];
+      bytes++;
+      length--;
+    }
+    bitString_.append(bytes, length);
+  }
+
+  BitString& bitString_;
+  uint32_t& numBits_;
+
+  // Byte offset in `bitString_` where the bits in the window begin.
+  size_t windowStart_;
+
+  // Pending bits aligned to the most significant bit.
+  uint64_t window_;
+  uint32_t bitsInWindow_;
+};
+
+typedef BasicBitWriter<folly::fbstring> BitWriter;
+
+// class BufferBitWriter
+//
+// Same as `BasicBitWriter`, but writes to a caller owned buffer
+// instead of a string so that encoding doesn't allocate. Writing
+// starts from a byte boundary and the caller must make sure that the
+// buffer has room for all the bits, rounded up to whole bytes.
+class BufferBitWriter {
+ public:
+  explicit BufferBitWriter(char* buffer)
+      : buffer_(buffer), bytes_(0), window_(0), bitsInWindow_(0) {}
+
+  BufferBitWriter(const BufferBitWriter&) = delete;
+  BufferBitWriter& operator=(const BufferBitWriter&) = delete;
+
+  // Adds the `bitsInValue` least significant bits of `value`, most
+  // significant bit first. `bitsInValue` must be 64 or less.
+  void write(uint64_t value, uint32_t bitsInValue) {
+    if (UNLIKELY(bitsInValue == 0)) {
+      return;
+    }
+
+    if (bitsInValue < 64) {
+      value &= (1ULL << bitsInValue) - 1;
+    }
+
+    uint32_t room = 64 - bitsInWindow_;
+    if (LIKELY(bitsInValue < room)) {
+      window_ |= value << (room - bitsInValue);
+      bitsInWindow_ += bitsInValue;
+      return;
+    }
+
+    uint32_t remaining = bitsInValue - room;
+    window_ |= value >> remaining;
+    writeBytes(sizeof(window_));
+    window_ = remaining == 0 ? 0 : value << (64 - remaining);
+    bitsInWindow_ = remaining;
+  }
+
+  // Writes all the pending bits to the buffer, padding the last byte
+  // with zeros, and returns the total number of bytes written. The
+  // writer must not be used after flushing.
+  size_t flush() {
+    writeBytes((bitsInWindow_ + 7) >> 3);
+    bitsInWindow_ = 0;
+    return bytes_;
+  }
+
+ private:
+  void writeBytes(size_t length) {
+    uint64_t word = folly::Endian::big(window_);
+    memcpy(buffer_ + bytes_, &word, length);
+    bytes_ += length;
+  }
+
+  char* buffer_;
+  size_t bytes_;
+
+  // Pending bits aligned to the most significant bit.
+  uint64_t window_;
+  uint32_t bitsInWindow_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+namespace facebook {
+namespace gorilla {
+
+// class BlockDedupTable
+//
+// Open-addressing table from the hash of a stored block to its storage
+// id. Replaces a `std::unordered_multimap` so that a bucket's dedup
+// index is one flat allocation that can be sized up front and reused
+// for the next bucket. The same hash can be inserted more than once
+// for blocks that collide. Storage id 0 marks an empty slot.
+//
+// Not thread-safe.
+class BlockDedupTable {
+ public:
+  BlockDedupTable() : capacity_(0), size_(0) {}
+
+  // Removes all entries and makes room for `n` entries without
+  // growing. Keeps the current allocation if it's big enough but not
+  // much bigger than needed.
+  void reset(size_t n) {
+    size_t capacity = capacityFor(n);
+    if (capacity == capacity_ || (capacity < capacity_ && capacity_ < 4 * n)) {
+      for (size_t i = 0; i < capacity_; i++) {
+        slots_[i].id = 0;
+      }
+    } else {
+      slots_.reset(new Slot[capacity]());
+      capacity_ = capacity;
+    }
+    size_ = 0;
+  }
+
+  // Frees the memory.
+  void release() {
+    slots_.reset();
+    capacity_ = 0;
+    size_ = 0;
+  }
+
+  // Returns the first id with the given hash for which `matches(id)`
+  // returns true, or 0.
+  template <typename Matches>
+  uint64_t find(uint64_t hash, Matches&& matches) const {
+    if (capacity_ == 0) {
+      return 0;
+    }
+
+    size_t mask = capacity_ - 1;
+    for (size_t i = hash & mask; slots_[i].id != 0; i = (i + 1) & mask) {
+      if (slots_[i].hash == hash && matches(slots_[i].id)) {
+        return slots_[i].id;
+      }
+    }
+    return 0;
+  }
+
+  void insert(uint64_t hash, uint64_t id) {
+    if ((size_ + 1) * kMaxLoadDenominator > capacity_ * kMaxLoadNumerator) {
+      grow();
+    }
+
+    size_t mask = capacity_ - 1;
+    size_t i = hash & mask;
+    while (slots_[i].id != 0) {
+      i = (i + 1) & mask;
+    }
+    slots_[i].hash = hash;
+    slots_[i].id = id;
+    size_++;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+ private:
+  static const size_t kMinCapacity = 16;
+
+  // The table is at most 7/10 full.
+  static const size_t kMaxLoadNumerator = 7;
+  static const size_t kMaxLoadDenominator = 10;
+
+  struct Slot {
+    uint64_t hash;
+    uint64_t id;
+  };
+
+  static size_t capacityFor(size_t n) {
+    size_t capacity = kMinCapacity;
+    while (n * kMaxLoadDenominator > capacity * kMaxLoadNumerator) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  void grow() {
+    size_t capacity = capacity_ == 0 ? kMinCapacity : capacity_ * 2;
+    std::unique_ptr<Slot[]> slots(new Slot[capacity]());
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < capacity_; i++) {
+      if (slots_[i].id != 0) {
+        size_t j = slots_[i].hash & mask;
+        while (slots[j].id != 0) {
+          j = (j + 1) & mask;
+        }
+        slots[j] = slots_[i];
+      }
+    }
+    slots_.swap(slots);
+    capacity_ = capacity;
+  }
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t capacity_;
+  size_t size_;
+};
+}
+} // facebook::gorilla
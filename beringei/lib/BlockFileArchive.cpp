@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "BlockFileArchive.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "FileUtils.h"
+#include "GorillaStatsManager.h"
+#include "GorillaTimeConstants.h"
+#include "Timer.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kHits = "block_file_archive_hits";
+static const std::string kMisses = "block_file_archive_misses";
+static const std::string kMsPerDownload = "ms_per_block_file_archive_download";
+
+BlockFileArchive::BlockFileArchive(
+    int64_t shardId,
+    std::shared_ptr<BlockFileStore> store,
+    const std::string& cacheDirectory,
+    size_t maxBuckets)
+    : shardId_(shardId),
+      store_(std::move(store)),
+      cacheDirectory_(cacheDirectory),
+      maxBuckets_(std::max<size_t>(maxBuckets, 1)) {
+  GorillaStatsManager::addStatExportType(kHits, SUM);
+  GorillaStatsManager::addStatExportType(kMisses, SUM);
+  GorillaStatsManager::addStatExportType(kMsPerDownload, AVG);
+}
+
+bool BlockFileArchive::get(
+    uint32_t position,
+    const std::vector<uint32_t>& timeSeriesIds,
+    const std::vector<std::vector<TimeSeriesBlock>*>& outs) {
+  auto bucket = getBucket(position);
+  if (!bucket->storage) {
+    return false;
+  }
+
+  for (int i = 0; i < timeSeriesIds.size(); i++) {
+    auto it = bucket->ids.find(timeSeriesIds[i]);
+    if (it == bucket->ids.end()) {
+      continue;
+    }
+
+    TimeSeriesBlock block;
+    uint32_t itemCount;
+    if (bucket->storage->fetch(position, it->second, block.data, itemCount) ==
+        BucketStorage::FetchStatus::SUCCESS) {
+      block.count = itemCount;
+      outs[i]->push_back(std::move(block));
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<BlockFileArchive::Bucket> BlockFileArchive::getBucket(
+    uint32_t position) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto it = buckets_.begin(); it != buckets_.end(); ++it) {
+    if (it->first == position) {
+      buckets_.splice(buckets_.end(), buckets_, it);
+      GorillaStatsManager::addStatValue(kHits);
+      return buckets_.back().second;
+    }
+  }
+
+  GorillaStatsManager::addStatValue(kMisses);
+  buckets_.emplace_back(position, load(position));
+  if (buckets_.size() > maxBuckets_) {
+    buckets_.pop_front();
+  }
+  return buckets_.back().second;
+}
+
+std::shared_ptr<BlockFileArchive::Bucket> BlockFileArchive::load(
+    uint32_t position) {
+  auto bucket = std::make_shared<Bucket>();
+
+  Timer timer(true);
+  std::string data;
+  if (!store_->get(shardId_, position, data)) {
+    return bucket;
+  }
+
+  FileUtils files(shardId_, BucketStorage::kDataPrefix, cacheDirectory_);
+  files.createDirectories();
+  auto file = files.open(position, "wb", 0);
+  if (!file.file) {
+    return bucket;
+  }
+  bool written =
+      fwrite(data.data(), sizeof(char), data.size(), file.file) == data.size();
+  FileUtils::closeFile(file, false);
+
+  // Each bucket gets a storage of its own so that any position can be
+  // loaded into it.
+  std::vector<uint32_t> timeSeriesIds;
+  std::vector<uint64_t> storageIds;
+  auto storage = std::make_unique<BucketStorage>(1, shardId_, cacheDirectory_);
+  if (written &&
+      storage->loadPosition(position, timeSeriesIds, storageIds)) {
+    bucket->storage = std::move(storage);
+    bucket->ids.reserve(timeSeriesIds.size());
+    for (int i = 0; i < timeSeriesIds.size(); i++) {
+      bucket->ids[timeSeriesIds[i]] = storageIds[i];
+    }
+    GorillaStatsManager::addStatValue(
+        kMsPerDownload, timer.get() / kGorillaUsecPerMs);
+  } else {
+    LOG(ERROR) << "Loading block file " << position << " of shard "
+               << shardId_ << " from the store failed";
+  }
+
+  files.remove(position);
+  return bucket;
+}
+}
+} // facebook::gorilla
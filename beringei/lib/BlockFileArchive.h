@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "BlockFileStore.h"
+#include "BucketStorage.h"
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class BlockFileArchive
+//
+// Reads the buckets of a shard that are older than the ones in memory
+// back from the BlockFileStore. A block file is downloaded when a
+// query first needs it and the last `maxBuckets` of them stay loaded,
+// so that a query over a long range reads each file from the store
+// once. Buckets that aren't in the store are remembered the same way.
+class BlockFileArchive {
+ public:
+  // Block files are downloaded to `cacheDirectory` to be read and
+  // removed once they are loaded.
+  BlockFileArchive(
+      int64_t shardId,
+      std::shared_ptr<BlockFileStore> store,
+      const std::string& cacheDirectory,
+      size_t maxBuckets);
+
+  // Appends the block of each of `timeSeriesIds` in the bucket at
+  // `position` to `outs`, which is indexed like `timeSeriesIds`. Time
+  // series without data in the bucket get nothing. Returns false if
+  // the bucket isn't in the store.
+  bool get(
+      uint32_t position,
+      const std::vector<uint32_t>& timeSeriesIds,
+      const std::vector<std::vector<TimeSeriesBlock>*>& outs);
+
+ private:
+  struct Bucket {
+    // Null if the bucket isn't in the store.
+    std::unique_ptr<BucketStorage> storage;
+    std::unordered_map<uint32_t, BucketStorage::BucketStorageId> ids;
+  };
+
+  std::shared_ptr<Bucket> getBucket(uint32_t position);
+  std::shared_ptr<Bucket> load(uint32_t position);
+
+  const int64_t shardId_;
+  std::shared_ptr<BlockFileStore> store_;
+  const std::string cacheDirectory_;
+  const size_t maxBuckets_;
+
+  // Loaded buckets by position, most recently used last. Loading is
+  // done under the lock so that concurrent queries download a bucket
+  // only once.
+  std::mutex mutex_;
+  std::list<std::pair<uint32_t, std::shared_ptr<Bucket>>> buckets_;
+};
+}
+} // facebook::gorilla
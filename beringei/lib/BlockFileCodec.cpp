@@ -0,0 +1,479 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "BlockFileCodec.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <future>
+
+#include <folly/compression/Compression.h>
+#include <folly/hash/Checksum.h>
+#include <glog/logging.h>
+
+namespace facebook {
+namespace gorilla {
+
+// Can't be confused with a zlib stream because the low nibble of the
+// first byte of a zlib stream is always 8.
+static const char kMagic[4] = {'B', 'G', 'B', 'F'};
+
+const uint32_t BlockFileCodec::kHeaderSize = sizeof(kMagic) + sizeof(uint32_t);
+
+// Set in the codec id of files that are split into chunks. The chunk
+// count follows the header.
+static const uint32_t kChunkedFlag = 1u << 31;
+
+// Also set in the codec id of chunked files whose chunks are checked.
+// The header of each chunk then ends with the CRC32C of its
+// uncompressed data, and the file ends with the offset of each chunk
+// from the chunk count, followed by the number of chunks and the CRC32C
+// of the offsets and the number.
+static const uint32_t kChecksummedFlag = 1u << 30;
+
+// Uncompressed and compressed length of a chunk.
+static const size_t kChunkHeaderSize = 2 * sizeof(uint32_t);
+static const size_t kChecksummedChunkHeaderSize = 3 * sizeof(uint32_t);
+
+static folly::io::CodecType toFollyCodec(BlockFileCodec::Type type) {
+  switch (type) {
+    case BlockFileCodec::Type::ZSTD:
+      return folly::io::CodecType::ZSTD;
+    case BlockFileCodec::Type::LZ4:
+      return folly::io::CodecType::LZ4_FRAME;
+    case BlockFileCodec::Type::NONE:
+      return folly::io::CodecType::NO_COMPRESSION;
+    case BlockFileCodec::Type::ZLIB:
+    default:
+      return folly::io::CodecType::ZLIB;
+  }
+}
+
+bool BlockFileCodec::parse(const std::string& name, Type& type) {
+  if (name == "zlib") {
+    type = Type::ZLIB;
+  } else if (name == "zstd") {
+    type = Type::ZSTD;
+  } else if (name == "lz4") {
+    type = Type::LZ4;
+  } else if (name == "none") {
+    type = Type::NONE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string BlockFileCodec::name(Type type) {
+  switch (type) {
+    case Type::ZLIB:
+      return "zlib";
+    case Type::ZSTD:
+      return "zstd";
+    case Type::LZ4:
+      return "lz4";
+    case Type::NONE:
+      return "none";
+  }
+  return "unknown";
+}
+
+// Falls back to zlib if the codec isn't available and picks the level
+// when `level` is zero.
+static void resolveCodec(BlockFileCodec::Type& type, int& level) {
+  if (!folly::io::hasCodec(toFollyCodec(type))) {
+    LOG(ERROR) << "Block file codec " << BlockFileCodec::name(type)
+               << " is not available, using zlib";
+    type = BlockFileCodec::Type::ZLIB;
+  }
+
+  if (level == 0 || type == BlockFileCodec::Type::NONE) {
+    level = type == BlockFileCodec::Type::ZLIB
+        ? folly::io::COMPRESSION_LEVEL_BEST
+        : folly::io::COMPRESSION_LEVEL_DEFAULT;
+  }
+}
+
+static void writeHeader(uint8_t* header, uint32_t codecId) {
+  memcpy(header, kMagic, sizeof(kMagic));
+  memcpy(header + sizeof(kMagic), &codecId, sizeof(codecId));
+}
+
+std::unique_ptr<folly::IOBuf>
+BlockFileCodec::compress(folly::ByteRange data, Type type, int level) {
+  resolveCodec(type, level);
+
+  auto codec = folly::io::getCodec(toFollyCodec(type), level);
+  auto input = folly::IOBuf::wrapBuffer(data);
+  auto compressed = codec->compress(input.get());
+
+  auto header = folly::IOBuf::create(kHeaderSize);
+  writeHeader(header->writableData(), static_cast<uint32_t>(type));
+  header->append(kHeaderSize);
+
+  header->prependChain(std::move(compressed));
+  header->coalesce();
+  return header;
+}
+
+// Returns the compressed chunk preceded by its lengths, and its
+// checksum if `checksummed` is set.
+static std::unique_ptr<folly::IOBuf> compressChunk(
+    folly::ByteRange chunk,
+    BlockFileCodec::Type type,
+    int level,
+    bool checksummed) {
+  auto codec = folly::io::getCodec(toFollyCodec(type), level);
+  auto input = folly::IOBuf::wrapBuffer(chunk);
+  auto compressed = codec->compress(input.get());
+  compressed->coalesce();
+
+  uint32_t fields[3] = {(uint32_t)chunk.size(),
+                        (uint32_t)compressed->length(),
+                        0};
+  size_t headerSize = kChunkHeaderSize;
+  if (checksummed) {
+    fields[2] = folly::crc32c(chunk.data(), chunk.size());
+    headerSize = kChecksummedChunkHeaderSize;
+  }
+  auto header = folly::IOBuf::create(headerSize);
+  memcpy(header->writableData(), fields, headerSize);
+  header->append(headerSize);
+
+  header->prependChain(std::move(compressed));
+  header->coalesce();
+  return header;
+}
+
+size_t BlockFileCodec::compressChunks(
+    const std::vector<folly::ByteRange>& chunks,
+    Type type,
+    int level,
+    int threads,
+    const std::function<void(folly::ByteRange)>& write,
+    bool checksums) {
+  if (type == Type::NONE) {
+    throw std::invalid_argument("Chunked block files must be compressed");
+  }
+  resolveCodec(type, level);
+
+  uint8_t header[kHeaderSize + sizeof(uint32_t)];
+  uint32_t count = chunks.size();
+  writeHeader(
+      header,
+      static_cast<uint32_t>(type) | kChunkedFlag |
+          (checksums ? kChecksummedFlag : 0));
+  memcpy(header + kHeaderSize, &count, sizeof(count));
+  write(folly::ByteRange(header, sizeof(header)));
+  size_t written = sizeof(header);
+
+  // From the chunk count.
+  std::vector<uint64_t> offsets;
+  offsets.reserve(chunks.size() + 1);
+
+  // Chunks are compressed a few ahead of the one being written, but
+  // they still have to be written in order.
+  std::deque<std::future<std::unique_ptr<folly::IOBuf>>> pending;
+  auto writeOldest = [&]() {
+    auto compressed = pending.front().get();
+    pending.pop_front();
+    offsets.push_back(written - kHeaderSize);
+    write(folly::ByteRange(compressed->data(), compressed->length()));
+    written += compressed->length();
+  };
+
+  const size_t maxPending = std::max(threads, 1);
+  const auto policy = threads > 1 ? std::launch::async : std::launch::deferred;
+  for (const auto& chunk : chunks) {
+    pending.push_back(std::async(policy, [chunk, type, level, checksums]() {
+      return compressChunk(chunk, type, level, checksums);
+    }));
+
+    if (pending.size() >= maxPending) {
+      writeOldest();
+    }
+  }
+
+  while (!pending.empty()) {
+    writeOldest();
+  }
+
+  if (checksums) {
+    std::string footer(
+        (const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    footer.append((const char*)&count, sizeof(count));
+    uint32_t checksum =
+        folly::crc32c((const uint8_t*)footer.data(), footer.size());
+    footer.append((const char*)&checksum, sizeof(checksum));
+    write(folly::ByteRange((const uint8_t*)footer.data(), footer.size()));
+    written += footer.size();
+  }
+  return written;
+}
+
+// Finds the chunks of a checksummed file from its index, or from their
+// headers if the index is damaged. Sets `compressed` to where each
+// chunk is, including its header.
+static void findChunks(
+    folly::ByteRange file,
+    uint32_t count,
+    std::vector<folly::ByteRange>& compressed) {
+  const size_t footerSize =
+      (size_t)count * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+  if (file.size() >= sizeof(count) + footerSize) {
+    const uint8_t* footer = file.end() - footerSize;
+    uint32_t footerCount;
+    uint32_t checksum;
+    memcpy(&footerCount, file.end() - 2 * sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&checksum, file.end() - sizeof(uint32_t), sizeof(uint32_t));
+
+    if (footerCount == count &&
+        folly::crc32c(footer, footerSize - sizeof(uint32_t)) == checksum) {
+      std::vector<uint64_t> offsets(count);
+      memcpy(offsets.data(), footer, count * sizeof(uint64_t));
+      offsets.push_back(footer - file.data());
+
+      bool valid = true;
+      for (uint32_t i = 0; i < count && valid; i++) {
+        valid = offsets[i] >= sizeof(count) && offsets[i] <= offsets[i + 1];
+      }
+      if (valid) {
+        compressed.clear();
+        for (uint32_t i = 0; i < count; i++) {
+          compressed.emplace_back(
+              file.data() + offsets[i], file.data() + offsets[i + 1]);
+        }
+        return;
+      }
+    }
+  }
+
+  LOG(ERROR) << "The chunk index of a block file is damaged";
+  file.advance(sizeof(count));
+  compressed.clear();
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t fields[3];
+    if (file.size() < kChecksummedChunkHeaderSize) {
+      throw std::runtime_error(
+          "Chunked block file ends after " + std::to_string(i) + " chunks");
+    }
+    memcpy(fields, file.data(), kChecksummedChunkHeaderSize);
+    size_t size = kChecksummedChunkHeaderSize + fields[1];
+    if (file.size() < size) {
+      throw std::runtime_error(
+          "Chunk " + std::to_string(i) + " is past the end of the file");
+    }
+    compressed.emplace_back(file.data(), size);
+    file.advance(size);
+  }
+}
+
+static std::unique_ptr<folly::IOBuf> uncompressChecksummedChunks(
+    folly::ByteRange file,
+    BlockFileCodec::Type type,
+    int threads,
+    std::vector<uint32_t>* damagedChunks) {
+  uint32_t count;
+  if (file.size() < sizeof(count)) {
+    throw std::runtime_error("Chunked block file is missing the chunk count");
+  }
+  memcpy(&count, file.data(), sizeof(count));
+
+  std::vector<folly::ByteRange> compressed;
+  findChunks(file, count, compressed);
+
+  // The lengths in the headers have to be right to know where each
+  // chunk goes, even if the chunk itself is damaged.
+  std::vector<uint32_t> checksums(count);
+  std::vector<size_t> outputOffsets(count + 1, 0);
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t fields[3];
+    if (compressed[i].size() < kChecksummedChunkHeaderSize) {
+      throw std::runtime_error(
+          "Chunk " + std::to_string(i) + " is missing its header");
+    }
+    memcpy(fields, compressed[i].data(), kChecksummedChunkHeaderSize);
+    compressed[i].advance(kChecksummedChunkHeaderSize);
+    if (compressed[i].size() != fields[1]) {
+      throw std::runtime_error(
+          "Chunk " + std::to_string(i) + " has a damaged header");
+    }
+    checksums[i] = fields[2];
+    outputOffsets[i + 1] = outputOffsets[i] + fields[0];
+  }
+
+  auto output = folly::IOBuf::create(outputOffsets[count]);
+  uint8_t* data = output->writableData();
+  auto uncompressChunk = [&](uint32_t i) {
+    size_t length = outputOffsets[i + 1] - outputOffsets[i];
+    try {
+      auto codec = folly::io::getCodec(toFollyCodec(type));
+      auto input = folly::IOBuf::wrapBuffer(compressed[i]);
+      auto uncompressed = codec->uncompress(input.get());
+      uncompressed->coalesce();
+      if (uncompressed->length() == length &&
+          folly::crc32c(uncompressed->data(), length) == checksums[i]) {
+        memcpy(data + outputOffsets[i], uncompressed->data(), length);
+        return true;
+      }
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Chunk " << i << " doesn't uncompress: " << e.what();
+    }
+    memset(data + outputOffsets[i], 0, length);
+    return false;
+  };
+
+  std::vector<std::future<bool>> results;
+  const auto policy = threads > 1 ? std::launch::async : std::launch::deferred;
+  const uint32_t workers = std::max(1, std::min<int>(threads, count));
+  std::atomic<uint32_t> next(0);
+  std::vector<std::vector<uint32_t>> damaged(workers);
+  for (uint32_t worker = 0; worker < workers; worker++) {
+    results.push_back(std::async(policy, [&, worker]() {
+      for (uint32_t i = next++; i < count; i = next++) {
+        if (!uncompressChunk(i)) {
+          damaged[worker].push_back(i);
+        }
+      }
+      return true;
+    }));
+  }
+  for (auto& result : results) {
+    result.get();
+  }
+  output->append(outputOffsets[count]);
+
+  std::vector<uint32_t> damagedIndexes;
+  for (const auto& indexes : damaged) {
+    damagedIndexes.insert(damagedIndexes.end(), indexes.begin(), indexes.end());
+  }
+  std::sort(damagedIndexes.begin(), damagedIndexes.end());
+  if (!damagedIndexes.empty()) {
+    if (!damagedChunks) {
+      throw std::runtime_error(
+          "Chunk " + std::to_string(damagedIndexes[0]) +
+          " fails its checksum");
+    }
+    damagedChunks->insert(
+        damagedChunks->end(), damagedIndexes.begin(), damagedIndexes.end());
+  }
+  return output;
+}
+
+static std::unique_ptr<folly::IOBuf> uncompressChunks(
+    folly::ByteRange file,
+    BlockFileCodec::Type type) {
+  uint32_t count;
+  if (file.size() < sizeof(count)) {
+    throw std::runtime_error("Chunked block file is missing the chunk count");
+  }
+  memcpy(&count, file.data(), sizeof(count));
+  file.advance(sizeof(count));
+
+  auto codec = folly::io::getCodec(toFollyCodec(type));
+  std::vector<std::unique_ptr<folly::IOBuf>> uncompressedChunks;
+  size_t length = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t lengths[2];
+    if (file.size() < kChunkHeaderSize) {
+      throw std::runtime_error(
+          "Chunked block file ends after " + std::to_string(i) + " chunks");
+    }
+    memcpy(lengths, file.data(), kChunkHeaderSize);
+    file.advance(kChunkHeaderSize);
+    if (file.size() < lengths[1]) {
+      throw std::runtime_error(
+          "Chunk " + std::to_string(i) + " is past the end of the file");
+    }
+
+    auto input = folly::IOBuf::wrapBuffer(file.data(), lengths[1]);
+    file.advance(lengths[1]);
+    auto uncompressed = codec->uncompress(input.get());
+    uncompressed->coalesce();
+    if (uncompressed->length() != lengths[0]) {
+      throw std::runtime_error(
+          "Chunk " + std::to_string(i) + " has the wrong length");
+    }
+    length += uncompressed->length();
+    uncompressedChunks.push_back(std::move(uncompressed));
+  }
+
+  if (!file.empty()) {
+    throw std::runtime_error("Extra bytes after the chunks of a block file");
+  }
+
+  auto output = folly::IOBuf::create(length);
+  for (const auto& chunk : uncompressedChunks) {
+    memcpy(
+        output->writableData() + output->length(),
+        chunk->data(),
+        chunk->length());
+    output->append(chunk->length());
+  }
+  return output;
+}
+
+std::unique_ptr<folly::IOBuf> BlockFileCodec::uncompress(
+    folly::ByteRange file,
+    int threads,
+    std::vector<uint32_t>* damagedChunks) {
+  Type type = Type::ZLIB;
+  bool chunked = false;
+  bool checksummed = false;
+  if (readHeader(file, type, &chunked)) {
+    uint32_t codecId;
+    memcpy(&codecId, file.data() + sizeof(kMagic), sizeof(codecId));
+    checksummed = codecId & kChecksummedFlag;
+    file.advance(kHeaderSize);
+  }
+
+  if (checksummed) {
+    return uncompressChecksummedChunks(file, type, threads, damagedChunks);
+  }
+
+  if (chunked) {
+    return uncompressChunks(file, type);
+  }
+
+  auto codec = folly::io::getCodec(toFollyCodec(type));
+  auto input = folly::IOBuf::wrapBuffer(file);
+  auto uncompressed = codec->uncompress(input.get());
+  uncompressed->coalesce();
+  return uncompressed;
+}
+
+bool BlockFileCodec::readHeader(
+    folly::ByteRange file,
+    Type& type,
+    bool* chunked) {
+  if (file.size() < kHeaderSize ||
+      memcmp(file.data(), kMagic, sizeof(kMagic)) != 0) {
+    return false;
+  }
+
+  uint32_t codecId;
+  memcpy(&codecId, file.data() + sizeof(kMagic), sizeof(codecId));
+  bool isChunked = codecId & kChunkedFlag;
+  bool isChecksummed = codecId & kChecksummedFlag;
+  type = static_cast<Type>(codecId & ~(kChunkedFlag | kChecksummedFlag));
+  if ((type != Type::ZLIB && type != Type::ZSTD && type != Type::LZ4 &&
+       type != Type::NONE) ||
+      (isChunked && type == Type::NONE) || (isChecksummed && !isChunked)) {
+    throw std::runtime_error(
+        "Unknown block file codec " + std::to_string(codecId));
+  }
+
+  if (chunked) {
+    *chunked = isChunked;
+  }
+  return true;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+#include <folly/io/IOBuf.h>
+
+namespace facebook {
+namespace gorilla {
+
+// class BlockFileCodec
+//
+// Compression used for finalized block files. A file starts with a
+// small header holding a magic value and a codec id, followed by the
+// compressed contents. Files written before the header existed are
+// plain zlib streams without a header and are still readable.
+//
+// The contents can also be split into chunks that are compressed
+// independently of each other, so that they can be compressed in
+// parallel. Each chunk is then preceded by its uncompressed and
+// compressed length. Checksummed chunked files also have the CRC32C of
+// each chunk and end with an index of the chunks, so that they can be
+// uncompressed in parallel too and a damaged chunk only loses itself.
+class BlockFileCodec {
+ public:
+  // Stored in the file header. Do not reuse values.
+  enum class Type : uint32_t {
+    ZLIB = 1,
+    ZSTD = 2,
+    LZ4 = 3,
+
+    // Stored as is, so the file can be memory mapped.
+    NONE = 4,
+  };
+
+  // Parses "zlib", "zstd", "lz4" or "none". Returns false for anything
+  // else.
+  static bool parse(const std::string& name, Type& type);
+
+  static std::string name(Type type);
+
+  // Compresses `data` and prepends the header. `level` of zero uses
+  // the default level of the codec, except for zlib, which uses the
+  // best level like block files always did. Falls back to zlib if
+  // the codec isn't available in this build. Throws on failure.
+  static std::unique_ptr<folly::IOBuf>
+  compress(folly::ByteRange data, Type type, int level);
+
+  // Compresses each of `chunks` separately on up to `threads` threads
+  // and passes the header and then the compressed chunks, in order, to
+  // `write` as soon as they are ready. At most `threads` compressed
+  // chunks are held in memory at a time. `type` can't be NONE, because
+  // chunked files can't be memory mapped anyway. With `checksums` the
+  // file is checksummed, which older builds can't read. Returns the
+  // number of bytes passed to `write`. Throws on failure, including
+  // when `write` throws.
+  static size_t compressChunks(
+      const std::vector<folly::ByteRange>& chunks,
+      Type type,
+      int level,
+      int threads,
+      const std::function<void(folly::ByteRange)>& write,
+      bool checksums = false);
+
+  // Reads the header, or assumes zlib if there isn't one, and
+  // uncompresses the rest. The chunks of checksummed files are
+  // uncompressed on up to `threads` threads. If `damagedChunks` isn't
+  // null, the chunks of checksummed files that fail their checksum are
+  // zeroed and their indexes appended to it instead of failing the
+  // whole file. Throws on failure.
+  static std::unique_ptr<folly::IOBuf> uncompress(
+      folly::ByteRange file,
+      int threads = 1,
+      std::vector<uint32_t>* damagedChunks = nullptr);
+
+  // Sets `type` from the header of `file`, and `chunked` if it isn't
+  // null. Returns false if the file has no header. Throws if the codec
+  // id is unknown.
+  static bool
+  readHeader(folly::ByteRange file, Type& type, bool* chunked = nullptr);
+
+  static const uint32_t kHeaderSize;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,158 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "BlockFileStore.h"
+
+#include <glog/logging.h>
+
+#include "BucketStorage.h"
+#include "FileUtils.h"
+#include "GorillaStatsManager.h"
+#include "GorillaTimeConstants.h"
+#include "Timer.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kUploads = "block_file_store_uploads";
+static const std::string kUploadFailures = "block_file_store_upload_failures";
+static const std::string kMsPerUpload = "ms_per_block_file_store_upload";
+
+// Block files are written under this prefix and renamed when complete,
+// so that get() never sees a partial file.
+static const std::string kUploadingPrefix = "uploading_block_data";
+
+static std::mutex instanceMutex;
+static std::shared_ptr<BlockFileStore> instance;
+
+BlockFileStore::BlockFileStore() : uploading_(false), stopping_(false) {
+  GorillaStatsManager::addStatExportType(kUploads, SUM);
+  GorillaStatsManager::addStatExportType(kUploadFailures, SUM);
+  GorillaStatsManager::addStatExportType(kMsPerUpload, AVG);
+}
+
+BlockFileStore::~BlockFileStore() {
+  CHECK(!uploader_.joinable()) << "stopUploads() wasn't called";
+}
+
+void BlockFileStore::stopUploads() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+  if (uploader_.joinable()) {
+    uploader_.join();
+  }
+}
+
+void BlockFileStore::putAsync(
+    int64_t shardId,
+    uint32_t position,
+    const std::string& dataDirectory) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  uploads_.push_back({shardId, position, dataDirectory});
+  if (!uploader_.joinable()) {
+    uploader_ = std::thread(&BlockFileStore::uploadLoop, this);
+  }
+  condition_.notify_all();
+}
+
+void BlockFileStore::flush() {
+  std::unique_lock<std::mutex> guard(mutex_);
+  condition_.wait(guard, [this]() { return uploads_.empty() && !uploading_; });
+}
+
+void BlockFileStore::uploadLoop() {
+  std::unique_lock<std::mutex> guard(mutex_);
+  while (true) {
+    condition_.wait(guard, [this]() { return stopping_ || !uploads_.empty(); });
+    if (uploads_.empty()) {
+      return;
+    }
+
+    Upload upload = std::move(uploads_.front());
+    uploads_.pop_front();
+    uploading_ = true;
+    guard.unlock();
+
+    Timer timer(true);
+    FileUtils files(
+        upload.shardId, BucketStorage::kDataPrefix, upload.dataDirectory);
+    std::string data;
+    if (files.read(upload.position, data) &&
+        put(upload.shardId, upload.position, data)) {
+      GorillaStatsManager::addStatValue(kUploads);
+      GorillaStatsManager::addStatValue(
+          kMsPerUpload, timer.get() / kGorillaUsecPerMs);
+    } else {
+      LOG(ERROR) << "Uploading block file " << upload.position << " of shard "
+                 << upload.shardId << " failed";
+      GorillaStatsManager::addStatValue(kUploadFailures);
+    }
+
+    guard.lock();
+    uploading_ = false;
+    condition_.notify_all();
+  }
+}
+
+void BlockFileStore::setInstance(std::shared_ptr<BlockFileStore> store) {
+  std::lock_guard<std::mutex> guard(instanceMutex);
+  instance = std::move(store);
+}
+
+std::shared_ptr<BlockFileStore> BlockFileStore::getInstance() {
+  std::lock_guard<std::mutex> guard(instanceMutex);
+  return instance;
+}
+
+DirectoryBlockFileStore::DirectoryBlockFileStore(const std::string& directory)
+    : directory_(directory) {}
+
+DirectoryBlockFileStore::~DirectoryBlockFileStore() {
+  stopUploads();
+}
+
+bool DirectoryBlockFileStore::put(
+    int64_t shardId,
+    uint32_t position,
+    const std::string& data) {
+  FileUtils files(shardId, kUploadingPrefix, directory_);
+  files.createDirectories();
+  auto file = files.open(position, "wb", 0);
+  if (!file.file) {
+    return false;
+  }
+
+  bool written =
+      fwrite(data.data(), sizeof(char), data.size(), file.file) == data.size();
+  if (fflush(file.file) != 0) {
+    written = false;
+  }
+  FileUtils::closeFile(file, false);
+  if (!written) {
+    PLOG(ERROR) << "Writing " << file.name << " failed";
+    files.remove(position);
+    return false;
+  }
+
+  files.rename(position, BucketStorage::kDataPrefix);
+  return true;
+}
+
+bool DirectoryBlockFileStore::get(
+    int64_t shardId,
+    uint32_t position,
+    std::string& data) {
+  FileUtils files(shardId, BucketStorage::kDataPrefix, directory_);
+  return files.read(position, data);
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace facebook {
+namespace gorilla {
+
+// class BlockFileStore
+//
+// Second tier for finalized block files. Every block file is copied to
+// the store once it's complete, so that it outlives the local files,
+// which are deleted after the buckets expire. Buckets older than the
+// ones in memory are read back from the store by BlockFileArchive.
+//
+// Implementations must be thread safe. The store of the process is set
+// once at startup with setInstance().
+class BlockFileStore {
+ public:
+  BlockFileStore();
+  virtual ~BlockFileStore();
+
+  // Stores `data` as the block file of `position` in shard `shardId`,
+  // replacing any previous one. Returns false on failure.
+  virtual bool put(
+      int64_t shardId,
+      uint32_t position,
+      const std::string& data) = 0;
+
+  // Reads the block file of `position` in shard `shardId`. Returns
+  // false if it's not in the store or can't be read.
+  virtual bool get(int64_t shardId, uint32_t position, std::string& data) = 0;
+
+  // Reads the local block file of `position` in `dataDirectory` and
+  // calls put() with it in a background thread, so that finalizing
+  // buckets never waits for the store. Failed uploads are logged and
+  // counted, not retried.
+  void putAsync(
+      int64_t shardId,
+      uint32_t position,
+      const std::string& dataDirectory);
+
+  // Waits until all the uploads queued before the call are done.
+  void flush();
+
+  static void setInstance(std::shared_ptr<BlockFileStore> store);
+
+  // The store of the process or nullptr if block files are only kept
+  // locally.
+  static std::shared_ptr<BlockFileStore> getInstance();
+
+ protected:
+  // Finishes the queued uploads and stops the upload thread. Must be
+  // called by the destructor of implementations, while put() still
+  // works.
+  void stopUploads();
+
+ private:
+  struct Upload {
+    int64_t shardId;
+    uint32_t position;
+    std::string dataDirectory;
+  };
+
+  void uploadLoop();
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<Upload> uploads_;
+  bool uploading_;
+  bool stopping_;
+  std::thread uploader_;
+};
+
+// Stores the block files in another directory, with the same layout as
+// the data directory. S3-compatible object storage can be used through
+// a file system mount of a bucket.
+class DirectoryBlockFileStore : public BlockFileStore {
+ public:
+  explicit DirectoryBlockFileStore(const std::string& directory);
+  ~DirectoryBlockFileStore() override;
+
+  bool put(int64_t shardId, uint32_t position, const std::string& data)
+      override;
+
+  bool get(int64_t shardId, uint32_t position, std::string& data) override;
+
+ private:
+  const std::string directory_;
+};
+}
+} // facebook::gorilla
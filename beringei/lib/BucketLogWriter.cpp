@@ -21,20 +21,42 @@ namespace gorilla {
 
 DECLARE_int32(data_log_buffer_size);
 
+DEFINE_int32(
+    log_group_commit_ms,
+    0,
+    "If set, log files are synced to disk with fdatasync at most this many "
+    "milliseconds after an entry has been written. All the open log files of "
+    "a writer thread are synced together. 0 disables syncing.");
+DEFINE_int32(
+    log_group_commit_bytes,
+    4 * 1024 * 1024,
+    "Sync the log files before the group commit latency is reached if this "
+    "many bytes have been written since the last sync.");
+DEFINE_bool(
+    combined_log,
+    false,
+    "Append the log files of all the shards of a writer thread to large "
+    "combined log segments instead of writing a file per shard per bucket.");
+
 static const int kLogFileBufferSize = FLAGS_data_log_buffer_size;
 static const std::string kLogDataDequeueLatencyUs =
     "log_data_dequeue_latency_us";
+static const std::string kLogDataWriteLatencyUs = "log_data_write_latency_us";
 static const std::string kLogDataFailures = "log_data_failures";
 static const std::string kLogDataEnqueueFailures = "log_data_enqueue_failures";
+static GorillaStat logDataEnqueueFailuresStat(kLogDataEnqueueFailures);
 static const std::string kLogFileOpenRetries = "log_file_open_retries";
 static const std::string kLogFilesystemFailures =
     "failed_writes.log_filesystem";
+static const std::string kLogSyncLatencyUs = "log_sync_latency_us";
+static const std::string kLogSyncBytes = "log_sync_bytes";
 
 // These are not valid indexes so they can be used to control starting
 // and stopping shards.
 static const int kStartShardIndex = -1;
 static const int kStopShardIndex = -2;
 static const int kNoOpIndex = -3;
+static const int kNewLogFileIndex = -4;
 
 static const int kMaxActiveBuckets = 2;
 
@@ -46,7 +68,8 @@ BucketLogWriter::BucketLogWriter(
     int windowSize,
     const std::string& dataDirectory,
     size_t queueSize,
-    uint32_t allowedTimestampBehind)
+    uint32_t allowedTimestampBehind,
+    int logPartition)
     : windowSize_(windowSize),
       logDataQueue_(queueSize),
       writerThread_(nullptr),
@@ -56,12 +79,17 @@ BucketLogWriter::BucketLogWriter(
       // One `allowedTimestampBehind` delay to allow the data to come in
       // and one more delay to allow the data to be dequeued and written.
       waitTimeBeforeClosing_(allowedTimestampBehind * 2),
-      keepLogFilesAroundTime_(BucketUtils::duration(2, windowSize)) {
+      keepLogFilesAroundTime_(BucketUtils::duration(2, windowSize)),
+      unsyncedBytes_(0) {
   CHECK_GT(windowSize, allowedTimestampBehind)
       << "Window size " << windowSize
       << " must be larger than allowedTimestampBehind "
       << allowedTimestampBehind;
 
+  if (FLAGS_combined_log) {
+    combinedLog_ =
+        std::make_shared<CombinedLogWriter>(dataDirectory_, logPartition);
+  }
   startWriterThread();
 }
 
@@ -95,9 +123,41 @@ void BucketLogWriter::stopWriterThread() {
     // that.
     logData(0, kNoOpIndex, 0, 0);
     writerThread_->join();
+    maybeSyncLogs(true);
   }
 }
 
+void BucketLogWriter::maybeSyncLogs(bool force) {
+  if (FLAGS_log_group_commit_ms <= 0 || unsyncedBytes_ == 0) {
+    return;
+  }
+
+  if (!force && unsyncedBytes_ < FLAGS_log_group_commit_bytes &&
+      std::chrono::steady_clock::now() < nextSyncTime_) {
+    return;
+  }
+
+  Timer syncTimer(true);
+  for (auto& shardWriter : shardWriters_) {
+    for (auto& logWriter : shardWriter.second.logWriters) {
+      if (logWriter.second && logWriter.second->unsyncedBytes() > 0) {
+        if (combinedLog_) {
+          // Only the combined log has to be synced, once.
+          logWriter.second->flushBuffer();
+        } else {
+          logWriter.second->sync();
+        }
+      }
+    }
+  }
+  if (combinedLog_) {
+    combinedLog_->sync();
+  }
+  GorillaStatsManager::addStatValue(kLogSyncLatencyUs, syncTimer.get());
+  GorillaStatsManager::addStatValue(kLogSyncBytes, unsyncedBytes_);
+  unsyncedBytes_ = 0;
+}
+
 uint32_t BucketLogWriter::bucket(uint64_t unixTime, int shardId) const {
   return BucketUtils::bucket(unixTime, windowSize_, shardId);
 }
@@ -110,6 +170,48 @@ uint64_t BucketLogWriter::duration(uint32_t buckets) const {
   return BucketUtils::duration(buckets, windowSize_);
 }
 
+bool BucketLogWriter::startNewLogFile(int64_t shardId, int64_t unixTime) {
+  LogDataInfo info;
+  info.shardId = shardId;
+  info.index = kNewLogFileIndex;
+  info.unixTime = unixTime;
+  info.value = 0;
+
+  if (!logDataQueue_.write(std::move(info))) {
+    logDataEnqueueFailuresStat.add();
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<DataLogWriter> BucketLogWriter::openLogFile(
+    int64_t shardId,
+    ShardWriter& shardWriter,
+    int64_t baseTime) {
+  if (combinedLog_) {
+    return std::make_unique<DataLogWriter>(combinedLog_, shardId, baseTime);
+  }
+
+  for (int i = 0; i < kFileOpenRetries; i++) {
+    GorillaStatsManager::addStatValue(kLogFileOpenRetries, i);
+    auto f = shardWriter.fileUtils->open(baseTime, "wb", kLogFileBufferSize);
+    if (f.file) {
+      return std::make_unique<DataLogWriter>(std::move(f), baseTime);
+    }
+    if (i == kFileOpenRetries - 1) {
+      LOG(ERROR) << "Failed too many times to open log file " << f.name;
+      GorillaStatsManager::addStatValue(kLogFilesystemFailures, 1);
+    }
+    usleep(kSleepUsBetweenFailures);
+  }
+  return nullptr;
+}
+
+double BucketLogWriter::getQueueFill() const {
+  return (double)std::max<ssize_t>(0, logDataQueue_.sizeGuess()) /
+      logDataQueue_.capacity();
+}
+
 void BucketLogWriter::flushQueue() {
   stopWriterThread();
   while (writeOneLogEntry(false))
@@ -121,15 +223,39 @@ void BucketLogWriter::logData(
     int64_t shardId,
     int32_t index,
     int64_t unixTime,
-    double value) {
+    double value,
+    int16_t ms) {
   LogDataInfo info;
   info.shardId = shardId;
   info.index = index;
   info.unixTime = unixTime;
   info.value = value;
+  info.ms = ms;
 
   if (!logDataQueue_.write(std::move(info))) {
-    GorillaStatsManager::addStatValue(kLogDataEnqueueFailures, 1);
+    logDataEnqueueFailuresStat.add();
+  }
+}
+
+void BucketLogWriter::logDataBatch(
+    int64_t shardId,
+    const std::vector<LogEntry>& entries) {
+  LogDataInfo info;
+  info.shardId = shardId;
+
+  int failures = 0;
+  for (const auto& entry : entries) {
+    info.index = entry.index;
+    info.unixTime = entry.unixTime;
+    info.value = entry.value;
+    info.ms = entry.ms;
+    if (!logDataQueue_.write(info)) {
+      failures++;
+    }
+  }
+
+  if (failures > 0) {
+    logDataEnqueueFailuresStat.add(failures);
   }
 }
 
@@ -143,7 +269,12 @@ bool BucketLogWriter::writeOneLogEntry(bool blockingRead) {
   }
 
   Timer dequeueTimer(true);
-  if (blockingRead) {
+  if (blockingRead && unsyncedBytes_ > 0) {
+    // Only block until the unsynced entries have to be synced.
+    if (logDataQueue_.tryReadUntil(nextSyncTime_, info)) {
+      data.push_back(std::move(info));
+    }
+  } else if (blockingRead) {
     // First read is blocking then as many as possible without blocking.
     logDataQueue_.blockingRead(info);
     data.push_back(std::move(info));
@@ -155,6 +286,8 @@ bool BucketLogWriter::writeOneLogEntry(bool blockingRead) {
   GorillaStatsManager::addStatValue(
       kLogDataDequeueLatencyUs, dequeueTimer.get());
 
+  Timer writeTimer(true);
+
   bool onePreviousLogWriterCleared = false;
 
   for (const auto& info : data) {
@@ -170,7 +303,32 @@ bool BucketLogWriter::writeOneLogEntry(bool blockingRead) {
       shardWriters_.insert(std::make_pair(info.shardId, std::move(writer)));
     } else if (info.index == kStopShardIndex) {
       LOG(INFO) << "Stopping shard " << info.shardId;
+      auto iter = shardWriters_.find(info.shardId);
+      if (iter != shardWriters_.end() && FLAGS_log_group_commit_ms > 0) {
+        for (auto& logWriter : iter->second.logWriters) {
+          if (logWriter.second) {
+            logWriter.second->sync();
+          }
+        }
+      }
       shardWriters_.erase(info.shardId);
+    } else if (info.index == kNewLogFileIndex) {
+      auto iter = shardWriters_.find(info.shardId);
+      if (iter == shardWriters_.end()) {
+        continue;
+      }
+
+      // Keep the current file if it's already new enough. Opening a
+      // file that exists would truncate it.
+      int b = bucket(info.unixTime, info.shardId);
+      auto& logWriter = iter->second.logWriters[b];
+      if (!logWriter || logWriter->baseTime() < info.unixTime) {
+        if (logWriter && FLAGS_log_group_commit_ms > 0) {
+          logWriter->sync();
+        }
+        LOG(INFO) << "Starting a new log file for shard " << info.shardId;
+        logWriter = openLogFile(info.shardId, iter->second, info.unixTime);
+      }
     } else if (info.index != kNoOpIndex) {
       auto iter = shardWriters_.find(info.shardId);
       if (iter == shardWriters_.end()) {
@@ -186,20 +344,7 @@ bool BucketLogWriter::writeOneLogEntry(bool blockingRead) {
 
       // If this bucket doesn't have a file open yet, open it now.
       if (!logWriter) {
-        for (int i = 0; i < kFileOpenRetries; i++) {
-          GorillaStatsManager::addStatValue(kLogFileOpenRetries, i);
-          auto f = shardWriter.fileUtils->open(
-              info.unixTime, "wb", kLogFileBufferSize);
-          if (f.file) {
-            logWriter.reset(new DataLogWriter(std::move(f), info.unixTime));
-            break;
-          }
-          if (i == kFileOpenRetries - 1) {
-            LOG(ERROR) << "Failed too many times to open log file " << f.name;
-            GorillaStatsManager::addStatValue(kLogFilesystemFailures, 1);
-          }
-          usleep(kSleepUsBetweenFailures);
-        }
+        logWriter = openLogFile(info.shardId, shardWriter, info.unixTime);
       }
 
       // Open files for the next bucket in the last 1/10 of the time window.
@@ -209,27 +354,22 @@ bool BucketLogWriter::writeOneLogEntry(bool blockingRead) {
           shardWriter.logWriters.find(b + 1) == shardWriter.logWriters.end()) {
         uint32_t baseTime = timestamp(b + 1, info.shardId);
         LOG(INFO) << "Opening file in advance for shard " << info.shardId;
-        for (int i = 0; i < kFileOpenRetries; i++) {
-          GorillaStatsManager::addStatValue(kLogFileOpenRetries, i);
-          auto f =
-              shardWriter.fileUtils->open(baseTime, "wb", kLogFileBufferSize);
-          if (f.file) {
-            shardWriter.logWriters[b + 1].reset(
-                new DataLogWriter(std::move(f), baseTime));
-            break;
-          }
 
-          if (i == kFileOpenRetries - 1) {
-            // This is kind of ok. We'll try again above.
-            LOG(ERROR) << "Failed too many times to open log file " << f.name;
-            GorillaStatsManager::addStatValue(kLogFilesystemFailures, 1);
-          }
-          usleep(kSleepUsBetweenFailures);
+        // Failing is kind of ok. We'll try again above.
+        auto nextLogWriter =
+            openLogFile(info.shardId, shardWriter, baseTime);
+        if (nextLogWriter) {
+          shardWriter.logWriters[b + 1] = std::move(nextLogWriter);
         }
       }
 
       if (logWriter) {
-        logWriter->append(info.index, info.unixTime, info.value);
+        if (FLAGS_log_group_commit_ms > 0 && unsyncedBytes_ == 0) {
+          nextSyncTime_ = std::chrono::steady_clock::now() +
+              std::chrono::milliseconds(FLAGS_log_group_commit_ms);
+        }
+        unsyncedBytes_ += logWriter->append(
+            info.index, info.unixTime, info.value, info.ms);
       } else {
         GorillaStatsManager::addStatValue(kLogDataFailures, 1);
       }
@@ -244,20 +384,31 @@ bool BucketLogWriter::writeOneLogEntry(bool blockingRead) {
               waitTimeBeforeClosing_ &&
           shardWriter.logWriters.find(nowBucket - 1) !=
               shardWriter.logWriters.end()) {
+        auto& previous = shardWriter.logWriters[nowBucket - 1];
+        if (previous && FLAGS_log_group_commit_ms > 0) {
+          previous->sync();
+        }
         shardWriter.logWriters.erase(nowBucket - 1);
         onePreviousLogWriterCleared = true;
       }
 
       if (now > shardWriter.nextClearTimeSecs) {
         shardWriter.fileUtils->clearTo(time(nullptr) - keepLogFilesAroundTime_);
+        if (combinedLog_) {
+          combinedLog_->clearTo(time(nullptr) - keepLogFilesAroundTime_);
+        }
         shardWriter.nextClearTimeSecs += duration(1);
       }
     }
   }
 
   // Don't flush any of the logWriters. DataLog class will handle the
-  // flushing when there's enough data.
-  return !data.empty();
+  // flushing when there's enough data, unless group commit is enabled.
+  maybeSyncLogs(false);
+  if (!data.empty()) {
+    GorillaStatsManager::addStatValue(kLogDataWriteLatencyUs, writeTimer.get());
+  }
+  return blockingRead || !data.empty();
 }
 
 void BucketLogWriter::startShard(int64_t shardId) {
@@ -277,9 +428,16 @@ void BucketLogWriter::stopShard(int64_t shardId) {
 void BucketLogWriter::startMonitoring() {
   GorillaStatsManager::addStatExportType(kLogDataEnqueueFailures, SUM);
   GorillaStatsManager::addStatExportType(kLogDataDequeueLatencyUs, AVG);
+  GorillaStatsManager::addPercentileExports(
+      kLogDataDequeueLatencyUs, kGorillaUsecPerSecond);
+  GorillaStatsManager::addStatExportType(kLogDataWriteLatencyUs, AVG);
+  GorillaStatsManager::addPercentileExports(
+      kLogDataWriteLatencyUs, kGorillaUsecPerSecond);
   GorillaStatsManager::addStatExportType(kLogFileOpenRetries, SUM);
   GorillaStatsManager::addStatExportType(kLogDataFailures, SUM);
   GorillaStatsManager::addStatExportType(kLogFilesystemFailures, SUM);
+  GorillaStatsManager::addStatExportType(kLogSyncLatencyUs, AVG);
+  GorillaStatsManager::addStatExportType(kLogSyncBytes, AVG);
 }
 
 } // namespace gorilla
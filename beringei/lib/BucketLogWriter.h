@@ -9,13 +9,16 @@
 
 #pragma once
 
+#include <chrono>
 #include <memory>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <folly/MPMCQueue.h>
 #include <gtest/gtest.h>
 
+#include "beringei/lib/CombinedLog.h"
 #include "beringei/lib/DataLog.h"
 #include "beringei/lib/FileUtils.h"
 
@@ -31,8 +34,32 @@ class BucketLogWriterIf {
   /// @param[in] index Index into the internal vector of TimeSeries.
   /// @param[in] unixTime Time of the data point.
   /// @param[in] value Value of the data point.
-  virtual void
-  logData(int64_t shardId, int32_t index, int64_t unixTime, double value) = 0;
+  /// @param[in] ms Milliseconds of the data point within `unixTime`.
+  virtual void logData(
+      int64_t shardId,
+      int32_t index,
+      int64_t unixTime,
+      double value,
+      int16_t ms = 0) = 0;
+
+  struct LogEntry {
+    int32_t index;
+    int64_t unixTime;
+    double value;
+    int16_t ms = 0;
+  };
+
+  /// Pushes a batch of data entries of one shard to the queue. The
+  /// default implementation calls logData for each entry.
+  /// @param[in] shardId Shard for this log.
+  /// @param[in] entries Data entries to log.
+  virtual void logDataBatch(
+      int64_t shardId,
+      const std::vector<LogEntry>& entries) {
+    for (const auto& entry : entries) {
+      logData(shardId, entry.index, entry.unixTime, entry.value, entry.ms);
+    }
+  }
 
   /// Starts writing points for this shard.
   /// @param[in] shard Shard to start writing data point.
@@ -41,22 +68,48 @@ class BucketLogWriterIf {
   /// Stops writing points for this shard and closes all the open files.
   /// @param[in] shard Shard to stop writing data point.
   virtual void stopShard(int64_t shardId) = 0;
+
+  /// Starts a new log file for the bucket of `unixTime`. Entries
+  /// logged after this call are not written to the older files of the
+  /// bucket. Returns false if the writer can't guarantee that.
+  /// @param[in] shardId Shard to start a new log file for.
+  /// @param[in] unixTime Id of the new log file.
+  virtual bool startNewLogFile(int64_t shardId, int64_t unixTime) {
+    return false;
+  }
+
+  /// Returns the fraction of the fullest queue that is in use. Entries
+  /// are dropped once a queue is full.
+  virtual double getQueueFill() const {
+    return 0;
+  }
 };
 
 class BucketLogWriter : public BucketLogWriterIf {
  public:
   static const std::string kLogFilePrefix;
 
+  /// `logPartition` tells apart the combined logs of the writers that
+  /// share a data directory.
   BucketLogWriter(
       int windowSize,
       const std::string& dataDirectory,
       size_t queueSize,
-      uint32_t allowedTimestampBehind);
+      uint32_t allowedTimestampBehind,
+      int logPartition = 0);
 
   ~BucketLogWriter();
 
   /// @see BucketLogWriterIf.
-  void logData(int64_t shardId, int32_t index, int64_t unixTime, double value)
+  void logData(
+      int64_t shardId,
+      int32_t index,
+      int64_t unixTime,
+      double value,
+      int16_t ms = 0) override;
+
+  /// @see BucketLogWriterIf.
+  void logDataBatch(int64_t shardId, const std::vector<LogEntry>& entries)
       override;
 
   /// @see BucketLogWriterIf.
@@ -65,6 +118,12 @@ class BucketLogWriter : public BucketLogWriterIf {
   /// @see BucketLogWriterIf.
   void stopShard(int64_t shardId) override;
 
+  /// @see BucketLogWriterIf.
+  bool startNewLogFile(int64_t shardId, int64_t unixTime) override;
+
+  /// @see BucketLogWriterIf.
+  double getQueueFill() const override;
+
   /// Initialize all monitoring for this class.
   static void startMonitoring();
 
@@ -78,6 +137,11 @@ class BucketLogWriter : public BucketLogWriterIf {
   void startWriterThread();
   void stopWriterThread();
 
+  // Syncs all the open log files to disk if group commit is enabled
+  // and the oldest unsynced entry is older than the max latency or
+  // there are too many unsynced bytes.
+  void maybeSyncLogs(bool force);
+
   uint32_t bucket(uint64_t unixTime, int shardId) const;
   uint64_t timestamp(uint32_t bucket, int shardId) const;
   uint64_t duration(uint32_t buckets) const;
@@ -91,6 +155,7 @@ class BucketLogWriter : public BucketLogWriterIf {
     int32_t shardId;
     int64_t unixTime;
     double value;
+    int16_t ms;
   };
 
   int windowSize_;
@@ -108,6 +173,19 @@ class BucketLogWriter : public BucketLogWriterIf {
   };
 
   std::unordered_map<int64_t, ShardWriter> shardWriters_;
+
+  // Opens a log file with `baseTime` as its id. Returns null if the
+  // file couldn't be opened after a few retries.
+  std::unique_ptr<DataLogWriter>
+  openLogFile(int64_t shardId, ShardWriter& shardWriter, int64_t baseTime);
+
+  // Host level log that all the log files are appended to instead of
+  // separate files, if enabled.
+  std::shared_ptr<CombinedLogWriter> combinedLog_;
+
+  // Group commit state. Only used by the writer thread.
+  std::chrono::steady_clock::time_point nextSyncTime_;
+  size_t unsyncedBytes_;
 };
 
 } // namespace gorilla
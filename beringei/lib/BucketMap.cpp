@@ -9,13 +9,22 @@
 
 #include "beringei/lib/BucketMap.h"
 
+#include <algorithm>
+#include <future>
+#include <limits>
+
+#include <folly/String.h>
+
+#include "beringei/lib/BlockFileStore.h"
 #include "beringei/lib/BucketLogWriter.h"
 #include "beringei/lib/BucketUtils.h"
+#include "beringei/lib/CategoryPolicy.h"
 #include "beringei/lib/DataBlockReader.h"
 #include "beringei/lib/DataLog.h"
 #include "beringei/lib/GorillaStatsManager.h"
 #include "beringei/lib/GorillaTimeConstants.h"
 #include "beringei/lib/LogReader.h"
+#include "beringei/lib/StreamArena.h"
 #include "beringei/lib/TimeSeries.h"
 
 DEFINE_int32(
@@ -24,11 +33,75 @@ DEFINE_int32(
     "The size of the qeueue that holds the data points in memory before they "
     "can be handled. This queue is only used when shards are being added.");
 
+DEFINE_bool(
+    key_filter,
+    true,
+    "Keep a Bloom filter over the keys of each shard so that lookups of keys "
+    "that don't exist skip the key tables.");
+
+DEFINE_int64(
+    data_point_queue_spill_bytes,
+    1024 * 1024 * 1024,
+    "Data points that don't fit in the queue of a shard that is being added "
+    "are written to a file in the shard directory, up to this many bytes. "
+    "0 drops them instead.");
+
 DEFINE_int64(
     missing_logs_threshold_secs,
     600, // 10 minute default
     "Count gaps longer than this as holes in the log files.");
 
+DEFINE_double(
+    key_list_compaction_dead_fraction,
+    0,
+    "Only compact the key list of a shard once at least this fraction of "
+    "its records are for deleted or replaced keys. When above zero, key "
+    "deletions are also written to the key list so that they survive "
+    "restarts. Older builds stop reading a key list file at the first "
+    "deletion.");
+
+DEFINE_int32(
+    deviation_index_threads,
+    1,
+    "Number of threads each shard uses to find the deviating time series.");
+
+DEFINE_bool(
+    drop_erased_blocks,
+    true,
+    "Leave the blocks of the time series that were erased before their "
+    "bucket was finalized out of its block file.");
+
+DEFINE_string(
+    rollup_tiers,
+    "",
+    "Comma separated resolution:buckets pairs, e.g. 300:84,3600:255. Each "
+    "tier keeps the min, max, sum and count of every window of "
+    "`resolution` seconds of each time series for `buckets` buckets, and "
+    "serves downsampling getData() requests with a step that is a "
+    "multiple of the resolution. Empty disables the rollups.");
+
+DEFINE_int32(
+    block_file_store_query_buckets,
+    84,
+    "getData reads at most this many buckets older than the ones in memory "
+    "from the block file store.");
+
+DEFINE_int32(
+    block_file_store_cached_buckets,
+    4,
+    "Buckets read from the block file store that each shard keeps in "
+    "memory for the next queries.");
+
+DEFINE_bool(
+    prepare_next_bucket,
+    false,
+    "Allocate and fault in the pages of the open bucket when the previous "
+    "one is finalized, sized like it, so that the time series don't "
+    "allocate them when they close their streams at the end of the "
+    "bucket. Holds up to one more bucket of pages in the meantime.");
+
+DECLARE_bool(gorilla_running_stats);
+
 namespace facebook {
 namespace gorilla {
 
@@ -36,11 +109,37 @@ namespace gorilla {
 // on each resize.
 const int kRowsAtATime = 10000;
 
+// How many rows are copied at a time when indexing deviations.
+static const int kDeviationRowsAtATime = 1000;
+
+// How many points replayed from the logs or taken from the queue are
+// put at a time.
+static const size_t kPointsPerPutBatch = 65536;
+
+// Seed of scanHashKey(), so that the subshards don't follow the stripes.
+static const uint64_t kScanHashSeed = 0xDA7A5CA9;
+
 static const std::string kMsPerKeyListRead = "ms_per_key_list_read";
 static const std::string kMsPerLogFilesRead = "ms_per_log_files_read";
 static const std::string kMsPerBlockFileRead = "ms_per_block_file_read";
+static const std::string kBlockFileRequests = "block_file_requests";
+
+// Block files read from the block file store are downloaded to this
+// directory under the data directory.
+static const std::string kArchiveDirectory = "archive";
 static const std::string kMsPerQueueProcessing = "ms_per_queue_processing";
+static const std::string kMsPerLogFileDecode = "ms_per_log_file_decode";
+static const std::string kMsPerLogFileWait = "ms_per_log_file_wait";
+static const std::string kMsPerLogFileApply = "ms_per_log_file_apply";
+static const std::string kMsPerRemoteLogFileRead =
+    "ms_per_remote_log_file_read";
+static const std::string kRemoteLogFileFailures = "remote_log_file_failures";
 static const std::string kDataPointQueueDropped = "data_point_queue_dropped";
+static const std::string kDataPointQueueSpilled = "data_point_queue_spilled";
+static const std::string kKeyFilterRejections = "key_filter_rejections";
+static GorillaStat keyFilterRejectionsStat(kKeyFilterRejections);
+static const std::string kKeyFilterBytes = "key_filter_bytes";
+static const std::string kQueuedDataPointsFile = "queued_data_points";
 static const std::string kCorruptKeyFiles = "corrupt_key_files";
 static const std::string kCorruptLogFiles = "corrupt_log_files";
 static const std::string kUnknownKeysInLogFiles = "unknown_keys_in_log_files";
@@ -50,9 +149,29 @@ static const std::string kDataHoles = "missing_blocks_and_logs";
 static const std::string kMissingLogs = "missing_seconds_of_log_data";
 static const std::string kDeletionRaces = "key_deletion_failures";
 static const std::string kDuplicateKeys = "duplicate_keys_in_key_list";
+static const std::string kSkippedKeyListCompactions =
+    "skipped_key_list_compactions";
+static const std::string kDeadKeyListRecords = "dead_key_list_records";
+static const std::string kMsPerSnapshotWrite = "ms_per_snapshot_write";
+static const std::string kMsPerSnapshotRead = "ms_per_snapshot_read";
+static const std::string kSnapshotFailures = "snapshot_failures";
+static const std::string kSnapshotStreams = "snapshot_streams";
+static const std::string kRestoredSnapshotStreams =
+    "restored_snapshot_streams";
+static const std::string kRowsCheckedForUpdates =
+    "rows_checked_for_updates";
+static const std::string kMsPerRollup = "ms_per_rollup";
+static const std::string kReplicatedKeys = "replicated_keys";
+static const std::string kReplicatedPointsUnknownKeys =
+    "replicated_points_unknown_keys";
+static const std::string kCategoryPolicyRefusedSeries =
+    "category_policy_refused_series";
 
 static const size_t kMaxAllowedKeyLength = 400;
 
+// Keeps the rollup blocks well under the maximum block size.
+static const int64_t kMaxRollupWindowsPerBucket = 512;
+
 static int16_t kInstagramCategoryId = 271;
 
 const int BucketMap::kNotOwned = -1;
@@ -72,15 +191,53 @@ BucketMap::BucketMap(
       windowSize_(windowSize),
       reliableDataStartTime_(0),
       lock_(),
+      lastUpdateTimes_(FLAGS_max_allowed_timeseries_id + 1),
       tableSize_(0),
+      keyListRecords_(0),
+      pointsAdded_(0),
+      keysQueried_(0),
+      previousUsageSample_{0, 0, 0},
+      lastUsageSample_{time(nullptr), 0, 0},
+      epoch_(0),
       storage_(buckets, shardId, dataDirectory),
+      snapshot_(shardId, dataDirectory),
       state_(state),
       shardId_(shardId),
       dataDirectory_(dataDirectory),
       keyWriter_(keyWriter),
       logWriter_(logWriter),
       lastFinalizedBucket_(0),
-      logReaderFactory_(logReaderFactory) {}
+      logReaderFactory_(logReaderFactory),
+      follower_(false) {
+  epochReaders_[0] = 0;
+  epochReaders_[1] = 0;
+
+  // Rollup tiers are only kept locally.
+  storage_.setBlockFileStore(BlockFileStore::getInstance());
+
+  std::vector<folly::StringPiece> tiers;
+  folly::split(',', FLAGS_rollup_tiers, tiers, true);
+  for (auto tier : tiers) {
+    int64_t resolution;
+    int buckets;
+    if (!folly::split(':', tier, resolution, buckets) || resolution <= 0 ||
+        windowSize_ % resolution != 0 ||
+        windowSize_ / resolution > kMaxRollupWindowsPerBucket ||
+        buckets <= 0 || buckets > std::numeric_limits<uint8_t>::max()) {
+      LOG(ERROR) << "Invalid rollup tier: " << tier;
+      continue;
+    }
+    rollups_.emplace_back(
+        new RollupStorage(resolution, buckets, shardId_, dataDirectory_));
+  }
+  std::sort(
+      rollups_.begin(),
+      rollups_.end(),
+      [](const std::unique_ptr<RollupStorage>& a,
+         const std::unique_ptr<RollupStorage>& b) {
+        return a->getResolution() < b->getResolution();
+      });
+}
 
 // Insert the given data point, creating a new row if necessary.
 // Returns the number of new rows created (0 or 1) and the number of
@@ -128,110 +285,1083 @@ std::pair<int, int> BucketMap::put(
         // considered to be owned.
         break;
 
-        // No default case to let compiler warn if new states are added
-        // without adding a case for them.
-    }
+        // No default case to let compiler warn if new states are added
+        // without adding a case for them.
+    }
+  }
+
+  if (existingItem) {
+    bool added = putDataPointWithId(existingItem.get(), id, value, category);
+    return {0, added ? 1 : 0};
+  }
+
+  if (!categoryHasRoom(category)) {
+    GorillaStatsManager::addStatValue(kCategoryPolicyRefusedSeries);
+    return {0, 0};
+  }
+
+  uint32_t b = bucket(value.unixTime);
+
+  // Prepare a row now to minimize critical section.
+  auto newRow = std::make_shared<std::pair<std::string, BucketedTimeSeries>>();
+  newRow->first = key;
+  newRow->second.reset(n_, b, value.unixTime, category);
+  newRow->second.put(b, value, &storage_, -1, &category);
+
+  Item item;
+  int index = insertRow(newRow, category, item);
+  if (item) {
+    // Another thread added the key, just update the existing one.
+    bool added = putDataPointWithId(item.get(), index, value, category);
+    return {0, added ? 1 : 0};
+  }
+  lastUpdateTimes_.update(index, value.unixTime);
+
+  // Write the new key out to disk.
+  keyWriter_->addKey(shardId_, index, newRow->first, category, value.unixTime);
+  keyListRecords_++;
+  logWriter_->logData(
+      shardId_, index, value.unixTime, value.value, value.ms);
+  if (replicator_) {
+    replicator_->addKey(
+        shardId_, index, newRow->first, category, value.unixTime);
+    replicator_->addPoint(
+        shardId_, index, value.unixTime, value.value, value.ms);
+  }
+  if (subscriptions_) {
+    subscriptions_->publish(shardId_, newRow->first, value, category);
+  }
+
+  return {1, 1};
+}
+
+int BucketMap::insertRow(
+    const Item& newRow,
+    uint16_t category,
+    Item& existing) {
+  // Only the stripe of this key is locked while the key is inserted.
+  uint64_t hash = hashKey(newRow->first.c_str());
+  MapStripe& stripe = getStripe(hash);
+  folly::RWSpinLock::WriteHolder stripeGuard(stripe.lock);
+
+  int index = 0;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    index = findInStripe(stripe, newRow->first.c_str(), hash);
+    if (index >= 0) {
+      existing = rows_[index];
+      return index;
+    }
+  }
+
+  // Find a row in the vector.
+  uint32_t scanHash = scanHashKey(newRow->first);
+  {
+    folly::RWSpinLock::WriteHolder guard(lock_);
+    if (freeList_.size()) {
+      index = freeList_.top();
+      freeList_.pop();
+    } else {
+      tableSize_++;
+      rows_.emplace_back();
+      scanHashes_.emplace_back();
+      index = rows_.size() - 1;
+    }
+
+    rows_[index] = newRow;
+    scanHashes_[index] = scanHash;
+    countCategorySeries(category, 1);
+  }
+  stripe.map.insert((uint32_t)hash, index);
+  if (auto filter = std::atomic_load(&keyFilter_)) {
+    filter->add(hash);
+  }
+
+  // Indexed under the stripe lock so that an erase of the key can't
+  // happen in between.
+  keyIndex_.insert(newRow);
+  return index;
+}
+
+BucketMap::PutBatchResult BucketMap::putBatch(
+    const std::vector<DataPoint>& data,
+    const std::vector<uint32_t>& points,
+    bool allowNewKeys,
+    std::vector<KeyId>* keyIds) {
+  PutBatchResult result;
+
+  std::vector<const char*> keys(points.size());
+  for (int i = 0; i < points.size(); i++) {
+    keys[i] = data[points[i]].key.key.c_str();
+  }
+
+  std::vector<int> ids;
+  std::vector<Item> items;
+  std::vector<uint64_t> hashes;
+  State state = findBatch(keys, ids, items, keyIds ? &hashes : nullptr);
+
+  if (state == UNOWNED) {
+    result.notOwned = points;
+    return result;
+  }
+
+  if (keyIds) {
+    for (int i = 0; i < points.size(); i++) {
+      if (items[i]) {
+        (*keyIds)[points[i]].id = ids[i];
+        (*keyIds)[points[i]].tag = hashes[i];
+      }
+    }
+  }
+
+  auto putOne = [&](int i) {
+    const DataPoint& dp = data[points[i]];
+    if (!items[i] && !allowNewKeys) {
+      result.newKeysBlocked++;
+      return;
+    }
+
+    auto ret = put(dp.key.key, dp.value, dp.categoryId);
+    if (ret.first == kNotOwned) {
+      result.notOwned.push_back(points[i]);
+    } else {
+      result.newRows += ret.first;
+      result.added += ret.second;
+    }
+  };
+
+  if (state != READING_BLOCK_DATA && state != OWNED && state != PRE_UNOWNED) {
+    // The shard is being added so the data points will be queued.
+    for (int i = 0; i < points.size(); i++) {
+      putOne(i);
+    }
+    pointsAdded_ += result.added;
+    return result;
+  }
+
+  std::vector<BucketLogWriterIf::LogEntry> logEntries;
+  logEntries.reserve(points.size());
+  for (int i = 0; i < points.size(); i++) {
+    if (!items[i]) {
+      // All the points of a new key go through put(), so the log
+      // entries of one key stay in order.
+      putOne(i);
+      continue;
+    }
+
+    const DataPoint& dp = data[points[i]];
+    uint16_t category = dp.categoryId;
+    uint32_t b = bucket(dp.value.unixTime);
+    if (items[i]->second.put(b, dp.value, &storage_, ids[i], &category)) {
+      lastUpdateTimes_.update(ids[i], dp.value.unixTime);
+      logEntries.push_back(
+          {ids[i], dp.value.unixTime, dp.value.value, dp.value.ms});
+      result.added++;
+      if (subscriptions_) {
+        subscriptions_->publish(
+            shardId_, items[i]->first, dp.value, category);
+      }
+    }
+  }
+
+  if (!logEntries.empty()) {
+    logWriter_->logDataBatch(shardId_, logEntries);
+    if (replicator_) {
+      replicator_->addPoints(shardId_, logEntries);
+    }
+  }
+  pointsAdded_ += result.added;
+  return result;
+}
+
+BucketMap::PutBatchResult BucketMap::putBatchWithKeyIds(
+    const std::vector<DataPointWithKeyId>& data,
+    const std::vector<uint32_t>& points) {
+  PutBatchResult result;
+  std::vector<Item> items(points.size());
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    if (state_ == READING_BLOCK_DATA || state_ == OWNED ||
+        state_ == PRE_UNOWNED) {
+      for (int i = 0; i < points.size(); i++) {
+        const KeyId& keyId = data[points[i]].keyId;
+        if (keyId.id >= 0 && keyId.id < rows_.size() && rows_[keyId.id] &&
+            hashKey(rows_[keyId.id]->first.c_str()) == (uint64_t)keyId.tag) {
+          items[i] = rows_[keyId.id];
+        }
+      }
+    }
+  }
+
+  std::vector<BucketLogWriterIf::LogEntry> logEntries;
+  logEntries.reserve(points.size());
+  for (int i = 0; i < points.size(); i++) {
+    if (!items[i]) {
+      result.notOwned.push_back(points[i]);
+      continue;
+    }
+
+    const DataPointWithKeyId& dp = data[points[i]];
+    uint16_t category = dp.categoryId;
+    uint32_t b = bucket(dp.value.unixTime);
+    if (items[i]->second.put(
+            b, dp.value, &storage_, dp.keyId.id, &category)) {
+      lastUpdateTimes_.update(dp.keyId.id, dp.value.unixTime);
+      logEntries.push_back(
+          {dp.keyId.id, dp.value.unixTime, dp.value.value, dp.value.ms});
+      result.added++;
+      if (subscriptions_) {
+        subscriptions_->publish(
+            shardId_, items[i]->first, dp.value, category);
+      }
+    }
+  }
+
+  if (!logEntries.empty()) {
+    logWriter_->logDataBatch(shardId_, logEntries);
+    if (replicator_) {
+      replicator_->addPoints(shardId_, logEntries);
+    }
+  }
+  pointsAdded_ += result.added;
+  return result;
+}
+
+BucketMap::PutBatchResult BucketMap::putEncoded(
+    const std::vector<EncodedDataPoints>& data,
+    const std::vector<std::vector<TimeValuePair>>& values,
+    const std::vector<uint32_t>& entries,
+    bool allowNewKeys) {
+  PutBatchResult result;
+
+  std::vector<const char*> keys(entries.size());
+  for (int i = 0; i < entries.size(); i++) {
+    keys[i] = data[entries[i]].key.key.c_str();
+  }
+
+  std::vector<int> ids;
+  std::vector<Item> items;
+  State state = findBatch(keys, ids, items);
+
+  if (state == UNOWNED) {
+    result.notOwned = entries;
+    return result;
+  }
+
+  auto putOne = [&](int i) {
+    const EncodedDataPoints& entry = data[entries[i]];
+    if (!items[i] && !allowNewKeys) {
+      result.newKeysBlocked++;
+      return;
+    }
+
+    for (const auto& value : values[entries[i]]) {
+      auto ret = put(entry.key.key, value, entry.categoryId);
+      if (ret.first == kNotOwned) {
+        result.notOwned.push_back(entries[i]);
+        return;
+      }
+      result.newRows += ret.first;
+      result.added += ret.second;
+    }
+  };
+
+  if (state != READING_BLOCK_DATA && state != OWNED && state != PRE_UNOWNED) {
+    // The shard is being added so the data points will be queued.
+    for (int i = 0; i < entries.size(); i++) {
+      putOne(i);
+    }
+    pointsAdded_ += result.added;
+    return result;
+  }
+
+  std::vector<BucketLogWriterIf::LogEntry> logEntries;
+  std::vector<uint32_t> buckets;
+  std::vector<bool> added;
+  for (int i = 0; i < entries.size(); i++) {
+    if (!items[i]) {
+      putOne(i);
+      continue;
+    }
+
+    const auto& points = values[entries[i]];
+    if (points.empty()) {
+      continue;
+    }
+
+    buckets.resize(points.size());
+    for (int j = 0; j < points.size(); j++) {
+      buckets[j] = bucket(points[j].unixTime);
+    }
+
+    uint16_t category = data[entries[i]].categoryId;
+    int count = items[i]->second.putMany(
+        points, buckets, &storage_, ids[i], &category, added);
+    if (count == 0) {
+      continue;
+    }
+
+    result.added += count;
+    for (int j = 0; j < points.size(); j++) {
+      if (!added[j]) {
+        continue;
+      }
+      lastUpdateTimes_.update(ids[i], points[j].unixTime);
+      logEntries.push_back(
+          {ids[i], points[j].unixTime, points[j].value, points[j].ms});
+      if (subscriptions_) {
+        subscriptions_->publish(
+            shardId_, items[i]->first, points[j], category);
+      }
+    }
+  }
+
+  if (!logEntries.empty()) {
+    logWriter_->logDataBatch(shardId_, logEntries);
+    if (replicator_) {
+      replicator_->addPoints(shardId_, logEntries);
+    }
+  }
+  pointsAdded_ += result.added;
+  return result;
+}
+
+// Get a shared_ptr to a TimeSeries.
+BucketMap::BackfillResult BucketMap::backfill(
+    const std::vector<BackfillData>& data,
+    const std::vector<uint32_t>& indexes) {
+  BackfillResult result;
+  std::lock_guard<std::mutex> finalizeGuard(finalizeMutex_);
+
+  // Block files are only read into buckets that have no pages, so
+  // nothing is backfilled until they all have been read.
+  if (getState() != OWNED || lastFinalizedBucket_ == 0) {
+    result.notOwned = indexes;
+    return result;
+  }
+
+  uint32_t newest = lastFinalizedBucket_;
+  uint32_t oldest = newest >= n_ ? newest - n_ + 1 : 0;
+  std::set<uint32_t> positions;
+
+  for (uint32_t i : indexes) {
+    const auto& entry = data[i];
+    std::vector<TimeValuePair> values;
+    TimeSeries::getValues(
+        entry.block, values, timestamp(oldest), timestamp(newest + 1) - 1);
+    result.dropped += std::max<int>(0, entry.block.count - (int)values.size());
+    if (values.empty()) {
+      continue;
+    }
+    std::stable_sort(
+        values.begin(),
+        values.end(),
+        [](const TimeValuePair& a, const TimeValuePair& b) {
+          return a.unixTime < b.unixTime;
+        });
+
+    State state;
+    uint32_t id;
+    uint16_t category = entry.categoryId;
+    Item item = getInternal(entry.key.key, state, id);
+    if (!item) {
+      if (!categoryHasRoom(category)) {
+        GorillaStatsManager::addStatValue(kCategoryPolicyRefusedSeries);
+        result.dropped += values.size();
+        continue;
+      }
+
+      // The row starts at the open bucket and its minimum bucket is
+      // lowered to the backfilled ones.
+      auto newRow = std::make_shared<Row>();
+      newRow->first = entry.key.key;
+      newRow->second.reset(n_, newest + 1, timestamp(newest + 1), category);
+      Item existing;
+      id = insertRow(newRow, category, existing);
+      if (existing) {
+        item = existing;
+      } else {
+        item = newRow;
+        lastUpdateTimes_.update(id, values.back().unixTime);
+        result.newRows++;
+      }
+    } else {
+      category = item->second.getCategory();
+    }
+
+    // Blocks older than the creation time of the key are dropped when
+    // the shard is read again, so the key is written out again with
+    // the time of the first backfilled point.
+    if (item->second.getMinBucket() > bucket(values.front().unixTime)) {
+      keyWriter_->addKey(
+          shardId_, id, item->first, category, values.front().unixTime);
+      keyListRecords_++;
+      if (replicator_) {
+        replicator_->addKey(
+            shardId_, id, item->first, category, values.front().unixTime);
+      }
+    }
+
+    auto begin = values.cbegin();
+    while (begin != values.cend()) {
+      uint32_t position = bucket(begin->unixTime);
+      auto end = begin;
+      while (end != values.cend() && bucket(end->unixTime) == position) {
+        ++end;
+      }
+
+      int added = backfillBucket(item.get(), position, begin, end);
+      if (added >= 0) {
+        result.added += added;
+        result.dropped += (end - begin) - added;
+        positions.insert(position);
+      } else {
+        result.dropped += end - begin;
+      }
+      begin = end;
+    }
+  }
+
+  if (positions.empty()) {
+    return result;
+  }
+
+  std::vector<Item> items;
+  getEverything(items);
+  for (uint32_t position : positions) {
+    std::vector<uint32_t> timeSeriesIds;
+    std::vector<BucketStorage::BucketStorageId> storageIds;
+    for (int i = 0; i < items.size(); i++) {
+      if (!items[i]) {
+        continue;
+      }
+
+      auto block = items[i]->second.getFinalizedBlock(position, n_);
+      if (block != BucketStorage::kInvalidId) {
+        timeSeriesIds.push_back(i);
+        storageIds.push_back(block);
+      }
+    }
+    storage_.writeBlockFile(position, timeSeriesIds, storageIds);
+  }
+  return result;
+}
+
+int BucketMap::backfillBucket(
+    Row* row,
+    uint32_t position,
+    std::vector<TimeValuePair>::const_iterator begin,
+    std::vector<TimeValuePair>::const_iterator end) {
+  std::vector<TimeValuePair> existing;
+  auto id = row->second.getFinalizedBlock(position, n_);
+  if (id != BucketStorage::kInvalidId) {
+    TimeSeriesBlock block;
+    uint32_t count;
+    if (storage_.fetch(position, id, block.data, count) !=
+        BucketStorage::SUCCESS) {
+      return -1;
+    }
+    block.count = count;
+    TimeSeries::getValues(
+        block, existing, 0, std::numeric_limits<int64_t>::max());
+  }
+
+  // Both are sorted, and the backfilled points replace the existing
+  // ones with the same timestamps.
+  int32_t minTimestampDelta =
+      BucketedTimeSeries::minTimestampDelta(row->second.getCategory());
+  TimeSeriesStream stream;
+  uint32_t count = 0;
+  int added = 0;
+  auto it = existing.cbegin();
+  while (begin != end || it != existing.cend()) {
+    bool backfilled = it == existing.cend() ||
+        (begin != end && begin->unixTime <= it->unixTime);
+    const TimeValuePair& value = backfilled ? *begin : *it;
+    if (backfilled) {
+      if (it != existing.cend() && it->unixTime == begin->unixTime) {
+        ++it;
+      }
+      ++begin;
+    } else {
+      ++it;
+    }
+
+    if (stream.append(value, minTimestampDelta)) {
+      count++;
+      added += backfilled ? 1 : 0;
+    }
+  }
+
+  auto newId = storage_.storeBackfill(
+      position, stream.getDataPtr(), stream.size(), count);
+  if (newId == BucketStorage::kInvalidId ||
+      !row->second.setBackfilledBlock(position, n_, newId)) {
+    return -1;
+  }
+  return added;
+}
+
+bool BucketMap::setFollower(bool follower) {
+  std::lock_guard<std::mutex> stateGuard(stateChangeMutex_);
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  if (state_ != UNOWNED) {
+    return follower_ == follower;
+  }
+
+  follower_ = follower;
+  return true;
+}
+
+int BucketMap::putReplicatedKeys(
+    const std::vector<KeyMapping>& keys,
+    const std::vector<uint32_t>& indexes) {
+  // Freed after the locks are released.
+  std::vector<Item> removed;
+  int newRows = 0;
+
+  // The keys can be in any of the stripes.
+  lockAllStripes();
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  if (!follower_ ||
+      (state_ != READING_BLOCK_DATA && state_ != OWNED &&
+       state_ != PRE_UNOWNED)) {
+    guard.reset();
+    unlockAllStripes();
+    return kNotOwned;
+  }
+
+  auto filter = std::atomic_load(&keyFilter_);
+  for (uint32_t index : indexes) {
+    const KeyMapping& mapping = keys[index];
+    if (mapping.keyId < 0 || mapping.keyId > FLAGS_max_allowed_timeseries_id ||
+        mapping.key.empty() || mapping.key.size() >= kMaxAllowedKeyLength) {
+      LOG(ERROR) << "Invalid replicated key " << mapping.keyId
+                 << " for shard " << shardId_;
+      continue;
+    }
+
+    int id = mapping.keyId;
+    const char* key = mapping.key.c_str();
+    uint64_t hash = hashKey(key);
+    MapStripe& stripe = getStripe(hash);
+    int existing = findInStripe(stripe, key, hash);
+    if (existing == id) {
+      continue;
+    }
+
+    // The owner only gives an id to another key once the old one has
+    // been purged, and gives a key another id after it was purged.
+    if (existing >= 0) {
+      removeRow(existing, removed);
+    }
+    if (id < rows_.size() && rows_[id]) {
+      removeRow(id, removed);
+    }
+    if (id >= rows_.size()) {
+      rows_.resize(id + 1);
+      scanHashes_.resize(id + 1);
+      tableSize_ = rows_.size();
+    }
+
+    auto row = std::make_shared<Row>();
+    row->first = mapping.key;
+    row->second.reset(
+        n_,
+        mapping.creationTime > 0 ? bucket(mapping.creationTime) : 0,
+        mapping.creationTime,
+        mapping.categoryId);
+    rows_[id] = row;
+    scanHashes_[id] = scanHashKey(row->first);
+    countCategorySeries(mapping.categoryId, 1);
+    stripe.map.insert((uint32_t)hash, id);
+    if (filter) {
+      filter->add(hash);
+    }
+    keyIndex_.insert(row);
+    newRows++;
+  }
+
+  guard.reset();
+  unlockAllStripes();
+  retireRows(std::move(removed));
+  GorillaStatsManager::addStatValue(kReplicatedKeys, newRows);
+  return newRows;
+}
+
+int BucketMap::putReplicatedPoints(
+    const std::vector<DataPointWithID>& points,
+    const std::vector<uint32_t>& indexes) {
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    if (!follower_ ||
+        (state_ != READING_BLOCK_DATA && state_ != OWNED &&
+         state_ != PRE_UNOWNED)) {
+      return kNotOwned;
+    }
+  }
+
+  uint32_t unknownKeys = 0;
+  std::vector<IdPoint> idPoints;
+  idPoints.reserve(indexes.size());
+  for (uint32_t index : indexes) {
+    const DataPointWithID& point = points[index];
+    if (point.keyId < 0) {
+      unknownKeys++;
+      continue;
+    }
+    idPoints.push_back({(uint32_t)point.keyId, 0, point.point});
+  }
+
+  uint32_t added = putDataPointsWithIds(idPoints, true, unknownKeys);
+  if (unknownKeys > 0) {
+    GorillaStatsManager::addStatValue(
+        kReplicatedPointsUnknownKeys, unknownKeys);
+  }
+  pointsAdded_ += added;
+  return added;
+}
+
+void BucketMap::removeRow(int index, std::vector<Item>& removed) {
+  Item& row = rows_[index];
+  uint64_t hash = hashKey(row->first.c_str());
+  getStripe(hash).map.erase((uint32_t)hash, index);
+  keyIndex_.erase(row);
+  lastUpdateTimes_.reset(index);
+  countCategorySeries(row->second.getCategory(), -1);
+  for (auto& rollup : rollups_) {
+    rollup->erase(index);
+  }
+  removed.push_back(std::move(row));
+}
+
+BucketMap::Item BucketMap::get(const std::string& key) {
+  State state;
+  uint32_t id;
+  keysQueried_++;
+  return getInternal(key, state, id);
+}
+
+void BucketMap::getBatch(
+    const std::vector<Key>& keys,
+    const std::vector<uint32_t>& indexes,
+    std::vector<Item>& out) {
+  std::vector<const char*> keyStrings(indexes.size());
+  for (int i = 0; i < indexes.size(); i++) {
+    keyStrings[i] = keys[indexes[i]].key.c_str();
+  }
+
+  std::vector<int> ids;
+  findBatch(keyStrings, ids, out);
+  keysQueried_ += indexes.size();
+}
+
+// Get all the TimeSeries.
+void BucketMap::getEverything(std::vector<Item>& out) {
+  out.reserve(tableSize_);
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  out.insert(out.end(), rows_.begin(), rows_.end());
+}
+
+bool BucketMap::getSome(std::vector<Item>& out, int offset, int count) {
+  out.reserve(count);
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  if (offset >= rows_.size()) {
+    return false;
+  } else if (offset + count >= rows_.size()) {
+    out.insert(out.end(), rows_.begin() + offset, rows_.end());
+    return false;
+  } else {
+    out.insert(
+        out.end(), rows_.begin() + offset, rows_.begin() + offset + count);
+    return true;
+  }
+}
+
+BucketMap::RowReader::RowReader(BucketMap* map)
+    : map_(map), epoch_(map->enterEpoch()) {}
+
+BucketMap::RowReader::~RowReader() {
+  map_->exitEpoch(epoch_);
+}
+
+bool BucketMap::RowReader::getSome(
+    std::vector<Row*>& out,
+    int offset,
+    int count,
+    uint32_t numSubshards,
+    uint32_t subshard) {
+  out.reserve(count);
+  folly::RWSpinLock::ReadHolder guard(map_->lock_);
+  const auto& rows = map_->rows_;
+  int end = std::min<int64_t>((int64_t)offset + count, rows.size());
+  for (int i = offset; i < end; i++) {
+    if (numSubshards <= 1 ||
+        map_->scanHashes_[i] % numSubshards == subshard) {
+      out.push_back(rows[i].get());
+    } else {
+      out.push_back(nullptr);
+    }
+  }
+  return end < rows.size();
+}
+
+uint64_t BucketMap::enterEpoch() {
+  while (true) {
+    uint64_t epoch = epoch_;
+    epochReaders_[epoch & 1]++;
+
+    // The epoch can't move past one with readers, but it could have
+    // moved before this reader was counted.
+    if (epoch_ == epoch) {
+      return epoch;
+    }
+    epochReaders_[epoch & 1]--;
+  }
+}
+
+void BucketMap::exitEpoch(uint64_t epoch) {
+  epochReaders_[epoch & 1]--;
+
+  std::unique_lock<std::mutex> guard(retiredMutex_, std::try_to_lock);
+  if (guard.owns_lock() && !retiredRows_.empty()) {
+    reclaimRows();
+  }
+}
+
+void BucketMap::retireRows(std::vector<Item>&& rows) {
+  if (rows.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(retiredMutex_);
+  retiredRows_.push_back({epoch_, std::move(rows)});
+  reclaimRows();
+}
+
+void BucketMap::reclaimRows() {
+  // Each step needs the readers of the epoch before the current one to
+  // be gone.
+  for (int i = 0; i < 2; i++) {
+    uint64_t epoch = epoch_;
+    if (epochReaders_[(epoch + 1) & 1] != 0) {
+      break;
+    }
+    epoch_.compare_exchange_strong(epoch, epoch + 1);
+  }
+
+  while (!retiredRows_.empty() && retiredRows_.front().epoch + 2 <= epoch_) {
+    retiredRows_.pop_front();
+  }
+}
+
+bool BucketMap::searchKeys(
+    const std::string& pattern,
+    const std::string& after,
+    int limit,
+    std::vector<Item>& out) {
+  return keyIndex_.find(pattern, after, limit, out);
+}
+
+bool BucketMap::getUpdatedSince(
+    uint32_t minLastUpdateTime,
+    int begin,
+    int end,
+    int limit,
+    std::vector<UpdatedItem>& out,
+    int& next) {
+  std::vector<std::pair<int, Item>> candidates;
+  bool more;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    int numRows = rows_.size();
+    next = std::max(0, begin);
+    end = std::min(end, numRows);
+    for (; next < end && candidates.size() < limit; next++) {
+      // Rows with a known time aren't touched unless they are fresh.
+      uint32_t time = lastUpdateTimes_.get(next);
+      if (time != 0 && time < minLastUpdateTime) {
+        continue;
+      }
+      if (rows_[next]) {
+        candidates.emplace_back(next, rows_[next]);
+      }
+    }
+    more = next < numRows;
+  }
+
+  uint64_t rowsChecked = candidates.size();
+  for (auto& candidate : candidates) {
+    uint32_t lastUpdateTime =
+        candidate.second->second.getLastUpdateTime(&storage_, *this);
+    if (lastUpdateTime != 0) {
+      // Remembered for rows that only have data from block files.
+      lastUpdateTimes_.update(candidate.first, lastUpdateTime);
+    }
+    if (lastUpdateTime >= minLastUpdateTime) {
+      out.push_back({std::move(candidate.second), lastUpdateTime});
+    }
+  }
+
+  GorillaStatsManager::addStatValue(kRowsCheckedForUpdates, rowsChecked);
+  return more;
+}
+
+void BucketMap::getResourceUsage(int sampleEvery, ResourceUsage& usage) {
+  sampleEvery = std::max(1, sampleEvery);
+  std::vector<Item> sampled;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    sampled.reserve(rows_.size() / sampleEvery + 1);
+    for (int i = 0; i < rows_.size(); i++) {
+      if (rows_[i]) {
+        usage.numSeries++;
+        if (usage.numSeries % sampleEvery == 0) {
+          sampled.push_back(rows_[i]);
+        }
+      }
+    }
+  }
+
+  for (const auto& item : sampled) {
+    uint32_t count, size, capacity;
+    std::tie(count, size, capacity) =
+        item->second.getActiveTimeSeriesStreamInfo();
+    auto& category = usage.categories[item->second.getCategory()];
+    category.numSeries += sampleEvery;
+    category.activeStreamBytes += (int64_t)size * sampleEvery;
+    usage.activeStreamBytes += (int64_t)size * sampleEvery;
+    usage.activeStreamSlackBytes += (int64_t)(capacity - size) * sampleEvery;
+  }
+
+  StreamArena* arena = storage_.getStreamArena();
+  if (arena) {
+    usage.streamArenaFreeBytes = arena->getFreeBytes();
+  }
+  usage.pageBytesByPosition = storage_.getPagesSizeByPosition();
+  usage.dedupHitRate = storage_.getLastBucketDedupHitRate();
+  usage.pointsAdded = pointsAdded_;
+  usage.keysQueried = keysQueried_;
+  usage.keyListRecords = keyListRecords_;
+
+  UsageSample from, to;
+  {
+    std::lock_guard<std::mutex> guard(usageSampleMutex_);
+    from = previousUsageSample_;
+    to = lastUsageSample_;
+  }
+  if (from.time == 0) {
+    // No bucket finalized yet.
+    from = to;
+    to = {time(nullptr), usage.pointsAdded, usage.keysQueried};
+  }
+  if (to.time > from.time) {
+    double seconds = to.time - from.time;
+    usage.pointsAddedPerSecond = (to.pointsAdded - from.pointsAdded) / seconds;
+    usage.keysQueriedPerSecond = (to.keysQueried - from.keysQueried) / seconds;
+  }
+}
+
+int64_t BucketMap::getExpectedRotationBytes() {
+  uint32_t last = lastFinalizedBucket_;
+  if (getState() != OWNED || last == 0) {
+    return 0;
+  }
+
+  auto sizes = storage_.getPagesSizeByPosition();
+  int64_t growth =
+      std::max<int64_t>(0, (int64_t)sizes[last] - (int64_t)sizes[last + 1]);
+  if (last + 2 > n_) {
+    auto oldest = sizes.find(last + 2 - n_);
+    if (oldest != sizes.end()) {
+      growth -= (int64_t)oldest->second;
+    }
+  }
+  return growth;
+}
+
+void BucketMap::erase(int index, Item item) {
+  if (!item) {
+    GorillaStatsManager::addStatValue(kDeletionRaces);
+    return;
+  }
+
+  uint64_t hash = hashKey(item->first.c_str());
+  MapStripe& stripe = getStripe(hash);
+  folly::RWSpinLock::WriteHolder stripeGuard(stripe.lock);
+  folly::RWSpinLock::WriteHolder guard(lock_);
+
+  if (rows_[index] != item) {
+    // The arguments provided are no longer valid.
+    GorillaStatsManager::addStatValue(kDeletionRaces);
+    return;
+  }
+
+  if (!stripe.map.erase((uint32_t)hash, index)) {
+    // The map doesn't point to this entry anymore.
+    GorillaStatsManager::addStatValue(kDeletionRaces);
   }
 
-  if (existingItem) {
-    bool added = putDataPointWithId(&existingItem->second, id, value, category);
-    return {0, added ? 1 : 0};
+  keyIndex_.erase(item);
+  lastUpdateTimes_.reset(index);
+  countCategorySeries(item->second.getCategory(), -1);
+  std::vector<Item> erased;
+  erased.push_back(std::move(rows_[index]));
+  freeList_.push(index);
+  for (auto& rollup : rollups_) {
+    rollup->erase(index);
   }
 
-  uint32_t b = bucket(value.unixTime);
+  // Queued while `lock_` is held, so the deletion is written before
+  // the key of whichever time series gets this row next.
+  if (FLAGS_key_list_compaction_dead_fraction > 0 &&
+      keyWriter_->deleteKey(shardId_, index)) {
+    keyListRecords_++;
+  }
 
-  // Prepare a row now to minimize critical section.
-  auto newRow = std::make_shared<std::pair<std::string, BucketedTimeSeries>>();
-  newRow->first = key;
-  newRow->second.reset(n_, b, value.unixTime);
-  newRow->second.put(b, value, &storage_, -1, &category);
+  guard.reset();
+  stripeGuard.reset();
+  retireRows(std::move(erased));
+}
 
-  int index = 0;
+int BucketMap::eraseBatch(
+    const std::vector<int>& indexes,
+    const std::vector<Item>& items) {
+  std::vector<Row*> rows;
+  rows.reserve(items.size());
+  for (const auto& item : items) {
+    rows.push_back(item.get());
+  }
+  return eraseBatch(indexes, rows);
+}
+
+int BucketMap::eraseBatch(
+    const std::vector<int>& indexes,
+    const std::vector<Row*>& rows) {
+  CHECK_EQ(indexes.size(), rows.size());
+
+  std::vector<uint64_t> hashes(rows.size());
+  std::array<bool, kMapStripes> usedStripes{};
+  for (int i = 0; i < rows.size(); i++) {
+    if (rows[i]) {
+      hashes[i] = hashKey(rows[i]->first.c_str());
+      usedStripes[getStripeIndex(hashes[i])] = true;
+    }
+  }
+
+  // Freed after the locks are released, so that freeing the time
+  // series doesn't block puts and queries.
+  std::vector<Item> erased;
+  erased.reserve(rows.size());
+
+  // The stripes are locked in order and before `lock_`, like in
+  // lockAllStripes().
+  for (int i = 0; i < kMapStripes; i++) {
+    if (usedStripes[i]) {
+      stripes_[i].lock.lock();
+    }
+  }
+
+  int races = 0;
   {
-    // Lock the map again.
-    folly::RWSpinLock::WriteHolder writeGuard(lock_);
-
-    // The value here doesn't matter because it will be replaced later.
-    auto ret = map_.insert(std::make_pair(newRow->first.c_str(), -1));
-    if (!ret.second) {
-      // Nothing was inserted, just update the existing one.
-      bool added = putDataPointWithId(
-          &rows_[ret.first->second]->second,
-          ret.first->second,
-          value,
-          category);
-      return {0, added ? 1 : 0};
-    }
-
-    // Find a row in the vector.
-    if (freeList_.size()) {
-      index = freeList_.top();
-      freeList_.pop();
-    } else {
-      tableSize_++;
-      rows_.emplace_back();
-      index = rows_.size() - 1;
+    folly::RWSpinLock::WriteHolder guard(lock_);
+    for (int i = 0; i < rows.size(); i++) {
+      int index = indexes[i];
+      if (!rows[i] || rows_[index].get() != rows[i]) {
+        // The arguments provided are no longer valid.
+        races++;
+        continue;
+      }
+
+      if (!getStripe(hashes[i]).map.erase((uint32_t)hashes[i], index)) {
+        // The map doesn't point to this entry anymore.
+        races++;
+      }
+
+      keyIndex_.erase(rows_[index]);
+      lastUpdateTimes_.reset(index);
+      countCategorySeries(rows[i]->second.getCategory(), -1);
+      erased.push_back(std::move(rows_[index]));
+      freeList_.push(index);
+
+      if (FLAGS_key_list_compaction_dead_fraction > 0 &&
+          keyWriter_->deleteKey(shardId_, index)) {
+        keyListRecords_++;
+      }
     }
+  }
 
-    rows_[index] = newRow;
-    ret.first->second = index;
+  for (int i = 0; i < kMapStripes; i++) {
+    if (usedStripes[i]) {
+      stripes_[i].lock.unlock();
+    }
   }
 
-  // Write the new key out to disk.
-  keyWriter_->addKey(shardId_, index, newRow->first, category, value.unixTime);
-  logWriter_->logData(shardId_, index, value.unixTime, value.value);
+  if (races > 0) {
+    GorillaStatsManager::addStatValue(kDeletionRaces, races);
+  }
 
-  return {1, 1};
+  int count = erased.size();
+  retireRows(std::move(erased));
+  return count;
 }
 
-// Get a shared_ptr to a TimeSeries.
-BucketMap::Item BucketMap::get(const std::string& key) {
-  State state;
-  uint32_t id;
-  return getInternal(key, state, id);
-}
+bool BucketMap::categoryHasRoom(uint16_t category) {
+  auto policy = CategoryPolicy::get(category);
+  if (!policy || (policy->maxSeries == 0 && policy->maxBytes == 0)) {
+    return true;
+  }
 
-// Get all the TimeSeries.
-void BucketMap::getEverything(std::vector<Item>& out) {
-  out.reserve(tableSize_);
-  folly::RWSpinLock::ReadHolder guard(lock_);
-  out.insert(out.end(), rows_.begin(), rows_.end());
-}
+  CategoryState state;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    auto it = categoryStates_.find(category);
+    if (it != categoryStates_.end()) {
+      state = it->second;
+    }
+  }
 
-bool BucketMap::getSome(std::vector<Item>& out, int offset, int count) {
-  out.reserve(count);
-  folly::RWSpinLock::ReadHolder guard(lock_);
-  if (offset >= rows_.size()) {
-    return false;
-  } else if (offset + count >= rows_.size()) {
-    out.insert(out.end(), rows_.begin() + offset, rows_.end());
+  if (policy->maxSeries > 0 && state.numSeries >= policy->maxSeries) {
     return false;
-  } else {
-    out.insert(
-        out.end(), rows_.begin() + offset, rows_.begin() + offset + count);
-    return true;
   }
-}
 
-void BucketMap::erase(int index, Item item) {
-  folly::RWSpinLock::WriteHolder guard(lock_);
+  // Every time series is expected to have as many bytes in each of the
+  // buckets kept as in the last finalized one.
+  double bytes = state.numSeries * state.blockBytesPerSeries *
+      CategoryPolicy::bucketsKept(category, n_);
+  return policy->maxBytes == 0 || bytes < policy->maxBytes;
+}
 
-  if (rows_[index] != item || !item) {
-    // The arguments provided are no longer valid.
-    GorillaStatsManager::addStatValue(kDeletionRaces);
-    return;
+void BucketMap::countCategorySeries(uint16_t category, int delta) {
+  if (CategoryPolicy::get(category)) {
+    auto& state = categoryStates_[category];
+    state.numSeries = std::max<int64_t>(0, state.numSeries + delta);
   }
+}
 
-  auto it = map_.find(item->first.c_str());
-  if (it != map_.end() && it->second == index) {
-    // The map still points to the right entry.
-    map_.erase(it);
-  } else {
-    GorillaStatsManager::addStatValue(kDeletionRaces);
+void BucketMap::updateCategoryBytes(
+    uint32_t bucket,
+    const std::vector<Item>& timeSeriesData) {
+  std::unordered_map<uint16_t, std::pair<int64_t, int64_t>> bytesAndSeries;
+  for (const auto& item : timeSeriesData) {
+    if (!item) {
+      continue;
+    }
+
+    uint16_t category = item->second.getCategory();
+    auto policy = CategoryPolicy::get(category);
+    if (policy && policy->maxBytes > 0) {
+      auto& entry = bytesAndSeries[category];
+      entry.first += item->second.getBlockBytes(bucket, n_);
+      entry.second++;
+    }
   }
 
-  rows_[index].reset();
-  freeList_.push(index);
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  for (const auto& entry : bytesAndSeries) {
+    categoryStates_[entry.first].blockBytesPerSeries =
+        (double)entry.second.first / entry.second.second;
+  }
 }
 
 uint32_t BucketMap::bucket(uint64_t unixTime) const {
@@ -259,38 +1389,65 @@ bool BucketMap::setState(BucketMap::State state) {
 
   // If we have to drop a shard, move the data here, then free all the memory
   // outside of any locks, as this can take a long time.
-  std::unordered_map<const char*, int, CaseHash, CaseEq> tmpMap;
+  std::array<FlatKeyTable, kMapStripes> tmpMaps;
+  KeyIndex tmpKeyIndex;
   std::priority_queue<int, std::vector<int>, std::less<int>> tmpQueue;
   std::vector<Item> tmpVec;
   std::vector<std::vector<uint32_t>> tmpDeviations;
 
   std::unique_lock<std::mutex> stateGuard(stateChangeMutex_);
+
+  // The stripes are only needed when dropping the map, but they must be
+  // locked before `lock_`.
+  bool stripesLocked = state == UNOWNED;
+  if (stripesLocked) {
+    lockAllStripes();
+  }
+
   folly::RWSpinLock::WriteHolder guard(lock_);
   if (!isAllowedStateTransition(state_, state)) {
     LOG(WARNING) << "Illegal transition from " << state_ << " to " << state;
+    guard.reset();
+    if (stripesLocked) {
+      unlockAllStripes();
+    }
     return false;
   }
 
   if (state == PRE_OWNED) {
     addTimer_.start();
-    keyWriter_->startShard(shardId_);
-    logWriter_->startShard(shardId_);
-    dataPointQueue_ = std::make_shared<folly::MPMCQueue<QueuedDataPoint>>(
-        FLAGS_data_point_queue_size);
+    if (!follower_) {
+      keyWriter_->startShard(shardId_);
+      logWriter_->startShard(shardId_);
+    }
+    dataPointQueue_ = std::make_shared<DataPointQueue>(
+        FLAGS_data_point_queue_size,
+        FileUtils::joinPaths(
+            dataDirectory_, std::to_string(shardId_), kQueuedDataPointsFile),
+        FLAGS_data_point_queue_spill_bytes);
 
     // Deviations are indexed per minute.
     deviations_.resize(duration(n_) / kGorillaSecondsPerMinute);
   } else if (state == UNOWNED) {
-    tmpMap.swap(map_);
+    std::atomic_store(&keyFilter_, std::shared_ptr<KeyFilter>());
+    for (int i = 0; i < kMapStripes; i++) {
+      tmpMaps[i].swap(stripes_[i].map);
+    }
+    tmpKeyIndex.swap(keyIndex_);
+    lastUpdateTimes_.resetAll();
     tmpQueue.swap(freeList_);
     tmpVec.swap(rows_);
+    std::vector<uint32_t>().swap(scanHashes_);
     tmpDeviations.swap(deviations_);
+    categoryStates_.clear();
     tableSize_ = 0;
 
     // These operations do block, but only to enqueue flags, not drain the
     // queues to disk.
-    keyWriter_->stopShard(shardId_);
-    logWriter_->stopShard(shardId_);
+    if (!follower_) {
+      keyWriter_->stopShard(shardId_);
+      logWriter_->stopShard(shardId_);
+    }
   } else if (state == OWNED) {
     // Calling this won't hurt even if the timer isn't running.
     addTimer_.stop();
@@ -299,13 +1456,26 @@ bool BucketMap::setState(BucketMap::State state) {
   BucketMap::State oldState = state_;
   state_ = state;
   guard.reset();
+  if (stripesLocked) {
+    unlockAllStripes();
+  }
 
   // Enable/disable storage outside the lock because it might take a
   // while and the the storage object has its own locking.
   if (state == PRE_OWNED) {
     storage_.enable();
+    for (auto& rollup : rollups_) {
+      rollup->enable();
+    }
   } else if (state == UNOWNED) {
     storage_.clearAndDisable();
+    for (auto& rollup : rollups_) {
+      rollup->clearAndDisable();
+    }
+
+    // A scan that started while the shard was owned might still be
+    // going through the rows.
+    retireRows(std::move(tmpVec));
   }
 
   LOG(INFO) << "Changed state of shard " << shardId_ << " from " << oldState
@@ -341,6 +1511,7 @@ int BucketMap::finalizeBuckets(uint32_t lastBucketToFinalize) {
   if (getState() != OWNED) {
     return 0;
   }
+  std::lock_guard<std::mutex> finalizeGuard(finalizeMutex_);
 
   // This code assumes that only one thread will be calling this at a
   // time. If this isn't the case anymore, locks need to be added.
@@ -375,10 +1546,35 @@ int BucketMap::finalizeBuckets(uint32_t lastBucketToFinalize) {
       }
     }
 
-    getStorage()->finalizeBucket(bucket);
+    if (FLAGS_drop_erased_blocks) {
+      // `timeSeriesData` still has the rows erased since it was read,
+      // and their rows might have been reused by other time series.
+      std::vector<BucketMap::Item> rows;
+      getEverything(rows);
+      getStorage()->finalizeBucket(
+          bucket, [&](uint32_t id, BucketStorage::BucketStorageId block) {
+            return id < rows.size() && rows[id] &&
+                rows[id]->second.getFinalizedBlock(bucket, n_) == block;
+          });
+    } else {
+      getStorage()->finalizeBucket(bucket);
+    }
+    updateCategoryBytes(bucket, timeSeriesData);
+    if (!rollups_.empty()) {
+      addRollups(bucket, timeSeriesData);
+    }
   }
 
   lastFinalizedBucket_ = lastBucketToFinalize;
+
+  // The streams of the open bucket are stored when it ends.
+  if (FLAGS_prepare_next_bucket) {
+    getStorage()->prepareBucket(lastBucketToFinalize + 1);
+  }
+
+  std::lock_guard<std::mutex> guard(usageSampleMutex_);
+  previousUsageSample_ = lastUsageSample_;
+  lastUsageSample_ = {time(nullptr), pointsAdded_, keysQueried_};
   return bucketsToFinalize;
 }
 
@@ -389,8 +1585,10 @@ bool BucketMap::isBehind(uint32_t bucketToFinalize) const {
 
 void BucketMap::shutdown() {
   if (getState() == OWNED) {
-    logWriter_->stopShard(shardId_);
-    keyWriter_->stopShard(shardId_);
+    if (!follower_) {
+      logWriter_->stopShard(shardId_);
+      keyWriter_->stopShard(shardId_);
+    }
 
     // Set the state directly without calling setState which would try
     // to deallocate memory.
@@ -401,6 +1599,33 @@ void BucketMap::shutdown() {
 }
 
 void BucketMap::compactKeyList() {
+  auto filter = std::atomic_load(&keyFilter_);
+  if (filter && filter->full()) {
+    rebuildKeyFilter();
+  }
+
+  // Followers don't write a key list.
+  if (follower_) {
+    return;
+  }
+
+  if (FLAGS_key_list_compaction_dead_fraction > 0) {
+    int64_t liveKeys;
+    {
+      folly::RWSpinLock::ReadHolder guard(lock_);
+      liveKeys = rows_.size() - freeList_.size();
+    }
+
+    int64_t records = keyListRecords_;
+    int64_t deadRecords = std::max<int64_t>(records - liveKeys, 0);
+    GorillaStatsManager::addStatValue(kDeadKeyListRecords, deadRecords);
+    if (deadRecords < FLAGS_key_list_compaction_dead_fraction * records) {
+      GorillaStatsManager::addStatValue(kSkippedKeyListCompactions);
+      return;
+    }
+  }
+
+  int64_t records = keyListRecords_;
   std::vector<Item> items;
   getEverything(items);
 
@@ -418,50 +1643,328 @@ void BucketMap::compactKeyList() {
     return std::make_tuple<uint32_t, const char*, uint16_t, int32_t>(
         0, nullptr, 0, 0);
   });
+
+  int64_t liveKeys = 0;
+  for (auto& item : items) {
+    if (item.get()) {
+      liveKeys++;
+    }
+  }
+
+  // Keys added during the compaction were written after it started.
+  keyListRecords_ += liveKeys - records;
+  rebuildKeyFilter();
+}
+
+void BucketMap::deleteOldBlockFiles() {
+  // Start far enough back that we can't possibly interfere with anything.
+  storage_.deleteBucketsOlderThan(bucket(time(nullptr)) - n_ - 1);
+  for (auto& rollup : rollups_) {
+    rollup->deleteOldBlockFiles(bucket(time(nullptr)));
+  }
+}
+
+bool BucketMap::writeSnapshot() {
+  // A shard that is about to be dropped is snapshotted when it's
+  // handed over to its next owner.
+  State state = getState();
+  if (follower_ || (state != OWNED && state != PRE_UNOWNED)) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(snapshotMutex_);
+
+  Timer timer(true);
+  int64_t now = time(nullptr);
+  uint32_t openBucket = bucket(now);
+  if (lastFinalizedBucket_ + 1 != openBucket) {
+    // The points of the previous bucket are only in memory and in the
+    // logs until it's finalized.
+    LOG(INFO) << "Not writing a snapshot for shard " << shardId_
+              << " before bucket " << openBucket - 1 << " is finalized";
+    return false;
+  }
+
+  // Entries logged after the new log file is started can't go to the
+  // log files that exist now. The points of the entries logged before
+  // are already in the streams when they are copied below, so the
+  // files don't have to be read when the snapshot is restored.
+  std::vector<int64_t> coveredLogFiles;
+  FileUtils logFiles(shardId_, BucketLogWriter::kLogFilePrefix, dataDirectory_);
+  for (int64_t id : logFiles.ls()) {
+    if (id < now && bucket(id) == openBucket) {
+      coveredLogFiles.push_back(id);
+    }
+  }
+  if (!logWriter_->startNewLogFile(shardId_, now)) {
+    coveredLogFiles.clear();
+  }
+
+  std::vector<Item> items;
+  getEverything(items);
+
+  std::vector<BucketSnapshot::Entry> entries;
+  BucketSnapshot::Entry entry;
+  for (int i = 0; i < items.size(); i++) {
+    uint32_t streamBucket;
+    if (!items[i].get() ||
+        !items[i]->second.getActiveStream(
+            streamBucket, entry.count, entry.state, entry.data)) {
+      continue;
+    }
+
+    if (streamBucket > openBucket) {
+      // The open bucket of this time series was already moved to
+      // BucketStorage and isn't in the snapshot.
+      LOG(WARNING) << "Not writing a snapshot for shard " << shardId_
+                   << " because bucket " << streamBucket << " is open";
+      GorillaStatsManager::addStatValue(kSnapshotFailures);
+      return false;
+    }
+
+    if (streamBucket == openBucket) {
+      entry.timeSeriesId = i;
+      entry.keyHash = hashKey(items[i]->first.c_str());
+      entries.push_back(std::move(entry));
+    }
+  }
+
+  if (!snapshot_.write(now, openBucket, coveredLogFiles, entries)) {
+    GorillaStatsManager::addStatValue(kSnapshotFailures);
+    return false;
+  }
+
+  GorillaStatsManager::addStatValue(kSnapshotStreams, entries.size());
+  GorillaStatsManager::addStatValue(
+      kMsPerSnapshotWrite, timer.get() / kGorillaUsecPerMs);
+  return true;
+}
+
+void BucketMap::startMonitoring() {
+  GorillaStatsManager::addStatExportType(kMsPerKeyListRead, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerLogFilesRead, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerBlockFileRead, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerBlockFileRead, COUNT);
+  GorillaStatsManager::addStatExportType(kBlockFileRequests, SUM);
+  GorillaStatsManager::addStatExportType(kMsPerQueueProcessing, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerLogFileDecode, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerLogFileWait, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerLogFileApply, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerRemoteLogFileRead, AVG);
+  GorillaStatsManager::addStatExportType(kRemoteLogFileFailures, SUM);
+  for (const auto& key :
+       {kMsPerKeyListRead,
+        kMsPerLogFilesRead,
+        kMsPerBlockFileRead,
+        kMsPerQueueProcessing}) {
+    GorillaStatsManager::addPercentileExports(key, 10 * kGorillaMsPerMinute);
+  }
+  GorillaStatsManager::addStatExportType(kDataPointQueueDropped, SUM);
+  GorillaStatsManager::addStatExportType(kDataPointQueueSpilled, SUM);
+  GorillaStatsManager::addStatExportType(kKeyFilterRejections, SUM);
+  GorillaStatsManager::addStatExportType(kKeyFilterBytes, AVG);
+  GorillaStatsManager::addStatExportType(kCorruptLogFiles, SUM);
+  GorillaStatsManager::addStatExportType(kCorruptKeyFiles, SUM);
+  GorillaStatsManager::addStatExportType(kUnknownKeysInLogFiles, SUM);
+  GorillaStatsManager::addStatExportType(kUnknownKeysInBlockMetadataFiles, SUM);
+  GorillaStatsManager::addStatExportType(kDataHoles, SUM);
+  GorillaStatsManager::addStatExportType(kMissingLogs, SUM);
+  GorillaStatsManager::addStatExportType(kMissingLogs, AVG);
+  GorillaStatsManager::addStatExportType(kMissingLogs, COUNT);
+  GorillaStatsManager::addStatExportType(kDeletionRaces, SUM);
+  GorillaStatsManager::addStatExportType(kDuplicateKeys, SUM);
+  GorillaStatsManager::addStatExportType(kSkippedKeyListCompactions, SUM);
+  GorillaStatsManager::addStatExportType(kDeadKeyListRecords, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerSnapshotWrite, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerSnapshotRead, AVG);
+  GorillaStatsManager::addStatExportType(kSnapshotFailures, SUM);
+  GorillaStatsManager::addStatExportType(kSnapshotStreams, AVG);
+  GorillaStatsManager::addStatExportType(kRestoredSnapshotStreams, SUM);
+  GorillaStatsManager::addStatExportType(kRowsCheckedForUpdates, SUM);
+  GorillaStatsManager::addStatExportType(kMsPerRollup, AVG);
+  GorillaStatsManager::addStatExportType(kCategoryPolicyRefusedSeries, SUM);
+  GorillaStatsManager::addStatExportType(kReplicatedKeys, SUM);
+  GorillaStatsManager::addStatExportType(kReplicatedPointsUnknownKeys, SUM);
+}
+
+BucketMap::Item
+BucketMap::getInternal(const std::string& key, State& state, uint32_t& id) {
+  uint64_t hash = hashKey(key.c_str());
+  if (!mayContainKey(std::atomic_load(&keyFilter_).get(), hash)) {
+    keyFilterRejectionsStat.add();
+    state = getState();
+    return nullptr;
+  }
+
+  MapStripe& stripe = getStripe(hash);
+  folly::RWSpinLock::ReadHolder stripeGuard(stripe.lock);
+  folly::RWSpinLock::ReadHolder guard(lock_);
+
+  state = state_;
+  if (state_ >= UNOWNED && state_ <= READING_KEYS) {
+    // Either the state is UNOWNED or keys are being read. In both
+    // cases do not try to find the key.
+    return nullptr;
+  }
+
+  int index = findInStripe(stripe, key.c_str(), hash);
+  if (index >= 0) {
+    id = index;
+    return rows_[id];
+  }
+
+  return nullptr;
+}
+
+uint64_t BucketMap::hashKey(const char* key) {
+  return CaseHash()(key);
+}
+
+uint32_t BucketMap::scanHashKey(const std::string& key) {
+  return CaseHash::hash(key, kScanHashSeed);
+}
+
+int BucketMap::getStripeIndex(uint64_t hash) {
+  static_assert(kMapStripes == 64, "Stripe is picked with the top 6 bits");
+  return hash >> 58;
+}
+
+BucketMap::MapStripe& BucketMap::getStripe(uint64_t hash) {
+  return stripes_[getStripeIndex(hash)];
+}
+
+BucketMap::State BucketMap::findBatch(
+    const std::vector<const char*>& keys,
+    std::vector<int>& ids,
+    std::vector<Item>& items,
+    std::vector<uint64_t>* keyHashes) {
+  ids.assign(keys.size(), -1);
+  items.assign(keys.size(), nullptr);
+
+  std::vector<uint64_t> localHashes;
+  std::vector<uint64_t>& hashes = keyHashes ? *keyHashes : localHashes;
+  hashes.resize(keys.size());
+  std::array<bool, kMapStripes> usedStripes{};
+  std::vector<bool> found(keys.size());
+  auto filter = std::atomic_load(&keyFilter_);
+  int rejected = 0;
+  for (int i = 0; i < keys.size(); i++) {
+    hashes[i] = hashKey(keys[i]);
+    found[i] = mayContainKey(filter.get(), hashes[i]);
+    if (found[i]) {
+      usedStripes[getStripeIndex(hashes[i])] = true;
+    } else {
+      rejected++;
+    }
+  }
+  if (rejected > 0) {
+    keyFilterRejectionsStat.add(rejected);
+  }
+
+  // The stripes are locked in order and before `lock_`, like in
+  // lockAllStripes().
+  for (int i = 0; i < kMapStripes; i++) {
+    if (usedStripes[i]) {
+      stripes_[i].lock.lock_shared();
+    }
+  }
+
+  State state;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    state = state_;
+    if (state_ < UNOWNED || state_ > READING_KEYS) {
+      // Start loading the table slots and then the rows for all the
+      // keys before they are needed.
+      for (int i = 0; i < keys.size(); i++) {
+        if (found[i]) {
+          getStripe(hashes[i]).map.prefetch(hashes[i]);
+        }
+      }
+      for (int i = 0; i < keys.size(); i++) {
+        if (!found[i]) {
+          continue;
+        }
+        ids[i] = findInStripe(getStripe(hashes[i]), keys[i], hashes[i]);
+        if (ids[i] >= 0) {
+          __builtin_prefetch(&rows_[ids[i]]);
+        }
+      }
+      for (int i = 0; i < keys.size(); i++) {
+        if (ids[i] >= 0) {
+          items[i] = rows_[ids[i]];
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < kMapStripes; i++) {
+    if (usedStripes[i]) {
+      stripes_[i].lock.unlock_shared();
+    }
+  }
+  return state;
+}
+
+bool BucketMap::mayContainKey(const KeyFilter* filter, uint64_t hash) const {
+  return !filter || filter->mayContain(hash);
 }
 
-void BucketMap::deleteOldBlockFiles() {
-  // Start far enough back that we can't possibly interfere with anything.
-  storage_.deleteBucketsOlderThan(bucket(time(nullptr)) - n_ - 1);
+void BucketMap::rebuildKeyFilter() {
+  if (!FLAGS_key_filter) {
+    return;
+  }
+
+  std::vector<Item> items;
+  getEverything(items);
+  auto filter = std::make_shared<KeyFilter>(items.size() + items.size() / 2);
+  for (auto& item : items) {
+    if (item) {
+      filter->add(hashKey(item->first.c_str()));
+    }
+  }
+
+  {
+    folly::RWSpinLock::WriteHolder guard(lock_);
+    if (state_ >= UNOWNED && state_ <= READING_KEYS) {
+      return;
+    }
+    std::atomic_store(&keyFilter_, filter);
+  }
+
+  // Keys added before the new filter was in place only went to the
+  // old one.
+  std::vector<Item> newItems;
+  getEverything(newItems);
+  for (int i = 0; i < newItems.size(); i++) {
+    if (newItems[i] && (i >= items.size() || newItems[i] != items[i])) {
+      filter->add(hashKey(newItems[i]->first.c_str()));
+    }
+  }
+  GorillaStatsManager::addStatValue(kKeyFilterBytes, filter->sizeInBytes());
 }
 
-void BucketMap::startMonitoring() {
-  GorillaStatsManager::addStatExportType(kMsPerKeyListRead, AVG);
-  GorillaStatsManager::addStatExportType(kMsPerLogFilesRead, AVG);
-  GorillaStatsManager::addStatExportType(kMsPerBlockFileRead, AVG);
-  GorillaStatsManager::addStatExportType(kMsPerBlockFileRead, COUNT);
-  GorillaStatsManager::addStatExportType(kMsPerQueueProcessing, AVG);
-  GorillaStatsManager::addStatExportType(kDataPointQueueDropped, SUM);
-  GorillaStatsManager::addStatExportType(kCorruptLogFiles, SUM);
-  GorillaStatsManager::addStatExportType(kCorruptKeyFiles, SUM);
-  GorillaStatsManager::addStatExportType(kUnknownKeysInLogFiles, SUM);
-  GorillaStatsManager::addStatExportType(kUnknownKeysInBlockMetadataFiles, SUM);
-  GorillaStatsManager::addStatExportType(kDataHoles, SUM);
-  GorillaStatsManager::addStatExportType(kMissingLogs, SUM);
-  GorillaStatsManager::addStatExportType(kMissingLogs, AVG);
-  GorillaStatsManager::addStatExportType(kMissingLogs, COUNT);
-  GorillaStatsManager::addStatExportType(kDeletionRaces, SUM);
-  GorillaStatsManager::addStatExportType(kDuplicateKeys, SUM);
+int BucketMap::findInStripe(
+    const MapStripe& stripe,
+    const char* key,
+    uint64_t hash) const {
+  return stripe.map.find(
+      key,
+      (uint32_t)hash,
+      [this](int id) { return rows_[id]->first.c_str(); },
+      CaseEq());
 }
 
-BucketMap::Item
-BucketMap::getInternal(const std::string& key, State& state, uint32_t& id) {
-  folly::RWSpinLock::ReadHolder guard(lock_);
-
-  state = state_;
-  if (state_ >= UNOWNED && state_ <= READING_KEYS) {
-    // Either the state is UNOWNED or keys are being read. In both
-    // cases do not try to find the key.
-    return nullptr;
+void BucketMap::lockAllStripes() {
+  for (auto& stripe : stripes_) {
+    stripe.lock.lock();
   }
+}
 
-  const auto& it = map_.find(key.c_str());
-  if (it != map_.end()) {
-    id = it->second;
-    return rows_[id];
+void BucketMap::unlockAllStripes() {
+  for (auto& stripe : stripes_) {
+    stripe.lock.unlock();
   }
-
-  return nullptr;
 }
 
 void BucketMap::readData() {
@@ -474,15 +1977,26 @@ void BucketMap::readData() {
   {
     std::unique_lock<std::mutex> guard(unreadBlockFilesMutex_);
     unreadBlockFiles_ = reader.findCompletedBlockFiles();
+    requestedBlockFiles_.clear();
     if (unreadBlockFiles_.size() > 0) {
       checkForMissingBlockFiles();
       lastFinalizedBucket_ = *unreadBlockFiles_.rbegin();
     }
   }
 
-  readLogFiles(lastFinalizedBucket_);
-  GorillaStatsManager::addStatValue(
-      kMsPerLogFilesRead, timer.reset() / kGorillaUsecPerMs);
+  // The rollups are small, so they are all read before the logs.
+  for (auto& rollup : rollups_) {
+    rollup->readBlockFiles();
+  }
+
+  int64_t snapshotTime = 0;
+  std::set<int64_t> coveredLogFiles;
+  readSnapshot(lastFinalizedBucket_, snapshotTime, coveredLogFiles);
+  int64_t snapshotMs = timer.reset() / kGorillaUsecPerMs;
+
+  readLogFiles(lastFinalizedBucket_, snapshotTime, coveredLogFiles);
+  int64_t logsMs = timer.reset() / kGorillaUsecPerMs;
+  GorillaStatsManager::addStatValue(kMsPerLogFilesRead, logsMs);
   CHECK(getState() == READING_LOGS);
 
   success = setState(PROCESSING_QUEUED_DATA_POINTS);
@@ -502,18 +2016,27 @@ void BucketMap::readData() {
   // the queue after it was emptied and before the state was set to
   // READING_BLOCK_DATA.
   processQueuedDataPoints(false);
-  GorillaStatsManager::addStatValue(
-      kMsPerQueueProcessing, timer.reset() / kGorillaUsecPerMs);
+  int64_t queueMs = timer.reset() / kGorillaUsecPerMs;
+  GorillaStatsManager::addStatValue(kMsPerQueueProcessing, queueMs);
+  LOG(INFO) << "Read data for shard " << shardId_ << ": snapshot "
+            << snapshotMs << " ms, logs " << logsMs
+            << " ms, queued data points " << queueMs << " ms";
 
   // Take a copy of the shared pointer to avoid freeing the memory
   // while holding the write lock. Not the most elegant solution but it
   // guarantees that freeing memory won't block anything else.
-  std::shared_ptr<folly::MPMCQueue<QueuedDataPoint>> copy;
+  std::shared_ptr<DataPointQueue> copy;
   {
     folly::RWSpinLock::WriteHolder guard(lock_);
     copy = dataPointQueue_;
     dataPointQueue_.reset();
   }
+  if (copy && copy->spilledPoints() > 0) {
+    LOG(INFO) << "Spilled " << copy->spilledPoints()
+              << " queued data points to disk for shard " << shardId_;
+    GorillaStatsManager::addStatValue(
+        kDataPointQueueSpilled, copy->spilledPoints());
+  }
 
   // Probably not needed because this object will fall out of scope,
   // but I am afraid of compiler optimizations that might end up
@@ -526,16 +2049,81 @@ bool BucketMap::readBlockFiles() {
   {
     std::unique_lock<std::mutex> guard(unreadBlockFilesMutex_);
     if (unreadBlockFiles_.empty()) {
-      bool success = setState(OWNED);
-      CHECK(success);
+      // The last requested block file might still be being read, in
+      // which case the shard is owned once that's done.
+      if (readingBlockFiles_.empty() && getState() != OWNED) {
+        bool success = setState(OWNED);
+        CHECK(success);
+      }
       // Done reading block files.
       return false;
     }
 
-    position = *unreadBlockFiles_.rbegin();
-    unreadBlockFiles_.erase(position);
+    // Block files that queries are waiting for go first. Otherwise
+    // the newest one is read.
+    auto& next =
+        requestedBlockFiles_.empty() ? unreadBlockFiles_ : requestedBlockFiles_;
+    position = *next.rbegin();
+    startReadingBlockFile(position);
+  }
+
+  readBlockFile(position);
+  return true;
+}
+
+bool BucketMap::readRequestedBlockFiles() {
+  uint32_t position;
+  {
+    std::unique_lock<std::mutex> guard(unreadBlockFilesMutex_);
+    if (requestedBlockFiles_.empty()) {
+      return false;
+    }
+
+    position = *requestedBlockFiles_.rbegin();
+    startReadingBlockFile(position);
+  }
+
+  readBlockFile(position);
+
+  std::unique_lock<std::mutex> guard(unreadBlockFilesMutex_);
+  return !requestedBlockFiles_.empty();
+}
+
+int BucketMap::requestBlockFiles(uint32_t begin, uint32_t end) {
+  std::unique_lock<std::mutex> guard(unreadBlockFilesMutex_);
+  int unread = 0;
+  for (auto it = unreadBlockFiles_.lower_bound(begin);
+       it != unreadBlockFiles_.end() && *it <= end;
+       it++) {
+    requestedBlockFiles_.insert(*it);
+    unread++;
+  }
+  for (auto it = readingBlockFiles_.lower_bound(begin);
+       it != readingBlockFiles_.end() && *it <= end;
+       it++) {
+    unread++;
+  }
+
+  if (unread > 0) {
+    GorillaStatsManager::addStatValue(kBlockFileRequests);
   }
+  return unread;
+}
+
+void BucketMap::startReadingBlockFile(uint32_t position) {
+  unreadBlockFiles_.erase(position);
+  requestedBlockFiles_.erase(position);
+  readingBlockFiles_.insert(position);
+
+  // Read the next file from disk while this one is being decoded.
+  if (!requestedBlockFiles_.empty()) {
+    storage_.prefetchPosition(*requestedBlockFiles_.rbegin());
+  } else if (!unreadBlockFiles_.empty()) {
+    storage_.prefetchPosition(*unreadBlockFiles_.rbegin());
+  }
+}
 
+void BucketMap::readBlockFile(uint32_t position) {
   std::vector<uint32_t> timeSeriesIds;
   std::vector<uint64_t> storageIds;
 
@@ -564,7 +2152,15 @@ bool BucketMap::readBlockFiles() {
                << position << ". Already loaded?";
   }
 
-  return true;
+  std::unique_lock<std::mutex> guard(unreadBlockFilesMutex_);
+  readingBlockFiles_.erase(position);
+  if (unreadBlockFiles_.empty() && readingBlockFiles_.empty() &&
+      getState() == READING_BLOCK_DATA) {
+    // readBlockFiles() already returned false while this file was
+    // being read.
+    bool success = setState(OWNED);
+    CHECK(success);
+  }
 }
 
 void BucketMap::readKeyList() {
@@ -574,14 +2170,24 @@ void BucketMap::readKeyList() {
   bool success = setState(READING_KEYS);
   CHECK(success) << "Setting state failed";
 
-  // No reason to lock because nothing is touching the rows_ or map_
+  // No reason to lock because nothing is touching the rows_ or stripes_
   // while this is running.
+  keyListRecords_ = 0;
 
   // Read all the keys from disk into the vector.
-  PersistentKeyList::readKeys(
+  PersistentKeyList::readKeysInline(
       shardId_,
       dataDirectory_,
       [&](uint32_t id, const char* key, uint16_t category, int32_t timestamp) {
+        keyListRecords_++;
+        if (key == nullptr) {
+          // The key was deleted after it was written.
+          if (id < rows_.size()) {
+            rows_[id].reset();
+          }
+          return true;
+        }
+
         if (strlen(key) >= kMaxAllowedKeyLength) {
           LOG(ERROR) << "Key too long. Key file is corrupt for shard "
                      << shardId_;
@@ -609,29 +2215,47 @@ void BucketMap::readKeyList() {
         rows_[id].reset(new std::pair<std::string, BucketedTimeSeries>());
         rows_[id]->first = key;
         rows_[id]->second.reset(
-            n_, (timestamp > 0 ? bucket(timestamp) : 0), timestamp);
-        rows_[id]->second.setCategory(category);
+            n_, (timestamp > 0 ? bucket(timestamp) : 0), timestamp, category);
         return true;
       });
 
   tableSize_ = rows_.size();
-  map_.reserve(rows_.size());
+  for (auto& stripe : stripes_) {
+    stripe.map.reserve(rows_.size() / kMapStripes);
+  }
+  scanHashes_.resize(rows_.size());
+
+  std::shared_ptr<KeyFilter> filter;
+  if (FLAGS_key_filter) {
+    filter = std::make_shared<KeyFilter>(rows_.size() + rows_.size() / 2);
+  }
 
   // Put all the rows in either the map or the free list.
   for (int i = 0; i < rows_.size(); i++) {
     if (rows_[i].get()) {
-      auto result = map_.insert({rows_[i]->first.c_str(), i});
+      const char* key = rows_[i]->first.c_str();
+      uint64_t hash = hashKey(key);
+      MapStripe& stripe = getStripe(hash);
+      if (filter) {
+        filter->add(hash);
+      }
 
       // Ignore keys that already exist.
-      if (!result.second) {
+      if (findInStripe(stripe, key, hash) >= 0) {
         GorillaStatsManager::addStatValue(kDuplicateKeys);
         rows_[i].reset();
         freeList_.push(i);
+      } else {
+        stripe.map.insert((uint32_t)hash, i);
+        countCategorySeries(rows_[i]->second.getCategory(), 1);
+        scanHashes_[i] = scanHashKey(rows_[i]->first);
       }
     } else {
       freeList_.push(i);
     }
   }
+  keyIndex_.insertBatch(rows_);
+  std::atomic_store(&keyFilter_, filter);
 
   LOG(INFO) << "Done reading keys for shard " << shardId_;
   GorillaStatsManager::addStatValue(
@@ -640,22 +2264,74 @@ void BucketMap::readKeyList() {
   CHECK(success) << "Setting state failed";
 }
 
-void BucketMap::readLogFiles(uint32_t lastBlock) {
+void BucketMap::readSnapshot(
+    uint32_t lastBlock,
+    int64_t& snapshotTime,
+    std::set<int64_t>& coveredLogFiles) {
+  Timer timer(true);
+  int64_t id;
+  uint32_t snapshotBucket;
+  std::vector<int64_t> logFiles;
+  std::vector<BucketSnapshot::Entry> entries;
+  if (!snapshot_.readLatest(id, snapshotBucket, logFiles, entries)) {
+    return;
+  }
+
+  // The snapshot can only be used if all the older buckets are in
+  // block files.
+  if (lastBlock == 0 || snapshotBucket != lastBlock + 1) {
+    LOG(INFO) << "Ignoring snapshot " << id << " of bucket " << snapshotBucket
+              << " for shard " << shardId_;
+    return;
+  }
+
+  int restored = 0;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    for (const auto& entry : entries) {
+      // Skip time series that were deleted or whose id was reused
+      // after the snapshot. Their points in the open bucket are
+      // dropped when the logs are read anyway.
+      uint32_t i = entry.timeSeriesId;
+      if (i < rows_.size() && rows_[i].get() &&
+          hashKey(rows_[i]->first.c_str()) == entry.keyHash &&
+          rows_[i]->second.setActiveStream(
+              snapshotBucket, entry.count, entry.state, entry.data)) {
+        restored++;
+      }
+    }
+  }
+
+  snapshotTime = id;
+  coveredLogFiles.insert(logFiles.begin(), logFiles.end());
+  LOG(INFO) << "Restored " << restored << " of " << entries.size()
+            << " streams from snapshot " << id << " for shard " << shardId_;
+  GorillaStatsManager::addStatValue(kRestoredSnapshotStreams, restored);
+  GorillaStatsManager::addStatValue(
+      kMsPerSnapshotRead, timer.get() / kGorillaUsecPerMs);
+}
+
+void BucketMap::readLogFiles(
+    uint32_t lastBlock,
+    int64_t snapshotTime,
+    const std::set<int64_t>& coveredLogFiles) {
   LOG(INFO) << "Reading logs for shard " << shardId_;
-  auto ingestData = [this](
+  std::vector<IdPoint> points;
+  auto ingestData = [this, &points](
                         uint32_t key,
                         int64_t unixTime,
                         double value,
+                        int16_t ms,
                         uint32_t& unknownKeys,
                         int64_t& lastTimestamp) {
-    folly::RWSpinLock::ReadHolder guard(lock_);
-    if (key < rows_.size() && rows_[key].get()) {
-      TimeValuePair tv;
-      tv.unixTime = unixTime;
-      tv.value = value;
-      rows_[key]->second.put(bucket(unixTime), tv, &storage_, key, nullptr);
-    } else {
-      unknownKeys++;
+    points.emplace_back();
+    points.back().id = key;
+    points.back().category = 0;
+    points.back().value.unixTime = unixTime;
+    points.back().value.value = value;
+    points.back().value.ms = ms;
+    if (points.size() >= kPointsPerPutBatch) {
+      putDataPointsWithIds(points, true, unknownKeys);
     }
 
     int64_t gap = unixTime - lastTimestamp;
@@ -671,10 +2347,15 @@ void BucketMap::readLogFiles(uint32_t lastBlock) {
   };
 
   uint32_t unknownKeys = 0;
-  int64_t lastTimestamp = timestamp(lastBlock + 1);
+  int64_t lastTimestamp =
+      std::max<int64_t>(timestamp(lastBlock + 1), snapshotTime);
   auto logReader = logReaderFactory_->getLogReader(
       shardId_, windowSize_, std::move(ingestData));
+  if (!coveredLogFiles.empty()) {
+    logReader->skipFiles(coveredLogFiles);
+  }
   logReader->readLog(lastBlock, lastTimestamp, unknownKeys);
+  putDataPointsWithIds(points, true, unknownKeys);
 
   int64_t now = time(nullptr);
   int64_t gap = now - lastTimestamp;
@@ -703,6 +2384,7 @@ void BucketMap::queueDataPointWithKey(
   QueuedDataPoint dp;
   dp.key = key;
   dp.unixTime = value.unixTime;
+  dp.ms = value.ms;
   dp.value = value.value;
   dp.category = category;
 
@@ -718,6 +2400,7 @@ void BucketMap::queueDataPointWithId(
   // Leave key string empty to indicate that timeSeriesId is used.
   dp.timeSeriesId = id;
   dp.unixTime = value.unixTime;
+  dp.ms = value.ms;
   dp.value = value.value;
   dp.category = category;
 
@@ -725,7 +2408,7 @@ void BucketMap::queueDataPointWithId(
 }
 
 void BucketMap::queueDataPoint(QueuedDataPoint& dp) {
-  std::shared_ptr<folly::MPMCQueue<QueuedDataPoint>> queue;
+  std::shared_ptr<DataPointQueue> queue;
   {
     folly::RWSpinLock::ReadHolder guard(lock_);
     queue = dataPointQueue_;
@@ -745,7 +2428,7 @@ void BucketMap::queueDataPoint(QueuedDataPoint& dp) {
 }
 
 void BucketMap::processQueuedDataPoints(bool skipStateCheck) {
-  std::shared_ptr<folly::MPMCQueue<QueuedDataPoint>> queue;
+  std::shared_ptr<DataPointQueue> queue;
 
   {
     // Take a copy of the shared pointer for the queue. Even if this
@@ -760,53 +2443,326 @@ void BucketMap::processQueuedDataPoints(bool skipStateCheck) {
     return;
   }
 
+  std::vector<IdPoint> points;
+  auto putPoints = [&]() {
+    if (points.empty()) {
+      return;
+    }
+
+    State state;
+    {
+      folly::RWSpinLock::ReadHolder guard(lock_);
+      state = state_;
+    }
+
+    if (!skipStateCheck && state != OWNED && state != PRE_UNOWNED) {
+      // Extremely rare corner case. We just set the state to owned
+      // and the queue should be really tiny or empty but still
+      // state was changed.
+      points.clear();
+      return;
+    }
+
+    uint32_t unknownKeys = 0;
+    putDataPointsWithIds(points, false, unknownKeys);
+  };
+
   QueuedDataPoint dp;
   while (queue->read(dp)) {
     TimeValuePair value;
     value.unixTime = dp.unixTime;
+    value.ms = dp.ms;
     value.value = dp.value;
 
     if (dp.key.length() == 0) {
-      // Time series id is known. It's possbible to take a few
-      // shortcuts to make adding the data point faster.
-
-      Item item;
-      State state;
-      {
-        folly::RWSpinLock::ReadHolder guard(lock_);
-        CHECK(dp.timeSeriesId < rows_.size());
-        item = rows_[dp.timeSeriesId];
-        state = state_;
-      }
-
-      if (!skipStateCheck && state != OWNED && state != PRE_UNOWNED) {
-        // Extremely rare corner case. We just set the state to owned
-        // and the queue should be really tiny or empty but still
-        // state was changed.
-        continue;
+      // Time series id is known. It's possible to take a few
+      // shortcuts and put the points of each time series at once.
+      points.push_back({dp.timeSeriesId, dp.category, value});
+      if (points.size() >= kPointsPerPutBatch) {
+        putPoints();
       }
-
-      putDataPointWithId(&item->second, dp.timeSeriesId, value, dp.category);
     } else {
-      // Run these through the normal workflow.
+      // Run these through the normal workflow, after the points that
+      // were queued before them.
+      putPoints();
       put(dp.key, value, dp.category, skipStateCheck);
     }
   }
+  putPoints();
+}
+
+uint32_t BucketMap::putDataPointsWithIds(
+    std::vector<IdPoint>& points,
+    bool replay,
+    uint32_t& unknownKeys) {
+  std::stable_sort(
+      points.begin(), points.end(), [](const IdPoint& a, const IdPoint& b) {
+        return a.id < b.id;
+      });
+
+  std::vector<TimeValuePair> values;
+  std::vector<uint32_t> buckets;
+  std::vector<bool> added;
+  std::vector<BucketLogWriterIf::LogEntry> logEntries;
+  uint32_t count = 0;
+  size_t end;
+  for (size_t begin = 0; begin < points.size(); begin = end) {
+    uint32_t id = points[begin].id;
+    uint16_t category = points[begin].category;
+    for (end = begin + 1; end < points.size() && points[end].id == id &&
+         (replay || points[end].category == category);
+         end++) {
+    }
+
+    Item item;
+    {
+      folly::RWSpinLock::ReadHolder guard(lock_);
+      if (id < rows_.size()) {
+        item = rows_[id];
+      }
+    }
+    if (!item) {
+      unknownKeys += end - begin;
+      continue;
+    }
+
+    values.clear();
+    buckets.clear();
+    for (size_t i = begin; i < end; i++) {
+      values.push_back(points[i].value);
+      buckets.push_back(bucket(points[i].value.unixTime));
+    }
+    count += item->second.putMany(
+        values, buckets, &storage_, id, replay ? nullptr : &category, added);
+
+    for (size_t i = 0; i < values.size(); i++) {
+      if (replay) {
+        lastUpdateTimes_.update(id, values[i].unixTime);
+        continue;
+      }
+      if (!added[i]) {
+        continue;
+      }
+      lastUpdateTimes_.update(id, values[i].unixTime);
+      logEntries.push_back(
+          {(int32_t)id, values[i].unixTime, values[i].value, values[i].ms});
+      if (subscriptions_) {
+        subscriptions_->publish(shardId_, item->first, values[i], category);
+      }
+    }
+  }
+
+  if (!logEntries.empty()) {
+    logWriter_->logDataBatch(shardId_, logEntries);
+    if (replicator_) {
+      replicator_->addPoints(shardId_, logEntries);
+    }
+  }
+  points.clear();
+  return count;
 }
 
 bool BucketMap::putDataPointWithId(
-    BucketedTimeSeries* timeSeries,
+    Row* row,
     uint32_t timeSeriesId,
     const TimeValuePair& value,
     uint16_t category) {
   uint32_t b = bucket(value.unixTime);
-  bool added = timeSeries->put(b, value, &storage_, timeSeriesId, &category);
+  bool added = row->second.put(b, value, &storage_, timeSeriesId, &category);
   if (added) {
-    logWriter_->logData(shardId_, timeSeriesId, value.unixTime, value.value);
+    lastUpdateTimes_.update(timeSeriesId, value.unixTime);
+    logWriter_->logData(
+        shardId_, timeSeriesId, value.unixTime, value.value, value.ms);
+    if (replicator_) {
+      replicator_->addPoint(
+          shardId_, timeSeriesId, value.unixTime, value.value, value.ms);
+    }
+    if (subscriptions_) {
+      subscriptions_->publish(shardId_, row->first, value, category);
+    }
   }
   return added;
 }
 
+void BucketMap::addRollups(
+    uint32_t bucket,
+    const std::vector<Item>& timeSeriesData) {
+  Timer timer(true);
+  for (int i = 0; i < timeSeriesData.size(); i++) {
+    if (!timeSeriesData[i].get()) {
+      continue;
+    }
+
+    // The points are decoded once for all the tiers.
+    BucketedTimeSeries::Output blocks;
+    timeSeriesData[i]->second.get(bucket, bucket, blocks, getStorage());
+    std::vector<TimeValuePair> points;
+    TimeSeries::getValues(
+        blocks, points, timestamp(bucket), timestamp(bucket + 1) - 1);
+    for (auto& rollup : rollups_) {
+      rollup->add(i, bucket, points);
+    }
+  }
+
+  for (auto& rollup : rollups_) {
+    rollup->finalizeBucket(bucket);
+  }
+  GorillaStatsManager::addStatValue(
+      kMsPerRollup, timer.get() / kGorillaUsecPerMs);
+}
+
+int BucketMap::pickRollup(int64_t begin, int64_t step, AggregationType type) {
+  if (type == AggregationType::LAST) {
+    return -1;
+  }
+
+  for (int i = rollups_.size() - 1; i >= 0; i--) {
+    auto& rollup = rollups_[i];
+    uint32_t newest = rollup->getNewestPosition();
+    if (newest > 0 && step % rollup->getResolution() == 0 &&
+        begin % rollup->getResolution() == 0 &&
+        begin >= (int64_t)timestamp(rollup->getOldestPosition())) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void BucketMap::getRollups(
+    int tier,
+    const std::vector<Key>& keys,
+    const std::vector<uint32_t>& indexes,
+    int64_t begin,
+    int64_t end,
+    int64_t step,
+    AggregationType type,
+    std::vector<std::vector<double>>& windows) {
+  windows.clear();
+  windows.resize(indexes.size());
+  std::vector<const char*> keyStrings(indexes.size());
+  for (int i = 0; i < indexes.size(); i++) {
+    keyStrings[i] = keys[indexes[i]].key.c_str();
+  }
+  std::vector<int> ids;
+  std::vector<Item> items;
+  findBatch(keyStrings, ids, items);
+
+  RollupStorage* rollup = rollups_[tier].get();
+  size_t numSteps = (end - begin) / step + 1;
+  for (int i = 0; i < items.size(); i++) {
+    if (!items[i]) {
+      continue;
+    }
+
+    std::vector<RollupStorage::Window> steps;
+    for (size_t j = 0; j < numSteps; j++) {
+      steps.push_back(RollupStorage::emptyWindow(begin + j * step));
+    }
+
+    // Summaries from before the row was created are of another key.
+    uint32_t first =
+        std::max(bucket(begin), items[i]->second.getMinBucket());
+    uint32_t last = bucket(end);
+    uint32_t rolledUp = rollup->getNewestPosition();
+    if (first <= std::min(last, rolledUp)) {
+      std::vector<RollupStorage::Window> summaries;
+      rollup->get(ids[i], first, std::min(last, rolledUp), summaries);
+      for (const auto& summary : summaries) {
+        if (summary.unixTime >= begin && summary.unixTime <= end) {
+          RollupStorage::merge(
+              summary, steps[(summary.unixTime - begin) / step]);
+        }
+      }
+    }
+
+    if (last > rolledUp) {
+      BucketedTimeSeries::Output blocks;
+      items[i]->second.get(
+          std::max(first, rolledUp + 1), last, blocks, getStorage());
+      std::vector<TimeValuePair> points;
+      TimeSeries::getValues(blocks, points, begin, end);
+      for (const auto& point : points) {
+        RollupStorage::Window& window = steps[(point.unixTime - begin) / step];
+        RollupStorage::merge(
+            RollupStorage::Window{
+                point.unixTime, point.value, point.value, point.value, 1},
+            window);
+      }
+    }
+
+    windows[i].reserve(numSteps);
+    for (const auto& window : steps) {
+      windows[i].push_back(RollupStorage::value(window, type));
+    }
+  }
+}
+
+int BucketMap::getArchived(
+    const std::vector<Key>& keys,
+    const std::vector<uint32_t>& indexes,
+    uint32_t begin,
+    uint32_t end,
+    const std::vector<BucketedTimeSeries::Output*>& outs) {
+  // The oldest bucket in memory is `n_` buckets before the current one.
+  uint32_t current = bucket(time(nullptr));
+  if (current <= n_ || FLAGS_block_file_store_query_buckets <= 0) {
+    return 0;
+  }
+  uint32_t newest = current - n_ - 1;
+  uint32_t oldest = newest >= FLAGS_block_file_store_query_buckets
+      ? newest - FLAGS_block_file_store_query_buckets + 1
+      : 0;
+  begin = std::max(begin, oldest);
+  end = std::min(end, newest);
+  if (begin > end) {
+    return 0;
+  }
+
+  BlockFileArchive* archive;
+  {
+    std::lock_guard<std::mutex> guard(archiveMutex_);
+    if (!archive_) {
+      auto store = BlockFileStore::getInstance();
+      if (!store) {
+        return 0;
+      }
+      archive_.reset(new BlockFileArchive(
+          shardId_,
+          store,
+          FileUtils::joinPaths(dataDirectory_, kArchiveDirectory),
+          FLAGS_block_file_store_cached_buckets));
+    }
+    archive = archive_.get();
+  }
+
+  std::vector<const char*> keyStrings(indexes.size());
+  for (int i = 0; i < indexes.size(); i++) {
+    keyStrings[i] = keys[indexes[i]].key.c_str();
+  }
+  std::vector<int> ids;
+  std::vector<Item> items;
+  findBatch(keyStrings, ids, items);
+
+  int found = 0;
+  for (uint32_t position = begin; position <= end; position++) {
+    // Blocks from before the row was created are of another key.
+    std::vector<uint32_t> timeSeriesIds;
+    std::vector<BucketedTimeSeries::Output*> keyOuts;
+    for (int i = 0; i < items.size(); i++) {
+      if (items[i] && items[i]->second.getMinBucket() <= position) {
+        timeSeriesIds.push_back(ids[i]);
+        keyOuts.push_back(outs[i]);
+      }
+    }
+
+    if (!timeSeriesIds.empty() &&
+        archive->get(position, timeSeriesIds, keyOuts)) {
+      found++;
+    }
+  }
+  return found;
+}
+
 int64_t BucketMap::getReliableDataStartTime() {
   return reliableDataStartTime_;
 }
@@ -858,62 +2814,133 @@ int BucketMap::indexDeviatingTimeSeries(
   uint32_t begin = bucket(deviationStartTime);
   uint32_t end = bucket(endTime);
 
-  std::vector<Item> timeSeriesData;
-  getEverything(timeSeriesData);
+  int numRows;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    numRows = rows_.size();
+  }
+
+  // Each worker reads a range of the rows and finds its deviations on
+  // its own. The ranges are in order, so appending the lists of the
+  // workers in order keeps the ids sorted.
+  int threads = std::max(1, std::min(FLAGS_deviation_index_threads, numRows));
+  int rowsPerThread = (numRows + threads - 1) / threads;
 
   // Low estimate for the number of time series that have a deviation
   // to avoid constant reallocation.
-  int initialSize = timeSeriesData.size() / pow(10, minimumSigma);
-  std::vector<std::vector<uint32_t>> deviations(totalMinutes);
-  for (int i = indexingStartTime; i <= endTime; i += kGorillaSecondsPerMinute) {
-    deviations[i / kGorillaSecondsPerMinute % totalMinutes].reserve(
-        initialSize);
-  }
-
-  for (int i = 0; i < timeSeriesData.size(); i++) {
-    auto& timeSeries = timeSeriesData[i];
-    if (!timeSeries.get()) {
-      continue;
+  int initialSize = rowsPerThread / pow(10, minimumSigma);
+
+  auto indexRows = [&](int first, int last) {
+    std::vector<std::vector<uint32_t>> deviations(totalMinutes);
+    for (int i = indexingStartTime; i <= endTime;
+         i += kGorillaSecondsPerMinute) {
+      deviations[i / kGorillaSecondsPerMinute % totalMinutes].reserve(
+          initialSize);
     }
 
+    // Reused for all the time series.
+    std::vector<Item> rows;
     std::vector<TimeSeriesBlock> out;
-    timeSeries->second.get(begin, end, out, getStorage());
-    std::vector<TimeValuePair> values;
-    for (auto& block : out) {
-      TimeSeries::getValues(block, values, deviationStartTime, endTime);
-    }
+    std::vector<int64_t> timestamps;
+    std::vector<double> values;
 
-    if (values.size() == 0) {
-      continue;
-    }
+    for (int offset = first; offset < last; offset += kDeviationRowsAtATime) {
+      rows.clear();
+      getSome(rows, offset, std::min(kDeviationRowsAtATime, last - offset));
 
-    // Calculate the mean and standard deviation.
-    double sum = 0;
-    for (auto& v : values) {
-      sum += v.value;
-    }
+      for (int j = 0; j < rows.size(); j++) {
+        auto& timeSeries = rows[j];
+        if (!timeSeries.get()) {
+          continue;
+        }
 
-    double avg = sum / values.size();
-    double variance = 0.0;
-    for (auto& value : values) {
-      variance += (value.value - avg) * (value.value - avg);
-    }
-    variance /= values.size();
+        // With running stats, only the blocks with values to index
+        // are read.
+        BucketedTimeSeries::Stats stats;
+        bool useStats = FLAGS_gorilla_running_stats &&
+            timeSeries->second.getStats(begin, end, getStorage(), stats);
+
+        out.clear();
+        timeSeries->second.get(
+            useStats ? bucket(indexingStartTime) : begin,
+            end,
+            out,
+            getStorage());
+        size_t count = 0;
+        for (auto& block : out) {
+          count += block.count;
+        }
+        if (timestamps.size() < count) {
+          timestamps.resize(count);
+          values.resize(count);
+        }
 
-    if (variance == 0) {
-      continue;
-    }
+        int n = TimeSeries::getValues(
+            out,
+            timestamps.data(),
+            values.data(),
+            useStats ? indexingStartTime : deviationStartTime,
+            endTime);
+        if (n == 0) {
+          continue;
+        }
+
+        double avg;
+        double variance;
+        if (useStats) {
+          avg = stats.mean;
+          variance = stats.variance;
+        } else {
+          // Calculate the mean and standard deviation in one pass. The
+          // values are shifted by the first one so that the sum of
+          // squares doesn't lose the precision of a large mean.
+          double shift = values[0];
+          double sum = 0;
+          double sumOfSquares = 0;
+          for (int k = 0; k < n; k++) {
+            double delta = values[k] - shift;
+            sum += delta;
+            sumOfSquares += delta * delta;
+          }
+
+          double mean = sum / n;
+          avg = shift + mean;
+          variance = sumOfSquares / n - mean * mean;
+        }
+
+        if (variance <= 0) {
+          continue;
+        }
 
-    // Index values that are over the limit.
-    double stddev = sqrt(variance);
-    double limit = minimumSigma * stddev;
-    for (auto& v : values) {
-      if (v.unixTime >= indexingStartTime && v.unixTime <= endTime &&
-          fabs(v.value - avg) >= limit) {
-        uint32_t time = (v.unixTime / kGorillaSecondsPerMinute) % totalMinutes;
-        deviations[time].push_back(i);
+        // Index values that are over the limit.
+        double limit = minimumSigma * sqrt(variance);
+        for (int k = 0; k < n; k++) {
+          if (timestamps[k] >= indexingStartTime && timestamps[k] <= endTime &&
+              fabs(values[k] - avg) >= limit) {
+            uint32_t time =
+                (timestamps[k] / kGorillaSecondsPerMinute) % totalMinutes;
+            deviations[time].push_back(offset + j);
+          }
+        }
       }
     }
+
+    return deviations;
+  };
+
+  std::vector<std::future<std::vector<std::vector<uint32_t>>>> workers;
+  for (int i = 1; i < threads; i++) {
+    int first = i * rowsPerThread;
+    int last = std::min(numRows, first + rowsPerThread);
+    workers.push_back(std::async(std::launch::async, indexRows, first, last));
+  }
+
+  auto deviations = indexRows(0, std::min(numRows, rowsPerThread));
+  for (auto& worker : workers) {
+    auto more = worker.get();
+    for (int i = 0; i < totalMinutes; i++) {
+      deviations[i].insert(deviations[i].end(), more[i].begin(), more[i].end());
+    }
   }
 
   folly::RWSpinLock::WriteHolder guard(lock_);
@@ -956,5 +2983,96 @@ std::vector<BucketMap::Item> BucketMap::getDeviatingTimeSeries(
   return deviations;
 }
 
+std::vector<BucketMap::Deviation> BucketMap::getDeviatingTimeSeries(
+    uint32_t begin,
+    uint32_t end) {
+  std::vector<Deviation> deviations;
+  if (getState() != OWNED || begin > end) {
+    return deviations;
+  }
+
+  uint32_t totalMinutes = duration(n_) / kGorillaSecondsPerMinute;
+  CHECK_EQ(totalMinutes, deviations_.size());
+
+  // Older minutes share their positions with the newer ones.
+  uint32_t firstMinute = begin / kGorillaSecondsPerMinute;
+  uint32_t lastMinute = end / kGorillaSecondsPerMinute;
+  if (lastMinute - firstMinute >= totalMinutes) {
+    firstMinute = lastMinute - totalMinutes + 1;
+  }
+
+  // Position of each row in `deviations`.
+  std::unordered_map<uint32_t, size_t> positions;
+
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  for (uint32_t minute = firstMinute; minute <= lastMinute; minute++) {
+    for (auto row : deviations_[minute % totalMinutes]) {
+      if (row >= rows_.size() || !rows_[row]) {
+        continue;
+      }
+
+      auto it = positions.emplace(row, deviations.size());
+      if (it.second) {
+        deviations.emplace_back();
+        deviations.back().item = rows_[row];
+      }
+      deviations[it.first->second].times.push_back(
+          minute * kGorillaSecondsPerMinute);
+    }
+  }
+
+  return deviations;
+}
+
+std::vector<std::pair<BucketMap::Item, double>>
+BucketMap::getTopDeviatingTimeSeries(
+    uint32_t begin,
+    uint32_t end,
+    int limit) {
+  std::vector<std::pair<Item, double>> top;
+  if (getState() != OWNED || !FLAGS_gorilla_running_stats || limit <= 0) {
+    return top;
+  }
+
+  uint32_t firstBucket = bucket(begin);
+  uint32_t lastBucket = bucket(end);
+  auto compare = [](const std::pair<Item, double>& a,
+                    const std::pair<Item, double>& b) {
+    return a.second > b.second;
+  };
+
+  // Min-heap of the `limit` largest deviations so far.
+  std::vector<Item> rows;
+  for (int offset = 0;; offset += kDeviationRowsAtATime) {
+    rows.clear();
+    bool more = getSome(rows, offset, kDeviationRowsAtATime);
+    for (auto& row : rows) {
+      BucketedTimeSeries::Stats stats;
+      if (!row.get() ||
+          !row->second.getStats(firstBucket, lastBucket, getStorage(), stats) ||
+          stats.variance <= 0) {
+        continue;
+      }
+
+      double sigmas = fabs(stats.last - stats.mean) / sqrt(stats.variance);
+      if (top.size() < limit) {
+        top.emplace_back(row, sigmas);
+        std::push_heap(top.begin(), top.end(), compare);
+      } else if (sigmas > top.front().second) {
+        std::pop_heap(top.begin(), top.end(), compare);
+        top.back() = std::make_pair(row, sigmas);
+        std::push_heap(top.begin(), top.end(), compare);
+      }
+    }
+
+    if (!more) {
+      break;
+    }
+  }
+
+  std::sort_heap(top.begin(), top.end(), compare);
+  return top;
+}
+
 } // namespace gorilla
 } // namespace facebook
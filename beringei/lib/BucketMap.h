@@ -9,6 +9,11 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <queue>
 #include <string>
 #include <unordered_map>
@@ -16,13 +21,23 @@
 
 #include <folly/synchronization/RWSpinLock.h>
 
+#include "beringei/lib/BlockFileArchive.h"
 #include "beringei/lib/BucketLogWriter.h"
+#include "beringei/lib/BucketSnapshot.h"
 #include "beringei/lib/BucketStorage.h"
 #include "beringei/lib/BucketedTimeSeries.h"
 #include "beringei/lib/CaseUtils.h"
+#include "beringei/lib/DataPointQueue.h"
+#include "beringei/lib/FlatKeyTable.h"
+#include "beringei/lib/KeyFilter.h"
+#include "beringei/lib/KeyIndex.h"
+#include "beringei/lib/LastUpdateTimes.h"
 #include "beringei/lib/KeyListWriter.h"
 #include "beringei/lib/LogReader.h"
 #include "beringei/lib/PersistentKeyList.h"
+#include "beringei/lib/RollupStorage.h"
+#include "beringei/lib/ShardReplicator.h"
+#include "beringei/lib/SubscriptionManager.h"
 #include "beringei/lib/Timer.h"
 
 namespace facebook {
@@ -33,7 +48,8 @@ namespace gorilla {
 // state of the shard.
 class BucketMap {
  public:
-  typedef std::shared_ptr<std::pair<std::string, BucketedTimeSeries>> Item;
+  typedef std::pair<std::string, BucketedTimeSeries> Row;
+  typedef std::shared_ptr<Row> Item;
 
   static const int kNotOwned;
 
@@ -94,9 +110,89 @@ class BucketMap {
       uint16_t category,
       bool skipStateCheck = false);
 
+  struct PutBatchResult {
+    int newRows = 0;
+    int added = 0;
+
+    // New keys that weren't added because `allowNewKeys` was false.
+    int newKeysBlocked = 0;
+
+    // Indexes of the data points that weren't handled because this map
+    // is not owned.
+    std::vector<uint32_t> notOwned;
+  };
+
+  // Inserts the data points in `data` at the given indexes, which must
+  // all be for this shard. All the existing keys are found with one
+  // acquisition of the locks and the log entries for them are written
+  // as one batch. New keys and points that have to be queued go
+  // through put().
+  //
+  // If `keyIds` is not null, it is indexed like `data` and gets the ids
+  // of the keys that already existed, for putBatchWithKeyIds().
+  PutBatchResult putBatch(
+      const std::vector<DataPoint>& data,
+      const std::vector<uint32_t>& points,
+      bool allowNewKeys,
+      std::vector<KeyId>* keyIds = nullptr);
+
+  // Same as putBatch() for points that give the ids of their keys.
+  // `notOwned` also gets the points whose ids don't match a key. Points
+  // are only added while the shard is fully owned, and are rejected
+  // while it is being loaded.
+  PutBatchResult putBatchWithKeyIds(
+      const std::vector<DataPointWithKeyId>& data,
+      const std::vector<uint32_t>& points);
+
+  // Inserts the sorted points in `values` of the entries in `data` at
+  // the given indexes, which must all be for this shard. `values` is
+  // indexed like `data` and holds the decoded points of each entry.
+  // The keys are found with one acquisition of the locks, and the
+  // points of each existing key are added with one acquisition of the
+  // lock of its time series. New keys and points that have to be
+  // queued go through put(). `notOwned` and `newKeysBlocked` count
+  // entries instead of points.
+  PutBatchResult putEncoded(
+      const std::vector<EncodedDataPoints>& data,
+      const std::vector<std::vector<TimeValuePair>>& values,
+      const std::vector<uint32_t>& entries,
+      bool allowNewKeys);
+
+  struct BackfillResult {
+    int newRows = 0;
+    int added = 0;
+
+    // Points outside of the finalized buckets that are in memory, or
+    // that could not be stored.
+    int dropped = 0;
+
+    // Indexes of the entries that weren't handled because this map
+    // isn't fully owned.
+    std::vector<uint32_t> notOwned;
+  };
+
+  // Writes the points of the entries in `data` at the given indexes,
+  // which must all be for this shard, straight into the finalized
+  // buckets that are still in memory, bypassing the active bucket and
+  // the data log. The points are merged with the ones already in the
+  // buckets, the backfilled ones winning ties, and the block files of
+  // the buckets are written again. Keys that don't exist are created.
+  BackfillResult backfill(
+      const std::vector<BackfillData>& data,
+      const std::vector<uint32_t>& indexes);
+
   // Get a shared_ptr to a TimeSeries.
   Item get(const std::string& key);
 
+  // Looks up the keys in `keys` at the given indexes, which must all
+  // be for this shard. `out` gets one item per index, nullptr for the
+  // keys that aren't found. All the keys are hashed first and found
+  // with one acquisition of the locks.
+  void getBatch(
+      const std::vector<Key>& keys,
+      const std::vector<uint32_t>& indexes,
+      std::vector<Item>& out);
+
   // Get all the TimeSeries.
   void getEverything(std::vector<Item>& out);
 
@@ -104,8 +200,111 @@ class BucketMap {
   // of `getEverything`. Returns true if there is more data left.
   bool getSome(std::vector<Item>& out, int offset, int count);
 
+  // Goes through the rows without taking a reference to each of them,
+  // so that scanning a whole shard doesn't touch the reference counts
+  // that puts and queries also use. The rows erased or dropped while a
+  // reader exists are only freed once every reader that was created
+  // before has been destroyed, so readers should be short lived.
+  class RowReader {
+   public:
+    explicit RowReader(BucketMap* map);
+    ~RowReader();
+
+    RowReader(const RowReader&) = delete;
+    RowReader& operator=(const RowReader&) = delete;
+
+    // Like getSome(). The rows outside of subshard `subshard` of
+    // `numSubshards` are null, so that the offsets stay the same. The
+    // subshard of a key comes from a hash computed when it's added.
+    // The rows stay valid until the reader is destroyed.
+    bool getSome(
+        std::vector<Row*>& out,
+        int offset,
+        int count,
+        uint32_t numSubshards = 1,
+        uint32_t subshard = 0);
+
+   private:
+    BucketMap* map_;
+    uint64_t epoch_;
+  };
+
+  // Appends up to `limit` time series whose keys match the glob
+  // `pattern` and sort after `after`, in case-insensitive key order.
+  // Looks up the keys in the sorted index instead of going through the
+  // whole shard. Returns true if there are more matching keys.
+  bool searchKeys(
+      const std::string& pattern,
+      const std::string& after,
+      int limit,
+      std::vector<Item>& out);
+
+  struct UpdatedItem {
+    Item item;
+    uint32_t lastUpdateTime;
+  };
+
+  // Appends the time series in the rows from `begin` to `end` that were
+  // updated at or after `minLastUpdateTime`, until `limit` rows have
+  // been looked at. Rows known to be older are skipped without
+  // touching them and don't count toward `limit`. Sets `next` to the
+  // row to continue from and returns true if there are rows after it.
+  bool getUpdatedSince(
+      uint32_t minLastUpdateTime,
+      int begin,
+      int end,
+      int limit,
+      std::vector<UpdatedItem>& out,
+      int& next);
+
   void erase(int index, Item item);
 
+  struct CategoryUsage {
+    int64_t numSeries = 0;
+    int64_t activeStreamBytes = 0;
+  };
+
+  struct ResourceUsage {
+    int64_t numSeries = 0;
+    std::map<uint32_t, uint64_t> pageBytesByPosition;
+    int64_t activeStreamBytes = 0;
+    int64_t activeStreamSlackBytes = 0;
+
+    // Bytes of the free buffers in the arena of the active streams.
+    int64_t streamArenaFreeBytes = 0;
+    uint32_t dedupHitRate = 0;
+    int64_t pointsAdded = 0;
+    int64_t keysQueried = 0;
+    double pointsAddedPerSecond = 0;
+    double keysQueriedPerSecond = 0;
+    int64_t keyListRecords = 0;
+    std::map<uint16_t, CategoryUsage> categories;
+  };
+
+  // Fills in the memory and traffic of this shard. The active streams
+  // and the categories are estimated from every `sampleEvery`th row.
+  // The rates are for the last finalized bucket, or since the shard
+  // was created before the first one is finalized.
+  void getResourceUsage(int sampleEvery, ResourceUsage& usage);
+
+  // Bytes the pages of this shard are expected to grow by until the
+  // bucket after the open one starts: the open bucket gets as big as
+  // the last finalized one and the oldest bucket is dropped. Negative
+  // once all the buckets are in use and shrinking.
+  int64_t getExpectedRotationBytes();
+
+  // Same as calling erase() for each pair of indexes and items, but
+  // takes the locks once for all of them. The time series are freed
+  // after the locks are released. Returns how many were erased.
+  int eraseBatch(
+      const std::vector<int>& indexes,
+      const std::vector<Item>& items);
+
+  // The same for rows from a RowReader that still exists.
+  int eraseBatch(
+      const std::vector<int>& indexes,
+      const std::vector<Row*>& rows);
+
   uint32_t bucket(uint64_t unixTime) const;
   uint64_t timestamp(uint32_t bucket) const;
   uint64_t duration(uint32_t buckets) const;
@@ -113,12 +312,63 @@ class BucketMap {
 
   BucketStorage* getStorage();
 
+  // Rewrites the key list with only the current keys. With
+  // --key_list_compaction_dead_fraction, does nothing until enough of
+  // the records are dead.
   void compactKeyList();
 
   void deleteOldBlockFiles();
 
+  // Writes a snapshot of the streams of the open bucket, so that
+  // restarting doesn't have to replay the logs written before it.
+  // Only works when the previous bucket has been finalized. Returns
+  // true if a snapshot was written. Thread-safe.
+  bool writeSnapshot();
+
   static void startMonitoring();
 
+  // Publishes the data points added to the map to `subscriptions`. Not
+  // thread-safe: must be called before any data points are added.
+  void setSubscriptions(std::shared_ptr<SubscriptionManager> subscriptions) {
+    subscriptions_ = std::move(subscriptions);
+  }
+
+  // Streams the keys and data points added to the map to the followers
+  // of the shard. Not thread-safe: must be called before any data
+  // points are added.
+  void setReplicator(std::shared_ptr<ShardReplicator> replicator) {
+    replicator_ = std::move(replicator);
+  }
+
+  // Makes the map a read replica of a shard owned by another host. A
+  // follower gets its keys and data points from putReplicatedKeys()
+  // and putReplicatedPoints() instead of put(), and doesn't write a
+  // key list, data logs or snapshots. It's loaded like an owned shard,
+  // from whatever files there are. Can only be changed while the shard
+  // is unowned. Returns whether the map has the given role.
+  bool setFollower(bool follower);
+
+  bool isFollower() const {
+    return follower_;
+  }
+
+  // Adds the keys in `keys` at the given indexes, which must all be
+  // for this shard, at the ids the owner gave them. A row that has
+  // another key at the id is replaced, and so is a row with the same
+  // key at another id. Returns the number of new rows, or kNotOwned if
+  // this map isn't a follower that has been loaded.
+  int putReplicatedKeys(
+      const std::vector<KeyMapping>& keys,
+      const std::vector<uint32_t>& indexes);
+
+  // Adds the points in `points` at the given indexes, which must all
+  // be for this shard. The points of ids without a key are dropped.
+  // Returns the number of points added, or kNotOwned if this map isn't
+  // a follower that has been loaded.
+  int putReplicatedPoints(
+      const std::vector<DataPointWithID>& points,
+      const std::vector<uint32_t>& indexes);
+
   // Reads the key list. This function should be called after moving
   // to PRE_OWNED state.
   void readKeyList();
@@ -127,12 +377,24 @@ class BucketMap {
   // readKeyList.
   void readData();
 
-  // Reads compressed block files for the newest unread time window.
-  // This function should be called repeatedly after calling readData.
-  // Returns true if there might be more files to read, in which case the caller
-  // should call again later.
+  // Reads compressed block files for the newest unread time window,
+  // or for the newest one passed to requestBlockFiles() if there are
+  // any. This function should be called repeatedly after calling
+  // readData. Returns true if there might be more files to read, in
+  // which case the caller should call again later.
   bool readBlockFiles();
 
+  // Makes the block files of the buckets between `begin` and `end`,
+  // inclusive, the next ones read. Returns the number of them that
+  // haven't been read yet, so zero means all the data for the buckets
+  // is in memory.
+  int requestBlockFiles(uint32_t begin, uint32_t end);
+
+  // Reads the newest block file passed to requestBlockFiles(). Can be
+  // called at the same time as readBlockFiles(). Returns true if more
+  // block files have been requested.
+  bool readRequestedBlockFiles();
+
   // Sets the state. Returns true if state was set, false if the state
   // transition is not allowed or already in that state.
   bool setState(State state);
@@ -158,6 +420,40 @@ class BucketMap {
   // with 0. This function is not thread-safe.
   int finalizeBuckets(uint32_t bucketToFinalize);
 
+  // Index of the coarsest rollup tier that can downsample [begin, end]
+  // into windows of `step` seconds with `type`, or -1 if the raw data
+  // has to be used. The tier must cover `begin`, and `begin` and `step`
+  // must be multiples of its resolution.
+  int pickRollup(int64_t begin, int64_t step, AggregationType type);
+
+  // Downsamples the keys at `indexes` into windows of `step` seconds
+  // from the summaries of rollup tier `tier`, and from the raw data for
+  // the buckets that haven't been rolled up yet. `windows` gets one
+  // vector per index, as Aggregation::downsample() would return, which
+  // is empty for the keys that aren't found. Windows of the tier are
+  // counted whole even when they go past `end`.
+  void getRollups(
+      int tier,
+      const std::vector<Key>& keys,
+      const std::vector<uint32_t>& indexes,
+      int64_t begin,
+      int64_t end,
+      int64_t step,
+      AggregationType type,
+      std::vector<std::vector<double>>& windows);
+
+  // Appends the blocks of the keys at `indexes` in the buckets from
+  // `begin` to `end` that are older than the ones in memory, read from
+  // the BlockFileStore, to `outs`, which is indexed like `indexes`.
+  // Goes back at most --block_file_store_query_buckets buckets. Returns
+  // the number of buckets that were found in the store.
+  int getArchived(
+      const std::vector<Key>& keys,
+      const std::vector<uint32_t>& indexes,
+      uint32_t begin,
+      uint32_t end,
+      const std::vector<BucketedTimeSeries::Output*>& outs);
+
   // Returns whether this BucketMap is behind more than 1 bucket.
   bool isBehind(uint32_t bucketToFinalize) const;
 
@@ -169,6 +465,18 @@ class BucketMap {
   // given time.
   std::vector<BucketMap::Item> getDeviatingTimeSeries(uint32_t unixTime);
 
+  struct Deviation {
+    Item item;
+    // The beginning of each minute it deviated in, oldest first.
+    std::vector<uint32_t> times;
+  };
+
+  // Returns the time series that deviated in the minutes from `begin` to
+  // `end`, each one once, in the order of their first deviation. Only
+  // the newest minutes are looked at if the range is longer than the
+  // index, which holds as many minutes as the buckets in memory.
+  std::vector<Deviation> getDeviatingTimeSeries(uint32_t begin, uint32_t end);
+
   // Indexes deviating time series. `deviationStartTime` and `endTime`
   // is the time range for calculating the mean and standard
   // deviation. `indexingStartTime` and `endTime` is the time range
@@ -177,12 +485,24 @@ class BucketMap {
   // from the mean before it's indexed.
   //
   // Returns the total number of deviations that were indexed.
+  //
+  // With --gorilla_running_stats, the mean and standard deviation are
+  // taken from the running stats of the whole buckets in the range, and
+  // only the blocks with values to index are read.
   int indexDeviatingTimeSeries(
       uint32_t deviationStartTime,
       uint32_t indexingStartTime,
       uint32_t endTime,
       double minimumSigma);
 
+  // Returns up to `limit` time series whose newest value is the most
+  // standard deviations away from the mean of the buckets between
+  // `begin` and `end`, with the number of standard deviations, largest
+  // first. Only answered from the running stats, so it's empty without
+  // --gorilla_running_stats.
+  std::vector<std::pair<Item, double>>
+  getTopDeviatingTimeSeries(uint32_t begin, uint32_t end, int limit);
+
   uint32_t getLastFinalizedBucket() {
     return lastFinalizedBucket_;
   }
@@ -193,9 +513,21 @@ class BucketMap {
   int64_t getReliableDataStartTime();
 
  private:
+  // Restores the streams of the bucket after lastBlock from the
+  // newest snapshot if there's one for that bucket. Sets
+  // `snapshotTime` and the log files that don't have to be read.
+  void readSnapshot(
+      uint32_t lastBlock,
+      int64_t& snapshotTime,
+      std::set<int64_t>& coveredLogFiles);
+
   // Load all the datapoints out of the logfiles for this shard that
-  // are newer than what is covered by the lastBlock.
-  void readLogFiles(uint32_t lastBlock);
+  // are newer than what is covered by the lastBlock, except for the
+  // files covered by a snapshot taken at `snapshotTime`.
+  void readLogFiles(
+      uint32_t lastBlock,
+      int64_t snapshotTime,
+      const std::set<int64_t>& coveredLogFiles);
 
   // Returns a shared_ptr to the item if found. Always sets
   // `state`. Sets `id` if item is found. If keyList is not nullptr,
@@ -215,28 +547,218 @@ class BucketMap {
   void processQueuedDataPoints(bool skipStateCheck);
 
   bool putDataPointWithId(
-      BucketedTimeSeries* timeSeries,
+      Row* row,
       uint32_t timeSeriesId,
       const TimeValuePair& value,
       uint16_t category);
 
+  // A point of a time series whose id is known.
+  struct IdPoint {
+    uint32_t id;
+    uint16_t category;
+    TimeValuePair value;
+  };
+
+  // Puts and empties `points`, with one BucketedTimeSeries::putMany()
+  // call for the points of each time series and category. The points of
+  // each time series are kept in order. Points of ids without a row are
+  // counted in `unknownKeys`. With `replay`, the points are replayed
+  // from the logs or the owner of the shard, so they aren't logged or
+  // published again and don't change the category. Returns the number
+  // of points that were added.
+  uint32_t putDataPointsWithIds(
+      std::vector<IdPoint>& points,
+      bool replay,
+      uint32_t& unknownKeys);
+
+  // Takes the row at `index` out of the map and moves it to `removed`.
+  // All the stripes and `lock_` must be held for writing.
+  void removeRow(int index, std::vector<Item>& removed);
+
+  // Inserts a new row unless another thread added its key first, in
+  // which case `existing` gets that row. Returns the id of the row.
+  int insertRow(const Item& newRow, uint16_t category, Item& existing);
+
+  // Merges sorted `values`, which are all in finalized bucket
+  // `position`, into the block of the row for that bucket. Returns the
+  // number of backfilled points that were written, or -1 if the block
+  // could not be replaced.
+  int backfillBucket(
+      Row* row,
+      uint32_t position,
+      std::vector<TimeValuePair>::const_iterator begin,
+      std::vector<TimeValuePair>::const_iterator end);
+
   void checkForMissingBlockFiles();
 
+  // Summarizes `bucket` of every time series into the rollup tiers.
+  void addRollups(uint32_t bucket, const std::vector<Item>& timeSeriesData);
+
+  // Returns false if a new time series of `category` would go over
+  // the limits of its policy.
+  bool categoryHasRoom(uint16_t category);
+
+  // Adds `delta` to the time series of `category` if it has a policy.
+  // `lock_` must be held for writing.
+  void countCategorySeries(uint16_t category, int delta);
+
+  // Measures the blocks of `bucket` of the categories with a memory
+  // quota.
+  void updateCategoryBytes(
+      uint32_t bucket,
+      const std::vector<Item>& timeSeriesData);
+
+  // Moves `position` from the unread block files to the ones being
+  // read. `unreadBlockFilesMutex_` must be held.
+  void startReadingBlockFile(uint32_t position);
+
+  // Reads the block file at `position` into memory.
+  void readBlockFile(uint32_t position);
+
   const uint8_t n_;
   const int64_t windowSize_;
 
   int64_t reliableDataStartTime_;
 
+  // Protects the state, `rows_`, `freeList_`, the data point queue and
+  // the deviations.
   mutable folly::RWSpinLock lock_;
 
-  std::unordered_map<const char*, int, CaseHash, CaseEq> map_;
+  // The key to row index map is split into stripes, each with its own
+  // lock, so that adding a new key only blocks lookups and inserts of
+  // keys in the same stripe. When both are needed, the stripe lock is
+  // always taken before `lock_`.
+  //
+  // The stripes only store hashes and row ids. The keys are the
+  // strings in `rows_`, so looking up a key also needs `lock_`.
+  static constexpr int kMapStripes = 64;
+  struct MapStripe {
+    folly::RWSpinLock lock;
+    FlatKeyTable map;
+  };
+
+  // The top bits of the hash pick the stripe and the low 32 bits are
+  // used by the table in the stripe.
+  static uint64_t hashKey(const char* key);
+
+  // The hash that assigns a key to a subshard in RowReader::getSome().
+  static uint32_t scanHashKey(const std::string& key);
+
+  // Readers are in the epoch that was current when they were created.
+  // The epoch only moves forward once no reader of the one before is
+  // left, so the rows retired in an epoch can be freed two epochs
+  // later.
+  uint64_t enterEpoch();
+  void exitEpoch(uint64_t epoch);
+
+  // Frees `rows`, which are not in `rows_` anymore, once no reader can
+  // be using them.
+  void retireRows(std::vector<Item>&& rows);
+
+  // Moves the epoch forward if possible and frees the rows that no
+  // reader can be using anymore. `retiredMutex_` must be held.
+  void reclaimRows();
+  static int getStripeIndex(uint64_t hash);
+  MapStripe& getStripe(uint64_t hash);
+
+  // Finds many keys with one acquisition of `lock_` and the stripe
+  // locks they need. Sets `ids` and `items` for each key, -1 and
+  // nullptr if it's not found, and `hashes` if not null. Returns the
+  // state.
+  State findBatch(
+      const std::vector<const char*>& keys,
+      std::vector<int>& ids,
+      std::vector<Item>& items,
+      std::vector<uint64_t>* hashes = nullptr);
+
+  // Returns the row id of the key in the stripe or -1. `lock_` must
+  // be held.
+  int findInStripe(const MapStripe& stripe, const char* key, uint64_t hash)
+      const;
+
+  // Locks all the stripes for writing. Used when the whole map changes.
+  void lockAllStripes();
+  void unlockAllStripes();
+
+  std::array<MapStripe, kMapStripes> stripes_;
+
+  // Replaces the key filter with one built from the current keys.
+  void rebuildKeyFilter();
+
+  // Returns false if the key with this hash is certainly not in the
+  // map.
+  bool mayContainKey(const KeyFilter* filter, uint64_t hash) const;
+
+  // Filter over the hashes of all the keys, or null while the keys
+  // are being read. Accessed with std::atomic_load and atomic_store.
+  std::shared_ptr<KeyFilter> keyFilter_;
+
+  // All the time series in `rows_` sorted by key. Updated under the
+  // stripe lock of the key, like the map.
+  KeyIndex keyIndex_;
+
+  // The last update time of each row, updated on every put.
+  LastUpdateTimes lastUpdateTimes_;
 
   // Always equal to rows_.size();
   std::atomic<int> tableSize_;
 
+  // Number of records in the key list, including the ones for keys
+  // that were deleted or replaced since the last compaction.
+  std::atomic<int64_t> keyListRecords_;
+
+  // Totals since the map was created, for getResourceUsage().
+  std::atomic<int64_t> pointsAdded_;
+  std::atomic<int64_t> keysQueried_;
+
+  struct UsageSample {
+    int64_t time;
+    int64_t pointsAdded;
+    int64_t keysQueried;
+  };
+
+  // The totals when the two last buckets were finalized.
+  UsageSample previousUsageSample_;
+  UsageSample lastUsageSample_;
+  std::mutex usageSampleMutex_;
+
+  struct CategoryState {
+    int64_t numSeries = 0;
+
+    // Average bytes of a block of the last finalized bucket.
+    double blockBytesPerSeries = 0;
+  };
+
+  // The categories that have a policy. Protected by `lock_`.
+  std::unordered_map<uint16_t, CategoryState> categoryStates_;
+
   std::vector<Item> rows_;
+
+  // The scanHashKey() of each row, as many as `rows_`. Protected by
+  // `lock_`.
+  std::vector<uint32_t> scanHashes_;
+
+  // For RowReader.
+  struct RetiredRows {
+    uint64_t epoch;
+    std::vector<Item> rows;
+  };
+  std::atomic<uint64_t> epoch_;
+  std::array<std::atomic<int>, 2> epochReaders_;
+  std::mutex retiredMutex_;
+  std::deque<RetiredRows> retiredRows_;
   std::priority_queue<int, std::vector<int>, std::less<int>> freeList_;
   BucketStorage storage_;
+
+  // From --rollup_tiers, finest resolution first.
+  std::vector<std::unique_ptr<RollupStorage>> rollups_;
+
+  // Created by the first getArchived() that needs it.
+  std::mutex archiveMutex_;
+  std::unique_ptr<BlockFileArchive> archive_;
+
+  BucketSnapshot snapshot_;
+  std::mutex snapshotMutex_;
   State state_;
   int shardId_;
   const std::string dataDirectory_;
@@ -246,30 +768,36 @@ class BucketMap {
   Timer addTimer_;
   std::mutex stateChangeMutex_;
 
-  struct QueuedDataPoint {
-    uint32_t timeSeriesId;
-
-    // 32 bits for the timestamp to save memory. 64-bits not needed
-    // because the timestamp is turned into seconds before coming to
-    // BucketMap.
-    uint32_t unixTime;
-
-    // Empty string will indicate that timeSeriesId is used.
-    std::string key;
-    double value;
-    uint16_t category;
-  };
+  using QueuedDataPoint = DataPointQueue::Point;
 
   void queueDataPoint(QueuedDataPoint& dp);
-  std::shared_ptr<folly::MPMCQueue<QueuedDataPoint>> dataPointQueue_;
+  std::shared_ptr<DataPointQueue> dataPointQueue_;
   uint32_t lastFinalizedBucket_;
 
+  // Keeps backfills out of the buckets while they are finalized.
+  std::mutex finalizeMutex_;
+
   std::mutex unreadBlockFilesMutex_;
   std::set<uint32_t> unreadBlockFiles_;
 
+  // Unread block files that queries have asked for.
+  std::set<uint32_t> requestedBlockFiles_;
+
+  // Block files taken out of `unreadBlockFiles_` that are still being
+  // read.
+  std::set<uint32_t> readingBlockFiles_;
+
   // Circular vector for the deviations.
   std::vector<std::vector<uint32_t>> deviations_;
   std::shared_ptr<LogReaderFactory> logReaderFactory_;
+
+  // Gets the data points added to the map. Can be null.
+  std::shared_ptr<SubscriptionManager> subscriptions_;
+
+  // Gets the keys and data points for the followers. Can be null.
+  std::shared_ptr<ShardReplicator> replicator_;
+
+  std::atomic<bool> follower_;
 };
 
 } // namespace gorilla
@@ -0,0 +1,237 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "BucketSnapshot.h"
+
+#include <folly/io/IOBuf.h>
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "BlockFileCodec.h"
+
+DECLARE_string(block_file_codec);
+DECLARE_int32(block_file_compression_level);
+
+namespace facebook {
+namespace gorilla {
+
+const std::string BucketSnapshot::kSnapshotPrefix = "open_bucket_snapshot";
+
+// The snapshot is written here first and renamed when it's complete.
+static const int64_t kTempFileId = 0;
+
+static const size_t kLargeFileBuffer = 1024 * 1024;
+
+namespace {
+
+// Layout of an entry in the file. The stream data of all the entries
+// follows the entries in the same order.
+struct FileEntry {
+  uint32_t timeSeriesId;
+  uint32_t dataLength;
+  uint64_t keyHash;
+  TimeSeriesStream::State state;
+  uint16_t count;
+
+  // The high bits of the count, which are 0 in older snapshots.
+  uint16_t countHigh;
+  uint32_t unused;
+};
+static_assert(sizeof(FileEntry) == 48, "FileEntry must be 48 bytes");
+}
+
+BucketSnapshot::BucketSnapshot(
+    int64_t shardId,
+    const std::string& dataDirectory)
+    : files_(shardId, kSnapshotPrefix, dataDirectory) {}
+
+bool BucketSnapshot::write(
+    int64_t id,
+    uint32_t bucket,
+    const std::vector<int64_t>& coveredLogFiles,
+    const std::vector<Entry>& entries) {
+  CHECK_NE(id, kTempFileId);
+
+  uint32_t logFileCount = coveredLogFiles.size();
+  uint32_t count = entries.size();
+  size_t dataLen = sizeof(uint32_t) + // bucket
+      sizeof(uint32_t) + // covered log files
+      sizeof(uint32_t) + // count
+      logFileCount * sizeof(int64_t) + // log file ids
+      count * sizeof(FileEntry); // entries
+  for (const auto& entry : entries) {
+    dataLen += entry.data.size();
+  }
+
+  std::unique_ptr<char[]> buffer(new char[dataLen]);
+  char* ptr = buffer.get();
+
+  memcpy(ptr, &bucket, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(ptr, &logFileCount, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(ptr, &count, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+
+  if (logFileCount > 0) {
+    memcpy(ptr, &coveredLogFiles[0], logFileCount * sizeof(int64_t));
+    ptr += logFileCount * sizeof(int64_t);
+  }
+
+  for (const auto& entry : entries) {
+    FileEntry fileEntry{};
+    fileEntry.timeSeriesId = entry.timeSeriesId;
+    fileEntry.dataLength = entry.data.size();
+    fileEntry.keyHash = entry.keyHash;
+    fileEntry.state = entry.state;
+    fileEntry.count = entry.count & 0xFFFF;
+    fileEntry.countHigh = entry.count >> 16;
+    memcpy(ptr, &fileEntry, sizeof(FileEntry));
+    ptr += sizeof(FileEntry);
+  }
+
+  for (const auto& entry : entries) {
+    memcpy(ptr, entry.data.data(), entry.data.size());
+    ptr += entry.data.size();
+  }
+
+  CHECK_EQ(ptr - buffer.get(), dataLen);
+
+  auto file = files_.open(kTempFileId, "wb", kLargeFileBuffer);
+  if (!file.file) {
+    LOG(ERROR) << "Opening snapshot file " << file.name << " failed";
+    return false;
+  }
+
+  try {
+    BlockFileCodec::Type codec = BlockFileCodec::Type::ZLIB;
+    if (!BlockFileCodec::parse(FLAGS_block_file_codec, codec)) {
+      LOG(ERROR) << "Unknown block file codec " << FLAGS_block_file_codec
+                 << ", using zlib";
+    }
+    auto compressed = BlockFileCodec::compress(
+        folly::ByteRange((const uint8_t*)buffer.get(), dataLen),
+        codec,
+        FLAGS_block_file_compression_level);
+
+    if (fwrite(
+            compressed->data(),
+            sizeof(char),
+            compressed->length(),
+            file.file) != compressed->length()) {
+      PLOG(ERROR) << "Writing snapshot file " << file.name << " failed";
+      FileUtils::closeFile(file, false);
+      return false;
+    }
+
+    LOG(INFO) << "Wrote snapshot file " << file.name << " bucket:" << bucket
+              << " entries:" << count << " dataLen:" << dataLen
+              << " compressed:" << compressed->length();
+  } catch (std::exception& e) {
+    LOG(ERROR) << e.what();
+    FileUtils::closeFile(file, false);
+    return false;
+  }
+
+  FileUtils::closeFile(file, false);
+  files_.rename(kTempFileId, id);
+
+  // Only the newest snapshot is ever read.
+  files_.clearTo(id);
+  return true;
+}
+
+bool BucketSnapshot::readLatest(
+    int64_t& id,
+    uint32_t& bucket,
+    std::vector<int64_t>& coveredLogFiles,
+    std::vector<Entry>& entries) {
+  std::vector<int64_t> ids = files_.ls();
+  if (ids.empty() || ids.back() == kTempFileId) {
+    return false;
+  }
+
+  id = ids.back();
+  std::string buffer;
+  if (!files_.read(id, buffer)) {
+    return false;
+  }
+
+  std::unique_ptr<folly::IOBuf> uncompressed;
+  try {
+    uncompressed = BlockFileCodec::uncompress(
+        folly::ByteRange((const uint8_t*)buffer.data(), buffer.size()));
+  } catch (std::exception& e) {
+    LOG(ERROR) << e.what();
+    return false;
+  }
+
+  const char* ptr = (const char*)uncompressed->data();
+  const char* end = ptr + uncompressed->length();
+  if (uncompressed->length() < 3 * sizeof(uint32_t)) {
+    LOG(ERROR) << "Not enough data in snapshot " << id;
+    return false;
+  }
+
+  uint32_t logFileCount;
+  uint32_t count;
+  memcpy(&bucket, ptr, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(&logFileCount, ptr, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(&count, ptr, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+
+  size_t headerLength =
+      logFileCount * sizeof(int64_t) + count * sizeof(FileEntry);
+  if ((size_t)(end - ptr) < headerLength) {
+    LOG(ERROR) << "Corrupt snapshot " << id << ": " << count << " entries in "
+               << uncompressed->length() << " bytes";
+    return false;
+  }
+
+  coveredLogFiles.resize(logFileCount);
+  if (logFileCount > 0) {
+    memcpy(&coveredLogFiles[0], ptr, logFileCount * sizeof(int64_t));
+    ptr += logFileCount * sizeof(int64_t);
+  }
+
+  const char* data = ptr + count * sizeof(FileEntry);
+  entries.resize(count);
+  for (auto& entry : entries) {
+    FileEntry fileEntry;
+    memcpy(&fileEntry, ptr, sizeof(FileEntry));
+    ptr += sizeof(FileEntry);
+
+    if ((size_t)(end - data) < fileEntry.dataLength) {
+      LOG(ERROR) << "Corrupt snapshot " << id << ": stream of "
+                 << fileEntry.timeSeriesId << " is past the end of the file";
+      entries.clear();
+      return false;
+    }
+
+    entry.timeSeriesId = fileEntry.timeSeriesId;
+    entry.keyHash = fileEntry.keyHash;
+    entry.count = fileEntry.count | ((uint32_t)fileEntry.countHigh << 16);
+    entry.state = fileEntry.state;
+    entry.data.assign(data, fileEntry.dataLength);
+    data += fileEntry.dataLength;
+  }
+
+  if (data != end) {
+    LOG(ERROR) << "Corrupt snapshot " << id << ": " << end - data
+               << " extra bytes";
+    entries.clear();
+    return false;
+  }
+
+  return true;
+}
+}
+} // facebook::gorilla
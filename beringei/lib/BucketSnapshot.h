@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "FileUtils.h"
+#include "TimeSeriesStream.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class BucketSnapshot
+//
+// Reads and writes snapshots of the active streams of a shard, so that
+// recovery doesn't have to replay the whole data log of the open
+// bucket. A snapshot holds the Gorilla encoded stream and the encoder
+// state of every time series with points in the bucket, and the ids of
+// the log files whose points are all in the snapshot. The file is
+// compressed like a block file.
+class BucketSnapshot {
+ public:
+  static const std::string kSnapshotPrefix;
+
+  struct Entry {
+    uint32_t timeSeriesId;
+
+    // Hash of the key, to detect time series ids that were reused for
+    // another key after the snapshot was taken.
+    uint64_t keyHash;
+    uint32_t count;
+    TimeSeriesStream::State state;
+    std::string data;
+  };
+
+  BucketSnapshot(int64_t shardId, const std::string& dataDirectory);
+
+  // Writes a snapshot of the active streams in `bucket` and removes
+  // the older snapshots. `id` is the time the snapshot was taken.
+  // Returns false if the snapshot couldn't be written.
+  bool write(
+      int64_t id,
+      uint32_t bucket,
+      const std::vector<int64_t>& coveredLogFiles,
+      const std::vector<Entry>& entries);
+
+  // Reads the newest snapshot. Returns false if there isn't one or if
+  // it can't be read.
+  bool readLatest(
+      int64_t& id,
+      uint32_t& bucket,
+      std::vector<int64_t>& coveredLogFiles,
+      std::vector<Entry>& entries);
+
+ private:
+  FileUtils files_;
+};
+}
+} // facebook::gorilla
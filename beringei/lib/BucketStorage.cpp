@@ -9,16 +9,92 @@
 
 #include "BucketStorage.h"
 
+#include "BlockFileCodec.h"
+#include "ColumnarPages.h"
+#include "DataBlockAllocator.h"
 #include "GorillaStatsManager.h"
+#include "InflatedPageCache.h"
+#include "StreamArena.h"
 #include "TimeSeriesStream.h"
 
-#include <folly/compression/Compression.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <iterator>
+
 #include <folly/io/IOBuf.h>
 
 DEFINE_int32(
     pla_period,
-    60,
-    "Lossily compress time series to 1 point every X seconds");
+    3600,
+    "Points kept by --lossy_compression_error are at most this many "
+    "seconds apart. 0 doesn't limit them.");
+DEFINE_string(
+    block_file_codec,
+    "zlib",
+    "Codec for finalized block files: zlib, zstd, lz4 or none. Files "
+    "written with any of them can be read regardless of this setting.");
+DEFINE_int32(
+    block_file_compression_level,
+    0,
+    "Compression level for block files. 0 uses the default of the codec.");
+DEFINE_int32(
+    mmap_bucket_age,
+    0,
+    "Finalized buckets this many positions older than the newest "
+    "finalized one are dropped from memory and read from a memory mapped "
+    "block file instead. Only works with --block_file_codec=none. "
+    "0 disables.");
+DEFINE_int32(
+    block_file_compression_threads,
+    0,
+    "Compress each page of a block file separately, on this many "
+    "threads per shard, and write the pages as they are compressed. "
+    "Older versions can't read these files. 0 compresses the whole file "
+    "at once. Ignored with --block_file_codec=none.");
+DEFINE_bool(
+    block_file_checksums,
+    false,
+    "Also write a CRC32C for each page of the block files compressed with "
+    "--block_file_compression_threads, and an index of the pages, so that "
+    "a damaged page only loses the blocks in it and the pages can be "
+    "uncompressed in parallel. Older versions can't read these files.");
+DEFINE_bool(
+    block_file_shared_timestamps,
+    false,
+    "Store the timestamps of the blocks in block files once for all the "
+    "time series that share them. Older versions can't read these files "
+    "and they can't be memory mapped.");
+DEFINE_int32(
+    compress_bucket_age,
+    0,
+    "Finalized buckets this many positions older than the newest "
+    "finalized one are kept in memory as independently compressed groups "
+    "of pages, which are inflated into a small cache shared by all the "
+    "shards when they are read. Memory mapped buckets aren't compressed "
+    "and compressed buckets aren't memory mapped. 0 disables.");
+DEFINE_int32(
+    compressed_page_group,
+    16,
+    "Pages of a bucket compressed by --compress_bucket_age that are "
+    "compressed and inflated together.");
+DEFINE_string(
+    compressed_bucket_codec,
+    "lz4",
+    "Codec for --compress_bucket_age: zlib, zstd or lz4.");
+DEFINE_int32(
+    inflated_page_cache_mb,
+    64,
+    "Megabytes of page groups inflated from the buckets compressed by "
+    "--compress_bucket_age that are cached for all the shards.");
+DEFINE_bool(
+    active_stream_arena,
+    true,
+    "Allocate the active streams of each shard from an arena of size "
+    "classes instead of the heap. Freed stream buffers are reused instead "
+    "of being returned to the system.");
 
 namespace facebook {
 namespace gorilla {
@@ -29,13 +105,25 @@ const uint16_t kMaxItemCount = 32767;
 // To fit in 15 bits.
 const uint16_t kMaxDataLength = 32767;
 
-// For page index to fit in 18 bits.
-const uint32_t kMaxPageCount = 262144;
+// For page index to fit in 17 bits.
+const uint32_t kMaxPageCount = 131072;
 
 // Store data in 64K chunks.
-// kMaxPageCount * kPageSize = 16GB
+// kMaxPageCount * kPageSize = 8GB
 const uint32_t BucketStorage::kPageSize = kDataBlockSize;
 
+// Set in the ids of blocks that don't fit in kMaxDataLength bytes or
+// kMaxItemCount items. The rest of the id is the id of a descriptor
+// block with the length and the item count of the data, followed by
+// the ids of the chunks the data was split into.
+const BucketStorage::BucketStorageId kLargeBlockFlag = 1ULL << 63;
+
+// The chunk ids have to fit in the descriptor, which caps large blocks
+// at about 128MB.
+const uint32_t kLargeBlockHeaderSize = 2 * sizeof(uint32_t);
+const uint32_t kMaxLargeBlockChunks = (kMaxDataLength - kLargeBlockHeaderSize) /
+    sizeof(BucketStorage::BucketStorageId);
+
 // Zero can be used as the invalid ID because no valid ID will ever be zero
 const BucketStorage::BucketStorageId BucketStorage::kInvalidId = 0;
 
@@ -51,37 +139,77 @@ static const std::string kBlockFileReadFailures = "block_file_read_failures";
 static const std::string kDedupedTimeSeriesSize = "timeseries_block_dedup_size";
 static const std::string kWrittenTimeSeriesSize =
     "timeseries_block_written_size";
+
+// Added for every block stored.
+static GorillaStat dedupedTimeSeriesSizeStat(kDedupedTimeSeriesSize);
+static GorillaStat writtenTimeSeriesSizeStat(kWrittenTimeSeriesSize);
 static const std::string kExpiredBucketFetch = "expired_bucket_fetches";
+static const std::string kDedupHitRate = "timeseries_block_dedup_hit_rate";
+static const std::string kDedupTableLoad = "timeseries_block_dedup_table_load";
+static const std::string kMappedBuckets = "mapped_buckets";
+static const std::string kMappedBucketFailures = "mapped_bucket_failures";
+static const std::string kLargeBlocks = "timeseries_large_blocks";
+static const std::string kDroppedBlocks = "timeseries_blocks_dropped";
+static const std::string kZeroedBlockBytes = "timeseries_block_bytes_zeroed";
+static const std::string kPreparedPages = "bucket_storage_prepared_pages";
+static const std::string kUnpreparedRotations =
+    "bucket_storage_unprepared_rotations";
+
+static const std::string kCompressedBuckets = "compressed_buckets";
+static const std::string kCompressedBucketFailures =
+    "compressed_bucket_failures";
+
+// Pages are pre-faulted by touching one byte per page of the system.
+static const uint32_t kSystemPageSize = 4096;
+
+// Keys of the groups of compressed buckets in the cache of inflated
+// groups. Never reused, so that a group is never served for another.
+static std::atomic<uint64_t> nextCompressedKey(0);
+
+static InflatedPageCache& getInflatedPageCache() {
+  static InflatedPageCache cache(
+      (size_t)std::max(FLAGS_inflated_page_cache_mb, 0) * 1024 * 1024);
+  return cache;
+}
 
 BucketStorage::BucketStorage(
     uint8_t numBuckets,
     int shardId,
     const std::string& dataDirectory)
     : numBuckets_(numBuckets),
+      shardId_(shardId),
+      dataDirectory_(dataDirectory),
       newestPosition_(0),
+      lastBucketBlocks_(0),
+      lastBucketDedupHitRate_(0),
       dataBlockReader_(shardId, dataDirectory),
       dataFiles_(shardId, kDataPrefix, dataDirectory),
-      completeFiles_(shardId, kCompletePrefix, dataDirectory) {
+      completeFiles_(shardId, kCompletePrefix, dataDirectory),
+      streamArena_(StreamArena::get(shardId)) {
   data_.reset(new BucketData[numBuckets]);
   enable();
 }
 
+StreamArena* BucketStorage::getStreamArena() {
+  return FLAGS_active_stream_arena ? streamArena_ : nullptr;
+}
+
 BucketStorage::BucketStorageId BucketStorage::store(
     uint32_t position,
     const char* data,
-    uint16_t dataLength,
-    uint16_t itemCount,
+    uint32_t dataLength,
+    uint32_t itemCount,
     uint32_t timeSeriesId) {
-  if (dataLength > kMaxDataLength || itemCount > kMaxItemCount) {
+  if (dataLength > (uint64_t)kMaxDataLength * kMaxLargeBlockChunks) {
     LOG(ERROR) << "Attempted to insert too much data. Length : " << dataLength
                << " Count : " << itemCount;
     return kInvalidId;
   }
 
-  uint32_t pageIndex;
-  uint32_t pageOffset;
   uint8_t bucket = position % numBuckets_;
 
+  // Freed after the pages mutex is released.
+  std::vector<std::shared_ptr<DataBlock>> released;
   std::unique_lock<std::mutex> guard(data_[bucket].pagesMutex);
 
   if (data_[bucket].disabled) {
@@ -92,24 +220,7 @@ BucketStorage::BucketStorageId BucketStorage::store(
   // is, buckets are rotated and an old bucket is now the active
   // one.
   if (position > newestPosition_) {
-    // Need this lock to prevent reading from deleted memory in fetch.
-    folly::RWSpinLock::WriteHolder writeGuard(data_[bucket].fetchLock);
-
-    if (data_[bucket].activePages < data_[bucket].pages.size()) {
-      // Only delete memory if the pages were not fully used the
-      // previous time around. This means that if there's a spike in
-      // the amount of data on day 1, the extra memory will be freed
-      // on day 3.
-      data_[bucket].pages.resize(data_[bucket].activePages);
-    }
-
-    data_[bucket].activePages = 0;
-    data_[bucket].lastPageBytesUsed = 0;
-    data_[bucket].position = position;
-    data_[bucket].storageIds.clear();
-    data_[bucket].timeSeriesIds.clear();
-    data_[bucket].finalized = false;
-    data_[bucket].storageIdsLookupMap.clear();
+    rotateLocked(bucket, position, released);
     newestPosition_ = position;
   }
 
@@ -123,97 +234,642 @@ BucketStorage::BucketStorageId BucketStorage::store(
     return kInvalidId;
   }
 
-  BucketStorageId id = kInvalidId;
-  uint64_t hash = folly::hash::SpookyHashV2::Hash64(data, dataLength, 0);
-  const auto& matches = data_[bucket].storageIdsLookupMap.equal_range(hash);
-  for (auto iter = matches.first; iter != matches.second; ++iter) {
-    uint32_t index, offset;
-    uint16_t length, count;
-    parseId(iter->second, index, offset, length, count);
-    if (length == dataLength && count == itemCount &&
-        (memcmp(data, data_[bucket].pages[index]->data + offset, dataLength) ==
-         0)) {
-      id = iter->second;
+  BucketStorageId id;
+  if (dataLength > kMaxDataLength || itemCount > kMaxItemCount) {
+    id = storeLargeLocked(bucket, data, dataLength, itemCount);
+  } else {
+    id = storeLocked(bucket, data, dataLength, itemCount);
+  }
+  if (id == kInvalidId) {
+    return kInvalidId;
+  }
+
+  data_[bucket].timeSeriesIds.push_back(timeSeriesId);
+  data_[bucket].storageIds.push_back(id);
+  return id;
+}
+
+void BucketStorage::rotateLocked(
+    uint8_t bucket,
+    uint32_t position,
+    std::vector<std::shared_ptr<DataBlock>>& released) {
+  // Need this lock to prevent reading from deleted memory in fetch.
+  folly::RWSpinLock::WriteHolder writeGuard(data_[bucket].fetchLock);
+  auto& pages = data_[bucket].pages;
+
+  if (data_[bucket].mapped) {
+    // Mapped pages are read-only. Unmaps the file once the last
+    // reader is done with it.
+    std::move(pages.begin(), pages.end(), std::back_inserter(released));
+    pages.clear();
+    data_[bucket].mapped = false;
+  } else if (data_[bucket].activePages < pages.size()) {
+    // Only delete memory if the pages were not fully used the
+    // previous time around. This means that if there's a spike in
+    // the amount of data on day 1, the extra memory will be freed
+    // on day 3.
+    std::move(
+        pages.begin() + data_[bucket].activePages,
+        pages.end(),
+        std::back_inserter(released));
+    pages.resize(data_[bucket].activePages);
+  }
+
+  // The groups inflated from a compressed bucket age out of the cache.
+  if (data_[bucket].compressed) {
+    std::vector<std::unique_ptr<folly::IOBuf>>().swap(
+        data_[bucket].compressedGroups);
+    data_[bucket].compressedBytes = 0;
+    data_[bucket].compressed = false;
+  }
 
-      GorillaStatsManager::addStatValue(kDedupedTimeSeriesSize, dataLength);
-      break;
+  std::vector<std::shared_ptr<DataBlock>> prepared;
+  if (data_[bucket].preparedPosition == position) {
+    prepared.swap(data_[bucket].preparedPages);
+    data_[bucket].timeSeriesIds.swap(data_[bucket].preparedTimeSeriesIds);
+    data_[bucket].storageIds.swap(data_[bucket].preparedStorageIds);
+    std::swap(data_[bucket].dedupTable, data_[bucket].preparedDedupTable);
+  } else {
+    data_[bucket].dedupTable.reset(lastBucketBlocks_);
+    GorillaStatsManager::addStatValue(kUnpreparedRotations);
+  }
+
+  // Pages that are still referenced by fetchBuffer() results are
+  // left to them.
+  for (auto& page : pages) {
+    if (page && page.use_count() > 1) {
+      if (prepared.empty()) {
+        page = DataBlockAllocator::allocate();
+      } else {
+        page = std::move(prepared.back());
+        prepared.pop_back();
+      }
     }
   }
+  std::move(prepared.begin(), prepared.end(), std::back_inserter(pages));
+
+  // Whatever was prepared for an older position is of no use anymore.
+  std::move(
+      data_[bucket].preparedPages.begin(),
+      data_[bucket].preparedPages.end(),
+      std::back_inserter(released));
+  data_[bucket].preparedPages.clear();
+  data_[bucket].preparedPosition = 0;
+  std::vector<uint32_t>().swap(data_[bucket].preparedTimeSeriesIds);
+  std::vector<BucketStorageId>().swap(data_[bucket].preparedStorageIds);
+  data_[bucket].preparedDedupTable.release();
+
+  data_[bucket].activePages = 0;
+  data_[bucket].lastPageBytesUsed = 0;
+  data_[bucket].position = position;
+  data_[bucket].storageIds.clear();
+  data_[bucket].timeSeriesIds.clear();
+  data_[bucket].finalized = false;
+  data_[bucket].backfilled = false;
+}
 
-  if (id == kInvalidId) {
-    if (data_[bucket].activePages == 0 ||
-        data_[bucket].lastPageBytesUsed + dataLength > kPageSize) {
-      if (data_[bucket].activePages == data_[bucket].pages.size()) {
-        // All allocated pages used, need to allocate more pages.
-        if (data_[bucket].pages.size() == kMaxPageCount) {
-          LOG(ERROR) << "All pages are already in use.";
-          return kInvalidId;
-        }
+bool BucketStorage::prepareBucket(uint32_t position) {
+  if (position == 0) {
+    return false;
+  }
+
+  // Sized like the previous position, which is still open or was just
+  // finalized.
+  uint32_t pagesNeeded = 0;
+  const uint8_t previous = (position - 1) % numBuckets_;
+  {
+    std::lock_guard<std::mutex> guard(data_[previous].pagesMutex);
+    if (data_[previous].position == position - 1) {
+      pagesNeeded = data_[previous].activePages;
+    }
+  }
+  const uint32_t blocks = lastBucketBlocks_;
+
+  const uint8_t bucket = position % numBuckets_;
+  uint32_t reusable = 0;
+  {
+    std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+    if (data_[bucket].disabled || data_[bucket].position >= position ||
+        data_[bucket].preparedPosition == position) {
+      return false;
+    }
 
-        data_[bucket].pages.emplace_back(new DataBlock);
+    if (!data_[bucket].mapped) {
+      const auto& pages = data_[bucket].pages;
+      for (uint32_t i = 0;
+           i < std::min<size_t>(data_[bucket].activePages, pages.size());
+           i++) {
+        if (pages[i] && pages[i].use_count() == 1) {
+          reusable++;
+        }
       }
+    }
+  }
+
+  // Allocated and faulted in without holding any lock.
+  std::vector<std::shared_ptr<DataBlock>> pages;
+  for (uint32_t i = reusable; i < pagesNeeded; i++) {
+    pages.push_back(DataBlockAllocator::allocate());
+    for (uint32_t offset = 0; offset < kPageSize; offset += kSystemPageSize) {
+      pages.back()->data[offset] = 0;
+    }
+  }
+  std::vector<uint32_t> timeSeriesIds;
+  std::vector<BucketStorageId> storageIds;
+  timeSeriesIds.reserve(blocks);
+  storageIds.reserve(blocks);
+  BlockDedupTable dedupTable;
+  dedupTable.reset(blocks);
 
-      // Use the next page.
-      data_[bucket].activePages++;
-      data_[bucket].lastPageBytesUsed = 0;
+  const size_t preparedPages = pages.size();
+
+  // Freed after the pages mutex is released.
+  std::vector<std::shared_ptr<DataBlock>> released;
+  {
+    std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+    if (data_[bucket].disabled || data_[bucket].position >= position) {
+      return false;
     }
 
-    pageIndex = data_[bucket].activePages - 1;
-    pageOffset = data_[bucket].lastPageBytesUsed;
-    data_[bucket].lastPageBytesUsed += dataLength;
+    released.swap(data_[bucket].preparedPages);
+    data_[bucket].preparedPages.swap(pages);
+    data_[bucket].preparedTimeSeriesIds.swap(timeSeriesIds);
+    data_[bucket].preparedStorageIds.swap(storageIds);
+    std::swap(data_[bucket].preparedDedupTable, dedupTable);
+    data_[bucket].preparedPosition = position;
+  }
 
-    memcpy(data_[bucket].pages[pageIndex]->data + pageOffset, data, dataLength);
-    id = createId(pageIndex, pageOffset, dataLength, itemCount);
-    data_[bucket].storageIdsLookupMap.insert(std::make_pair(hash, id));
-    GorillaStatsManager::addStatValue(kWrittenTimeSeriesSize, dataLength);
+  GorillaStatsManager::addStatValue(kPreparedPages, preparedPages);
+  return true;
+}
+
+BucketStorage::BucketStorageId BucketStorage::storeBackfill(
+    uint32_t position,
+    const char* data,
+    uint32_t dataLength,
+    uint32_t itemCount) {
+  if (dataLength > (uint64_t)kMaxDataLength * kMaxLargeBlockChunks) {
+    LOG(ERROR) << "Attempted to backfill too much data. Length : "
+               << dataLength << " Count : " << itemCount;
+    return kInvalidId;
   }
-  data_[bucket].timeSeriesIds.push_back(timeSeriesId);
-  data_[bucket].storageIds.push_back(id);
 
+  uint8_t bucket = position % numBuckets_;
+
+  // Freed after the pages mutex is released.
+  std::vector<std::shared_ptr<DataBlock>> released;
+  std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+  if (data_[bucket].disabled) {
+    return kInvalidId;
+  }
+
+  // Buckets that didn't get any data still hold an older position.
+  if (data_[bucket].position < position) {
+    rotateLocked(bucket, position, released);
+    newestPosition_ = std::max<int>(newestPosition_, position);
+  }
+
+  if (data_[bucket].position != position || data_[bucket].mapped ||
+      data_[bucket].compressed) {
+    return kInvalidId;
+  }
+
+  // Readers index the pages without the pages mutex.
+  folly::RWSpinLock::WriteHolder writeGuard(data_[bucket].fetchLock);
+  if (!data_[bucket].backfilled) {
+    data_[bucket].lastPageBytesUsed = kPageSize;
+    data_[bucket].backfilled = true;
+  }
+
+  if (dataLength > kMaxDataLength || itemCount > kMaxItemCount) {
+    return storeLargeLocked(bucket, data, dataLength, itemCount);
+  }
+
+  BucketStorageId id = writeLocked(bucket, data, dataLength, itemCount);
+  if (id != kInvalidId) {
+    writtenTimeSeriesSizeStat.add(dataLength);
+  }
   return id;
 }
 
+bool BucketStorage::writeBlockFile(
+    uint32_t position,
+    const std::vector<uint32_t>& timeSeriesIds,
+    const std::vector<BucketStorageId>& storageIds) {
+  const uint8_t bucket = position % numBuckets_;
+  std::vector<std::shared_ptr<DataBlock>> pages;
+  uint32_t activePages;
+  {
+    std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+
+    // The file of a mapped bucket can't be replaced under the mapping,
+    // and compressed buckets don't have pages to write.
+    if (data_[bucket].disabled || data_[bucket].position != position ||
+        data_[bucket].mapped || data_[bucket].compressed) {
+      LOG(ERROR) << "Can't write the block file of bucket " << position;
+      return false;
+    }
+
+    pages = data_[bucket].pages;
+    activePages = data_[bucket].activePages;
+  }
+
+  if (activePages > 0 && timeSeriesIds.size() > 0) {
+    write(position, pages, activePages, timeSeriesIds, storageIds);
+  }
+  return true;
+}
+
+BucketStorage::BucketStorageId BucketStorage::storeLocked(
+    uint8_t bucket,
+    const char* data,
+    uint16_t dataLength,
+    uint16_t itemCount) {
+  uint64_t hash = folly::hash::SpookyHashV2::Hash64(data, dataLength, 0);
+  BucketStorageId id = data_[bucket].dedupTable.find(
+      hash, [&](BucketStorageId match) {
+        uint32_t index, offset;
+        uint16_t length, count;
+        parseId(match, index, offset, length, count);
+        const char* stored = data_[bucket].pages[index]->data + offset;
+        return length == dataLength && count == itemCount &&
+            memcmp(data, stored, dataLength) == 0;
+      });
+  if (id != kInvalidId) {
+    dedupedTimeSeriesSizeStat.add(dataLength);
+  }
+
+  if (id == kInvalidId) {
+    id = writeLocked(bucket, data, dataLength, itemCount);
+    if (id != kInvalidId) {
+      data_[bucket].dedupTable.insert(hash, id);
+      writtenTimeSeriesSizeStat.add(dataLength);
+    }
+  }
+  return id;
+}
+
+BucketStorage::BucketStorageId BucketStorage::storeLargeLocked(
+    uint8_t bucket,
+    const char* data,
+    uint32_t dataLength,
+    uint32_t itemCount) {
+  // The chunks aren't deduped, as large blocks are rare.
+  std::string descriptor;
+  descriptor.append(
+      reinterpret_cast<const char*>(&dataLength), sizeof(dataLength));
+  descriptor.append(
+      reinterpret_cast<const char*>(&itemCount), sizeof(itemCount));
+  for (uint32_t offset = 0; offset < dataLength; offset += kMaxDataLength) {
+    uint16_t length = std::min<uint32_t>(kMaxDataLength, dataLength - offset);
+    BucketStorageId chunk = writeLocked(bucket, data + offset, length, 0);
+    if (chunk == kInvalidId) {
+      return kInvalidId;
+    }
+    descriptor.append(reinterpret_cast<const char*>(&chunk), sizeof(chunk));
+  }
+
+  BucketStorageId id =
+      writeLocked(bucket, descriptor.data(), descriptor.size(), 0);
+  if (id == kInvalidId) {
+    return kInvalidId;
+  }
+  writtenTimeSeriesSizeStat.add(dataLength);
+  GorillaStatsManager::addStatValue(kLargeBlocks);
+  return id | kLargeBlockFlag;
+}
+
+BucketStorage::BucketStorageId BucketStorage::writeLocked(
+    uint8_t bucket,
+    const char* data,
+    uint16_t dataLength,
+    uint16_t itemCount) {
+  if (data_[bucket].activePages == 0 ||
+      data_[bucket].lastPageBytesUsed + dataLength > kPageSize) {
+    if (data_[bucket].activePages == data_[bucket].pages.size()) {
+      // All allocated pages used, need to allocate more pages.
+      if (data_[bucket].pages.size() == kMaxPageCount) {
+        LOG(ERROR) << "All pages are already in use.";
+        return kInvalidId;
+      }
+
+      data_[bucket].pages.push_back(DataBlockAllocator::allocate());
+    }
+
+    // Use the next page.
+    data_[bucket].activePages++;
+    data_[bucket].lastPageBytesUsed = 0;
+  }
+
+  uint32_t pageIndex = data_[bucket].activePages - 1;
+  uint32_t pageOffset = data_[bucket].lastPageBytesUsed;
+  data_[bucket].lastPageBytesUsed += dataLength;
+
+  memcpy(data_[bucket].pages[pageIndex]->data + pageOffset, data, dataLength);
+  return createId(pageIndex, pageOffset, dataLength, itemCount);
+}
+
 BucketStorage::FetchStatus BucketStorage::fetch(
     uint32_t position,
     BucketStorage::BucketStorageId id,
     std::string& data,
-    uint16_t& itemCount) {
+    uint32_t& itemCount) {
   if (id == kInvalidId || id == kDisabledId) {
     return FAILURE;
   }
 
-  uint32_t pageIndex;
-  uint32_t pageOffset;
-  uint16_t dataLength;
-  parseId(id, pageIndex, pageOffset, dataLength, itemCount);
   uint8_t bucket = position % numBuckets_;
+  folly::RWSpinLock::ReadHolder readGuard(&data_[bucket].fetchLock);
+  if (!canFetch(bucket, position)) {
+    return FAILURE;
+  }
+
+  return fetchLocked(bucket, id, data, itemCount);
+}
+
+void BucketStorage::fetchMany(
+    uint32_t position,
+    const std::vector<BucketStorageId>& ids,
+    std::vector<std::string>& data,
+    std::vector<uint32_t>& itemCounts,
+    std::vector<FetchStatus>& statuses) {
+  data.resize(ids.size());
+  itemCounts.assign(ids.size(), 0);
+  statuses.assign(ids.size(), FAILURE);
+
+  fetchViews(
+      position, ids, [&](size_t i, folly::StringPiece view, uint32_t count) {
+        data[i].assign(view.data(), view.size());
+        itemCounts[i] = count;
+        statuses[i] = SUCCESS;
+      });
+}
+
+void BucketStorage::sortByPage(
+    const std::vector<BucketStorageId>& ids,
+    std::vector<uint32_t>& order) {
+  order.clear();
+  order.reserve(ids.size());
+  for (uint32_t i = 0; i < ids.size(); i++) {
+    if (ids[i] != kInvalidId && ids[i] != kDisabledId) {
+      order.push_back(i);
+    }
+  }
+
+  // The page index and the offset are the top bits of the id after the
+  // large block flag. Ids of a bucket written in order are sorted
+  // already.
+  auto pageOrder = [&](uint32_t a, uint32_t b) {
+    return (ids[a] & ~kLargeBlockFlag) < (ids[b] & ~kLargeBlockFlag);
+  };
+  if (!std::is_sorted(order.begin(), order.end(), pageOrder)) {
+    std::sort(order.begin(), order.end(), pageOrder);
+  }
+}
+
+bool BucketStorage::canFetch(uint8_t bucket, uint32_t position) {
+  if (data_[bucket].disabled) {
+    return false;
+  }
+
+  if (data_[bucket].position != position && data_[bucket].position != 0) {
+    VLOG(0) << "Tried to fetch data for an expired bucket:" << bucket
+            << " position:" << position;
+    GorillaStatsManager::addStatValue(kExpiredBucketFetch, 1);
+    return false;
+  }
+
+  return true;
+}
+
+DataBlock* BucketStorage::findBlock(
+    uint8_t bucket,
+    BucketStorage::BucketStorageId id,
+    uint32_t& pageIndex,
+    uint32_t& pageOffset,
+    uint16_t& dataLength,
+    uint16_t& itemCount,
+    std::shared_ptr<DataBlock>& pin) {
+  parseId(id, pageIndex, pageOffset, dataLength, itemCount);
 
   if (pageOffset + dataLength > kPageSize) {
     LOG(ERROR) << "Corrupt storage id:" << id << " pageIndex:" << pageIndex
                << " pageOffset:" << pageOffset << " dataLength:" << dataLength
                << " itemCount:" << itemCount;
+    return nullptr;
+  }
+
+  if (data_[bucket].compressed) {
+    pin = inflatePage(bucket, pageIndex);
+    return pin.get();
+  }
+
+  if (pageIndex < data_[bucket].pages.size()) {
+    return data_[bucket].pages[pageIndex].get();
+  }
+
+  return nullptr;
+}
+
+std::shared_ptr<DataBlock> BucketStorage::inflatePage(
+    uint8_t bucket,
+    uint32_t pageIndex) {
+  const BucketData& data = data_[bucket];
+  const uint32_t groupIndex = pageIndex / data.compressedGroupPages;
+  if (pageIndex >= data.activePages ||
+      groupIndex >= data.compressedGroups.size()) {
+    return nullptr;
+  }
+
+  const uint32_t first = groupIndex * data.compressedGroupPages;
+  const uint64_t key = data.compressedKey + groupIndex;
+  auto& cache = getInflatedPageCache();
+  std::shared_ptr<folly::IOBuf> group = cache.get(key);
+  if (!group) {
+    const auto& compressed = data.compressedGroups[groupIndex];
+    try {
+      group = BlockFileCodec::uncompress(
+          folly::ByteRange(compressed->data(), compressed->length()));
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Inflating page group " << groupIndex << " of bucket "
+                 << data.position << " failed: " << e.what();
+      return nullptr;
+    }
+
+    const uint32_t count =
+        std::min(data.compressedGroupPages, data.activePages - first);
+    if (group->length() != count * (size_t)kPageSize) {
+      LOG(ERROR) << "Corrupt page group " << groupIndex << " of bucket "
+                 << data.position << " length:" << group->length();
+      return nullptr;
+    }
+    cache.put(key, group);
+  }
+
+  // The page shares ownership of the group, so it stays valid after the
+  // group is evicted.
+  return std::shared_ptr<DataBlock>(
+      group, (DataBlock*)(group->data() + (pageIndex - first) * kPageSize));
+}
+
+BucketStorage::FetchStatus BucketStorage::fetchLocked(
+    uint8_t bucket,
+    BucketStorage::BucketStorageId id,
+    std::string& data,
+    uint32_t& itemCount) {
+  if (id & kLargeBlockFlag) {
+    return fetchLargeLocked(bucket, id & ~kLargeBlockFlag, data, itemCount);
+  }
+
+  uint32_t pageIndex;
+  uint32_t pageOffset;
+  uint16_t dataLength;
+  uint16_t count;
+  std::shared_ptr<DataBlock> pin;
+  DataBlock* page =
+      findBlock(bucket, id, pageIndex, pageOffset, dataLength, count, pin);
+  if (!page) {
     return FAILURE;
   }
 
-  folly::RWSpinLock::ReadHolder readGuard(&data_[bucket].fetchLock);
-  if (data_[bucket].disabled) {
+  data.assign(page->data + pageOffset, dataLength);
+  itemCount = count;
+  return SUCCESS;
+}
+
+BucketStorage::FetchStatus BucketStorage::viewLocked(
+    uint8_t bucket,
+    BucketStorage::BucketStorageId id,
+    folly::StringPiece& data,
+    uint32_t& itemCount,
+    std::string& scratch,
+    std::shared_ptr<DataBlock>& pin) {
+  if (id & kLargeBlockFlag) {
+    if (fetchLargeLocked(bucket, id & ~kLargeBlockFlag, scratch, itemCount) !=
+        SUCCESS) {
+      return FAILURE;
+    }
+    data = scratch;
+    return SUCCESS;
+  }
+
+  uint32_t pageIndex;
+  uint32_t pageOffset;
+  uint16_t dataLength;
+  uint16_t count;
+  DataBlock* page =
+      findBlock(bucket, id, pageIndex, pageOffset, dataLength, count, pin);
+  if (!page) {
     return FAILURE;
   }
 
-  if (data_[bucket].position != position && data_[bucket].position != 0) {
-    VLOG(0) << "Tried to fetch data for an expired bucket:" << bucket
-            << " position:" << position;
-    GorillaStatsManager::addStatValue(kExpiredBucketFetch, 1);
+  data = folly::StringPiece(page->data + pageOffset, dataLength);
+  itemCount = count;
+  return SUCCESS;
+}
+
+BucketStorage::FetchStatus BucketStorage::fetchLargeLocked(
+    uint8_t bucket,
+    BucketStorage::BucketStorageId descriptorId,
+    std::string& data,
+    uint32_t& itemCount) {
+  uint32_t pageIndex;
+  uint32_t pageOffset;
+  uint16_t descriptorLength;
+  uint16_t unused;
+  std::shared_ptr<DataBlock> descriptorPin;
+  DataBlock* page = findBlock(
+      bucket,
+      descriptorId,
+      pageIndex,
+      pageOffset,
+      descriptorLength,
+      unused,
+      descriptorPin);
+  if (!page || descriptorLength < kLargeBlockHeaderSize ||
+      (descriptorLength - kLargeBlockHeaderSize) % sizeof(BucketStorageId)) {
+    LOG(ERROR) << "Corrupt large block descriptor:" << descriptorId;
+    return FAILURE;
+  }
+
+  const char* descriptor = page->data + pageOffset;
+  uint32_t dataLength;
+  memcpy(&dataLength, descriptor, sizeof(uint32_t));
+  memcpy(&itemCount, descriptor + sizeof(uint32_t), sizeof(uint32_t));
+
+  data.clear();
+  data.reserve(dataLength);
+  std::shared_ptr<DataBlock> chunkPin;
+  for (uint32_t offset = kLargeBlockHeaderSize; offset < descriptorLength;
+       offset += sizeof(BucketStorageId)) {
+    BucketStorageId chunk;
+    memcpy(&chunk, descriptor + offset, sizeof(chunk));
+    uint16_t chunkLength;
+    page = findBlock(
+        bucket, chunk, pageIndex, pageOffset, chunkLength, unused, chunkPin);
+    if (!page) {
+      return FAILURE;
+    }
+    data.append(page->data + pageOffset, chunkLength);
+  }
+
+  if (data.size() != dataLength) {
+    LOG(ERROR) << "Corrupt large block descriptor:" << descriptorId
+               << " length:" << dataLength << " chunks:" << data.size();
     return FAILURE;
   }
+  return SUCCESS;
+}
 
-  if (pageIndex < data_[bucket].pages.size() &&
-      data_[bucket].pages[pageIndex]) {
-    data.assign(data_[bucket].pages[pageIndex]->data + pageOffset, dataLength);
+BucketStorage::FetchStatus BucketStorage::fetchBuffer(
+    uint32_t position,
+    BucketStorage::BucketStorageId id,
+    std::unique_ptr<folly::IOBuf>& data,
+    uint32_t& itemCount) {
+  if (id == kInvalidId || id == kDisabledId) {
+    return FAILURE;
+  }
+
+  uint8_t bucket = position % numBuckets_;
+  folly::RWSpinLock::ReadHolder readGuard(&data_[bucket].fetchLock);
+  if (!canFetch(bucket, position)) {
+    return FAILURE;
+  }
+
+  if (id & kLargeBlockFlag) {
+    // Large blocks span pages, so they are copied.
+    std::string copy;
+    if (fetchLargeLocked(bucket, id & ~kLargeBlockFlag, copy, itemCount) !=
+        SUCCESS) {
+      return FAILURE;
+    }
+    data = folly::IOBuf::copyBuffer(copy.data(), copy.size());
     return SUCCESS;
   }
 
-  return FAILURE;
+  uint32_t pageIndex;
+  uint32_t pageOffset;
+  uint16_t dataLength;
+  uint16_t count;
+  std::shared_ptr<DataBlock> inflated;
+  DataBlock* page =
+      findBlock(bucket, id, pageIndex, pageOffset, dataLength, count, inflated);
+  if (!page) {
+    return FAILURE;
+  }
+  itemCount = count;
+
+  // The IOBuf owns a reference to the page.
+  auto* pin = new std::shared_ptr<DataBlock>(
+      inflated ? std::move(inflated) : data_[bucket].pages[pageIndex]);
+  data = folly::IOBuf::takeOwnership(
+      page->data + pageOffset,
+      dataLength,
+      [](void*, void* userData) {
+        delete static_cast<std::shared_ptr<DataBlock>*>(userData);
+      },
+      pin);
+  return SUCCESS;
 }
 
 bool BucketStorage::loadPosition(
@@ -253,6 +909,7 @@ bool BucketStorage::loadPosition(
 
   data_[bucket].pages.resize(blocks.size());
   data_[bucket].activePages = blocks.size();
+  data_[bucket].mapped = false;
 
   for (int i = 0; i < blocks.size(); i++) {
     data_[bucket].pages[i] = std::move(blocks[i]);
@@ -261,6 +918,7 @@ bool BucketStorage::loadPosition(
 }
 
 void BucketStorage::clearAndDisable() {
+  dataBlockReader_.clearPrefetched();
   for (int i = 0; i < numBuckets_; i++) {
     std::unique_lock<std::mutex> guard(data_[i].pagesMutex);
     folly::RWSpinLock::WriteHolder writeGuard(data_[i].fetchLock);
@@ -269,9 +927,19 @@ void BucketStorage::clearAndDisable() {
     std::vector<std::shared_ptr<DataBlock>>().swap(data_[i].pages);
     data_[i].activePages = 0;
     data_[i].lastPageBytesUsed = 0;
-    std::unordered_multimap<uint64_t, uint64_t>().swap(
-        data_[i].storageIdsLookupMap);
+    data_[i].dedupTable.release();
+    std::vector<std::shared_ptr<DataBlock>>().swap(data_[i].preparedPages);
+    std::vector<uint32_t>().swap(data_[i].preparedTimeSeriesIds);
+    std::vector<BucketStorageId>().swap(data_[i].preparedStorageIds);
+    data_[i].preparedDedupTable.release();
+    data_[i].preparedPosition = 0;
     data_[i].finalized = false;
+    data_[i].mapped = false;
+    data_[i].backfilled = false;
+    std::vector<std::unique_ptr<folly::IOBuf>>().swap(
+        data_[i].compressedGroups);
+    data_[i].compressedBytes = 0;
+    data_[i].compressed = false;
   }
 }
 
@@ -283,6 +951,15 @@ void BucketStorage::enable() {
     data_[i].disabled = false;
     data_[i].activePages = 0;
     data_[i].lastPageBytesUsed = 0;
+    if (data_[i].mapped) {
+      data_[i].pages.clear();
+      data_[i].mapped = false;
+    }
+    if (data_[i].compressed) {
+      data_[i].compressedGroups.clear();
+      data_[i].compressedBytes = 0;
+      data_[i].compressed = false;
+    }
   }
 }
 
@@ -321,7 +998,28 @@ void BucketStorage::parseId(
   itemCount = id & kMaxItemCount;
 }
 
-void BucketStorage::finalizeBucket(uint32_t position) {
+uint32_t BucketStorage::getDataLength(BucketStorageId id) {
+  if (id == kInvalidId || id == kDisabledId) {
+    return 0;
+  }
+
+  uint32_t pageIndex;
+  uint32_t pageOffset;
+  uint16_t dataLength;
+  uint16_t itemCount;
+  parseId(id & ~kLargeBlockFlag, pageIndex, pageOffset, dataLength, itemCount);
+  if (id & kLargeBlockFlag) {
+    // The descriptor has the ids of the chunks after the header.
+    return (dataLength - kLargeBlockHeaderSize) / sizeof(BucketStorageId) *
+        kMaxDataLength;
+  }
+  return dataLength;
+}
+
+void BucketStorage::finalizeBucket(
+    uint32_t position,
+    const std::function<bool(uint32_t timeSeriesId, BucketStorageId id)>&
+        keep) {
   std::vector<std::shared_ptr<DataBlock>> pages;
   std::vector<uint32_t> timeSeriesIds;
   std::vector<BucketStorageId> storageIds;
@@ -348,21 +1046,267 @@ void BucketStorage::finalizeBucket(uint32_t position) {
       return;
     }
 
+    // Every stored block that wasn't added to the dedup table was a
+    // duplicate.
+    const auto& dedupTable = data_[bucket].dedupTable;
+    const uint64_t blocks = data_[bucket].storageIds.size();
+    if (blocks > 0) {
+      lastBucketDedupHitRate_ = 100 * (blocks - dedupTable.size()) / blocks;
+      GorillaStatsManager::addStatValue(kDedupHitRate, lastBucketDedupHitRate_);
+      GorillaStatsManager::addStatValue(
+          kDedupTableLoad, 100 * dedupTable.size() / dedupTable.capacity());
+    }
+    lastBucketBlocks_ = blocks;
+
     pages = data_[bucket].pages;
     timeSeriesIds = std::move(data_[bucket].timeSeriesIds);
     storageIds = std::move(data_[bucket].storageIds);
     activePages = data_[bucket].activePages;
     std::vector<uint32_t>().swap(data_[bucket].timeSeriesIds);
     std::vector<BucketStorageId>().swap(data_[bucket].storageIds);
-    std::unordered_multimap<uint64_t, uint64_t>().swap(
-        data_[bucket].storageIdsLookupMap);
+    data_[bucket].dedupTable.release();
 
     data_[bucket].finalized = true;
   }
 
+  // Outside of the pages mutex, as `keep` might lock the time series,
+  // which store() is called with locked.
+  uint32_t dropped = 0;
+  if (keep) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < timeSeriesIds.size(); i++) {
+      if (keep(timeSeriesIds[i], storageIds[i])) {
+        timeSeriesIds[kept] = timeSeriesIds[i];
+        storageIds[kept] = storageIds[i];
+        kept++;
+      }
+    }
+    dropped = timeSeriesIds.size() - kept;
+    timeSeriesIds.resize(kept);
+    storageIds.resize(kept);
+    GorillaStatsManager::addStatValue(kDroppedBlocks, dropped);
+  }
+
   if (activePages > 0 && timeSeriesIds.size() > 0) {
-    write(position, pages, activePages, timeSeriesIds, storageIds);
+    write(
+        position, pages, activePages, timeSeriesIds, storageIds, dropped > 0);
+  }
+
+  if (FLAGS_mmap_bucket_age > 0 && FLAGS_mmap_bucket_age < numBuckets_ &&
+      position > FLAGS_mmap_bucket_age) {
+    mapBucket(position - FLAGS_mmap_bucket_age);
+  }
+
+  if (FLAGS_compress_bucket_age > 0 &&
+      FLAGS_compress_bucket_age < numBuckets_ &&
+      position > FLAGS_compress_bucket_age) {
+    compressBucket(position - FLAGS_compress_bucket_age);
+  }
+}
+
+bool BucketStorage::mapOldestBucket() {
+  std::vector<uint32_t> positions;
+  for (int i = 0; i < numBuckets_; i++) {
+    std::lock_guard<std::mutex> guard(data_[i].pagesMutex);
+    if (!data_[i].disabled && data_[i].finalized && !data_[i].mapped &&
+        !data_[i].compressed && data_[i].activePages > 0) {
+      positions.push_back(data_[i].position);
+    }
+  }
+
+  std::sort(positions.begin(), positions.end());
+  for (uint32_t position : positions) {
+    if (mapBucket(position)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BucketStorage::mapBucket(uint32_t position) {
+  const uint8_t bucket = position % numBuckets_;
+  uint32_t activePages;
+  {
+    std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+    if (data_[bucket].disabled || data_[bucket].position != position ||
+        !data_[bucket].finalized || data_[bucket].mapped ||
+        data_[bucket].compressed || data_[bucket].activePages == 0) {
+      return false;
+    }
+    activePages = data_[bucket].activePages;
+  }
+
+  auto dataFile = dataFiles_.open(position, "rb", 0);
+  if (!dataFile.file) {
+    GorillaStatsManager::addStatValue(kMappedBucketFailures, 1);
+    return false;
+  }
+
+  int fd = fileno(dataFile.file);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < BlockFileCodec::kHeaderSize) {
+    PLOG(ERROR) << "Can't map data block file " << dataFile.name;
+    FileUtils::closeFile(dataFile, false);
+    GorillaStatsManager::addStatValue(kMappedBucketFailures, 1);
+    return false;
+  }
+
+  size_t fileSize = st.st_size;
+  void* addr = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+  FileUtils::closeFile(dataFile, false);
+  if (addr == MAP_FAILED) {
+    PLOG(ERROR) << "Mapping data block file " << dataFile.name << " failed";
+    GorillaStatsManager::addStatValue(kMappedBucketFailures, 1);
+    return false;
+  }
+
+  // The pages share ownership of the mapping, so readers that still
+  // hold one keep the file mapped after the bucket expires.
+  std::shared_ptr<char> mapping(
+      (char*)addr, [fileSize](char* p) { munmap(p, fileSize); });
+
+  BlockFileCodec::Type codec;
+  try {
+    if (!BlockFileCodec::readHeader(
+            folly::ByteRange((const uint8_t*)addr, fileSize), codec) ||
+        codec != BlockFileCodec::Type::NONE) {
+      // The block file is compressed, so the pages stay in memory.
+      return false;
+    }
+  } catch (std::exception& e) {
+    LOG(ERROR) << e.what();
+    GorillaStatsManager::addStatValue(kMappedBucketFailures, 1);
+    return false;
+  }
+
+  const char* ptr = mapping.get() + BlockFileCodec::kHeaderSize;
+  uint32_t count;
+  uint32_t filePages;
+  memcpy(&count, ptr, sizeof(uint32_t));
+  memcpy(&filePages, ptr + sizeof(uint32_t), sizeof(uint32_t));
+  if (filePages & ColumnarPages::kPageCountFlag) {
+    // Blocks were cut out of the pages in the file.
+    return false;
+  }
+  size_t pagesOffset = BlockFileCodec::kHeaderSize + sizeof(uint32_t) +
+      sizeof(uint32_t) + count * sizeof(uint32_t) + count * sizeof(uint64_t);
+  if (filePages != activePages ||
+      pagesOffset + (size_t)filePages * kDataBlockSize != fileSize) {
+    LOG(ERROR) << "Unexpected size for data block file " << dataFile.name;
+    GorillaStatsManager::addStatValue(kMappedBucketFailures, 1);
+    return false;
+  }
+
+  std::vector<std::shared_ptr<DataBlock>> pages(activePages);
+  for (int i = 0; i < activePages; i++) {
+    pages[i] = std::shared_ptr<DataBlock>(
+        mapping,
+        (DataBlock*)(mapping.get() + pagesOffset + i * kDataBlockSize));
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+    folly::RWSpinLock::WriteHolder writeGuard(data_[bucket].fetchLock);
+
+    // The bucket might have rotated while the file was being mapped.
+    if (data_[bucket].disabled || data_[bucket].position != position ||
+        !data_[bucket].finalized || data_[bucket].mapped ||
+        data_[bucket].compressed || data_[bucket].activePages != activePages) {
+      return false;
+    }
+
+    // The old pages are freed when `pages` goes out of scope, outside
+    // of the locks.
+    data_[bucket].pages.swap(pages);
+    data_[bucket].mapped = true;
   }
+
+  GorillaStatsManager::addStatValue(kMappedBuckets, 1);
+  return true;
+}
+
+bool BucketStorage::compressBucket(uint32_t position) {
+  BlockFileCodec::Type codec;
+  if (!BlockFileCodec::parse(FLAGS_compressed_bucket_codec, codec) ||
+      codec == BlockFileCodec::Type::NONE) {
+    LOG(ERROR) << "Invalid codec for compressed buckets: "
+               << FLAGS_compressed_bucket_codec;
+    return false;
+  }
+
+  const uint8_t bucket = position % numBuckets_;
+  std::vector<std::shared_ptr<DataBlock>> pages;
+  uint32_t activePages;
+  uint32_t lastPageBytesUsed;
+  {
+    std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+    if (data_[bucket].disabled || data_[bucket].position != position ||
+        !data_[bucket].finalized || data_[bucket].mapped ||
+        data_[bucket].compressed || data_[bucket].activePages == 0) {
+      return false;
+    }
+    pages = data_[bucket].pages;
+    activePages = data_[bucket].activePages;
+    lastPageBytesUsed = data_[bucket].lastPageBytesUsed;
+  }
+
+  // Compressed without the locks. Backfilled blocks only go after the
+  // used bytes, and the bucket is left as is if any were stored.
+  const uint32_t groupPages = std::max(FLAGS_compressed_page_group, 1);
+  std::vector<std::unique_ptr<folly::IOBuf>> groups;
+  uint64_t compressedBytes = 0;
+  std::string group;
+  try {
+    for (uint32_t first = 0; first < activePages; first += groupPages) {
+      const uint32_t count = std::min(groupPages, activePages - first);
+      group.resize(count * (size_t)kPageSize);
+      for (uint32_t i = 0; i < count; i++) {
+        memcpy(
+            &group[i * (size_t)kPageSize], pages[first + i]->data, kPageSize);
+      }
+      groups.push_back(BlockFileCodec::compress(
+          folly::ByteRange((const uint8_t*)group.data(), group.size()),
+          codec,
+          0));
+      compressedBytes += groups.back()->length();
+    }
+  } catch (std::exception& e) {
+    LOG(ERROR) << "Compressing bucket " << position << " failed: " << e.what();
+    GorillaStatsManager::addStatValue(kCompressedBucketFailures, 1);
+    return false;
+  }
+
+  if (compressedBytes >= activePages * (uint64_t)kPageSize) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(data_[bucket].pagesMutex);
+    folly::RWSpinLock::WriteHolder writeGuard(data_[bucket].fetchLock);
+
+    // The bucket might have rotated or been backfilled meanwhile.
+    if (data_[bucket].disabled || data_[bucket].position != position ||
+        !data_[bucket].finalized || data_[bucket].mapped ||
+        data_[bucket].compressed ||
+        data_[bucket].activePages != activePages ||
+        data_[bucket].lastPageBytesUsed != lastPageBytesUsed) {
+      return false;
+    }
+
+    // The old pages are freed when `pages` goes out of scope, outside
+    // of the locks, or once fetchBuffer() results are done with them.
+    pages.clear();
+    data_[bucket].pages.swap(pages);
+    data_[bucket].compressedGroups.swap(groups);
+    data_[bucket].compressedGroupPages = groupPages;
+    data_[bucket].compressedKey =
+        nextCompressedKey.fetch_add(data_[bucket].compressedGroups.size());
+    data_[bucket].compressedBytes = compressedBytes;
+    data_[bucket].compressed = true;
+  }
+
+  GorillaStatsManager::addStatValue(kCompressedBuckets, 1);
+  return true;
 }
 
 void BucketStorage::write(
@@ -370,7 +1314,8 @@ void BucketStorage::write(
     const std::vector<std::shared_ptr<DataBlock>>& pages,
     uint32_t activePages,
     const std::vector<uint32_t>& timeSeriesIds,
-    const std::vector<BucketStorageId>& storageIds) {
+    const std::vector<BucketStorageId>& storageIds,
+    bool zeroUnused) {
   CHECK_EQ(timeSeriesIds.size(), storageIds.size());
 
   // Delete files older than 24h.
@@ -384,18 +1329,37 @@ void BucketStorage::write(
   }
 
   uint32_t count = timeSeriesIds.size();
-  size_t dataLen = sizeof(uint32_t) + // count
+  size_t metadataLen = sizeof(uint32_t) + // count
       sizeof(uint32_t) + // active pages
       count * sizeof(uint32_t) + // time series ids
-      count * sizeof(uint64_t) + // storage ids
-      activePages * kDataBlockSize; // blocks
+      count * sizeof(uint64_t); // storage ids
+  size_t dataLen = metadataLen + activePages * kDataBlockSize; // blocks
 
-  std::unique_ptr<char[]> buffer(new char[dataLen]);
+  BlockFileCodec::Type codec = BlockFileCodec::Type::ZLIB;
+  if (!BlockFileCodec::parse(FLAGS_block_file_codec, codec)) {
+    LOG(ERROR) << "Unknown block file codec " << FLAGS_block_file_codec
+               << ", using zlib";
+  }
+  bool chunked = FLAGS_block_file_compression_threads > 0 &&
+      codec != BlockFileCodec::Type::NONE;
+  bool columnar = FLAGS_block_file_shared_timestamps;
+
+  // Only worth it once compressed, and uncompressed files might be
+  // mapped for readers that fetched the ids before they were left out.
+  zeroUnused = zeroUnused && codec != BlockFileCodec::Type::NONE;
+
+  // Pages are compressed straight from memory when the file is
+  // chunked, unless blocks are cut out of them or zeroed. Otherwise
+  // everything is copied to one buffer.
+  bool copyPages = !chunked || columnar || zeroUnused;
+  std::unique_ptr<char[]> buffer(new char[copyPages ? dataLen : metadataLen]);
   char* ptr = buffer.get();
 
   memcpy(ptr, &count, sizeof(uint32_t));
   ptr += sizeof(uint32_t);
-  memcpy(ptr, &activePages, sizeof(uint32_t));
+  uint32_t pageCount =
+      activePages | (columnar ? ColumnarPages::kPageCountFlag : 0);
+  memcpy(ptr, &pageCount, sizeof(uint32_t));
   ptr += sizeof(uint32_t);
 
   memcpy(ptr, &timeSeriesIds[0], sizeof(uint32_t) * count);
@@ -404,34 +1368,122 @@ void BucketStorage::write(
   memcpy(ptr, &storageIds[0], sizeof(uint64_t) * count);
   ptr += sizeof(uint64_t) * count;
 
-  for (int i = 0; i < activePages; i++) {
-    memcpy(ptr, pages[i]->data, kDataBlockSize);
-    ptr += kDataBlockSize;
+  std::vector<char*> pageCopies;
+  if (copyPages) {
+    for (int i = 0; i < activePages; i++) {
+      memcpy(ptr, pages[i]->data, kDataBlockSize);
+      pageCopies.push_back(ptr);
+      ptr += kDataBlockSize;
+    }
   }
 
-  CHECK_EQ(ptr - buffer.get(), dataLen);
+  CHECK_EQ(ptr - buffer.get(), copyPages ? dataLen : metadataLen);
+
+  if (zeroUnused) {
+    // The blocks that were left out still take their bytes in the
+    // pages, but zeroed bytes cost next to nothing once compressed.
+    uint64_t zeroed = zeroUnusedBytes(pageCopies, storageIds);
+    GorillaStatsManager::addStatValue(kZeroedBlockBytes, zeroed);
+  }
+
+  std::string columns;
+  if (columnar) {
+    // Deduplicated blocks have many ids, but are cut out only once.
+    // Chunks of large blocks aren't time series streams and stay in
+    // the pages.
+    std::vector<BucketStorageId> ids;
+    for (auto id : storageIds) {
+      if (id != kInvalidId && id != kDisabledId && !(id & kLargeBlockFlag)) {
+        ids.push_back(id);
+      }
+    }
+    std::sort(ids.begin(), ids.end());
+
+    std::vector<ColumnarPages::Block> blocks;
+    blocks.reserve(ids.size());
+    for (int i = 0; i < ids.size(); i++) {
+      ColumnarPages::Block block;
+      parseId(
+          ids[i],
+          block.pageIndex,
+          block.pageOffset,
+          block.dataLength,
+          block.itemCount);
+      if (!blocks.empty() && blocks.back().pageIndex == block.pageIndex &&
+          blocks.back().pageOffset == block.pageOffset) {
+        continue;
+      }
+      blocks.push_back(block);
+    }
+
+    uint32_t cut = ColumnarPages::encode(pageCopies, blocks, columns);
+    LOG(INFO) << "Cut " << cut << " of " << blocks.size()
+              << " blocks with shared timestamps out of the pages of "
+              << dataFile.name << " columns:" << columns.size();
+  }
 
   try {
-    auto ioBuffer = folly::IOBuf::wrapBuffer(buffer.get(), dataLen);
-    auto codec = folly::io::getCodec(
-        folly::io::CodecType::ZLIB, folly::io::COMPRESSION_LEVEL_BEST);
-    auto compressed = codec->compress(ioBuffer.get());
-    compressed->coalesce();
-
-    if (fwrite(
-            compressed->data(),
-            sizeof(char),
-            compressed->length(),
-            dataFile.file) != compressed->length()) {
-      PLOG(ERROR) << "Writing compressed data block file " << dataFile.name
-                  << " failed";
-      FileUtils::closeFile(dataFile, false);
-      return;
+    size_t compressedLen;
+    if (chunked) {
+      std::vector<folly::ByteRange> chunks;
+      chunks.emplace_back((const uint8_t*)buffer.get(), metadataLen);
+      for (int i = 0; i < activePages; i++) {
+        const char* page = copyPages ? pageCopies[i] : pages[i]->data;
+        chunks.emplace_back((const uint8_t*)page, kDataBlockSize);
+      }
+      if (!columns.empty()) {
+        chunks.emplace_back((const uint8_t*)columns.data(), columns.size());
+      }
+
+      compressedLen = BlockFileCodec::compressChunks(
+          chunks,
+          codec,
+          FLAGS_block_file_compression_level,
+          FLAGS_block_file_compression_threads,
+          [&](folly::ByteRange data) {
+            if (fwrite(data.data(), sizeof(char), data.size(), dataFile.file) !=
+                data.size()) {
+              throw std::runtime_error(
+                  "Writing compressed data block file " + dataFile.name +
+                  " failed");
+            }
+          },
+          FLAGS_block_file_checksums);
+    } else {
+      std::unique_ptr<folly::IOBuf> compressed;
+      if (columns.empty()) {
+        compressed = BlockFileCodec::compress(
+            folly::ByteRange((const uint8_t*)buffer.get(), dataLen),
+            codec,
+            FLAGS_block_file_compression_level);
+      } else {
+        std::string contents(buffer.get(), dataLen);
+        contents.append(columns);
+        compressed = BlockFileCodec::compress(
+            folly::ByteRange((const uint8_t*)contents.data(), contents.size()),
+            codec,
+            FLAGS_block_file_compression_level);
+      }
+
+      if (fwrite(
+              compressed->data(),
+              sizeof(char),
+              compressed->length(),
+              dataFile.file) != compressed->length()) {
+        PLOG(ERROR) << "Writing compressed data block file " << dataFile.name
+                    << " failed";
+        FileUtils::closeFile(dataFile, false);
+        return;
+      }
+      compressedLen = compressed->length();
     }
 
     LOG(INFO) << "Wrote compressed data block file " << dataFile.name
-              << " dataLen:" << dataLen
-              << " compressed:" << compressed->length();
+              << " dataLen:" << dataLen + columns.size()
+              << " compressed:" << compressedLen
+              << " codec:" << BlockFileCodec::name(codec)
+              << (chunked ? " chunked" : "")
+              << (chunked && FLAGS_block_file_checksums ? " checksummed" : "");
 
   } catch (std::exception& e) {
     LOG(ERROR) << e.what();
@@ -447,6 +1499,99 @@ void BucketStorage::write(
     return;
   }
   FileUtils::closeFile(completeFile, false);
+
+  if (blockFileStore_) {
+    blockFileStore_->putAsync(shardId_, position, dataDirectory_);
+  }
+}
+
+void BucketStorage::getPageIndexes(
+    BucketStorageId id,
+    const std::vector<char*>& pages,
+    std::vector<uint32_t>& out) {
+  if (id == kInvalidId || id == kDisabledId) {
+    return;
+  }
+
+  uint32_t pageIndex, pageOffset;
+  uint16_t dataLength, itemCount;
+  parseId(id & ~kLargeBlockFlag, pageIndex, pageOffset, dataLength, itemCount);
+  out.push_back(pageIndex);
+  if (!(id & kLargeBlockFlag) || pageIndex >= pages.size() ||
+      pageOffset + dataLength > kPageSize) {
+    return;
+  }
+
+  // The chunks of a large block are listed in its descriptor.
+  const char* descriptor = pages[pageIndex] + pageOffset;
+  for (uint32_t offset = kLargeBlockHeaderSize;
+       offset + sizeof(BucketStorageId) <= dataLength;
+       offset += sizeof(BucketStorageId)) {
+    BucketStorageId chunk;
+    memcpy(&chunk, descriptor + offset, sizeof(chunk));
+    parseId(chunk, pageIndex, pageOffset, dataLength, itemCount);
+    out.push_back(pageIndex);
+  }
+}
+
+uint64_t BucketStorage::zeroUnusedBytes(
+    const std::vector<char*>& pages,
+    const std::vector<BucketStorageId>& storageIds) {
+  // The [begin, end) byte ranges of each page that blocks use.
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> used(pages.size());
+  auto use = [&](BucketStorageId id) -> const char* {
+    uint32_t pageIndex, pageOffset;
+    uint16_t dataLength, itemCount;
+    parseId(id, pageIndex, pageOffset, dataLength, itemCount);
+    if (pageIndex >= pages.size() || pageOffset + dataLength > kPageSize) {
+      return nullptr;
+    }
+    used[pageIndex].emplace_back(pageOffset, pageOffset + dataLength);
+    return pages[pageIndex] + pageOffset;
+  };
+
+  for (auto id : storageIds) {
+    if (id == kInvalidId || id == kDisabledId) {
+      continue;
+    }
+    if (!(id & kLargeBlockFlag)) {
+      use(id);
+      continue;
+    }
+
+    // The chunks of a large block are listed in its descriptor.
+    const char* descriptor = use(id & ~kLargeBlockFlag);
+    uint32_t descriptorLength = getDataLength(id & ~kLargeBlockFlag);
+    if (!descriptor || descriptorLength < kLargeBlockHeaderSize) {
+      continue;
+    }
+    for (uint32_t offset = kLargeBlockHeaderSize;
+         offset + sizeof(BucketStorageId) <= descriptorLength;
+         offset += sizeof(BucketStorageId)) {
+      BucketStorageId chunk;
+      memcpy(&chunk, descriptor + offset, sizeof(chunk));
+      use(chunk);
+    }
+  }
+
+  uint64_t zeroed = 0;
+  for (uint32_t i = 0; i < pages.size(); i++) {
+    auto& ranges = used[i];
+    std::sort(ranges.begin(), ranges.end());
+    uint32_t end = 0;
+    for (const auto& range : ranges) {
+      if (range.first > end) {
+        memset(pages[i] + end, 0, range.first - end);
+        zeroed += range.first - end;
+      }
+      end = std::max(end, range.second);
+    }
+    if (end < kPageSize) {
+      memset(pages[i] + end, 0, kPageSize - end);
+      zeroed += kPageSize - end;
+    }
+  }
+  return zeroed;
 }
 
 bool BucketStorage::sanityCheck(uint8_t bucket, uint32_t position) {
@@ -479,7 +1624,18 @@ void BucketStorage::startMonitoring() {
   GorillaStatsManager::addStatExportType(kDedupedTimeSeriesSize, COUNT);
   GorillaStatsManager::addStatExportType(kWrittenTimeSeriesSize, SUM);
   GorillaStatsManager::addStatExportType(kWrittenTimeSeriesSize, COUNT);
+  GorillaStatsManager::addStatExportType(kDedupHitRate, AVG);
+  GorillaStatsManager::addStatExportType(kDedupTableLoad, AVG);
   GorillaStatsManager::addStatExportType(kExpiredBucketFetch, COUNT);
+  GorillaStatsManager::addStatExportType(kMappedBuckets, SUM);
+  GorillaStatsManager::addStatExportType(kMappedBucketFailures, SUM);
+  GorillaStatsManager::addStatExportType(kLargeBlocks, SUM);
+  GorillaStatsManager::addStatExportType(kDroppedBlocks, SUM);
+  GorillaStatsManager::addStatExportType(kZeroedBlockBytes, SUM);
+  GorillaStatsManager::addStatExportType(kPreparedPages, SUM);
+  GorillaStatsManager::addStatExportType(kUnpreparedRotations, SUM);
+  GorillaStatsManager::addStatExportType(kCompressedBuckets, SUM);
+  GorillaStatsManager::addStatExportType(kCompressedBucketFailures, SUM);
 }
 
 std::pair<uint64_t, uint64_t> BucketStorage::getPagesSize() {
@@ -487,10 +1643,40 @@ std::pair<uint64_t, uint64_t> BucketStorage::getPagesSize() {
   uint64_t totalPagesSize = 0;
   for (int i = 0; i < numBuckets_; i++) {
     std::unique_lock<std::mutex> guard(data_[i].pagesMutex);
+
+    // Pages prepared for the next position are already allocated.
+    totalPagesSize +=
+        data_[i].preparedPages.size() * (uint64_t)kDataBlockSize;
+    if (data_[i].mapped) {
+      // Backed by the page cache instead of the heap.
+      continue;
+    }
+    if (data_[i].compressed) {
+      activePagesSize += data_[i].compressedBytes;
+      totalPagesSize += data_[i].compressedBytes;
+      continue;
+    }
     activePagesSize += data_[i].activePages * (uint64_t)kDataBlockSize;
     totalPagesSize += data_[i].pages.size() * (uint64_t)kDataBlockSize;
   }
   return std::make_pair(activePagesSize, totalPagesSize);
 }
+
+std::map<uint32_t, uint64_t> BucketStorage::getPagesSizeByPosition() {
+  std::map<uint32_t, uint64_t> sizes;
+  for (int i = 0; i < numBuckets_; i++) {
+    std::unique_lock<std::mutex> guard(data_[i].pagesMutex);
+    if (data_[i].disabled || data_[i].position == 0) {
+      continue;
+    }
+    if (data_[i].compressed) {
+      sizes[data_[i].position] = data_[i].compressedBytes;
+      continue;
+    }
+    sizes[data_[i].position] =
+        data_[i].mapped ? 0 : data_[i].pages.size() * (uint64_t)kDataBlockSize;
+  }
+  return sizes;
+}
 } // namespace gorilla
 } // namespace facebook
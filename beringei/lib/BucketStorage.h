@@ -11,20 +11,28 @@
 
 #include <stdint.h>
 #include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "BlockDedupTable.h"
+#include "BlockFileStore.h"
 #include "DataBlock.h"
 #include "DataBlockReader.h"
 
+#include <folly/Range.h>
+#include <folly/io/IOBuf.h>
 #include <folly/synchronization/RWSpinLock.h>
 
 namespace facebook {
 namespace gorilla {
 
+class StreamArena;
+
 // class BucketStorage
 //
 // This class stores data for each bucket in 64K blocks. The reason
@@ -65,13 +73,35 @@ class BucketStorage {
   // could not be stored. This can happen if data is tried to be stored for
   // a position that is too old, i.e., more than numBuckets behind the current
   // position.
+  //
+  // Data of more than 32767 bytes or items is split into chunks that are
+  // found through a descriptor block, and is copied when it's fetched.
   BucketStorageId store(
       uint32_t position,
       const char* data,
-      uint16_t dataLength,
-      uint16_t itemCount,
+      uint32_t dataLength,
+      uint32_t itemCount,
       uint32_t timeSeriesId = 0);
 
+  // Stores a backfilled block in finalized bucket `position`, which
+  // must still be in memory and neither memory mapped nor compressed.
+  // Blocks aren't deduped and aren't in the block file of the bucket
+  // until writeBlockFile() writes it again. Returns kInvalidId if the
+  // block could not be stored.
+  BucketStorageId storeBackfill(
+      uint32_t position,
+      const char* data,
+      uint32_t dataLength,
+      uint32_t itemCount);
+
+  // Writes the block file of bucket `position` again with the blocks of
+  // the given time series, e.g., after blocks were backfilled. Returns
+  // false if the bucket isn't in memory anymore or is compressed.
+  bool writeBlockFile(
+      uint32_t position,
+      const std::vector<uint32_t>& timeSeriesIds,
+      const std::vector<BucketStorageId>& storageIds);
+
   enum FetchStatus { SUCCESS, FAILURE };
 
   // Fetches data.
@@ -82,7 +112,40 @@ class BucketStorage {
       uint32_t position,
       BucketStorageId id,
       std::string& data,
-      uint16_t& itemCount);
+      uint32_t& itemCount);
+
+  // Same as fetch() but returns the data in an IOBuf that points into
+  // the page of the block instead of copying it. The IOBuf keeps the
+  // page alive, and a page that is still referenced when its bucket is
+  // reused is replaced with a new one instead of being overwritten.
+  FetchStatus fetchBuffer(
+      uint32_t position,
+      BucketStorageId id,
+      std::unique_ptr<folly::IOBuf>& data,
+      uint32_t& itemCount);
+
+  // Fetches data for many ids of the same position while taking the
+  // fetch lock of the bucket once. Fills `data`, `itemCounts` and
+  // `statuses` with one entry per id.
+  void fetchMany(
+      uint32_t position,
+      const std::vector<BucketStorageId>& ids,
+      std::vector<std::string>& data,
+      std::vector<uint32_t>& itemCounts,
+      std::vector<FetchStatus>& statuses);
+
+  // Calls `f(i, data, itemCount)` for each id `ids[i]` of the same
+  // position that can be fetched, while taking the fetch lock of the
+  // bucket once. The blocks are visited in the order they are in the
+  // pages rather than in the order of `ids`, so a batch of many time
+  // series reads the pages sequentially. `data` points into the page
+  // and is only valid during the call. Returns the number of blocks
+  // visited.
+  template <typename F>
+  int fetchViews(
+      uint32_t position,
+      const std::vector<BucketStorageId>& ids,
+      F&& f);
 
   // Read all blocks for a given position into memory.
   //
@@ -95,6 +158,21 @@ class BucketStorage {
       std::vector<uint32_t>& timeSeriesIds,
       std::vector<uint64_t>& storageIds);
 
+  // Gets the next position of a bucket ready before the first block is
+  // stored in it, so that the rotation only swaps in what was prepared.
+  // Allocates and pre-faults as many pages as the previous position
+  // used beyond those the bucket can reuse, and sizes the block ids and
+  // the dedup table for as many blocks as the last finalized bucket.
+  // Returns false if the position is already open or the bucket is
+  // disabled.
+  bool prepareBucket(uint32_t position);
+
+  // Starts reading the block file of the position in the background
+  // for a later loadPosition() call.
+  void prefetchPosition(uint32_t position) {
+    dataBlockReader_.prefetch(position);
+  }
+
   // This clears and disables the buckets for reads and writes.
   void clearAndDisable();
 
@@ -105,6 +183,10 @@ class BucketStorage {
     return numBuckets_;
   }
 
+  // Arena for the active streams of the shard, or null if they are on
+  // the heap.
+  StreamArena* getStreamArena();
+
   static void parseId(
       BucketStorageId id,
       uint32_t& pageIndex,
@@ -112,18 +194,70 @@ class BucketStorage {
       uint16_t& dataLength,
       uint16_t& itemCount);
 
+  // Appends the index of each page that the block uses to `out`. The
+  // chunks of large blocks are looked up in their descriptor in
+  // `pages`.
+  static void getPageIndexes(
+      BucketStorageId id,
+      const std::vector<char*>& pages,
+      std::vector<uint32_t>& out);
+
+  // Bytes of data of the block without fetching it, rounded up to
+  // whole chunks for large blocks. 0 for invalid and disabled ids.
+  static uint32_t getDataLength(BucketStorageId id);
+
   // Finalizes a bucket at the given position. After calling this no
   // more data can be stored in this bucket.
-  void finalizeBucket(uint32_t position);
+  //
+  // If `keep` is set, the blocks it returns false for are left out of
+  // the block file, e.g. those of time series that were erased, and
+  // the page bytes only they used are zeroed in it.
+  void finalizeBucket(
+      uint32_t position,
+      const std::function<bool(uint32_t timeSeriesId, BucketStorageId id)>&
+          keep = nullptr);
+
+  // Drops the pages of the oldest finalized bucket that is still in
+  // memory and reads them from its memory mapped block file instead,
+  // like --mmap_bucket_age does as buckets age. Returns false if no
+  // bucket could be mapped, e.g. because the block files are
+  // compressed.
+  bool mapOldestBucket();
+
+  // Replaces the pages of finalized bucket `position` with groups of
+  // --compressed_page_group pages that are compressed independently of
+  // each other, like --compress_bucket_age does as buckets age. Reading
+  // a block inflates the group of its page into a cache of inflated
+  // groups that all the shards share. Returns false if the bucket
+  // couldn't be compressed or didn't get smaller.
+  bool compressBucket(uint32_t position);
 
   void deleteBucketsOlderThan(uint32_t position);
 
+  // Copies the block file of every bucket finalized from now on to
+  // `store`. Not thread safe, call it before storing anything.
+  void setBlockFileStore(std::shared_ptr<BlockFileStore> store) {
+    blockFileStore_ = std::move(store);
+  }
+
   static void startMonitoring();
 
   // Returns the total size of active and all in-memory pages
-  // (active pages size; all pages size)
+  // (active pages size; all pages size). Compressed buckets count as the
+  // size of their compressed pages.
   std::pair<uint64_t, uint64_t> getPagesSize();
 
+  // Returns the size of the in-memory pages of each enabled bucket
+  // keyed by its position. Buckets backed by block files count as 0
+  // and compressed buckets as the size of their compressed pages.
+  std::map<uint32_t, uint64_t> getPagesSizeByPosition();
+
+  // Returns the percentage of the blocks of the last finalized bucket
+  // that were duplicates of another block.
+  uint32_t getLastBucketDedupHitRate() {
+    return lastBucketDedupHitRate_;
+  }
+
  private:
   BucketStorageId createId(
       uint32_t pageIndex,
@@ -136,19 +270,122 @@ class BucketStorage {
       const std::vector<std::shared_ptr<DataBlock>>& pages,
       uint32_t activePages,
       const std::vector<uint32_t>& timeSeriesIds,
+      const std::vector<BucketStorageId>& storageIds,
+      bool zeroUnused = false);
+
+  // Zeroes the bytes of `pages` that none of `storageIds` use and
+  // returns how many there were.
+  static uint64_t zeroUnusedBytes(
+      const std::vector<char*>& pages,
       const std::vector<BucketStorageId>& storageIds);
 
+  // Reuses a bucket for a newer position. Caller must hold the pages
+  // mutex. The pages that aren't reused are moved to `released` to be
+  // freed after the mutex is released.
+  void rotateLocked(
+      uint8_t bucket,
+      uint32_t position,
+      std::vector<std::shared_ptr<DataBlock>>& released);
+
   // Verify that the given position is active and not disabled.
   // Caller must hold the write lock because this can open a new bucket.
   bool sanityCheck(uint8_t bucket, uint32_t position);
 
+  // Returns false if the bucket is disabled or has expired. Caller
+  // must hold the fetch lock.
+  bool canFetch(uint8_t bucket, uint32_t position);
+
+  // Stores a block that fits in kMaxDataLength and kMaxItemCount,
+  // or returns the id of an identical one. Caller must hold the pages
+  // mutex and have checked the position.
+  BucketStorageId storeLocked(
+      uint8_t bucket,
+      const char* data,
+      uint16_t dataLength,
+      uint16_t itemCount);
+
+  // Stores a block that doesn't, as chunks and a descriptor.
+  BucketStorageId storeLargeLocked(
+      uint8_t bucket,
+      const char* data,
+      uint32_t dataLength,
+      uint32_t itemCount);
+
+  // Copies data to the end of the active pages.
+  BucketStorageId writeLocked(
+      uint8_t bucket,
+      const char* data,
+      uint16_t dataLength,
+      uint16_t itemCount);
+
+  // Fetches data from a bucket. Caller must hold the fetch lock and
+  // have checked canFetch().
+  FetchStatus fetchLocked(
+      uint8_t bucket,
+      BucketStorageId id,
+      std::string& data,
+      uint32_t& itemCount);
+
+  // Same as fetchLocked() but points `data` into the page, which is
+  // kept alive by `pin` if it was inflated. Large blocks span pages, so
+  // they are copied to `scratch`.
+  FetchStatus viewLocked(
+      uint8_t bucket,
+      BucketStorageId id,
+      folly::StringPiece& data,
+      uint32_t& itemCount,
+      std::string& scratch,
+      std::shared_ptr<DataBlock>& pin);
+
+  // Fills `order` with the indexes of `ids` in the order of the blocks
+  // in the pages, skipping the invalid and disabled ids.
+  static void sortByPage(
+      const std::vector<BucketStorageId>& ids,
+      std::vector<uint32_t>& order);
+
+  // Same for a large block with the id of its descriptor.
+  FetchStatus fetchLargeLocked(
+      uint8_t bucket,
+      BucketStorageId descriptorId,
+      std::string& data,
+      uint32_t& itemCount);
+
+  // Finds the page and the range of the data of a block. Caller must
+  // hold the fetch lock and have checked canFetch(). Pages of
+  // compressed buckets are inflated and only valid while `pin` is held.
+  DataBlock* findBlock(
+      uint8_t bucket,
+      BucketStorageId id,
+      uint32_t& pageIndex,
+      uint32_t& pageOffset,
+      uint16_t& dataLength,
+      uint16_t& itemCount,
+      std::shared_ptr<DataBlock>& pin);
+
+  // Returns a page of a compressed bucket from the shared cache of
+  // inflated groups, inflating its group if it isn't cached. Caller
+  // must hold the fetch lock.
+  std::shared_ptr<DataBlock> inflatePage(uint8_t bucket, uint32_t pageIndex);
+
+  // Replaces the pages of a finalized bucket with pages that point to
+  // a memory mapped copy of its block file. Does nothing if the block
+  // file is compressed. Returns false if the pages weren't replaced.
+  bool mapBucket(uint32_t position);
+
   struct BucketData {
     BucketData()
         : activePages(0),
           lastPageBytesUsed(0),
           position(0),
           disabled(false),
-          finalized(false) {}
+          finalized(false),
+          mapped(false),
+          backfilled(false),
+          compressed(false),
+          compressedGroupPages(0),
+          compressedKey(0),
+          compressedBytes(0),
+          preparedPosition(0) {}
 
     std::vector<std::shared_ptr<DataBlock>> pages;
     uint32_t activePages;
@@ -157,11 +394,39 @@ class BucketStorage {
     bool disabled;
     bool finalized;
 
+    // True if the pages point into a memory mapped block file instead
+    // of memory owned by this class. They are read-only and can't be
+    // reused for the next position.
+    bool mapped;
+
+    // True once blocks were backfilled into this position. The first
+    // backfilled block starts a new page, as the last page of a bucket
+    // read from its block file may be full.
+    bool backfilled;
+
+    // True if the pages were replaced with compressed groups of pages.
+    // The groups hold `compressedGroupPages` pages each, except for the
+    // last one, and their keys in the cache of inflated groups start
+    // at `compressedKey`.
+    bool compressed;
+    std::vector<std::unique_ptr<folly::IOBuf>> compressedGroups;
+    uint32_t compressedGroupPages;
+    uint64_t compressedKey;
+    uint64_t compressedBytes;
+
     // Two separate vectors for metadata to save memory.
     std::vector<uint32_t> timeSeriesIds;
     std::vector<BucketStorageId> storageIds;
 
-    std::unordered_multimap<uint64_t, uint64_t> storageIdsLookupMap;
+    BlockDedupTable dedupTable;
+
+    // Made ready by prepareBucket() for `preparedPosition` and swapped
+    // in when the bucket is rotated to it.
+    uint32_t preparedPosition;
+    std::vector<std::shared_ptr<DataBlock>> preparedPages;
+    std::vector<uint32_t> preparedTimeSeriesIds;
+    std::vector<BucketStorageId> preparedStorageIds;
+    BlockDedupTable preparedDedupTable;
 
     // To control that reads will always work, i.e., allocated pages
     // won't be deleted.
@@ -172,12 +437,50 @@ class BucketStorage {
   };
 
   const uint8_t numBuckets_;
+  const int shardId_;
+  const std::string dataDirectory_;
   int newestPosition_;
+
+  // Number of blocks stored in the last finalized bucket. Used to size
+  // the dedup table of the next bucket.
+  std::atomic<uint32_t> lastBucketBlocks_;
+  std::atomic<uint32_t> lastBucketDedupHitRate_;
   std::unique_ptr<BucketData[]> data_;
   DataBlockReader dataBlockReader_;
 
   FileUtils dataFiles_;
   FileUtils completeFiles_;
+  std::shared_ptr<BlockFileStore> blockFileStore_;
+  StreamArena* const streamArena_;
 };
+
+template <typename F>
+int BucketStorage::fetchViews(
+    uint32_t position,
+    const std::vector<BucketStorageId>& ids,
+    F&& f) {
+  std::vector<uint32_t> order;
+  sortByPage(ids, order);
+
+  uint8_t bucket = position % numBuckets_;
+  folly::RWSpinLock::ReadHolder readGuard(&data_[bucket].fetchLock);
+  if (!canFetch(bucket, position)) {
+    return 0;
+  }
+
+  int visited = 0;
+  std::string scratch;
+  std::shared_ptr<DataBlock> pin;
+  for (uint32_t i : order) {
+    folly::StringPiece data;
+    uint32_t itemCount;
+    if (viewLocked(bucket, ids[i], data, itemCount, scratch, pin) ==
+        SUCCESS) {
+      f(i, data, itemCount);
+      visited++;
+    }
+  }
+  return visited;
+}
 }
 } // facebook:gorilla
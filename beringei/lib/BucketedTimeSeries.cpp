@@ -8,17 +8,102 @@
  */
 
 #include "BucketedTimeSeries.h"
+
+#include <cmath>
+#include <map>
+
+#include <folly/Conv.h>
+#include <folly/String.h>
+
+#include "Aggregation.h"
 #include "BucketMap.h"
+#include "CategoryPolicy.h"
+#include "CoalescedBlockCache.h"
+#include "TimeSeries.h"
 
+DEFINE_bool(
+    gorilla_count_repeated_points,
+    true,
+    "Count the points of the active bucket that repeat the previous value "
+    "at the same interval instead of appending them to its stream until "
+    "it is read or closed.");
 DEFINE_int32(
     mintimestampdelta,
     30,
     "Values coming in faster than this are considered spam");
+DEFINE_double(
+    lossy_compression_error,
+    0,
+    "When positive, each bucket of a time series is compressed with the "
+    "swinging door algorithm as it's finalized, which keeps only the "
+    "points needed to stay within this fraction of the range of the "
+    "values of the bucket. The blocks are marked as approximate. 0 "
+    "keeps every point.");
+DEFINE_string(
+    gorilla_high_resolution_categories,
+    "",
+    "Comma separated category ids whose time series accept points as "
+    "often as --gorilla_high_resolution_min_timestamp_delta instead of "
+    "--mintimestampdelta");
+DEFINE_int32(
+    gorilla_high_resolution_min_timestamp_delta,
+    1,
+    "Values of the high resolution categories coming in faster than this "
+    "are considered spam");
+DEFINE_string(
+    gorilla_millisecond_categories,
+    "",
+    "Comma separated category ids whose time series keep the milliseconds "
+    "of their points and accept points as often as "
+    "--gorilla_millisecond_min_timestamp_delta_ms. Their points are not "
+    "reordered, counted as repeats or compressed lossily. Their log files "
+    "can't be replayed by versions that don't know the milliseconds record.");
+DEFINE_int32(
+    gorilla_millisecond_min_timestamp_delta_ms,
+    100,
+    "Values of the millisecond categories coming in faster than this many "
+    "milliseconds are considered spam");
+DEFINE_bool(
+    gorilla_running_stats,
+    false,
+    "Keep the count, sum and sum of squares of the values of each bucket "
+    "of each time series, so that deviations can be found without "
+    "decompressing old blocks. Uses about 40 bytes per bucket for each "
+    "time series that has data.");
+DEFINE_int32(
+    reorder_window_secs,
+    0,
+    "Hold back the last few points of each time series until a point this "
+    "many seconds newer arrives, so that points that arrive out of order "
+    "by less than that are still appended to its stream in order. Uses "
+    "about 80 bytes for each time series that gets points. 0 appends the "
+    "points as they arrive.");
+
+DECLARE_int32(pla_period);
 
 namespace facebook {
 namespace gorilla {
 
-static const uint16_t kDefaultCategory = 0;
+namespace {
+
+// Table of the category ids in the comma separated `ids`.
+std::vector<bool> parseCategories(
+    const std::string& ids,
+    const char* description) {
+  std::vector<bool> categories(std::numeric_limits<uint16_t>::max() + 1);
+  std::vector<folly::StringPiece> parts;
+  folly::split(',', ids, parts, true);
+  for (auto id : parts) {
+    auto parsed = folly::tryTo<uint16_t>(folly::trimWhitespace(id));
+    if (parsed.hasValue()) {
+      categories[parsed.value()] = true;
+    } else {
+      LOG(ERROR) << "Invalid " << description << " category: " << id;
+    }
+  }
+  return categories;
+}
+}
 
 BucketedTimeSeries::BucketedTimeSeries() {}
 
@@ -27,21 +112,20 @@ BucketedTimeSeries::~BucketedTimeSeries() {}
 void BucketedTimeSeries::reset(
     uint8_t n,
     uint32_t minBucket,
-    int64_t minTimestamp) {
+    int64_t minTimestamp,
+    uint16_t category) {
   queriedBucketsAgo_ = std::numeric_limits<uint8_t>::max();
   lock_.init();
   current_ = minBucket;
-  blocks_.reset(new BucketStorage::BucketStorageId[n]);
 
-  for (int i = 0; i < n; i++) {
-    // Blacklist older buckets if `minBucket` was set.
-    blocks_[i] = (minBucket == 0) ? BucketStorage::kInvalidId
-                                  : BucketStorage::kDisabledId;
-  }
-  blocks_[current_ % n] = BucketStorage::kInvalidId;
+  // Blacklist older buckets if `minBucket` was set.
+  minBucket_ = minBucket;
+  blocks_.reset();
+  extra_.reset();
   count_ = 0;
-  stream_.reset(minTimestamp, FLAGS_mintimestampdelta);
-  stream_.extraData = kDefaultCategory;
+  repeats_ = 0;
+  stream_.reset(minTimestamp, minTimestampDelta(category));
+  stream_.extraData = category;
 }
 
 bool BucketedTimeSeries::put(
@@ -51,6 +135,93 @@ bool BucketedTimeSeries::put(
     uint32_t timeSeriesId,
     uint16_t* category) {
   folly::MSLGuard guard(lock_);
+  if (reorderedPoints() > 0 ||
+      (FLAGS_reorder_window_secs > 0 &&
+       !isMillisecondCategory(category ? *category : stream_.extraData))) {
+    return putReordered(i, value, storage, timeSeriesId, category);
+  }
+  return putLocked(i, value, storage, timeSeriesId, category);
+}
+
+int BucketedTimeSeries::putMany(
+    const std::vector<TimeValuePair>& values,
+    const std::vector<uint32_t>& buckets,
+    BucketStorage* storage,
+    uint32_t timeSeriesId,
+    uint16_t* category,
+    std::vector<bool>& added) {
+  added.assign(values.size(), false);
+  int count = 0;
+  folly::MSLGuard guard(lock_);
+  uint16_t streamCategory = category ? *category : stream_.extraData;
+  if (isMillisecondCategory(streamCategory) && reorderedPoints() == 0) {
+    for (size_t j = 0; j < values.size(); j++) {
+      added[j] =
+          putLocked(buckets[j], values[j], storage, timeSeriesId, category);
+      count += added[j];
+    }
+    return count;
+  }
+
+  if (FLAGS_reorder_window_secs > 0 || reorderedPoints() > 0) {
+    for (size_t j = 0; j < values.size(); j++) {
+      added[j] =
+          putReordered(buckets[j], values[j], storage, timeSeriesId, category);
+      count += added[j];
+    }
+    return count;
+  }
+
+  int32_t minDelta = minTimestampDelta(streamCategory);
+
+  // Each run of values in the same bucket is appended in one batch.
+  size_t end;
+  for (size_t begin = 0; begin < values.size(); begin = end) {
+    uint32_t i = buckets[begin];
+    for (end = begin + 1; end < values.size() && buckets[end] == i; end++) {
+    }
+    if (i < current_) {
+      continue;
+    }
+
+    if (i != current_) {
+      open(i, storage, timeSeriesId);
+    }
+
+    stream_.useArena(storage->getStreamArena());
+    int batchCount = stream_.appendBatch(
+        values,
+        begin,
+        end,
+        minDelta,
+        added,
+        FLAGS_gorilla_count_repeated_points ? &repeats_ : nullptr);
+    if (batchCount == 0) {
+      continue;
+    }
+
+    if (category) {
+      stream_.extraData = *category;
+    }
+    if (FLAGS_gorilla_running_stats) {
+      for (size_t j = begin; j < end; j++) {
+        if (added[j]) {
+          addToStats(i, values[j].value, storage->numBuckets());
+        }
+      }
+    }
+    count_ += batchCount;
+    count += batchCount;
+  }
+  return count;
+}
+
+bool BucketedTimeSeries::putLocked(
+    uint32_t i,
+    const TimeValuePair& value,
+    BucketStorage* storage,
+    uint32_t timeSeriesId,
+    uint16_t* category) {
   if (i < current_) {
     return false;
   }
@@ -59,38 +230,266 @@ bool BucketedTimeSeries::put(
     open(i, storage, timeSeriesId);
   }
 
-  if (!stream_.append(value, FLAGS_mintimestampdelta)) {
-    return false;
+  // Only takes a buffer from the arena while the stream is empty.
+  stream_.useArena(storage->getStreamArena());
+
+  uint16_t streamCategory = category ? *category : stream_.extraData;
+  int32_t minDelta = minTimestampDelta(streamCategory);
+  if (isMillisecondCategory(streamCategory)) {
+    if (value.ms < 0 || value.ms >= kGorillaMsPerSecond) {
+      return false;
+    }
+    appendRepeats();
+    if (!stream_.appendMilliseconds(
+            value.unixTime * kGorillaMsPerSecond + value.ms,
+            value.value,
+            FLAGS_gorilla_millisecond_min_timestamp_delta_ms)) {
+      return false;
+    }
+  } else if (
+      FLAGS_gorilla_count_repeated_points &&
+      repeats_ < std::numeric_limits<uint16_t>::max() &&
+      stream_.isRepeat(value.unixTime, value.value, repeats_, minDelta)) {
+    repeats_++;
+  } else {
+    appendRepeats();
+    if (!stream_.append(value, minDelta)) {
+      return false;
+    }
   }
 
   if (category) {
     stream_.extraData = *category;
   }
 
+  if (FLAGS_gorilla_running_stats) {
+    addToStats(i, value.value, storage->numBuckets());
+  }
+
   count_++;
   return true;
 }
 
+void BucketedTimeSeries::appendRepeats() {
+  if (repeats_ > 0) {
+    stream_.appendRepeats(repeats_);
+    repeats_ = 0;
+  }
+}
+
+bool BucketedTimeSeries::putReordered(
+    uint32_t i,
+    const TimeValuePair& value,
+    BucketStorage* storage,
+    uint32_t timeSeriesId,
+    uint16_t* category) {
+  // Too late to be appended in order.
+  if (i < current_ ||
+      (count_ > 0 &&
+       value.unixTime < stream_.getRepeatTimeStamp(repeats_))) {
+    return false;
+  }
+
+  if (category) {
+    stream_.extraData = *category;
+  }
+
+  ReorderBuffer& buffer = getExtra().reorder;
+  if (buffer.size == kReorderPoints) {
+    if (value.unixTime < buffer.points[0].unixTime) {
+      return putLocked(i, value, storage, timeSeriesId, nullptr);
+    }
+    commitReordered(1, storage, timeSeriesId);
+  }
+
+  // Points with the same timestamp stay in the order they arrived.
+  int j = buffer.size;
+  for (; j > 0 && buffer.points[j - 1].unixTime > value.unixTime; j--) {
+    buffer.points[j] = buffer.points[j - 1];
+  }
+  buffer.points[j].bucket = i;
+  buffer.points[j].unixTime = value.unixTime;
+  buffer.points[j].value = value.value;
+  buffer.size++;
+
+  int64_t newest = buffer.points[buffer.size - 1].unixTime;
+  uint8_t old = 0;
+  while (old < buffer.size &&
+         buffer.points[old].unixTime + (int64_t)FLAGS_reorder_window_secs <=
+             newest) {
+    old++;
+  }
+  commitReordered(old, storage, timeSeriesId);
+  return true;
+}
+
+void BucketedTimeSeries::commitReordered(
+    uint8_t count,
+    BucketStorage* storage,
+    uint32_t timeSeriesId) {
+  ReorderBuffer& buffer = extra_->reorder;
+  for (uint8_t j = 0; j < count; j++) {
+    TimeValuePair value;
+    value.unixTime = buffer.points[j].unixTime;
+    value.value = buffer.points[j].value;
+    putLocked(buffer.points[j].bucket, value, storage, timeSeriesId, nullptr);
+  }
+  for (uint8_t j = count; j < buffer.size; j++) {
+    buffer.points[j - count] = buffer.points[j];
+  }
+  buffer.size -= count;
+}
+
+uint32_t BucketedTimeSeries::appendReordered(TimeSeriesStream& stream) const {
+  uint32_t count = 0;
+  int32_t minDelta = minTimestampDelta(stream_.extraData);
+  for (uint8_t j = 0; j < reorderedPoints(); j++) {
+    const auto& point = extra_->reorder.points[j];
+    if (point.bucket == current_ &&
+        stream.append(point.unixTime, point.value, minDelta)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+uint32_t BucketedTimeSeries::readActiveData(std::string& data) {
+  if (repeats_ == 0 && reorderedPoints() == 0) {
+    stream_.readData(data);
+    return count_;
+  }
+
+  // The repeats and the held back points are only appended to a copy,
+  // so reading doesn't grow the stream of a time series that is
+  // otherwise idle.
+  TimeSeriesStream stream(stream_);
+  if (repeats_ > 0) {
+    stream.appendRepeats(repeats_);
+  }
+  uint32_t count = count_ + appendReordered(stream);
+  stream.readData(data);
+  return count;
+}
+
+void BucketedTimeSeries::addToStats(uint32_t i, double value, uint8_t n) {
+  auto& buckets = getExtra().stats;
+  if (!buckets) {
+    buckets.reset(new BucketStats[n + 1]);
+    for (int slot = 0; slot <= n; slot++) {
+      buckets[slot].count = 0;
+    }
+  }
+
+  BucketStats& stats = buckets[i % (n + 1)];
+  if (stats.count == 0 || stats.bucket != i) {
+    stats.bucket = i;
+    stats.count = 0;
+    stats.shift = value;
+    stats.sum = 0;
+    stats.sumOfSquares = 0;
+  }
+
+  double delta = value - stats.shift;
+  stats.count++;
+  stats.sum += delta;
+  stats.sumOfSquares += delta * delta;
+  stats.last = value;
+}
+
+bool BucketedTimeSeries::getStats(
+    uint32_t begin,
+    uint32_t end,
+    BucketStorage* storage,
+    Stats& stats) const {
+  uint8_t n = storage->numBuckets();
+  stats = Stats();
+
+  folly::MSLGuard guard(lock_);
+  if (!extra_ || !extra_->stats) {
+    return false;
+  }
+
+  // Only the last n + 1 buckets are kept.
+  end = std::min(end, current_);
+  begin = std::max(begin, current_ >= n ? current_ - n : 0);
+
+  // Move the sums of every bucket to the shift of the first one.
+  double shift = 0;
+  double sum = 0;
+  double sumOfSquares = 0;
+  for (uint32_t i = begin; i <= end; i++) {
+    const BucketStats& bucket = extra_->stats[i % (n + 1)];
+    if (bucket.count == 0 || bucket.bucket != i) {
+      continue;
+    }
+
+    if (stats.count == 0) {
+      shift = bucket.shift;
+    }
+    double offset = bucket.shift - shift;
+    sum += bucket.sum + bucket.count * offset;
+    sumOfSquares += bucket.sumOfSquares + 2 * offset * bucket.sum +
+        bucket.count * offset * offset;
+    stats.count += bucket.count;
+    stats.last = bucket.last;
+  }
+
+  if (stats.count == 0) {
+    return false;
+  }
+
+  double mean = sum / stats.count;
+  stats.mean = shift + mean;
+  stats.variance = std::max(0.0, sumOfSquares / stats.count - mean * mean);
+  return true;
+}
+
 void BucketedTimeSeries::get(
     uint32_t begin,
     uint32_t end,
     std::vector<TimeSeriesBlock>& out,
-    BucketStorage* storage) {
+    BucketStorage* storage,
+    const Coalesce* coalesce) {
+  if (coalesce) {
+    getMany({this}, begin, end, {&out}, storage, coalesce);
+    return;
+  }
+
   uint8_t n = storage->numBuckets();
   out.reserve(out.size() + std::min<uint32_t>(n + 1, end - begin + 1));
 
-  folly::MSLGuard guard(lock_);
-  bool getCurrent = begin <= current_ && end >= current_;
+  // Only the storage ids and the active stream are copied under the
+  // lock. The blocks are fetched after releasing it, so writers never
+  // wait for BucketStorage.
+  std::vector<BucketStorage::BucketStorageId> ids;
+  TimeSeriesBlock current;
+  bool getCurrent;
+  {
+    folly::MSLGuard guard(lock_);
+    getCurrent = begin <= current_ && end >= current_;
 
-  end = std::min(end, current_ >= 1 ? current_ - 1 : 0);
-  begin = std::max(begin, current_ >= n ? current_ - n : 0);
+    end = std::min(end, current_ >= 1 ? current_ - 1 : 0);
+    uint8_t kept = CategoryPolicy::bucketsKept(stream_.extraData, n);
+    begin = std::max(begin, current_ >= kept ? current_ - kept : 0);
 
-  for (int i = begin; i <= end; i++) {
+    if (begin <= end) {
+      ids.reserve(end - begin + 1);
+      for (uint32_t i = begin; i <= end; i++) {
+        ids.push_back(getBlock(i, n));
+      }
+    }
+
+    if (getCurrent) {
+      current.count = readActiveData(current.data);
+    }
+  }
+
+  for (int i = 0; i < ids.size(); i++) {
     TimeSeriesBlock outBlock;
-    uint16_t count;
+    uint32_t count;
 
     BucketStorage::FetchStatus status =
-        storage->fetch(i, blocks_[i % n], outBlock.data, count);
+        storage->fetch(begin + i, ids[i], outBlock.data, count);
     if (status == BucketStorage::FetchStatus::SUCCESS) {
       outBlock.count = count;
       out.push_back(std::move(outBlock));
@@ -98,9 +497,185 @@ void BucketedTimeSeries::get(
   }
 
   if (getCurrent) {
-    out.emplace_back();
-    out.back().count = count_;
-    stream_.readData(out.back().data);
+    out.push_back(std::move(current));
+  }
+}
+
+void BucketedTimeSeries::getBuffers(
+    uint32_t begin,
+    uint32_t end,
+    std::vector<Buffer>& out,
+    BucketStorage* storage) {
+  uint8_t n = storage->numBuckets();
+  out.reserve(out.size() + std::min<uint32_t>(n + 1, end - begin + 1));
+
+  std::vector<BucketStorage::BucketStorageId> ids;
+  Buffer current;
+  bool getCurrent;
+  {
+    folly::MSLGuard guard(lock_);
+    getCurrent = begin <= current_ && end >= current_;
+
+    end = std::min(end, current_ >= 1 ? current_ - 1 : 0);
+    uint8_t kept = CategoryPolicy::bucketsKept(stream_.extraData, n);
+    begin = std::max(begin, current_ >= kept ? current_ - kept : 0);
+
+    if (begin <= end) {
+      ids.reserve(end - begin + 1);
+      for (uint32_t i = begin; i <= end; i++) {
+        ids.push_back(getBlock(i, n));
+      }
+    }
+
+    if (getCurrent) {
+      std::string data;
+      current.count = readActiveData(data);
+      current.data = folly::IOBuf::copyBuffer(data.data(), data.size());
+    }
+  }
+
+  for (int i = 0; i < ids.size(); i++) {
+    Buffer outBlock;
+    BucketStorage::FetchStatus status =
+        storage->fetchBuffer(begin + i, ids[i], outBlock.data, outBlock.count);
+    if (status == BucketStorage::FetchStatus::SUCCESS) {
+      out.push_back(std::move(outBlock));
+    }
+  }
+
+  if (getCurrent) {
+    out.push_back(std::move(current));
+  }
+}
+
+void BucketedTimeSeries::getMany(
+    const std::vector<BucketedTimeSeries*>& series,
+    uint32_t begin,
+    uint32_t end,
+    const std::vector<Output*>& outs,
+    BucketStorage* storage,
+    const Coalesce* coalesce) {
+  uint8_t n = storage->numBuckets();
+  CoalescedBlockCache* cache = coalesce ? coalesce->cache : nullptr;
+
+  // Storage ids to fetch for each position, and the time series they
+  // belong to. Positions are visited in order so that the blocks of
+  // each time series are added oldest first.
+  typedef std::pair<BucketStorage::BucketStorageId, int> Fetch;
+  std::map<uint32_t, std::vector<Fetch>> fetches;
+  std::vector<TimeSeriesBlock> current(series.size());
+  std::vector<bool> getCurrent(series.size());
+
+  // When coalescing, the first finalized position, the storage ids from
+  // there on and where the finalized blocks start in the output.
+  std::vector<uint32_t> firsts(coalesce ? series.size() : 0);
+  std::vector<std::vector<BucketStorage::BucketStorageId>> ids(
+      coalesce ? series.size() : 0);
+  std::vector<size_t> starts(coalesce ? series.size() : 0);
+  std::vector<int> missing(coalesce ? series.size() : 0);
+
+  for (int i = 0; i < series.size(); i++) {
+    auto* timeSeries = series[i];
+    outs[i]->reserve(
+        outs[i]->size() + std::min<uint32_t>(n + 1, end - begin + 1));
+
+    folly::MSLGuard guard(timeSeries->lock_);
+    uint32_t currentBucket = timeSeries->current_;
+    getCurrent[i] = begin <= currentBucket && end >= currentBucket;
+
+    uint8_t kept =
+        CategoryPolicy::bucketsKept(timeSeries->stream_.extraData, n);
+    uint32_t first =
+        std::max(begin, currentBucket >= kept ? currentBucket - kept : 0);
+    uint32_t last = std::min(end, currentBucket >= 1 ? currentBucket - 1 : 0);
+    if (coalesce) {
+      firsts[i] = first;
+      for (uint32_t position = first; position <= last; position++) {
+        ids[i].push_back(timeSeries->getBlock(position, n));
+      }
+    } else {
+      for (uint32_t position = first; position <= last; position++) {
+        fetches[position].emplace_back(timeSeries->getBlock(position, n), i);
+      }
+    }
+
+    if (getCurrent[i]) {
+      current[i].count = timeSeries->readActiveData(current[i].data);
+    }
+  }
+
+  // Look up the cached blocks after releasing the locks and only fetch
+  // the buckets of the others.
+  std::vector<bool> cached(coalesce ? series.size() : 0);
+  for (int i = 0; i < ids.size(); i++) {
+    starts[i] = outs[i]->size();
+    if (cache && ids[i].size() > 1) {
+      TimeSeriesBlock block;
+      if (cache->get(coalesce->keys[i], firsts[i], ids[i], block)) {
+        outs[i]->push_back(std::move(block));
+        cached[i] = true;
+        continue;
+      }
+    }
+
+    for (int j = 0; j < ids[i].size(); j++) {
+      if (ids[i][j] != BucketStorage::kInvalidId &&
+          ids[i][j] != BucketStorage::kDisabledId) {
+        fetches[firsts[i] + j].emplace_back(ids[i][j], i);
+        missing[i]++;
+      }
+    }
+  }
+
+  // The blocks of a bucket are visited in page order, so each time
+  // series gets an empty block first, which is dropped if the fetch
+  // fails. A time series has at most one block per bucket.
+  std::vector<BucketStorage::BucketStorageId> fetchIds;
+  std::vector<bool> fetched;
+  for (const auto& fetch : fetches) {
+    fetchIds.clear();
+    for (const auto& entry : fetch.second) {
+      fetchIds.push_back(entry.first);
+      outs[entry.second]->emplace_back();
+    }
+
+    fetched.assign(fetchIds.size(), false);
+    storage->fetchViews(
+        fetch.first,
+        fetchIds,
+        [&](size_t j, folly::StringPiece data, uint32_t count) {
+          auto& block = outs[fetch.second[j].second]->back();
+          block.count = count;
+          block.data.assign(data.data(), data.size());
+          fetched[j] = true;
+        });
+
+    for (int j = 0; j < fetchIds.size(); j++) {
+      int i = fetch.second[j].second;
+      if (!fetched[j]) {
+        outs[i]->pop_back();
+      } else if (coalesce) {
+        missing[i]--;
+      }
+    }
+  }
+
+  for (int i = 0; i < ids.size(); i++) {
+    if (cached[i] || outs[i]->size() - starts[i] < 2 ||
+        !TimeSeries::coalesceBlocks(*outs[i], starts[i], outs[i]->size())) {
+      continue;
+    }
+
+    // Blocks that failed to fetch might be there next time.
+    if (cache && ids[i].size() > 1 && missing[i] == 0) {
+      cache->put(coalesce->keys[i], firsts[i], ids[i], outs[i]->back());
+    }
+  }
+
+  for (int i = 0; i < series.size(); i++) {
+    if (getCurrent[i]) {
+      outs[i]->push_back(std::move(current[i]));
+    }
   }
 }
 
@@ -109,6 +684,12 @@ void BucketedTimeSeries::setCurrentBucket(
     BucketStorage* storage,
     uint32_t timeSeriesId) {
   folly::MSLGuard guard(lock_);
+
+  // The held back points go to the blocks of their buckets before
+  // those are closed.
+  if (reorderedPoints() > 0) {
+    commitReordered(reorderedPoints(), storage, timeSeriesId);
+  }
   if (current_ < currentBucket) {
     open(currentBucket, storage, timeSeriesId);
   }
@@ -121,22 +702,25 @@ void BucketedTimeSeries::open(
   if (current_ == 0) {
     // Skip directly to the new value.
     current_ = next;
-    blocks_[current_ % storage->numBuckets()] = BucketStorage::kInvalidId;
+    setBlock(current_, storage->numBuckets(), BucketStorage::kInvalidId);
     return;
   }
 
   // Wipe all the blocks in between.
   while (current_ != next) {
     // Reset the block we're about to replace.
-    auto& block = blocks_[current_ % storage->numBuckets()];
+    auto block = BucketStorage::kInvalidId;
+    appendRepeats();
 
-    if (count_ > 0) {
+    if (count_ > 0 && FLAGS_lossy_compression_error > 0 &&
+        !stream_.isMilliseconds()) {
+      block = storeApproximate(storage, timeSeriesId);
+    } else if (count_ > 0) {
       // Copy out the active data.
       block = storage->store(
           current_, stream_.getDataPtr(), stream_.size(), count_, timeSeriesId);
-    } else {
-      block = BucketStorage::kInvalidId;
     }
+    setBlock(current_, storage->numBuckets(), block);
 
     // Prepare for writes.
     count_ = 0;
@@ -149,6 +733,93 @@ void BucketedTimeSeries::open(
   }
 }
 
+BucketStorage::BucketStorageId BucketedTimeSeries::storeApproximate(
+    BucketStorage* storage,
+    uint32_t timeSeriesId) {
+  std::vector<TimeValuePair> points;
+  stream_.readValues(points, count_);
+
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  for (const auto& point : points) {
+    min = std::fmin(min, point.value);
+    max = std::fmax(max, point.value);
+  }
+
+  std::vector<TimeValuePair> kept;
+  double maxError =
+      min <= max ? (max - min) * FLAGS_lossy_compression_error : 0;
+  Aggregation::swingingDoor(points, maxError, FLAGS_pla_period, kept);
+
+  TimeSeriesStream approximate;
+  approximate.setApproximate();
+  for (const auto& point : kept) {
+    approximate.append(point, 0);
+  }
+
+  // Nothing to gain from the approximation.
+  if (approximate.size() >= stream_.size()) {
+    return storage->store(
+        current_, stream_.getDataPtr(), stream_.size(), count_, timeSeriesId);
+  }
+  return storage->store(
+      current_,
+      approximate.getDataPtr(),
+      approximate.size(),
+      kept.size(),
+      timeSeriesId);
+}
+
+bool BucketedTimeSeries::getActiveStream(
+    uint32_t& bucket,
+    uint32_t& count,
+    TimeSeriesStream::State& state,
+    std::string& data) {
+  folly::MSLGuard guard(lock_);
+  bool reordered = reorderedPoints() > 0;
+  if (count_ == 0 && !reordered) {
+    return false;
+  }
+
+  bucket = current_;
+  count = count_;
+  if (repeats_ == 0 && !reordered) {
+    stream_.getState(state, data);
+  } else {
+    // The held back points of later buckets are only in the logs.
+    TimeSeriesStream stream(stream_);
+    if (repeats_ > 0) {
+      stream.appendRepeats(repeats_);
+    }
+    count += appendReordered(stream);
+    if (count == 0) {
+      return false;
+    }
+    stream.getState(state, data);
+  }
+  return true;
+}
+
+bool BucketedTimeSeries::setActiveStream(
+    uint32_t bucket,
+    uint32_t count,
+    const TimeSeriesStream::State& state,
+    folly::StringPiece data) {
+  folly::MSLGuard guard(lock_);
+  if (count_ > 0 || bucket < current_ || bucket < minBucket_) {
+    return false;
+  }
+
+  if (!stream_.setState(state, data)) {
+    return false;
+  }
+
+  current_ = bucket;
+  count_ = count;
+  repeats_ = 0;
+  return true;
+}
+
 void BucketedTimeSeries::setQueried() {
   queriedBucketsAgo_ = 0;
 }
@@ -165,28 +836,70 @@ void BucketedTimeSeries::setDataBlock(
   // loaded.
   if (position >= current_) {
     count_ = 0;
+    repeats_ = 0;
     stream_.reset();
     open(position + 1, storage, 0);
   }
 
   // Don't store any data older than the configured minimum bucket.
   // This allows safe shard movement even when timeseries IDs get reused.
-  auto numBuckets = storage->numBuckets();
-  auto& block = blocks_[position % numBuckets];
-  if (block != BucketStorage::kDisabledId) {
-    blocks_[position % numBuckets] = id;
+  if (position >= minBucket_) {
+    setBlock(position, storage->numBuckets(), id);
   }
 }
 
+BucketStorage::BucketStorageId BucketedTimeSeries::getFinalizedBlock(
+    uint32_t position,
+    uint8_t n) {
+  folly::MSLGuard guard(lock_);
+  if (position >= current_ || current_ - position > n ||
+      position < minBucket_) {
+    return BucketStorage::kInvalidId;
+  }
+  return getBlock(position, n);
+}
+
+bool BucketedTimeSeries::setBackfilledBlock(
+    uint32_t position,
+    uint8_t n,
+    BucketStorage::BucketStorageId id) {
+  folly::MSLGuard guard(lock_);
+  if (position >= current_ || current_ - position > n) {
+    return false;
+  }
+
+  // The buckets in between have no blocks, as they were ignored.
+  if (position < minBucket_) {
+    minBucket_ = position;
+  }
+  setBlock(position, n, id);
+  return true;
+}
+
 bool BucketedTimeSeries::hasDataPoints(uint8_t numBuckets) {
   folly::MSLGuard guard(lock_);
-  if (count_ > 0) {
+  if (count_ > 0 || reorderedPoints() > 0) {
     return true;
   }
 
+  uint8_t kept =
+      CategoryPolicy::bucketsKept(stream_.extraData, numBuckets);
+  if (kept < numBuckets) {
+    // Only the buckets of the retention of the category count.
+    for (uint32_t i = 1; i <= kept && i <= current_; i++) {
+      auto block = getBlock(current_ - i, numBuckets);
+      if (block != BucketStorage::kInvalidId &&
+          block != BucketStorage::kDisabledId) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   for (int i = 0; i < numBuckets; i++) {
-    if (blocks_[i] != BucketStorage::kInvalidId &&
-        blocks_[i] != BucketStorage::kDisabledId) {
+    auto block = getBlock(i, numBuckets);
+    if (block != BucketStorage::kInvalidId &&
+        block != BucketStorage::kDisabledId) {
       return true;
     }
   }
@@ -194,6 +907,91 @@ bool BucketedTimeSeries::hasDataPoints(uint8_t numBuckets) {
   return false;
 }
 
+uint32_t BucketedTimeSeries::getBlockBytes(uint32_t position, uint8_t n) {
+  folly::MSLGuard guard(lock_);
+  if (position >= current_ || current_ - position > n) {
+    return 0;
+  }
+  return BucketStorage::getDataLength(getBlock(position, n));
+}
+
+// Number of bitmap words at the start of `blocks_`.
+static uint32_t bitmapWords(uint8_t n) {
+  return (n + 63) / 64;
+}
+
+BucketStorage::BucketStorageId BucketedTimeSeries::getBlock(
+    uint32_t position,
+    uint8_t n) const {
+  uint32_t slot = position % n;
+  if (!blocks_ || !(blocks_[slot / 64] & (1ULL << (slot % 64)))) {
+    return BucketStorage::kInvalidId;
+  }
+  return blocks_[bitmapWords(n) + blockIndex(slot)];
+}
+
+void BucketedTimeSeries::setBlock(
+    uint32_t position,
+    uint8_t n,
+    BucketStorage::BucketStorageId id) {
+  uint32_t slot = position % n;
+  uint32_t words = bitmapWords(n);
+  uint64_t bit = 1ULL << (slot % 64);
+  bool present = blocks_ && (blocks_[slot / 64] & bit);
+  bool keep = id != BucketStorage::kInvalidId;
+
+  if (present && keep) {
+    // Dense time series only replace ids in place.
+    blocks_[words + blockIndex(slot)] = id;
+    return;
+  } else if (!present && !keep) {
+    return;
+  }
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; blocks_ && i < words; i++) {
+    count += __builtin_popcountll(blocks_[i]);
+  }
+  uint32_t newCount = present ? count - 1 : count + 1;
+  if (newCount == 0) {
+    blocks_.reset();
+    return;
+  }
+
+  uint32_t index = blocks_ ? blockIndex(slot) : 0;
+  std::unique_ptr<uint64_t[]> newBlocks(new uint64_t[words + newCount]);
+  for (uint32_t i = 0; i < words; i++) {
+    newBlocks[i] = blocks_ ? blocks_[i] : 0;
+  }
+  newBlocks[slot / 64] ^= bit;
+
+  // Copy the ids, skipping the removed one or making room for the new
+  // one at `index`.
+  for (uint32_t i = 0; i < index; i++) {
+    newBlocks[words + i] = blocks_[words + i];
+  }
+  if (present) {
+    for (uint32_t i = index + 1; i < count; i++) {
+      newBlocks[words + i - 1] = blocks_[words + i];
+    }
+  } else {
+    newBlocks[words + index] = id;
+    for (uint32_t i = index; i < count; i++) {
+      newBlocks[words + i + 1] = blocks_[words + i];
+    }
+  }
+  blocks_ = std::move(newBlocks);
+}
+
+uint32_t BucketedTimeSeries::blockIndex(uint32_t slot) const {
+  uint32_t index = 0;
+  for (uint32_t i = 0; i < slot / 64; i++) {
+    index += __builtin_popcountll(blocks_[i]);
+  }
+  return index +
+      __builtin_popcountll(blocks_[slot / 64] & ((1ULL << (slot % 64)) - 1));
+}
+
 uint16_t BucketedTimeSeries::getCategory() const {
   folly::MSLGuard guard(lock_);
   return stream_.extraData;
@@ -204,6 +1002,34 @@ void BucketedTimeSeries::setCategory(uint16_t category) {
   stream_.extraData = category;
 }
 
+int32_t BucketedTimeSeries::minTimestampDelta(uint16_t category) {
+  auto policy = CategoryPolicy::get(category);
+  if (policy && policy->minTimestampDelta >= 0) {
+    return policy->minTimestampDelta;
+  }
+
+  if (FLAGS_gorilla_high_resolution_categories.empty()) {
+    return FLAGS_mintimestampdelta;
+  }
+
+  static const std::vector<bool> highResolution = parseCategories(
+      FLAGS_gorilla_high_resolution_categories, "high resolution");
+
+  return highResolution[category]
+      ? FLAGS_gorilla_high_resolution_min_timestamp_delta
+      : FLAGS_mintimestampdelta;
+}
+
+bool BucketedTimeSeries::isMillisecondCategory(uint16_t category) {
+  if (FLAGS_gorilla_millisecond_categories.empty()) {
+    return false;
+  }
+
+  static const std::vector<bool> milliseconds = parseCategories(
+      FLAGS_gorilla_millisecond_categories, "millisecond");
+  return milliseconds[category];
+}
+
 int32_t BucketedTimeSeries::getFirstUpdateTime(
     BucketStorage* storage,
     const BucketMap& map) {
@@ -218,7 +1044,7 @@ int32_t BucketedTimeSeries::getFirstUpdateTime(
       continue;
     }
 
-    auto& block = blocks_[position % storage->numBuckets()];
+    auto block = getBlock(position, storage->numBuckets());
     if (block != BucketStorage::kInvalidId &&
         block != BucketStorage::kDisabledId) {
       return map.timestamp(position);
@@ -232,7 +1058,12 @@ uint32_t BucketedTimeSeries::getLastUpdateTime(
     BucketStorage* storage,
     const BucketMap& map) {
   folly::MSLGuard guard(lock_);
-  uint32_t lastUpdateTime = stream_.getPreviousTimeStamp();
+  uint32_t lastUpdateTime = stream_.getRepeatTimeStamp(repeats_);
+  uint8_t reordered = reorderedPoints();
+  if (reordered > 0) {
+    lastUpdateTime = std::max(
+        lastUpdateTime, extra_->reorder.points[reordered - 1].unixTime);
+  }
   if (lastUpdateTime != 0) {
     return lastUpdateTime;
   }
@@ -246,7 +1077,7 @@ uint32_t BucketedTimeSeries::getLastUpdateTime(
       break;
     }
 
-    auto& block = blocks_[position % storage->numBuckets()];
+    auto block = getBlock(position, storage->numBuckets());
     if (block != BucketStorage::kInvalidId &&
         block != BucketStorage::kDisabledId) {
       return map.timestamp(position + 1);
@@ -21,9 +21,21 @@ namespace facebook {
 namespace gorilla {
 
 class BucketMap;
+class CoalescedBlockCache;
+
 // Holds a rolling window of TimeSeries data.
 class BucketedTimeSeries {
  public:
+  // Summary of the values in a range of buckets.
+  struct Stats {
+    uint32_t count = 0;
+    double mean = 0;
+    double variance = 0;
+
+    // The newest value.
+    double last = 0;
+  };
+
   BucketedTimeSeries();
   ~BucketedTimeSeries();
 
@@ -31,11 +43,22 @@ class BucketedTimeSeries {
   // one active bucket. The BucketedTimeSeries will ignore any points
   // that predate minTimestamp and loaded block files that predate minBucket.
   // Not thread-safe.
-  void reset(uint8_t n, uint32_t minBucket, int64_t minTimestamp);
+  void reset(
+      uint8_t n,
+      uint32_t minBucket,
+      int64_t minTimestamp,
+      uint16_t category = 0);
 
   // Add a data point to the given bucket. Returns true if data was
   // added, false if it was dropped. If category pointer is defined,
-  // sets the category.
+  // sets the category. Points of the millisecond categories are
+  // dropped if their milliseconds are not within [0, 999].
+  //
+  // With --reorder_window_secs the point is held back with the last
+  // few points of the time series and appended to the stream in order
+  // once it's old enough, so it's only dropped here if it's older than
+  // what was already appended. Held back points are read with the
+  // active stream.
   bool put(
       uint32_t i,
       const TimeValuePair& value,
@@ -43,9 +66,74 @@ class BucketedTimeSeries {
       uint32_t timeSeriesId,
       uint16_t* category);
 
+  // Same as calling put() for each of the sorted `values` in the
+  // matching bucket of `buckets`, with one acquisition of the lock.
+  // The values of each bucket are appended to the stream in one batch.
+  // Sets `added` for each value and returns the number of values
+  // added.
+  int putMany(
+      const std::vector<TimeValuePair>& values,
+      const std::vector<uint32_t>& buckets,
+      BucketStorage* storage,
+      uint32_t timeSeriesId,
+      uint16_t* category,
+      std::vector<bool>& added);
+
+  // Makes get() and getMany() return the finalized buckets of each time
+  // series as a single re-encoded block instead of one block per bucket.
+  struct Coalesce {
+    // Keeps the coalesced blocks when not null.
+    CoalescedBlockCache* cache = nullptr;
+
+    // The cache key of each time series, e.g., its shard and key. Only
+    // needed with `cache`.
+    std::vector<std::string> keys;
+  };
+
   // Read out buckets between begin and end inclusive, including current one.
+  // The lock is only held while the active stream is copied.
   typedef std::vector<TimeSeriesBlock> Output;
-  void get(uint32_t begin, uint32_t end, Output& out, BucketStorage* storage);
+  void get(
+      uint32_t begin,
+      uint32_t end,
+      Output& out,
+      BucketStorage* storage,
+      const Coalesce* coalesce = nullptr);
+
+  // Same as get() but the blocks point into the pages of the storage
+  // instead of being copied out of them. Only the active stream is
+  // copied.
+  struct Buffer {
+    uint32_t count;
+    std::unique_ptr<folly::IOBuf> data;
+  };
+  void getBuffers(
+      uint32_t begin,
+      uint32_t end,
+      std::vector<Buffer>& out,
+      BucketStorage* storage);
+
+  // Combines the running stats of the buckets between begin and end
+  // inclusive without reading any blocks. The stats are only kept with
+  // --gorilla_running_stats, and only for the points that were put
+  // since the process started. Returns false if there are none.
+  bool getStats(
+      uint32_t begin,
+      uint32_t end,
+      BucketStorage* storage,
+      Stats& stats) const;
+
+  // Same as calling get() for each time series with the matching
+  // output in `outs`. The blocks are fetched one bucket at a time, so
+  // the storage takes its fetch lock once per bucket instead of once
+  // per block.
+  static void getMany(
+      const std::vector<BucketedTimeSeries*>& series,
+      uint32_t begin,
+      uint32_t end,
+      const std::vector<Output*>& outs,
+      BucketStorage* storage,
+      const Coalesce* coalesce = nullptr);
 
   // Returns a tuple representing:
   //   1) the number of points in the active stream.
@@ -70,6 +158,21 @@ class BucketedTimeSeries {
       BucketStorage* storage,
       BucketStorage::BucketStorageId id);
 
+  // Returns the storage id of the block of finalized bucket `position`,
+  // or kInvalidId if there's none or the bucket isn't finalized.
+  BucketStorage::BucketStorageId getFinalizedBlock(
+      uint32_t position,
+      uint8_t n);
+
+  // Replaces the block of finalized bucket `position` with a backfilled
+  // one. Unlike setDataBlock(), also lowers the minimum bucket to
+  // `position`, as the block is known to be of this time series.
+  // Returns false if the bucket isn't finalized or has expired.
+  bool setBackfilledBlock(
+      uint32_t position,
+      uint8_t n,
+      BucketStorage::BucketStorageId id);
+
   // Sets the current bucket. Flushes data from the previous bucket to
   // BucketStorage. No-op if this time series is already at
   // currentBucket.
@@ -78,34 +181,189 @@ class BucketedTimeSeries {
       BucketStorage* storage,
       uint32_t timeSeriesId);
 
-  // Returns true if there are data points for this time series.
+  // Returns true if there are data points for this time series in
+  // the buckets kept for its category.
   bool hasDataPoints(uint8_t numBuckets);
 
+  // Bytes of the block of finalized bucket `position`, 0 if there's
+  // none.
+  uint32_t getBlockBytes(uint32_t position, uint8_t n);
+
   // Returns the ODS category associated with this time series.
   uint16_t getCategory() const;
 
   // Sets the ODS category for this time series.
   void setCategory(uint16_t category);
 
+  // Block data for buckets before this one is ignored.
+  uint32_t getMinBucket() const {
+    return minBucket_;
+  }
+
+  // Smallest number of seconds between two points of a time series in
+  // `category`. --mintimestampdelta unless the category is in
+  // --gorilla_high_resolution_categories, which is only read once.
+  static int32_t minTimestampDelta(uint16_t category);
+
+  // True if the time series in `category` keep the milliseconds of
+  // their points, i.e., the category is in
+  // --gorilla_millisecond_categories, which is only read once.
+  static bool isMillisecondCategory(uint16_t category);
+
+  // Copies the active stream and its encoder state for a snapshot.
+  // Returns false if there are no points in the active bucket.
+  bool getActiveStream(
+      uint32_t& bucket,
+      uint32_t& count,
+      TimeSeriesStream::State& state,
+      std::string& data);
+
+  // Sets the active stream from a snapshot. Returns false if there
+  // already are points in the active bucket, if `bucket` is older than
+  // the current or the minimum bucket or if the stream doesn't match
+  // its state.
+  bool setActiveStream(
+      uint32_t bucket,
+      uint32_t count,
+      const TimeSeriesStream::State& state,
+      folly::StringPiece data);
+
   int32_t getFirstUpdateTime(BucketStorage* storage, const BucketMap& map);
   uint32_t getLastUpdateTime(BucketStorage* storage, const BucketMap& map);
 
  private:
+  // put() with `lock_` held.
+  bool putLocked(
+      uint32_t i,
+      const TimeValuePair& value,
+      BucketStorage* storage,
+      uint32_t timeSeriesId,
+      uint16_t* category);
+
   // Open the next bucket for writes.
   void open(uint32_t next, BucketStorage* storage, uint32_t timeSeriesId);
 
+  // Stores the swinging door approximation of the active stream unless
+  // it's no smaller.
+  BucketStorage::BucketStorageId storeApproximate(
+      BucketStorage* storage,
+      uint32_t timeSeriesId);
+
+  // Returns the storage id of a previous bucket or kInvalidId.
+  BucketStorage::BucketStorageId getBlock(uint32_t position, uint8_t n) const;
+  void setBlock(
+      uint32_t position,
+      uint8_t n,
+      BucketStorage::BucketStorageId id);
+
+  // Index of the storage id of `slot` among the stored ids.
+  uint32_t blockIndex(uint32_t slot) const;
+
+  // Count, sum and sum of squares of the values put in one bucket. The
+  // sums are of the differences from the first value, so that a large
+  // mean doesn't cost the precision of the variance.
+  struct BucketStats {
+    uint32_t bucket;
+    uint32_t count;
+    double shift;
+    double sum;
+    double sumOfSquares;
+    double last;
+  };
+
+  // Appends the points counted in repeats_ to stream_.
+  void appendRepeats();
+
+  // Copies out the active stream, with the repeats and the held back
+  // points of the active bucket appended. Returns the number of points
+  // in it.
+  uint32_t readActiveData(std::string& data);
+
+  // put() with --reorder_window_secs.
+  bool putReordered(
+      uint32_t i,
+      const TimeValuePair& value,
+      BucketStorage* storage,
+      uint32_t timeSeriesId,
+      uint16_t* category);
+
+  // Appends the oldest `count` held back points to the stream.
+  void commitReordered(
+      uint8_t count,
+      BucketStorage* storage,
+      uint32_t timeSeriesId);
+
+  // Appends the held back points of the active bucket to a copy of the
+  // stream and returns how many were appended.
+  uint32_t appendReordered(TimeSeriesStream& stream) const;
+
+  // Adds a value put in bucket `i` to the running stats.
+  void addToStats(uint32_t i, double value, uint8_t n);
+
   uint8_t queriedBucketsAgo_;
 
   mutable folly::MicroSpinLock lock_;
 
+  // Points at the end of the active bucket that repeat the last point
+  // of stream_ at the same interval and haven't been appended to it.
+  // Counted in count_. Constant, regularly spaced time series keep the
+  // stream at its first points until the bucket is read or closed.
+  uint16_t repeats_;
+
   // Number of points in the active bucket (stream_).
-  uint16_t count_;
+  uint32_t count_;
 
   // Currently active bucket.
   uint32_t current_;
 
-  // Blocks of metadata for previous data.
-  std::unique_ptr<BucketStorage::BucketStorageId[]> blocks_;
+  // Block data for buckets before this one is ignored.
+  uint32_t minBucket_;
+
+  // Blocks of metadata for previous data. Only the ids that aren't
+  // kInvalidId are stored, so sparse time series use less memory.
+  // Starts with a bitmap of the slots (position % n) that have an id,
+  // followed by the ids in slot order. Null if there are no ids.
+  std::unique_ptr<uint64_t[]> blocks_;
+
+  static constexpr uint8_t kReorderPoints = 4;
+
+  // The newest points, in timestamp order, that haven't been appended
+  // to the stream yet.
+  struct ReorderBuffer {
+    struct Point {
+      uint32_t bucket;
+      uint32_t unixTime;
+      double value;
+    };
+
+    uint8_t size = 0;
+    Point points[kReorderPoints];
+  };
+
+  // State of the optional features of a time series. Allocated the
+  // first time one of them is used, so that the time series that don't
+  // use any only pay for the pointer.
+  struct Extra {
+    // Running stats of the last n + 1 buckets, indexed by bucket %
+    // (n + 1). Only allocated with --gorilla_running_stats.
+    std::unique_ptr<BucketStats[]> stats;
+
+    // Only used with --reorder_window_secs.
+    ReorderBuffer reorder;
+  };
+  std::unique_ptr<Extra> extra_;
+
+  Extra& getExtra() {
+    if (!extra_) {
+      extra_.reset(new Extra());
+    }
+    return *extra_;
+  }
+
+  // Number of points held back in the reorder buffer.
+  uint8_t reorderedPoints() const {
+    return extra_ ? extra_->reorder.size : 0;
+  }
 
   // Current stream of data.
   TimeSeriesStream stream_;
@@ -29,7 +29,44 @@ size_t CaseHash::operator()(const char* s) const {
   return CaseHash::hash(s, kCaseHashSeed);
 }
 
+// Returns true if `s` has any of 'A' to 'Z'. Looks at 8 bytes at a
+// time, like folly::toLowerAscii().
+static bool hasUpperAscii(folly::StringPiece s) {
+  const uint64_t kOnes = 0x0101010101010101ULL;
+  const uint64_t kHighBits = kOnes * 0x80;
+
+  const char* p = s.data();
+  size_t n = s.size();
+  for (; n >= sizeof(uint64_t); p += sizeof(uint64_t), n -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+
+    // Without the high bits the additions can't carry into the next
+    // byte. The high bit of each sum is set if the byte is at least
+    // 'A' and if it's past 'Z'.
+    uint64_t low = word & ~kHighBits;
+    uint64_t atLeastA = low + kOnes * (0x80 - 'A');
+    uint64_t pastZ = low + kOnes * (0x80 - 'Z' - 1);
+    if (atLeastA & ~pastZ & ~word & kHighBits) {
+      return true;
+    }
+  }
+
+  for (; n > 0; p++, n--) {
+    if (*p >= 'A' && *p <= 'Z') {
+      return true;
+    }
+  }
+  return false;
+}
+
 uint64_t CaseHash::hash(folly::StringPiece s, uint64_t seed) {
+  // Most keys are already in lower case and can be hashed in place.
+  // This gives the same hash as the copy below.
+  if (!hasUpperAscii(s)) {
+    return folly::hash::SpookyHashV2::Hash64(s.data(), s.size(), seed);
+  }
+
   char buf[kBufferSize];
   folly::hash::SpookyHashV2 spooky;
   spooky.Init(seed, seed);
@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/lib/CategoryPolicy.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <folly/Conv.h>
+#include <folly/String.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_string(
+    gorilla_category_policies,
+    "",
+    "Comma separated per category limits, each as "
+    "<category>:<name>=<value>:... with the names retention (buckets "
+    "of data kept), interval (replaces --mintimestampdelta), series "
+    "(time series per shard) and memory_mb (megabytes of blocks per "
+    "shard). For example 7:retention=2:series=10000,9:interval=300");
+
+namespace facebook {
+namespace gorilla {
+
+bool CategoryPolicy::parse(
+    folly::StringPiece spec,
+    std::unordered_map<uint16_t, CategoryPolicy>& out) {
+  std::vector<folly::StringPiece> entries;
+  folly::split(',', spec, entries, true);
+  for (auto entry : entries) {
+    std::vector<folly::StringPiece> fields;
+    folly::split(':', folly::trimWhitespace(entry), fields);
+    auto category = folly::tryTo<uint16_t>(fields[0]);
+    if (!category.hasValue()) {
+      LOG(ERROR) << "Invalid category in policy: " << entry;
+      return false;
+    }
+
+    CategoryPolicy& policy = out[category.value()];
+    for (int i = 1; i < fields.size(); i++) {
+      folly::StringPiece name;
+      folly::StringPiece value;
+      if (!folly::split('=', fields[i], name, value)) {
+        LOG(ERROR) << "Invalid category policy: " << entry;
+        return false;
+      }
+
+      auto parsed = folly::tryTo<int64_t>(value);
+      if (!parsed.hasValue() || parsed.value() < 0) {
+        LOG(ERROR) << "Invalid value in category policy: " << entry;
+        return false;
+      }
+
+      int64_t v = parsed.value();
+      if (name == "retention" && v <= std::numeric_limits<uint8_t>::max()) {
+        policy.retentionBuckets = v;
+      } else if (
+          name == "interval" && v <= std::numeric_limits<int32_t>::max()) {
+        policy.minTimestampDelta = v;
+      } else if (name == "series") {
+        policy.maxSeries = v;
+      } else if (name == "memory_mb" && v < (1LL << 40)) {
+        policy.maxBytes = v << 20;
+      } else {
+        LOG(ERROR) << "Invalid category policy: " << entry;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+const CategoryPolicy* CategoryPolicy::get(uint16_t category) {
+  if (FLAGS_gorilla_category_policies.empty()) {
+    return nullptr;
+  }
+
+  static const std::unordered_map<uint16_t, CategoryPolicy> policies = []() {
+    std::unordered_map<uint16_t, CategoryPolicy> parsed;
+    if (!parse(FLAGS_gorilla_category_policies, parsed)) {
+      LOG(ERROR) << "Ignoring --gorilla_category_policies";
+      parsed.clear();
+    }
+    return parsed;
+  }();
+
+  auto it = policies.find(category);
+  return it == policies.end() ? nullptr : &it->second;
+}
+
+uint8_t CategoryPolicy::bucketsKept(
+    uint16_t category,
+    uint8_t numBuckets) {
+  auto policy = get(category);
+  if (policy && policy->retentionBuckets > 0) {
+    return std::min(policy->retentionBuckets, numBuckets);
+  }
+  return numBuckets;
+}
+}
+} // facebook::gorilla
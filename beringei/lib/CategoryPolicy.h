@@ -0,0 +1,54 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <unordered_map>
+
+#include <folly/Range.h>
+
+namespace facebook {
+namespace gorilla {
+
+// The limits of the time series of one category, from
+// --gorilla_category_policies. Zero means no limit.
+struct CategoryPolicy {
+  // Buckets of data that are queried. The time series are purged once
+  // they have no data in them. More than the buckets of the shard
+  // can't be kept.
+  uint8_t retentionBuckets = 0;
+
+  // Replaces --mintimestampdelta when not negative.
+  int32_t minTimestampDelta = -1;
+
+  // New time series are refused once a shard has this many of the
+  // category.
+  int64_t maxSeries = 0;
+
+  // New time series are refused once the category has about this many
+  // bytes of blocks in a shard.
+  int64_t maxBytes = 0;
+
+  // Parses comma separated "<category>:<name>=<value>:..." policies,
+  // where the names are retention (buckets), interval (seconds),
+  // series and memory_mb. Returns false if any of them is invalid.
+  static bool parse(
+      folly::StringPiece spec,
+      std::unordered_map<uint16_t, CategoryPolicy>& out);
+
+  // The policy of `category`, or null if it has none. The flag is
+  // parsed the first time it's not empty.
+  static const CategoryPolicy* get(uint16_t category);
+
+  // The buckets of data kept for `category` in a shard of
+  // `numBuckets` buckets.
+  static uint8_t bucketsKept(uint16_t category, uint8_t numBuckets);
+};
+}
+} // facebook::gorilla
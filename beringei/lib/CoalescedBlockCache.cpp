@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "CoalescedBlockCache.h"
+
+#include "GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kHits = "coalesced_block_cache_hits";
+static const std::string kMisses = "coalesced_block_cache_misses";
+static const std::string kStale = "coalesced_block_cache_stale";
+static const std::string kEvictions = "coalesced_block_cache_evictions";
+static const std::string kBytes = "coalesced_block_cache_bytes";
+
+// Approximate overhead of an entry in the list and the map.
+static const size_t kEntryOverhead = 128;
+
+size_t CoalescedBlockCache::EntryKeyHash::operator()(
+    const EntryKey& key) const {
+  size_t hash = std::hash<std::string>()(*key.key);
+  hash = hash * 31 + std::hash<uint32_t>()(key.first);
+  return hash * 31 + std::hash<size_t>()(key.buckets);
+}
+
+CoalescedBlockCache::CoalescedBlockCache(size_t maxBytes)
+    : maxBytes_(maxBytes), bytes_(0) {
+  GorillaStatsManager::addStatExportType(kHits, SUM);
+  GorillaStatsManager::addStatExportType(kMisses, SUM);
+  GorillaStatsManager::addStatExportType(kStale, SUM);
+  GorillaStatsManager::addStatExportType(kEvictions, SUM);
+}
+
+bool CoalescedBlockCache::get(
+    const std::string& key,
+    uint32_t first,
+    const std::vector<BucketStorage::BucketStorageId>& ids,
+    TimeSeriesBlock& block) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = entries_.find({&key, first, ids.size()});
+    if (it != entries_.end()) {
+      if (it->second->ids == ids) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        block = it->second->block;
+        GorillaStatsManager::addStatValue(kHits);
+        return true;
+      }
+
+      // The time series changed under the entry.
+      bytes_ -= getMemoryUsage(*it->second);
+      lru_.erase(it->second);
+      entries_.erase(it);
+      GorillaStatsManager::addStatValue(kStale);
+    }
+  }
+
+  GorillaStatsManager::addStatValue(kMisses);
+  return false;
+}
+
+void CoalescedBlockCache::put(
+    const std::string& key,
+    uint32_t first,
+    const std::vector<BucketStorage::BucketStorageId>& ids,
+    const TimeSeriesBlock& block) {
+  Entry entry;
+  entry.key = key;
+  entry.first = first;
+  entry.ids = ids;
+  entry.block = block;
+  size_t size = getMemoryUsage(entry);
+  if (size > maxBytes_) {
+    return;
+  }
+
+  int evictions = 0;
+  size_t bytes;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = entries_.find({&key, first, ids.size()});
+    if (it != entries_.end()) {
+      bytes_ -= getMemoryUsage(*it->second);
+      lru_.erase(it->second);
+      entries_.erase(it);
+    }
+
+    while (bytes_ + size > maxBytes_ && !lru_.empty()) {
+      const Entry& last = lru_.back();
+      entries_.erase({&last.key, last.first, last.ids.size()});
+      bytes_ -= getMemoryUsage(last);
+      lru_.pop_back();
+      evictions++;
+    }
+
+    lru_.push_front(std::move(entry));
+    const Entry& cached = lru_.front();
+    entries_[{&cached.key, cached.first, cached.ids.size()}] = lru_.begin();
+    bytes_ += size;
+    bytes = bytes_;
+  }
+
+  if (evictions > 0) {
+    GorillaStatsManager::addStatValue(kEvictions, evictions);
+  }
+  GorillaStatsManager::setCounter(kBytes, bytes);
+}
+
+size_t CoalescedBlockCache::getMemoryUsage() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return bytes_;
+}
+
+size_t CoalescedBlockCache::getMemoryUsage(const Entry& entry) {
+  return kEntryOverhead + entry.key.size() +
+      entry.ids.size() * sizeof(BucketStorage::BucketStorageId) +
+      entry.block.data.size() + entry.block.checkpoints.size();
+}
+}
+} // facebook::gorilla
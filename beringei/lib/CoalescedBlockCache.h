@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BucketStorage.h"
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class CoalescedBlockCache
+//
+// Keeps the single blocks that the finalized buckets of a time series
+// were coalesced into, so that reading the same historical range again
+// doesn't fetch and re-encode every bucket. An entry is only used while
+// the time series still points to the same storage ids, so rows that
+// were erased and created again or buckets that were loaded again are
+// never served stale. The least recently used entries are evicted once
+// the blocks take more than `maxBytes`.
+class CoalescedBlockCache {
+ public:
+  explicit CoalescedBlockCache(size_t maxBytes);
+
+  // Copies the block coalesced from the buckets with the storage ids
+  // `ids`, starting at position `first`, of the time series `key` to
+  // `block`. Returns false if it isn't cached.
+  bool get(
+      const std::string& key,
+      uint32_t first,
+      const std::vector<BucketStorage::BucketStorageId>& ids,
+      TimeSeriesBlock& block);
+
+  void put(
+      const std::string& key,
+      uint32_t first,
+      const std::vector<BucketStorage::BucketStorageId>& ids,
+      const TimeSeriesBlock& block);
+
+  size_t getMemoryUsage();
+
+ private:
+  struct Entry {
+    std::string key;
+    uint32_t first;
+    std::vector<BucketStorage::BucketStorageId> ids;
+    TimeSeriesBlock block;
+  };
+
+  // Points to the key of an entry, or of the caller while looking up.
+  struct EntryKey {
+    const std::string* key;
+    uint32_t first;
+    size_t buckets;
+
+    bool operator==(const EntryKey& other) const {
+      return *key == *other.key && first == other.first &&
+          buckets == other.buckets;
+    }
+  };
+
+  struct EntryKeyHash {
+    size_t operator()(const EntryKey& key) const;
+  };
+
+  static size_t getMemoryUsage(const Entry& entry);
+
+  const size_t maxBytes_;
+
+  std::mutex mutex_;
+
+  // The most recently used entry first.
+  std::list<Entry> lru_;
+  std::unordered_map<EntryKey, std::list<Entry>::iterator, EntryKeyHash>
+      entries_;
+  size_t bytes_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "ColumnarPages.h"
+
+#include <string.h>
+#include <unordered_map>
+
+#include "DataBlock.h"
+#include "TimeSeriesStream.h"
+
+namespace facebook {
+namespace gorilla {
+
+namespace {
+
+void appendUint32(std::string& out, uint32_t value) {
+  out.append((const char*)&value, sizeof(value));
+}
+
+bool readUint32(folly::StringPiece& in, uint32_t& value) {
+  if (in.size() < sizeof(value)) {
+    return false;
+  }
+  memcpy(&value, in.data(), sizeof(value));
+  in.advance(sizeof(value));
+  return true;
+}
+
+bool readBytes(folly::StringPiece& in, folly::StringPiece& bytes) {
+  uint32_t length;
+  if (!readUint32(in, length) || in.size() < length) {
+    return false;
+  }
+  bytes = folly::StringPiece(in.data(), length);
+  in.advance(length);
+  return true;
+}
+
+bool inPages(const ColumnarPages::Block& block, uint32_t numPages) {
+  return block.pageIndex < numPages && block.pageOffset < kDataBlockSize &&
+      block.dataLength > 0 &&
+      block.dataLength <= kDataBlockSize - block.pageOffset;
+}
+}
+
+uint32_t ColumnarPages::encode(
+    const std::vector<char*>& pages,
+    const std::vector<Block>& blocks,
+    std::string& out) {
+  struct Split {
+    const Block* block;
+    uint32_t timestamps;
+    std::string values;
+  };
+
+  std::vector<Split> splits;
+  std::vector<std::string> timestamps;
+  std::vector<uint32_t> uses;
+  std::unordered_map<std::string, uint32_t> timestampIndex;
+  std::string blockTimestamps;
+  std::string joined;
+  for (const auto& block : blocks) {
+    if (!inPages(block, pages.size())) {
+      continue;
+    }
+
+    folly::StringPiece data(
+        pages[block.pageIndex] + block.pageOffset, block.dataLength);
+    Split split{&block, 0, std::string()};
+    if (!TimeSeriesStream::split(
+            data, block.itemCount, blockTimestamps, split.values) ||
+        !TimeSeriesStream::join(
+            blockTimestamps, split.values, block.itemCount, joined) ||
+        joined.size() != data.size() ||
+        memcmp(joined.data(), data.data(), data.size()) != 0) {
+      continue;
+    }
+
+    auto inserted =
+        timestampIndex.emplace(blockTimestamps, timestampIndex.size());
+    if (inserted.second) {
+      timestamps.push_back(blockTimestamps);
+      uses.push_back(0);
+    }
+    split.timestamps = inserted.first->second;
+    uses[split.timestamps]++;
+    splits.push_back(std::move(split));
+  }
+
+  // Only timestamps that are shared are worth a table entry. The rest
+  // of the blocks stay in the pages.
+  std::vector<uint32_t> renumbered(timestamps.size());
+  uint32_t numTimestamps = 0;
+  for (int i = 0; i < timestamps.size(); i++) {
+    if (uses[i] > 1) {
+      renumbered[i] = numTimestamps++;
+    }
+  }
+
+  appendUint32(out, numTimestamps);
+  for (int i = 0; i < timestamps.size(); i++) {
+    if (uses[i] > 1) {
+      appendUint32(out, timestamps[i].size());
+      out.append(timestamps[i]);
+    }
+  }
+
+  uint32_t numBlocks = 0;
+  for (const auto& split : splits) {
+    numBlocks += uses[split.timestamps] > 1;
+  }
+
+  appendUint32(out, numBlocks);
+  for (const auto& split : splits) {
+    if (uses[split.timestamps] <= 1) {
+      continue;
+    }
+
+    const Block& block = *split.block;
+    appendUint32(out, block.pageIndex);
+    appendUint32(out, block.pageOffset);
+    appendUint32(out, block.dataLength);
+    appendUint32(out, block.itemCount);
+    appendUint32(out, renumbered[split.timestamps]);
+    appendUint32(out, split.values.size());
+    out.append(split.values);
+    memset(pages[block.pageIndex] + block.pageOffset, 0, block.dataLength);
+  }
+
+  return numBlocks;
+}
+
+bool ColumnarPages::decode(
+    folly::StringPiece columns,
+    const std::vector<char*>& pages) {
+  uint32_t numTimestamps;
+  if (!readUint32(columns, numTimestamps)) {
+    return false;
+  }
+
+  std::vector<folly::StringPiece> timestamps(numTimestamps);
+  for (auto& sequence : timestamps) {
+    if (!readBytes(columns, sequence)) {
+      return false;
+    }
+  }
+
+  uint32_t numBlocks;
+  if (!readUint32(columns, numBlocks)) {
+    return false;
+  }
+
+  std::string data;
+  for (uint32_t i = 0; i < numBlocks; i++) {
+    uint32_t pageIndex;
+    uint32_t pageOffset;
+    uint32_t dataLength;
+    uint32_t itemCount;
+    uint32_t sequence;
+    folly::StringPiece values;
+    if (!readUint32(columns, pageIndex) || !readUint32(columns, pageOffset) ||
+        !readUint32(columns, dataLength) || !readUint32(columns, itemCount) ||
+        !readUint32(columns, sequence) || !readBytes(columns, values) ||
+        sequence >= numTimestamps) {
+      return false;
+    }
+
+    Block block{pageIndex, pageOffset, (uint16_t)dataLength, (uint16_t)0};
+    if (dataLength > UINT16_MAX || !inPages(block, pages.size()) ||
+        !TimeSeriesStream::join(
+            timestamps[sequence], values, itemCount, data) ||
+        data.size() != dataLength) {
+      return false;
+    }
+    memcpy(pages[pageIndex] + pageOffset, data.data(), dataLength);
+  }
+
+  return columns.empty();
+}
+}
+} // facebook::gorilla
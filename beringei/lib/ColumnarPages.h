@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+
+namespace facebook {
+namespace gorilla {
+
+// class ColumnarPages
+//
+// Block file encoding of the pages of a finalized bucket that stores
+// the timestamps of its blocks once per distinct sequence. Most time
+// series of a shard are written at the same times, so their blocks
+// have the same timestamp bits and differ only in their values.
+//
+// Each block is split with TimeSeriesStream::split() and the ones
+// whose timestamps are shared with another block are cut out of the
+// pages, which are left zeroed and cost next to nothing once the file
+// is compressed. The cut blocks are stored after the pages as a table
+// of distinct timestamp parts and the value part of each block.
+// decode() puts them back bit for bit, so the storage ids of the
+// bucket stay valid and the pages in memory are the same as before.
+class ColumnarPages {
+ public:
+  // Set in the page count of block files whose pages are followed by
+  // columns.
+  static constexpr uint32_t kPageCountFlag = 1U << 31;
+
+  // A block in the pages, as in its storage id.
+  struct Block {
+    uint32_t pageIndex;
+    uint32_t pageOffset;
+    uint16_t dataLength;
+    uint16_t itemCount;
+  };
+
+  // Cuts the blocks out of `pages`, which are kDataBlockSize bytes each, and
+  // appends their columns to `out`. Blocks that don't share their
+  // timestamps or don't split and join back to the same bytes are left
+  // in the pages. Returns the number of blocks that were cut out.
+  static uint32_t encode(
+      const std::vector<char*>& pages,
+      const std::vector<Block>& blocks,
+      std::string& out);
+
+  // Writes the blocks in `columns` back into `pages`. Returns false if
+  // the columns are corrupt.
+  static bool decode(
+      folly::StringPiece columns,
+      const std::vector<char*>& pages);
+};
+}
+} // facebook::gorilla
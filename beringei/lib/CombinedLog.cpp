@@ -0,0 +1,250 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/lib/CombinedLog.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <ctime>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "beringei/lib/GorillaStatsManager.h"
+
+DEFINE_int32(
+    combined_log_segment_size,
+    256 * 1024 * 1024,
+    "Start a new combined log segment once the current one is this large");
+
+namespace facebook {
+namespace gorilla {
+
+DECLARE_int32(data_log_buffer_size);
+
+const std::string CombinedLogWriter::kDirectory = "combined_log";
+const std::string CombinedLogWriter::kSegmentPrefix = "segment";
+
+static const std::string kCombinedLogFailures = "failed_writes.combined_log";
+static const std::string kCombinedLogSegments = "combined_log_segments";
+
+namespace {
+struct ChunkHeader {
+  uint32_t shardId;
+  uint32_t flags;
+  int64_t fileId;
+  uint32_t length;
+};
+
+const size_t kChunkHeaderSize = 20;
+
+void encodeHeader(const ChunkHeader& header, char* out) {
+  memcpy(out, &header.shardId, sizeof(header.shardId));
+  memcpy(out + 4, &header.flags, sizeof(header.flags));
+  memcpy(out + 8, &header.fileId, sizeof(header.fileId));
+  memcpy(out + 16, &header.length, sizeof(header.length));
+}
+
+void decodeHeader(const char* in, ChunkHeader& header) {
+  memcpy(&header.shardId, in, sizeof(header.shardId));
+  memcpy(&header.flags, in + 4, sizeof(header.flags));
+  memcpy(&header.fileId, in + 8, sizeof(header.fileId));
+  memcpy(&header.length, in + 16, sizeof(header.length));
+}
+}
+
+CombinedLogWriter::CombinedLogWriter(
+    const std::string& dataDirectory,
+    int partition)
+    : files_(
+          partition,
+          kSegmentPrefix,
+          FileUtils::joinPaths(dataDirectory, kDirectory)),
+      out_{nullptr, ""},
+      segmentId_(0),
+      segmentSize_(0) {
+  GorillaStatsManager::addStatExportType(kCombinedLogFailures, SUM);
+  GorillaStatsManager::addStatExportType(kCombinedLogSegments, SUM);
+  files_.createDirectories();
+
+  // Never reuse the id of a segment from before a restart.
+  std::vector<int64_t> ids = files_.ls();
+  if (!ids.empty()) {
+    segmentId_ = ids.back();
+  }
+}
+
+CombinedLogWriter::~CombinedLogWriter() {
+  FileUtils::closeFile(out_, FLAGS_gorilla_async_file_close);
+}
+
+bool CombinedLogWriter::append(
+    uint32_t shardId,
+    int64_t fileId,
+    uint32_t flags,
+    const char* data,
+    size_t length) {
+  if (!out_.file || segmentSize_ >= FLAGS_combined_log_segment_size) {
+    if (!openSegment()) {
+      GorillaStatsManager::addStatValue(kCombinedLogFailures, 1);
+      return false;
+    }
+  }
+
+  char header[kChunkHeaderSize];
+  encodeHeader(ChunkHeader{shardId, flags, fileId, (uint32_t)length}, header);
+  if (fwrite(header, 1, kChunkHeaderSize, out_.file) != kChunkHeaderSize ||
+      fwrite(data, 1, length, out_.file) != length) {
+    PLOG(ERROR) << "Writing to combined log segment failed: " << out_.name;
+    GorillaStatsManager::addStatValue(kCombinedLogFailures, 1);
+
+    // The rest of the segment can't be read after a partial chunk.
+    FileUtils::closeFile(out_, FLAGS_gorilla_async_file_close);
+    out_.file = nullptr;
+    return false;
+  }
+
+  segmentSize_ += kChunkHeaderSize + length;
+  return true;
+}
+
+bool CombinedLogWriter::sync() {
+  if (!out_.file) {
+    return true;
+  }
+
+  if (fflush(out_.file) != 0 || fdatasync(fileno(out_.file)) != 0) {
+    PLOG(ERROR) << "Syncing combined log segment failed: " << out_.name;
+    GorillaStatsManager::addStatValue(kCombinedLogFailures, 1);
+    return false;
+  }
+  return true;
+}
+
+void CombinedLogWriter::clearTo(int64_t unixTime) {
+  // A segment only has chunks written before the next segment was
+  // started, so everything before the newest segment started before
+  // `unixTime` can go.
+  int64_t oldestToKeep = 0;
+  for (int64_t id : files_.ls()) {
+    if (id <= unixTime) {
+      oldestToKeep = id;
+    }
+  }
+  files_.clearTo(oldestToKeep);
+}
+
+bool CombinedLogWriter::openSegment() {
+  FileUtils::closeFile(out_, FLAGS_gorilla_async_file_close);
+  out_.file = nullptr;
+
+  // Ids have to grow even if segments are started within a second.
+  int64_t id = std::max<int64_t>(time(nullptr), segmentId_ + 1);
+  out_ = files_.open(id, "wb", FLAGS_data_log_buffer_size);
+  if (!out_.file) {
+    return false;
+  }
+
+  segmentId_ = id;
+  segmentSize_ = 0;
+  GorillaStatsManager::addStatValue(kCombinedLogSegments, 1);
+  return true;
+}
+
+bool CombinedLogReader::exists(const std::string& dataDirectory) {
+  return FileUtils::isDirectory(
+      FileUtils::joinPaths(dataDirectory, CombinedLogWriter::kDirectory));
+}
+
+void CombinedLogReader::readShard(
+    const std::string& dataDirectory,
+    uint32_t shardId,
+    std::map<int64_t, std::string>& files) {
+  std::string directory =
+      FileUtils::joinPaths(dataDirectory, CombinedLogWriter::kDirectory);
+  if (!FileUtils::isDirectory(directory)) {
+    return;
+  }
+
+  // Segments of all the partitions, oldest first. A shard might have
+  // been written by different partitions before restarts.
+  std::vector<std::pair<int64_t, int>> segments;
+  boost::filesystem::directory_iterator end;
+  for (boost::filesystem::directory_iterator it(directory); it != end; it++) {
+    int partition;
+    try {
+      partition = std::stoi(it->path().filename().native());
+    } catch (...) {
+      continue;
+    }
+
+    FileUtils segmentFiles(
+        partition, CombinedLogWriter::kSegmentPrefix, directory);
+    for (int64_t id : segmentFiles.ls()) {
+      segments.emplace_back(id, partition);
+    }
+  }
+  std::sort(segments.begin(), segments.end());
+
+  for (const auto& segment : segments) {
+    FileUtils segmentFiles(
+        segment.second, CombinedLogWriter::kSegmentPrefix, directory);
+    auto f = segmentFiles.open(segment.first, "rb", 0);
+    if (!f.file) {
+      continue;
+    }
+
+    fseek(f.file, 0, SEEK_END);
+    int64_t remaining = ftell(f.file);
+    fseek(f.file, 0, SEEK_SET);
+
+    // Only the headers of the chunks of the other shards are read.
+    char buffer[kChunkHeaderSize];
+    ChunkHeader header;
+    std::string chunk;
+    while (remaining >= kChunkHeaderSize &&
+           fread(buffer, 1, kChunkHeaderSize, f.file) == kChunkHeaderSize) {
+      remaining -= kChunkHeaderSize;
+      decodeHeader(buffer, header);
+      if (header.length > remaining) {
+        // Still being written or cut short by a crash.
+        LOG(WARNING) << "Partial chunk at the end of " << f.name;
+        break;
+      }
+      remaining -= header.length;
+
+      if (header.shardId != shardId) {
+        if (fseek(f.file, header.length, SEEK_CUR) != 0) {
+          break;
+        }
+        continue;
+      }
+
+      chunk.resize(header.length);
+      if (fread(&chunk[0], 1, header.length, f.file) != header.length) {
+        PLOG(ERROR) << "Failed to read chunk from " << f.name;
+        break;
+      }
+
+      std::string& file = files[header.fileId];
+      if (header.flags & CombinedLogWriter::kStartOfFile) {
+        file.clear();
+      }
+      file.append(chunk);
+    }
+    fclose(f.file);
+  }
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "beringei/lib/FileUtils.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class CombinedLogWriter
+//
+// Writes the log files of all the shards of a log writer into large
+// host level segments instead of a file per shard per bucket. Each
+// segment is a sequence of chunks, and each chunk holds a piece of one
+// shard's log file:
+//
+//   shard id (4 bytes), flags (4 bytes), log file id (8 bytes),
+//   length (4 bytes), `length` bytes of the log file.
+//
+// Concatenating the chunks of a log file in order gives the same bytes
+// as a separate log file would have. The chunk headers are the index of
+// the segment: a shard can be read by skipping over the chunks of the
+// other shards.
+//
+// Segments are stored in /path/to/data/combined_log/partition/segment.XXXX
+// where the id is the time the segment was started.
+//
+// This class is not thread safe.
+class CombinedLogWriter {
+ public:
+  static const std::string kDirectory;
+  static const std::string kSegmentPrefix;
+
+  // The first chunk of a log file. Log files that are opened again
+  // start from the beginning, like when they are truncated.
+  static const uint32_t kStartOfFile = 1;
+
+  CombinedLogWriter(const std::string& dataDirectory, int partition);
+
+  ~CombinedLogWriter();
+
+  // Appends a chunk of the log file `fileId` of the shard. Returns true
+  // if all of it was written.
+  bool append(
+      uint32_t shardId,
+      int64_t fileId,
+      uint32_t flags,
+      const char* data,
+      size_t length);
+
+  // Flushes the current segment and waits until it's on disk with
+  // fdatasync. Returns true if everything was successful.
+  bool sync();
+
+  // Removes the segments that only have chunks written before
+  // `unixTime`.
+  void clearTo(int64_t unixTime);
+
+ private:
+  // Closes the current segment and opens a new one. Returns false if
+  // the new segment couldn't be opened.
+  bool openSegment();
+
+  FileUtils files_;
+  FileUtils::File out_;
+  int64_t segmentId_;
+  size_t segmentSize_;
+};
+
+class CombinedLogReader {
+ public:
+  // Reads the log files of the shard from all the segments in the data
+  // directory. `files` maps log file ids to their contents.
+  static void readShard(
+      const std::string& dataDirectory,
+      uint32_t shardId,
+      std::map<int64_t, std::string>& files);
+
+  // Returns true if the data directory has combined log segments.
+  static bool exists(const std::string& dataDirectory);
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,169 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "DataBlockAllocator.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "GorillaStatsManager.h"
+
+DEFINE_bool(
+    data_block_huge_pages,
+    false,
+    "Allocate BucketStorage pages from large regions backed by huge pages. "
+    "Released pages are reused instead of being returned to the system.");
+
+namespace facebook {
+namespace gorilla {
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Each region holds 512 blocks.
+static const size_t kRegionSize = 16 * kHugePageSize;
+
+static const std::string kHugePageRegions = "data_block_huge_page_regions";
+static const std::string kHugePageFallbacks =
+    "data_block_huge_page_madvise_fallbacks";
+
+namespace {
+class HugePagePool {
+ public:
+  DataBlock* allocate() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (freeList_.empty() && !mapRegion()) {
+      return nullptr;
+    }
+
+    DataBlock* block = freeList_.back();
+    freeList_.pop_back();
+    releasedBlocks_ = std::min(releasedBlocks_, freeList_.size());
+    return block;
+  }
+
+  void release(DataBlock* block) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    freeList_.push_back(block);
+  }
+
+  size_t freeBlocks() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return freeList_.size();
+  }
+
+  size_t releaseFreeBlocks() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    size_t released = 0;
+    for (; releasedBlocks_ < freeList_.size(); releasedBlocks_++) {
+      DataBlock* block = freeList_[releasedBlocks_];
+      if (madvise(block, sizeof(DataBlock), MADV_DONTNEED) == 0) {
+        released++;
+      }
+    }
+    return released;
+  }
+
+ private:
+  // Maps a new region and adds its blocks to the free list. Caller
+  // must hold the mutex.
+  bool mapRegion() {
+    // Try reserved huge pages first.
+    void* region = mmap(
+        nullptr,
+        kRegionSize,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+        -1,
+        0);
+
+    if (region == MAP_FAILED) {
+      // No reserved huge pages. Map a bit more to align the region to
+      // the huge page size and ask for transparent huge pages.
+      size_t length = kRegionSize + kHugePageSize;
+      char* mapped = (char*)mmap(
+          nullptr,
+          length,
+          PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS,
+          -1,
+          0);
+      if (mapped == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to map a region for data blocks";
+        return false;
+      }
+
+      uintptr_t address = (uintptr_t)mapped;
+      uintptr_t aligned = (address + kHugePageSize - 1) & ~(kHugePageSize - 1);
+      size_t head = aligned - address;
+      if (head > 0) {
+        munmap(mapped, head);
+      }
+      if (length - head > kRegionSize) {
+        munmap((char*)aligned + kRegionSize, length - head - kRegionSize);
+      }
+
+      region = (void*)aligned;
+      if (madvise(region, kRegionSize, MADV_HUGEPAGE) != 0) {
+        PLOG(WARNING) << "madvise(MADV_HUGEPAGE) failed for data blocks";
+      }
+      GorillaStatsManager::addStatValue(kHugePageFallbacks);
+    }
+
+    GorillaStatsManager::addStatValue(kHugePageRegions);
+    DataBlock* blocks = (DataBlock*)region;
+    for (size_t i = 0; i < kRegionSize / sizeof(DataBlock); i++) {
+      freeList_.push_back(&blocks[i]);
+    }
+    return true;
+  }
+
+  std::mutex mutex_;
+  std::vector<DataBlock*> freeList_;
+
+  // The blocks at the bottom of the free list that were already
+  // released to the system.
+  size_t releasedBlocks_ = 0;
+};
+
+// Never destroyed so that blocks can still be released during
+// shutdown.
+HugePagePool& getPool() {
+  static HugePagePool* pool = new HugePagePool();
+  return *pool;
+}
+} // namespace
+
+std::shared_ptr<DataBlock> DataBlockAllocator::allocate() {
+  if (FLAGS_data_block_huge_pages) {
+    DataBlock* block = getPool().allocate();
+    if (block) {
+      return std::shared_ptr<DataBlock>(
+          block, [](DataBlock* b) { getPool().release(b); });
+    }
+  }
+
+  return std::shared_ptr<DataBlock>(new DataBlock);
+}
+
+size_t DataBlockAllocator::freeBlocks() {
+  return getPool().freeBlocks();
+}
+
+size_t DataBlockAllocator::releaseFreeBlocks() {
+  return getPool().releaseFreeBlocks();
+}
+}
+} // facebook::gorilla
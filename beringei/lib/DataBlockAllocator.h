@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include "DataBlock.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class DataBlockAllocator
+//
+// Allocates the pages of BucketStorage. By default every block is a
+// separate heap allocation. With --data_block_huge_pages the blocks
+// are carved out of large mmap'ed regions backed by huge pages, which
+// cuts TLB misses when scanning the pages. Blocks of those regions
+// are kept in a free list for reuse when they are released and the
+// regions are never unmapped.
+//
+// Thread-safe.
+class DataBlockAllocator {
+ public:
+  // Returns an uninitialized block.
+  static std::shared_ptr<DataBlock> allocate();
+
+  // Number of blocks in the free list of the huge page regions.
+  static size_t freeBlocks();
+
+  // Returns the memory of the blocks in the free list to the system.
+  // They are still reused and are faulted back in when they are.
+  // Returns how many were released.
+  static size_t releaseFreeBlocks();
+};
+}
+} // facebook::gorilla
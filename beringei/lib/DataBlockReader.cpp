@@ -9,62 +9,86 @@
 
 #include "DataBlockReader.h"
 
+#include "BlockFileCodec.h"
 #include "BucketStorage.h"
+#include "ColumnarPages.h"
+#include "DataBlockAllocator.h"
+#include "GorillaStatsManager.h"
+
+#include <algorithm>
 
-#include <folly/compression/Compression.h>
 #include <folly/io/IOBuf.h>
+#include <gflags/gflags.h>
+
+DEFINE_int32(
+    block_file_read_threads,
+    1,
+    "Uncompress the pages of checksummed block files on this many threads "
+    "per shard.");
 
 namespace facebook {
 namespace gorilla {
 
+static const std::string kDamagedPages = "block_file_damaged_pages";
+static const std::string kDroppedDamagedBlocks =
+    "block_file_damaged_blocks_dropped";
+
 DataBlockReader::DataBlockReader(
     int64_t shardId,
     const std::string& dataDirectory)
     : dataFiles_(shardId, BucketStorage::kDataPrefix, dataDirectory),
-      completedFiles_(shardId, BucketStorage::kCompletePrefix, dataDirectory) {}
+      completedFiles_(shardId, BucketStorage::kCompletePrefix, dataDirectory) {
+  GorillaStatsManager::addStatExportType(kDamagedPages, SUM);
+  GorillaStatsManager::addStatExportType(kDroppedDamagedBlocks, SUM);
+}
 
-std::vector<std::unique_ptr<DataBlock>> DataBlockReader::readBlocks(
+std::vector<std::shared_ptr<DataBlock>> DataBlockReader::readBlocks(
     uint32_t position,
     std::vector<uint32_t>& timeSeriesIds,
     std::vector<uint64_t>& storageIds) {
-  std::vector<std::unique_ptr<DataBlock>> pointers;
-
-  auto f = dataFiles_.open(position, "rb", 0);
-  if (!f.file) {
-    LOG(ERROR) << "Could not open block file for reading : " << position;
-    return pointers;
+  std::vector<std::shared_ptr<DataBlock>> pointers;
+
+  std::future<std::string> prefetched;
+  {
+    std::lock_guard<std::mutex> guard(prefetchedMutex_);
+    auto iter = prefetched_.find(position);
+    if (iter != prefetched_.end()) {
+      prefetched = std::move(iter->second);
+      prefetched_.erase(iter);
+    }
   }
 
-  fseek(f.file, 0, SEEK_END);
-  size_t len = ftell(f.file);
-  if (len == 0) {
-    LOG(WARNING) << "Empty data file " << f.name;
-    fclose(f.file);
-    return pointers;
+  std::string buffer;
+  if (prefetched.valid()) {
+    buffer = prefetched.get();
+  } else {
+    dataFiles_.read(position, buffer);
   }
 
-  fseek(f.file, 0, SEEK_SET);
-  std::unique_ptr<char[]> buffer(new char[len]);
-  int bytesRead = fread(buffer.get(), sizeof(char), len, f.file);
-
-  if (bytesRead != len) {
-    PLOG(ERROR) << "Could not read metadata from " << f.name;
-    fclose(f.file);
+  if (buffer.empty()) {
+    LOG(ERROR) << "Could not read block file : " << position;
     return pointers;
   }
-  fclose(f.file);
 
+  // The chunks of a file are its metadata, its pages and, if blocks
+  // were cut out of them, its columns.
   std::unique_ptr<folly::IOBuf> uncompressed;
+  std::vector<uint32_t> damagedChunks;
   try {
-    auto codec = folly::io::getCodec(folly::io::CodecType::ZLIB);
-    auto ioBuffer = folly::IOBuf::wrapBuffer(buffer.get(), len);
-    uncompressed = codec->uncompress(ioBuffer.get());
-    uncompressed->coalesce();
+    uncompressed = BlockFileCodec::uncompress(
+        folly::ByteRange((const uint8_t*)buffer.data(), buffer.size()),
+        FLAGS_block_file_read_threads,
+        &damagedChunks);
   } catch (std::exception& e) {
     LOG(ERROR) << e.what();
     return pointers;
   }
 
+  if (!damagedChunks.empty() && damagedChunks[0] == 0) {
+    LOG(ERROR) << "The metadata of block file " << position << " is damaged";
+    return pointers;
+  }
+
   if (uncompressed->length() < sizeof(uint32_t) + sizeof(uint32_t)) {
     LOG(ERROR) << "Not enough data";
     return pointers;
@@ -78,11 +102,17 @@ std::vector<std::unique_ptr<DataBlock>> DataBlockReader::readBlocks(
   memcpy(&activePages, ptr, sizeof(uint32_t));
   ptr += sizeof(uint32_t);
 
+  // Pages with blocks cut out of them are followed by the columns of
+  // those blocks.
+  bool columnar = activePages & ColumnarPages::kPageCountFlag;
+  activePages &= ~ColumnarPages::kPageCountFlag;
+
   size_t expectedLength = sizeof(uint32_t) + sizeof(uint32_t) +
       count * sizeof(uint32_t) + count * sizeof(uint64_t) +
-      activePages * BucketStorage::kPageSize;
+      (size_t)activePages * BucketStorage::kPageSize;
 
-  if (uncompressed->length() != expectedLength) {
+  if (columnar ? uncompressed->length() < expectedLength
+               : uncompressed->length() != expectedLength) {
     LOG(ERROR) << "Corrupt data file: expected " << expectedLength
                << " bytes, got " << uncompressed->length() << " bytes.";
     return pointers;
@@ -97,15 +127,92 @@ std::vector<std::unique_ptr<DataBlock>> DataBlockReader::readBlocks(
 
   // Reorganize into individually allocated blocks because
   // BucketStorage doesn't know how to deal with a single pointer.
+  std::vector<char*> pages;
   for (int i = 0; i < activePages; i++) {
-    pointers.emplace_back(new DataBlock);
+    pointers.push_back(DataBlockAllocator::allocate());
     memcpy(pointers.back()->data, ptr, BucketStorage::kPageSize);
     ptr += BucketStorage::kPageSize;
+    pages.push_back(pointers.back()->data);
+  }
+
+  if (columnar &&
+      ((!damagedChunks.empty() && damagedChunks.back() > activePages) ||
+       !ColumnarPages::decode(
+           folly::StringPiece(
+               ptr, uncompressed->length() - expectedLength),
+           pages))) {
+    LOG(ERROR) << "Corrupt columns in data file " << position;
+    pointers.clear();
+    timeSeriesIds.clear();
+    storageIds.clear();
+  }
+
+  if (!damagedChunks.empty() && !pointers.empty()) {
+    dropDamagedBlocks(
+        position, damagedChunks, pages, timeSeriesIds, storageIds);
   }
 
   return pointers;
 }
 
+void DataBlockReader::dropDamagedBlocks(
+    uint32_t position,
+    const std::vector<uint32_t>& damagedChunks,
+    const std::vector<char*>& pages,
+    std::vector<uint32_t>& timeSeriesIds,
+    std::vector<uint64_t>& storageIds) {
+  // Chunk 0 is the metadata.
+  std::vector<bool> damaged(pages.size(), false);
+  for (uint32_t chunk : damagedChunks) {
+    if (chunk > 0 && chunk <= pages.size()) {
+      damaged[chunk - 1] = true;
+    }
+  }
+
+  uint32_t kept = 0;
+  std::vector<uint32_t> pageIndexes;
+  for (uint32_t i = 0; i < storageIds.size(); i++) {
+    pageIndexes.clear();
+    BucketStorage::getPageIndexes(storageIds[i], pages, pageIndexes);
+    bool intact = std::none_of(
+        pageIndexes.begin(), pageIndexes.end(), [&](uint32_t page) {
+          return page < damaged.size() && damaged[page];
+        });
+    if (intact) {
+      timeSeriesIds[kept] = timeSeriesIds[i];
+      storageIds[kept] = storageIds[i];
+      kept++;
+    }
+  }
+
+  LOG(ERROR) << "Dropped " << storageIds.size() - kept << " blocks in "
+             << damagedChunks.size() << " damaged pages of block file "
+             << position;
+  GorillaStatsManager::addStatValue(kDamagedPages, damagedChunks.size());
+  GorillaStatsManager::addStatValue(
+      kDroppedDamagedBlocks, storageIds.size() - kept);
+  timeSeriesIds.resize(kept);
+  storageIds.resize(kept);
+}
+
+void DataBlockReader::prefetch(uint32_t position) {
+  std::lock_guard<std::mutex> guard(prefetchedMutex_);
+  if (prefetched_.find(position) == prefetched_.end()) {
+    prefetched_.emplace(position, dataFiles_.readAsync(position));
+  }
+}
+
+void DataBlockReader::clearPrefetched() {
+  std::map<uint32_t, std::future<std::string>> prefetched;
+  {
+    std::lock_guard<std::mutex> guard(prefetchedMutex_);
+    prefetched.swap(prefetched_);
+  }
+
+  // Destroying the futures waits for the reads to finish, so do it
+  // without holding the lock.
+}
+
 std::set<uint32_t> DataBlockReader::findCompletedBlockFiles() {
   const std::vector<int64_t> files = completedFiles_.ls();
   std::set<uint32_t> completedBlockFiles(files.begin(), files.end());
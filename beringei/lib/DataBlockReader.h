@@ -10,6 +10,10 @@
 #pragma once
 
 #include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <vector>
@@ -26,18 +30,38 @@ class DataBlockReader {
 
   // Returns allocated blocks for every page in the given position.
   // Fills in timeSeriesIds and storageIds with the metadata associated with
-  // the blocks.
-  std::vector<std::unique_ptr<DataBlock>> readBlocks(
+  // the blocks. The blocks in the damaged pages of checksummed files are
+  // left out of the metadata, and their pages are zeroed.
+  std::vector<std::shared_ptr<DataBlock>> readBlocks(
       uint32_t position,
       std::vector<uint32_t>& timeSeriesIds,
       std::vector<uint64_t>& storageIds);
 
+  // Starts reading the block file for the given position in the
+  // background. A later readBlocks() call for the position uses the
+  // data instead of reading the file again.
+  void prefetch(uint32_t position);
+
+  // Drops the data of all prefetched files that haven't been used.
+  void clearPrefetched();
+
   // Returns the file ids for the completed blocks.
   std::set<uint32_t> findCompletedBlockFiles();
 
  private:
+  // Removes the blocks that use any of the damaged pages.
+  static void dropDamagedBlocks(
+      uint32_t position,
+      const std::vector<uint32_t>& damagedChunks,
+      const std::vector<char*>& pages,
+      std::vector<uint32_t>& timeSeriesIds,
+      std::vector<uint64_t>& storageIds);
+
   FileUtils dataFiles_;
   FileUtils completedFiles_;
+
+  std::mutex prefetchedMutex_;
+  std::map<uint32_t, std::future<std::string>> prefetched_;
 };
 }
 } // facebook:gorilla
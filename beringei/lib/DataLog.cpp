@@ -9,14 +9,20 @@
 
 #include "beringei/lib/DataLog.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+
 #include <folly/GroupVarint.h>
 
-#include "beringei/lib/BitUtil.h"
+#include "beringei/lib/BitWriter.h"
 #include "beringei/lib/FileUtils.h"
 #include "beringei/lib/GorillaStatsManager.h"
+#include "beringei/lib/GorillaTimeConstants.h"
 
 namespace {
-const static int kPreviousValuesVectorSizeIncrement = 1000;
+const static int kPreviousValuesPageBits = 10;
+const static int kPreviousValuesPageSize = 1 << kPreviousValuesPageBits;
 }
 
 namespace facebook {
@@ -40,59 +46,124 @@ const static std::string kPartialWriteCounter = "partial_writes.log";
 
 DataLogWriter::DataLogWriter(FileUtils::File&& out, int64_t baseTime)
     : out_(out),
+      shardId_(0),
+      baseTime_(baseTime),
       lastTimestamp_(baseTime),
-      buffer_(new char[FLAGS_data_log_buffer_size]),
-      bufferSize_(0) {
+      buffer_(new char[std::max<int>(
+          FLAGS_data_log_buffer_size, datalog::kMaxPointBytes)]),
+      bufferSize_(0),
+      unsyncedBytes_(0),
+      startOfFile_(false) {
   GorillaStatsManager::addStatExportType(kFailedCounter, SUM);
   GorillaStatsManager::addStatExportType(kPartialWriteCounter, SUM);
 }
 
+DataLogWriter::DataLogWriter(
+    std::shared_ptr<CombinedLogWriter> combinedLog,
+    uint32_t shardId,
+    int64_t baseTime)
+    : out_{nullptr, ""},
+      combinedLog_(std::move(combinedLog)),
+      shardId_(shardId),
+      baseTime_(baseTime),
+      lastTimestamp_(baseTime),
+      buffer_(new char[std::max<int>(
+          FLAGS_data_log_buffer_size, datalog::kMaxPointBytes)]),
+      bufferSize_(0),
+      unsyncedBytes_(0),
+      startOfFile_(true) {
+  GorillaStatsManager::addStatExportType(kFailedCounter, SUM);
+}
+
 DataLogWriter::~DataLogWriter() {
-  if (out_.file) {
+  if (combinedLog_) {
+    flushBuffer();
+  } else if (out_.file) {
     flushBuffer();
     FileUtils::closeFile(out_, FLAGS_gorilla_async_file_close);
   }
 }
 
-void DataLogWriter::append(uint32_t id, int64_t unixTime, double value) {
-  folly::fbstring bits;
-  uint32_t numBits = 0;
-
-  if (id > FLAGS_max_allowed_timeseries_id) {
+size_t DataLogWriter::append(
+    uint32_t id,
+    int64_t unixTime,
+    double value,
+    int16_t ms) {
+  if (id > FLAGS_max_allowed_timeseries_id ||
+      id >= datalog::kMillisecondsId) {
     LOG(ERROR) << "ID:" << id
                << " too large. Increase max_allowed_timeseries_id?";
-    return;
+    return 0;
+  }
+  if (ms < 0 || ms >= kGorillaMsPerSecond) {
+    LOG(ERROR) << "Invalid milliseconds " << ms << " for ID:" << id;
+    return 0;
   }
-  DataLogUtil::appendId(id, bits, numBits);
 
-  // Optimize for zero delta case and increase used bits 8 at a time
-  // to fill bytes.
-  int64_t delta = unixTime - lastTimestamp_;
-  DataLogUtil::appendTimestampDelta(delta, bits, numBits);
+  // Make sure that the largest possible point fits so that it can be
+  // encoded directly into the buffer.
+  if (bufferSize_ + datalog::kMaxPointBytes > FLAGS_data_log_buffer_size) {
+    flushBuffer();
+  }
 
-  if (id >= previousValues_.size()) {
+  size_t page = id >> kPreviousValuesPageBits;
+  if (page >= previousValues_.size()) {
+    previousValues_.resize(page + 1);
+  }
+  if (!previousValues_[page]) {
     // If the value hasn't been seen before, assume that the previous
     // value is zero.
-    previousValues_.resize(id + kPreviousValuesVectorSizeIncrement, 0);
+    previousValues_[page].reset(new uint64_t[kPreviousValuesPageSize]());
   }
 
-  uint64_t* v = (uint64_t*)&value;
-  uint64_t* previousValue = (uint64_t*)&previousValues_[id];
-  uint64_t xorWithPrevious = *v ^ *previousValue;
-  DataLogUtil::appendValueXor(xorWithPrevious, bits, numBits);
-
-  previousValues_[id] = value;
-  lastTimestamp_ = unixTime;
+  uint64_t v;
+  memcpy(&v, &value, sizeof(v));
+  uint64_t& previousValue =
+      previousValues_[page][id & (kPreviousValuesPageSize - 1)];
 
-  if (bits.length() + bufferSize_ > FLAGS_data_log_buffer_size) {
-    flushBuffer();
+  BufferBitWriter writer(buffer_.get() + bufferSize_);
+  if (ms != 0) {
+    DataLogUtil::appendMilliseconds(ms, writer);
   }
+  DataLogUtil::appendId(id, writer);
+
+  // Optimize for zero delta case and increase used bits 8 at a time
+  // to fill bytes.
+  int64_t delta = unixTime - lastTimestamp_;
+  DataLogUtil::appendTimestampDelta(delta, writer);
+  DataLogUtil::appendValueXor(v ^ previousValue, writer);
+  size_t length = writer.flush();
 
-  memcpy(buffer_.get() + bufferSize_, bits.data(), bits.length());
-  bufferSize_ += bits.length();
+  previousValue = v;
+  lastTimestamp_ = unixTime;
+
+  bufferSize_ += length;
+  unsyncedBytes_ += length;
+  return length;
 }
 
 bool DataLogWriter::flushBuffer() {
+  if (combinedLog_) {
+    // Even an empty file gets its first chunk, so that it replaces a
+    // log file with the same id from before.
+    if (bufferSize_ == 0 && !startOfFile_) {
+      return true;
+    }
+
+    bool success = combinedLog_->append(
+        shardId_,
+        baseTime_,
+        startOfFile_ ? CombinedLogWriter::kStartOfFile : 0,
+        buffer_.get(),
+        bufferSize_);
+    if (!success) {
+      GorillaStatsManager::addStatValue(kFailedCounter, 1);
+    }
+    startOfFile_ = false;
+    bufferSize_ = 0;
+    return success;
+  }
+
   char* buffer = buffer_.get();
   bool success = true;
   clearerr(out_.file);
@@ -124,6 +195,20 @@ bool DataLogWriter::flushBuffer() {
   return success;
 }
 
+bool DataLogWriter::sync() {
+  bool success = flushBuffer();
+  if (combinedLog_) {
+    success = combinedLog_->sync() && success;
+  } else if (fflush(out_.file) != 0 || fdatasync(fileno(out_.file)) != 0) {
+    PLOG(ERROR) << "Syncing log file failed: " << out_.name;
+    GorillaStatsManager::addStatValue(kFailedCounter, 1);
+    success = false;
+  }
+
+  unsyncedBytes_ = 0;
+  return success;
+}
+
 int DataLogReader::readLog(
     const FileUtils::File& file,
     int64_t baseTime,
@@ -15,6 +15,7 @@
 #include <memory>
 #include <vector>
 
+#include "beringei/lib/CombinedLog.h"
 #include "beringei/lib/DataLogUtil.h"
 #include "beringei/lib/FileUtils.h"
 
@@ -29,24 +30,59 @@ class DataLogWriter {
   // Initialize a DataLogWriter which will append data to the given file.
   DataLogWriter(FileUtils::File&& out, int64_t baseTime);
 
+  // Initialize a DataLogWriter which will append the log file
+  // `baseTime` of the shard to a combined log as chunks.
+  DataLogWriter(
+      std::shared_ptr<CombinedLogWriter> combinedLog,
+      uint32_t shardId,
+      int64_t baseTime);
+
   virtual ~DataLogWriter();
 
   // Appends a data point to the internal buffer. This operation is
   // not thread safe. Caller is responsible for locking. Data will be
   // written to disk when buffer is full or `flushBuffer` is called or
-  // destructor is called.
-  void append(uint32_t id, int64_t unixTime, double value);
+  // destructor is called. Non-zero `ms` are logged in a separate
+  // record before the point.
+  // Returns the number of bytes appended.
+  size_t append(uint32_t id, int64_t unixTime, double value, int16_t ms = 0);
 
   // Flushes the buffer that has been created with `append` calls to
   // disk. Returns true if writing was successful, false otherwise.
   bool flushBuffer();
 
+  // Flushes the buffer and the stdio buffer of the file and waits
+  // until the data is on disk with fdatasync. Returns true if
+  // everything was successful, false otherwise. Syncs the whole
+  // combined log if this writer appends to one.
+  bool sync();
+
+  // Bytes appended since the last `sync` call.
+  size_t unsyncedBytes() const {
+    return unsyncedBytes_;
+  }
+
+  // Base time the file was opened with, which is also its id.
+  int64_t baseTime() const {
+    return baseTime_;
+  }
+
  private:
   FileUtils::File out_;
+  std::shared_ptr<CombinedLogWriter> combinedLog_;
+  const uint32_t shardId_;
+  const int64_t baseTime_;
   int64_t lastTimestamp_;
   std::unique_ptr<char[]> buffer_;
   size_t bufferSize_;
-  std::vector<double> previousValues_;
+  size_t unsyncedBytes_;
+
+  // True until the first chunk has been appended to the combined log.
+  bool startOfFile_;
+
+  // Previous value bits by id, in pages that are allocated when an id
+  // in them is first seen. Values that haven't been seen are zero.
+  std::vector<std::unique_ptr<uint64_t[]>> previousValues_;
 };
 
 class DataLogReader {
@@ -0,0 +1,270 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <glog/logging.h>
+
+#include <limits>
+
+#include "BitReader.h"
+#include "GorillaTimeConstants.h"
+
+namespace facebook {
+namespace gorilla {
+
+namespace datalog {
+// The algorithm for encoding data tries to take a full use of
+// bytes. In the optimal case everything will fit 3 bytes. This is
+// possible when the value doesn't change and the timestamp is the
+// same as before. If timestamp is different, but value doesn't
+// change, it's possible to use 4 bytes. If the value changes, a
+// variable number of bytes will be used.
+
+// 3 bytes with with three unused bits. One of the is used for the control bit.
+const static int kShortIdBits = 21;
+
+// 4 bytes with with three unused bits. One of the is used for the control bit.
+const static int kLongIdBits = 29;
+const static int kShortIdControlBit = 0;
+const static int kLongIdControlBit = 1;
+
+// 7 + 2 control bits -> 7 bits left in the byte.
+const static int kShortDeltaBits = 7;
+const static int kShortDeltaMin = -(1 << (kShortDeltaBits - 1)) + 1;
+const static int kShortDeltaMax = (1 << (kShortDeltaBits - 1));
+
+// 14 + 3 control bits -> 7 bits left in the byte.
+const static int kMediumDeltaBits = 14;
+const static int kMediumDeltaMin = -(1 << (kMediumDeltaBits - 1)) + 1;
+const static int kMediumDeltaMax = (1 << (kMediumDeltaBits - 1));
+
+const static int kLargeDeltaBits = 32;
+const static int32_t kLargeDeltaMin = std::numeric_limits<int32_t>::min();
+
+// Control bits for the timestamp type
+const static int kZeroDeltaControlValue = 0; // 0
+const static int kShortDeltaControlValue = 2; // 10
+const static int kMediumDeltaControlValue = 6; // 110
+const static int kLargeDeltaControlValue = 7; // 111
+
+const static int kPreviousValuesVectorSizeIncrement = 1000;
+
+const static int kBlockSizeBits = 6;
+const static int kLeadingZerosBits = 5;
+const static int kMinBytesNeeded = 3;
+
+const static int kSameValueControlBit = 0;
+const static int kDifferentValueControlBit = 1;
+
+// The largest long id is not a time series but marks a record with the
+// milliseconds of the point that follows it. The marker and the
+// milliseconds fill exactly 5 bytes. Points without milliseconds don't
+// have the record.
+const static uint32_t kMillisecondsId = (1 << kLongIdBits) - 1;
+const static int kMillisecondsBits = 10;
+
+// The largest possible encoded point: the milliseconds record, a long
+// id, a large delta and a value with a 64-bit block, rounded up to
+// whole bytes.
+const static int kMaxPointBits = 1 + kLongIdBits + kMillisecondsBits + 1 +
+    kLongIdBits + 3 + kLargeDeltaBits + 1 + kLeadingZerosBits +
+    kBlockSizeBits + 64;
+const static int kMaxPointBytes = (kMaxPointBits + 7) / 8;
+} // namespace datalog
+
+template <typename Writer>
+void DataLogUtil::appendId(uint32_t id, Writer& writer) {
+  using namespace datalog;
+
+  if (id >= (1 << kShortIdBits)) {
+    writer.write(kLongIdControlBit, 1);
+    writer.write(id, kLongIdBits);
+  } else {
+    writer.write(kShortIdControlBit, 1);
+    writer.write(id, kShortIdBits);
+  }
+}
+
+template <typename Writer>
+void DataLogUtil::appendMilliseconds(int16_t ms, Writer& writer) {
+  using namespace datalog;
+
+  writer.write(kLongIdControlBit, 1);
+  writer.write(kMillisecondsId, kLongIdBits);
+  writer.write(ms, kMillisecondsBits);
+}
+
+template <typename Writer>
+void DataLogUtil::appendTimestampDelta(int64_t delta, Writer& writer) {
+  using namespace datalog;
+
+  if (delta == 0) {
+    writer.write(kZeroDeltaControlValue, 1);
+  } else if (delta >= kShortDeltaMin && delta <= kShortDeltaMax) {
+    delta -= kShortDeltaMin;
+    CHECK_LT(delta, 1 << kShortDeltaBits);
+
+    writer.write(kShortDeltaControlValue, 2);
+    writer.write(delta, kShortDeltaBits);
+  } else if (delta >= kMediumDeltaMin && delta <= kMediumDeltaMax) {
+    delta -= kMediumDeltaMin;
+    CHECK_LT(delta, 1 << kMediumDeltaBits);
+
+    writer.write(kMediumDeltaControlValue, 3);
+    writer.write(delta, kMediumDeltaBits);
+  } else {
+    delta -= kLargeDeltaMin;
+    writer.write(kLargeDeltaControlValue, 3);
+    writer.write(delta, kLargeDeltaBits);
+  }
+}
+
+template <typename Writer>
+void DataLogUtil::appendValueXor(uint64_t xorWithPrevious, Writer& writer) {
+  using namespace datalog;
+
+  if (xorWithPrevious == 0) {
+    // Same as previous value, just store a single bit.
+    writer.write(kSameValueControlBit, 1);
+  } else {
+    writer.write(kDifferentValueControlBit, 1);
+
+    // Check TimeSeriesStream.cpp for more information about this
+    // algorithm.
+    int leadingZeros = __builtin_clzll(xorWithPrevious);
+    int trailingZeros = __builtin_ctzll(xorWithPrevious);
+    if (leadingZeros > 31) {
+      leadingZeros = 31;
+    }
+    int blockSize = 64 - leadingZeros - trailingZeros;
+    uint64_t blockValue = xorWithPrevious >> trailingZeros;
+
+    writer.write(leadingZeros, kLeadingZerosBits);
+    writer.write(blockSize - 1, kBlockSizeBits);
+    writer.write(blockValue, blockSize);
+  }
+}
+
+template <typename Out>
+int DataLogUtil::readLogInline(
+    const char* buffer,
+    size_t len,
+    int64_t baseTime,
+    size_t maxAllowedTimeSeriesId,
+    std::vector<double>& previousValues,
+    Out&& out) {
+  using namespace datalog;
+
+  // Read out all the available points.
+  int points = 0;
+  int64_t prevTime = baseTime;
+  int16_t ms = 0;
+  BitReader reader(folly::StringPiece(buffer, len));
+  // Need at least three bytes for a complete value.
+  while (reader.bitPos() <= len * 8 - kMinBytesNeeded * 8) {
+    try {
+      // Read the id of the time series.
+      int idControlBit = reader.read(1);
+      uint32_t id;
+      if (idControlBit == kShortIdControlBit) {
+        id = reader.read(kShortIdBits);
+      } else {
+        id = reader.read(kLongIdBits);
+      }
+
+      if (idControlBit == kLongIdControlBit && id == kMillisecondsId) {
+        // The record is byte aligned and the point follows it.
+        ms = reader.read(kMillisecondsBits);
+        if (ms >= kGorillaMsPerSecond) {
+          LOG(ERROR) << "Corrupt file. Milliseconds are too large " << ms;
+          break;
+        }
+        continue;
+      }
+
+      if (id > maxAllowedTimeSeriesId) {
+        LOG(ERROR) << "Corrupt file. ID is too large " << id;
+        break;
+      }
+
+      // Read the time stamp delta based on the the number of bits in
+      // the delta.
+      uint32_t timeDeltaControlValue = reader.readValueThroughFirstZero(3);
+      int64_t timeDelta = 0;
+      switch (timeDeltaControlValue) {
+        case kZeroDeltaControlValue:
+          break;
+        case kShortDeltaControlValue:
+          timeDelta = reader.read(kShortDeltaBits) + kShortDeltaMin;
+          break;
+        case kMediumDeltaControlValue:
+          timeDelta = reader.read(kMediumDeltaBits) + kMediumDeltaMin;
+          break;
+        case kLargeDeltaControlValue:
+          timeDelta = reader.read(kLargeDeltaBits) + kLargeDeltaMin;
+          break;
+        default:
+          LOG(ERROR) << "Invalid time delta control value "
+                     << timeDeltaControlValue;
+          return points;
+      }
+
+      int64_t unixTime = prevTime + timeDelta;
+      prevTime = unixTime;
+
+      if (id >= previousValues.size()) {
+        previousValues.resize(id + kPreviousValuesVectorSizeIncrement, 0);
+      }
+
+      // Finally read the value.
+      double value;
+      uint32_t sameValueControlBit = reader.read(1);
+      if (sameValueControlBit == kSameValueControlBit) {
+        value = previousValues[id];
+      } else {
+        uint32_t leadingZeros = reader.read(kLeadingZerosBits);
+        uint32_t blockSize = reader.read(kBlockSizeBits) + 1;
+        uint64_t blockValue = reader.read(blockSize);
+
+        // Shift to left by the number of trailing zeros
+        blockValue <<= (64 - blockSize - leadingZeros);
+
+        uint64_t* previousValue = (uint64_t*)&previousValues[id];
+        uint64_t xorredValue = blockValue ^ *previousValue;
+        double* temp = (double*)&xorredValue;
+        value = *temp;
+      }
+
+      previousValues[id] = value;
+
+      // Each tuple (id, unixTime, value) in the file is byte aligned.
+      uint64_t bitPos = reader.bitPos();
+      if (bitPos % 8 != 0) {
+        reader.read(8 - (bitPos % 8));
+      }
+
+      if (!out(id, unixTime, value, ms)) {
+        // Callback doesn't accept more points.
+        break;
+      }
+      points++;
+      ms = 0;
+
+    } catch (std::exception& e) {
+      // Most likely too many bits were being read.
+      LOG(ERROR) << e.what();
+      break;
+    }
+  }
+
+  return points;
+}
+}
+} // facebook::gorilla
@@ -10,27 +10,38 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <vector>
 
 #include <folly/FBString.h>
 
+#include "BitWriter.h"
+
 namespace facebook {
 namespace gorilla {
 
 class DataLogUtil {
  public:
+  // The append functions work with any writer that has the
+  // `write(value, bits)` function of `BitWriter`, such as
+  // `BufferBitWriter`. Defined in DataLogUtil-inl.h.
+
   // Append timeseries id to data log buffer
-  static void appendId(uint32_t id, folly::fbstring& bits, uint32_t& numBits);
+  template <typename Writer>
+  static void appendId(uint32_t id, Writer& writer);
+
+  // Append the milliseconds record of the next point to data log
+  // buffer
+  template <typename Writer>
+  static void appendMilliseconds(int16_t ms, Writer& writer);
 
   // Append timestamp delta to data log buffer
-  static void
-  appendTimestampDelta(int64_t delta, folly::fbstring& bits, uint32_t& numBits);
+  template <typename Writer>
+  static void appendTimestampDelta(int64_t delta, Writer& writer);
 
   // Append xor'd delta to data log buffer
-  static void appendValueXor(
-      uint64_t xorWithPrevious,
-      folly::fbstring& bits,
-      uint32_t& numBits);
+  template <typename Writer>
+  static void appendValueXor(uint64_t xorWithPrevious, Writer& writer);
 
   static int readLog(
       const char* buffer,
@@ -46,7 +57,23 @@ class DataLogUtil {
       size_t maxAllowedTimeSeriesId,
       std::vector<double>& previousValues,
       std::function<bool(uint32_t, int64_t, double)> out);
+
+  // Same as readLog but calls `out` directly instead of through a
+  // std::function, so that it can be inlined into the decoding
+  // loop. `out` also gets the milliseconds of the point, which are
+  // zero unless the point was logged with them. Defined in
+  // DataLogUtil-inl.h.
+  template <typename Out>
+  static int readLogInline(
+      const char* buffer,
+      size_t len,
+      int64_t baseTime,
+      size_t maxAllowedTimeSeriesId,
+      std::vector<double>& previousValues,
+      Out&& out);
 };
 
 } // namespace gorilla
 } // namespace facebook
+
+#include "DataLogUtil-inl.h"
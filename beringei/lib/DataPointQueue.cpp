@@ -0,0 +1,215 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/lib/DataPointQueue.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace facebook {
+namespace gorilla {
+
+// Time series id, timestamp, value, category, key length and
+// milliseconds.
+static const size_t kRecordHeaderSize = 4 + 4 + 8 + 2 + 4 + 2;
+
+static const size_t kSpillBufferSize = 64 * 1024;
+static const size_t kSpillReadSize = 1024 * 1024;
+
+DataPointQueue::DataPointQueue(
+    size_t capacity,
+    const std::string& spillFile,
+    size_t maxSpillBytes)
+    : queue_(capacity),
+      spillFile_(spillFile),
+      maxSpillBytes_(maxSpillBytes),
+      spilling_(false),
+      spilledPoints_(0),
+      fd_(-1),
+      readOffset_(0),
+      writeOffset_(0),
+      nextSpilled_(0) {}
+
+DataPointQueue::~DataPointQueue() {
+  if (fd_ >= 0) {
+    close(fd_);
+    unlink(spillFile_.c_str());
+  }
+}
+
+bool DataPointQueue::write(Point&& point) {
+  if (!spilling_ && queue_.write(std::move(point))) {
+    return true;
+  }
+
+  if (maxSpillBytes_ == 0) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(spillMutex_);
+  if (!spilling_) {
+    // The spill file might have been read empty just now.
+    if (queue_.write(std::move(point))) {
+      return true;
+    }
+    spilling_ = true;
+  }
+
+  size_t recordSize = kRecordHeaderSize + point.key.size();
+  if (writeOffset_ - readOffset_ + spillBuffer_.size() + recordSize >
+      maxSpillBytes_) {
+    return false;
+  }
+
+  char header[kRecordHeaderSize];
+  uint32_t keyLength = point.key.size();
+  memcpy(header, &point.timeSeriesId, 4);
+  memcpy(header + 4, &point.unixTime, 4);
+  memcpy(header + 8, &point.value, 8);
+  memcpy(header + 16, &point.category, 2);
+  memcpy(header + 18, &keyLength, 4);
+  memcpy(header + 22, &point.ms, 2);
+  spillBuffer_.append(header, kRecordHeaderSize);
+  spillBuffer_.append(point.key);
+  spilledPoints_++;
+
+  if (spillBuffer_.size() >= kSpillBufferSize) {
+    return flushSpillBuffer();
+  }
+  return true;
+}
+
+bool DataPointQueue::flushSpillBuffer() {
+  if (spillBuffer_.empty()) {
+    return true;
+  }
+
+  if (fd_ < 0) {
+    fd_ = open(spillFile_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      PLOG(ERROR) << "Failed to open " << spillFile_;
+      spillBuffer_.clear();
+      return false;
+    }
+  }
+
+  size_t written = 0;
+  while (written < spillBuffer_.size()) {
+    ssize_t n = pwrite(
+        fd_,
+        spillBuffer_.data() + written,
+        spillBuffer_.size() - written,
+        writeOffset_ + written);
+    if (n <= 0) {
+      PLOG(ERROR) << "Failed to write to " << spillFile_;
+      spillBuffer_.clear();
+      return false;
+    }
+    written += n;
+  }
+
+  writeOffset_ += written;
+  spillBuffer_.clear();
+  return true;
+}
+
+bool DataPointQueue::readSpillFile() {
+  std::lock_guard<std::mutex> guard(spillMutex_);
+  if (!spilling_) {
+    return false;
+  }
+
+  flushSpillBuffer();
+  if (readOffset_ >= writeOffset_) {
+    // Everything has been read. New points can go to memory again.
+    readOffset_ = 0;
+    writeOffset_ = 0;
+    if (fd_ >= 0 && ftruncate(fd_, 0) != 0) {
+      PLOG(ERROR) << "Failed to truncate " << spillFile_;
+    }
+    spilling_ = false;
+    return false;
+  }
+
+  std::string chunk;
+  size_t pos = 0;
+  while (readOffset_ < writeOffset_) {
+    if (chunk.empty()) {
+      chunk.resize(std::min(kSpillReadSize, writeOffset_ - readOffset_));
+      if (pread(fd_, &chunk[0], chunk.size(), readOffset_) !=
+          (ssize_t)chunk.size()) {
+        PLOG(ERROR) << "Failed to read " << spillFile_;
+        readOffset_ = writeOffset_;
+        return false;
+      }
+    }
+
+    if (pos + kRecordHeaderSize > chunk.size()) {
+      break;
+    }
+
+    uint32_t keyLength;
+    memcpy(&keyLength, &chunk[pos + 18], 4);
+    if (pos + kRecordHeaderSize + keyLength > chunk.size()) {
+      if (pos == 0) {
+        // A single record larger than a normal read.
+        chunk.clear();
+        chunk.resize(kRecordHeaderSize + keyLength);
+        if (pread(fd_, &chunk[0], chunk.size(), readOffset_) !=
+            (ssize_t)chunk.size()) {
+          PLOG(ERROR) << "Failed to read " << spillFile_;
+          readOffset_ = writeOffset_;
+          return false;
+        }
+        continue;
+      }
+      break;
+    }
+
+    Point point;
+    memcpy(&point.timeSeriesId, &chunk[pos], 4);
+    memcpy(&point.unixTime, &chunk[pos + 4], 4);
+    memcpy(&point.value, &chunk[pos + 8], 8);
+    memcpy(&point.category, &chunk[pos + 16], 2);
+    memcpy(&point.ms, &chunk[pos + 22], 2);
+    point.key.assign(&chunk[pos + kRecordHeaderSize], keyLength);
+    spilled_.push_back(std::move(point));
+    pos += kRecordHeaderSize + keyLength;
+  }
+
+  readOffset_ += pos;
+  return !spilled_.empty();
+}
+
+bool DataPointQueue::read(Point& point) {
+  while (true) {
+    if (nextSpilled_ < spilled_.size()) {
+      point = std::move(spilled_[nextSpilled_++]);
+      return true;
+    }
+
+    // The points in memory are always older than the spilled ones.
+    if (queue_.read(point)) {
+      return true;
+    }
+
+    spilled_.clear();
+    nextSpilled_ = 0;
+    if (!readSpillFile()) {
+      return queue_.read(point);
+    }
+  }
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <folly/MPMCQueue.h>
+
+namespace facebook {
+namespace gorilla {
+
+// class DataPointQueue
+//
+// Holds the data points that come in while a shard is being loaded. The
+// points are kept in a bounded in-memory queue, and once that is full
+// they are appended to a spill file instead of being dropped. The spill
+// file is read back in large chunks when the points are processed.
+//
+// Points are read in the order they were written: after the first
+// point is spilled, all the points go to the spill file until it has
+// been read empty again. Any number of threads can write, but only one
+// thread can read.
+class DataPointQueue {
+ public:
+  struct Point {
+    uint32_t timeSeriesId;
+
+    // 32 bits for the timestamp to save memory. 64-bits not needed
+    // because the timestamp is turned into seconds before coming to
+    // BucketMap.
+    uint32_t unixTime;
+
+    // Milliseconds within `unixTime`.
+    int16_t ms;
+
+    // Empty string will indicate that timeSeriesId is used.
+    std::string key;
+    double value;
+    uint16_t category;
+  };
+
+  // At most `maxSpillBytes` are kept in the spill file at `spillFile`,
+  // which is created when it's first needed. 0 disables spilling.
+  DataPointQueue(
+      size_t capacity,
+      const std::string& spillFile,
+      size_t maxSpillBytes);
+
+  // Removes the spill file.
+  ~DataPointQueue();
+
+  // Returns false if the point was dropped because the in-memory queue
+  // and the spill file are full.
+  bool write(Point&& point);
+
+  // Reads the oldest point. Returns false if there are no more points.
+  bool read(Point& point);
+
+  // Total number of points spilled to disk.
+  size_t spilledPoints() const {
+    return spilledPoints_;
+  }
+
+ private:
+  // Appends the buffered points to the spill file. Must be called with
+  // `spillMutex_` held.
+  bool flushSpillBuffer();
+
+  // Reads the next chunk of points from the spill file into `spilled_`.
+  // Returns false if the spill file was empty.
+  bool readSpillFile();
+
+  folly::MPMCQueue<Point> queue_;
+  const std::string spillFile_;
+  const size_t maxSpillBytes_;
+  std::atomic<bool> spilling_;
+  std::atomic<size_t> spilledPoints_;
+
+  std::mutex spillMutex_;
+  int fd_;
+  std::string spillBuffer_;
+  size_t readOffset_;
+  size_t writeOffset_;
+
+  // Points read from the spill file that haven't been returned yet.
+  // Only used by the reader.
+  std::vector<Point> spilled_;
+  size_t nextSpilled_;
+};
+}
+} // facebook::gorilla
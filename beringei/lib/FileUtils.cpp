@@ -40,6 +40,8 @@ static const std::string kMsPerFileClose = "ms_per_file_close";
 static const std::string kFileOpenFailures = "file_open_failures";
 static const std::string kMsPerFileRemove = "ms_per_file_remove";
 static const std::string kMsPerDirList = "ms_per_dir_list";
+static const std::string kMsPerFileRead = "ms_per_file_read";
+static const std::string kAsyncFileReads = "async_file_reads";
 
 FileUtils::FileUtils(
     int64_t shardId,
@@ -72,6 +74,53 @@ FileUtils::open(int64_t id, const char* mode, size_t bufferSize) {
   return File{file, path.c_str()};
 }
 
+bool FileUtils::read(int64_t id, std::string& data) {
+  return readFile(filePath(id).string(), data);
+}
+
+std::future<std::string> FileUtils::readAsync(int64_t id) {
+  GorillaStatsManager::addStatValue(kAsyncFileReads);
+  std::string path = filePath(id).string();
+  return std::async(std::launch::async, [path]() {
+    std::string data;
+    if (!readFile(path, data)) {
+      data.clear();
+    }
+    return data;
+  });
+}
+
+bool FileUtils::readFile(const std::string& path, std::string& data) {
+  Timer timer(true);
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    PLOG(ERROR) << "Failed to open file: " << path;
+    GorillaStatsManager::addStatValue(kFileOpenFailures);
+    return false;
+  }
+
+  fseek(file, 0, SEEK_END);
+  size_t len = ftell(file);
+  if (len == 0) {
+    LOG(WARNING) << "Empty file " << path;
+    fclose(file);
+    return false;
+  }
+
+  fseek(file, 0, SEEK_SET);
+  data.resize(len);
+  size_t bytesRead = fread(&data[0], sizeof(char), len, file);
+  fclose(file);
+  if (bytesRead != len) {
+    PLOG(ERROR) << "Could not read " << path;
+    return false;
+  }
+
+  GorillaStatsManager::addStatValue(
+      kMsPerFileRead, timer.get() / kGorillaUsecPerMs);
+  return true;
+}
+
 void FileUtils::clearTo(int64_t id) {
   for (int64_t fileId : ls()) {
     if (fileId >= id) {
@@ -239,6 +288,8 @@ void FileUtils::startMonitoring() {
   GorillaStatsManager::addStatExportType(kMsPerFileRemove, AVG);
   GorillaStatsManager::addStatExportType(kFileOpenFailures, SUM);
   GorillaStatsManager::addStatExportType(kMsPerDirList, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerFileRead, AVG);
+  GorillaStatsManager::addStatExportType(kAsyncFileReads, SUM);
 }
 
 void FileUtils::closeFile(File& file, bool asyncClose) {
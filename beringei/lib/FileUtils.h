@@ -10,6 +10,7 @@
 #pragma once
 
 #include <folly/String.h>
+#include <future>
 #include <string>
 #include <vector>
 
@@ -44,6 +45,15 @@ class FileUtils {
   // Returns nullptr on failure.
   File open(int64_t id, const char* mode, size_t bufferSize);
 
+  // Reads the whole file with the given id into `data`. Returns false
+  // if the file could not be read or is empty.
+  bool read(int64_t id, std::string& data);
+
+  // Same as `read` but reads the file in a separate thread, so that
+  // the caller can do other work while waiting for the disk. The
+  // result is empty if the file could not be read.
+  std::future<std::string> readAsync(int64_t id);
+
   // Remove all files with id less than this.
   void clearTo(int64_t id);
 
@@ -85,6 +95,8 @@ class FileUtils {
   static void closeFile(File& file, bool asyncClose);
 
  private:
+  static bool readFile(const std::string& path, std::string& data);
+
   boost::filesystem::path filePath(int64_t id);
   boost::filesystem::path filePath(int64_t id, const std::string& prefix);
 
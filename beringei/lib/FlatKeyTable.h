@@ -0,0 +1,168 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace facebook {
+namespace gorilla {
+
+// class FlatKeyTable
+//
+// Open-addressing hash table from keys to row ids. Each slot is only
+// a 32-bit hash and the row id, so the keys themselves are not stored
+// here. Lookups call `getKey(id)` to compare against the key of a row
+// when the hashes match. This takes about 11 bytes per key instead of
+// a heap allocated node per key in `std::unordered_map`.
+//
+// Not thread-safe.
+class FlatKeyTable {
+ public:
+  FlatKeyTable() : size_(0), used_(0) {}
+
+  // Returns the row id of the key or -1 if it's not in the table.
+  template <typename GetKey, typename Eq>
+  int find(const char* key, uint32_t hash, GetKey&& getKey, Eq&& eq) const {
+    if (slots_.empty()) {
+      return -1;
+    }
+
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const Slot& slot = slots_[i];
+      if (slot.id == kEmpty) {
+        return -1;
+      }
+      if (slot.id >= 0 && slot.hash == hash && eq(getKey(slot.id), key)) {
+        return slot.id;
+      }
+    }
+  }
+
+  // Prefetches the first slot that find() would look at.
+  void prefetch(uint32_t hash) const {
+    if (!slots_.empty()) {
+      __builtin_prefetch(&slots_[hash & (slots_.size() - 1)]);
+    }
+  }
+
+  // Adds a row id. The caller must make sure that the key is not in
+  // the table already, e.g. with find().
+  void insert(uint32_t hash, int id) {
+    if ((used_ + 1) * kMaxLoadDenominator >
+        slots_.size() * kMaxLoadNumerator) {
+      // Rehashing to the same size is enough to get rid of the
+      // tombstones if there are many of them.
+      rehash(
+          (size_ + 1) * 2 * kMaxLoadDenominator >
+                  slots_.size() * kMaxLoadNumerator
+              ? slots_.size() * 2
+              : slots_.size());
+    }
+
+    size_t mask = slots_.size() - 1;
+    size_t i = hash & mask;
+    while (slots_[i].id >= 0) {
+      i = (i + 1) & mask;
+    }
+    if (slots_[i].id == kEmpty) {
+      used_++;
+    }
+    slots_[i].hash = hash;
+    slots_[i].id = id;
+    size_++;
+  }
+
+  // Removes the row id that was inserted with the given hash. Returns
+  // false if it's not in the table.
+  bool erase(uint32_t hash, int id) {
+    if (slots_.empty()) {
+      return false;
+    }
+
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask; slots_[i].id != kEmpty; i = (i + 1) & mask) {
+      if (slots_[i].id == id && slots_[i].hash == hash) {
+        slots_[i].id = kDeleted;
+        size_--;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Makes room for `n` keys without rehashing.
+  void reserve(size_t n) {
+    size_t capacity = kMinCapacity;
+    while (n * kMaxLoadDenominator > capacity * kMaxLoadNumerator) {
+      capacity *= 2;
+    }
+    if (capacity > slots_.size()) {
+      rehash(capacity);
+    }
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  void swap(FlatKeyTable& other) {
+    slots_.swap(other.slots_);
+    std::swap(size_, other.size_);
+    std::swap(used_, other.used_);
+  }
+
+ private:
+  static const int32_t kEmpty = -1;
+  static const int32_t kDeleted = -2;
+  static const size_t kMinCapacity = 16;
+
+  // The table is at most 7/10 full, including the deleted slots.
+  static const size_t kMaxLoadNumerator = 7;
+  static const size_t kMaxLoadDenominator = 10;
+
+  struct Slot {
+    uint32_t hash;
+    int32_t id;
+  };
+
+  void rehash(size_t capacity) {
+    if (capacity < kMinCapacity) {
+      capacity = kMinCapacity;
+    }
+
+    std::vector<Slot> slots(capacity, Slot{0, kEmpty});
+    size_t mask = capacity - 1;
+    for (const auto& slot : slots_) {
+      if (slot.id >= 0) {
+        size_t i = slot.hash & mask;
+        while (slots[i].id != kEmpty) {
+          i = (i + 1) & mask;
+        }
+        slots[i] = slot;
+      }
+    }
+    slots_.swap(slots);
+    used_ = size_;
+  }
+
+  std::vector<Slot> slots_;
+
+  // Number of keys in the table.
+  size_t size_;
+
+  // Number of slots that are not empty, including deleted ones.
+  size_t used_;
+};
+}
+} // facebook::gorilla
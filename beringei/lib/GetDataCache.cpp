@@ -0,0 +1,222 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "GetDataCache.h"
+
+#include <chrono>
+
+#include "GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kHits = "get_data_cache_hits";
+static const std::string kMisses = "get_data_cache_misses";
+static const std::string kCoalesced = "get_data_cache_coalesced";
+static const std::string kEvictions = "get_data_cache_evictions";
+static const std::string kBytes = "get_data_cache_bytes";
+
+// Approximate overhead of an entry in the list and the map, and of each
+// key in a result.
+static const size_t kEntryOverhead = 128;
+static const size_t kResultOverhead = 64;
+
+static size_t dataSize(const TimeSeriesData& data) {
+  size_t size = kResultOverhead;
+  for (const auto& block : data.data) {
+    size += kResultOverhead + block.data.size() + block.checkpoints.size();
+  }
+  return size;
+}
+
+static int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+GetDataCache::GetDataCache(size_t maxBytes)
+    : maxBytes_(maxBytes), bytes_(0), generation_(0) {
+  GorillaStatsManager::addStatExportType(kHits, SUM);
+  GorillaStatsManager::addStatExportType(kMisses, SUM);
+  GorillaStatsManager::addStatExportType(kCoalesced, SUM);
+  GorillaStatsManager::addStatExportType(kEvictions, SUM);
+}
+
+std::string GetDataCache::fingerprint(const GetDataRequest& req) {
+  // Keys are length prefixed so that no two requests get the same
+  // fingerprint.
+  std::string fingerprint;
+  for (const auto& key : req.keys) {
+    fingerprint += std::to_string(key.shardId);
+    fingerprint += ':';
+    fingerprint += std::to_string(key.key.size());
+    fingerprint += ':';
+    fingerprint += key.key;
+  }
+
+  fingerprint += '|';
+  fingerprint += std::to_string(req.begin);
+  fingerprint += ':';
+  fingerprint += std::to_string(req.end);
+  fingerprint += ':';
+  fingerprint += std::to_string(req.aggregation.step);
+  fingerprint += ':';
+  fingerprint += std::to_string((int)req.aggregation.function);
+  fingerprint += ':';
+  fingerprint += std::to_string((int)req.aggregation.crossKeyFunction);
+  for (const auto& range : req.ranges) {
+    fingerprint += ':';
+    fingerprint += std::to_string(range.begin);
+    fingerprint += '-';
+    fingerprint += std::to_string(range.end);
+  }
+  return fingerprint;
+}
+
+void GetDataCache::get(
+    const std::string& fingerprint,
+    int64_t ttlMs,
+    GetDataResult& result,
+    const ComputeFunction& compute) {
+  std::promise<ResultPtr> promise;
+  std::shared_future<ResultPtr> running;
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = entries_.find(fingerprint);
+    if (it != entries_.end()) {
+      if (it->second->expiresMs > nowMs()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        result = *it->second->result;
+        GorillaStatsManager::addStatValue(kHits);
+        return;
+      }
+
+      bytes_ -= getMemoryUsage(*it->second);
+      lru_.erase(it->second);
+      entries_.erase(it);
+    }
+
+    auto pending = pending_.find(fingerprint);
+    if (pending != pending_.end()) {
+      running = pending->second;
+    } else {
+      pending_[fingerprint] = promise.get_future().share();
+      generation = generation_;
+    }
+  }
+
+  if (running.valid()) {
+    GorillaStatsManager::addStatValue(kCoalesced);
+    result = *running.get();
+    return;
+  }
+
+  GorillaStatsManager::addStatValue(kMisses);
+  try {
+    compute(result);
+  } catch (...) {
+    promise.set_exception(std::current_exception());
+    std::lock_guard<std::mutex> guard(mutex_);
+    pending_.erase(fingerprint);
+    throw;
+  }
+
+  auto shared = std::make_shared<const GetDataResult>(result);
+  promise.set_value(shared);
+  finish(fingerprint, ttlMs, generation, std::move(shared));
+}
+
+void GetDataCache::finish(
+    const std::string& fingerprint,
+    int64_t ttlMs,
+    uint64_t generation,
+    ResultPtr result) {
+  Entry entry;
+  entry.fingerprint = fingerprint;
+  entry.expiresMs = nowMs() + ttlMs;
+  entry.result = std::move(result);
+  size_t size = getMemoryUsage(entry);
+  bool keep = ttlMs > 0 && size <= maxBytes_ && cacheable(*entry.result);
+
+  int evictions = 0;
+  size_t bytes;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    pending_.erase(fingerprint);
+    if (!keep || generation != generation_) {
+      return;
+    }
+
+    auto it = entries_.find(fingerprint);
+    if (it != entries_.end()) {
+      bytes_ -= getMemoryUsage(*it->second);
+      lru_.erase(it->second);
+      entries_.erase(it);
+    }
+
+    while (bytes_ + size > maxBytes_ && !lru_.empty()) {
+      const Entry& last = lru_.back();
+      entries_.erase(last.fingerprint);
+      bytes_ -= getMemoryUsage(last);
+      lru_.pop_back();
+      evictions++;
+    }
+
+    lru_.push_front(std::move(entry));
+    entries_[lru_.front().fingerprint] = lru_.begin();
+    bytes_ += size;
+    bytes = bytes_;
+  }
+
+  if (evictions > 0) {
+    GorillaStatsManager::addStatValue(kEvictions, evictions);
+  }
+  GorillaStatsManager::setCounter(kBytes, bytes);
+}
+
+void GetDataCache::clear() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    lru_.clear();
+    entries_.clear();
+    bytes_ = 0;
+    generation_++;
+  }
+  GorillaStatsManager::setCounter(kBytes, 0);
+}
+
+size_t GetDataCache::getMemoryUsage() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return bytes_;
+}
+
+bool GetDataCache::cacheable(const GetDataResult& result) {
+  // Shards that are still loading or that moved would give a different
+  // result soon.
+  for (const auto& data : result.results) {
+    if (data.status != StatusCode::OK &&
+        data.status != StatusCode::KEY_MISSING) {
+      return false;
+    }
+  }
+  return result.reduced.status == StatusCode::OK;
+}
+
+size_t GetDataCache::getMemoryUsage(const Entry& entry) {
+  size_t size = kEntryOverhead + entry.fingerprint.size() +
+      dataSize(entry.result->reduced);
+  for (const auto& data : entry.result->results) {
+    size += dataSize(data);
+  }
+  return size;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class GetDataCache
+//
+// Keeps the results of recent getData requests, so that the same
+// request sent by many dashboards doesn't fetch and encode the same
+// blocks every time. Requests are matched exactly on their keys, time
+// range and aggregation. Identical requests that arrive while one of
+// them is running wait for its result instead of running as well.
+//
+// Results are only kept for `ttlMs` and only if every key is either OK
+// or missing. The owner clears the cache when buckets are finalized.
+// The least recently used entries are evicted once the results take
+// more than `maxBytes`.
+class GetDataCache {
+ public:
+  explicit GetDataCache(size_t maxBytes);
+
+  // The cache key of a request.
+  static std::string fingerprint(const GetDataRequest& req);
+
+  typedef std::function<void(GetDataResult& result)> ComputeFunction;
+
+  // Copies the cached result of the request with this fingerprint to
+  // `result`, or waits for the identical request that is already
+  // running, or calls `compute`. The result is kept for `ttlMs`, and 0
+  // only shares it with the requests that are waiting for it. Throws
+  // what `compute` threw.
+  void get(
+      const std::string& fingerprint,
+      int64_t ttlMs,
+      GetDataResult& result,
+      const ComputeFunction& compute);
+
+  // Removes all the cached results. Requests that are running are
+  // still shared with the ones waiting for them, but not kept.
+  void clear();
+
+  size_t getMemoryUsage();
+
+ private:
+  typedef std::shared_ptr<const GetDataResult> ResultPtr;
+
+  struct Entry {
+    std::string fingerprint;
+    int64_t expiresMs;
+    ResultPtr result;
+  };
+
+  // Keeps the result of a request that ran unless the cache was cleared
+  // since it started, and lets new requests run again.
+  void finish(
+      const std::string& fingerprint,
+      int64_t ttlMs,
+      uint64_t generation,
+      ResultPtr result);
+
+  static bool cacheable(const GetDataResult& result);
+  static size_t getMemoryUsage(const Entry& entry);
+
+  const size_t maxBytes_;
+
+  std::mutex mutex_;
+
+  // The most recently used entry first.
+  std::list<Entry> lru_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+  size_t bytes_;
+
+  // Requests that are running, and the number of times the cache was
+  // cleared so that results computed before `clear` aren't kept.
+  std::unordered_map<std::string, std::shared_future<ResultPtr>> pending_;
+  uint64_t generation_;
+};
+}
+} // facebook::gorilla
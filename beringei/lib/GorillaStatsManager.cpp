@@ -9,12 +9,45 @@
 
 #include "GorillaStatsManager.h"
 
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include <folly/experimental/FunctionScheduler.h>
+#include <gflags/gflags.h>
+
+DEFINE_int32(
+    gorilla_stats_flush_interval_ms,
+    1000,
+    "How often the values of the pre-registered stats are reported");
+
 namespace facebook {
 namespace gorilla {
 
 std::string GorillaStatsManager::keyPrefix_ = "";
 std::unique_ptr<GorillaStatsManager> GorillaStatsManager::stats_ = nullptr;
 
+// Defined after `stats_` so that it's stopped before `stats_` is
+// destroyed.
+static std::unique_ptr<folly::FunctionScheduler> statsFlusher;
+
+std::atomic<int> GorillaStat::nextStripe_(0);
+
+namespace {
+struct StatRegistry {
+  std::mutex lock;
+  std::vector<GorillaStat*> stats;
+};
+
+// Never destroyed, since static stats in other files can be destroyed
+// after this file's statics.
+StatRegistry& getStatRegistry() {
+  static StatRegistry* registry = new StatRegistry();
+  return *registry;
+}
+}
+
 GorillaStatsManager::GorillaStatsManager() {}
 
 GorillaStatsManager::~GorillaStatsManager() {}
@@ -26,6 +59,52 @@ void GorillaStatsManager::initialize(
     keyPrefix_ = keyPrefix + '.';
   }
   stats_ = std::move(stats);
+
+  if (stats_ && !statsFlusher && FLAGS_gorilla_stats_flush_interval_ms > 0) {
+    statsFlusher.reset(new folly::FunctionScheduler());
+    statsFlusher->addFunction(
+        &GorillaStatsManager::flushStats,
+        std::chrono::milliseconds(FLAGS_gorilla_stats_flush_interval_ms),
+        "flushStats");
+    statsFlusher->start();
+  }
+}
+
+// Resolution of the histograms of addPercentileExports().
+static const int64_t kPercentileBuckets = 1000;
+
+void GorillaStatsManager::addPercentileExports(
+    const std::string& key,
+    int64_t max) {
+  addHistAndStatExports(
+      key,
+      "p50,p90,p99,p999",
+      std::max<int64_t>(1, max / kPercentileBuckets),
+      0,
+      max);
+}
+
+void GorillaStatsManager::flushStats() {
+  StatRegistry& registry = getStatRegistry();
+  std::lock_guard<std::mutex> guard(registry.lock);
+  for (GorillaStat* stat : registry.stats) {
+    stat->flush();
+  }
+}
+
+void GorillaStatsManager::registerStat(GorillaStat* stat) {
+  StatRegistry& registry = getStatRegistry();
+  std::lock_guard<std::mutex> guard(registry.lock);
+  registry.stats.push_back(stat);
+}
+
+void GorillaStatsManager::unregisterStat(GorillaStat* stat) {
+  StatRegistry& registry = getStatRegistry();
+  std::lock_guard<std::mutex> guard(registry.lock);
+  auto it = std::find(registry.stats.begin(), registry.stats.end(), stat);
+  if (it != registry.stats.end()) {
+    registry.stats.erase(it);
+  }
 }
 
 void GorillaStatsManager::addStatValue(const std::string& key, int64_t value) {
@@ -85,5 +164,28 @@ void GorillaStatsManager::addHistAndStatExports(
         keyPrefix_ + key, stats, bucketWidth, min, max);
   }
 }
+
+constexpr int GorillaStat::kStripes;
+
+GorillaStat::GorillaStat(const std::string& key) : key_(key) {
+  GorillaStatsManager::registerStat(this);
+}
+
+GorillaStat::~GorillaStat() {
+  GorillaStatsManager::unregisterStat(this);
+}
+
+void GorillaStat::flush() {
+  int64_t sum = 0;
+  int64_t count = 0;
+  for (auto& stripe : stripes_) {
+    sum += stripe.sum.exchange(0, std::memory_order_relaxed);
+    count += stripe.count.exchange(0, std::memory_order_relaxed);
+  }
+
+  if (count > 0) {
+    GorillaStatsManager::addStatValueAggregated(key_, sum, count);
+  }
+}
 }
 } // facebook:gorilla
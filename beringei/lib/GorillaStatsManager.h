@@ -9,6 +9,8 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <memory>
 #include <string>
 
@@ -23,6 +25,8 @@ enum GorillaStatsExportType {
   PERCENT,
 };
 
+class GorillaStat;
+
 // This class is a wrapper around ServiceData which prefixes all the counters
 // with a specific string.
 //
@@ -60,6 +64,15 @@ class GorillaStatsManager {
       int64_t min,
       int64_t max);
 
+  // Exports the 50th, 90th, 99th and 99.9th percentiles of the values
+  // of `key` from a histogram between 0 and `max`. Used for latencies,
+  // where averages hide the slow requests.
+  static void addPercentileExports(const std::string& key, int64_t max);
+
+  // Reports the values added to every GorillaStat since the last flush.
+  // Called every --gorilla_stats_flush_interval_ms after initialize().
+  static void flushStats();
+
  protected:
   GorillaStatsManager();
 
@@ -89,8 +102,63 @@ class GorillaStatsManager {
       int64_t max) = 0;
 
  private:
+  friend class GorillaStat;
+
+  static void registerStat(GorillaStat* stat);
+  static void unregisterStat(GorillaStat* stat);
+
   static std::string keyPrefix_;
   static std::unique_ptr<GorillaStatsManager> stats_;
 };
+
+// class GorillaStat
+//
+// A stat for hot paths. Adding a value is a relaxed atomic add on a
+// cache line of the calling thread instead of a virtual call and a
+// lookup by key. The values are passed to addStatValueAggregated() by
+// GorillaStatsManager::flushStats(), so the export types are added
+// for the key as usual. Usually a static object next to the key.
+class GorillaStat {
+ public:
+  explicit GorillaStat(const std::string& key);
+  ~GorillaStat();
+
+  GorillaStat(const GorillaStat&) = delete;
+  GorillaStat& operator=(const GorillaStat&) = delete;
+
+  // Same as GorillaStatsManager::addStatValue(key, value).
+  void add(int64_t value = 1) {
+    Stripe& stripe = stripes_[getStripeIndex()];
+    stripe.sum.fetch_add(value, std::memory_order_relaxed);
+    stripe.count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  const std::string& getKey() const {
+    return key_;
+  }
+
+  // Reports the values added since the last flush.
+  void flush();
+
+ private:
+  static constexpr int kStripes = 16;
+
+  struct alignas(64) Stripe {
+    std::atomic<int64_t> sum{0};
+    std::atomic<int64_t> count{0};
+  };
+
+  // Threads are spread over the stripes in the order they first add a
+  // value.
+  static int getStripeIndex() {
+    static thread_local int index = nextStripe_++ % kStripes;
+    return index;
+  }
+
+  static std::atomic<int> nextStripe_;
+
+  const std::string key_;
+  std::array<Stripe, kStripes> stripes_;
+};
 }
 } // facebook:gorilla
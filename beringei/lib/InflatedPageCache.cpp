@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "InflatedPageCache.h"
+
+#include <iterator>
+
+#include "GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kHits = "inflated_page_cache_hits";
+static const std::string kMisses = "inflated_page_cache_misses";
+static const std::string kEvictions = "inflated_page_cache_evictions";
+static const std::string kBytes = "inflated_page_cache_bytes";
+
+InflatedPageCache::InflatedPageCache(size_t maxBytes)
+    : maxBytes_(maxBytes), bytes_(0) {
+  GorillaStatsManager::addStatExportType(kHits, SUM);
+  GorillaStatsManager::addStatExportType(kMisses, SUM);
+  GorillaStatsManager::addStatExportType(kEvictions, SUM);
+}
+
+std::shared_ptr<folly::IOBuf> InflatedPageCache::get(uint64_t key) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      GorillaStatsManager::addStatValue(kHits);
+      return it->second->second;
+    }
+  }
+
+  GorillaStatsManager::addStatValue(kMisses);
+  return nullptr;
+}
+
+void InflatedPageCache::put(
+    uint64_t key,
+    std::shared_ptr<folly::IOBuf> group) {
+  size_t size = group->length();
+  if (size > maxBytes_) {
+    return;
+  }
+
+  // Evicted groups are freed outside of the mutex.
+  std::list<Entry> evicted;
+  int evictions = 0;
+  size_t bytes;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      bytes_ -= it->second->second->length();
+      evicted.splice(evicted.end(), lru_, it->second);
+      entries_.erase(it);
+    }
+
+    while (bytes_ + size > maxBytes_ && !lru_.empty()) {
+      entries_.erase(lru_.back().first);
+      bytes_ -= lru_.back().second->length();
+      evicted.splice(evicted.end(), lru_, std::prev(lru_.end()));
+      evictions++;
+    }
+
+    lru_.emplace_front(key, std::move(group));
+    entries_[key] = lru_.begin();
+    bytes_ += size;
+    bytes = bytes_;
+  }
+
+  if (evictions > 0) {
+    GorillaStatsManager::addStatValue(kEvictions, evictions);
+  }
+  GorillaStatsManager::setCounter(kBytes, bytes);
+}
+
+size_t InflatedPageCache::getMemoryUsage() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return bytes_;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <folly/io/IOBuf.h>
+
+namespace facebook {
+namespace gorilla {
+
+// class InflatedPageCache
+//
+// Keeps the page groups of compressed buckets that were inflated to
+// read them, so that reading the same cold pages again doesn't inflate
+// them every time. A group is keyed by a number that is never reused
+// for another group, so a bucket that was rotated or compressed again
+// is never served stale, and its old groups are just evicted in time.
+// The least recently used groups are evicted once they take more than
+// `maxBytes`. Groups stay alive for as long as a reader holds them,
+// even after they were evicted.
+//
+// Thread-safe.
+class InflatedPageCache {
+ public:
+  explicit InflatedPageCache(size_t maxBytes);
+
+  // Returns the group or null if it isn't cached.
+  std::shared_ptr<folly::IOBuf> get(uint64_t key);
+
+  void put(uint64_t key, std::shared_ptr<folly::IOBuf> group);
+
+  size_t getMemoryUsage();
+
+ private:
+  const size_t maxBytes_;
+
+  std::mutex mutex_;
+
+  // The most recently used group first.
+  typedef std::pair<uint64_t, std::shared_ptr<folly::IOBuf>> Entry;
+  std::list<Entry> lru_;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> entries_;
+  size_t bytes_;
+};
+}
+} // facebook::gorilla
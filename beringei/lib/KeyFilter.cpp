@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/lib/KeyFilter.h"
+
+#include <algorithm>
+
+namespace facebook {
+namespace gorilla {
+
+// The hash of the key is also used for picking the stripe and the slot
+// in the key table, so it's mixed again before picking the bits.
+static const uint64_t kBlockMultiplier = 0x9E3779B97F4A7C15ULL;
+static const uint64_t kBitsMultiplier = 0xBF58476D1CE4E5B9ULL;
+
+KeyFilter::KeyFilter(size_t expectedKeys)
+    : blocks_(std::max<size_t>(
+          1,
+          (expectedKeys * kBitsPerKey + kWordsPerBlock * 64 - 1) /
+              (kWordsPerBlock * 64))),
+      words_(new std::atomic<uint64_t>[blocks_ * kWordsPerBlock]),
+      expectedKeys_(expectedKeys),
+      added_(0) {
+  for (size_t i = 0; i < blocks_ * kWordsPerBlock; i++) {
+    words_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+std::atomic<uint64_t>* KeyFilter::block(uint64_t hash) const {
+  uint64_t h = (hash * kBlockMultiplier) >> 32;
+  return &words_[((h * blocks_) >> 32) * kWordsPerBlock];
+}
+
+void KeyFilter::add(uint64_t hash) {
+  std::atomic<uint64_t>* words = block(hash);
+  uint64_t bits = (hash ^ (hash >> 31)) * kBitsMultiplier;
+  for (int i = 0; i < kProbes; i++) {
+    uint32_t bit = (bits >> (i * kBitsPerProbe)) & (kWordsPerBlock * 64 - 1);
+    words[bit >> 6].fetch_or(1ULL << (bit & 63), std::memory_order_relaxed);
+  }
+  added_++;
+}
+
+bool KeyFilter::mayContain(uint64_t hash) const {
+  const std::atomic<uint64_t>* words = block(hash);
+  uint64_t bits = (hash ^ (hash >> 31)) * kBitsMultiplier;
+  for (int i = 0; i < kProbes; i++) {
+    uint32_t bit = (bits >> (i * kBitsPerProbe)) & (kWordsPerBlock * 64 - 1);
+    if (!(words[bit >> 6].load(std::memory_order_relaxed) &
+          (1ULL << (bit & 63)))) {
+      return false;
+    }
+  }
+  return true;
+}
+}
+} // facebook::gorilla
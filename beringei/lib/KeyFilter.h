@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+namespace facebook {
+namespace gorilla {
+
+// class KeyFilter
+//
+// Blocked Bloom filter over key hashes, so that lookups of keys that
+// don't exist can usually be answered without locking and probing the
+// key tables. All the bits of a key are in one 64-byte block, which
+// takes a single cache miss per lookup.
+//
+// The filter is built for a number of keys and gets less selective if
+// many more keys are added. Keys can't be removed, so a key that was
+// deleted can still be reported as maybe present.
+//
+// `add` and `mayContain` can be called from any number of threads.
+class KeyFilter {
+ public:
+  explicit KeyFilter(size_t expectedKeys);
+
+  // Adds the `CaseHash` of a key.
+  void add(uint64_t hash);
+
+  // Returns false if the key with this hash was never added.
+  bool mayContain(uint64_t hash) const;
+
+  // Returns true if many more keys have been added than the filter was
+  // built for.
+  bool full() const {
+    return added_ > 2 * expectedKeys_;
+  }
+
+  size_t sizeInBytes() const {
+    return blocks_ * kWordsPerBlock * sizeof(uint64_t);
+  }
+
+ private:
+  static const int kWordsPerBlock = 8;
+  static const int kBitsPerKey = 10;
+  static const int kBitsPerProbe = 9;
+  static const int kProbes = 6;
+
+  std::atomic<uint64_t>* block(uint64_t hash) const;
+
+  size_t blocks_;
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;
+  const size_t expectedKeys_;
+  std::atomic<size_t> added_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,133 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "KeyIndex.h"
+
+#include <strings.h>
+#include <cctype>
+
+namespace facebook {
+namespace gorilla {
+
+bool KeyIndex::CaseLess::operator()(const Item& a, const Item& b) const {
+  return strcasecmp(a->first.c_str(), b->first.c_str()) < 0;
+}
+
+bool KeyIndex::CaseLess::operator()(const Item& a, const char* b) const {
+  return strcasecmp(a->first.c_str(), b) < 0;
+}
+
+bool KeyIndex::CaseLess::operator()(const char* a, const Item& b) const {
+  return strcasecmp(a, b->first.c_str()) < 0;
+}
+
+bool KeyIndex::insert(const Item& item) {
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  return items_.insert(item).second;
+}
+
+bool KeyIndex::erase(const Item& item) {
+  folly::RWSpinLock::WriteHolder guard(lock_);
+
+  // Only erase the exact time series and not another one with the
+  // same key.
+  auto it = items_.find(item);
+  if (it == items_.end() || *it != item) {
+    return false;
+  }
+  items_.erase(it);
+  return true;
+}
+
+void KeyIndex::insertBatch(const std::vector<Item>& items) {
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  for (const auto& item : items) {
+    if (item) {
+      items_.insert(item);
+    }
+  }
+}
+
+void KeyIndex::swap(KeyIndex& other) {
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  folly::RWSpinLock::WriteHolder otherGuard(other.lock_);
+  items_.swap(other.items_);
+}
+
+size_t KeyIndex::size() const {
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  return items_.size();
+}
+
+bool KeyIndex::find(
+    const std::string& pattern,
+    const std::string& after,
+    int limit,
+    std::vector<Item>& out) const {
+  // Only the keys starting with the part of the pattern before the
+  // first wildcard can match.
+  std::string prefix = pattern.substr(0, pattern.find_first_of("*?"));
+  bool exact = prefix.size() == pattern.size();
+
+  folly::RWSpinLock::ReadHolder guard(lock_);
+  auto it = strcasecmp(after.c_str(), prefix.c_str()) >= 0
+      ? items_.upper_bound(after.c_str())
+      : items_.lower_bound(prefix.c_str());
+
+  int found = 0;
+  for (; it != items_.end(); ++it) {
+    const std::string& key = (*it)->first;
+    if (strncasecmp(key.c_str(), prefix.c_str(), prefix.size()) != 0) {
+      return false;
+    }
+
+    if (exact ? key.size() == prefix.size() : matches(pattern, key)) {
+      if (found == limit) {
+        return true;
+      }
+      out.push_back(*it);
+      found++;
+    }
+  }
+  return false;
+}
+
+bool KeyIndex::matches(folly::StringPiece pattern, folly::StringPiece key) {
+  // Backtracks to the last '*' on a mismatch, which is linear in the
+  // length of the key for each '*' in the pattern.
+  size_t p = 0;
+  size_t k = 0;
+  size_t starPattern = std::string::npos;
+  size_t starKey = 0;
+  while (k < key.size()) {
+    if (p < pattern.size() && pattern[p] == '*') {
+      starPattern = p++;
+      starKey = k;
+    } else if (
+        p < pattern.size() &&
+        (pattern[p] == '?' ||
+         tolower((unsigned char)pattern[p]) ==
+             tolower((unsigned char)key[k]))) {
+      p++;
+      k++;
+    } else if (starPattern != std::string::npos) {
+      p = starPattern + 1;
+      k = ++starKey;
+    } else {
+      return false;
+    }
+  }
+
+  while (p < pattern.size() && pattern[p] == '*') {
+    p++;
+  }
+  return p == pattern.size();
+}
+}
+} // facebook::gorilla
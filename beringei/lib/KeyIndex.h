@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+#include <folly/synchronization/RWSpinLock.h>
+
+#include "beringei/lib/BucketedTimeSeries.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class KeyIndex
+//
+// The time series of a shard sorted by key, ignoring case, so that the
+// keys matching a prefix or a glob can be found without going through
+// every key of the shard. Has its own lock and is updated by BucketMap
+// whenever a key is added or removed.
+class KeyIndex {
+ public:
+  typedef std::shared_ptr<std::pair<std::string, BucketedTimeSeries>> Item;
+
+  // Returns false if a time series with the same key is already in the
+  // index.
+  bool insert(const Item& item);
+
+  // Returns false if `item` isn't in the index.
+  bool erase(const Item& item);
+
+  // Inserts many items with one acquisition of the lock.
+  void insertBatch(const std::vector<Item>& items);
+
+  // Swaps the contents with `other`. Used to free the items outside
+  // of the locks of the shard.
+  void swap(KeyIndex& other);
+
+  size_t size() const;
+
+  // Appends up to `limit` items whose keys match `pattern` and sort
+  // after `after`, in order. `pattern` is a glob where '*' matches any
+  // characters and '?' any one character, ignoring case. Returns true
+  // if more keys might match.
+  bool find(
+      const std::string& pattern,
+      const std::string& after,
+      int limit,
+      std::vector<Item>& out) const;
+
+  // Returns true if `key` matches the glob `pattern`, ignoring case.
+  static bool matches(folly::StringPiece pattern, folly::StringPiece key);
+
+ private:
+  struct CaseLess {
+    typedef void is_transparent;
+
+    bool operator()(const Item& a, const Item& b) const;
+    bool operator()(const Item& a, const char* b) const;
+    bool operator()(const char* a, const Item& b) const;
+  };
+
+  mutable folly::RWSpinLock lock_;
+  std::set<Item, CaseLess> items_;
+};
+}
+} // facebook::gorilla
@@ -10,6 +10,8 @@
 #include "KeyListWriter.h"
 
 #include "GorillaStatsManager.h"
+#include "GorillaTimeConstants.h"
+#include "Timer.h"
 
 #include "glog/logging.h"
 
@@ -18,16 +20,23 @@ namespace gorilla {
 
 static const std::string kKeyListFailures = "key_list_write_failures";
 static const std::string kKeysPopped = "key_list_queue_popped";
+static const std::string kKeyGroupsWritten = "key_list_groups_written";
+static const std::string kUsPerKeyGroupWrite = "us_per_key_list_group_write";
 
-KeyListWriter::KeyListWriter(const std::string& dataDirectory, size_t queueSize)
-    : keyInfoQueue_(queueSize),
-      writerThread_(nullptr),
-      dataDirectory_(dataDirectory) {
-  startWriterThread();
+KeyListWriter::KeyListWriter(
+    const std::string& dataDirectory,
+    size_t queueSize,
+    int threads)
+    : dataDirectory_(dataDirectory) {
+  CHECK_GT(threads, 0);
+  for (int i = 0; i < threads; i++) {
+    writerThreads_.emplace_back(new WriterThread(queueSize));
+  }
+  startWriterThreads();
 }
 
 KeyListWriter::~KeyListWriter() {
-  stopWriterThread();
+  stopWriterThreads();
 }
 
 void KeyListWriter::addKey(
@@ -45,7 +54,15 @@ void KeyListWriter::addKey(
   info.timestamp = timestamp;
 
   // It's better to delay the thrift handler than to completely lose a key.
-  keyInfoQueue_.blockingWrite(std::move(info));
+  queue(shardId).blockingWrite(std::move(info));
+}
+
+bool KeyListWriter::deleteKey(int64_t shardId, uint32_t id) {
+  KeyInfo info;
+  info.shardId = shardId;
+  info.keyId = id;
+  info.type = KeyInfo::DELETE_KEY;
+  return queue(shardId).write(std::move(info));
 }
 
 void KeyListWriter::compact(
@@ -64,20 +81,24 @@ void KeyListWriter::startShard(int64_t shardId) {
   KeyInfo info;
   info.shardId = shardId;
   info.type = KeyInfo::START_SHARD;
-  keyInfoQueue_.blockingWrite(std::move(info));
+  queue(shardId).blockingWrite(std::move(info));
 }
 
 void KeyListWriter::stopShard(int64_t shardId) {
   KeyInfo info;
   info.shardId = shardId;
   info.type = KeyInfo::STOP_SHARD;
-  keyInfoQueue_.blockingWrite(std::move(info));
+  queue(shardId).blockingWrite(std::move(info));
 }
 
 void KeyListWriter::startMonitoring() {
   GorillaStatsManager::addStatExportType(kKeyListFailures, SUM);
   GorillaStatsManager::addStatExportType(kKeysPopped, AVG);
   GorillaStatsManager::addStatExportType(kKeysPopped, SUM);
+  GorillaStatsManager::addStatExportType(kKeyGroupsWritten, SUM);
+  GorillaStatsManager::addStatExportType(kUsPerKeyGroupWrite, AVG);
+  GorillaStatsManager::addPercentileExports(
+      kUsPerKeyGroupWrite, kGorillaUsecPerSecond);
 }
 
 std::shared_ptr<PersistentKeyList> KeyListWriter::get(int64_t shardId) {
@@ -99,85 +120,146 @@ void KeyListWriter::disable(int64_t shardId) {
   keyWriters_.erase(shardId);
 }
 
+double KeyListWriter::getQueueFill() const {
+  double fill = 0;
+  for (auto& writerThread : writerThreads_) {
+    fill = std::max(
+        fill,
+        (double)std::max<ssize_t>(0, writerThread->queue.sizeGuess()) /
+            writerThread->queue.capacity());
+  }
+  return fill;
+}
+
 void KeyListWriter::flushQueue() {
-  // Stop thread to flush keys
-  stopWriterThread();
-  startWriterThread();
+  // Stop threads to flush keys
+  stopWriterThreads();
+  startWriterThreads();
 }
 
-void KeyListWriter::startWriterThread() {
-  writerThread_.reset(new std::thread([&]() {
-    while (true) {
-      try {
-        if (!writeOneKey()) {
-          break;
+void KeyListWriter::startWriterThreads() {
+  for (auto& writerThread : writerThreads_) {
+    auto& queue = writerThread->queue;
+    writerThread->thread.reset(new std::thread([this, &queue]() {
+      while (true) {
+        try {
+          if (!writeKeys(queue)) {
+            break;
+          }
+        } catch (std::exception& e) {
+          LOG(ERROR) << e.what();
         }
-      } catch (std::exception& e) {
-        LOG(ERROR) << e.what();
       }
-    }
-  }));
+    }));
+  }
 }
 
-void KeyListWriter::stopWriterThread() {
-  if (writerThread_) {
-    // Wake up and stop the writer thread.
-    KeyInfo info;
-    info.type = KeyInfo::STOP_THREAD;
-    keyInfoQueue_.blockingWrite(std::move(info));
+void KeyListWriter::stopWriterThreads() {
+  for (auto& writerThread : writerThreads_) {
+    if (writerThread->thread) {
+      // Wake up and stop the writer thread.
+      KeyInfo info;
+      info.type = KeyInfo::STOP_THREAD;
+      writerThread->queue.blockingWrite(std::move(info));
+    }
+  }
 
-    writerThread_->join();
+  for (auto& writerThread : writerThreads_) {
+    if (writerThread->thread) {
+      writerThread->thread->join();
+      writerThread->thread.reset();
+    }
   }
 }
 
-bool KeyListWriter::writeOneKey() {
-  // This code assumes that there's only a single thread running here!
+bool KeyListWriter::writeKeys(folly::MPMCQueue<KeyInfo>& queue) {
+  // Only one thread reads from each queue.
 
   std::vector<KeyInfo> keys;
 
   {
     KeyInfo info;
-    keyInfoQueue_.blockingRead(info);
+    queue.blockingRead(info);
 
     keys.push_back(std::move(info));
-    while (keyInfoQueue_.read(info)) {
+    while (queue.read(info)) {
       keys.push_back(std::move(info));
     }
   }
 
   GorillaStatsManager::addStatValue(kKeysPopped, keys.size());
 
-  for (auto& info : keys) {
-    switch (info.type) {
+  auto iter = keys.begin();
+  while (iter != keys.end()) {
+    switch (iter->type) {
       case KeyInfo::STOP_THREAD:
         return false;
       case KeyInfo::START_SHARD:
-        enable(info.shardId);
+        enable(iter->shardId);
+        iter++;
         break;
       case KeyInfo::STOP_SHARD:
-        disable(info.shardId);
+        disable(iter->shardId);
+        iter++;
         break;
       case KeyInfo::WRITE_KEY:
-        auto writer = get(info.shardId);
-        if (!writer) {
-          LOG(ERROR) << "Trying to write key to non-enabled shard "
-                     << info.shardId;
-          continue;
-        }
-        if (!writer->appendKey(
-                info.keyId, info.key.c_str(), info.category, info.timestamp)) {
-          LOG(ERROR) << "Failed to write key '" << info.key
-                     << "' to log for shard " << info.shardId;
-          GorillaStatsManager::addStatValue(kKeyListFailures);
-
-          // Try to put it back in the queue for later.
-          keyInfoQueue_.write(std::move(info));
+      case KeyInfo::DELETE_KEY: {
+        // Take every following key and deletion of the same shard.
+        auto end = iter + 1;
+        while (end != keys.end() && end->shardId == iter->shardId &&
+               (end->type == KeyInfo::WRITE_KEY ||
+                end->type == KeyInfo::DELETE_KEY)) {
+          end++;
         }
+        writeGroup(queue, iter, end);
+        iter = end;
         break;
+      }
     }
   }
 
   return true;
 }
+
+void KeyListWriter::writeGroup(
+    folly::MPMCQueue<KeyInfo>& queue,
+    std::vector<KeyInfo>::iterator begin,
+    std::vector<KeyInfo>::iterator end) {
+  int64_t shardId = begin->shardId;
+  auto writer = get(shardId);
+  if (!writer) {
+    LOG(ERROR) << "Trying to write " << (end - begin)
+               << " keys to non-enabled shard " << shardId;
+    return;
+  }
+
+  std::vector<PersistentKeyList::KeyEntry> entries;
+  entries.reserve(end - begin);
+  for (auto iter = begin; iter != end; iter++) {
+    if (iter->type == KeyInfo::DELETE_KEY) {
+      entries.push_back({(uint32_t)iter->keyId, nullptr, 0, 0});
+    } else {
+      entries.push_back({(uint32_t)iter->keyId,
+                         iter->key.c_str(),
+                         iter->category,
+                         iter->timestamp});
+    }
+  }
+
+  GorillaStatsManager::addStatValue(kKeyGroupsWritten);
+  Timer timer(true);
+  bool appended = writer->appendKeys(entries);
+  GorillaStatsManager::addStatValue(kUsPerKeyGroupWrite, timer.get());
+  if (!appended) {
+    LOG(ERROR) << "Failed to write " << entries.size()
+               << " keys to log for shard " << shardId;
+    GorillaStatsManager::addStatValue(kKeyListFailures, entries.size());
+
+    // Try to put them back in the queue for later.
+    for (auto iter = begin; iter != end; iter++) {
+      queue.write(std::move(*iter));
+    }
+  }
+}
 }
 } // facebook:gorilla
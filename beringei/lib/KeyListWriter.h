@@ -12,6 +12,7 @@
 #include <memory>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "PersistentKeyList.h"
 
@@ -20,11 +21,21 @@
 namespace facebook {
 namespace gorilla {
 
+// class KeyListWriter
+//
+// Writes new keys to the key lists of the shards from background
+// threads. Each thread has its own queue and a shard always goes to the
+// same thread, so the keys of a shard are written in order. The keys
+// that a thread dequeues together are grouped by shard and each group
+// is appended to the key list at once.
 class KeyListWriter {
  public:
   static const std::string kLogFilePrefix;
 
-  KeyListWriter(const std::string& dataDirectory, size_t queueSize);
+  KeyListWriter(
+      const std::string& dataDirectory,
+      size_t queueSize,
+      int threads = 1);
 
   ~KeyListWriter();
 
@@ -36,6 +47,10 @@ class KeyListWriter {
       uint16_t category,
       int32_t timestamp);
 
+  // Queue a deletion of the key with `id`. Doesn't block, so it can
+  // be called with locks held. Returns false if the queue is full.
+  bool deleteKey(int64_t shardId, uint32_t id);
+
   // Pass a compaction call down to the appropriate PersistentKeyList.
   void compact(
       int64_t shardId,
@@ -49,28 +64,60 @@ class KeyListWriter {
 
   void flushQueue();
 
+  // Returns the fraction of the fullest queue that is in use. Keys are
+  // dropped once a queue is full.
+  double getQueueFill() const;
+
+  // Returns the writer thread of the shard.
+  int thread(int64_t shardId) const {
+    return shardId % writerThreads_.size();
+  }
+
  private:
   std::shared_ptr<PersistentKeyList> get(int64_t shardId);
   void enable(int64_t shardId);
   void disable(int64_t shardId);
 
-  void stopWriterThread();
-  void startWriterThread();
-
-  // Write a single entry from the queue.
-  bool writeOneKey();
+  void stopWriterThreads();
+  void startWriterThreads();
 
   struct KeyInfo {
     int64_t shardId;
     std::string key;
     int32_t keyId;
-    enum { STOP_THREAD, START_SHARD, STOP_SHARD, WRITE_KEY } type;
+    enum {
+      STOP_THREAD,
+      START_SHARD,
+      STOP_SHARD,
+      WRITE_KEY,
+      DELETE_KEY
+    } type;
     uint16_t category;
     int32_t timestamp;
   };
 
-  folly::MPMCQueue<KeyInfo> keyInfoQueue_;
-  std::unique_ptr<std::thread> writerThread_;
+  struct WriterThread {
+    explicit WriterThread(size_t queueSize) : queue(queueSize) {}
+
+    folly::MPMCQueue<KeyInfo> queue;
+    std::unique_ptr<std::thread> thread;
+  };
+
+  // Write everything that's in the queue, blocking until there's at
+  // least one entry. Returns false when the thread should stop.
+  bool writeKeys(folly::MPMCQueue<KeyInfo>& queue);
+
+  // Write consecutive keys of the same shard with a single append.
+  void writeGroup(
+      folly::MPMCQueue<KeyInfo>& queue,
+      std::vector<KeyInfo>::iterator begin,
+      std::vector<KeyInfo>::iterator end);
+
+  folly::MPMCQueue<KeyInfo>& queue(int64_t shardId) {
+    return writerThreads_[thread(shardId)]->queue;
+  }
+
+  std::vector<std::unique_ptr<WriterThread>> writerThreads_;
   const std::string dataDirectory_;
 
   std::mutex lock_;
@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "LastUpdateTimes.h"
+
+namespace facebook {
+namespace gorilla {
+
+constexpr uint32_t LastUpdateTimes::kRowsPerChunk;
+
+LastUpdateTimes::LastUpdateTimes(uint32_t maxRows)
+    : numChunks_((maxRows + kRowsPerChunk - 1) / kRowsPerChunk),
+      chunks_(new std::atomic<std::atomic<uint32_t>*>[numChunks_]) {
+  for (uint32_t i = 0; i < numChunks_; i++) {
+    chunks_[i] = nullptr;
+  }
+}
+
+LastUpdateTimes::~LastUpdateTimes() {
+  for (uint32_t i = 0; i < numChunks_; i++) {
+    delete[] chunks_[i].load();
+  }
+}
+
+std::atomic<uint32_t>* LastUpdateTimes::getChunk(uint32_t row) const {
+  uint32_t chunk = row / kRowsPerChunk;
+  if (chunk >= numChunks_) {
+    return nullptr;
+  }
+  return chunks_[chunk].load(std::memory_order_acquire);
+}
+
+void LastUpdateTimes::update(uint32_t row, uint32_t unixTime) {
+  std::atomic<uint32_t>* chunk = getChunk(row);
+  if (!chunk) {
+    uint32_t index = row / kRowsPerChunk;
+    if (index >= numChunks_) {
+      return;
+    }
+
+    // Another thread might allocate the chunk at the same time.
+    std::unique_ptr<std::atomic<uint32_t>[]> newChunk(
+        new std::atomic<uint32_t>[kRowsPerChunk]);
+    for (uint32_t i = 0; i < kRowsPerChunk; i++) {
+      newChunk[i] = 0;
+    }
+    std::atomic<uint32_t>* expected = nullptr;
+    if (chunks_[index].compare_exchange_strong(expected, newChunk.get())) {
+      chunk = newChunk.release();
+    } else {
+      chunk = expected;
+    }
+  }
+
+  auto& time = chunk[row % kRowsPerChunk];
+  uint32_t previous = time.load(std::memory_order_relaxed);
+  while (previous < unixTime &&
+         !time.compare_exchange_weak(
+             previous, unixTime, std::memory_order_relaxed)) {
+  }
+}
+
+uint32_t LastUpdateTimes::get(uint32_t row) const {
+  std::atomic<uint32_t>* chunk = getChunk(row);
+  if (!chunk) {
+    return 0;
+  }
+  return chunk[row % kRowsPerChunk].load(std::memory_order_relaxed);
+}
+
+void LastUpdateTimes::reset(uint32_t row) {
+  std::atomic<uint32_t>* chunk = getChunk(row);
+  if (chunk) {
+    chunk[row % kRowsPerChunk].store(0, std::memory_order_relaxed);
+  }
+}
+
+void LastUpdateTimes::resetAll() {
+  for (uint32_t i = 0; i < numChunks_; i++) {
+    std::atomic<uint32_t>* chunk = chunks_[i].load();
+    if (chunk) {
+      for (uint32_t j = 0; j < kRowsPerChunk; j++) {
+        chunk[j].store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace facebook {
+namespace gorilla {
+
+// class LastUpdateTimes
+//
+// The time of the newest data point put in each row of a shard, so that
+// searching for recently updated time series can skip the stale rows
+// without locking or even looking at them. The times are kept in
+// chunks that are never moved or freed while the object exists, so puts
+// update them without taking any locks.
+//
+// A time of 0 means unknown, for example for rows that only have data
+// from block files. These rows must be looked at.
+class LastUpdateTimes {
+ public:
+  // Rows at or past `maxRows` are always unknown.
+  explicit LastUpdateTimes(uint32_t maxRows);
+  ~LastUpdateTimes();
+
+  // Moves the time of `row` forward to `unixTime`.
+  void update(uint32_t row, uint32_t unixTime);
+
+  uint32_t get(uint32_t row) const;
+
+  // Forgets the time of `row`, when the row is freed.
+  void reset(uint32_t row);
+
+  // Forgets all the times. The memory is kept because puts might still
+  // be using it.
+  void resetAll();
+
+ private:
+  static constexpr uint32_t kRowsPerChunk = 4096;
+
+  std::atomic<uint32_t>* getChunk(uint32_t row) const;
+
+  const uint32_t numChunks_;
+  std::unique_ptr<std::atomic<std::atomic<uint32_t>*>[]> chunks_;
+};
+}
+} // facebook::gorilla
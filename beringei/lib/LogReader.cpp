@@ -2,18 +2,44 @@
 
 #include "beringei/lib/LogReader.h"
 
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <vector>
+
 #include <folly/Range.h>
 
 #include "beringei/lib/BucketUtils.h"
+#include "beringei/lib/CombinedLog.h"
 #include "beringei/lib/DataLog.h"
+#include "beringei/lib/DataLogUtil.h"
 #include "beringei/lib/FileUtils.h"
 #include "beringei/lib/GorillaStatsManager.h"
+#include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/Timer.h"
+
+DEFINE_int32(
+    log_reader_parallel_files,
+    2,
+    "Number of log files read and decoded in parallel while the points "
+    "of an earlier file are being applied during shard recovery");
 
 namespace facebook {
 namespace gorilla {
 
 static constexpr folly::StringPiece kLogFilePrefix = "log";
 static constexpr folly::StringPiece kCorruptLogFiles = "corrupt_log_files";
+static constexpr folly::StringPiece kMsPerLogFileDecode =
+    "ms_per_log_file_decode";
+static constexpr folly::StringPiece kMsPerLogFileWait = "ms_per_log_file_wait";
+static constexpr folly::StringPiece kMsPerLogFileApply =
+    "ms_per_log_file_apply";
+static constexpr folly::StringPiece kRemoteLogFileFailures =
+    "remote_log_file_failures";
+static constexpr folly::StringPiece kMsPerRemoteLogFileRead =
+    "ms_per_remote_log_file_read";
+
+DECLARE_int32(max_allowed_timeseries_id);
 
 LocalLogReader::LocalLogReader(
     uint32_t shardId,
@@ -29,45 +55,137 @@ void LocalLogReader::readLog(
     uint32_t lastBlock,
     int64_t& lastTimestamp,
     uint32_t& unknownKeys) {
-  FileUtils files(shardId_, kLogFilePrefix.str(), dataDirectory_);
+  // Log files are read and decoded in background threads a few files
+  // ahead of the one whose points are being applied. Points still have
+  // to be applied in file order.
+  std::deque<std::pair<int64_t, std::future<std::vector<LogPoint>>>>
+      pending;
+  auto applyOldest = [&]() {
+    Timer timer(true);
+    int64_t id = pending.front().first;
+    std::vector<LogPoint> points = pending.front().second.get();
+    pending.pop_front();
+    GorillaStatsManager::addStatValue(
+        kMsPerLogFileWait.str(), timer.reset() / kGorillaUsecPerMs);
+
+    for (const auto& point : points) {
+      cb_(point.key,
+          point.unixTime,
+          point.value,
+          point.ms,
+          unknownKeys,
+          lastTimestamp);
+    }
+    GorillaStatsManager::addStatValue(
+        kMsPerLogFileApply.str(), timer.get() / kGorillaUsecPerMs);
+    LOG(INFO) << "Finished reading logfile " << id << " for shard "
+              << shardId_ << " with " << points.size() << " points";
+  };
 
-  for (int64_t id : files.ls()) {
+  const size_t maxPending = std::max(FLAGS_log_reader_parallel_files, 0);
+  for (int64_t id : listLogFiles()) {
     if (id < BucketUtils::timestamp(lastBlock + 1, windowSize_, shardId_)) {
       LOG(INFO) << "Skipping log file " << id << " because it's already "
                 << "covered by a block";
       continue;
     }
 
-    auto file = files.open(id, "rb", 0);
-    if (!file.file) {
-      LOG(ERROR) << "Could not open shard " << shardId_ << " logfile";
+    if (skippedFiles_.count(id) > 0) {
+      LOG(INFO) << "Skipping log file " << id << " because it's already "
+                << "covered by a snapshot";
       continue;
     }
 
-    LOG(INFO) << "Reading logfile " << file.name;
     uint32_t b = BucketUtils::bucket(id, windowSize_, shardId_);
-    DataLogReader::readLog(
-        file, id, [&](uint32_t key, int64_t unixTime, double value) {
-          if (unixTime < BucketUtils::timestamp(b, windowSize_, shardId_) ||
-              unixTime > BucketUtils::timestamp(b + 1, windowSize_, shardId_)) {
-            LOG(ERROR) << "Unix time is out of the expected range: " << unixTime
-                       << " ["
-                       << BucketUtils::timestamp(b, windowSize_, shardId_)
-                       << ","
-                       << BucketUtils::timestamp(b + 1, windowSize_, shardId_)
-                       << "]";
-            GorillaStatsManager::addStatValue(kCorruptLogFiles.str());
-
-            // It's better to stop reading this log file here because
-            // none of the data can be trusted after this.
-            return false;
-          }
-          cb_(key, unixTime, value, unknownKeys, lastTimestamp);
-          return true;
-        });
-    fclose(file.file);
-    LOG(INFO) << "Finished reading logfile " << file.name;
+    int64_t begin = BucketUtils::timestamp(b, windowSize_, shardId_);
+    int64_t end = BucketUtils::timestamp(b + 1, windowSize_, shardId_);
+    pending.emplace_back(
+        id,
+        std::async(std::launch::async, [this, id, begin, end]() {
+          return decodeLogFile(id, begin, end);
+        }));
+
+    if (pending.size() > maxPending) {
+      applyOldest();
+    }
+  }
+
+  while (!pending.empty()) {
+    applyOldest();
+  }
+}
+
+void LocalLogReader::skipFiles(const std::set<int64_t>& ids) {
+  skippedFiles_ = ids;
+}
+
+std::vector<int64_t> LocalLogReader::listLogFiles() {
+  FileUtils files(shardId_, kLogFilePrefix.str(), dataDirectory_);
+  std::vector<int64_t> ids = files.ls();
+  if (!CombinedLogReader::exists(dataDirectory_)) {
+    return ids;
+  }
+
+  // Separate files from before the combined log was enabled are still
+  // read. A file in the combined log replaces one with the same id.
+  combinedFiles_.clear();
+  CombinedLogReader::readShard(dataDirectory_, shardId_, combinedFiles_);
+  for (const auto& file : combinedFiles_) {
+    ids.push_back(file.first);
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  LOG(INFO) << "Found " << combinedFiles_.size() << " log files of shard "
+            << shardId_ << " in the combined log";
+  return ids;
+}
+
+bool LocalLogReader::readLogFile(int64_t id, std::string& data) {
+  // Files are read from several threads, but the map itself doesn't
+  // change after listing.
+  auto iter = combinedFiles_.find(id);
+  if (iter != combinedFiles_.end()) {
+    data = std::move(iter->second);
+    return !data.empty();
+  }
+
+  FileUtils files(shardId_, kLogFilePrefix.str(), dataDirectory_);
+  return files.read(id, data);
+}
+
+std::vector<LocalLogReader::LogPoint>
+LocalLogReader::decodeLogFile(int64_t id, int64_t begin, int64_t end) {
+  std::vector<LogPoint> points;
+  std::string buffer;
+  if (!readLogFile(id, buffer)) {
+    // Empty or unreadable. The reader already logged why.
+    return points;
   }
+
+  Timer timer(true);
+  std::vector<double> previousValues;
+  DataLogUtil::readLogInline(
+      buffer.data(),
+      buffer.size(),
+      id,
+      FLAGS_max_allowed_timeseries_id,
+      previousValues,
+      [&](uint32_t key, int64_t unixTime, double value, int16_t ms) {
+        if (unixTime < begin || unixTime > end) {
+          LOG(ERROR) << "Unix time is out of the expected range: " << unixTime
+                     << " [" << begin << "," << end << "]";
+          GorillaStatsManager::addStatValue(kCorruptLogFiles.str());
+
+          // It's better to stop reading this log file here because
+          // none of the data can be trusted after this.
+          return false;
+        }
+        points.push_back(LogPoint{key, unixTime, value, ms});
+        return true;
+      });
+  GorillaStatsManager::addStatValue(
+      kMsPerLogFileDecode.str(), timer.get() / kGorillaUsecPerMs);
+  return points;
 }
 
 LocalLogReaderFactory::LocalLogReaderFactory(const std::string& dir)
@@ -81,5 +199,57 @@ std::unique_ptr<LogReader> LocalLogReaderFactory::getLogReader(
       shardId, dataDir_, windowSize, std::move(func));
 }
 
+RemoteLogReader::RemoteLogReader(
+    uint32_t shardId,
+    const std::string& dataDir,
+    int64_t windowSize,
+    DataPointCallback&& func,
+    std::shared_ptr<LogFileSource> source)
+    : LocalLogReader(shardId, dataDir, windowSize, std::move(func)),
+      source_(std::move(source)),
+      remote_(true) {}
+
+std::vector<int64_t> RemoteLogReader::listLogFiles() {
+  std::vector<int64_t> ids;
+  if (source_->listLogFiles(shardId_, ids)) {
+    LOG(INFO) << "Reading " << ids.size() << " log files of shard "
+              << shardId_ << " remotely";
+    return ids;
+  }
+
+  remote_ = false;
+  return LocalLogReader::listLogFiles();
+}
+
+bool RemoteLogReader::readLogFile(int64_t id, std::string& data) {
+  if (!remote_) {
+    return LocalLogReader::readLogFile(id, data);
+  }
+
+  Timer timer(true);
+  if (!source_->readLogFile(shardId_, id, data)) {
+    LOG(ERROR) << "Reading log file " << id << " of shard " << shardId_
+               << " remotely failed";
+    GorillaStatsManager::addStatValue(kRemoteLogFileFailures.str());
+    return false;
+  }
+  GorillaStatsManager::addStatValue(
+      kMsPerRemoteLogFileRead.str(), timer.get() / kGorillaUsecPerMs);
+  return !data.empty();
+}
+
+RemoteLogReaderFactory::RemoteLogReaderFactory(
+    const std::string& dir,
+    std::shared_ptr<LogFileSource> source)
+    : dataDir_(dir), source_(std::move(source)) {}
+
+std::unique_ptr<LogReader> RemoteLogReaderFactory::getLogReader(
+    uint32_t shardId,
+    int64_t windowSize,
+    DataPointCallback&& func) const {
+  return std::make_unique<RemoteLogReader>(
+      shardId, dataDir_, windowSize, std::move(func), source_);
+}
+
 } // namespace gorilla
 } // namespace facebook
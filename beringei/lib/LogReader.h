@@ -4,13 +4,21 @@
 
 #include <cstddef>
 #include <functional>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <vector>
 
 namespace facebook {
 namespace gorilla {
 
-using DataPointCallback =
-    std::function<void(uint32_t, int64_t, double, uint32_t&, int64_t&)>;
+class FileUtils;
+
+// Gets the key, the timestamp, the value and the milliseconds of each
+// point.
+using DataPointCallback = std::function<
+    void(uint32_t, int64_t, double, int16_t, uint32_t&, int64_t&)>;
 
 /// Reader for all data points from the log.
 class LogReader {
@@ -25,6 +33,13 @@ class LogReader {
       uint32_t lastBlock,
       int64_t& lastTimestamp,
       uint32_t& unknownKeys) = 0;
+
+  /// Don't read the given log files because all their data points are
+  /// in a snapshot of the open bucket. Readers that can't skip files
+  /// read them anyway, which gives the same result because the points
+  /// are dropped as duplicates.
+  /// @param[in] ids Ids of the log files to skip.
+  virtual void skipFiles(const std::set<int64_t>& ids) {}
 };
 
 /// Read log from a local directory.
@@ -42,11 +57,80 @@ class LocalLogReader : public LogReader {
       int64_t& lastTimestamp,
       uint32_t& unknownKeys) override;
 
- private:
+  /// @see LogReader.
+  void skipFiles(const std::set<int64_t>& ids) override;
+
+ protected:
+  /// Ids of the log files of the shard, oldest first.
+  virtual std::vector<int64_t> listLogFiles();
+
+  /// Reads the whole log file `id`. Returns false if it is empty or can't
+  /// be read.
+  virtual bool readLogFile(int64_t id, std::string& data);
+
   uint32_t shardId_;
+
+ private:
+  struct LogPoint {
+    uint32_t key;
+    int64_t unixTime;
+    double value;
+    int16_t ms;
+  };
+
+  // Reads a log file and decodes the points in it. Stops at the first
+  // point that is not within [begin, end].
+  std::vector<LogPoint> decodeLogFile(int64_t id, int64_t begin, int64_t end);
+
   std::string dataDirectory_;
   int64_t windowSize_;
   DataPointCallback cb_;
+  std::set<int64_t> skippedFiles_;
+
+  // Log files of the shard from the combined log segments, read when
+  // the files are listed. Taken out one by one as they are read.
+  std::map<int64_t, std::string> combinedFiles_;
+};
+
+/// Gives RemoteLogReader the log files of shards, e.g. from the host that
+/// owned them before. Must be thread safe.
+class LogFileSource {
+ public:
+  virtual ~LogFileSource() {}
+
+  /// Sets `ids` to the ids of the log files of the shard, oldest first.
+  /// Returns false if the source doesn't have the shard, in which case
+  /// the local log files are read instead.
+  virtual bool listLogFiles(uint32_t shardId, std::vector<int64_t>& ids) = 0;
+
+  /// Reads the whole log file `id` of the shard. Returns false if it
+  /// can't be read.
+  virtual bool
+  readLogFile(uint32_t shardId, int64_t id, std::string& data) = 0;
+};
+
+/// Reads the log files from a LogFileSource instead of the local
+/// directory, so that a host taking over a shard gets all the points
+/// the previous owner logged up to the moment each file is read, without
+/// copying the files first.
+class RemoteLogReader : public LocalLogReader {
+ public:
+  RemoteLogReader(
+      uint32_t shardId,
+      const std::string& dataDir,
+      int64_t windowSize,
+      DataPointCallback&& func,
+      std::shared_ptr<LogFileSource> source);
+
+ protected:
+  std::vector<int64_t> listLogFiles() override;
+  bool readLogFile(int64_t id, std::string& data) override;
+
+ private:
+  std::shared_ptr<LogFileSource> source_;
+
+  // False once the source didn't have the shard.
+  bool remote_;
 };
 
 class LogReaderFactory {
@@ -70,5 +154,21 @@ class LocalLogReaderFactory : public LogReaderFactory {
   std::string dataDir_;
 };
 
+class RemoteLogReaderFactory : public LogReaderFactory {
+ public:
+  /// Log files that `source` doesn't have are read from `dir`.
+  RemoteLogReaderFactory(
+      const std::string& dir,
+      std::shared_ptr<LogFileSource> source);
+  virtual std::unique_ptr<LogReader> getLogReader(
+      uint32_t shardId,
+      int64_t windowSize,
+      DataPointCallback&& func) const override;
+
+ private:
+  std::string dataDir_;
+  std::shared_ptr<LogFileSource> source_;
+};
+
 } // namespace gorilla
 } // namespace facebook
@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "MemoryStats.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include <glog/logging.h>
+
+#include "FileUtils.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kStatFile = "/proc/self/statm";
+
+bool MemoryStats::read(const std::string& cgroupDirectory, MemoryStats& out) {
+  if (!cgroupDirectory.empty() && readCgroup(cgroupDirectory, out)) {
+    return true;
+  }
+
+  size_t vPages, rPages;
+  std::ifstream statm(kStatFile);
+  statm >> vPages >> rPages; // Ignore the rest of the fields.
+  if (!statm.good()) {
+    return false;
+  }
+
+  out = MemoryStats();
+  out.usedBytes = (int64_t)rPages * getpagesize();
+  return true;
+}
+
+bool MemoryStats::readCgroup(const std::string& directory, MemoryStats& out) {
+  int64_t current;
+  std::ifstream currentFile(FileUtils::joinPaths(directory, "memory.current"));
+  currentFile >> current;
+  if (currentFile.fail()) {
+    return false;
+  }
+
+  // "max" when there's no limit.
+  std::string max;
+  std::ifstream maxFile(FileUtils::joinPaths(directory, "memory.max"));
+  maxFile >> max;
+  int64_t limit = 0;
+  if (!maxFile.fail() && max != "max") {
+    try {
+      limit = std::stoll(max);
+    } catch (const std::exception&) {
+      LOG(ERROR) << "Invalid memory.max in " << directory << ": " << max;
+    }
+  }
+
+  int64_t reclaimable = 0;
+  std::ifstream statFile(FileUtils::joinPaths(directory, "memory.stat"));
+  std::string name;
+  int64_t value;
+  while (statFile >> name >> value) {
+    if (name == "inactive_file") {
+      reclaimable = value;
+      break;
+    }
+  }
+
+  out.reclaimableBytes = std::min(reclaimable, current);
+  out.usedBytes = current - out.reclaimableBytes;
+  out.limitBytes = limit;
+  return true;
+}
+
+std::string MemoryStats::findCgroupDirectory(
+    const std::string& procCgroupFile,
+    const std::string& cgroupRoot) {
+  std::ifstream file(procCgroupFile);
+  std::string line;
+  while (std::getline(file, line)) {
+    // cgroup v1 hierarchies have a number other than 0 and controllers.
+    if (line.compare(0, 3, "0::") == 0) {
+      size_t begin = line.find_first_not_of('/', 3);
+      if (begin == std::string::npos) {
+        return cgroupRoot;
+      }
+      return FileUtils::joinPaths(cgroupRoot, line.substr(begin));
+    }
+  }
+  return "";
+}
+
+MemoryUsageGuardIf::Pressure MemoryStats::pressure(
+    int64_t usedBytes,
+    int64_t predictedBytes,
+    int64_t capBytes,
+    double evictFraction) {
+  if (capBytes <= 0) {
+    return MemoryUsageGuardIf::NONE;
+  }
+  if (usedBytes >= evictFraction * capBytes) {
+    return MemoryUsageGuardIf::EVICT_BUCKETS;
+  }
+  if (usedBytes >= capBytes) {
+    return MemoryUsageGuardIf::BLOCK_NEW_KEYS;
+  }
+  if (predictedBytes >= capBytes) {
+    return MemoryUsageGuardIf::SLOW_NEW_KEYS;
+  }
+  return MemoryUsageGuardIf::NONE;
+}
+
+MemoryGrowthEstimator::MemoryGrowthEstimator(double smoothing)
+    : smoothing_(smoothing) {}
+
+void MemoryGrowthEstimator::add(double seconds, int64_t bytes) {
+  if (!empty_ && seconds > lastSeconds_) {
+    double rate = (bytes - lastBytes_) / (seconds - lastSeconds_);
+    rate_ += smoothing_ * (rate - rate_);
+  }
+  empty_ = false;
+  lastSeconds_ = seconds;
+  lastBytes_ = bytes;
+}
+
+int64_t MemoryGrowthEstimator::predict(double seconds, int64_t extraBytes)
+    const {
+  return lastBytes_ + std::max<int64_t>(0, rate_ * seconds + extraBytes);
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "MemoryUsageGuardIf.h"
+
+namespace facebook {
+namespace gorilla {
+
+// The memory usage of the process, from its cgroup v2 when it has one
+// and from /proc/self/statm otherwise.
+struct MemoryStats {
+  // The working set: the memory of the cgroup minus the page cache it
+  // can reclaim without writing anything, or the RSS.
+  int64_t usedBytes = 0;
+
+  // memory.max of the cgroup, 0 if unlimited or not in a cgroup.
+  int64_t limitBytes = 0;
+
+  // The inactive file pages counted in memory.current of the cgroup.
+  int64_t reclaimableBytes = 0;
+
+  // Reads the stats of the cgroup in `cgroupDirectory`, or of the RSS
+  // if it's empty or can't be read. Returns false if neither can be.
+  static bool read(const std::string& cgroupDirectory, MemoryStats& out);
+
+  // Reads memory.current, memory.max and memory.stat of a cgroup v2.
+  static bool readCgroup(const std::string& directory, MemoryStats& out);
+
+  // The directory of the cgroup v2 of the process in `cgroupRoot`,
+  // from the "0::<path>" line of `procCgroupFile`. Empty if there's
+  // none.
+  static std::string findCgroupDirectory(
+      const std::string& procCgroupFile = "/proc/self/cgroup",
+      const std::string& cgroupRoot = "/sys/fs/cgroup");
+
+  // The response to `usedBytes` now and `predictedBytes` soon with a
+  // soft cap of `capBytes`. Buckets are evicted above `evictFraction`
+  // of the cap.
+  static MemoryUsageGuardIf::Pressure pressure(
+      int64_t usedBytes,
+      int64_t predictedBytes,
+      int64_t capBytes,
+      double evictFraction);
+};
+
+// Predicts the memory usage from how fast it grew recently.
+class MemoryGrowthEstimator {
+ public:
+  // `smoothing` is the weight of the newest sample in the growth rate.
+  explicit MemoryGrowthEstimator(double smoothing = 0.1);
+
+  // Adds the usage at `seconds` since any fixed point in time.
+  void add(double seconds, int64_t bytes);
+
+  // Bytes per second. Negative when the usage is going down.
+  double getGrowthRate() const {
+    return rate_;
+  }
+
+  // The usage `seconds` after the last sample plus `extraBytes`. Never
+  // less than the last sample.
+  int64_t predict(double seconds, int64_t extraBytes = 0) const;
+
+ private:
+  const double smoothing_;
+  bool empty_ = true;
+  double lastSeconds_ = 0;
+  int64_t lastBytes_ = 0;
+  double rate_ = 0;
+};
+}
+} // facebook::gorilla
@@ -9,14 +9,38 @@
 
 #pragma once
 
+#include <stdint.h>
+
 namespace facebook {
 namespace gorilla {
 class MemoryUsageGuardIf {
  public:
+  // What the server should do to use less memory, from least to most
+  // drastic. Every level includes the ones below it.
+  enum Pressure {
+    NONE = 0,
+    // The memory usage is expected to go over the cap soon. Only some
+    // of the new time series are accepted.
+    SLOW_NEW_KEYS = 1,
+    // Over the cap. No new time series are accepted.
+    BLOCK_NEW_KEYS = 2,
+    // Well over the cap. Finalized buckets are dropped from memory and
+    // read from their block files.
+    EVICT_BUCKETS = 3,
+  };
+
   MemoryUsageGuardIf() {}
   virtual ~MemoryUsageGuardIf() {}
 
   virtual bool weAreLowOnMemory() = 0;
+
+  virtual Pressure getPressure() {
+    return weAreLowOnMemory() ? BLOCK_NEW_KEYS : NONE;
+  }
+
+  // Bytes the memory usage will grow by when the next buckets are
+  // finalized, for guards that predict the usage.
+  virtual void setExpectedGrowth(int64_t /* bytes */) {}
 };
 }
 }
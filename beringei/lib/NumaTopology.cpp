@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "NumaTopology.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+
+#include "FileUtils.h"
+#include "GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kNodePrefix = "node";
+static const std::string kNumaNodeStatPrefix = "numa_node_";
+
+NumaTopology::NumaTopology(const std::string& nodeDirectory)
+    : nodeDirectory_(nodeDirectory) {
+  boost::system::error_code error;
+  boost::filesystem::directory_iterator it(nodeDirectory, error);
+  for (; !error && it != boost::filesystem::directory_iterator();
+       it.increment(error)) {
+    std::string name = it->path().filename().string();
+    std::string id = name.substr(std::min(name.size(), kNodePrefix.size()));
+    if (name.compare(0, kNodePrefix.size(), kNodePrefix) != 0 || id.empty() ||
+        !std::all_of(id.begin(), id.end(), ::isdigit)) {
+      continue;
+    }
+
+    std::ifstream file(FileUtils::joinPaths(it->path().string(), "cpulist"));
+    std::string list;
+    file >> list;
+    Node node;
+    node.id = std::stoi(id);
+    node.cpus = parseCpuList(list);
+    if (!node.cpus.empty()) {
+      nodes_.push_back(std::move(node));
+    }
+  }
+
+  std::sort(nodes_.begin(), nodes_.end(), [](const Node& a, const Node& b) {
+    return a.id < b.id;
+  });
+  if (nodes_.empty()) {
+    Node node;
+    node.id = 0;
+    nodes_.push_back(node);
+  }
+}
+
+bool NumaTopology::bindThread(pthread_t thread, int node) const {
+  const auto& cpus = getCpus(node);
+  if (cpus.empty()) {
+    return false;
+  }
+
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  for (int cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &cpuSet);
+    }
+  }
+  int ret = pthread_setaffinity_np(thread, sizeof(cpuSet), &cpuSet);
+  if (ret != 0) {
+    LOG(ERROR) << "Failed to bind a thread to NUMA node " << nodes_[node].id;
+    return false;
+  }
+  return true;
+}
+
+void NumaTopology::exportStats() const {
+  for (const auto& node : nodes_) {
+    if (node.cpus.empty()) {
+      continue;
+    }
+
+    std::ifstream file(FileUtils::joinPaths(
+        nodeDirectory_, kNodePrefix + std::to_string(node.id) + "/numastat"));
+    std::string name;
+    int64_t value;
+    std::string prefix = kNumaNodeStatPrefix + std::to_string(node.id) + ".";
+    while (file >> name >> value) {
+      if (name == "local_node" || name == "other_node" ||
+          name == "numa_miss") {
+        GorillaStatsManager::setCounter(prefix + name, value);
+      }
+    }
+  }
+}
+
+std::vector<int> NumaTopology::parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::istringstream in(list);
+  std::string range;
+  while (std::getline(in, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+
+    size_t dash = range.find('-');
+    try {
+      int first = std::stoi(range.substr(0, dash));
+      int last =
+          dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception&) {
+      LOG(ERROR) << "Invalid CPU list: " << list;
+      return {};
+    }
+  }
+  return cpus;
+}
+
+NumaTopology::ScopedBinding::ScopedBinding(
+    const NumaTopology* topology,
+    int64_t shardId) {
+  if (!topology || topology->numNodes() < 2) {
+    return;
+  }
+
+  pthread_t self = pthread_self();
+  if (pthread_getaffinity_np(self, sizeof(previous_), &previous_) == 0) {
+    bound_ = topology->bindThread(self, topology->getNode(shardId));
+  }
+}
+
+NumaTopology::ScopedBinding::~ScopedBinding() {
+  if (bound_) {
+    pthread_setaffinity_np(pthread_self(), sizeof(previous_), &previous_);
+  }
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace gorilla {
+
+// class NumaTopology
+//
+// The NUMA nodes of the host and their CPUs, read from sysfs. Shards
+// are spread over the nodes, and the threads that load or write a shard
+// are bound to the CPUs of its node, so that the pages and rows they
+// touch first are allocated on that node.
+class NumaTopology {
+ public:
+  // Reads the nodes in `nodeDirectory`. Without any, the host has one
+  // node with all the CPUs.
+  explicit NumaTopology(
+      const std::string& nodeDirectory = "/sys/devices/system/node");
+
+  int numNodes() const {
+    return nodes_.size();
+  }
+
+  // The CPUs of the node. Empty for the single node of a host without
+  // NUMA information, which means any CPU.
+  const std::vector<int>& getCpus(int node) const {
+    return nodes_[node].cpus;
+  }
+
+  // The node of the shard.
+  int getNode(int64_t shardId) const {
+    return shardId % nodes_.size();
+  }
+
+  // Binds `thread` to the CPUs of `node`. Returns false if it can't.
+  bool bindThread(pthread_t thread, int node) const;
+
+  // Sets the allocation counters of each node from its numastat.
+  void exportStats() const;
+
+  // Parses a CPU list like "0-3,8,10-11".
+  static std::vector<int> parseCpuList(const std::string& list);
+
+  // Binds the calling thread to a node, and restores its previous CPUs
+  // when destroyed. Does nothing with a null topology.
+  class ScopedBinding {
+   public:
+    ScopedBinding(const NumaTopology* topology, int64_t shardId);
+    ~ScopedBinding();
+
+   private:
+    bool bound_ = false;
+    cpu_set_t previous_;
+  };
+
+ private:
+  struct Node {
+    int id;
+    std::vector<int> cpus;
+  };
+
+  const std::string nodeDirectory_;
+  std::vector<Node> nodes_;
+};
+}
+} // facebook::gorilla
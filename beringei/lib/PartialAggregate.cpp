@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "PartialAggregate.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace facebook {
+namespace gorilla {
+
+PartialAggregate::PartialAggregate(AggregationType type) : type_(type) {}
+
+void PartialAggregate::add(const std::vector<double>& windows) {
+  for (size_t window = 0; window < windows.size(); window++) {
+    if (!std::isnan(windows[window])) {
+      combine(window, windows[window], 1);
+    }
+  }
+}
+
+void PartialAggregate::merge(
+    const std::vector<double>& values,
+    const std::vector<int64_t>& counts) {
+  size_t numSteps = std::min(values.size(), counts.size());
+  for (size_t window = 0; window < numSteps; window++) {
+    if (counts[window] > 0) {
+      combine(window, values[window], counts[window]);
+    }
+  }
+}
+
+void PartialAggregate::combine(size_t window, double value, int64_t count) {
+  if (window >= values_.size()) {
+    values_.resize(window + 1, std::numeric_limits<double>::quiet_NaN());
+    counts_.resize(window + 1, 0);
+  }
+
+  double& current = values_[window];
+  if (counts_[window] == 0) {
+    current = value;
+  } else {
+    switch (type_) {
+      case AggregationType::SUM:
+      case AggregationType::AVG:
+        current += value;
+        break;
+      case AggregationType::MIN:
+        current = std::min(current, value);
+        break;
+      case AggregationType::MAX:
+        current = std::max(current, value);
+        break;
+      case AggregationType::COUNT:
+        break;
+      case AggregationType::LAST:
+        current = value;
+        break;
+    }
+  }
+  counts_[window] += count;
+}
+
+void PartialAggregate::finish(
+    int64_t begin,
+    int64_t step,
+    std::vector<TimeValuePair>& out) const {
+  out.clear();
+  for (size_t window = 0; window < values_.size(); window++) {
+    if (counts_[window] == 0) {
+      continue;
+    }
+
+    out.emplace_back();
+    out.back().unixTime = begin + window * step;
+    if (type_ == AggregationType::AVG) {
+      out.back().value = values_[window] / counts_[window];
+    } else if (type_ == AggregationType::COUNT) {
+      out.back().value = counts_[window];
+    } else {
+      out.back().value = values_[window];
+    }
+  }
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+#include "beringei/lib/Aggregation.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class PartialAggregate
+//
+// Cross key reduction of downsampled windows that can be merged with
+// the reductions of other keys, so that each host reduces the keys it
+// owns and only the per host results are merged. Keeps the sum of the
+// values for SUM and AVG, their min for MIN, max for MAX and the last
+// value for LAST, along with the number of keys that have a value in
+// each window, which is all COUNT needs. LAST keeps the value of the
+// last key or merged result that has one.
+class PartialAggregate {
+ public:
+  explicit PartialAggregate(AggregationType type);
+
+  // Adds the windows of one key, as returned by
+  // Aggregation::downsample(). NaN values are skipped.
+  void add(const std::vector<double>& windows);
+
+  // Merges the `values()` and `counts()` of another PartialAggregate of
+  // the same type.
+  void merge(
+      const std::vector<double>& values,
+      const std::vector<int64_t>& counts);
+
+  // One point per window that has a value for at least one key, as
+  // Aggregation::reduce() would return for all the keys.
+  void finish(int64_t begin, int64_t step, std::vector<TimeValuePair>& out)
+      const;
+
+  // NaN for the windows without values.
+  const std::vector<double>& values() const {
+    return values_;
+  }
+
+  const std::vector<int64_t>& counts() const {
+    return counts_;
+  }
+
+ private:
+  void combine(size_t window, double value, int64_t count);
+
+  const AggregationType type_;
+  std::vector<double> values_;
+  std::vector<int64_t> counts_;
+};
+}
+} // facebook::gorilla
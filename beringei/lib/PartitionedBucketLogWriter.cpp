@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/lib/PartitionedBucketLogWriter.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace facebook {
+namespace gorilla {
+
+PartitionedBucketLogWriter::PartitionedBucketLogWriter(
+    int partitions,
+    int windowSize,
+    const std::string& dataDirectory,
+    size_t queueSize,
+    uint32_t allowedTimestampBehind) {
+  CHECK_GT(partitions, 0);
+  for (int i = 0; i < partitions; i++) {
+    writers_.emplace_back(new BucketLogWriter(
+        windowSize, dataDirectory, queueSize, allowedTimestampBehind, i));
+  }
+}
+
+void PartitionedBucketLogWriter::logData(
+    int64_t shardId,
+    int32_t index,
+    int64_t unixTime,
+    double value,
+    int16_t ms) {
+  writers_[partition(shardId)]->logData(shardId, index, unixTime, value, ms);
+}
+
+void PartitionedBucketLogWriter::logDataBatch(
+    int64_t shardId,
+    const std::vector<LogEntry>& entries) {
+  writers_[partition(shardId)]->logDataBatch(shardId, entries);
+}
+
+void PartitionedBucketLogWriter::startShard(int64_t shardId) {
+  writers_[partition(shardId)]->startShard(shardId);
+}
+
+void PartitionedBucketLogWriter::stopShard(int64_t shardId) {
+  writers_[partition(shardId)]->stopShard(shardId);
+}
+
+bool PartitionedBucketLogWriter::startNewLogFile(
+    int64_t shardId,
+    int64_t unixTime) {
+  return writers_[partition(shardId)]->startNewLogFile(shardId, unixTime);
+}
+
+double PartitionedBucketLogWriter::getQueueFill() const {
+  double fill = 0;
+  for (auto& writer : writers_) {
+    fill = std::max(fill, writer->getQueueFill());
+  }
+  return fill;
+}
+
+void PartitionedBucketLogWriter::flushQueue() {
+  for (auto& writer : writers_) {
+    writer->flushQueue();
+  }
+}
+}
+} // facebook::gorilla
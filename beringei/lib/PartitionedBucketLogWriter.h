@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "beringei/lib/BucketLogWriter.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class PartitionedBucketLogWriter
+//
+// Spreads the shards over a fixed number of BucketLogWriters, each with
+// its own queue and writer thread. A shard always goes to the same
+// partition, so its log entries stay in order and a slow flush only
+// stalls the shards of one partition.
+class PartitionedBucketLogWriter : public BucketLogWriterIf {
+ public:
+  PartitionedBucketLogWriter(
+      int partitions,
+      int windowSize,
+      const std::string& dataDirectory,
+      size_t queueSize,
+      uint32_t allowedTimestampBehind);
+
+  /// @see BucketLogWriterIf.
+  void logData(
+      int64_t shardId,
+      int32_t index,
+      int64_t unixTime,
+      double value,
+      int16_t ms = 0) override;
+
+  /// @see BucketLogWriterIf.
+  void logDataBatch(int64_t shardId, const std::vector<LogEntry>& entries)
+      override;
+
+  /// @see BucketLogWriterIf.
+  void startShard(int64_t shardId) override;
+
+  /// @see BucketLogWriterIf.
+  void stopShard(int64_t shardId) override;
+
+  /// @see BucketLogWriterIf.
+  bool startNewLogFile(int64_t shardId, int64_t unixTime) override;
+
+  /// @see BucketLogWriterIf.
+  double getQueueFill() const override;
+
+  /// Flush the queues of all the partitions.
+  void flushQueue();
+
+  int partitions() const {
+    return writers_.size();
+  }
+
+  /// Returns the partition that writes the logs of the shard.
+  int partition(int64_t shardId) const {
+    return shardId % writers_.size();
+  }
+
+ private:
+  std::vector<std::unique_ptr<BucketLogWriter>> writers_;
+};
+}
+} // facebook::gorilla
@@ -9,13 +9,31 @@
 
 #include "PersistentKeyList.h"
 
+#include <sys/mman.h>
+#include <algorithm>
+#include <limits>
+
 #include <folly/compression/Compression.h>
 #include <folly/io/IOBuf.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <zdict.h>
+#include <zstd.h>
 
 #include "GorillaStatsManager.h"
 
+DEFINE_bool(
+    binary_key_lists,
+    false,
+    "Write compacted key lists in the binary format, which is mapped and "
+    "read without inflating it. Older builds can't read these files.");
+DEFINE_bool(
+    key_list_dictionary_compression,
+    false,
+    "Compress compacted key lists with zstd and a dictionary trained on "
+    "the keys of the shard, which is stored in the file. Smaller and faster "
+    "to read back than zlib. Older builds can't read these files.");
+
 namespace facebook {
 namespace gorilla {
 
@@ -28,8 +46,9 @@ const static size_t kSmallBufferSize = 1 << 12;
 const static int kTempFileId = 0;
 const int KRetryFileOpen = 3;
 
-const static std::string kFileType = "key_list";
-const static std::string kFailedCounter = "failed_writes." + kFileType;
+const std::string PersistentKeyList::kFilePrefix = "key_list";
+const static std::string kFailedCounter =
+    "failed_writes." + PersistentKeyList::kFilePrefix;
 
 // Marker bytes to determine if the file is compressed or not and if
 // there are categories or not.
@@ -39,6 +58,22 @@ const static char kCompressedFileWithCategoriesMarker = '0';
 const static char kUncompressedFileWithCategoriesMarker = '1';
 const static char kCompressedFileWithTimestampsMarker = '2';
 const static char kUncompressedFileWithTimestampsMarker = '3';
+const static char kBinaryFileMarker = 'B';
+
+// Followed by the length of the dictionary, the dictionary and a zstd
+// frame compressed with it of the records that
+// kCompressedFileWithTimestampsMarker files have. Without a dictionary
+// if its length is 0.
+const static char kDictionaryFileMarker = 'D';
+
+// zstd suggests dictionaries of about 100KB, trained on about a hundred
+// times as much data.
+const static size_t kDictionarySize = 1 << 17;
+const static size_t kMaxDictionarySampleBytes = 100 * kDictionarySize;
+const static int kDictionaryCompressionLevel = 9;
+
+// Keeps the binary header and records 4-byte aligned.
+const static char kBinaryFilePadding[3] = {0, 0, 0};
 
 const static uint32_t kHardFlushIntervalSecs = 120;
 
@@ -46,7 +81,7 @@ PersistentKeyList::PersistentKeyList(
     int64_t shardId,
     const std::string& dataDirectory)
     : activeList_({nullptr, ""}),
-      files_(shardId, kFileType, dataDirectory),
+      files_(shardId, kFilePrefix, dataDirectory),
       lock_(),
       shard_(shardId) {
   GorillaStatsManager::addStatExportType(kFailedCounter, SUM);
@@ -58,92 +93,253 @@ PersistentKeyList::PersistentKeyList(
   openNext();
 }
 
+// Trains a dictionary on a sample of the records in `data`, whose sizes
+// are `recordSizes`, and appends it and `data` compressed with it to
+// `out`. Throws on failure.
+static void compressWithDictionary(
+    const folly::fbstring& data,
+    const std::vector<uint32_t>& recordSizes,
+    std::string& out) {
+  std::string samples;
+  std::vector<size_t> sampleSizes;
+  size_t stride =
+      std::max<size_t>(1, data.length() / kMaxDictionarySampleBytes + 1);
+  size_t offset = 0;
+  for (size_t i = 0; i < recordSizes.size(); offset += recordSizes[i++]) {
+    if (i % stride == 0) {
+      samples.append(data.data() + offset, recordSizes[i]);
+      sampleSizes.push_back(recordSizes[i]);
+    }
+  }
+
+  std::string dictionary(kDictionarySize, '\0');
+  size_t dictionaryLength = ZDICT_trainFromBuffer(
+      &dictionary[0],
+      dictionary.size(),
+      samples.data(),
+      sampleSizes.data(),
+      sampleSizes.size());
+  if (ZDICT_isError(dictionaryLength)) {
+    // E.g. too few keys to train on.
+    LOG(WARNING) << "Compressing the key list without a dictionary: "
+                 << ZDICT_getErrorName(dictionaryLength);
+    dictionaryLength = 0;
+  }
+  dictionary.resize(dictionaryLength);
+
+  uint32_t length = dictionary.size();
+  out.append((const char*)&length, sizeof(length));
+  out.append(dictionary);
+
+  size_t frameOffset = out.size();
+  size_t bound = ZSTD_compressBound(data.length());
+  out.resize(frameOffset + bound);
+  std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(
+      ZSTD_createCCtx(), ZSTD_freeCCtx);
+  size_t compressed = ZSTD_compress_usingDict(
+      context.get(),
+      &out[frameOffset],
+      bound,
+      data.data(),
+      data.length(),
+      dictionary.data(),
+      dictionary.size(),
+      kDictionaryCompressionLevel);
+  if (ZSTD_isError(compressed)) {
+    throw std::runtime_error(ZSTD_getErrorName(compressed));
+  }
+  out.resize(frameOffset + compressed);
+}
+
+// Reverses compressWithDictionary(). Throws on failure.
+static std::unique_ptr<folly::IOBuf> uncompressWithDictionary(
+    const char* data,
+    size_t length) {
+  uint32_t dictionaryLength;
+  if (length < sizeof(dictionaryLength)) {
+    throw std::runtime_error("Truncated key list");
+  }
+  memcpy(&dictionaryLength, data, sizeof(dictionaryLength));
+  data += sizeof(dictionaryLength);
+  length -= sizeof(dictionaryLength);
+  if (dictionaryLength > length) {
+    throw std::runtime_error("Truncated key list dictionary");
+  }
+  const char* dictionary = data;
+  data += dictionaryLength;
+  length -= dictionaryLength;
+
+  unsigned long long size = ZSTD_getFrameContentSize(data, length);
+  if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+    throw std::runtime_error("Invalid key list frame");
+  }
+
+  auto out = folly::IOBuf::create(size);
+  std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> context(
+      ZSTD_createDCtx(), ZSTD_freeDCtx);
+  size_t uncompressed = ZSTD_decompress_usingDict(
+      context.get(),
+      out->writableData(),
+      size,
+      data,
+      length,
+      dictionary,
+      dictionaryLength);
+  if (ZSTD_isError(uncompressed)) {
+    throw std::runtime_error(ZSTD_getErrorName(uncompressed));
+  }
+  out->append(uncompressed);
+  return out;
+}
+
+static bool writeWithDictionary(
+    FileUtils::File& file,
+    const folly::fbstring& buffer,
+    const std::vector<uint32_t>& recordSizes) {
+  std::string compressed;
+  try {
+    compressWithDictionary(buffer, recordSizes, compressed);
+  } catch (std::exception& e) {
+    LOG(ERROR) << "Compression failed:" << e.what();
+    return false;
+  }
+
+  if (fwrite(&kDictionaryFileMarker, sizeof(char), 1, file.file) != 1 ||
+      fwrite(compressed.data(), sizeof(char), compressed.size(), file.file) !=
+          compressed.size()) {
+    PLOG(ERROR) << "Could not write to the temporary key file " << file.name;
+    return false;
+  }
+
+  LOG(INFO) << "Compressed key list with a dictionary from "
+            << buffer.length() << " bytes to " << compressed.size();
+  return true;
+}
+
 int PersistentKeyList::readKeys(
     int64_t shardId,
     const std::string& dataDirectory,
     std::function<bool(uint32_t, const char*, uint16_t, int32_t)> f) {
+  return readKeysInline(shardId, dataDirectory, f);
+}
+
+FileUtils PersistentKeyList::keyFiles(
+    int64_t shardId,
+    const std::string& dataDirectory) {
   LOG(INFO) << "Reading keys from shard " << shardId;
+  return FileUtils(shardId, kFilePrefix, dataDirectory);
+}
 
-  FileUtils files(shardId, kFileType, dataDirectory);
+bool PersistentKeyList::readKeyFile(
+    FileUtils& files,
+    int64_t fileId,
+    KeyFile& keyFile) {
+  // Ignore leftover files from a failed call to compact().
+  if (fileId == kTempFileId) {
+    return false;
+  }
 
-  // Read all the keys from all the relevant files.
-  std::vector<int64_t> ids = files.ls();
-  int keys = 0;
-  for (int64_t fileId : ids) {
-    // Ignore leftover files from a failed call to compact().
-    if (fileId == kTempFileId) {
-      continue;
-    }
+  auto file = files.open(fileId, "rb", 0);
+  if (!file.file) {
+    LOG(ERROR) << "Opening file failed: " << file.name;
+    return false;
+  }
+  keyFile.name = file.name;
 
-    auto file = files.open(fileId, "rb", 0);
-    if (!file.file) {
-      LOG(ERROR) << "Opening file failed: " << file.name;
-      continue;
-    }
+  // Read the entire file.
+  fseek(file.file, 0, SEEK_END);
+  size_t len = ftell(file.file);
 
-    // Read the entire file.
-    fseek(file.file, 0, SEEK_END);
-    size_t len = ftell(file.file);
+  if (len <= 1) {
+    fclose(file.file);
+    return false;
+  }
 
-    if (len <= 1) {
-      fclose(file.file);
-      continue;
-    }
+  char marker;
+  fseek(file.file, 0, SEEK_SET);
+  if (fread(&marker, 1, 1, file.file) != 1) {
+    PLOG(ERROR) << "Failed to read " << file.name;
+    fclose(file.file);
+    return false;
+  }
 
-    std::unique_ptr<char[]> buffer(new char[len]);
-    fseek(file.file, 0, SEEK_SET);
-    if (fread(buffer.get(), 1, len, file.file) != len) {
-      PLOG(ERROR) << "Failed to read " << file.name;
-      fclose(file.file);
-      continue;
+  if (marker == kBinaryFileMarker) {
+    void* addr =
+        mmap(nullptr, len, PROT_READ, MAP_SHARED, fileno(file.file), 0);
+    fclose(file.file);
+    if (addr == MAP_FAILED) {
+      PLOG(ERROR) << "Mapping key list file " << keyFile.name << " failed";
+      return false;
     }
 
-    int keysFound = 0;
-    if (buffer[0] == kCompressedFileMarker ||
-        buffer[0] == kCompressedFileWithCategoriesMarker ||
-        buffer[0] == kCompressedFileWithTimestampsMarker) {
-      try {
-        auto codec = folly::io::getCodec(
-            folly::io::CodecType::ZLIB, folly::io::COMPRESSION_LEVEL_BEST);
-        auto ioBuffer = folly::IOBuf::wrapBuffer(buffer.get() + 1, len - 1);
-        auto uncompressed = codec->uncompress(ioBuffer.get());
-
-        // It's a chained buffer. This will make it a single buffer.
-        uncompressed->coalesce();
-        keysFound = readKeysFromBuffer(
-            (const char*)uncompressed->data(),
-            uncompressed->length(),
-            buffer[0] != kCompressedFileMarker,
-            buffer[0] == kCompressedFileWithTimestampsMarker,
-            f);
-      } catch (std::exception& e) {
-        LOG(ERROR) << "Uncompression failed: " << e.what();
-      }
-    } else if (
-        buffer[0] == kUncompressedFileMarker ||
-        buffer[0] == kUncompressedFileWithCategoriesMarker ||
-        buffer[0] == kUncompressedFileWithTimestampsMarker) {
-      keysFound = readKeysFromBuffer(
-          buffer.get() + 1,
-          len - 1,
-          buffer[0] != kUncompressedFileMarker,
-          buffer[0] == kUncompressedFileWithTimestampsMarker,
-          f);
-    } else {
-      LOG(ERROR) << "Unknown marker byte " << buffer[0];
+    madvise(addr, len, MADV_SEQUENTIAL);
+    keyFile.mapping.reset((char*)addr, [len](char* p) { munmap(p, len); });
+    keyFile.data = keyFile.mapping.get() + 1;
+    keyFile.length = len - 1;
+    keyFile.binary = true;
+    return true;
+  }
+
+  keyFile.raw.reset(new char[len]);
+  fseek(file.file, 0, SEEK_SET);
+  if (fread(keyFile.raw.get(), 1, len, file.file) != len) {
+    PLOG(ERROR) << "Failed to read " << file.name;
+    fclose(file.file);
+    return false;
+  }
+  fclose(file.file);
+
+  if (marker == kDictionaryFileMarker) {
+    try {
+      keyFile.uncompressed =
+          uncompressWithDictionary(keyFile.raw.get() + 1, len - 1);
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Uncompression failed: " << e.what();
+      keyFile.length = 0;
+      return true;
     }
 
-    if (keysFound == 0) {
-      LOG(ERROR) << file.name << " contains no valid data";
+    keyFile.data = (const char*)keyFile.uncompressed->data();
+    keyFile.length = keyFile.uncompressed->length();
+    keyFile.raw.reset();
+    keyFile.categoryPresent = true;
+    keyFile.timestampPresent = true;
+  } else if (
+      marker == kCompressedFileMarker ||
+      marker == kCompressedFileWithCategoriesMarker ||
+      marker == kCompressedFileWithTimestampsMarker) {
+    try {
+      auto codec = folly::io::getCodec(
+          folly::io::CodecType::ZLIB, folly::io::COMPRESSION_LEVEL_BEST);
+      auto ioBuffer = folly::IOBuf::wrapBuffer(keyFile.raw.get() + 1, len - 1);
+      keyFile.uncompressed = codec->uncompress(ioBuffer.get());
+
+      // It's a chained buffer. This will make it a single buffer.
+      keyFile.uncompressed->coalesce();
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Uncompression failed: " << e.what();
+      keyFile.length = 0;
+      return true;
     }
-    keys += keysFound;
 
-    fclose(file.file);
+    keyFile.data = (const char*)keyFile.uncompressed->data();
+    keyFile.length = keyFile.uncompressed->length();
+    keyFile.raw.reset();
+    keyFile.categoryPresent = marker != kCompressedFileMarker;
+    keyFile.timestampPresent = marker == kCompressedFileWithTimestampsMarker;
+  } else if (
+      marker == kUncompressedFileMarker ||
+      marker == kUncompressedFileWithCategoriesMarker ||
+      marker == kUncompressedFileWithTimestampsMarker) {
+    keyFile.data = keyFile.raw.get() + 1;
+    keyFile.length = len - 1;
+    keyFile.categoryPresent = marker != kUncompressedFileMarker;
+    keyFile.timestampPresent = marker == kUncompressedFileWithTimestampsMarker;
+  } else {
+    LOG(ERROR) << "Unknown marker byte " << marker;
+    keyFile.length = 0;
   }
-
-  LOG(INFO) << "Read " << keys << " keys from " << ids.size()
-            << " files for shard " << shardId;
-  return keys;
+  return true;
 }
 
 bool PersistentKeyList::appendKey(
@@ -160,6 +356,34 @@ bool PersistentKeyList::appendKey(
   return true;
 }
 
+bool PersistentKeyList::deleteKey(uint32_t id) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (activeList_.file == nullptr) {
+    return false;
+  }
+
+  writeKey(kDeletedKeyId, "", 0, id);
+  return true;
+}
+
+bool PersistentKeyList::appendKeys(const std::vector<KeyEntry>& keys) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (activeList_.file == nullptr) {
+    return false;
+  }
+
+  for (const auto& entry : keys) {
+    if (entry.key) {
+      appendBuffer(
+          buffer_, entry.id, entry.key, entry.category, entry.timestamp);
+    } else {
+      appendBuffer(buffer_, kDeletedKeyId, "", 0, entry.id);
+    }
+  }
+  flushIfNeeded();
+  return true;
+}
+
 void PersistentKeyList::compact(
     std::function<std::tuple<uint32_t, const char*, uint16_t, int32_t>()>
         generator) {
@@ -175,14 +399,35 @@ void PersistentKeyList::compact(
     return;
   }
 
+  if (FLAGS_binary_key_lists) {
+    int keys = writeBinary(tempFile, generator);
+    fclose(tempFile.file);
+    if (keys < 0) {
+      GorillaStatsManager::addStatValue(kFailedCounter, 1);
+      return;
+    }
+    if (keys == 0) {
+      return;
+    }
+
+    files_.rename(kTempFileId, prev);
+    files_.clearTo(prev);
+    return;
+  }
+
   folly::fbstring buffer;
+  std::vector<uint32_t> recordSizes;
   for (auto key = generator(); std::get<1>(key) != nullptr; key = generator()) {
+    size_t offset = buffer.length();
     appendBuffer(
         buffer,
         std::get<0>(key),
         std::get<1>(key),
         std::get<2>(key),
         std::get<3>(key));
+    if (FLAGS_key_list_dictionary_compression) {
+      recordSizes.push_back(buffer.length() - offset);
+    }
   }
 
   if (buffer.length() == 0) {
@@ -190,6 +435,19 @@ void PersistentKeyList::compact(
     return;
   }
 
+  if (FLAGS_key_list_dictionary_compression) {
+    if (!writeWithDictionary(tempFile, buffer, recordSizes)) {
+      GorillaStatsManager::addStatValue(kFailedCounter, 1);
+      fclose(tempFile.file);
+      return;
+    }
+
+    fclose(tempFile.file);
+    files_.rename(kTempFileId, prev);
+    files_.clearTo(prev);
+    return;
+  }
+
   try {
     auto ioBuffer = folly::IOBuf::wrapBuffer(buffer.data(), buffer.length());
     auto codec = folly::io::getCodec(
@@ -230,6 +488,65 @@ void PersistentKeyList::compact(
   files_.clearTo(prev);
 }
 
+int PersistentKeyList::writeBinary(
+    FileUtils::File& file,
+    std::function<std::tuple<uint32_t, const char*, uint16_t, int32_t>()>&
+        generator) {
+  std::vector<BinaryRecord> records;
+  std::string strings;
+  std::string previous;
+  for (auto key = generator(); std::get<1>(key) != nullptr; key = generator()) {
+    const char* name = std::get<1>(key);
+    size_t length = strlen(name);
+    if (length > std::numeric_limits<uint16_t>::max()) {
+      LOG(ERROR) << "Not writing a key of " << length << " bytes";
+      continue;
+    }
+
+    size_t prefixLength = 0;
+    size_t maxPrefix = std::min(length, previous.size());
+    while (prefixLength < maxPrefix &&
+           name[prefixLength] == previous[prefixLength]) {
+      prefixLength++;
+    }
+
+    BinaryRecord record{};
+    record.id = std::get<0>(key);
+    record.timestamp = std::get<3>(key);
+    record.category = std::get<2>(key);
+    record.prefixLength = prefixLength;
+    record.suffixLength = length - prefixLength;
+    records.push_back(record);
+    strings.append(name + prefixLength, record.suffixLength);
+
+    // The key is only valid until the next call to the generator.
+    previous.assign(name, length);
+  }
+
+  if (records.empty()) {
+    return 0;
+  }
+
+  BinaryHeader header;
+  header.count = records.size();
+  header.stringTableLength = strings.size();
+
+  size_t recordsLength = records.size() * sizeof(BinaryRecord);
+  if (fwrite(&kBinaryFileMarker, sizeof(char), 1, file.file) != 1 ||
+      fwrite(kBinaryFilePadding, 1, sizeof(kBinaryFilePadding), file.file) !=
+          sizeof(kBinaryFilePadding) ||
+      fwrite(&header, sizeof(BinaryHeader), 1, file.file) != 1 ||
+      fwrite(records.data(), 1, recordsLength, file.file) != recordsLength ||
+      fwrite(strings.data(), 1, strings.size(), file.file) != strings.size()) {
+    PLOG(ERROR) << "Could not write to the temporary key file " << file.name;
+    return -1;
+  }
+
+  LOG(INFO) << "Wrote binary key list with " << records.size() << " keys and "
+            << strings.size() << " bytes of strings";
+  return records.size();
+}
+
 void PersistentKeyList::flush(bool hardFlush) {
   if (activeList_.file == nullptr) {
     openNext();
@@ -325,7 +642,10 @@ void PersistentKeyList::writeKey(
     int32_t timestamp) {
   // Write to the internal buffer and only flush when needed.
   appendBuffer(buffer_, id, key, category, timestamp);
+  flushIfNeeded();
+}
 
+void PersistentKeyList::flushIfNeeded() {
   bool flushHard = time(nullptr) > nextHardFlushTimeSecs_;
   if (flushHard) {
     nextHardFlushTimeSecs_ = time(nullptr) + kHardFlushIntervalSecs;
@@ -335,66 +655,5 @@ void PersistentKeyList::writeKey(
     flush(flushHard);
   }
 }
-
-int PersistentKeyList::readKeysFromBuffer(
-    const char* buffer,
-    size_t len,
-    bool categoryPresent,
-    bool timestampPresent,
-    std::function<bool(uint32_t, const char*, uint16_t, int32_t)> f) {
-  // Back up until the buffer ends with a zero byte.
-  // This should come from the last byte in a string, but it could be a byte
-  // in an id.
-  while (buffer[len - 1] != '\0') {
-    len--;
-    if (len == 0) {
-      return 0;
-    }
-  }
-
-  int keys = 0;
-
-  size_t minRecordLength = sizeof(uint32_t) + 1;
-  if (categoryPresent) {
-    minRecordLength += sizeof(uint16_t);
-  }
-  if (timestampPresent) {
-    minRecordLength += sizeof(uint32_t);
-  }
-
-  // Read the records one-by-one until too few bytes remain.
-  // A minimum record is an uint32 (+uint16) (+uint32) and a zero-length string.
-  const char* pos = buffer;
-  const char* endPos = pos + len - minRecordLength;
-  uint16_t defaultCategory = 0;
-  int32_t defaultTimestamp = 0;
-  while (pos <= endPos) {
-    uint32_t* id;
-    const char* key;
-    uint16_t* category = &defaultCategory;
-    int32_t* timestamp = &defaultTimestamp;
-
-    id = (uint32_t*)pos;
-    pos += sizeof(uint32_t);
-    if (categoryPresent) {
-      category = (uint16_t*)pos;
-      pos += sizeof(uint16_t);
-    }
-    if (timestampPresent) {
-      timestamp = (int32_t*)pos;
-      pos += sizeof(int32_t);
-    }
-    key = pos;
-
-    if (!f(*id, key, *category, *timestamp)) {
-      // Callback doesn't accept more keys.
-      break;
-    }
-    keys++;
-    pos += strlen(key) + 1;
-  }
-
-  return keys;
-}
 }
 } // facebook:gorilla
@@ -9,13 +9,19 @@
 
 #pragma once
 
+#include <string.h>
 #include <cstdio>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <vector>
 
 #include "FileUtils.h"
 
 #include <folly/FBString.h>
+#include <folly/io/IOBuf.h>
+#include <glog/logging.h>
 
 namespace facebook {
 namespace gorilla {
@@ -27,6 +33,8 @@ namespace gorilla {
 // of the file itself.
 class PersistentKeyList {
  public:
+  static const std::string kFilePrefix;
+
   explicit PersistentKeyList(int64_t shardId, const std::string& dataDirectory);
   ~PersistentKeyList() {
     if (activeList_.file != nullptr) {
@@ -35,13 +43,23 @@ class PersistentKeyList {
     }
   }
 
-  // Call f on each key in the list.
+  // Call f on each key in the list. Deletions written with
+  // deleteKey() are passed with a nullptr key.
   // The callback should return false if reading should be stopped.
   static int readKeys(
       int64_t shardId,
       const std::string& dataDirectory,
       std::function<bool(uint32_t, const char*, uint16_t, int32_t)> f);
 
+  // Same as readKeys but calls `f` directly instead of through a
+  // std::function, so that it can be inlined into the loop over the
+  // keys.
+  template <typename F>
+  static int readKeysInline(
+      int64_t shardId,
+      const std::string& dataDirectory,
+      F&& f);
+
   // Must not be called until after a call to readKeys().
   // Returns false on failure.
   bool appendKey(
@@ -50,8 +68,31 @@ class PersistentKeyList {
       uint16_t category,
       int32_t firstTimestamp);
 
+  // Records that the key with `id` was deleted, so it isn't read back
+  // before the next compaction. Must not be called until after a call
+  // to readKeys(). Returns false on failure.
+  bool deleteKey(uint32_t id);
+
+  // A key to append, or a deletion if `key` is nullptr.
+  struct KeyEntry {
+    uint32_t id;
+    const char* key;
+    uint16_t category;
+    int32_t timestamp;
+  };
+
+  // Appends all the keys and deletions in order, taking the lock and
+  // checking whether to flush only once. Returns false on failure, in
+  // which case nothing was appended.
+  bool appendKeys(const std::vector<KeyEntry>& keys);
+
   // Rewrite and compress the file to contain only the generated
-  // entries. Continues generating until receiving a nullptr key.
+  // entries. Continues generating until receiving a nullptr key. With
+  // --binary_key_lists the file is written in the binary format
+  // instead, which is mapped into memory and read without inflating
+  // it or scanning for the end of every key. With
+  // --key_list_dictionary_compression it's compressed with zstd and a
+  // dictionary trained on its keys instead of zlib.
   // This function should only be called by a single thread at a time,
   // but concurrent calls to appendKey() are safe.
   void compact(
@@ -86,12 +127,75 @@ class PersistentKeyList {
   void
   writeKey(uint32_t id, const char* key, uint16_t category, int32_t timestamp);
 
+  // Flushes the internal buffer if it's big enough or enough time has
+  // passed since the last flush time.
+  void flushIfNeeded();
+
+  // Writes the generated entries to `file` in the binary format.
+  // Returns the number of entries, or -1 if writing failed. Nothing is
+  // written if there are no entries.
+  int writeBinary(
+      FileUtils::File& file,
+      std::function<std::tuple<uint32_t, const char*, uint16_t, int32_t>()>&
+          generator);
+
+  // Header of a binary key list file. It follows the marker byte and
+  // three bytes of padding and is followed by `count` records and the
+  // string table. Each key is stored as the length of the prefix it
+  // shares with the previous key and the remaining suffix, which is
+  // `suffixLength` bytes of the string table.
+  struct BinaryHeader {
+    uint32_t count;
+    uint32_t stringTableLength;
+  };
+
+  struct BinaryRecord {
+    uint32_t id;
+    int32_t timestamp;
+    uint16_t category;
+    uint16_t prefixLength;
+    uint16_t suffixLength;
+    uint16_t unused;
+  };
+
+  // Contents of one key list file.
+  struct KeyFile {
+    std::string name;
+    std::unique_ptr<char[]> raw;
+    std::unique_ptr<folly::IOBuf> uncompressed;
+
+    // Binary files are mapped instead of read.
+    std::shared_ptr<char> mapping;
+    const char* data = nullptr;
+    size_t length = 0;
+    bool binary = false;
+    bool categoryPresent = false;
+    bool timestampPresent = false;
+  };
+
+  static FileUtils keyFiles(int64_t shardId, const std::string& dataDirectory);
+
+  // Reads and uncompresses a key list file. Returns false if the file
+  // should be skipped. Leaves `length` zero if the contents are not
+  // valid.
+  static bool readKeyFile(FileUtils& files, int64_t fileId, KeyFile& keyFile);
+
+  template <typename F>
   static int readKeysFromBuffer(
       const char* buffer,
       size_t len,
       bool categoryPresent,
       bool timestampPresent,
-      std::function<bool(uint32_t, const char*, uint16_t, int32_t)> f);
+      F&& f);
+
+  // Reads the records of a binary key list file, starting after the
+  // marker byte.
+  template <typename F>
+  static int readBinaryKeys(const char* buffer, size_t len, F&& f);
+
+  // A deletion is written as a record with this id and the id of the
+  // deleted key in the timestamp field.
+  static const uint32_t kDeletedKeyId = std::numeric_limits<uint32_t>::max();
 
   FileUtils::File activeList_;
 
@@ -102,5 +206,160 @@ class PersistentKeyList {
   folly::fbstring buffer_;
   uint32_t nextHardFlushTimeSecs_;
 };
+
+template <typename F>
+int PersistentKeyList::readKeysInline(
+    int64_t shardId,
+    const std::string& dataDirectory,
+    F&& f) {
+  FileUtils files = keyFiles(shardId, dataDirectory);
+
+  // Read all the keys from all the relevant files.
+  std::vector<int64_t> ids = files.ls();
+  int keys = 0;
+  for (int64_t fileId : ids) {
+    KeyFile keyFile;
+    if (!readKeyFile(files, fileId, keyFile)) {
+      continue;
+    }
+
+    int keysFound = 0;
+    if (keyFile.binary) {
+      keysFound = readBinaryKeys(keyFile.data, keyFile.length, f);
+    } else if (keyFile.length > 0) {
+      keysFound = readKeysFromBuffer(
+          keyFile.data,
+          keyFile.length,
+          keyFile.categoryPresent,
+          keyFile.timestampPresent,
+          f);
+    }
+
+    if (keysFound == 0) {
+      LOG(ERROR) << keyFile.name << " contains no valid data";
+    }
+    keys += keysFound;
+  }
+
+  LOG(INFO) << "Read " << keys << " keys from " << ids.size()
+            << " files for shard " << shardId;
+  return keys;
+}
+
+template <typename F>
+int PersistentKeyList::readKeysFromBuffer(
+    const char* buffer,
+    size_t len,
+    bool categoryPresent,
+    bool timestampPresent,
+    F&& f) {
+  // Back up until the buffer ends with a zero byte.
+  // This should come from the last byte in a string, but it could be a byte
+  // in an id.
+  while (buffer[len - 1] != '\0') {
+    len--;
+    if (len == 0) {
+      return 0;
+    }
+  }
+
+  int keys = 0;
+
+  size_t minRecordLength = sizeof(uint32_t) + 1;
+  if (categoryPresent) {
+    minRecordLength += sizeof(uint16_t);
+  }
+  if (timestampPresent) {
+    minRecordLength += sizeof(uint32_t);
+  }
+
+  // Read the records one-by-one until too few bytes remain.
+  // A minimum record is an uint32 (+uint16) (+uint32) and a zero-length string.
+  const char* pos = buffer;
+  const char* endPos = pos + len - minRecordLength;
+  uint16_t defaultCategory = 0;
+  int32_t defaultTimestamp = 0;
+  while (pos <= endPos) {
+    uint32_t* id;
+    const char* key;
+    uint16_t* category = &defaultCategory;
+    int32_t* timestamp = &defaultTimestamp;
+
+    id = (uint32_t*)pos;
+    pos += sizeof(uint32_t);
+    if (categoryPresent) {
+      category = (uint16_t*)pos;
+      pos += sizeof(uint16_t);
+    }
+    if (timestampPresent) {
+      timestamp = (int32_t*)pos;
+      pos += sizeof(int32_t);
+    }
+    key = pos;
+
+    if (*id == kDeletedKeyId && timestampPresent) {
+      key = nullptr;
+      id = (uint32_t*)timestamp;
+      category = &defaultCategory;
+      timestamp = &defaultTimestamp;
+    }
+
+    if (!f(*id, key, *category, *timestamp)) {
+      // Callback doesn't accept more keys.
+      break;
+    }
+    keys++;
+    pos += strlen(pos) + 1;
+  }
+
+  return keys;
+}
+
+template <typename F>
+int PersistentKeyList::readBinaryKeys(const char* buffer, size_t len, F&& f) {
+  // Skip the padding after the marker byte.
+  const size_t kPadding = 3;
+  if (len < kPadding + sizeof(BinaryHeader)) {
+    return 0;
+  }
+
+  BinaryHeader header;
+  memcpy(&header, buffer + kPadding, sizeof(BinaryHeader));
+  const char* records = buffer + kPadding + sizeof(BinaryHeader);
+  const char* end = buffer + len;
+  size_t recordsLength = (size_t)header.count * sizeof(BinaryRecord);
+  if ((size_t)(end - records) < recordsLength ||
+      (size_t)(end - records) - recordsLength != header.stringTableLength) {
+    LOG(ERROR) << "Binary key list with " << header.count << " keys and "
+               << header.stringTableLength << " bytes of strings is " << len
+               << " bytes long";
+    return 0;
+  }
+
+  const char* strings = records + recordsLength;
+  std::string key;
+  int keys = 0;
+  for (uint32_t i = 0; i < header.count; i++) {
+    BinaryRecord record;
+    memcpy(&record, records + i * sizeof(BinaryRecord), sizeof(BinaryRecord));
+    if (record.prefixLength > key.size() ||
+        end - strings < record.suffixLength) {
+      LOG(ERROR) << "Corrupt binary key list record " << i;
+      break;
+    }
+
+    key.resize(record.prefixLength);
+    key.append(strings, record.suffixLength);
+    strings += record.suffixLength;
+
+    if (!f(record.id, key.c_str(), record.category, record.timestamp)) {
+      // Callback doesn't accept more keys.
+      break;
+    }
+    keys++;
+  }
+
+  return keys;
+}
 }
 } // facebook:gorilla
@@ -0,0 +1,294 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "RollupStorage.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "DataBlockReader.h"
+#include "FileUtils.h"
+#include "GorillaStatsManager.h"
+#include "TimeSeriesStream.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kRollupBlocksWritten = "rollup_blocks_written";
+static const std::string kRollupStoreFailures = "rollup_store_failures";
+
+// The min, max, sum and count streams.
+static const int kStreams = 4;
+
+RollupStorage::RollupStorage(
+    int64_t resolution,
+    uint8_t numBuckets,
+    int shardId,
+    const std::string& dataDirectory)
+    : resolution_(resolution),
+      shardId_(shardId),
+      dataDirectory_(
+          dataDirectory.empty()
+              ? dataDirectory
+              : FileUtils::joinPaths(
+                    dataDirectory, "rollup_" + std::to_string(resolution))),
+      storage_(numBuckets, shardId, dataDirectory_),
+      newestPosition_(0),
+      oldestPosition_(0) {
+  GorillaStatsManager::addStatExportType(kRollupBlocksWritten, SUM);
+  GorillaStatsManager::addStatExportType(kRollupStoreFailures, SUM);
+}
+
+void RollupStorage::add(
+    uint32_t id,
+    uint32_t position,
+    const std::vector<TimeValuePair>& points) {
+  if (points.empty()) {
+    return;
+  }
+
+  std::vector<Window> windows;
+  summarize(points, resolution_, windows);
+  std::string data;
+  encode(windows, data);
+
+  auto storageId = storage_.store(
+      position, data.data(), data.size(), windows.size(), id);
+  if (storageId == BucketStorage::kInvalidId) {
+    // Also the case for positions that were already read from disk.
+    GorillaStatsManager::addStatValue(kRollupStoreFailures);
+    return;
+  }
+  GorillaStatsManager::addStatValue(kRollupBlocksWritten);
+
+  setDataBlock(id, position, storageId);
+}
+
+void RollupStorage::setDataBlock(
+    uint32_t id,
+    uint32_t position,
+    BucketStorage::BucketStorageId storageId) {
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  if (position > newestPosition_) {
+    newestPosition_ = position;
+  }
+  if (oldestPosition_ == 0 || position < oldestPosition_) {
+    oldestPosition_ = position;
+  }
+
+  if (id >= series_.size()) {
+    series_.resize(id + 1);
+  }
+  if (!series_[id]) {
+    series_[id].reset(new BucketedTimeSeries());
+    series_[id]->reset(numBuckets(), 0, 0);
+  }
+  series_[id]->setDataBlock(position, &storage_, storageId);
+}
+
+uint32_t RollupStorage::getOldestPosition() {
+  uint32_t newest = newestPosition_;
+  if (newest >= numBuckets()) {
+    return std::max<uint32_t>(oldestPosition_, newest - numBuckets() + 1);
+  }
+  return oldestPosition_;
+}
+
+void RollupStorage::finalizeBucket(uint32_t position) {
+  storage_.finalizeBucket(position);
+}
+
+void RollupStorage::get(
+    uint32_t id,
+    uint32_t begin,
+    uint32_t end,
+    std::vector<Window>& out) {
+  BucketedTimeSeries::Output blocks;
+  {
+    folly::RWSpinLock::ReadHolder guard(lock_);
+    if (id >= series_.size() || !series_[id]) {
+      return;
+    }
+    series_[id]->get(begin, end, blocks, &storage_);
+  }
+
+  for (const auto& block : blocks) {
+    if (block.count > 0 && !decode(block.data, block.count, out)) {
+      LOG(ERROR) << "Invalid rollup block of time series " << id
+                 << " in shard " << shardId_;
+    }
+  }
+}
+
+void RollupStorage::erase(uint32_t id) {
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  if (id < series_.size()) {
+    series_[id].reset();
+  }
+}
+
+int RollupStorage::readBlockFiles() {
+  if (dataDirectory_.empty()) {
+    return 0;
+  }
+
+  DataBlockReader reader(shardId_, dataDirectory_);
+  auto positions = reader.findCompletedBlockFiles();
+
+  // Newest first, so that the older positions that don't fit in the
+  // storage anymore are the ones skipped.
+  int read = 0;
+  for (auto it = positions.rbegin();
+       it != positions.rend() && read < numBuckets();
+       ++it) {
+    std::vector<uint32_t> timeSeriesIds;
+    std::vector<uint64_t> storageIds;
+    if (!storage_.loadPosition(*it, timeSeriesIds, storageIds)) {
+      continue;
+    }
+
+    read++;
+    for (int i = 0; i < timeSeriesIds.size(); i++) {
+      setDataBlock(timeSeriesIds[i], *it, storageIds[i]);
+    }
+  }
+  return read;
+}
+
+void RollupStorage::deleteOldBlockFiles(uint32_t position) {
+  if (position > numBuckets() + 1) {
+    storage_.deleteBucketsOlderThan(position - numBuckets() - 1);
+  }
+}
+
+void RollupStorage::enable() {
+  storage_.enable();
+}
+
+void RollupStorage::clearAndDisable() {
+  storage_.clearAndDisable();
+  folly::RWSpinLock::WriteHolder guard(lock_);
+  newestPosition_ = 0;
+  oldestPosition_ = 0;
+  std::vector<std::unique_ptr<BucketedTimeSeries>>().swap(series_);
+}
+
+void RollupStorage::summarize(
+    const std::vector<TimeValuePair>& points,
+    int64_t resolution,
+    std::vector<Window>& out) {
+  for (const auto& point : points) {
+    int64_t unixTime = point.unixTime - point.unixTime % resolution;
+    if (out.empty() || out.back().unixTime != unixTime) {
+      out.push_back(emptyWindow(unixTime));
+    }
+
+    Window& window = out.back();
+    window.min = std::fmin(window.min, point.value);
+    window.max = std::fmax(window.max, point.value);
+    window.sum += point.value;
+    window.count++;
+  }
+}
+
+void RollupStorage::merge(const Window& from, Window& to) {
+  to.min = std::fmin(to.min, from.min);
+  to.max = std::fmax(to.max, from.max);
+  to.sum += from.sum;
+  to.count += from.count;
+}
+
+double RollupStorage::value(const Window& window, AggregationType type) {
+  if (type == AggregationType::COUNT) {
+    return window.count;
+  }
+  if (window.count == 0) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+
+  switch (type) {
+    case AggregationType::SUM:
+      return window.sum;
+    case AggregationType::MIN:
+      return window.min;
+    case AggregationType::MAX:
+      return window.max;
+    case AggregationType::AVG:
+      return window.sum / window.count;
+    default:
+      return std::numeric_limits<double>::quiet_NaN();
+  }
+}
+
+RollupStorage::Window RollupStorage::emptyWindow(int64_t unixTime) {
+  // fmin and fmax skip the NaNs, so the first value replaces them.
+  return Window{unixTime,
+                std::numeric_limits<double>::quiet_NaN(),
+                std::numeric_limits<double>::quiet_NaN(),
+                0,
+                0};
+}
+
+void RollupStorage::encode(
+    const std::vector<Window>& windows,
+    std::string& out) {
+  out.clear();
+  for (int i = 0; i < kStreams; i++) {
+    TimeSeriesStream stream;
+    for (const auto& window : windows) {
+      double values[kStreams] = {
+          window.min, window.max, window.sum, window.count};
+      stream.append(window.unixTime, values[i], 0);
+    }
+
+    uint32_t size = stream.size();
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.append(stream.getDataPtr(), size);
+  }
+}
+
+bool RollupStorage::decode(
+    folly::StringPiece data,
+    uint32_t count,
+    std::vector<Window>& out) {
+  std::vector<int64_t> timestamps(count);
+  std::vector<double> values[kStreams];
+  for (int i = 0; i < kStreams; i++) {
+    uint32_t size;
+    if (data.size() < sizeof(size)) {
+      return false;
+    }
+    memcpy(&size, data.data(), sizeof(size));
+    data.advance(sizeof(size));
+    if (data.size() < size) {
+      return false;
+    }
+
+    values[i].resize(count);
+    int read = TimeSeriesStream::readValues(
+        timestamps.data(),
+        values[i].data(),
+        folly::StringPiece(data.data(), size),
+        count);
+    if (read != count) {
+      return false;
+    }
+    data.advance(size);
+  }
+
+  for (int i = 0; i < count; i++) {
+    out.push_back(
+        Window{timestamps[i], values[0][i], values[1][i], values[2][i],
+               values[3][i]});
+  }
+  return true;
+}
+}
+} // facebook::gorilla
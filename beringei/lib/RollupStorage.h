@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+#include <folly/synchronization/RWSpinLock.h>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+#include "beringei/lib/Aggregation.h"
+#include "beringei/lib/BucketStorage.h"
+#include "beringei/lib/BucketedTimeSeries.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class RollupStorage
+//
+// Downsampled copies of the finalized buckets of one shard. The points
+// of every time series in a bucket are summarized into windows of
+// `resolution` seconds that hold their min, max, sum and count. The
+// summaries are in a BucketStorage of their own, with their own block
+// files and number of buckets, so they can be kept for longer than the
+// raw data.
+//
+// The windows are aligned to multiples of `resolution` since the
+// epoch, which must divide the bucket size.
+class RollupStorage {
+ public:
+  struct Window {
+    int64_t unixTime;
+    double min;
+    double max;
+    double sum;
+    double count;
+  };
+
+  // The block files are in `dataDirectory`/rollup_<resolution>.
+  RollupStorage(
+      int64_t resolution,
+      uint8_t numBuckets,
+      int shardId,
+      const std::string& dataDirectory);
+
+  int64_t getResolution() const {
+    return resolution_;
+  }
+
+  uint8_t numBuckets() {
+    return storage_.numBuckets();
+  }
+
+  // Newest position that was added or read from disk, 0 if none.
+  uint32_t getNewestPosition() const {
+    return newestPosition_;
+  }
+
+  // Oldest position that is still kept, 0 if none.
+  uint32_t getOldestPosition();
+
+  // Summarizes the points of time series `id` in bucket `position`.
+  // The points must be sorted by time.
+  void add(
+      uint32_t id,
+      uint32_t position,
+      const std::vector<TimeValuePair>& points);
+
+  // Writes the summaries of `position` to disk. No more can be added
+  // for it afterwards.
+  void finalizeBucket(uint32_t position);
+
+  // Appends the windows of time series `id` in the positions between
+  // begin and end inclusive.
+  void get(
+      uint32_t id,
+      uint32_t begin,
+      uint32_t end,
+      std::vector<Window>& out);
+
+  // Forgets the summaries of time series `id`, whose row is about to
+  // be reused by another key.
+  void erase(uint32_t id);
+
+  // Reads the newest block files from disk. Returns the number of
+  // positions read.
+  int readBlockFiles();
+
+  // Deletes the block files that are out of the retention when
+  // `position` is the current one.
+  void deleteOldBlockFiles(uint32_t position);
+
+  void enable();
+  void clearAndDisable();
+
+  // Summarizes sorted points into windows of `resolution` seconds.
+  static void summarize(
+      const std::vector<TimeValuePair>& points,
+      int64_t resolution,
+      std::vector<Window>& out);
+
+  // Adds the points summarized by `from` to `to`.
+  static void merge(const Window& from, Window& to);
+
+  // The result of aggregating the points of `window` with `type`. NaN
+  // for empty windows, except for COUNT, and for LAST, which can't be
+  // computed from a summary.
+  static double value(const Window& window, AggregationType type);
+
+  // An empty window at `unixTime`.
+  static Window emptyWindow(int64_t unixTime);
+
+  // The block format: the streams of the min, max, sum and count
+  // values, each preceded by its size as a 32 bit integer.
+  static void encode(const std::vector<Window>& windows, std::string& out);
+  static bool decode(
+      folly::StringPiece data,
+      uint32_t count,
+      std::vector<Window>& out);
+
+ private:
+  void setDataBlock(
+      uint32_t id,
+      uint32_t position,
+      BucketStorage::BucketStorageId storageId);
+
+  const int64_t resolution_;
+  const int shardId_;
+  const std::string dataDirectory_;
+  BucketStorage storage_;
+  std::atomic<uint32_t> newestPosition_;
+  std::atomic<uint32_t> oldestPosition_;
+
+  // Keeps the storage ids of the summaries of each time series.
+  // Indexed by the id of the time series in the BucketMap.
+  folly::RWSpinLock lock_;
+  std::vector<std::unique_ptr<BucketedTimeSeries>> series_;
+};
+}
+} // facebook::gorilla
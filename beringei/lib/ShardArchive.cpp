@@ -0,0 +1,186 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "ShardArchive.h"
+
+#include <stdio.h>
+
+#include <folly/lang/Bits.h>
+#include "glog/logging.h"
+
+#include "BucketSnapshot.h"
+#include "ShardTransfer.h"
+
+namespace facebook {
+namespace gorilla {
+
+// Identifies shard archives and their version.
+static const uint64_t kMagic = 0x4245524152433031ULL;
+
+const int64_t ShardArchive::kChunkSize = 1 << 20;
+
+template <class T>
+static bool writeInt(FILE* f, T value) {
+  value = folly::Endian::little(value);
+  return fwrite(&value, sizeof(value), 1, f) == 1;
+}
+
+template <class T>
+static bool readInt(FILE* f, T& value) {
+  if (fread(&value, sizeof(value), 1, f) != 1) {
+    return false;
+  }
+  value = folly::Endian::little(value);
+  return true;
+}
+
+static bool writeString(FILE* f, const std::string& data) {
+  return writeInt<uint32_t>(f, data.size()) &&
+      fwrite(data.data(), sizeof(char), data.size(), f) == data.size();
+}
+
+static bool readString(FILE* f, std::string& data, uint32_t maxSize) {
+  uint32_t size;
+  if (!readInt(f, size) || size > maxSize) {
+    return false;
+  }
+  data.resize(size);
+  return size == 0 || fread(&data[0], sizeof(char), size, f) == size;
+}
+
+bool ShardArchive::dump(
+    int64_t shardId,
+    const std::string& dataDirectory,
+    const std::string& archivePath,
+    bool includeLogs) {
+  ShardTransfer transfer(shardId, dataDirectory);
+  auto files = transfer.listFiles(includeLogs ? 0 : INT64_MAX);
+  if (files.empty()) {
+    LOG(ERROR) << "Shard " << shardId << " has no files to dump";
+    return false;
+  }
+
+  std::string tmpPath = archivePath + ".tmp";
+  FILE* f = fopen(tmpPath.c_str(), "wb");
+  if (!f) {
+    PLOG(ERROR) << "Can't open " << tmpPath;
+    return false;
+  }
+
+  int count = 0;
+  bool success = writeInt(f, kMagic) && writeInt(f, shardId);
+  for (const auto& file : files) {
+    if (!success) {
+      break;
+    }
+    if (!includeLogs && file.prefix == BucketSnapshot::kSnapshotPrefix) {
+      continue;
+    }
+
+    success = writeString(f, file.prefix) && writeInt(f, file.id);
+    int64_t offset = 0;
+    bool endOfFile = false;
+    std::string data;
+    while (success && !endOfFile) {
+      success = transfer.readFile(file, offset, kChunkSize, data, endOfFile);
+      if (success && !data.empty()) {
+        success = writeString(f, data);
+        offset += data.size();
+      }
+    }
+
+    // An empty chunk ends the file.
+    success = success && writeString(f, "");
+    count++;
+  }
+
+  // An empty prefix ends the archive.
+  success = success && writeString(f, "");
+  if (fclose(f) != 0) {
+    success = false;
+  }
+
+  if (!success || rename(tmpPath.c_str(), archivePath.c_str()) != 0) {
+    PLOG(ERROR) << "Dumping shard " << shardId << " to " << archivePath
+                << " failed";
+    remove(tmpPath.c_str());
+    return false;
+  }
+
+  LOG(INFO) << "Dumped " << count << " files of shard " << shardId;
+  return true;
+}
+
+bool ShardArchive::restore(
+    const std::string& archivePath,
+    const std::string& dataDirectory,
+    int64_t& shardId) {
+  FILE* f = fopen(archivePath.c_str(), "rb");
+  if (!f) {
+    PLOG(ERROR) << "Can't open " << archivePath;
+    return false;
+  }
+
+  uint64_t magic;
+  if (!readInt(f, magic) || magic != kMagic || !readInt(f, shardId)) {
+    LOG(ERROR) << archivePath << " is not a shard archive";
+    fclose(f);
+    return false;
+  }
+
+  ShardTransfer transfer(shardId, dataDirectory);
+  transfer.clear();
+
+  std::vector<ShardTransfer::File> files;
+  bool success = true;
+  while (true) {
+    ShardTransfer::File file;
+    if (!readString(f, file.prefix, kChunkSize)) {
+      success = false;
+      break;
+    }
+    if (file.prefix.empty()) {
+      break;
+    }
+    if (!readInt(f, file.id)) {
+      success = false;
+      break;
+    }
+
+    // Empty files are created too.
+    int64_t offset = 0;
+    std::string data;
+    success = transfer.writeFile(file, 0, "");
+    while (success) {
+      success = readString(f, data, kChunkSize);
+      if (!success || data.empty()) {
+        break;
+      }
+      success = transfer.writeFile(file, offset, data);
+      offset += data.size();
+    }
+    if (!success) {
+      break;
+    }
+    files.push_back(file);
+  }
+  fclose(f);
+
+  if (!success) {
+    LOG(ERROR) << "Restoring shard " << shardId << " from " << archivePath
+               << " failed";
+    transfer.clear();
+    return false;
+  }
+
+  transfer.install(files);
+  return true;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace facebook {
+namespace gorilla {
+
+// class ShardArchive
+//
+// Writes the files of a shard into a single archive and restores them
+// into another data directory, so that a shard can be moved or seeded
+// without a host to copy it from. The archive holds the key list and
+// the block files of the finalized buckets, and optionally the snapshot
+// of the open bucket and the logs written after it. Restored shards
+// load their finalized buckets straight from the block files.
+//
+// The archive starts with a magic number and the shard id, followed by
+// the files, each as its prefix and id and its data in chunks. All the
+// integers are little endian.
+class ShardArchive {
+ public:
+  // Writes the archive under a temporary name and renames it to
+  // `archivePath` once it's complete. Returns false on failure.
+  static bool dump(
+      int64_t shardId,
+      const std::string& dataDirectory,
+      const std::string& archivePath,
+      bool includeLogs);
+
+  // Replaces the files of the shard of the archive in `dataDirectory`
+  // with the ones in the archive and sets `shardId` to the shard.
+  // Nothing is replaced if the archive can't be read.
+  static bool restore(
+      const std::string& archivePath,
+      const std::string& dataDirectory,
+      int64_t& shardId);
+
+  // Bytes of data in each chunk.
+  static const int64_t kChunkSize;
+};
+}
+} // facebook::gorilla
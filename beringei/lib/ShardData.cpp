@@ -9,9 +9,28 @@
 
 #include "ShardData.h"
 
+#include <algorithm>
+
 #include <folly/container/Enumerate.h>
 #include "beringei/lib/GorillaStatsManager.h"
 #include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/Timer.h"
+
+DEFINE_int32(
+    shard_load_concurrency,
+    0,
+    "How many shards can read keys, logs or block files at the same time. "
+    "0 allows one per add shard thread.");
+DEFINE_int32(
+    shard_load_put_latency_us,
+    0,
+    "Load fewer shards at a time while the 99th percentile of put "
+    "latencies is above this. 0 disables it.");
+DEFINE_bool(
+    numa_shards,
+    false,
+    "Spread the shards over the NUMA nodes of the host and bind the threads "
+    "that load a shard to the CPUs of its node");
 
 namespace facebook {
 namespace gorilla {
@@ -21,6 +40,23 @@ const static std::string kMsPerShardAdd = "ms_per_shard_add";
 const static std::string kShardsAdded = "shards_added";
 const static std::string kShardsBeingAdded = "shards_being_added";
 const static std::string kShardsDropped = "shards_dropped";
+const static std::string kShardLoadLimit = "shard_load_limit";
+const static std::string kMsWaitingForShardLoadSlot =
+    "ms_waiting_for_shard_load_slot";
+const static std::string kShardsInStatePrefix = "shards_in_state_";
+
+// Indexed by BucketMap::State.
+const static std::vector<std::string> kStateNames = {
+    "pre_unowned",
+    "unowned",
+    "pre_owned",
+    "reading_keys",
+    "reading_keys_done",
+    "reading_logs",
+    "processing_queued_data_points",
+    "reading_block_data",
+    "owned",
+};
 
 const int ShardData::kAsyncDropShardsDelaySecs = 30;
 
@@ -32,21 +68,42 @@ ShardData::ShardData(int totalShards, int threads)
       numShardsBeingAdded_(0),
       addShardQueue_(totalShards),
       readBlocksShardQueue_(totalShards),
-      dropShardQueue_(totalShards) {
+      requestedBlocksShardQueue_(totalShards),
+      dropShardQueue_(totalShards),
+      activeLoads_(0),
+      maxLoads_(
+          FLAGS_shard_load_concurrency > 0
+              ? std::min(FLAGS_shard_load_concurrency, threads)
+              : threads),
+      nextPutLatency_(0) {
   // The number of threads for each thread pool must exceed 0.
   CHECK_GT(threads, 0);
 
+  if (FLAGS_numa_shards) {
+    numa_.reset(new NumaTopology());
+    LOG(INFO) << "Spreading the shards over " << numa_->numNodes()
+              << " NUMA nodes";
+  }
+
+  loadLimit_ = maxLoads_;
+  for (auto& latency : putLatencies_) {
+    latency = 0;
+  }
+
   for (int i = 0; i < threads; i++) {
     addShardThreads_.push_back(std::thread(&ShardData::addShardThread, this));
   }
   dropShardThread_ = std::thread(&ShardData::dropShardThread, this);
 
   GorillaStatsManager::addStatExportType(kMsPerShardAdd, AVG);
+  GorillaStatsManager::addPercentileExports(kMsPerShardAdd, kGorillaMsPerHour);
   GorillaStatsManager::addStatExportType(kShardsAdded, SUM);
   GorillaStatsManager::addStatExportType(kShardsDropped, SUM);
+  GorillaStatsManager::addStatExportType(kMsWaitingForShardLoadSlot, AVG);
 
   GorillaStatsManager::setCounter(kNumShards, 0);
   GorillaStatsManager::setCounter(kShardsBeingAdded, 0);
+  GorillaStatsManager::setCounter(kShardLoadLimit, loadLimit_);
 }
 
 ShardData::~ShardData() {
@@ -65,6 +122,9 @@ void ShardData::initialize(int64_t shard, std::unique_ptr<BucketMap> map) {
   CHECK_EQ(data_.size(), shard);
   CHECK_LT(shard, totalShards_);
   data_.emplace_back(std::move(map));
+  if (data_.size() == totalShards_) {
+    exportShardStates();
+  }
 }
 
 void ShardData::setShards(const std::set<int64_t>& shards, int dropDelay) {
@@ -132,6 +192,9 @@ void ShardData::processOneShardAddition(int64_t shardId) {
   if (map) {
     BucketMap::State state = map->getState();
     if (state == BucketMap::PRE_OWNED) {
+      if (shardTransferCallback_) {
+        shardTransferCallback_(shardId);
+      }
       map->readKeyList();
 
       // Put this shard back in the queue to read data.
@@ -143,8 +206,7 @@ void ShardData::processOneShardAddition(int64_t shardId) {
       GorillaStatsManager::setCounter(kShardsBeingAdded, numShardsBeingAdded_);
       GorillaStatsManager::setCounter(kNumShards, numShards_);
       GorillaStatsManager::addStatValue(kShardsAdded);
-      GorillaStatsManager::addStatValue(
-          kMsPerShardAdd, map->getAddTime() / kGorillaUsecPerMs);
+      GorillaStatsManager::addStatValue(kMsPerShardAdd, map->getAddTime());
 
       // Enqueue to read the compressed block files.
       readBlocksShardQueue_.write(shardId);
@@ -176,6 +238,114 @@ ShardData::BeringeiShardState ShardData::addShardAsync(int64_t shardId) {
   return BeringeiShardState::ERROR;
 }
 
+void ShardData::setShardTransferCallback(
+    std::function<void(int64_t)> callback) {
+  shardTransferCallback_ = std::move(callback);
+}
+
+int ShardData::requestBlockFiles(
+    int64_t shardId,
+    uint32_t begin,
+    uint32_t end) {
+  auto map = getShardMap(shardId);
+  if (!map) {
+    return 0;
+  }
+
+  int unread = map->requestBlockFiles(begin, end);
+  if (unread > 0) {
+    // The queue might already have the shard, in which case it's fine
+    // that it is full.
+    requestedBlocksShardQueue_.write(shardId);
+  }
+  return unread;
+}
+
+void ShardData::reportPutLatency(int64_t us) {
+  putLatencies_[nextPutLatency_++ % kPutLatencySamples] = us;
+}
+
+int ShardData::getShardLoadLimit() {
+  std::lock_guard<std::mutex> guard(loadSlotsMutex_);
+  return loadLimit_;
+}
+
+void ShardData::acquireLoadSlot() {
+  Timer timer(true);
+  std::unique_lock<std::mutex> lock(loadSlotsMutex_);
+  loadSlotsCondition_.wait(lock, [&]() { return activeLoads_ < loadLimit_; });
+  activeLoads_++;
+  lock.unlock();
+
+  GorillaStatsManager::addStatValue(
+      kMsWaitingForShardLoadSlot, timer.get() / kGorillaUsecPerMs);
+}
+
+void ShardData::releaseLoadSlot() {
+  {
+    std::lock_guard<std::mutex> guard(loadSlotsMutex_);
+    activeLoads_--;
+    adjustLoadLimit();
+  }
+
+  // The limit might have grown by one, and another thread may be
+  // waiting for a slot.
+  loadSlotsCondition_.notify_one();
+  exportShardStates();
+}
+
+void ShardData::adjustLoadLimit() {
+  if (FLAGS_shard_load_put_latency_us <= 0) {
+    return;
+  }
+
+  // Back off quickly when the loads slow down the puts and try more
+  // slowly to load more again.
+  int limit = getPutLatencyP99() > FLAGS_shard_load_put_latency_us
+      ? std::max(1, loadLimit_ / 2)
+      : std::min(maxLoads_, loadLimit_ + 1);
+  if (limit != loadLimit_) {
+    LOG(INFO) << "Loading up to " << limit << " shards at a time";
+    loadLimit_ = limit;
+    GorillaStatsManager::setCounter(kShardLoadLimit, loadLimit_);
+  }
+}
+
+int64_t ShardData::getPutLatencyP99() {
+  int samples = std::min<uint32_t>(nextPutLatency_, kPutLatencySamples);
+  if (samples == 0) {
+    return 0;
+  }
+
+  std::vector<int64_t> latencies;
+  latencies.reserve(samples);
+  for (int i = 0; i < samples; i++) {
+    latencies.push_back(putLatencies_[i]);
+  }
+
+  auto p99 = latencies.begin() + samples * 99 / 100;
+  std::nth_element(latencies.begin(), p99, latencies.end());
+  return *p99;
+}
+
+void ShardData::exportNumaStats() {
+  if (numa_) {
+    numa_->exportStats();
+  }
+}
+
+void ShardData::exportShardStates() {
+  std::vector<int> counts(kStateNames.size(), 0);
+  for (auto& map : data_) {
+    counts[map->getState()]++;
+  }
+
+  for (int i = 0; i < counts.size(); i++) {
+    GorillaStatsManager::setCounter(
+        kShardsInStatePrefix + kStateNames[i], counts[i]);
+  }
+}
+
 ShardData::BeringeiShardState ShardData::dropShardAsync(
     int64_t shardId,
     int64_t delay) {
@@ -215,27 +385,49 @@ void ShardData::addShardThread() {
     try {
       int64_t shardId;
 
-      // Prioritize addShardQueue_ over readBlocksShardQueue_.
+      // Prioritize addShardQueue_ over the block files that queries are
+      // waiting for, and those over readBlocksShardQueue_.
       // It's ok to do the blocking read on addShardQueue_ because these are the
-      // only threads that insert into readBlocksShardQueue_.
-      if (addShardQueue_.read(shardId)) {
-        processOneShardAddition(shardId);
-      } else if (readBlocksShardQueue_.read(shardId)) {
-        auto map = getShardMap(shardId);
-        if (map && map->readBlockFiles()) {
-          // Put this shard back in the queue to read more block files.
-          // This way, all shards are read starting from now and working back.
-          readBlocksShardQueue_.write(shardId);
+      // only threads that insert into readBlocksShardQueue_, and block
+      // files are only requested while their shard is in it.
+      //
+      // Every step holds one of the load slots while it runs, so only
+      // as many shards are read at once as the puts can take.
+      folly::MPMCQueue<int64_t>* queue = &addShardQueue_;
+      if (!addShardQueue_.read(shardId)) {
+        if (requestedBlocksShardQueue_.read(shardId)) {
+          queue = &requestedBlocksShardQueue_;
+        } else if (readBlocksShardQueue_.read(shardId)) {
+          queue = &readBlocksShardQueue_;
+        } else {
+          addShardQueue_.blockingRead(shardId);
         }
-
-      } else {
-        addShardQueue_.blockingRead(shardId);
-        processOneShardAddition(shardId);
       }
 
       if (shardId == kStopThreadShardId) {
         break;
       }
+
+      acquireLoadSlot();
+      try {
+        NumaTopology::ScopedBinding binding(numa_.get(), shardId);
+        auto map = getShardMap(shardId);
+        if (queue == &addShardQueue_) {
+          processOneShardAddition(shardId);
+        } else if (queue == &requestedBlocksShardQueue_) {
+          if (map && map->readRequestedBlockFiles()) {
+            requestedBlocksShardQueue_.write(shardId);
+          }
+        } else if (map && map->readBlockFiles()) {
+          // Put this shard back in the queue to read more block files.
+          // This way, all shards are read starting from now and working back.
+          readBlocksShardQueue_.write(shardId);
+        }
+      } catch (...) {
+        releaseLoadSlot();
+        throw;
+      }
+      releaseLoadSlot();
     } catch (std::exception& e) {
       LOG(ERROR) << e.what();
     }
@@ -268,6 +460,7 @@ void ShardData::dropShardThread() {
             numShards_--;
             GorillaStatsManager::setCounter(kNumShards, numShards_);
             GorillaStatsManager::addStatValue(kShardsDropped);
+            exportShardStates();
           }
         }
       }
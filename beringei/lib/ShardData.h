@@ -9,7 +9,14 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
 #include "beringei/lib/BucketMap.h"
+#include "beringei/lib/NumaTopology.h"
 
 namespace facebook {
 namespace gorilla {
@@ -46,6 +53,17 @@ class ShardData {
 
   BeringeiShardState addShardAsync(int64_t shardId);
 
+  // Called with the id of every shard that is being added, before any
+  // of its files are read, so that they can be copied from the previous
+  // owner first. Must be set before any shards are added.
+  void setShardTransferCallback(std::function<void(int64_t)> callback);
+
+  // Reads the block files of the buckets between `begin` and `end` of
+  // the shard before the block files of the shards that haven't been
+  // queried. Returns the number of those block files that haven't been
+  // read yet.
+  int requestBlockFiles(int64_t shardId, uint32_t begin, uint32_t end);
+
   // Drops a single shard asynchronously. Delay is the seconds to wait
   // before actually dropping the shard.
   BeringeiShardState dropShardAsync(int64_t shardId, int64_t delay);
@@ -64,6 +82,25 @@ class ShardData {
   int64_t getNumShardsOwnedInProgress();
   int64_t getTotalNumShards();
 
+  // Records how long a put took, in microseconds. With
+  // --shard_load_put_latency_us, fewer shards are loaded at a time
+  // while puts are slow.
+  void reportPutLatency(int64_t us);
+
+  // Returns how many shards may read keys, logs or block files at the
+  // same time.
+  int getShardLoadLimit();
+
+  // The NUMA nodes that the shards are spread over with --numa_shards,
+  // or nullptr.
+  const NumaTopology* getNumaTopology() const {
+    return numa_.get();
+  }
+
+  // Exports the allocation counters of the NUMA nodes with
+  // --numa_shards.
+  void exportNumaStats();
+
   // Synchronously add and drop shards by spinning until the corresponding
   // async methods succeed.
   void addShardForTests(int64_t shardId);
@@ -76,18 +113,55 @@ class ShardData {
   void addShardThread();
   void dropShardThread();
 
+  // Waits until fewer than the limit of shards are being loaded and
+  // takes one of the slots.
+  void acquireLoadSlot();
+
+  // Gives the slot back and adjusts the limit. `loadSlotsMutex_` must
+  // not be held.
+  void releaseLoadSlot();
+
+  // Halves the limit if the puts are too slow and grows it by one
+  // otherwise. `loadSlotsMutex_` must be held.
+  void adjustLoadLimit();
+
+  // Returns the 99th percentile of the recent put latencies.
+  int64_t getPutLatencyP99();
+
+  // Exports the number of shards in each state.
+  void exportShardStates();
+
   std::vector<std::unique_ptr<BucketMap>> data_;
 
+  // The threads that load a shard are bound to its node while they do,
+  // so that its rows and pages are allocated there.
+  std::unique_ptr<NumaTopology> numa_;
+  std::function<void(int64_t)> shardTransferCallback_;
+
   const int64_t totalShards_;
   std::atomic<int> numShards_;
   std::atomic<int> numShardsBeingAdded_;
 
   folly::MPMCQueue<int64_t> addShardQueue_;
   folly::MPMCQueue<int64_t> readBlocksShardQueue_;
+
+  // Shards with block files that queries are waiting for.
+  folly::MPMCQueue<int64_t> requestedBlocksShardQueue_;
   std::vector<std::thread> addShardThreads_;
 
   folly::MPMCQueue<std::pair<uint32_t, int64_t>> dropShardQueue_;
   std::thread dropShardThread_;
+
+  std::mutex loadSlotsMutex_;
+  std::condition_variable loadSlotsCondition_;
+  int activeLoads_;
+  int loadLimit_;
+  const int maxLoads_;
+
+  // Ring of the latest put latencies.
+  static constexpr int kPutLatencySamples = 1024;
+  std::array<std::atomic<int64_t>, kPutLatencySamples> putLatencies_;
+  std::atomic<uint32_t> nextPutLatency_;
 };
 }
 } // facebook::gorilla
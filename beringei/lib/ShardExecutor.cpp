@@ -0,0 +1,101 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "ShardExecutor.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <condition_variable>
+#include <mutex>
+
+#include "GorillaStatsManager.h"
+
+#include "glog/logging.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kShardTasks = "shard_executor_tasks";
+
+ShardExecutor::ShardExecutor(
+    int threads,
+    size_t queueSize,
+    int firstCpu,
+    const NumaTopology* numa) {
+  CHECK_GT(threads, 0);
+  GorillaStatsManager::addStatExportType(kShardTasks, SUM);
+  int cpus = std::thread::hardware_concurrency();
+  for (int i = 0; i < threads; i++) {
+    threads_.emplace_back(new Thread(queueSize));
+    Thread* thread = threads_.back().get();
+    thread->thread.reset(new std::thread([thread]() {
+      while (true) {
+        std::function<void()> fn;
+        thread->inbox.blockingRead(fn);
+        if (!fn) {
+          break;
+        }
+        fn();
+      }
+    }));
+
+    if (firstCpu >= 0 && cpus > 0) {
+      cpu_set_t cpuSet;
+      CPU_ZERO(&cpuSet);
+      CPU_SET((firstCpu + i) % cpus, &cpuSet);
+      int ret = pthread_setaffinity_np(
+          thread->thread->native_handle(), sizeof(cpuSet), &cpuSet);
+      if (ret != 0) {
+        LOG(ERROR) << "Failed to pin shard executor thread " << i
+                   << " to CPU " << (firstCpu + i) % cpus;
+      }
+    } else if (
+        numa && numa->numNodes() > 1 && threads % numa->numNodes() == 0) {
+      // Thread i owns the shards whose node is i % numNodes.
+      numa->bindThread(thread->thread->native_handle(), i % numa->numNodes());
+    }
+  }
+}
+
+ShardExecutor::~ShardExecutor() {
+  for (auto& thread : threads_) {
+    thread->inbox.blockingWrite(std::function<void()>());
+  }
+  for (auto& thread : threads_) {
+    thread->thread->join();
+  }
+}
+
+void ShardExecutor::run(
+    const std::vector<int64_t>& shardIds,
+    const std::function<void(size_t)>& fn) {
+  if (shardIds.empty()) {
+    return;
+  }
+
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t left = shardIds.size();
+  for (size_t i = 0; i < shardIds.size(); i++) {
+    threads_[thread(shardIds[i])]->inbox.blockingWrite([&, i]() {
+      fn(i);
+      std::lock_guard<std::mutex> guard(mutex);
+      if (--left == 0) {
+        done.notify_one();
+      }
+    });
+  }
+  GorillaStatsManager::addStatValue(kShardTasks, shardIds.size());
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&]() { return left == 0; });
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,73 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <folly/MPMCQueue.h>
+
+#include "beringei/lib/NumaTopology.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class ShardExecutor
+//
+// Runs the work of each shard on the one thread that owns it, so that
+// the rows, the storage and the writer queues of a shard stay in the
+// caches of one core instead of moving between all the request
+// threads. Each thread has its own inbox and a shard always goes to the
+// same thread, picked like the partitions of the log writers, so with
+// the same number of threads a shard is handled by threads with the
+// same index everywhere.
+class ShardExecutor {
+ public:
+  // Pins thread i to CPU `firstCpu + i` when `firstCpu` isn't negative.
+  // Otherwise, with `numa` and a multiple of its nodes of threads, binds
+  // each thread to the node of the shards it owns.
+  ShardExecutor(
+      int threads,
+      size_t queueSize,
+      int firstCpu = -1,
+      const NumaTopology* numa = nullptr);
+  ~ShardExecutor();
+
+  int threads() const {
+    return threads_.size();
+  }
+
+  // Returns the thread that owns the shard.
+  int thread(int64_t shardId) const {
+    return shardId % threads_.size();
+  }
+
+  // Calls `fn(i)` on the thread of `shardIds[i]` for every i and waits
+  // for all the calls to return. Calls for the same thread run in
+  // order. Must not be called from one of the threads.
+  void run(
+      const std::vector<int64_t>& shardIds,
+      const std::function<void(size_t)>& fn);
+
+ private:
+  struct Thread {
+    explicit Thread(size_t queueSize) : inbox(queueSize) {}
+
+    // An empty function stops the thread.
+    folly::MPMCQueue<std::function<void()>> inbox;
+    std::unique_ptr<std::thread> thread;
+  };
+
+  std::vector<std::unique_ptr<Thread>> threads_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,293 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/lib/ShardReplicator.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <glog/logging.h>
+
+#include "beringei/lib/GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kReplicationKeysSent = "replication_keys_sent";
+static const std::string kReplicationPointsSent = "replication_points_sent";
+static const std::string kReplicationPointsDropped =
+    "replication_points_dropped";
+static const std::string kReplicationSendFailures =
+    "replication_send_failures";
+static const std::string kReplicationRejectedShards =
+    "replication_rejected_shards";
+
+const size_t ShardReplicator::kMaxPointsPerBatch = 65536;
+
+ShardReplicator::ShardReplicator(
+    int numShards,
+    size_t maxQueuedPoints,
+    Sender sender)
+    : numShards_(numShards),
+      maxQueuedPoints_(maxQueuedPoints),
+      sender_(std::move(sender)),
+      shards_(new Shard[numShards]) {
+  GorillaStatsManager::addStatExportType(kReplicationKeysSent, SUM);
+  GorillaStatsManager::addStatExportType(kReplicationPointsSent, SUM);
+  GorillaStatsManager::addStatExportType(kReplicationPointsDropped, SUM);
+  GorillaStatsManager::addStatExportType(kReplicationSendFailures, SUM);
+  GorillaStatsManager::addStatExportType(kReplicationRejectedShards, SUM);
+}
+
+void ShardReplicator::setFollowers(
+    int64_t shardId,
+    const std::vector<Host>& followers) {
+  if (shardId < 0 || shardId >= numShards_) {
+    LOG(ERROR) << "Invalid shard for replication: " << shardId;
+    return;
+  }
+
+  Shard& shard = shards_[shardId];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  std::map<Host, Queue> queues;
+  for (const auto& follower : followers) {
+    auto it = shard.queues.find(follower);
+    if (it != shard.queues.end()) {
+      queues[follower] = std::move(it->second);
+    } else {
+      queues[follower];
+    }
+  }
+  shard.queues.swap(queues);
+  shard.count = shard.queues.size();
+}
+
+std::vector<ShardReplicator::Host> ShardReplicator::getFollowers(
+    int64_t shardId) {
+  std::vector<Host> followers;
+  if (shardId < 0 || shardId >= numShards_) {
+    return followers;
+  }
+
+  Shard& shard = shards_[shardId];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  for (const auto& queue : shard.queues) {
+    followers.push_back(queue.first);
+  }
+  return followers;
+}
+
+void ShardReplicator::addKeyToShard(
+    int64_t shardId,
+    uint32_t id,
+    const std::string& key,
+    uint16_t category,
+    int32_t creationTime) {
+  KeyMapping mapping;
+  mapping.shardId = shardId;
+  mapping.keyId = id;
+  mapping.key = key;
+  mapping.categoryId = category;
+  mapping.creationTime = creationTime;
+
+  Shard& shard = shards_[shardId];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  for (auto& queue : shard.queues) {
+    queue.second.keys.push_back(mapping);
+  }
+}
+
+void ShardReplicator::addPointsToShard(
+    int64_t shardId,
+    const std::vector<BucketLogWriterIf::LogEntry>& entries) {
+  Shard& shard = shards_[shardId];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  for (auto& queue : shard.queues) {
+    for (const auto& entry : entries) {
+      queue.second.points.emplace_back();
+      DataPointWithID& point = queue.second.points.back();
+      point.shardId = shardId;
+      point.keyId = entry.index;
+      point.point.unixTime = entry.unixTime;
+      point.point.value = entry.value;
+      point.point.ms = entry.ms;
+    }
+    trim(queue.second);
+  }
+}
+
+void ShardReplicator::trim(Queue& queue) {
+  if (queue.points.size() <= maxQueuedPoints_) {
+    return;
+  }
+
+  size_t dropped = queue.points.size() - maxQueuedPoints_;
+  queue.points.erase(queue.points.begin(), queue.points.begin() + dropped);
+  GorillaStatsManager::addStatValue(kReplicationPointsDropped, dropped);
+}
+
+int64_t ShardReplicator::flush() {
+  int64_t sent = 0;
+  std::map<Host, std::pair<AppendKeysRequest, LogDataPointsRequest>> batches;
+  for (int i = 0; i < numShards_; i++) {
+    Shard& shard = shards_[i];
+    if (shard.count.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+
+    std::vector<Host> full;
+    {
+      std::lock_guard<std::mutex> guard(shard.mutex);
+      for (auto& queue : shard.queues) {
+        auto& batch = batches[queue.first];
+        auto& keys = queue.second.keys;
+        auto& points = queue.second.points;
+        batch.first.keys.insert(
+            batch.first.keys.end(),
+            std::make_move_iterator(keys.begin()),
+            std::make_move_iterator(keys.end()));
+        keys.clear();
+
+        size_t count = std::min(
+            points.size(), kMaxPointsPerBatch - batch.second.points.size());
+        batch.second.points.insert(
+            batch.second.points.end(),
+            std::make_move_iterator(points.begin()),
+            std::make_move_iterator(points.begin() + count));
+        points.erase(points.begin(), points.begin() + count);
+        if (batch.second.points.size() >= kMaxPointsPerBatch) {
+          full.push_back(queue.first);
+        }
+      }
+    }
+
+    // The points left in the queues of full batches wait for the next
+    // flush.
+    for (const auto& follower : full) {
+      auto& batch = batches[follower];
+      sent += send(follower, batch.first, batch.second);
+      batches.erase(follower);
+    }
+  }
+
+  for (auto& batch : batches) {
+    if (!batch.second.first.keys.empty() ||
+        !batch.second.second.points.empty()) {
+      sent += send(batch.first, batch.second.first, batch.second.second);
+    }
+  }
+  return sent;
+}
+
+int64_t ShardReplicator::send(
+    const Host& follower,
+    AppendKeysRequest& keys,
+    LogDataPointsRequest& points) {
+  std::set<int64_t> rejectedShards;
+  bool success = false;
+  try {
+    success = sender_(follower, keys, points, rejectedShards);
+  } catch (std::exception& e) {
+    LOG(ERROR) << "Replicating to " << follower.first << ":"
+               << follower.second << " failed: " << e.what();
+  }
+
+  if (!success) {
+    GorillaStatsManager::addStatValue(kReplicationSendFailures);
+    rejectedShards.clear();
+    for (const auto& key : keys.keys) {
+      rejectedShards.insert(key.shardId);
+    }
+    for (const auto& point : points.points) {
+      rejectedShards.insert(point.shardId);
+    }
+  } else if (!rejectedShards.empty()) {
+    GorillaStatsManager::addStatValue(
+        kReplicationRejectedShards, rejectedShards.size());
+  }
+
+  std::map<
+      int64_t,
+      std::pair<std::vector<KeyMapping>, std::vector<DataPointWithID>>>
+      retries;
+  int64_t keysSent = 0;
+  int64_t pointsSent = 0;
+  for (auto& key : keys.keys) {
+    if (rejectedShards.count(key.shardId) > 0) {
+      retries[key.shardId].first.push_back(std::move(key));
+    } else {
+      keysSent++;
+    }
+  }
+  for (auto& point : points.points) {
+    if (rejectedShards.count(point.shardId) > 0) {
+      retries[point.shardId].second.push_back(std::move(point));
+    } else {
+      pointsSent++;
+    }
+  }
+
+  for (auto& retry : retries) {
+    requeue(
+        follower,
+        retry.first,
+        std::move(retry.second.first),
+        std::move(retry.second.second));
+  }
+
+  GorillaStatsManager::addStatValue(kReplicationKeysSent, keysSent);
+  GorillaStatsManager::addStatValue(kReplicationPointsSent, pointsSent);
+  return pointsSent;
+}
+
+void ShardReplicator::requeue(
+    const Host& follower,
+    int64_t shardId,
+    std::vector<KeyMapping>&& keys,
+    std::vector<DataPointWithID>&& points) {
+  if (shardId < 0 || shardId >= numShards_) {
+    return;
+  }
+
+  Shard& shard = shards_[shardId];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto it = shard.queues.find(follower);
+  if (it == shard.queues.end()) {
+    return;
+  }
+
+  Queue& queue = it->second;
+  queue.keys.insert(
+      queue.keys.begin(),
+      std::make_move_iterator(keys.begin()),
+      std::make_move_iterator(keys.end()));
+  queue.points.insert(
+      queue.points.begin(),
+      std::make_move_iterator(points.begin()),
+      std::make_move_iterator(points.end()));
+  trim(queue);
+}
+
+int64_t ShardReplicator::getQueuedPoints() {
+  int64_t queued = 0;
+  for (int i = 0; i < numShards_; i++) {
+    Shard& shard = shards_[i];
+    if (shard.count.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    for (const auto& queue : shard.queues) {
+      queued += queue.second.points.size();
+    }
+  }
+  return queued;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,163 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+#include "beringei/lib/BucketLogWriter.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class ShardReplicator
+//
+// Streams the new keys and data points of the shards owned by this host
+// to the hosts that follow them and keep read replicas of the shards.
+// BucketMap adds every key it creates and every point it logs, and
+// flush() sends them to the followers in batches, the keys of a batch
+// before its points.
+//
+// Every shard has a queue per follower, so a follower that is down
+// doesn't hold back the others. Entries that can't be sent, or that a
+// follower rejects because it isn't ready for the shard yet, are sent
+// again by the next flush. A queue keeps at most `maxQueuedPoints`
+// points and drops the oldest ones beyond that. Keys are never dropped,
+// since the points of a key can't be added without it.
+//
+// All the functions can be called from any number of threads.
+class ShardReplicator {
+ public:
+  typedef std::pair<std::string, int> Host;
+
+  // Sends a batch to a follower. Returns false if it couldn't be sent.
+  // Adds the shards whose entries the follower didn't take to
+  // `rejectedShards`.
+  typedef std::function<bool(
+      const Host& follower,
+      const AppendKeysRequest& keys,
+      const LogDataPointsRequest& points,
+      std::set<int64_t>& rejectedShards)>
+      Sender;
+
+  static const size_t kMaxPointsPerBatch;
+
+  ShardReplicator(int numShards, size_t maxQueuedPoints, Sender sender);
+
+  // Replaces the followers of a shard. The entries queued for the hosts
+  // that don't follow it anymore are dropped. Shards without followers
+  // aren't replicated.
+  void setFollowers(int64_t shardId, const std::vector<Host>& followers);
+
+  std::vector<Host> getFollowers(int64_t shardId);
+
+  // Queues a key that was created with id `id` for the followers of the
+  // shard.
+  void addKey(
+      int64_t shardId,
+      uint32_t id,
+      const std::string& key,
+      uint16_t category,
+      int32_t creationTime) {
+    if (hasFollowers(shardId)) {
+      addKeyToShard(shardId, id, key, category, creationTime);
+    }
+  }
+
+  // Queues the points that were logged for the followers of the shard.
+  void addPoints(
+      int64_t shardId,
+      const std::vector<BucketLogWriterIf::LogEntry>& entries) {
+    if (hasFollowers(shardId)) {
+      addPointsToShard(shardId, entries);
+    }
+  }
+
+  void addPoint(
+      int64_t shardId,
+      int32_t id,
+      int64_t unixTime,
+      double value,
+      int16_t ms = 0) {
+    if (hasFollowers(shardId)) {
+      addPointsToShard(shardId, {{id, unixTime, value, ms}});
+    }
+  }
+
+  // Sends the queued entries to the followers. Returns the number of
+  // points that were sent.
+  int64_t flush();
+
+  // Number of points waiting to be sent to all the followers.
+  int64_t getQueuedPoints();
+
+ private:
+  struct Queue {
+    std::deque<KeyMapping> keys;
+    std::deque<DataPointWithID> points;
+  };
+
+  struct Shard {
+    std::atomic<int> count{0};
+    std::mutex mutex;
+    std::map<Host, Queue> queues;
+  };
+
+  bool hasFollowers(int64_t shardId) const {
+    return shardId >= 0 && shardId < numShards_ &&
+        shards_[shardId].count.load(std::memory_order_relaxed) > 0;
+  }
+
+  void addKeyToShard(
+      int64_t shardId,
+      uint32_t id,
+      const std::string& key,
+      uint16_t category,
+      int32_t creationTime);
+
+  void addPointsToShard(
+      int64_t shardId,
+      const std::vector<BucketLogWriterIf::LogEntry>& entries);
+
+  // Drops the oldest points of the queue beyond `maxQueuedPoints_`.
+  void trim(Queue& queue);
+
+  // Puts the entries of `shardId` in the batch back at the front of its
+  // queue for `follower`, if the shard still has that follower.
+  void requeue(
+      const Host& follower,
+      int64_t shardId,
+      std::vector<KeyMapping>&& keys,
+      std::vector<DataPointWithID>&& points);
+
+  // Sends one batch and queues again what wasn't taken. Returns the
+  // number of points that were taken.
+  int64_t send(
+      const Host& follower,
+      AppendKeysRequest& keys,
+      LogDataPointsRequest& points);
+
+  const int numShards_;
+  const size_t maxQueuedPoints_;
+  Sender sender_;
+  std::unique_ptr<Shard[]> shards_;
+};
+}
+} // facebook::gorilla
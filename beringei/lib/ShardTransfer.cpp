@@ -0,0 +1,196 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "ShardTransfer.h"
+
+#include <algorithm>
+
+#include "glog/logging.h"
+
+#include "BucketLogWriter.h"
+#include "BucketSnapshot.h"
+#include "BucketStorage.h"
+#include "FileUtils.h"
+#include "PersistentKeyList.h"
+
+namespace facebook {
+namespace gorilla {
+
+// Written to and renamed by the key list and the snapshot, so it's
+// never copied.
+static const int64_t kTempFileId = 0;
+
+ShardTransfer::ShardTransfer(
+    int64_t shardId,
+    const std::string& dataDirectory)
+    : shardId_(shardId), dataDirectory_(dataDirectory) {}
+
+const std::vector<std::string>& ShardTransfer::prefixes() {
+  static const std::vector<std::string> kPrefixes = {
+      PersistentKeyList::kFilePrefix,
+      BucketStorage::kDataPrefix,
+      BucketStorage::kCompletePrefix,
+      BucketSnapshot::kSnapshotPrefix,
+      BucketLogWriter::kLogFilePrefix,
+  };
+  return kPrefixes;
+}
+
+std::string ShardTransfer::incomingPrefix(const std::string& prefix) {
+  return "transfer_" + prefix;
+}
+
+std::vector<ShardTransfer::File> ShardTransfer::listFiles(
+    int64_t firstLogFileId) {
+  std::vector<File> files;
+  if (!FileUtils::isDirectory(
+          FileUtils::joinPaths(dataDirectory_, std::to_string(shardId_)))) {
+    return files;
+  }
+
+  // Only the newest key list and snapshot are ever read.
+  std::vector<int64_t> keyLists =
+      FileUtils(shardId_, PersistentKeyList::kFilePrefix, dataDirectory_).ls();
+  if (!keyLists.empty() && keyLists.back() != kTempFileId) {
+    files.push_back(File{PersistentKeyList::kFilePrefix, keyLists.back()});
+  }
+
+  // The marker goes after the block file, like when it's written.
+  FileUtils completeFiles(
+      shardId_, BucketStorage::kCompletePrefix, dataDirectory_);
+  for (int64_t id : completeFiles.ls()) {
+    files.push_back(File{BucketStorage::kDataPrefix, id});
+    files.push_back(File{BucketStorage::kCompletePrefix, id});
+  }
+
+  std::vector<int64_t> snapshots =
+      FileUtils(shardId_, BucketSnapshot::kSnapshotPrefix, dataDirectory_)
+          .ls();
+  if (!snapshots.empty() && snapshots.back() != kTempFileId) {
+    files.push_back(File{BucketSnapshot::kSnapshotPrefix, snapshots.back()});
+  }
+
+  // Last, so that as much as possible of the files that are still
+  // being written is copied.
+  FileUtils logFiles(shardId_, BucketLogWriter::kLogFilePrefix, dataDirectory_);
+  for (int64_t id : logFiles.ls()) {
+    if (id >= firstLogFileId) {
+      files.push_back(File{BucketLogWriter::kLogFilePrefix, id});
+    }
+  }
+
+  return files;
+}
+
+bool ShardTransfer::readFile(
+    const File& file,
+    int64_t offset,
+    int64_t maxBytes,
+    std::string& data,
+    bool& endOfFile) {
+  const auto& known = prefixes();
+  if (std::find(known.begin(), known.end(), file.prefix) == known.end()) {
+    LOG(ERROR) << "Can't transfer files with prefix " << file.prefix;
+    return false;
+  }
+
+  FileUtils files(shardId_, file.prefix, dataDirectory_);
+  auto f = files.open(file.id, "rb", 0);
+  if (!f.file) {
+    return false;
+  }
+
+  int64_t length = -1;
+  if (fseek(f.file, 0, SEEK_END) == 0) {
+    length = ftell(f.file);
+  }
+  if (length < 0 || offset < 0 || offset > length ||
+      fseek(f.file, offset, SEEK_SET) != 0) {
+    LOG(ERROR) << "Can't read " << f.name << " from offset " << offset;
+    FileUtils::closeFile(f, false);
+    return false;
+  }
+
+  int64_t toRead = length - offset;
+  if (maxBytes > 0) {
+    toRead = std::min(toRead, maxBytes);
+  }
+
+  data.resize(toRead);
+  if (toRead > 0 && fread(&data[0], sizeof(char), toRead, f.file) != toRead) {
+    PLOG(ERROR) << "Reading " << f.name << " failed";
+    FileUtils::closeFile(f, false);
+    return false;
+  }
+
+  FileUtils::closeFile(f, false);
+  endOfFile = offset + toRead == length;
+  return true;
+}
+
+bool ShardTransfer::writeFile(
+    const File& file,
+    int64_t offset,
+    const std::string& data) {
+  const auto& known = prefixes();
+  if (std::find(known.begin(), known.end(), file.prefix) == known.end()) {
+    LOG(ERROR) << "Can't transfer files with prefix " << file.prefix;
+    return false;
+  }
+
+  FileUtils files(shardId_, incomingPrefix(file.prefix), dataDirectory_);
+  if (offset == 0) {
+    files.createDirectories();
+  }
+
+  auto f = files.open(file.id, offset == 0 ? "wb" : "ab", 0);
+  if (!f.file) {
+    return false;
+  }
+
+  if (ftell(f.file) != offset) {
+    LOG(ERROR) << "Copy of " << f.name << " is not " << offset << " bytes";
+    FileUtils::closeFile(f, false);
+    return false;
+  }
+
+  if (fwrite(data.data(), sizeof(char), data.size(), f.file) != data.size()) {
+    PLOG(ERROR) << "Writing " << f.name << " failed";
+    FileUtils::closeFile(f, false);
+    return false;
+  }
+
+  FileUtils::closeFile(f, false);
+  return true;
+}
+
+void ShardTransfer::install(const std::vector<File>& files) {
+  for (const auto& prefix : prefixes()) {
+    FileUtils(shardId_, prefix, dataDirectory_).clearAll();
+  }
+
+  for (const auto& file : files) {
+    FileUtils(shardId_, incomingPrefix(file.prefix), dataDirectory_)
+        .rename(file.id, file.prefix);
+  }
+  LOG(INFO) << "Installed " << files.size() << " files of shard " << shardId_;
+}
+
+void ShardTransfer::clear() {
+  if (!FileUtils::isDirectory(
+          FileUtils::joinPaths(dataDirectory_, std::to_string(shardId_)))) {
+    return;
+  }
+
+  for (const auto& prefix : prefixes()) {
+    FileUtils(shardId_, incomingPrefix(prefix), dataDirectory_).clearAll();
+  }
+}
+}
+} // facebook::gorilla
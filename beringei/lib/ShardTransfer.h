@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace gorilla {
+
+// class ShardTransfer
+//
+// Copies the files of a shard from its previous owner to its next
+// owner: the key list, the block files, the snapshot of the open bucket
+// and the log files written after it. All of them are compressed
+// already, and with the snapshot the next owner only has to replay the
+// logs written since it was taken. The next owner writes the files next
+// to its own and only replaces its own files with them once all of
+// them have been copied.
+class ShardTransfer {
+ public:
+  struct File {
+    std::string prefix;
+    int64_t id;
+  };
+
+  ShardTransfer(int64_t shardId, const std::string& dataDirectory);
+
+  // Returns the files to copy, in the order they should be copied. Log
+  // files older than `firstLogFileId` are left out.
+  std::vector<File> listFiles(int64_t firstLogFileId);
+
+  // Reads up to `maxBytes` of `file` starting at `offset` into `data`
+  // and sets `endOfFile` if there is nothing after that. Returns false
+  // if the file can't be read.
+  bool readFile(
+      const File& file,
+      int64_t offset,
+      int64_t maxBytes,
+      std::string& data,
+      bool& endOfFile);
+
+  // Appends `data` to the copy of `file`. `offset` must be the length
+  // of the copy so far. Returns false on failure.
+  bool writeFile(const File& file, int64_t offset, const std::string& data);
+
+  // Replaces the files of the shard with the copies of `files`.
+  void install(const std::vector<File>& files);
+
+  // Removes copies left by a transfer that failed.
+  void clear();
+
+ private:
+  // Prefix of the copy of a file with `prefix`.
+  static std::string incomingPrefix(const std::string& prefix);
+
+  static const std::vector<std::string>& prefixes();
+
+  const int64_t shardId_;
+  const std::string dataDirectory_;
+};
+}
+} // facebook::gorilla
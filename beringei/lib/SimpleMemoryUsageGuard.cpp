@@ -10,7 +10,9 @@
 #include "SimpleMemoryUsageGuard.h"
 
 #include <gflags/gflags.h>
-#include <fstream>
+#include <folly/memory/MallctlHelper.h>
+#include <folly/memory/Malloc.h>
+#include "beringei/lib/DataBlockAllocator.h"
 #include "beringei/lib/GorillaStatsManager.h"
 
 DEFINE_uint64(
@@ -18,6 +20,28 @@ DEFINE_uint64(
     0, // unlimited
     "Soft memory cap for gorilla (mb).  Memory usage may exceed this cap, "
     "but new time series creation may be blocked. 0 indicates unlimited.");
+DEFINE_double(
+    memory_cgroup_limit_fraction,
+    0.9,
+    "With a cgroup v2 memory limit, the soft memory cap is this fraction "
+    "of it when that's lower than --soft_memory_cap_mb. 0 ignores the "
+    "cgroup limit.");
+DEFINE_string(
+    memory_cgroup_directory,
+    "",
+    "Directory of the cgroup v2 with memory.current and memory.max. "
+    "Found from /proc/self/cgroup if empty. The RSS is used outside of "
+    "a cgroup v2.");
+DEFINE_int32(
+    memory_prediction_secs,
+    300,
+    "New time series are slowed down when the memory usage predicted "
+    "this many seconds ahead is over the soft memory cap. 0 disables.");
+DEFINE_double(
+    memory_evict_fraction,
+    1.05,
+    "Finalized buckets are evicted to their memory mapped block files "
+    "when the memory usage is over this fraction of the soft memory cap");
 
 namespace facebook {
 namespace gorilla {
@@ -26,47 +50,135 @@ static const std::chrono::seconds kMemoryStatsUpdateInterval(1);
 
 static constexpr size_t kBytesPerMB = 1024 * 1024;
 static const std::string kMemoryTotal = "gorilla.memory_total_mb";
-static const std::string kStatFile = "/proc/self/statm";
+static const std::string kMemoryCap = "gorilla.memory_cap_mb";
+static const std::string kMemoryPredicted = "gorilla.memory_predicted_mb";
+static const std::string kMemoryReclaimable = "gorilla.memory_reclaimable_mb";
+static const std::string kMemoryPressure = "gorilla.memory_pressure";
+static const std::string kMallocAllocated = "gorilla.malloc_allocated_mb";
+static const std::string kMallocResident = "gorilla.malloc_resident_mb";
+static const std::string kReleasedDataBlocks = "gorilla.released_data_blocks";
+
+// MALLCTL_ARENAS_ALL of jemalloc.
+static const std::string kPurgeAllArenas = "arena.4096.purge";
 
 SimpleMemoryUsageGuard::SimpleMemoryUsageGuard()
-    : isFreeMemoryRatioLow_(false), memoryStatsUpdateRunner_() {
+    : SimpleMemoryUsageGuard(FLAGS_memory_cgroup_limit_fraction) {}
+
+SimpleMemoryUsageGuard::SimpleMemoryUsageGuard(double memFractionToUse)
+    : memFractionToUse_(memFractionToUse),
+      cgroupDirectory_(
+          FLAGS_memory_cgroup_directory.empty()
+              ? MemoryStats::findCgroupDirectory()
+              : FLAGS_memory_cgroup_directory),
+      start_(std::chrono::steady_clock::now()),
+      expectedGrowth_(0),
+      pressure_(NONE),
+      memoryStatsUpdateRunner_() {
+  LOG(INFO) << "Memory usage is read from "
+            << (cgroupDirectory_.empty() ? "/proc/self/statm"
+                                         : cgroupDirectory_);
   memoryStatsUpdateRunner_.addFunction(
       std::bind(&SimpleMemoryUsageGuard::updateMemoryStats, this),
       kMemoryStatsUpdateInterval,
       "updateMemoryStats");
   GorillaStatsManager::addStatExportType(
       kMemoryTotal, GorillaStatsExportType::AVG);
+  GorillaStatsManager::addStatExportType(
+      kMemoryPredicted, GorillaStatsExportType::AVG);
+  GorillaStatsManager::addStatExportType(
+      kMemoryPressure, GorillaStatsExportType::AVG);
+  GorillaStatsManager::addStatExportType(
+      kReleasedDataBlocks, GorillaStatsExportType::SUM);
   memoryStatsUpdateRunner_.start();
 }
 
+SimpleMemoryUsageGuard::~SimpleMemoryUsageGuard() {
+  memoryStatsUpdateRunner_.shutdown();
+}
+
 bool SimpleMemoryUsageGuard::weAreLowOnMemory() {
-  return isFreeMemoryRatioLow_;
+  return pressure_ >= BLOCK_NEW_KEYS;
+}
+
+MemoryUsageGuardIf::Pressure SimpleMemoryUsageGuard::getPressure() {
+  return (Pressure)pressure_.load();
+}
+
+void SimpleMemoryUsageGuard::setExpectedGrowth(int64_t bytes) {
+  expectedGrowth_ = bytes;
 }
 
 void SimpleMemoryUsageGuard::updateMemoryStats() {
-  if (FLAGS_soft_memory_cap_mb == 0) {
-    isFreeMemoryRatioLow_ = false;
+  MemoryStats stats;
+  if (!MemoryStats::read(cgroupDirectory_, stats)) {
+    LOG(ERROR) << "Failed to update memory usage";
     return;
   }
 
-  size_t vPages, rPages;
-  std::ifstream statm(kStatFile);
-  statm >> vPages >> rPages; // Ignore the rest of the fields.
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start_)
+                       .count();
+  growth_.add(seconds, stats.usedBytes);
 
-  if (!statm.good()) {
-    LOG(ERROR) << "Failed to update memory usage";
-    statm.close();
-    return;
+  int64_t cap = FLAGS_soft_memory_cap_mb * kBytesPerMB;
+  if (stats.limitBytes > 0 && memFractionToUse_ > 0) {
+    int64_t cgroupCap = memFractionToUse_ * stats.limitBytes;
+    cap = cap > 0 ? std::min(cap, cgroupCap) : cgroupCap;
+  }
+
+  int64_t predicted = stats.usedBytes;
+  if (FLAGS_memory_prediction_secs > 0) {
+    predicted =
+        growth_.predict(FLAGS_memory_prediction_secs, expectedGrowth_.load());
   }
 
-  statm.close();
+  int64_t usedMB = stats.usedBytes / kBytesPerMB;
+  GorillaStatsManager::setCounter(kMemoryTotal, usedMB);
+  GorillaStatsManager::addStatValue(kMemoryTotal, usedMB);
+  GorillaStatsManager::setCounter(kMemoryCap, cap / kBytesPerMB);
+  GorillaStatsManager::addStatValue(kMemoryPredicted, predicted / kBytesPerMB);
+  GorillaStatsManager::setCounter(
+      kMemoryReclaimable, stats.reclaimableBytes / kBytesPerMB);
 
-  size_t rssMB = rPages * getpagesize() / kBytesPerMB;
+  Pressure pressure = MemoryStats::pressure(
+      stats.usedBytes, predicted, cap, FLAGS_memory_evict_fraction);
+  Pressure previous = (Pressure)pressure_.exchange(pressure);
+  GorillaStatsManager::addStatValue(kMemoryPressure, pressure);
+  if (pressure >= BLOCK_NEW_KEYS && previous < BLOCK_NEW_KEYS) {
+    LOG(WARNING) << "Memory usage of " << usedMB << "MB is over the cap of "
+                 << cap / kBytesPerMB << "MB";
+    shrinkCaches();
+  }
 
-  GorillaStatsManager::setCounter(kMemoryTotal, rssMB);
-  GorillaStatsManager::addStatValue(kMemoryTotal, rssMB);
+  if (folly::usingJEMalloc()) {
+    try {
+      // Refreshes the cached stats.
+      folly::mallctlWrite<uint64_t>("epoch", 1);
+      size_t allocated;
+      size_t resident;
+      folly::mallctlRead<size_t>("stats.allocated", &allocated);
+      folly::mallctlRead<size_t>("stats.resident", &resident);
+      GorillaStatsManager::setCounter(
+          kMallocAllocated, allocated / kBytesPerMB);
+      GorillaStatsManager::setCounter(kMallocResident, resident / kBytesPerMB);
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Failed to read jemalloc stats: " << e.what();
+    }
+  }
+}
 
-  isFreeMemoryRatioLow_ = rssMB >= FLAGS_soft_memory_cap_mb;
+void SimpleMemoryUsageGuard::shrinkCaches() {
+  GorillaStatsManager::addStatValue(
+      kReleasedDataBlocks, DataBlockAllocator::releaseFreeBlocks());
+
+  if (folly::usingJEMalloc()) {
+    try {
+      // Returns the dirty pages of every arena to the system.
+      folly::mallctlCall(kPurgeAllArenas.c_str());
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Failed to purge jemalloc arenas: " << e.what();
+    }
+  }
 }
 }
 } // facebook:gorilla
@@ -9,26 +9,49 @@
 
 #pragma once
 
+#include "MemoryStats.h"
 #include "MemoryUsageGuardIf.h"
 
 #include <folly/experimental/FunctionScheduler.h>
 
 #include <atomic>
+#include <chrono>
+#include <string>
 
 namespace facebook {
 namespace gorilla {
 
+// Compares the memory usage with a soft cap once a second. The cap is
+// --soft_memory_cap_mb or a fraction of the memory limit of the cgroup
+// of the process, whichever is lower. The usage is predicted from how
+// fast it grew and from the expected growth of the bucket rotations.
 class SimpleMemoryUsageGuard : public MemoryUsageGuardIf {
  public:
   SimpleMemoryUsageGuard();
+
+  // `memFractionToUse` of the cgroup memory limit is the soft cap.
   explicit SimpleMemoryUsageGuard(double memFractionToUse);
 
+  ~SimpleMemoryUsageGuard() override;
+
   bool weAreLowOnMemory() override;
 
+  Pressure getPressure() override;
+
+  void setExpectedGrowth(int64_t bytes) override;
+
  private:
   void updateMemoryStats();
 
-  std::atomic<bool> isFreeMemoryRatioLow_;
+  // Gives free memory back to the system.
+  void shrinkCaches();
+
+  const double memFractionToUse_;
+  const std::string cgroupDirectory_;
+  const std::chrono::steady_clock::time_point start_;
+  MemoryGrowthEstimator growth_;
+  std::atomic<int64_t> expectedGrowth_;
+  std::atomic<int> pressure_;
   folly::FunctionScheduler memoryStatsUpdateRunner_;
 };
 }
@@ -0,0 +1,129 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "StreamArena.h"
+
+#include <string.h>
+
+#include <new>
+#include <unordered_map>
+
+namespace facebook {
+namespace gorilla {
+
+static const size_t kSlabSize = 1024 * 1024;
+
+// Each buffer is preceded by a pointer to its arena.
+static const uint32_t kHeaderSize = sizeof(StreamArena*);
+
+const uint32_t StreamArena::kMaxCapacity = 16 * 1024 - kHeaderSize;
+
+StreamArena* StreamArena::get(int shardId) {
+  static std::mutex* mutex = new std::mutex();
+  static auto* arenas = new std::unordered_map<int, StreamArena*>();
+
+  std::lock_guard<std::mutex> guard(*mutex);
+  StreamArena*& arena = (*arenas)[shardId];
+  if (!arena) {
+    arena = new StreamArena();
+  }
+  return arena;
+}
+
+StreamArena* StreamArena::getArena(const char* buffer) {
+  StreamArena* arena;
+  memcpy(&arena, buffer - kHeaderSize, sizeof(arena));
+  return arena;
+}
+
+StreamArena::StreamArena()
+    : slab_(nullptr), slabLeft_(0), slabBytes_(0), freeBytes_(0) {
+  for (int i = 0; i < kSizeClasses; i++) {
+    freeLists_[i] = nullptr;
+  }
+}
+
+uint32_t StreamArena::getChunkSize(int sizeClass) {
+  // 32, 48, 64, 96, 128, ..., 16384.
+  return (sizeClass % 2 == 0 ? 32 : 48) << (sizeClass / 2);
+}
+
+int StreamArena::getSizeClass(uint32_t size) {
+  int sizeClass = 0;
+  while (getChunkSize(sizeClass) < size + kHeaderSize) {
+    sizeClass++;
+  }
+  return sizeClass;
+}
+
+char* StreamArena::allocate(uint32_t size, uint32_t& capacity) {
+  if (size > kMaxCapacity) {
+    return nullptr;
+  }
+
+  int sizeClass = getSizeClass(size);
+  uint32_t chunkSize = getChunkSize(sizeClass);
+  capacity = chunkSize - kHeaderSize;
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  char* buffer = freeLists_[sizeClass];
+  if (buffer) {
+    memcpy(&freeLists_[sizeClass], buffer, sizeof(char*));
+    freeBytes_ -= chunkSize;
+    return buffer;
+  }
+
+  if (slabLeft_ < chunkSize) {
+    // Hand out the rest of the old slab as smaller buffers before
+    // starting a new one.
+    for (int i = sizeClass - 1; i >= 0; i--) {
+      while (slabLeft_ >= getChunkSize(i)) {
+        char* free = carve(getChunkSize(i));
+        memcpy(free, &freeLists_[i], sizeof(char*));
+        freeLists_[i] = free;
+        freeBytes_ += getChunkSize(i);
+      }
+    }
+
+    slab_ = new char[kSlabSize];
+    slabLeft_ = kSlabSize;
+    slabBytes_ += kSlabSize;
+  }
+
+  return carve(chunkSize);
+}
+
+char* StreamArena::carve(uint32_t chunkSize) {
+  char* chunk = slab_;
+  slab_ += chunkSize;
+  slabLeft_ -= chunkSize;
+  StreamArena* arena = this;
+  memcpy(chunk, &arena, kHeaderSize);
+  return chunk + kHeaderSize;
+}
+
+void StreamArena::release(char* buffer, uint32_t capacity) {
+  int sizeClass = getSizeClass(capacity);
+  std::lock_guard<std::mutex> guard(mutex_);
+  memcpy(buffer, &freeLists_[sizeClass], sizeof(char*));
+  freeLists_[sizeClass] = buffer;
+  freeBytes_ += getChunkSize(sizeClass);
+}
+
+size_t StreamArena::getMemoryUsage() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return slabBytes_;
+}
+
+size_t StreamArena::getFreeBytes() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return freeBytes_;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,85 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+namespace facebook {
+namespace gorilla {
+
+// class StreamArena
+//
+// Allocates the buffers of the active streams of a shard. Buffers come
+// in size classes that grow by 1.5x and 1.33x in turn, like the growth
+// of a string, and are carved out of 1MB slabs. Released buffers are
+// kept in a free list per size class for the next streams that need
+// one, so streams that grow as points arrive don't call malloc and
+// realloc for every step and don't fragment the heap. Slabs are never
+// freed.
+//
+// Thread-safe.
+class StreamArena {
+ public:
+  // Largest buffer allocated from an arena.
+  static const uint32_t kMaxCapacity;
+
+  // Returns the arena of the shard. Arenas are never destroyed so
+  // that streams can still release their buffers during shutdown.
+  static StreamArena* get(int shardId);
+
+  // Returns the arena that allocated `buffer`.
+  static StreamArena* getArena(const char* buffer);
+
+  // Returns a buffer with room for at least `size` bytes and sets
+  // `capacity` to its actual size, or null if `size` is larger than
+  // kMaxCapacity.
+  char* allocate(uint32_t size, uint32_t& capacity);
+
+  // Puts a buffer from allocate() back in the free list of its size
+  // class.
+  void release(char* buffer, uint32_t capacity);
+
+  // Bytes of all the slabs, including the free buffers.
+  size_t getMemoryUsage();
+
+  // Bytes of the buffers in the free lists.
+  size_t getFreeBytes();
+
+ private:
+  StreamArena();
+
+  // Size classes of whole chunks, including the header with the arena
+  // that every buffer is preceded by.
+  static const int kSizeClasses = 19;
+  static uint32_t getChunkSize(int sizeClass);
+
+  // Smallest size class with room for `size` bytes of buffer.
+  static int getSizeClass(uint32_t size);
+
+  // Takes a chunk from the slab and returns its buffer. Caller must
+  // hold the mutex.
+  char* carve(uint32_t chunkSize);
+
+  std::mutex mutex_;
+
+  // Singly linked through the first bytes of each free buffer.
+  char* freeLists_[kSizeClasses];
+
+  // Rest of the slab that buffers are carved out of.
+  char* slab_;
+  size_t slabLeft_;
+
+  size_t slabBytes_;
+  size_t freeBytes_;
+};
+}
+} // facebook::gorilla
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "StreamBuffer.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+
+namespace facebook {
+namespace gorilla {
+
+StreamBuffer::StreamBuffer(const StreamBuffer& other)
+    : data_(nullptr), size_(0), capacity_(0) {
+  append(other.data_, other.size_);
+}
+
+StreamBuffer& StreamBuffer::operator=(const StreamBuffer& other) {
+  if (this != &other) {
+    assign(other.data_, other.size_);
+  }
+  return *this;
+}
+
+void StreamBuffer::free() {
+  if (inArena()) {
+    StreamArena::getArena(data_)->release(data_, capacity());
+  } else {
+    ::free(data_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  capacity_ = 0;
+}
+
+void StreamBuffer::moveTo(StreamArena* arena) {
+  if (!arena || inArena() || size_ > 0) {
+    return;
+  }
+
+  uint32_t capacity;
+  char* data = arena->allocate(this->capacity(), capacity);
+  if (data) {
+    free();
+    data_ = data;
+    capacity_ = capacity | kArenaBit;
+  }
+}
+
+void StreamBuffer::reallocate(size_t capacity) {
+  capacity = std::max(capacity, this->capacity() * 3 / 2);
+
+  if (inArena()) {
+    uint32_t arenaCapacity;
+    StreamArena* arena = StreamArena::getArena(data_);
+    char* data = arena->allocate(capacity, arenaCapacity);
+    if (data) {
+      memcpy(data, data_, size_);
+      arena->release(data_, this->capacity());
+      data_ = data;
+      capacity_ = arenaCapacity | kArenaBit;
+      return;
+    }
+
+    // Too large for the arena.
+    data = (char*)malloc(capacity);
+    if (!data) {
+      throw std::bad_alloc();
+    }
+    memcpy(data, data_, size_);
+    arena->release(data_, this->capacity());
+    data_ = data;
+    capacity_ = capacity;
+    return;
+  }
+
+  char* data = (char*)realloc(data_, capacity);
+  if (!data) {
+    throw std::bad_alloc();
+  }
+  data_ = data;
+  capacity_ = capacity;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "StreamArena.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class StreamBuffer
+//
+// The bytes of a TimeSeriesStream. A string with only what the stream
+// and `BasicBitWriter` need, whose memory can come from a StreamArena.
+// Buffers are on the heap until they are moved to an arena. Once in an
+// arena they grow within it and go back to it when they are freed, and
+// only return to the heap if they outgrow the largest size class.
+class StreamBuffer {
+ public:
+  StreamBuffer() : data_(nullptr), size_(0), capacity_(0) {}
+
+  // Copies are on the heap.
+  StreamBuffer(const StreamBuffer& other);
+
+  // Copies the bytes into the buffer that's already there.
+  StreamBuffer& operator=(const StreamBuffer& other);
+
+  ~StreamBuffer() {
+    free();
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  size_t capacity() const {
+    return capacity_ & ~kArenaBit;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  const char* data() const {
+    return data_;
+  }
+
+  char& operator[](size_t i) {
+    return data_[i];
+  }
+
+  char operator[](size_t i) const {
+    return data_[i];
+  }
+
+  void append(const char* bytes, size_t length) {
+    if (length == 0) {
+      return;
+    }
+    if (size_ + length > capacity()) {
+      reallocate(size_ + length);
+    }
+    memcpy(data_ + size_, bytes, length);
+    size_ += length;
+  }
+
+  void assign(const char* bytes, size_t length) {
+    size_ = 0;
+    append(bytes, length);
+  }
+
+  // Keeps the memory.
+  void clear() {
+    size_ = 0;
+  }
+
+  void reserve(size_t capacity) {
+    if (capacity > this->capacity()) {
+      reallocate(capacity);
+    }
+  }
+
+  // Clears the buffer and gives back its memory.
+  void free();
+
+  // Takes the memory from `arena` from now on if the buffer is empty
+  // and isn't in an arena yet. Does nothing if `arena` is null.
+  void moveTo(StreamArena* arena);
+
+  bool inArena() const {
+    return capacity_ & kArenaBit;
+  }
+
+  std::string toStdString() const {
+    return std::string(data_, size_);
+  }
+
+ private:
+  // Set in `capacity_` for buffers from an arena.
+  static const uint32_t kArenaBit = 1U << 31;
+
+  // Grows the buffer to at least `capacity` bytes, and by at least
+  // half.
+  void reallocate(size_t capacity);
+
+  char* data_;
+  uint32_t size_;
+  uint32_t capacity_;
+};
+}
+} // facebook::gorilla
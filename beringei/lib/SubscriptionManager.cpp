@@ -0,0 +1,316 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/lib/SubscriptionManager.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+
+#include <glog/logging.h>
+
+#include "beringei/lib/GorillaStatsManager.h"
+
+namespace facebook {
+namespace gorilla {
+
+static const std::string kSubscriptions = "subscriptions";
+static const std::string kSubscriptionsExpired = "subscriptions_expired";
+static const std::string kSubscriptionPointsPublished =
+    "subscription_points_published";
+static const std::string kSubscriptionPointsDropped =
+    "subscription_points_dropped";
+
+static GorillaStat pointsPublishedStat(kSubscriptionPointsPublished);
+static GorillaStat pointsDroppedStat(kSubscriptionPointsDropped);
+
+static int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+SubscriptionManager::SubscriptionManager(
+    int numShards,
+    size_t maxBufferSize,
+    size_t maxSubscriptions,
+    int64_t idleTimeoutMs)
+    : numShards_(numShards),
+      maxBufferSize_(maxBufferSize),
+      maxSubscriptions_(maxSubscriptions),
+      idleTimeoutMs_(idleTimeoutMs),
+      shards_(new Shard[numShards]),
+      nextId_(1) {
+  GorillaStatsManager::addStatExportType(kSubscriptionsExpired, SUM);
+  GorillaStatsManager::addStatExportType(kSubscriptionPointsPublished, SUM);
+  GorillaStatsManager::addStatExportType(kSubscriptionPointsDropped, SUM);
+}
+
+int64_t SubscriptionManager::subscribe(
+    const std::vector<Key>& keys,
+    const std::string& prefix,
+    const std::vector<int64_t>& prefixShards,
+    size_t bufferSize) {
+  auto subscription = std::make_shared<Subscription>();
+  subscription->keys = keys;
+  subscription->prefix = prefix;
+  if (!prefix.empty()) {
+    subscription->prefixShards = prefixShards;
+  }
+  subscription->bufferSize = bufferSize == 0
+      ? maxBufferSize_
+      : std::min(bufferSize, maxBufferSize_);
+  subscription->lastPollMs = nowMs();
+
+  std::set<int64_t> shardIds(
+      subscription->prefixShards.begin(), subscription->prefixShards.end());
+  for (const auto& key : keys) {
+    shardIds.insert(key.shardId);
+  }
+  for (int64_t shardId : shardIds) {
+    if (shardId < 0 || shardId >= numShards_) {
+      LOG(ERROR) << "Invalid shard in subscription: " << shardId;
+      return 0;
+    }
+  }
+
+  removeIdle();
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (subscriptions_.size() >= maxSubscriptions_) {
+    return 0;
+  }
+
+  subscription->id = nextId_++;
+  subscriptions_[subscription->id] = subscription;
+  updateShards(std::vector<int64_t>(shardIds.begin(), shardIds.end()));
+  GorillaStatsManager::setCounter(kSubscriptions, subscriptions_.size());
+  return subscription->id;
+}
+
+bool SubscriptionManager::unsubscribe(int64_t id) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = subscriptions_.find(id);
+  if (it == subscriptions_.end()) {
+    return false;
+  }
+
+  remove(it->second);
+  GorillaStatsManager::setCounter(kSubscriptions, subscriptions_.size());
+  return true;
+}
+
+bool SubscriptionManager::poll(
+    int64_t id,
+    int64_t timeoutMs,
+    size_t maxPoints,
+    std::vector<DataPoint>& points,
+    int64_t& dropped) {
+  std::shared_ptr<Subscription> subscription;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = subscriptions_.find(id);
+    if (it == subscriptions_.end()) {
+      return false;
+    }
+    subscription = it->second;
+  }
+
+  std::unique_lock<std::mutex> lock(subscription->mutex);
+  subscription->lastPollMs = nowMs();
+  subscription->ready.wait_for(
+      lock, std::chrono::milliseconds(timeoutMs), [&]() {
+        return !subscription->points.empty() || subscription->removed;
+      });
+  if (subscription->removed) {
+    return false;
+  }
+
+  size_t n = subscription->points.size();
+  if (maxPoints > 0) {
+    n = std::min(n, maxPoints);
+  }
+  auto end = subscription->points.begin() + n;
+  points.insert(
+      points.end(),
+      std::make_move_iterator(subscription->points.begin()),
+      std::make_move_iterator(end));
+  subscription->points.erase(subscription->points.begin(), end);
+
+  dropped = subscription->dropped;
+  subscription->dropped = 0;
+  subscription->lastPollMs = nowMs();
+  return true;
+}
+
+void SubscriptionManager::removeIdle() {
+  int64_t idleBefore = nowMs() - idleTimeoutMs_;
+  std::lock_guard<std::mutex> guard(mutex_);
+  std::vector<std::shared_ptr<Subscription>> idle;
+  for (const auto& subscription : subscriptions_) {
+    std::lock_guard<std::mutex> lock(subscription.second->mutex);
+    if (subscription.second->lastPollMs < idleBefore) {
+      idle.push_back(subscription.second);
+    }
+  }
+
+  for (auto& subscription : idle) {
+    remove(subscription);
+  }
+  if (!idle.empty()) {
+    GorillaStatsManager::addStatValue(kSubscriptionsExpired, idle.size());
+    GorillaStatsManager::setCounter(kSubscriptions, subscriptions_.size());
+  }
+}
+
+size_t SubscriptionManager::numSubscriptions() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return subscriptions_.size();
+}
+
+void SubscriptionManager::publishToShard(
+    int64_t shardId,
+    const std::string& key,
+    const TimeValuePair& value,
+    uint16_t category) {
+  auto subscriptions = std::atomic_load(&shards_[shardId].subscriptions);
+  if (!subscriptions) {
+    return;
+  }
+
+  const std::vector<std::shared_ptr<Subscription>>* keySubscriptions =
+      nullptr;
+  auto it = subscriptions->keys.find(key.c_str());
+  if (it != subscriptions->keys.end()) {
+    keySubscriptions = &it->second;
+  }
+
+  int published = 0;
+  int dropped = 0;
+  auto add = [&](Subscription& subscription) {
+    DataPoint dp;
+    dp.key.key = key;
+    dp.key.shardId = shardId;
+    dp.value = value;
+    dp.categoryId = category;
+
+    {
+      std::lock_guard<std::mutex> guard(subscription.mutex);
+      if (subscription.removed) {
+        return;
+      }
+      if (subscription.points.size() >= subscription.bufferSize) {
+        subscription.points.pop_front();
+        subscription.dropped++;
+        dropped++;
+      }
+      subscription.points.push_back(std::move(dp));
+    }
+    subscription.ready.notify_one();
+    published++;
+  };
+
+  if (keySubscriptions) {
+    for (const auto& subscription : *keySubscriptions) {
+      add(*subscription);
+    }
+  }
+
+  for (const auto& subscription : subscriptions->prefixes) {
+    const std::string& prefix = subscription->prefix;
+    if (key.size() < prefix.size() ||
+        strncasecmp(key.c_str(), prefix.c_str(), prefix.size()) != 0) {
+      continue;
+    }
+
+    // Points of keys that match both are only added once.
+    if (keySubscriptions &&
+        std::find(
+            keySubscriptions->begin(), keySubscriptions->end(), subscription) !=
+            keySubscriptions->end()) {
+      continue;
+    }
+    add(*subscription);
+  }
+
+  if (published > 0) {
+    pointsPublishedStat.add(published);
+  }
+  if (dropped > 0) {
+    pointsDroppedStat.add(dropped);
+  }
+}
+
+void SubscriptionManager::updateShards(const std::vector<int64_t>& shardIds) {
+  for (int64_t shardId : shardIds) {
+    auto subscriptions = std::make_shared<ShardSubscriptions>();
+    int count = 0;
+    for (const auto& it : subscriptions_) {
+      const auto& subscription = it.second;
+      bool matched = false;
+      for (const auto& key : subscription->keys) {
+        if (key.shardId != shardId) {
+          continue;
+        }
+
+        auto& keySubscriptions = subscriptions->keys[key.key.c_str()];
+        if (keySubscriptions.empty() ||
+            keySubscriptions.back() != subscription) {
+          keySubscriptions.push_back(subscription);
+        }
+        matched = true;
+      }
+
+      if (std::find(
+              subscription->prefixShards.begin(),
+              subscription->prefixShards.end(),
+              shardId) != subscription->prefixShards.end()) {
+        subscriptions->prefixes.push_back(subscription);
+        matched = true;
+      }
+
+      if (matched) {
+        count++;
+      }
+    }
+
+    Shard& shard = shards_[shardId];
+    if (count > 0) {
+      std::atomic_store(
+          &shard.subscriptions,
+          std::shared_ptr<const ShardSubscriptions>(std::move(subscriptions)));
+    } else {
+      std::atomic_store(
+          &shard.subscriptions, std::shared_ptr<const ShardSubscriptions>());
+    }
+    shard.count = count;
+  }
+}
+
+void SubscriptionManager::remove(std::shared_ptr<Subscription> subscription) {
+  subscriptions_.erase(subscription->id);
+
+  std::set<int64_t> shardIds(
+      subscription->prefixShards.begin(), subscription->prefixShards.end());
+  for (const auto& key : subscription->keys) {
+    shardIds.insert(key.shardId);
+  }
+  updateShards(std::vector<int64_t>(shardIds.begin(), shardIds.end()));
+
+  {
+    std::lock_guard<std::mutex> guard(subscription->mutex);
+    subscription->removed = true;
+    subscription->points.clear();
+  }
+  subscription->ready.notify_all();
+}
+}
+} // facebook::gorilla
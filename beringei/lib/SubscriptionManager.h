@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "beringei/if/gen-cpp2/beringei_data_types.h"
+#include "beringei/lib/CaseUtils.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class SubscriptionManager
+//
+// Keeps the new data points of the keys that clients follow until they
+// poll for them. Each subscription has a set of keys and optionally a
+// key prefix, and a bounded buffer of points that drops the oldest ones
+// when the subscriber falls behind.
+//
+// BucketMap publishes every point it adds. The subscriptions are kept
+// per shard in immutable sets that are replaced when subscriptions
+// change, so publishing doesn't take any locks for shards without
+// subscribers and only the locks of the matching subscriptions for the
+// others.
+//
+// Subscriptions that aren't polled for `idleTimeoutMs` are removed.
+//
+// All the functions can be called from any number of threads.
+class SubscriptionManager {
+ public:
+  SubscriptionManager(
+      int numShards,
+      size_t maxBufferSize,
+      size_t maxSubscriptions,
+      int64_t idleTimeoutMs);
+
+  // Returns the id of the new subscription, or 0 if there are too many
+  // subscriptions. The shards of the keys and `prefixShards` must be
+  // less than `numShards`.
+  int64_t subscribe(
+      const std::vector<Key>& keys,
+      const std::string& prefix,
+      const std::vector<int64_t>& prefixShards,
+      size_t bufferSize);
+
+  // Returns false if there was no such subscription.
+  bool unsubscribe(int64_t id);
+
+  // Moves up to `maxPoints` points of the subscription to `points`,
+  // waiting up to `timeoutMs` for the first one. 0 `maxPoints` moves
+  // all of them. Sets `dropped` to the number of points dropped since
+  // the last poll. Returns false if there is no such subscription.
+  bool poll(
+      int64_t id,
+      int64_t timeoutMs,
+      size_t maxPoints,
+      std::vector<DataPoint>& points,
+      int64_t& dropped);
+
+  // Adds the point to the subscriptions of the key.
+  void publish(
+      int64_t shardId,
+      const std::string& key,
+      const TimeValuePair& value,
+      uint16_t category) {
+    if (shardId >= 0 && shardId < numShards_ &&
+        shards_[shardId].count.load(std::memory_order_relaxed) > 0) {
+      publishToShard(shardId, key, value, category);
+    }
+  }
+
+  // Removes the subscriptions that haven't been polled recently.
+  void removeIdle();
+
+  size_t numSubscriptions();
+
+ private:
+  struct Subscription {
+    int64_t id;
+    std::vector<Key> keys;
+    std::string prefix;
+    std::vector<int64_t> prefixShards;
+    size_t bufferSize;
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<DataPoint> points;
+    int64_t dropped = 0;
+    int64_t lastPollMs = 0;
+    bool removed = false;
+  };
+
+  // The subscriptions of a shard. The keys point to the keys of the
+  // subscriptions.
+  struct ShardSubscriptions {
+    std::unordered_map<
+        const char*,
+        std::vector<std::shared_ptr<Subscription>>,
+        CaseHash,
+        CaseEq>
+        keys;
+    std::vector<std::shared_ptr<Subscription>> prefixes;
+  };
+
+  struct Shard {
+    std::atomic<int> count{0};
+    std::shared_ptr<const ShardSubscriptions> subscriptions;
+  };
+
+  void publishToShard(
+      int64_t shardId,
+      const std::string& key,
+      const TimeValuePair& value,
+      uint16_t category);
+
+  // Builds the subscription sets of the shards again. Must be called
+  // with `mutex_` held.
+  void updateShards(const std::vector<int64_t>& shardIds);
+
+  // Removes the subscription from the shards. Must be called with
+  // `mutex_` held.
+  void remove(std::shared_ptr<Subscription> subscription);
+
+  const int numShards_;
+  const size_t maxBufferSize_;
+  const size_t maxSubscriptions_;
+  const int64_t idleTimeoutMs_;
+  std::unique_ptr<Shard[]> shards_;
+
+  std::mutex mutex_;
+  std::unordered_map<int64_t, std::shared_ptr<Subscription>> subscriptions_;
+  int64_t nextId_;
+};
+}
+} // facebook::gorilla
@@ -9,6 +9,8 @@
 
 #include "TimeSeries.h"
 
+#include <algorithm>
+
 namespace {
 struct DeltaInserter
     : public std::iterator<std::output_iterator_tag, void, void, void, void> {
@@ -99,6 +101,93 @@ struct DeltaCompareInserter
   double epsilon_;
   int64_t& mismatches_;
 };
+// Merges the values of `in` between begin and end with `out` into
+// `inserter` the same way std::merge() would, but decodes the blocks
+// straight into the merge. Returns the number of values in `in`.
+template <typename Inserter>
+int64_t mergeBlocks(
+    const std::vector<facebook::gorilla::TimeSeriesBlock>& in,
+    const std::vector<facebook::gorilla::TimeValuePair>& out,
+    int64_t begin,
+    int64_t end,
+    Inserter inserter) {
+  using facebook::gorilla::TimeSeriesStream;
+  using facebook::gorilla::TimeValuePair;
+
+  size_t next = 0;
+  int64_t count = 0;
+  for (const auto& block : in) {
+    count += TimeSeriesStream::visitValues(
+        block.data,
+        block.checkpoints,
+        block.count,
+        begin,
+        end,
+        [&](int64_t unixTime, double value) {
+          TimeValuePair tv;
+          tv.unixTime = unixTime;
+          tv.value = value;
+          while (next < out.size() && !(tv < out[next])) {
+            *inserter++ = out[next++];
+          }
+          *inserter++ = tv;
+        });
+  }
+
+  while (next < out.size()) {
+    *inserter++ = out[next++];
+  }
+  return count;
+}
+
+// The data points of the blocks of one input of a k-way merge, decoded
+// one at a time.
+class MergeInput {
+ public:
+  MergeInput(
+      const std::vector<facebook::gorilla::TimeSeriesBlock>& blocks,
+      int64_t begin,
+      int64_t end)
+      : blocks_(&blocks), nextBlock_(0), begin_(begin), end_(end) {}
+
+  // Moves `head` to the next data point. Returns false after the last
+  // one.
+  bool next() {
+    while (!reader_.next(head.unixTime, head.value)) {
+      if (nextBlock_ >= blocks_->size()) {
+        return false;
+      }
+      const auto& block = (*blocks_)[nextBlock_++];
+      reader_ = facebook::gorilla::TimeSeriesStream::Reader(
+          block.data, block.checkpoints, block.count, begin_, end_);
+    }
+    return true;
+  }
+
+  facebook::gorilla::TimeValuePair head;
+
+ private:
+  const std::vector<facebook::gorilla::TimeSeriesBlock>* blocks_;
+  size_t nextBlock_;
+  int64_t begin_;
+  int64_t end_;
+  facebook::gorilla::TimeSeriesStream::Reader reader_;
+};
+
+// Adds a merged data point that was in the inputs set in `inputs` to
+// the stats of each input.
+void countMergedPoint(
+    uint64_t inputs,
+    std::vector<facebook::gorilla::TimeSeries::MergeStats>& stats) {
+  for (size_t i = 0; i < stats.size(); i++) {
+    bool before = (inputs & ((1ULL << i) - 1)) != 0;
+    if (inputs & (1ULL << i)) {
+      stats[i].added += before ? 0 : 1;
+    } else if (before) {
+      stats[i].missing++;
+    }
+  }
+}
 } // namespace
 
 namespace facebook {
@@ -106,15 +195,201 @@ namespace gorilla {
 
 void TimeSeries::writeValues(
     const std::vector<TimeValuePair>& values,
-    TimeSeriesBlock& block) {
+    TimeSeriesBlock& block,
+    int checkpointInterval,
+    bool approximate) {
   TimeSeriesStream stream;
+  if (approximate) {
+    stream.setApproximate();
+  }
 
+  // Values with milliseconds get a millisecond stream.
+  bool milliseconds = std::any_of(
+      values.begin(), values.end(), [](const TimeValuePair& value) {
+        return value.ms != 0;
+      });
   for (const auto& value : values) {
-    if (stream.append(value, 0)) {
+    bool added = milliseconds
+        ? stream.appendMilliseconds(
+              value.unixTime * kGorillaMsPerSecond + value.ms, value.value, 0)
+        : stream.append(value, 0);
+    if (added) {
       block.count++;
     }
   }
   stream.readData(block.data);
+
+  if (checkpointInterval > 0) {
+    TimeSeriesStream::writeCheckpoints(
+        block.data, block.count, checkpointInterval, block.checkpoints);
+  }
+}
+
+void TimeSeries::writeCheckpoints(
+    std::vector<TimeSeriesBlock>& blocks,
+    int interval) {
+  for (auto& block : blocks) {
+    if (block.checkpoints.empty()) {
+      TimeSeriesStream::writeCheckpoints(
+          block.data, block.count, interval, block.checkpoints);
+    }
+  }
+}
+
+bool TimeSeries::isApproximate(const TimeSeriesBlock& block) {
+  return TimeSeriesStream::isApproximate(block.data);
+}
+
+bool TimeSeries::coalesceBlocks(
+    std::vector<TimeSeriesBlock>& blocks,
+    size_t begin,
+    size_t end) {
+  end = std::min(end, blocks.size());
+  if (begin + 1 >= end) {
+    return true;
+  }
+
+  int count = 0;
+  bool approximate = false;
+  for (size_t i = begin; i < end; i++) {
+    if (blocks[i].count == 0) {
+      continue;
+    }
+    if (count == 0) {
+      approximate = isApproximate(blocks[i]);
+    } else if (isApproximate(blocks[i]) != approximate) {
+      return false;
+    }
+    count += blocks[i].count;
+  }
+
+  std::vector<TimeValuePair> values;
+  values.reserve(count);
+  for (size_t i = begin; i < end; i++) {
+    getValues(
+        blocks[i],
+        values,
+        std::numeric_limits<int64_t>::min(),
+        std::numeric_limits<int64_t>::max());
+  }
+
+  TimeSeriesBlock block;
+  writeValues(values, block, 0, approximate);
+  blocks[begin] = std::move(block);
+  blocks.erase(blocks.begin() + begin + 1, blocks.begin() + end);
+  return true;
+}
+
+void TimeSeries::trimBlocks(
+    std::vector<TimeSeriesBlock>& blocks,
+    int64_t begin,
+    int64_t end) {
+  size_t kept = 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    TimeSeriesBlock& block = blocks[i];
+    if (block.count == 0 || block.data.empty()) {
+      continue;
+    }
+
+    int64_t first = TimeSeriesStream::getFirstTimeStamp(block.data);
+    if (first > end) {
+      // Neither this block nor the ones after it are in the range.
+      break;
+    }
+
+    // The points of this block are all before the first point of the
+    // next one.
+    bool hasNext = i + 1 < blocks.size() && !blocks[i + 1].data.empty();
+    int64_t next =
+        hasNext ? TimeSeriesStream::getFirstTimeStamp(blocks[i + 1].data) : 0;
+    if (hasNext && next <= begin) {
+      continue;
+    }
+
+    if (first < begin || !hasNext || next > end + 1) {
+      std::vector<TimeValuePair> values;
+      getValues(block, values, begin, end);
+      if (values.empty()) {
+        continue;
+      }
+      if (values.size() < block.count) {
+        bool approximate = isApproximate(block);
+        block = TimeSeriesBlock();
+        writeValues(values, block, 0, approximate);
+      }
+    }
+
+    if (kept != i) {
+      blocks[kept] = std::move(block);
+    }
+    kept++;
+  }
+  blocks.resize(kept);
+}
+
+void TimeSeries::appendColumnar(
+    const TimeSeriesData& in,
+    GetDataColumnarResult& out) {
+  out.keyBlockOffsets.push_back(out.blockOffsets.size());
+  out.statuses.push_back(in.status);
+  for (const auto& block : in.data) {
+    out.blockOffsets.push_back(out.data.size());
+    out.blockCounts.push_back(block.count);
+    out.data.append(block.data.data(), block.data.size());
+  }
+}
+
+// Returns the range of blocks of the given key.
+static std::pair<size_t, size_t> getColumnarBlocks(
+    const GetDataColumnarResult& in,
+    size_t key) {
+  if (key >= in.keyBlockOffsets.size()) {
+    return {0, 0};
+  }
+
+  size_t first = in.keyBlockOffsets[key];
+  size_t last = key + 1 < in.keyBlockOffsets.size()
+      ? in.keyBlockOffsets[key + 1]
+      : in.blockOffsets.size();
+  return {first, std::min(last, in.blockOffsets.size())};
+}
+
+int TimeSeries::getCount(const GetDataColumnarResult& in, size_t key) {
+  auto blocks = getColumnarBlocks(in, key);
+  int count = 0;
+  for (size_t i = blocks.first; i < blocks.second; i++) {
+    count += in.blockCounts[i];
+  }
+  return count;
+}
+
+int TimeSeries::getValues(
+    const GetDataColumnarResult& in,
+    size_t key,
+    int64_t* timestamps,
+    double* values,
+    int64_t begin,
+    int64_t end) {
+  auto blocks = getColumnarBlocks(in, key);
+  int count = 0;
+  for (size_t i = blocks.first; i < blocks.second; i++) {
+    size_t blockBegin = in.blockOffsets[i];
+    size_t blockEnd = i + 1 < in.blockOffsets.size() ? in.blockOffsets[i + 1]
+                                                     : in.data.size();
+    if (blockBegin > blockEnd || blockEnd > in.data.size()) {
+      LOG(ERROR) << "Invalid block offsets in columnar result";
+      break;
+    }
+
+    count += TimeSeriesStream::readValues(
+        timestamps + count,
+        values + count,
+        folly::StringPiece(in.data.data() + blockBegin, blockEnd - blockBegin),
+        in.blockCounts[i],
+        begin,
+        end);
+  }
+  return count;
 }
 
 void TimeSeries::mergeValues(
@@ -126,21 +401,130 @@ void TimeSeries::mergeValues(
     bool compareValues,
     double mismatchEpsilon,
     int64_t* inSize,
-    int64_t* mismatches) {
-  std::vector<facebook::gorilla::TimeValuePair> resultData;
-  TimeSeries::getValues(in, resultData, begin, end);
+    int64_t* mismatchesOut) {
+  // This is the first copy.
+  if (out.empty()) {
+    TimeSeries::getValues(in, out, begin, end);
+    if (inSize) {
+      *inSize = out.size();
+    }
+    return;
+  }
+
+  size_t inCount = 0;
+  for (const auto& block : in) {
+    inCount += block.count;
+  }
+
+  std::vector<TimeValuePair> newData;
+  newData.reserve(std::max(out.size(), inCount));
+
+  int64_t count;
+  if (compareValues) {
+    int64_t mismatches = 0;
+    count = mergeBlocks(
+        in,
+        out,
+        begin,
+        end,
+        DeltaCompareInserter(
+            newData, minTimestampDelta, mismatchEpsilon, mismatches));
+    if (mismatchesOut) {
+      *mismatchesOut = mismatches;
+    }
+  } else {
+    count = mergeBlocks(
+        in, out, begin, end, DeltaInserter(newData, minTimestampDelta));
+  }
 
   if (inSize) {
-    *inSize = resultData.size();
+    *inSize = count;
+  }
+  std::swap(out, newData);
+}
+
+void TimeSeries::mergeValues(
+    const std::vector<const std::vector<TimeSeriesBlock>*>& in,
+    std::vector<facebook::gorilla::TimeValuePair>& out,
+    int64_t begin,
+    int64_t end,
+    int32_t minTimestampDelta,
+    bool compareValues,
+    double mismatchEpsilon,
+    std::vector<MergeStats>* stats) {
+  CHECK(!stats || in.size() <= 64) << "Too many inputs for merge stats";
+
+  // The copies usually hold about the same points, so the biggest one
+  // is the best guess of the merged size.
+  size_t maxCount = 0;
+  std::vector<MergeInput> inputs;
+  inputs.reserve(in.size());
+  for (const auto* blocks : in) {
+    size_t count = 0;
+    for (const auto& block : *blocks) {
+      count += block.count;
+    }
+    maxCount = std::max(maxCount, count);
+    inputs.emplace_back(*blocks, begin, end);
   }
 
-  TimeSeries::mergeValues(
-      std::move(resultData),
-      out,
-      minTimestampDelta,
-      compareValues,
-      mismatchEpsilon,
-      mismatches);
+  out.clear();
+  out.reserve(maxCount);
+  if (stats) {
+    stats->assign(in.size(), MergeStats());
+  }
+
+  std::vector<bool> active(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    active[i] = inputs[i].next();
+  }
+
+  // The inputs that had the last merged data point and the one it was
+  // taken from.
+  uint64_t merged = 0;
+  int mergedFrom = 0;
+  while (true) {
+    int first = -1;
+    for (int i = 0; i < inputs.size(); i++) {
+      if (active[i] &&
+          (first < 0 ||
+           inputs[i].head.unixTime < inputs[first].head.unixTime)) {
+        first = i;
+      }
+    }
+    if (first < 0) {
+      break;
+    }
+
+    // Only points of different inputs are too close to each other, so
+    // a single input is copied as is.
+    const TimeValuePair& tv = inputs[first].head;
+    if (out.empty() || first == mergedFrom ||
+        tv.unixTime - out.back().unixTime >= minTimestampDelta) {
+      if (stats && !out.empty()) {
+        countMergedPoint(merged, *stats);
+      }
+      out.push_back(tv);
+      merged = 0;
+      mergedFrom = first;
+    } else if (
+        stats && compareValues &&
+        std::abs(tv.value - out.back().value) >
+            std::max(mismatchEpsilon * std::abs(out.back().value),
+                     mismatchEpsilon)) {
+      (*stats)[std::max(first, mergedFrom)].mismatches++;
+    }
+
+    if (stats) {
+      (*stats)[first].in++;
+      merged |= 1ULL << first;
+    }
+    active[first] = inputs[first].next();
+  }
+
+  if (stats && !out.empty()) {
+    countMergedPoint(merged, *stats);
+  }
 }
 
 void TimeSeries::mergeValues(
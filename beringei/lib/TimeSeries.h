@@ -20,10 +20,22 @@ namespace gorilla {
 
 class TimeSeries {
  public:
-  // Build a TimeSeriesBlock from the given TimeValues.
+  // Build a TimeSeriesBlock from the given TimeValues. If
+  // `checkpointInterval` is positive, also adds a decoder checkpoint
+  // every `checkpointInterval` values so that reading a narrow time
+  // range doesn't need to decode the whole block. `approximate` marks
+  // the values as an approximation of the real ones. The milliseconds
+  // of the values are kept if any of them has some.
   static void writeValues(
       const std::vector<TimeValuePair>& values,
-      TimeSeriesBlock& block);
+      TimeSeriesBlock& block,
+      int checkpointInterval = 0,
+      bool approximate = false);
+
+  // True if the values of `block` are only an approximation, e.g.,
+  // because the block was lossily compressed when its bucket was
+  // finalized.
+  static bool isApproximate(const TimeSeriesBlock& block);
 
   // Append all uncompressed data points that fall between begin and
   // end inclusive to the given datastructure.
@@ -33,7 +45,8 @@ class TimeSeries {
       T& values,
       int64_t begin,
       int64_t end) {
-    TimeSeriesStream::readValues(values, block.data, block.count, begin, end);
+    TimeSeriesStream::readValues(
+        values, block.data, block.checkpoints, block.count, begin, end);
   }
 
   template <typename T>
@@ -47,6 +60,106 @@ class TimeSeries {
     }
   }
 
+  // Write all uncompressed data points that fall between begin and
+  // end inclusive to the given timestamp and value arrays. The arrays
+  // must have space for `block.count` values. Returns the number of
+  // data points written.
+  static int getValues(
+      const TimeSeriesBlock& block,
+      int64_t* timestamps,
+      double* values,
+      int64_t begin,
+      int64_t end) {
+    return TimeSeriesStream::readValues(
+        timestamps,
+        values,
+        block.data,
+        block.checkpoints,
+        block.count,
+        begin,
+        end);
+  }
+
+  // Same as above for multiple blocks. The arrays must have space for
+  // the sum of the counts of all the blocks.
+  static int getValues(
+      const std::vector<TimeSeriesBlock>& in,
+      int64_t* timestamps,
+      double* values,
+      int64_t begin,
+      int64_t end) {
+    int count = 0;
+    for (const auto& block : in) {
+      count += TimeSeries::getValues(
+          block, timestamps + count, values + count, begin, end);
+    }
+    return count;
+  }
+
+  // Drops the blocks of one time series that have no data points
+  // between begin and end inclusive and re-encodes the ones that only
+  // partly do, so that only the points in the range are left. The
+  // blocks must be in time order. The first timestamp of a block is
+  // read from its header, and the next block starts after its last
+  // one, so only the blocks at the edges of the range are decoded.
+  static void trimBlocks(
+      std::vector<TimeSeriesBlock>& blocks,
+      int64_t begin,
+      int64_t end);
+
+  // Re-encodes the blocks [begin, end) of one time series into a single
+  // block in their place, so that a long read doesn't send and decode a
+  // header per bucket. The blocks must be in time order. Returns false
+  // and leaves them as they are if some of them are approximate and
+  // some aren't.
+  static bool coalesceBlocks(
+      std::vector<TimeSeriesBlock>& blocks,
+      size_t begin,
+      size_t end);
+
+  // Writes the checkpoints of the blocks that have more than `interval`
+  // values and no checkpoints yet. See
+  // TimeSeriesStream::writeCheckpoints().
+  static void writeCheckpoints(
+      std::vector<TimeSeriesBlock>& blocks,
+      int interval);
+
+  // Append the blocks of one key to a columnar getData result.
+  static void appendColumnar(
+      const TimeSeriesData& in,
+      GetDataColumnarResult& out);
+
+  // Number of data points in all the blocks of key `key` of a columnar
+  // result. The sum of `blockCounts` is the number of points in the
+  // whole result, so one pair of arrays of that size fits all the keys.
+  static int getCount(const GetDataColumnarResult& in, size_t key);
+
+  // Write all uncompressed data points of key `key` in a columnar
+  // result that fall between begin and end inclusive to the given
+  // arrays. The arrays must have space for `getCount(in, key)` values.
+  // Returns the number of data points written.
+  static int getValues(
+      const GetDataColumnarResult& in,
+      size_t key,
+      int64_t* timestamps,
+      double* values,
+      int64_t begin,
+      int64_t end);
+
+  // Call `visitor(unixTime, value)` for all the data points that fall
+  // between begin and end inclusive without materializing them.
+  template <typename Visitor>
+  static void visitValues(
+      const std::vector<TimeSeriesBlock>& in,
+      int64_t begin,
+      int64_t end,
+      Visitor&& visitor) {
+    for (const auto& block : in) {
+      TimeSeriesStream::visitValues(
+          block.data, block.checkpoints, block.count, begin, end, visitor);
+    }
+  }
+
   // Merge all uncompressed data points that fall between begin and
   // end inclusive to the given datastructure.  When non-null, inSize
   // becomes number of entries from in, and mismatches the number of
@@ -76,6 +189,44 @@ class TimeSeries {
       bool compareValues,
       double mismatchEpsilon,
       int64_t* mismatches);
+
+  // What one input contributed to a merge of many inputs.
+  struct MergeStats {
+    // Data points of the input between begin and end.
+    int64_t in = 0;
+
+    // Merged data points that are in this input but in none of the
+    // inputs before it.
+    int64_t added = 0;
+
+    // Merged data points that are in one of the inputs before this one
+    // but not in this one.
+    int64_t missing = 0;
+
+    // Data points that were dropped as too close to a merged one and
+    // didn't match its value, counted for the later of the two inputs
+    // like when merging one input at a time. Only with compareValues.
+    int64_t mismatches = 0;
+  };
+
+  // Merges the data points between begin and end inclusive of many
+  // copies of a time series, e.g., the answers of each service, in one
+  // pass: the blocks of all the inputs are decoded in step and the
+  // points go straight into `out`, which is replaced. The first input
+  // wins ties, and points that are less than minTimestampDelta after
+  // the last merged one are dropped if that one came from another
+  // input, so the points of a single input are all kept.
+  // `stats` gets one entry per input when not null. At most 64 inputs
+  // are supported with stats.
+  static void mergeValues(
+      const std::vector<const std::vector<TimeSeriesBlock>*>& in,
+      std::vector<facebook::gorilla::TimeValuePair>& out,
+      int64_t begin,
+      int64_t end,
+      int32_t minTimestampDelta,
+      bool compareValues,
+      double mismatchEpsilon,
+      std::vector<MergeStats>* stats);
 };
 }
 } // facebook::gorilla
@@ -9,9 +9,11 @@
 
 #pragma once
 
+#include <string.h>
+
 #include <gflags/gflags.h>
 
-#include "BitUtil.h"
+#include "BitReader.h"
 
 DECLARE_int64(gorilla_blacklisted_time_min);
 DECLARE_int64(gorilla_blacklisted_time_max);
@@ -39,6 +41,21 @@ addValueToOutput(T& out, int64_t unixTime, double value) {
   out[unixTime] = value;
 }
 
+template <typename T>
+inline typename std::enable_if<is_vector<T>::value>::type
+addMillisecondValueToOutput(T& out, int64_t unixTimeMs, double value) {
+  out.emplace_back();
+  out.back().unixTime = unixTimeMs / kGorillaMsPerSecond;
+  out.back().ms = unixTimeMs % kGorillaMsPerSecond;
+  out.back().value = value;
+}
+
+template <typename T>
+inline typename std::enable_if<!is_vector<T>::value>::type
+addMillisecondValueToOutput(T& out, int64_t unixTimeMs, double value) {
+  out[unixTimeMs / kGorillaMsPerSecond] = value;
+}
+
 // Call reserve() only if it exists.
 template <typename T>
 inline typename std::enable_if<
@@ -51,72 +68,427 @@ inline void reserve(...) {}
 
 } // namespace
 
+inline int64_t TimeSeriesStream::readNextTimestamp(
+    BitReader& reader,
+    int64_t& prevValue,
+    int64_t& prevDelta,
+    bool milliseconds) {
+  uint32_t type = reader.findTheFirstZeroBit(4);
+  if (type > 0) {
+    // Delta of delta is non zero. Calculate the new delta. `index`
+    // will be used to find the right length for the value that is
+    // read.
+    const TimestampEncoding& encoding = UNLIKELY(milliseconds)
+        ? millisecondTimestampEncodings[type - 1]
+        : timestampEncodings[type - 1];
+    int64_t decodedValue = reader.read(encoding.bitsForValue);
+
+    // [0,255] becomes [-128,127]
+    decodedValue -= ((int64_t)1 << (encoding.bitsForValue - 1));
+    if (decodedValue >= 0) {
+      // [-128,127] becomes [-128,128] without the zero in the middle
+      decodedValue++;
+    }
+
+    prevDelta += decodedValue;
+  }
+
+  prevValue += prevDelta;
+  return prevValue;
+}
+
+inline int64_t TimeSeriesStream::readFirstTimestamp(
+    BitReader& reader,
+    ValueState& state) {
+  int64_t timestamp = reader.read(kBitsForFirstTimestamp);
+  if (UNLIKELY(timestamp == kApproximateValuesTimestamp)) {
+    timestamp = reader.read(kBitsForFirstTimestamp);
+  }
+  if (UNLIKELY(timestamp == kMillisecondsTimestamp)) {
+    state.milliseconds = true;
+    timestamp = reader.read(kBitsForFirstTimestamp);
+    if (timestamp == kIntegerValuesTimestamp) {
+      state.integerValues = true;
+      return reader.read(kBitsForFirstMillisecondTimestamp);
+    }
+
+    // The timestamp comes right after the marker, and these were its
+    // top bits, which can't be a marker.
+    uint32_t lowBits =
+        kBitsForFirstMillisecondTimestamp - kBitsForFirstTimestamp;
+    return (timestamp << lowBits) | reader.read(lowBits);
+  }
+  if (UNLIKELY(timestamp == kIntegerValuesTimestamp)) {
+    state.integerValues = true;
+    timestamp = reader.read(kBitsForFirstTimestamp);
+  }
+  return timestamp;
+}
+
+inline double TimeSeriesStream::readNextValue(
+    BitReader& reader,
+    ValueState& state) {
+  if (UNLIKELY(state.integerValues)) {
+    return readNextIntegerValue(reader, state);
+  }
+  return readNextXorValue(reader, state);
+}
+
+inline double TimeSeriesStream::readNextIntegerValue(
+    BitReader& reader,
+    ValueState& state) {
+  uint32_t type = reader.findTheFirstZeroBit(kIntegerControlLimit);
+  if (UNLIKELY(type == kIntegerControlLimit)) {
+    // The rest of the values are XORed with the previous integer as a
+    // double.
+    double previous = (int64_t)state.previousValue;
+    memcpy(&state.previousValue, &previous, sizeof(previous));
+    state.previousLeadingZeros = 0;
+    state.previousTrailingZeros = 0;
+    state.integerValues = false;
+    return readNextXorValue(reader, state);
+  }
+
+  if (type > 0) {
+    uint64_t zigzag = reader.read(integerEncodings[type - 1].bitsForValue);
+    state.previousIntegerDelta +=
+        (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+  }
+
+  int64_t value = (int64_t)state.previousValue + state.previousIntegerDelta;
+  state.previousValue = value;
+  return value;
+}
+
+inline double TimeSeriesStream::readNextXorValue(
+    BitReader& reader,
+    ValueState& state) {
+  uint32_t nonZeroValue = reader.read(1);
+
+  if (!nonZeroValue) {
+    double* p = (double*)&state.previousValue;
+    return *p;
+  }
+
+  uint32_t usePreviousBlockInformation = reader.read(1);
+
+  uint64_t xorValue;
+  if (usePreviousBlockInformation) {
+    xorValue = reader.read(
+        64 - state.previousLeadingZeros - state.previousTrailingZeros);
+    xorValue <<= state.previousTrailingZeros;
+  } else {
+    // Leading zeros and block size are adjacent, so read them in one go.
+    uint64_t blockInformation =
+        reader.read(kLeadingZerosLengthBits + kBlockSizeLengthBits);
+    uint64_t leadingZeros = blockInformation >> kBlockSizeLengthBits;
+    uint64_t blockSize =
+        (blockInformation & ((1 << kBlockSizeLengthBits) - 1)) +
+        kBlockSizeAdjustment;
+    state.previousTrailingZeros = 64 - blockSize - leadingZeros;
+    xorValue = reader.read(blockSize);
+    xorValue <<= state.previousTrailingZeros;
+    state.previousLeadingZeros = leadingZeros;
+  }
+
+  uint64_t value = xorValue ^ state.previousValue;
+  state.previousValue = value;
+
+  double* p = (double*)&value;
+  return *p;
+}
+
 template <typename T>
 int TimeSeriesStream::readValues(
     T& out,
     folly::StringPiece data,
+    folly::StringPiece checkpoints,
     int n,
     int64_t begin,
     int64_t end) {
   if (data.empty() || n == 0) {
     return 0;
   }
-  int count = 0;
-  try {
-    reserve(&out, out.size() + n);
 
-    uint64_t previousValue = 0;
-    uint64_t previousLeadingZeros = 0;
-    uint64_t previousTrailingZeros = 0;
-    uint64_t bitPos = 0;
-    int64_t previousTimestampDelta = kDefaultDelta;
+  reserve(&out, out.size() + n);
+  if (UNLIKELY(isMilliseconds(data))) {
+    auto visitor = [&out](int64_t unixTimeMs, double value) {
+      addMillisecondValueToOutput(out, unixTimeMs, value);
+    };
+    return visitNativeValues(data, checkpoints, n, begin, end, true, visitor);
+  }
+  return visitValues(
+      data, checkpoints, n, begin, end, [&out](int64_t unixTime, double value) {
+        addValueToOutput(out, unixTime, value);
+      });
+}
 
-    int64_t firstTimestamp =
-        BitUtil::readValueFromBitString(data, bitPos, kBitsForFirstTimestamp);
-    double firstValue = readNextValue(
-        data,
-        bitPos,
-        previousValue,
-        previousLeadingZeros,
-        previousTrailingZeros);
-    int64_t previousTimestamp = firstTimestamp;
-
-    // If the first data point is after the query range, return nothing.
-    if (firstTimestamp > end) {
-      return 0;
-    }
+template <bool kCheckEnd, bool kCheckBlacklist, typename Visitor>
+inline void TimeSeriesStream::visitRemainingValues(
+    BitReader& reader,
+    ValueState& valueState,
+    int64_t unixTime,
+    int64_t previousTimestampDelta,
+    int i,
+    int n,
+    int64_t end,
+    int64_t blacklistedMin,
+    int64_t blacklistedMax,
+    Visitor& visitor,
+    int& count) {
+  const bool milliseconds = valueState.milliseconds;
+  for (; i < n; i++) {
+    unixTime = readNextTimestamp(
+        reader, unixTime, previousTimestampDelta, milliseconds);
+    double value = readNextValue(reader, valueState);
 
-    if (firstTimestamp >= begin) {
-      addValueToOutput(out, firstTimestamp, firstValue);
-      count++;
+    if (kCheckEnd && unixTime > end) {
+      break;
+    }
+    if (kCheckBlacklist && unixTime >= blacklistedMin &&
+        unixTime <= blacklistedMax) {
+      continue;
     }
 
-    for (int i = 1; i < n; i++) {
-      int64_t unixTime = readNextTimestamp(
-          data, bitPos, previousTimestamp, previousTimestampDelta);
-      double value = readNextValue(
-          data,
-          bitPos,
-          previousValue,
-          previousLeadingZeros,
-          previousTrailingZeros);
+    visitor(unixTime, value);
+    count++;
+  }
+}
+
+inline int64_t TimeSeriesStream::getFirstMillisecond(int64_t unixTime) {
+  const int64_t min = std::numeric_limits<int64_t>::min();
+  if (unixTime <= min / kGorillaMsPerSecond) {
+    return min;
+  }
+  return unixTime * kGorillaMsPerSecond;
+}
+
+inline int64_t TimeSeriesStream::getLastMillisecond(int64_t unixTime) {
+  const int64_t max = std::numeric_limits<int64_t>::max();
+  if (unixTime >= max / kGorillaMsPerSecond) {
+    return max;
+  }
+  return unixTime * kGorillaMsPerSecond + kGorillaMsPerSecond - 1;
+}
+
+template <typename Visitor>
+int TimeSeriesStream::visitValues(
+    folly::StringPiece data,
+    folly::StringPiece checkpoints,
+    int n,
+    int64_t begin,
+    int64_t end,
+    Visitor&& visitor) {
+  if (UNLIKELY(isMilliseconds(data))) {
+    auto secondsVisitor = [&visitor](int64_t unixTimeMs, double value) {
+      visitor(unixTimeMs / kGorillaMsPerSecond, value);
+    };
+    return visitNativeValues(
+        data, checkpoints, n, begin, end, true, secondsVisitor);
+  }
+  return visitNativeValues(data, checkpoints, n, begin, end, false, visitor);
+}
 
+template <typename Visitor>
+int TimeSeriesStream::visitNativeValues(
+    folly::StringPiece data,
+    folly::StringPiece checkpoints,
+    int n,
+    int64_t begin,
+    int64_t end,
+    bool milliseconds,
+    Visitor& visitor) {
+  if (data.empty() || n == 0) {
+    return 0;
+  }
+
+  int64_t blacklistedMin = FLAGS_gorilla_blacklisted_time_min;
+  int64_t blacklistedMax = FLAGS_gorilla_blacklisted_time_max;
+  if (milliseconds) {
+    begin = getFirstMillisecond(begin);
+    end = getLastMillisecond(end);
+    blacklistedMin = getFirstMillisecond(blacklistedMin);
+    blacklistedMax = getLastMillisecond(blacklistedMax);
+  }
+
+  int count = 0;
+  try {
+    ValueState valueState;
+    valueState.milliseconds = milliseconds;
+    int64_t previousTimestampDelta = kDefaultDelta;
+    int64_t unixTime = 0;
+    double value = 0;
+    BitReader reader(data);
+
+    int i = seekToCheckpoint(
+        reader,
+        checkpoints,
+        n,
+        begin,
+        unixTime,
+        previousTimestampDelta,
+        valueState);
+    if (i == 0) {
+      unixTime = readFirstTimestamp(reader, valueState);
+      value = readNextValue(reader, valueState);
+
+      // If the first data point is after the query range, return nothing.
       if (unixTime > end) {
-        break;
+        return 0;
       }
 
+      i = 1;
       if (unixTime >= begin) {
-        if (unixTime < FLAGS_gorilla_blacklisted_time_min ||
-            unixTime > FLAGS_gorilla_blacklisted_time_max) {
-          addValueToOutput(out, unixTime, value);
-          count++;
+        visitor(unixTime, value);
+        count++;
+      }
+    }
+
+    if (unixTime < begin) {
+      // Timestamps in a stream never decrease, so skip everything
+      // before `begin` without looking at the values.
+      while (i < n) {
+        unixTime = readNextTimestamp(
+            reader, unixTime, previousTimestampDelta, milliseconds);
+        value = readNextValue(reader, valueState);
+        i++;
+        if (unixTime >= begin) {
+          break;
         }
       }
+
+      if (unixTime < begin || unixTime > end) {
+        return 0;
+      }
+
+      if (unixTime < blacklistedMin || unixTime > blacklistedMax) {
+        visitor(unixTime, value);
+        count++;
+      }
+    }
+
+    // The rest of the values come at or after `unixTime`, so the
+    // blacklist only matters if it ends after it, and the end of the
+    // range only if it's before the last possible timestamp.
+    bool checkEnd = end < std::numeric_limits<int64_t>::max();
+    bool checkBlacklist = blacklistedMin <= end && blacklistedMax >= unixTime;
+    if (checkEnd && checkBlacklist) {
+      visitRemainingValues<true, true>(
+          reader,
+          valueState,
+          unixTime,
+          previousTimestampDelta,
+          i,
+          n,
+          end,
+          blacklistedMin,
+          blacklistedMax,
+          visitor,
+          count);
+    } else if (checkEnd) {
+      visitRemainingValues<true, false>(
+          reader,
+          valueState,
+          unixTime,
+          previousTimestampDelta,
+          i,
+          n,
+          end,
+          blacklistedMin,
+          blacklistedMax,
+          visitor,
+          count);
+    } else if (checkBlacklist) {
+      visitRemainingValues<false, true>(
+          reader,
+          valueState,
+          unixTime,
+          previousTimestampDelta,
+          i,
+          n,
+          end,
+          blacklistedMin,
+          blacklistedMax,
+          visitor,
+          count);
+    } else {
+      visitRemainingValues<false, false>(
+          reader,
+          valueState,
+          unixTime,
+          previousTimestampDelta,
+          i,
+          n,
+          end,
+          blacklistedMin,
+          blacklistedMax,
+          visitor,
+          count);
     }
   } catch (const std::runtime_error& e) {
     LOG(ERROR) << "Error decoding data from Gorilla: " << e.what();
   }
   return count;
 }
+
+inline bool TimeSeriesStream::Reader::next(int64_t& unixTime, double& value) {
+  try {
+    if (i_ == 0 && n_ > 0) {
+      valueState_.milliseconds = milliseconds_;
+      i_ = seekToCheckpoint(
+          reader_,
+          checkpoints_,
+          n_,
+          begin_,
+          previousTimestamp_,
+          previousTimestampDelta_,
+          valueState_);
+      if (i_ == 0) {
+        int64_t firstTimestamp = readFirstTimestamp(reader_, valueState_);
+        double firstValue = readNextValue(reader_, valueState_);
+        previousTimestamp_ = firstTimestamp;
+        i_ = 1;
+
+        if (firstTimestamp > end_) {
+          n_ = 0;
+          return false;
+        }
+        if (firstTimestamp >= begin_) {
+          unixTime = milliseconds_ ? firstTimestamp / kGorillaMsPerSecond
+                                   : firstTimestamp;
+          value = firstValue;
+          return true;
+        }
+      }
+    }
+
+    while (i_ < n_) {
+      int64_t nextTime = readNextTimestamp(
+          reader_, previousTimestamp_, previousTimestampDelta_, milliseconds_);
+      double nextValue = readNextValue(reader_, valueState_);
+      i_++;
+
+      if (nextTime > end_) {
+        break;
+      }
+      if (nextTime < begin_) {
+        continue;
+      }
+      if (milliseconds_) {
+        nextTime /= kGorillaMsPerSecond;
+      }
+      if (nextTime < FLAGS_gorilla_blacklisted_time_min ||
+          nextTime > FLAGS_gorilla_blacklisted_time_max) {
+        unixTime = nextTime;
+        value = nextValue;
+        return true;
+      }
+    }
+  } catch (const std::runtime_error& e) {
+    LOG(ERROR) << "Error decoding data from Gorilla: " << e.what();
+  }
+  n_ = 0;
+  return false;
+}
 }
 } // facebook::gorilla
@@ -9,9 +9,12 @@
 
 #include "TimeSeriesStream.h"
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include "BitUtil.h"
+#include "BitWriter.h"
 
 DEFINE_int64(
     gorilla_blacklisted_time_min,
@@ -23,32 +26,144 @@ DEFINE_int64(
     0,
     "Upper time for blacklisted unix times to not return when decompressing"
     " gorilla block");
+DEFINE_bool(
+    gorilla_integer_values,
+    false,
+    "Store the values of time series that start with an integer as deltas "
+    "of deltas of integers instead of XORs of doubles. Only enable after "
+    "every reader of the data understands the encoding.");
 
 namespace facebook {
 namespace gorilla {
 
-struct {
-  int64_t bitsForValue;
-  uint32_t controlValue;
-  uint32_t controlValueBitLength;
-} static const timestampEncodings[4] = {{7, 2, 2},
-                                        {9, 6, 3},
-                                        {12, 14, 4},
-                                        {32, 15, 4}};
+namespace {
+
+// Room reserved for each value appended by appendBatch(). Most values
+// of regular time series take a few bits.
+const size_t kBytesPerBatchedValue = 2;
+
+// Copies the next `numBits` bits of `reader` to `writer`.
+void copyBits(BitReader& reader, BitWriter& writer, uint64_t numBits) {
+  while (numBits > 0) {
+    uint32_t bits = std::min<uint64_t>(numBits, 64);
+    writer.write(reader.read(bits), bits);
+    numBits -= bits;
+  }
+}
+
+void appendLittleEndian(uint64_t value, int bytes, std::string& out) {
+  for (int i = 0; i < bytes; i++) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+uint64_t readLittleEndian(const char* data, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+  }
+  return value;
+}
+}
+
+const TimeSeriesStream::TimestampEncoding
+    TimeSeriesStream::timestampEncodings[4] = {{7, 2, 2},
+                                               {9, 6, 3},
+                                               {12, 14, 4},
+                                               {32, 15, 4}};
+
+const TimeSeriesStream::TimestampEncoding
+    TimeSeriesStream::millisecondTimestampEncodings[4] = {{8, 2, 2},
+                                                          {12, 6, 3},
+                                                          {16, 14, 4},
+                                                          {32, 15, 4}};
+
+const TimeSeriesStream::IntegerEncoding
+    TimeSeriesStream::integerEncodings[4] = {{6, 2, 2},
+                                             {13, 6, 3},
+                                             {20, 14, 4},
+                                             {56, 30, 5}};
 
 TimeSeriesStream::TimeSeriesStream() {
   prevTimestamp_ = 0;
+  previousValueLeadingZeros_ = 0;
   reset();
 }
 
+TimeSeriesStream::TimeSeriesStream(const TimeSeriesStream& other)
+    : data_(other.data_),
+      previousValue_(other.previousValue_),
+      numBits_(other.numBits_),
+      prevTimestamp_(other.prevTimestamp_),
+      prevTimestampDelta_(other.prevTimestampDelta_),
+      previousValueLeadingZeros_(other.previousValueLeadingZeros_),
+      previousValueTrailingZeros_(other.previousValueTrailingZeros_),
+      extraData(other.extraData) {
+  if (writingIntegers()) {
+    integerState_ = new IntegerState(*other.integerState_);
+  }
+}
+
+TimeSeriesStream& TimeSeriesStream::operator=(const TimeSeriesStream& other) {
+  if (this == &other) {
+    return *this;
+  }
+
+  if (writingIntegers()) {
+    stopIntegers();
+  }
+  data_ = other.data_;
+  previousValue_ = other.previousValue_;
+  numBits_ = other.numBits_;
+  prevTimestamp_ = other.prevTimestamp_;
+  prevTimestampDelta_ = other.prevTimestampDelta_;
+  previousValueLeadingZeros_ = other.previousValueLeadingZeros_;
+  previousValueTrailingZeros_ = other.previousValueTrailingZeros_;
+  extraData = other.extraData;
+  if (writingIntegers()) {
+    integerState_ = new IntegerState(*other.integerState_);
+  }
+  return *this;
+}
+
+TimeSeriesStream::~TimeSeriesStream() {
+  if (writingIntegers()) {
+    delete integerState_;
+  }
+}
+
+void TimeSeriesStream::startIntegers(
+    int64_t previousValue,
+    int64_t previousDelta) {
+  integerState_ = new IntegerState{previousValue, previousDelta};
+  previousValueLeadingZeros_ = kIntegerValuesMarker;
+}
+
+int64_t TimeSeriesStream::stopIntegers() {
+  int64_t previous = integerState_->previousValue;
+  delete integerState_;
+  previousValue_ = 0;
+  previousValueLeadingZeros_ = 0;
+  return previous;
+}
+
 void TimeSeriesStream::reset() {
-  // Shrink to fit before clearing to possibly free some unused
-  // memory. (It will only free memory if there's more than 50% extra
-  // allocated.)
-  data_.shrink_to_fit();
+  if (isMilliseconds()) {
+    prevTimestamp_ = getPreviousMilliseconds() / kGorillaMsPerSecond;
+  }
 
-  // This won't actually release the memory.
-  data_.clear();
+  // The buffer is kept for the next bucket so that streams of active
+  // time series don't reallocate it again as points arrive. It's only
+  // freed if more than half of it was unused, which also gives back
+  // all the memory of an empty stream.
+  if (data_.capacity() > 2 * data_.size()) {
+    data_.free();
+  } else {
+    data_.clear();
+  }
+  if (writingIntegers()) {
+    stopIntegers();
+  }
   numBits_ = 0;
   prevTimestampDelta_ = 0;
   previousValue_ = 0;
@@ -57,7 +172,7 @@ void TimeSeriesStream::reset() {
 
   // Do not reset the `prevTimestamp_` because it is still useful for
   // the callers. When data_ is empty, it is used only to enforce the
-  // minTimestampDelta check across buckets.
+  // minTimestampDelta check across buckets, in seconds.
 }
 
 void TimeSeriesStream::reset(int64_t minTimestamp, int64_t minTimestampDelta) {
@@ -90,6 +205,70 @@ const char* TimeSeriesStream::getDataPtr() {
   return data_.data();
 }
 
+void TimeSeriesStream::getState(State& state, std::string& data) {
+  state.previousValue =
+      writingIntegers() ? integerState_->previousValue : previousValue_;
+  state.numBits = numBits_;
+  state.prevTimestamp = prevTimestamp_;
+  state.prevTimestampDelta = prevTimestampDelta_;
+  state.previousValueLeadingZeros = previousValueLeadingZeros_;
+  state.previousValueTrailingZeros = previousValueTrailingZeros_;
+  state.extraData = extraData;
+  readData(data);
+}
+
+bool TimeSeriesStream::setState(const State& state, folly::StringPiece data) {
+  if ((state.numBits + 7) / 8 != data.size()) {
+    return false;
+  }
+
+  // The delta of the previous integer isn't in the state, so it's
+  // recovered by decoding the data.
+  int64_t previousIntegerDelta = 0;
+  if (state.previousValueLeadingZeros == kIntegerValuesMarker) {
+    try {
+      ValueState valueState;
+      int64_t previousTimestamp = 0;
+      int64_t previousTimestampDelta = kDefaultDelta;
+      BitReader reader(data);
+      readFirstTimestamp(reader, valueState);
+      readNextValue(reader, valueState);
+      while (reader.bitPos() < state.numBits) {
+        readNextTimestamp(
+            reader,
+            previousTimestamp,
+            previousTimestampDelta,
+            valueState.milliseconds);
+        readNextValue(reader, valueState);
+      }
+      if (!valueState.integerValues ||
+          valueState.previousValue != state.previousValue) {
+        return false;
+      }
+      previousIntegerDelta = valueState.previousIntegerDelta;
+    } catch (const std::runtime_error& e) {
+      LOG(ERROR) << "Error decoding data from Gorilla: " << e.what();
+      return false;
+    }
+  }
+
+  data_.assign(data.data(), data.size());
+  if (writingIntegers()) {
+    stopIntegers();
+  }
+  previousValue_ = state.previousValue;
+  numBits_ = state.numBits;
+  prevTimestamp_ = state.prevTimestamp;
+  prevTimestampDelta_ = state.prevTimestampDelta;
+  previousValueLeadingZeros_ = state.previousValueLeadingZeros;
+  previousValueTrailingZeros_ = state.previousValueTrailingZeros;
+  if (state.previousValueLeadingZeros == kIntegerValuesMarker) {
+    startIntegers(state.previousValue, previousIntegerDelta);
+  }
+  extraData = state.extraData;
+  return true;
+}
+
 bool TimeSeriesStream::append(
     const TimeValuePair& value,
     int64_t minTimestampDelta) {
@@ -100,17 +279,162 @@ bool TimeSeriesStream::append(
     int64_t unixTime,
     double value,
     int64_t minTimestampDelta) {
-  if (!appendTimestamp(unixTime, minTimestampDelta)) {
+  if (data_.empty()) {
+    startValues(
+        value,
+        unixTime == kIntegerValuesTimestamp ||
+            unixTime == kMillisecondsTimestamp ||
+            (unixTime == kApproximateValuesTimestamp &&
+             previousValueTrailingZeros_ != kApproximateMarker));
+  } else if (UNLIKELY(isMilliseconds())) {
+    return appendMilliseconds(
+        unixTime * kGorillaMsPerSecond,
+        value,
+        minTimestampDelta * kGorillaMsPerSecond);
+  }
+
+  Writer writer(data_, numBits_);
+  if (!appendTimestamp(unixTime, minTimestampDelta, writer)) {
+    return false;
+  }
+
+  appendValue(value, writer);
+  return true;
+}
+
+bool TimeSeriesStream::appendMilliseconds(
+    int64_t unixTimeMs,
+    double value,
+    int64_t minTimestampDeltaMs) {
+  if (unixTimeMs < 0) {
+    return false;
+  }
+
+  if (data_.empty()) {
+    // The previous bucket ended in seconds.
+    if (prevTimestamp_ != 0 &&
+        unixTimeMs - (int64_t)prevTimestamp_ * kGorillaMsPerSecond <
+            minTimestampDeltaMs) {
+      return false;
+    }
+
+    startValues(value, false);
+    Writer writer(data_, numBits_);
+    appendFirstTimestamp(unixTimeMs, true, writer);
+    appendValue(value, writer);
+    return true;
+  }
+
+  if (!isMilliseconds()) {
+    return append(
+        unixTimeMs / kGorillaMsPerSecond,
+        value,
+        (minTimestampDeltaMs + kGorillaMsPerSecond - 1) /
+            kGorillaMsPerSecond);
+  }
+
+  // Timestamps never decrease, so that the previous one can be
+  // recovered from its low bits.
+  int64_t first = getFirstMilliseconds();
+  int64_t delta = unixTimeMs - getPreviousMilliseconds();
+  if (delta < std::max<int64_t>(minTimestampDeltaMs, 0) ||
+      unixTimeMs - first > kMaxMillisecondSpan) {
     return false;
   }
 
-  appendValue(value);
+  Writer writer(data_, numBits_);
+  appendDeltaOfDelta(
+      delta - prevTimestampDelta_, millisecondTimestampEncodings, writer);
+  prevTimestamp_ = unixTimeMs;
+  prevTimestampDelta_ = delta;
+  appendValue(value, writer);
   return true;
 }
 
+int64_t TimeSeriesStream::getFirstMilliseconds() const {
+  BitReader reader(folly::StringPiece(data_.data(), data_.size()));
+  ValueState valueState;
+  return readFirstTimestamp(reader, valueState);
+}
+
+int64_t TimeSeriesStream::getPreviousMilliseconds() const {
+  int64_t first = getFirstMilliseconds();
+  return first + (uint32_t)(prevTimestamp_ - (uint32_t)first);
+}
+
+void TimeSeriesStream::startValues(double value, bool integerMarker) {
+  if (writingIntegers()) {
+    stopIntegers();
+  }
+  previousValue_ = 0;
+  previousValueLeadingZeros_ = 0;
+  if ((FLAGS_gorilla_integer_values && isIntegerValue(value)) ||
+      integerMarker) {
+    startIntegers(0, 0);
+  }
+}
+
+int TimeSeriesStream::appendBatch(
+    const std::vector<TimeValuePair>& values,
+    size_t begin,
+    size_t end,
+    int64_t minTimestampDelta,
+    std::vector<bool>& added,
+    uint16_t* repeats) {
+  int count = 0;
+
+  // The first value of a stream picks its encoding, and the writer
+  // can't tell if the stream is empty until it's flushed.
+  for (; begin < end && data_.empty(); begin++) {
+    added[begin] = append(values[begin], minTimestampDelta);
+    count += added[begin];
+  }
+  if (begin == end) {
+    return count;
+  }
+
+  if (UNLIKELY(isMilliseconds())) {
+    // Millisecond streams have no repeats.
+    for (; begin < end; begin++) {
+      added[begin] = append(values[begin], minTimestampDelta);
+      count += added[begin];
+    }
+    return count;
+  }
+
+  size_t reserve = data_.size() + (end - begin) * kBytesPerBatchedValue;
+  if (reserve > data_.capacity()) {
+    data_.reserve(std::max(reserve, data_.capacity() * 3 / 2));
+  }
+
+  Writer writer(data_, numBits_);
+  for (size_t i = begin; i < end; i++) {
+    const TimeValuePair& value = values[i];
+    if (repeats) {
+      if (*repeats < std::numeric_limits<uint16_t>::max() &&
+          isRepeat(value.unixTime, value.value, *repeats, minTimestampDelta)) {
+        (*repeats)++;
+        added[i] = true;
+        count++;
+        continue;
+      }
+      appendRepeats(*repeats, writer);
+      *repeats = 0;
+    }
+
+    added[i] = appendTimestamp(value.unixTime, minTimestampDelta, writer);
+    if (added[i]) {
+      appendValue(value.value, writer);
+      count++;
+    }
+  }
+  return count;
+}
+
 bool TimeSeriesStream::appendTimestamp(
     int64_t timestamp,
-    int64_t minTimestampDelta) {
+    int64_t minTimestampDelta,
+    Writer& writer) {
   // Store a delta of delta for the rest of the values in one of the
   // following ways
   //
@@ -128,20 +452,46 @@ bool TimeSeriesStream::appendTimestamp(
   }
 
   if (data_.empty()) {
-    // Store the first value as is
-    BitUtil::addValueToBitString(
-        timestamp, kBitsForFirstTimestamp, data_, numBits_);
-    prevTimestamp_ = timestamp;
-    prevTimestampDelta_ = kDefaultDelta;
+    appendFirstTimestamp(timestamp, false, writer);
     return true;
   }
 
-  int64_t deltaOfDelta = delta - prevTimestampDelta_;
+  appendDeltaOfDelta(delta - prevTimestampDelta_, timestampEncodings, writer);
+  prevTimestamp_ = timestamp;
+  prevTimestampDelta_ = delta;
+  return true;
+}
 
+void TimeSeriesStream::appendFirstTimestamp(
+    int64_t timestamp,
+    bool milliseconds,
+    Writer& writer) {
+  // Store the first value as is
+  if (previousValueTrailingZeros_ == kApproximateMarker) {
+    writer.write(kApproximateValuesTimestamp, kBitsForFirstTimestamp);
+    previousValueTrailingZeros_ = 0;
+  }
+  if (milliseconds) {
+    writer.write(kMillisecondsTimestamp, kBitsForFirstTimestamp);
+  }
+  if (writingIntegers()) {
+    writer.write(kIntegerValuesTimestamp, kBitsForFirstTimestamp);
+  }
+  writer.write(
+      timestamp,
+      milliseconds ? kBitsForFirstMillisecondTimestamp
+                   : kBitsForFirstTimestamp);
+  prevTimestamp_ = timestamp;
+  prevTimestampDelta_ = kDefaultDelta;
+}
+
+void TimeSeriesStream::appendDeltaOfDelta(
+    int64_t deltaOfDelta,
+    const TimestampEncoding* encodings,
+    Writer& writer) {
   if (deltaOfDelta == 0) {
-    prevTimestamp_ = timestamp;
-    BitUtil::addValueToBitString(0, 1, data_, numBits_);
-    return true;
+    writer.write(0, 1);
+    return;
   }
 
   if (deltaOfDelta > 0) {
@@ -152,30 +502,70 @@ bool TimeSeriesStream::appendTimestamp(
   int64_t absValue = std::abs(deltaOfDelta);
 
   for (int i = 0; i < 4; i++) {
-    if (absValue < ((int64_t)1 << (timestampEncodings[i].bitsForValue - 1))) {
-      BitUtil::addValueToBitString(
-          timestampEncodings[i].controlValue,
-          timestampEncodings[i].controlValueBitLength,
-          data_,
-          numBits_);
-
-      // Make this value between [0, 2^timestampEncodings[i].bitsForValue - 1]
-      int64_t encodedValue = deltaOfDelta +
-          ((int64_t)1 << (timestampEncodings[i].bitsForValue - 1));
-
-      BitUtil::addValueToBitString(
-          encodedValue, timestampEncodings[i].bitsForValue, data_, numBits_);
+    if (absValue < ((int64_t)1 << (encodings[i].bitsForValue - 1))) {
+      writer.write(
+          encodings[i].controlValue, encodings[i].controlValueBitLength);
+
+      // Make this value between [0, 2^encodings[i].bitsForValue - 1]
+      int64_t encodedValue =
+          deltaOfDelta + ((int64_t)1 << (encodings[i].bitsForValue - 1));
+
+      writer.write(encodedValue, encodings[i].bitsForValue);
       break;
     }
   }
+}
 
-  prevTimestamp_ = timestamp;
-  prevTimestampDelta_ = delta;
+bool TimeSeriesStream::isIntegerValue(double value) {
+  // Also false for NaN. Negative zero is left to the XOR encoding so
+  // that its sign is kept.
+  return value >= -kMaxIntegerValue && value <= kMaxIntegerValue &&
+      value == (double)(int64_t)value &&
+      !(value == 0 && std::signbit(value));
+}
 
-  return true;
+bool TimeSeriesStream::appendIntegerValue(int64_t value, Writer& writer) {
+  IntegerState& state = *integerState_;
+  int64_t delta = value - state.previousValue;
+  int64_t deltaOfDelta = delta - state.previousDelta;
+
+  if (deltaOfDelta == 0) {
+    writer.write(0, 1);
+    state.previousValue = value;
+    return true;
+  }
+
+  // Small negative and positive values both get small codes.
+  uint64_t zigzag = ((uint64_t)deltaOfDelta << 1) ^ (deltaOfDelta >> 63);
+  for (const auto& encoding : integerEncodings) {
+    if (zigzag < ((uint64_t)1 << encoding.bitsForValue)) {
+      writer.write(encoding.controlValue, encoding.controlValueBitLength);
+      writer.write(zigzag, encoding.bitsForValue);
+      state.previousValue = value;
+      state.previousDelta = delta;
+      return true;
+    }
+  }
+
+  // Integers near both ends of the range can be 57 bits apart from the
+  // previous delta, which is more than the widest code holds.
+  return false;
 }
 
-void TimeSeriesStream::appendValue(double value) {
+void TimeSeriesStream::appendValue(double value, Writer& writer) {
+  if (writingIntegers()) {
+    if (isIntegerValue(value) && appendIntegerValue((int64_t)value, writer)) {
+      return;
+    }
+
+    // XOR encode the rest of the values starting from the previous
+    // integer.
+    writer.write(kSwitchToXorControlValue, kIntegerControlLimit);
+    double previous = stopIntegers();
+    memcpy(&previousValue_, &previous, sizeof(previous));
+    previousValueTrailingZeros_ = 0;
+  }
+
   uint64_t* p = (uint64_t*)&value;
   uint64_t xorWithPrevius = previousValue_ ^ *p;
 
@@ -197,11 +587,11 @@ void TimeSeriesStream::appendValue(double value) {
   //    bits and finally the XORred value is stored.
 
   if (xorWithPrevius == 0) {
-    BitUtil::addValueToBitString(0, 1, data_, numBits_);
+    writer.write(0, 1);
     return;
   }
 
-  BitUtil::addValueToBitString(1, 1, data_, numBits_);
+  writer.write(1, 1);
 
   int leadingZeros = __builtin_clzll(xorWithPrevius);
   int trailingZeros = __builtin_ctzll(xorWithPrevius);
@@ -220,28 +610,22 @@ void TimeSeriesStream::appendValue(double value) {
       trailingZeros >= previousValueTrailingZeros_ &&
       previousBlockInformationSize < expectedSize) {
     // Control bit for using previous block information.
-    BitUtil::addValueToBitString(1, 1, data_, numBits_);
+    writer.write(1, 1);
 
     uint64_t blockValue = xorWithPrevius >> previousValueTrailingZeros_;
-    BitUtil::addValueToBitString(
-        blockValue, previousBlockInformationSize, data_, numBits_);
+    writer.write(blockValue, previousBlockInformationSize);
 
   } else {
     // Control bit for not using previous block information.
-    BitUtil::addValueToBitString(0, 1, data_, numBits_);
+    writer.write(0, 1);
 
-    BitUtil::addValueToBitString(
-        leadingZeros, kLeadingZerosLengthBits, data_, numBits_);
+    writer.write(leadingZeros, kLeadingZerosLengthBits);
 
-    BitUtil::addValueToBitString(
-        // To fit in 6 bits. There will never be a zero size block
-        blockSize - kBlockSizeAdjustment,
-        kBlockSizeLengthBits,
-        data_,
-        numBits_);
+    // To fit in 6 bits. There will never be a zero size block
+    writer.write(blockSize - kBlockSizeAdjustment, kBlockSizeLengthBits);
 
     uint64_t blockValue = xorWithPrevius >> trailingZeros;
-    BitUtil::addValueToBitString(blockValue, blockSize, data_, numBits_);
+    writer.write(blockValue, blockSize);
 
     previousValueTrailingZeros_ = trailingZeros;
     previousValueLeadingZeros_ = leadingZeros;
@@ -250,83 +634,345 @@ void TimeSeriesStream::appendValue(double value) {
   previousValue_ = *p;
 }
 
-int64_t TimeSeriesStream::readNextTimestamp(
+int TimeSeriesStream::readValues(
+    int64_t* timestamps,
+    double* values,
+    folly::StringPiece data,
+    folly::StringPiece checkpoints,
+    int n,
+    int64_t begin,
+    int64_t end) {
+  int count = 0;
+  return visitValues(
+      data,
+      checkpoints,
+      n,
+      begin,
+      end,
+      [timestamps, values, &count](int64_t unixTime, double value) {
+        timestamps[count] = unixTime;
+        values[count] = value;
+        count++;
+      });
+}
+
+void TimeSeriesStream::writeCheckpoints(
     folly::StringPiece data,
-    uint64_t& bitPos,
-    int64_t& prevValue,
-    int64_t& prevDelta) {
-  uint32_t type = BitUtil::findTheFirstZeroBit(data, bitPos, 4);
-  if (type > 0) {
-    // Delta of delta is non zero. Calculate the new delta. `index`
-    // will be used to find the right length for the value that is
-    // read.
-    int index = type - 1;
-    int64_t decodedValue = BitUtil::readValueFromBitString(
-        data, bitPos, timestampEncodings[index].bitsForValue);
-
-    // [0,255] becomes [-128,127]
-    decodedValue -=
-        ((int64_t)1 << (timestampEncodings[index].bitsForValue - 1));
-    if (decodedValue >= 0) {
-      // [-128,127] becomes [-128,128] without the zero in the middle
-      decodedValue++;
+    int n,
+    int interval,
+    std::string& checkpoints) {
+  checkpoints.clear();
+  if (data.empty() || interval <= 0 || n <= interval) {
+    return;
+  }
+
+  try {
+    ValueState valueState;
+    int64_t previousTimestampDelta = kDefaultDelta;
+    BitReader reader(data);
+
+    int64_t previousTimestamp = readFirstTimestamp(reader, valueState);
+    if (valueState.integerValues) {
+      // The delta of the integers doesn't fit in a checkpoint. Integer
+      // values are fast enough to decode without them.
+      return;
     }
 
-    prevDelta += decodedValue;
+    checkpoints.reserve((n - 1) / interval * kCheckpointSize);
+    readNextValue(reader, valueState);
+
+    for (int i = 1; i < n; i++) {
+      if (i % interval == 0) {
+        Checkpoint checkpoint{};
+        checkpoint.previousValue = valueState.previousValue;
+        checkpoint.previousTimestamp = previousTimestamp;
+        checkpoint.bitPos = reader.bitPos();
+        checkpoint.index = i;
+        checkpoint.previousTimestampDelta = previousTimestampDelta;
+        checkpoint.previousLeadingZeros = valueState.previousLeadingZeros;
+        checkpoint.previousTrailingZeros = valueState.previousTrailingZeros;
+        appendCheckpoint(checkpoint, checkpoints);
+      }
+
+      readNextTimestamp(
+          reader,
+          previousTimestamp,
+          previousTimestampDelta,
+          valueState.milliseconds);
+      readNextValue(reader, valueState);
+    }
+  } catch (const std::runtime_error& e) {
+    // The checkpoints written so far are still valid.
+    LOG(ERROR) << "Error decoding data from Gorilla: " << e.what();
   }
+}
 
-  prevValue += prevDelta;
-  return prevValue;
+void TimeSeriesStream::appendCheckpoint(
+    const Checkpoint& checkpoint,
+    std::string& checkpoints) {
+  appendLittleEndian(checkpoint.previousValue, 8, checkpoints);
+  appendLittleEndian(checkpoint.previousTimestamp, 8, checkpoints);
+  appendLittleEndian(checkpoint.bitPos, 4, checkpoints);
+  appendLittleEndian(checkpoint.index, 4, checkpoints);
+  appendLittleEndian(checkpoint.previousTimestampDelta, 4, checkpoints);
+  appendLittleEndian(checkpoint.previousLeadingZeros, 1, checkpoints);
+  appendLittleEndian(checkpoint.previousTrailingZeros, 1, checkpoints);
+  appendLittleEndian(0, 2, checkpoints);
 }
 
-double TimeSeriesStream::readNextValue(
-    folly::StringPiece data,
-    uint64_t& bitPos,
-    uint64_t& previousValue,
-    uint64_t& previousLeadingZeros,
-    uint64_t& previousTrailingZeros) {
-  uint64_t nonZeroValue = BitUtil::readValueFromBitString(data, bitPos, 1);
+TimeSeriesStream::Checkpoint TimeSeriesStream::readCheckpoint(
+    const char* data) {
+  Checkpoint checkpoint;
+  checkpoint.previousValue = readLittleEndian(data, 8);
+  checkpoint.previousTimestamp = readLittleEndian(data + 8, 8);
+  checkpoint.bitPos = readLittleEndian(data + 16, 4);
+  checkpoint.index = readLittleEndian(data + 20, 4);
+  checkpoint.previousTimestampDelta =
+      static_cast<int32_t>(readLittleEndian(data + 24, 4));
+  checkpoint.previousLeadingZeros = readLittleEndian(data + 28, 1);
+  checkpoint.previousTrailingZeros = readLittleEndian(data + 29, 1);
+  return checkpoint;
+}
 
-  if (!nonZeroValue) {
-    double* p = (double*)&previousValue;
-    return *p;
+int TimeSeriesStream::seekToCheckpoint(
+    BitReader& reader,
+    folly::StringPiece checkpoints,
+    int n,
+    int64_t begin,
+    int64_t& previousTimestamp,
+    int64_t& previousTimestampDelta,
+    ValueState& valueState) {
+  if (checkpoints.empty()) {
+    return 0;
   }
 
-  uint64_t usePreviousBlockInformation =
-      BitUtil::readValueFromBitString(data, bitPos, 1);
+  if (checkpoints.size() % kCheckpointSize != 0) {
+    LOG(ERROR) << "Invalid checkpoint data size " << checkpoints.size();
+    return 0;
+  }
 
-  uint64_t xorValue;
-  if (usePreviousBlockInformation) {
-    xorValue = BitUtil::readValueFromBitString(
-        data, bitPos, 64 - previousLeadingZeros - previousTrailingZeros);
-    xorValue <<= previousTrailingZeros;
-  } else {
-    uint64_t leadingZeros =
-        BitUtil::readValueFromBitString(data, bitPos, kLeadingZerosLengthBits);
-    uint64_t blockSize =
-        BitUtil::readValueFromBitString(data, bitPos, kBlockSizeLengthBits) +
-        kBlockSizeAdjustment;
-    previousTrailingZeros = 64 - blockSize - leadingZeros;
-    xorValue = BitUtil::readValueFromBitString(data, bitPos, blockSize);
-    xorValue <<= previousTrailingZeros;
-    previousLeadingZeros = leadingZeros;
+  auto checkpointAt = [&](size_t i) {
+    return readCheckpoint(checkpoints.data() + i * kCheckpointSize);
+  };
+
+  // Find the last checkpoint whose previous value is before
+  // `begin`. None of the values before it can be in the range.
+  size_t low = 0;
+  size_t high = checkpoints.size() / kCheckpointSize;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (checkpointAt(mid).previousTimestamp < begin) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low == 0) {
+    return 0;
   }
 
-  uint64_t value = xorValue ^ previousValue;
-  previousValue = value;
+  Checkpoint checkpoint = checkpointAt(low - 1);
+  if (checkpoint.index == 0 || checkpoint.index >= n) {
+    return 0;
+  }
 
-  double* p = (double*)&value;
-  return *p;
+  reader.seek(checkpoint.bitPos);
+  valueState.previousValue = checkpoint.previousValue;
+  previousTimestamp = checkpoint.previousTimestamp;
+  previousTimestampDelta = checkpoint.previousTimestampDelta;
+  valueState.previousLeadingZeros = checkpoint.previousLeadingZeros;
+  valueState.previousTrailingZeros = checkpoint.previousTrailingZeros;
+  return checkpoint.index;
+}
+
+bool TimeSeriesStream::isRepeat(
+    int64_t unixTime,
+    double value,
+    uint32_t skipped,
+    int64_t minTimestampDelta) const {
+  if (data_.empty() || prevTimestampDelta_ == 0 ||
+      prevTimestampDelta_ < minTimestampDelta ||
+      unixTime != (int64_t)prevTimestamp_ +
+              ((int64_t)skipped + 1) * prevTimestampDelta_ ||
+      isMilliseconds()) {
+    return false;
+  }
+
+  if (writingIntegers()) {
+    return isIntegerValue(value) &&
+        (int64_t)value == integerState_->previousValue;
+  }
+
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits == previousValue_;
+}
+
+void TimeSeriesStream::appendRepeats(uint32_t count) {
+  Writer writer(data_, numBits_);
+  appendRepeats(count, writer);
+}
+
+void TimeSeriesStream::appendRepeats(uint32_t count, Writer& writer) {
+  double value;
+  if (writingIntegers()) {
+    value = integerState_->previousValue;
+  } else {
+    memcpy(&value, &previousValue_, sizeof(value));
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    appendTimestamp(prevTimestamp_ + prevTimestampDelta_, 0, writer);
+    appendValue(value, writer);
+  }
 }
 
 uint32_t TimeSeriesStream::getFirstTimeStamp() {
-  if (data_.length() == 0) {
+  return getFirstTimeStamp(folly::StringPiece(data_.data(), data_.size()));
+}
+
+uint32_t TimeSeriesStream::getFirstTimeStamp(folly::StringPiece data) {
+  if (data.size() == 0) {
     return 0;
   }
 
+  if (isMilliseconds(data)) {
+    try {
+      BitReader reader(data);
+      ValueState valueState;
+      return readFirstTimestamp(reader, valueState) / kGorillaMsPerSecond;
+    } catch (const std::runtime_error& e) {
+      LOG(ERROR) << "Error decoding data from Gorilla: " << e.what();
+      return 0;
+    }
+  }
+
+  uint64_t bitPos = 0;
+  uint32_t timestamp =
+      BitUtil::readValueFromBitString(data, bitPos, kBitsForFirstTimestamp);
+  if (timestamp == kApproximateValuesTimestamp &&
+      data.size() * 8 >= bitPos + kBitsForFirstTimestamp) {
+    timestamp =
+        BitUtil::readValueFromBitString(data, bitPos, kBitsForFirstTimestamp);
+  }
+  if (timestamp == kIntegerValuesTimestamp &&
+      data.size() * 8 >= bitPos + kBitsForFirstTimestamp) {
+    // Streams of integer values.
+    timestamp =
+        BitUtil::readValueFromBitString(data, bitPos, kBitsForFirstTimestamp);
+  }
+  return timestamp;
+}
+
+bool TimeSeriesStream::isApproximate(folly::StringPiece data) {
+  if (data.size() * 8 < 2 * kBitsForFirstTimestamp) {
+    return false;
+  }
+
   uint64_t bitPos = 0;
-  folly::StringPiece data(data_.c_str(), data_.size());
-  return BitUtil::readValueFromBitString(data, bitPos, kBitsForFirstTimestamp);
+  return BitUtil::readValueFromBitString(
+             data, bitPos, kBitsForFirstTimestamp) ==
+      kApproximateValuesTimestamp;
+}
+
+bool TimeSeriesStream::split(
+    folly::StringPiece data,
+    int n,
+    std::string& timestamps,
+    std::string& values) {
+  if (n <= 0) {
+    return false;
+  }
+
+  folly::fbstring timestampBits;
+  folly::fbstring valueBits;
+  uint32_t numTimestampBits = 0;
+  uint32_t numValueBits = 0;
+  try {
+    // One reader decodes to find where each part ends and the other
+    // copies the bits up to there.
+    BitReader reader(data);
+    BitReader copier(data);
+    BitWriter timestampWriter(timestampBits, numTimestampBits);
+    BitWriter valueWriter(valueBits, numValueBits);
+    ValueState valueState;
+    int64_t previousTimestamp = 0;
+    int64_t previousTimestampDelta = kDefaultDelta;
+    uint64_t bitPos = 0;
+    for (int i = 0; i < n; i++) {
+      if (i == 0) {
+        previousTimestamp = readFirstTimestamp(reader, valueState);
+      } else {
+        readNextTimestamp(
+            reader,
+            previousTimestamp,
+            previousTimestampDelta,
+            valueState.milliseconds);
+      }
+      copyBits(copier, timestampWriter, reader.bitPos() - bitPos);
+      bitPos = reader.bitPos();
+
+      readNextValue(reader, valueState);
+      copyBits(copier, valueWriter, reader.bitPos() - bitPos);
+      bitPos = reader.bitPos();
+    }
+
+    if (data.size() != (bitPos + 7) / 8) {
+      return false;
+    }
+  } catch (std::runtime_error&) {
+    return false;
+  }
+
+  timestamps.assign(timestampBits.data(), timestampBits.size());
+  values.assign(valueBits.data(), valueBits.size());
+  return true;
+}
+
+bool TimeSeriesStream::join(
+    folly::StringPiece timestamps,
+    folly::StringPiece values,
+    int n,
+    std::string& data) {
+  if (n <= 0) {
+    return false;
+  }
+
+  folly::fbstring bits;
+  uint32_t numBits = 0;
+  try {
+    BitReader timestampReader(timestamps);
+    BitReader timestampCopier(timestamps);
+    BitReader valueReader(values);
+    BitReader valueCopier(values);
+    BitWriter writer(bits, numBits);
+    ValueState valueState;
+    int64_t previousTimestamp = 0;
+    int64_t previousTimestampDelta = kDefaultDelta;
+    for (int i = 0; i < n; i++) {
+      uint64_t bitPos = timestampReader.bitPos();
+      if (i == 0) {
+        previousTimestamp = readFirstTimestamp(timestampReader, valueState);
+      } else {
+        readNextTimestamp(
+            timestampReader,
+            previousTimestamp,
+            previousTimestampDelta,
+            valueState.milliseconds);
+      }
+      copyBits(timestampCopier, writer, timestampReader.bitPos() - bitPos);
+
+      bitPos = valueReader.bitPos();
+      readNextValue(valueReader, valueState);
+      copyBits(valueCopier, writer, valueReader.bitPos() - bitPos);
+    }
+  } catch (std::runtime_error&) {
+    return false;
+  }
+
+  data.assign(bits.data(), bits.size());
+  return true;
 }
 }
 } // facebook::gorilla
@@ -10,12 +10,19 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 #include <limits>
 #include <vector>
 
 #include <folly/FBString.h>
+#include <folly/Likely.h>
 #include <folly/Range.h>
+#include <folly/lang/Bits.h>
 
+#include "BitReader.h"
+#include "BitWriter.h"
+#include "GorillaTimeConstants.h"
+#include "StreamBuffer.h"
 #include "beringei/if/gen-cpp2/beringei_data_types.h"
 
 namespace facebook {
@@ -25,6 +32,9 @@ namespace gorilla {
 class TimeSeriesStream {
  public:
   TimeSeriesStream();
+  TimeSeriesStream(const TimeSeriesStream& other);
+  TimeSeriesStream& operator=(const TimeSeriesStream& other);
+  ~TimeSeriesStream();
 
   // Clear and re-initialize the stream.
   void reset();
@@ -34,6 +44,13 @@ class TimeSeriesStream {
   // this class.
   void reset(int64_t minTimestamp, int64_t minTimestampDelta);
 
+  // Allocates the data from `arena` from now on if the stream is
+  // empty. Streams that are never moved to an arena, and copies of
+  // streams, are on the heap.
+  void useArena(StreamArena* arena) {
+    data_.moveTo(arena);
+  }
+
   // Size in bytes of the data.
   uint32_t size();
 
@@ -49,6 +66,27 @@ class TimeSeriesStream {
   // Returns the raw pointer to the stream data.
   const char* getDataPtr();
 
+  // Encoder state that isn't in the data. Together with the data it's
+  // enough to restore the stream and keep appending to it. Restoring a
+  // stream of integer values decodes the data.
+  struct State {
+    uint64_t previousValue;
+    uint32_t numBits;
+    uint32_t prevTimestamp;
+    uint32_t prevTimestampDelta;
+    uint8_t previousValueLeadingZeros;
+    uint8_t previousValueTrailingZeros;
+    uint16_t extraData;
+  };
+  static_assert(sizeof(State) == 24, "State must be 24 bytes");
+
+  // Copies out the data and the encoder state.
+  void getState(State& state, std::string& data);
+
+  // Replaces the stream with data and state from `getState`. Returns
+  // false and leaves the stream unchanged if they don't match.
+  bool setState(const State& state, folly::StringPiece data);
+
   // Appends a time value to the current stream. Returns true if the
   // value was successfully added, false otherwise. This function
   // might return false if it considers the value to be spam, i.e., it
@@ -58,6 +96,62 @@ class TimeSeriesStream {
   // Same as above
   bool append(int64_t unixTime, double value, int64_t minTimestampDelta);
 
+  // Same as append(), but with the time and the minimum delta in
+  // milliseconds, for time series that are written more than once a
+  // second. The first value makes an empty stream a millisecond
+  // stream, whose first timestamp takes 64 bits and whose deltas are
+  // in milliseconds. Streams that started with append() keep seconds
+  // and get the time rounded down. Millisecond streams take no values
+  // more than kMaxMillisecondSpan after their first one.
+  bool appendMilliseconds(
+      int64_t unixTimeMs,
+      double value,
+      int64_t minTimestampDeltaMs);
+
+  // Longest span of a millisecond stream, a little over 24 days.
+  static constexpr int64_t kMaxMillisecondSpan =
+      std::numeric_limits<int32_t>::max();
+
+  // True for the data of streams written with appendMilliseconds().
+  // They are read like the other streams, with the times rounded down
+  // to seconds, except that readValues() into TimeValuePairs also sets
+  // their `ms`.
+  static bool isMilliseconds(folly::StringPiece data) {
+    // Both markers, or a marker and a 64 bit timestamp, come first.
+    if (data.size() < sizeof(uint64_t)) {
+      return false;
+    }
+
+    uint64_t header;
+    memcpy(&header, data.data(), sizeof(header));
+    header = folly::Endian::big(header);
+    uint64_t timestamp = header >> (64 - kBitsForFirstTimestamp);
+    if (timestamp == kApproximateValuesTimestamp) {
+      timestamp = (header >> (64 - 2 * kBitsForFirstTimestamp)) &
+          kIntegerValuesTimestamp;
+    }
+    return timestamp == kMillisecondsTimestamp;
+  }
+
+  bool isMilliseconds() const {
+    return isMilliseconds(folly::StringPiece(data_.data(), data_.size()));
+  }
+
+  // Same as calling append() for each of the sorted `values` from
+  // `begin` until `end`, reserving room for them up front and encoding
+  // them with one writer. Sets `added` for each of them and returns the
+  // number of values added. With `repeats`, the values that isRepeat()
+  // after `*repeats` skipped ones are counted in `*repeats` instead of
+  // being appended, and the counted ones are appended before the next
+  // value that isn't a repeat.
+  int appendBatch(
+      const std::vector<TimeValuePair>& values,
+      size_t begin,
+      size_t end,
+      int64_t minTimestampDelta,
+      std::vector<bool>& added,
+      uint16_t* repeats = nullptr);
+
   // Extract the at most n values that are between begin and end
   // inclusive and put them in a vector. Assumes there are n values
   // in the series and space for n values in the vector. Returns the
@@ -68,7 +162,22 @@ class TimeSeriesStream {
       folly::StringPiece data,
       int n,
       int64_t begin = 0,
-      int64_t end = std::numeric_limits<int64_t>::max());
+      int64_t end = std::numeric_limits<int64_t>::max()) {
+    return readValues(out, data, folly::StringPiece(), n, begin, end);
+  }
+
+  // Same as above, but uses `checkpoints` written by
+  // writeCheckpoints() to start decoding from the last checkpoint
+  // before `begin` instead of from the first value. Empty
+  // `checkpoints` decode everything.
+  template <typename T>
+  static int readValues(
+      T& out,
+      folly::StringPiece data,
+      folly::StringPiece checkpoints,
+      int n,
+      int64_t begin,
+      int64_t end);
 
   // The same, but use the data stored in `this`.
   template <typename T>
@@ -77,51 +186,410 @@ class TimeSeriesStream {
       int n,
       int64_t begin = 0,
       int64_t end = std::numeric_limits<int64_t>::max()) {
-    return readValues(out, data_, n, begin, end);
+    return readValues(
+        out, folly::StringPiece(data_.data(), data_.size()), n, begin, end);
   }
 
+  // Calls `visitor(unixTime, value)` for each of the at most n values
+  // that are between begin and end inclusive, without storing them
+  // anywhere. The visitor is a template parameter so that the call
+  // gets inlined into the decoding loop. `checkpoints` are used the
+  // same way as in readValues above. Returns the number of values
+  // visited.
+  template <typename Visitor>
+  static int visitValues(
+      folly::StringPiece data,
+      folly::StringPiece checkpoints,
+      int n,
+      int64_t begin,
+      int64_t end,
+      Visitor&& visitor);
+
+  // Extract the at most n values that are between begin and end
+  // inclusive into two parallel arrays. Both arrays must have space for
+  // n values. Returns the number of values read.
+  static int readValues(
+      int64_t* timestamps,
+      double* values,
+      folly::StringPiece data,
+      int n,
+      int64_t begin = 0,
+      int64_t end = std::numeric_limits<int64_t>::max()) {
+    return readValues(
+        timestamps, values, data, folly::StringPiece(), n, begin, end);
+  }
+
+  // Same as above with checkpoints.
+  static int readValues(
+      int64_t* timestamps,
+      double* values,
+      folly::StringPiece data,
+      folly::StringPiece checkpoints,
+      int n,
+      int64_t begin,
+      int64_t end);
+
+  // The same, but use the data stored in `this`.
+  int readValues(
+      int64_t* timestamps,
+      double* values,
+      int n,
+      int64_t begin = 0,
+      int64_t end = std::numeric_limits<int64_t>::max()) {
+    return readValues(
+        timestamps,
+        values,
+        folly::StringPiece(data_.data(), data_.size()),
+        n,
+        begin,
+        end);
+  }
+
+  // Decodes the n values in `data` and writes a checkpoint of the
+  // decoder state before every `interval`th value to
+  // `checkpoints`. Checkpoints are 32 bytes each and are meant to be
+  // stored in `TimeSeriesBlock::checkpoints` next to the data.
+  static void writeCheckpoints(
+      folly::StringPiece data,
+      int n,
+      int interval,
+      std::string& checkpoints);
+
   uint32_t getPreviousTimeStamp() {
-    return prevTimestamp_;
+    return getRepeatTimeStamp(0);
+  }
+
+  // True if `value` at `unixTime` repeats the previous value, at the
+  // same distance from the previous timestamp as the one before it,
+  // after `skipped` such repeats that weren't appended yet. These
+  // points take two bits each, so they can be counted instead of
+  // written and appended later with appendRepeats().
+  bool isRepeat(
+      int64_t unixTime,
+      double value,
+      uint32_t skipped,
+      int64_t minTimestampDelta) const;
+
+  // Appends `count` repeats of the previous value, each at the same
+  // distance from the previous timestamp as the one before it.
+  void appendRepeats(uint32_t count);
+
+  // The timestamp of the last of `count` repeats of the previous value.
+  // In seconds for millisecond streams too, which have no repeats.
+  uint32_t getRepeatTimeStamp(uint32_t count) const {
+    if (UNLIKELY(isMilliseconds())) {
+      return getPreviousMilliseconds() / kGorillaMsPerSecond;
+    }
+    return prevTimestamp_ + count * prevTimestampDelta_;
   }
 
   uint32_t getFirstTimeStamp();
 
+  // Timestamp of the first value in `data`, which is stored whole at
+  // the start of the stream, in seconds. Returns 0 for empty data.
+  static uint32_t getFirstTimeStamp(folly::StringPiece data);
+
+  // True if `value` can be stored with the integer value encoding.
+  static bool isIntegerValue(double value);
+
+  // Marks the values of the stream as an approximation of the points
+  // that were written, e.g., by a lossy compression. Readers can tell
+  // with isApproximate(). Must be called before the first append().
+  void setApproximate() {
+    previousValueTrailingZeros_ = kApproximateMarker;
+  }
+
+  // True for the data of streams that were marked with setApproximate().
+  static bool isApproximate(folly::StringPiece data);
+
+  // Splits the bits of the n values in `data` into the bits of their
+  // timestamps, which include the header, and the bits of their
+  // values. Series that are written at the same times often have the
+  // same timestamp bits. Returns false if `data` is not n values.
+  static bool split(
+      folly::StringPiece data,
+      int n,
+      std::string& timestamps,
+      std::string& values);
+
+  // Interleaves the parts made by split() back into the original data.
+  // Returns false if the parts are not n values.
+  static bool join(
+      folly::StringPiece timestamps,
+      folly::StringPiece values,
+      int n,
+      std::string& data);
+
  private:
   static constexpr uint32_t kLeadingZerosLengthBits = 5;
   static constexpr uint32_t kBlockSizeLengthBits = 6;
   static constexpr uint32_t kMaxLeadingZerosLength =
       (1 << kLeadingZerosLengthBits) - 1;
   static constexpr uint32_t kBlockSizeAdjustment = 1;
+  // The delta before the first one, in the units of the stream.
   static constexpr uint32_t kDefaultDelta = 60;
   static constexpr uint32_t kBitsForFirstTimestamp = 31; // Works until 2038.
+  static constexpr uint32_t kBitsForFirstMillisecondTimestamp = 64;
 
-  // Decompression methods.
-  static double readNextValue(
-      folly::StringPiece data,
-      uint64_t& bitPos,
-      uint64_t& previousValue,
-      uint64_t& previousLeadingZeros,
-      uint64_t& previousTrailingZeros);
+  struct TimestampEncoding {
+    int64_t bitsForValue;
+    uint32_t controlValue;
+    uint32_t controlValueBitLength;
+  };
+  static const TimestampEncoding timestampEncodings[4];
+
+  // The deltas of deltas of milliseconds are larger, so their
+  // encodings are wider: 8, 12, 16 and 32 bits.
+  static const TimestampEncoding millisecondTimestampEncodings[4];
+
+  // Streams whose first value is an integer can store their values as
+  // zigzag encoded deltas of deltas instead of XORs of the doubles
+  // when --gorilla_integer_values is set. These streams start with
+  // kIntegerValuesTimestamp followed by the real first timestamp. The
+  // control values are
+  //
+  // '0' = delta of delta did not change
+  // '10' followed by a value length of 6
+  // '110' followed by a value length of 13
+  // '1110' followed by a value length of 20
+  // '11110' followed by a value length of 56
+  // '11111' the rest of the values are XORed doubles
+  struct IntegerEncoding {
+    uint32_t bitsForValue;
+    uint32_t controlValue;
+    uint32_t controlValueBitLength;
+  };
+  static const IntegerEncoding integerEncodings[4];
+  static constexpr uint32_t kIntegerControlLimit = 5;
+  static constexpr uint32_t kSwitchToXorControlValue = 31;
+
+  // The last second of 31 bit timestamps. Streams that really start at
+  // this time use the integer encoding if only to switch to XORs.
+  static constexpr uint32_t kIntegerValuesTimestamp =
+      ((uint32_t)1 << kBitsForFirstTimestamp) - 1;
+
+  // Approximate streams start with this marker, before the integer
+  // one. Other streams that really start at this time use the integer
+  // encoding so that their first timestamp follows a marker.
+  static constexpr uint32_t kApproximateValuesTimestamp =
+      kIntegerValuesTimestamp - 1;
+
+  // `previousValueTrailingZeros_` of an empty stream that
+  // setApproximate() was called for, until the first timestamp is
+  // written. Takes no room in the stream.
+  static constexpr uint8_t kApproximateMarker = 0xFF;
+
+  // Millisecond streams start with this marker, after the approximate
+  // one and before the integer one, followed by the first timestamp in
+  // 64 bits. Other streams that really start at this time use the
+  // integer encoding so that their first timestamp follows a marker.
+  static constexpr uint32_t kMillisecondsTimestamp =
+      kApproximateValuesTimestamp - 1;
+
+  // Largest integer magnitude that every double can represent.
+  static constexpr int64_t kMaxIntegerValue = (int64_t)1 << 53;
+
+  // `previousValueLeadingZeros_` of a stream that is writing integer
+  // values. `integerState_` is then set instead of `previousValue_`.
+  static constexpr uint8_t kIntegerValuesMarker = 0xFF;
+
+  // Encoder state of a stream that is writing integer values. Kept
+  // out of the stream so that the other streams don't pay for it.
+  struct IntegerState {
+    int64_t previousValue;
+    int64_t previousDelta;
+  };
+
+  bool writingIntegers() const {
+    return previousValueLeadingZeros_ == kIntegerValuesMarker;
+  }
+
+  // Starts writing integer values after `previousValue`.
+  void startIntegers(int64_t previousValue, int64_t previousDelta);
+
+  // Frees the integer state and returns the previous integer.
+  int64_t stopIntegers();
+
+  // Decoder state of the values.
+  struct ValueState {
+    uint64_t previousValue = 0;
+    uint64_t previousLeadingZeros = 0;
+    uint64_t previousTrailingZeros = 0;
+    int64_t previousIntegerDelta = 0;
+    bool integerValues = false;
+    bool milliseconds = false;
+  };
+
+  // Decoder state before the value at `index`.
+  struct Checkpoint {
+    uint64_t previousValue;
+    int64_t previousTimestamp;
+    uint32_t bitPos;
+    uint32_t index;
+    int32_t previousTimestampDelta;
+    uint8_t previousLeadingZeros;
+    uint8_t previousTrailingZeros;
+  };
+
+  // Checkpoints are serialized as little-endian fields in the order of
+  // the struct, followed by two zero bytes, so that they don't depend
+  // on the layout or the byte order of the host.
+  static const size_t kCheckpointSize = 32;
+  static void appendCheckpoint(
+      const Checkpoint& checkpoint,
+      std::string& checkpoints);
+  static Checkpoint readCheckpoint(const char* data);
+
+  // Restores the decoder state from the last checkpoint that comes
+  // before `begin`. Returns the index of the next value to read or
+  // zero if there is no usable checkpoint, in which case the reader
+  // is not moved.
+  static int seekToCheckpoint(
+      BitReader& reader,
+      folly::StringPiece checkpoints,
+      int n,
+      int64_t begin,
+      int64_t& previousTimestamp,
+      int64_t& previousTimestampDelta,
+      ValueState& valueState);
+
+  // Decompression methods. Defined in TimeSeriesStream-inl.h so that
+  // they get inlined into the decoding loop.
+  static int64_t readFirstTimestamp(BitReader& reader, ValueState& state);
+  static double readNextValue(BitReader& reader, ValueState& state);
+  static double readNextXorValue(BitReader& reader, ValueState& state);
+  static double readNextIntegerValue(BitReader& reader, ValueState& state);
   static int64_t readNextTimestamp(
-      folly::StringPiece data,
-      uint64_t& bitPos,
+      BitReader& reader,
       int64_t& prevValue,
-      int64_t& prevDelta);
+      int64_t& prevDelta,
+      bool milliseconds);
+
+  // The first and the last millisecond of the second `unixTime`,
+  // clamped to the range of int64_t.
+  static int64_t getFirstMillisecond(int64_t unixTime);
+  static int64_t getLastMillisecond(int64_t unixTime);
+
+  // Same as visitValues(), but passes the timestamps of millisecond
+  // streams to `visitor` in milliseconds. `begin` and `end` are in
+  // seconds either way, and `milliseconds` is isMilliseconds(data).
+  template <typename Visitor>
+  static int visitNativeValues(
+      folly::StringPiece data,
+      folly::StringPiece checkpoints,
+      int n,
+      int64_t begin,
+      int64_t end,
+      bool milliseconds,
+      Visitor& visitor);
+
+  // Decodes the values from the `i`th on and passes them to `visitor`,
+  // adding the number of values visited to `count`. The values before
+  // `begin` have been skipped already, and the end of the range and the
+  // blacklist are only checked for each value when they can exclude
+  // some, so decoding a whole block runs without any checks.
+  template <bool kCheckEnd, bool kCheckBlacklist, typename Visitor>
+  static void visitRemainingValues(
+      BitReader& reader,
+      ValueState& valueState,
+      int64_t unixTime,
+      int64_t previousTimestampDelta,
+      int i,
+      int n,
+      int64_t end,
+      int64_t blacklistedMin,
+      int64_t blacklistedMax,
+      Visitor& visitor,
+      int& count);
 
   // Compression methods.
-  bool appendTimestamp(int64_t timestamp, int64_t minTimestampDelta);
+  typedef BasicBitWriter<StreamBuffer> Writer;
+
+  // Picks the encoding of the values of an empty stream from its first
+  // value. `integerMarker` forces the integer encoding.
+  void startValues(double value, bool integerMarker);
+
+  bool appendTimestamp(
+      int64_t timestamp,
+      int64_t minTimestampDelta,
+      Writer& writer);
+  void appendFirstTimestamp(
+      int64_t timestamp,
+      bool milliseconds,
+      Writer& writer);
+  static void appendDeltaOfDelta(
+      int64_t deltaOfDelta,
+      const TimestampEncoding* encodings,
+      Writer& writer);
+
+  // First timestamp of a millisecond stream.
+  int64_t getFirstMilliseconds() const;
+
+  // Previous timestamp of a millisecond stream, of which
+  // `prevTimestamp_` only keeps the low 32 bits.
+  int64_t getPreviousMilliseconds() const;
+
+  void appendValue(double value, Writer& writer);
+  void appendRepeats(uint32_t count, Writer& writer);
 
-  void appendValue(double value);
+  // Returns false without writing anything if the delta of delta of
+  // `value` doesn't fit in any of the integer encodings.
+  bool appendIntegerValue(int64_t value, Writer& writer);
 
-  folly::fbstring data_;
-  uint64_t previousValue_;
+  StreamBuffer data_;
+  union {
+    uint64_t previousValue_;
+    IntegerState* integerState_;
+  };
   uint32_t numBits_;
+
+  // In milliseconds in non-empty millisecond streams, of which the low
+  // 32 bits are kept, and in seconds otherwise.
   uint32_t prevTimestamp_;
   uint32_t prevTimestampDelta_;
   uint8_t previousValueLeadingZeros_;
   uint8_t previousValueTrailingZeros_;
 
  public:
+  // Decodes the values between begin and end inclusive one at a time,
+  // so that several streams can be merged without decoding any of them
+  // in full. Skips the same values as visitValues().
+  class Reader {
+   public:
+    Reader() : Reader(folly::StringPiece(), folly::StringPiece(), 0, 0, 0) {}
+
+    Reader(
+        folly::StringPiece data,
+        folly::StringPiece checkpoints,
+        int n,
+        int64_t begin,
+        int64_t end)
+        : reader_(data),
+          checkpoints_(checkpoints),
+          n_(data.empty() ? 0 : n),
+          milliseconds_(isMilliseconds(data)),
+          begin_(milliseconds_ ? getFirstMillisecond(begin) : begin),
+          end_(milliseconds_ ? getLastMillisecond(end) : end) {}
+
+    // Reads the next value. Returns false after the last one.
+    bool next(int64_t& unixTime, double& value);
+
+   private:
+    BitReader reader_;
+    folly::StringPiece checkpoints_;
+    ValueState valueState_;
+    int64_t previousTimestamp_ = 0;
+    int64_t previousTimestampDelta_ = kDefaultDelta;
+    int i_ = 0;
+    int n_;
+
+    // Millisecond streams are decoded in milliseconds, with `begin_`
+    // and `end_` in milliseconds, and returned in seconds.
+    bool milliseconds_;
+    int64_t begin_;
+    int64_t end_;
+  };
+
   // 16 unused bits.
   uint16_t extraData;
 };
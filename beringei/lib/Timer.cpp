@@ -10,6 +10,12 @@
 #include "Timer.h"
 
 #include <chrono>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define GORILLA_HAVE_TSC 1
+#endif
 
 using clk = std::chrono::high_resolution_clock;
 
@@ -65,5 +71,42 @@ int64_t Timer::getNow() const {
 void Timer::record() {
   sum_ += getNow() - start_;
 }
+
+// Timer's constructor would call Timer::getNow(), so start the timer
+// here instead.
+TscTimer::TscTimer(bool autoStart) : Timer(false) {
+  if (autoStart) {
+    start();
+  }
+}
+
+#ifdef GORILLA_HAVE_TSC
+static double getTscTicksPerUs() {
+  static const double ticksPerUs = []() {
+    auto clockStart = std::chrono::steady_clock::now();
+    uint64_t tscStart = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    uint64_t tscEnd = __rdtsc();
+    auto clockEnd = std::chrono::steady_clock::now();
+
+    double us = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    clockEnd - clockStart)
+                    .count() /
+        1000.0;
+    return (tscEnd - tscStart) / us;
+  }();
+  return ticksPerUs;
+}
+#endif
+
+int64_t TscTimer::getNow() const {
+#ifdef GORILLA_HAVE_TSC
+  // Calibrated before reading the counter.
+  double ticksPerUs = getTscTicksPerUs();
+  return __rdtsc() / ticksPerUs;
+#else
+  return Timer::getNow();
+#endif
+}
 }
 } // facebook::gorilla
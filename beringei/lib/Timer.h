@@ -51,5 +51,19 @@ class Timer {
   int64_t start_;
   int64_t sum_;
 };
+
+// class TscTimer
+//
+// Same as Timer but reads the time stamp counter of the CPU, which is
+// cheaper than asking the clock. The counter rate is measured against
+// the clock once per process, which takes 10ms on first use. Uses the
+// clock on CPUs without a time stamp counter.
+class TscTimer : public Timer {
+ public:
+  explicit TscTimer(bool autoStart = false);
+
+ protected:
+  int64_t getNow() const override;
+};
 }
 } // facebook::gorilla
@@ -0,0 +1,218 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "Tracing.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <folly/Random.h>
+#include <folly/experimental/FunctionScheduler.h>
+#include "glog/logging.h"
+
+DEFINE_double(
+    gorilla_trace_sample_rate,
+    0,
+    "Fraction of the requests to trace. The servers trace the requests "
+    "that the clients sampled regardless.");
+DEFINE_int32(
+    gorilla_trace_buffer_size,
+    65536,
+    "Number of the most recent spans to keep until they are written out");
+DEFINE_string(
+    gorilla_trace_file,
+    "",
+    "File to append the spans to. They are logged if empty.");
+DEFINE_int32(
+    gorilla_trace_export_interval_secs,
+    10,
+    "How often the recorded spans are written out");
+
+namespace facebook {
+namespace gorilla {
+
+const std::string Tracing::kHeader = "beringei_trace_id";
+
+thread_local uint64_t Tracing::currentTraceId_ = 0;
+
+TraceBuffer::TraceBuffer(size_t size)
+    : size_(std::max<size_t>(size, 1)), slots_(new Slot[size_]), next_(0) {}
+
+void TraceBuffer::record(const Span& span) {
+  uint64_t position = next_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots_[position % size_];
+  slot.sequence.store(2 * position + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.traceId.store(span.traceId, std::memory_order_relaxed);
+  slot.name.store(span.name, std::memory_order_relaxed);
+  slot.shardId.store(span.shardId, std::memory_order_relaxed);
+  slot.startUs.store(span.startUs, std::memory_order_relaxed);
+  slot.durationUs.store(span.durationUs, std::memory_order_relaxed);
+  slot.sequence.store(2 * position + 2, std::memory_order_release);
+}
+
+uint64_t TraceBuffer::collect(uint64_t position, std::vector<Span>& spans)
+    const {
+  uint64_t end = next_.load(std::memory_order_acquire);
+  if (end > size_) {
+    position = std::max(position, end - size_);
+  }
+
+  for (; position < end; position++) {
+    const Slot& slot = slots_[position % size_];
+    uint64_t sequence = 2 * position + 2;
+    if (slot.sequence.load(std::memory_order_acquire) != sequence) {
+      // Still being written, or overwritten already.
+      continue;
+    }
+
+    Span span;
+    span.traceId = slot.traceId.load(std::memory_order_relaxed);
+    span.name = slot.name.load(std::memory_order_relaxed);
+    span.shardId = slot.shardId.load(std::memory_order_relaxed);
+    span.startUs = slot.startUs.load(std::memory_order_relaxed);
+    span.durationUs = slot.durationUs.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+      spans.push_back(span);
+    }
+  }
+  return end;
+}
+
+namespace {
+
+// The buffer of the process and the thread that writes it out. Only
+// created once the first span is recorded.
+class Exporter {
+ public:
+  Exporter() : buffer(FLAGS_gorilla_trace_buffer_size), position_(0) {
+    if (FLAGS_gorilla_trace_export_interval_secs > 0) {
+      scheduler_.addFunction(
+          [this]() { write(); },
+          std::chrono::seconds(FLAGS_gorilla_trace_export_interval_secs),
+          "trace_export");
+      scheduler_.start();
+    }
+  }
+
+  ~Exporter() {
+    scheduler_.shutdown();
+  }
+
+  TraceBuffer buffer;
+
+ private:
+  void write() {
+    std::vector<TraceBuffer::Span> spans;
+    position_ = buffer.collect(position_, spans);
+    if (spans.empty()) {
+      return;
+    }
+
+    FILE* f = nullptr;
+    if (!FLAGS_gorilla_trace_file.empty()) {
+      f = fopen(FLAGS_gorilla_trace_file.c_str(), "a");
+      if (!f) {
+        PLOG(ERROR) << "Can't open " << FLAGS_gorilla_trace_file;
+        return;
+      }
+    }
+
+    for (const auto& span : spans) {
+      char line[256];
+      snprintf(
+          line,
+          sizeof(line),
+          "%s %s %lld %lld %lld",
+          Tracing::format(span.traceId).c_str(),
+          span.name,
+          (long long)span.shardId,
+          (long long)span.startUs,
+          (long long)span.durationUs);
+      if (f) {
+        fprintf(f, "%s\n", line);
+      } else {
+        LOG(INFO) << "Trace span " << line;
+      }
+    }
+
+    if (f) {
+      fclose(f);
+    }
+  }
+
+  folly::FunctionScheduler scheduler_;
+  uint64_t position_;
+};
+
+Exporter& getExporter() {
+  static Exporter exporter;
+  return exporter;
+}
+}
+
+uint64_t Tracing::sampleSlow() {
+  if (folly::Random::randDouble01() >= FLAGS_gorilla_trace_sample_rate) {
+    return 0;
+  }
+
+  uint64_t traceId;
+  do {
+    traceId = folly::Random::rand64();
+  } while (traceId == 0);
+  return traceId;
+}
+
+void Tracing::record(
+    uint64_t traceId,
+    const char* name,
+    int64_t startUs,
+    int64_t shardId) {
+  if (traceId == 0) {
+    return;
+  }
+  TraceBuffer::Span span;
+  span.traceId = traceId;
+  span.name = name;
+  span.shardId = shardId;
+  span.startUs = startUs;
+  span.durationUs = nowUs() - startUs;
+  getExporter().buffer.record(span);
+}
+
+int64_t Tracing::nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string Tracing::format(uint64_t traceId) {
+  char header[17];
+  snprintf(header, sizeof(header), "%016llx", (unsigned long long)traceId);
+  return header;
+}
+
+uint64_t Tracing::parse(const std::string& header) {
+  try {
+    return std::stoull(header, nullptr, 16);
+  } catch (const std::exception&) {
+    return 0;
+  }
+}
+
+uint64_t Tracing::collect(
+    uint64_t position,
+    std::vector<TraceBuffer::Span>& spans) {
+  return getExporter().buffer.collect(position, spans);
+}
+}
+} // facebook::gorilla
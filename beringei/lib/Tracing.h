@@ -0,0 +1,156 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+
+DECLARE_double(gorilla_trace_sample_rate);
+
+namespace facebook {
+namespace gorilla {
+
+// class TraceBuffer
+//
+// Ring buffer of the last `size` spans. Any number of threads can record
+// spans without locks. Readers copy out the spans recorded since their
+// last read and skip the ones that were overwritten in the meantime.
+class TraceBuffer {
+ public:
+  struct Span {
+    uint64_t traceId;
+    // Must be a string literal.
+    const char* name;
+    int64_t shardId;
+    int64_t startUs;
+    int64_t durationUs;
+  };
+
+  explicit TraceBuffer(size_t size);
+
+  void record(const Span& span);
+
+  // Appends the spans recorded from `position` on to `spans` and returns
+  // the position after the last one.
+  uint64_t collect(uint64_t position, std::vector<Span>& spans) const;
+
+ private:
+  // `sequence` is odd while the slot is being written and twice the
+  // position plus two once it holds the span at that position.
+  struct Slot {
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<uint64_t> traceId{0};
+    std::atomic<const char*> name{nullptr};
+    std::atomic<int64_t> shardId{0};
+    std::atomic<int64_t> startUs{0};
+    std::atomic<int64_t> durationUs{0};
+  };
+
+  const size_t size_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> next_;
+};
+
+// class Tracing
+//
+// Sampled request tracing. The client picks a trace id for a sample of
+// its requests and sends it to the servers in a Thrift header. While a
+// request is traced, the thread that handles it has the trace id set
+// with a TraceScope and SpanScopes record how long each step took into a
+// process wide TraceBuffer, which is written out every few seconds.
+//
+// Without a trace id a SpanScope costs a thread local load and a branch.
+class Tracing {
+ public:
+  // Thrift header that carries the trace id.
+  static const std::string kHeader;
+
+  // Returns a new trace id for the sampled requests and 0 for the others.
+  static uint64_t sample() {
+    return FLAGS_gorilla_trace_sample_rate > 0 ? sampleSlow() : 0;
+  }
+
+  // The trace id of the request the calling thread works on, or 0.
+  static uint64_t current() {
+    return currentTraceId_;
+  }
+
+  // Records a span from `startUs` until now.
+  static void record(
+      uint64_t traceId,
+      const char* name,
+      int64_t startUs,
+      int64_t shardId = -1);
+
+  static int64_t nowUs();
+
+  // The trace id as sent in the header.
+  static std::string format(uint64_t traceId);
+
+  // Parses the trace id in a header, returning 0 if it isn't valid.
+  static uint64_t parse(const std::string& header);
+
+  // Appends the spans recorded from `position` on to `spans` and returns
+  // the position after the last one.
+  static uint64_t collect(
+      uint64_t position,
+      std::vector<TraceBuffer::Span>& spans);
+
+  // Sets the trace id of the calling thread until it goes out of scope.
+  class TraceScope {
+   public:
+    explicit TraceScope(uint64_t traceId) : previous_(currentTraceId_) {
+      currentTraceId_ = traceId;
+    }
+
+    ~TraceScope() {
+      currentTraceId_ = previous_;
+    }
+
+   private:
+    const uint64_t previous_;
+  };
+
+  // Records a span of the current trace from its construction until it
+  // goes out of scope.
+  class SpanScope {
+   public:
+    explicit SpanScope(const char* name, int64_t shardId = -1)
+        : traceId_(currentTraceId_), name_(name), shardId_(shardId) {
+      if (traceId_ != 0) {
+        startUs_ = nowUs();
+      }
+    }
+
+    ~SpanScope() {
+      if (traceId_ != 0) {
+        record(traceId_, name_, startUs_, shardId_);
+      }
+    }
+
+   private:
+    const uint64_t traceId_;
+    const char* name_;
+    const int64_t shardId_;
+    int64_t startUs_ = 0;
+  };
+
+ private:
+  static uint64_t sampleSlow();
+
+  static thread_local uint64_t currentTraceId_;
+};
+}
+} // facebook::gorilla
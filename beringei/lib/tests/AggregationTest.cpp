@@ -0,0 +1,326 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "beringei/lib/Aggregation.h"
+#include "beringei/lib/TimeSeries.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+TEST(AggregationTest, Kernels) {
+  srandom(1);
+
+  // Cover the vectorized loops and the tails.
+  for (int n = 1; n < 100; n++) {
+    vector<double> values;
+    for (int i = 0; i < n; i++) {
+      values.push_back((double)(random() % 20000) / 8 - 1000);
+    }
+
+    double sum = 0;
+    for (auto value : values) {
+      sum += value;
+    }
+
+    EXPECT_DOUBLE_EQ(sum, Aggregation::sum(values.data(), n));
+    EXPECT_EQ(
+        *min_element(values.begin(), values.end()),
+        Aggregation::min(values.data(), n));
+    EXPECT_EQ(
+        *max_element(values.begin(), values.end()),
+        Aggregation::max(values.data(), n));
+    EXPECT_DOUBLE_EQ(sum / n, Aggregation::avg(values.data(), n));
+    EXPECT_EQ(values.back(), Aggregation::last(values.data(), n));
+    EXPECT_EQ(
+        n, Aggregation::aggregate(AggregationType::COUNT, values.data(), n));
+  }
+}
+
+TEST(AggregationTest, Empty) {
+  EXPECT_EQ(0, Aggregation::sum(nullptr, 0));
+  EXPECT_TRUE(std::isnan(Aggregation::min(nullptr, 0)));
+  EXPECT_TRUE(std::isnan(Aggregation::max(nullptr, 0)));
+  EXPECT_TRUE(std::isnan(Aggregation::avg(nullptr, 0)));
+  EXPECT_TRUE(std::isnan(Aggregation::last(nullptr, 0)));
+}
+
+TEST(AggregationTest, MinMaxSkipNaN) {
+  vector<double> values(20, 1.0);
+  values[3] = NAN;
+  values[10] = 5.0;
+  values[11] = -5.0;
+  values[17] = NAN;
+
+  EXPECT_EQ(-5.0, Aggregation::min(values.data(), values.size()));
+  EXPECT_EQ(5.0, Aggregation::max(values.data(), values.size()));
+}
+
+TEST(AggregationTest, Downsample) {
+  vector<int64_t> timestamps = {95, 100, 110, 120, 150, 190, 260, 400};
+  vector<double> values = {100, 1, 2, 3, 4, 5, 6, 100};
+
+  // Windows [100, 160), [160, 220) and [220, 280).
+  vector<double> out;
+  Aggregation::downsample(
+      timestamps.data(),
+      values.data(),
+      timestamps.size(),
+      100,
+      60,
+      3,
+      AggregationType::AVG,
+      out);
+  ASSERT_EQ(3, out.size());
+  EXPECT_EQ(2.5, out[0]);
+  EXPECT_EQ(5, out[1]);
+  EXPECT_EQ(6, out[2]);
+
+  Aggregation::downsample(
+      timestamps.data(),
+      values.data(),
+      timestamps.size(),
+      100,
+      60,
+      4,
+      AggregationType::COUNT,
+      out);
+  ASSERT_EQ(4, out.size());
+  EXPECT_EQ(4, out[0]);
+  EXPECT_EQ(1, out[1]);
+  EXPECT_EQ(1, out[2]);
+  EXPECT_EQ(0, out[3]);
+
+  Aggregation::downsample(
+      timestamps.data(),
+      values.data(),
+      timestamps.size(),
+      100,
+      60,
+      4,
+      AggregationType::MAX,
+      out);
+  EXPECT_EQ(4, out[0]);
+  EXPECT_TRUE(std::isnan(out[3]));
+}
+
+TEST(AggregationTest, Blocks) {
+  vector<TimeSeriesBlock> blocks(2);
+  vector<TimeValuePair> values;
+  for (int i = 0; i < 240; i++) {
+    TimeValuePair value;
+    value.unixTime = 1000 + i * 60;
+    value.value = i;
+    values.push_back(value);
+    if (i == 119) {
+      TimeSeries::writeValues(values, blocks[0]);
+      values.clear();
+    }
+  }
+  TimeSeries::writeValues(values, blocks[1]);
+
+  EXPECT_EQ(
+      240,
+      Aggregation::aggregate(
+          AggregationType::COUNT, blocks, 0, 1000 + 240 * 60));
+  EXPECT_EQ(
+      239,
+      Aggregation::aggregate(AggregationType::MAX, blocks, 0, 1000 + 240 * 60));
+
+  // One hour windows.
+  vector<double> out;
+  Aggregation::downsample(
+      blocks, 1000, 1000 + 4 * 3600 - 1, 3600, AggregationType::AVG, out);
+  ASSERT_EQ(4, out.size());
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(i * 60 + 29.5, out[i]);
+  }
+}
+
+TEST(AggregationTest, FusedDownsampleMatchesColumnar) {
+  srandom(2);
+
+  vector<TimeSeriesBlock> blocks(3);
+  int64_t unixTime = 10000;
+  for (auto& block : blocks) {
+    vector<TimeValuePair> values;
+    for (int i = 0; i < 500; i++) {
+      TimeValuePair value;
+      unixTime += random() % 120 + 1;
+      value.unixTime = unixTime;
+      value.value = (double)(random() % 1000) / 4;
+      values.push_back(value);
+    }
+    TimeSeries::writeValues(values, block);
+  }
+
+  vector<int64_t> timestamps(1500);
+  vector<double> values(1500);
+  int64_t begin = 20000;
+  int64_t end = unixTime - 5000;
+  int count =
+      TimeSeries::getValues(blocks, timestamps.data(), values.data(), 0, end);
+
+  for (auto type :
+       {AggregationType::SUM,
+        AggregationType::MIN,
+        AggregationType::MAX,
+        AggregationType::COUNT,
+        AggregationType::AVG,
+        AggregationType::LAST}) {
+    vector<double> expected;
+    Aggregation::downsample(
+        timestamps.data(),
+        values.data(),
+        count,
+        begin,
+        300,
+        (end - begin) / 300 + 1,
+        type,
+        expected);
+
+    vector<double> out;
+    Aggregation::downsample(blocks, begin, end, 300, type, out);
+
+    ASSERT_EQ(expected.size(), out.size());
+    for (int i = 0; i < out.size(); i++) {
+      if (std::isnan(expected[i])) {
+        ASSERT_TRUE(std::isnan(out[i]));
+      } else {
+        ASSERT_DOUBLE_EQ(expected[i], out[i]);
+      }
+    }
+  }
+}
+
+TEST(AggregationTest, DownsampleBlocks) {
+  vector<TimeValuePair> points(6);
+  for (int i = 0; i < points.size(); i++) {
+    points[i].unixTime = 100 + i * 10;
+    points[i].value = i;
+  }
+  vector<TimeSeriesBlock> blocks(1);
+  TimeSeries::writeValues(points, blocks[0]);
+
+  AggregationSpec spec;
+  vector<double> windows;
+  ASSERT_FALSE(Aggregation::downsampleBlocks(spec, 100, 199, blocks, windows));
+  ASSERT_EQ(1, blocks.size());
+
+  // The last window has no points.
+  spec.step = 20;
+  spec.function = AggregationFunction::SUM;
+  ASSERT_TRUE(Aggregation::downsampleBlocks(spec, 100, 199, blocks, windows));
+  ASSERT_EQ(5, windows.size());
+  EXPECT_TRUE(std::isnan(windows[4]));
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(blocks, values, 0, 1000);
+  ASSERT_EQ(3, values.size());
+  EXPECT_EQ(100, values[0].unixTime);
+  EXPECT_EQ(1, values[0].value);
+  EXPECT_EQ(120, values[1].unixTime);
+  EXPECT_EQ(5, values[1].value);
+  EXPECT_EQ(140, values[2].unixTime);
+  EXPECT_EQ(9, values[2].value);
+}
+
+TEST(AggregationTest, Reduce) {
+  const double kNaN = std::numeric_limits<double>::quiet_NaN();
+  vector<vector<double>> windows = {{1, kNaN, 3}, {5, kNaN, kNaN}};
+
+  vector<TimeSeriesBlock> blocks;
+  Aggregation::reduce(AggregationType::MAX, 100, 60, windows, blocks);
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(blocks, values, 0, 1000);
+  ASSERT_EQ(2, values.size());
+  EXPECT_EQ(100, values[0].unixTime);
+  EXPECT_EQ(5, values[0].value);
+  EXPECT_EQ(220, values[1].unixTime);
+  EXPECT_EQ(3, values[1].value);
+}
+
+TEST(AggregationTest, LargestTriangleThreeBuckets) {
+  // A flat line with one spike in each third.
+  vector<TimeValuePair> in;
+  for (int i = 0; i < 32; i++) {
+    TimeValuePair tv;
+    tv.unixTime = 60 * i;
+    tv.value = i == 5 || i == 25 ? 100 : i == 15 ? -100 : 0;
+    in.push_back(tv);
+  }
+
+  vector<TimeValuePair> out;
+  Aggregation::largestTriangleThreeBuckets(in, 5, out);
+  ASSERT_EQ(5, out.size());
+  EXPECT_EQ(0, out[0].unixTime);
+  EXPECT_EQ(60 * 5, out[1].unixTime);
+  EXPECT_EQ(60 * 15, out[2].unixTime);
+  EXPECT_EQ(60 * 25, out[3].unixTime);
+  EXPECT_EQ(60 * 31, out[4].unixTime);
+
+  Aggregation::largestTriangleThreeBuckets(in, 32, out);
+  EXPECT_EQ(in, out);
+  Aggregation::largestTriangleThreeBuckets(in, 2, out);
+  EXPECT_EQ(in, out);
+}
+
+TEST(AggregationTest, SwingingDoor) {
+  // Two ramps with a little noise, then a NaN.
+  vector<TimeValuePair> in;
+  for (int i = 0; i < 40; i++) {
+    TimeValuePair tv;
+    tv.unixTime = 60 * i;
+    tv.value = (i < 20 ? i : 40 - i) + (i % 2 ? 0.1 : -0.1);
+    in.push_back(tv);
+  }
+  in[35].value = std::numeric_limits<double>::quiet_NaN();
+
+  vector<TimeValuePair> out;
+  Aggregation::swingingDoor(in, 0.5, 0, out);
+  ASSERT_LT(out.size(), 10);
+  EXPECT_EQ(in.front(), out.front());
+  EXPECT_EQ(in.back().unixTime, out.back().unixTime);
+
+  // Every point is within the error of the line between the kept
+  // points around it, and the NaN is kept.
+  bool keptNaN = false;
+  size_t next = 0;
+  for (size_t i = 0; i < in.size(); i++) {
+    if (in[i].unixTime == out[next].unixTime) {
+      keptNaN |= std::isnan(out[next].value);
+      next++;
+      continue;
+    }
+    const auto& a = out[next - 1];
+    const auto& b = out[next];
+    double line = a.value +
+        (b.value - a.value) * (in[i].unixTime - a.unixTime) /
+            (b.unixTime - a.unixTime);
+    EXPECT_LE(std::abs(in[i].value - line), 0.5 + 1e-9) << i;
+  }
+  EXPECT_EQ(out.size(), next);
+  EXPECT_TRUE(keptNaN);
+
+  // No further apart than the maximum gap.
+  Aggregation::swingingDoor(in, 0.5, 600, out);
+  for (size_t i = 1; i < out.size(); i++) {
+    EXPECT_LE(out[i].unixTime - out[i - 1].unixTime, 600);
+  }
+
+  // No error keeps the noisy points.
+  Aggregation::swingingDoor(in, 0, 0, out);
+  EXPECT_EQ(in.size(), out.size());
+}
@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <folly/Benchmark.h>
+#include <folly/init/Init.h>
+
+#include "beringei/lib/BitUtil.h"
+#include "beringei/lib/BitWriter.h"
+#include "beringei/lib/DataLogUtil.h"
+#include "beringei/lib/TimeSeriesStream.h"
+
+using namespace facebook::gorilla;
+
+namespace {
+
+// Roughly the number of points in one 2h bucket of a 1s series.
+const int kRecordsPerString = 7200;
+
+// Each record mimics one encoded point: a short control prefix for
+// the timestamp, a delta of delta, a value control bit and a
+// variable length XOR block.
+struct Record {
+  std::vector<std::pair<uint64_t, uint32_t>> fields;
+};
+
+std::vector<Record> generateRecords() {
+  std::mt19937_64 rng(1);
+  std::vector<Record> records(kRecordsPerString);
+  for (auto& record : records) {
+    uint32_t deltaBits = rng() % 2 ? 1 : 9;
+    uint32_t blockBits = rng() % 3 == 0 ? 1 : 2 + rng() % 52;
+    record.fields.emplace_back(rng() & 0x3, 2);
+    record.fields.emplace_back(rng() & ((1ULL << deltaBits) - 1), deltaBits);
+    record.fields.emplace_back(rng() & 0x1, 1);
+    record.fields.emplace_back(rng() & ((1ULL << blockBits) - 1), blockBits);
+  }
+  return records;
+}
+
+const std::vector<Record>& records() {
+  static const std::vector<Record> kRecords = generateRecords();
+  return kRecords;
+}
+
+std::vector<std::pair<int64_t, double>> generatePoints() {
+  std::mt19937_64 rng(1);
+  std::vector<std::pair<int64_t, double>> points;
+  int64_t unixTime = 1500000000;
+  double value = 0;
+  for (int i = 0; i < kRecordsPerString; i++) {
+    unixTime += 59 + rng() % 3;
+    value = rng() % 4 == 0 ? value : (double)(rng() % 10000) / 100;
+    points.emplace_back(unixTime, value);
+  }
+  return points;
+}
+} // namespace
+
+BENCHMARK(addValueToBitString, iters) {
+  const auto& input = records();
+  while (iters--) {
+    folly::fbstring bits;
+    uint32_t numBits = 0;
+    for (const auto& record : input) {
+      for (const auto& field : record.fields) {
+        BitUtil::addValueToBitString(field.first, field.second, bits, numBits);
+      }
+    }
+    folly::doNotOptimizeAway(bits.size());
+  }
+}
+
+BENCHMARK_RELATIVE(bitWriterWrite, iters) {
+  const auto& input = records();
+  while (iters--) {
+    folly::fbstring bits;
+    uint32_t numBits = 0;
+    for (const auto& record : input) {
+      BitWriter writer(bits, numBits);
+      for (const auto& field : record.fields) {
+        writer.write(field.first, field.second);
+      }
+    }
+    folly::doNotOptimizeAway(bits.size());
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(timeSeriesStreamAppend, iters) {
+  std::vector<std::pair<int64_t, double>> points;
+  BENCHMARK_SUSPEND {
+    points = generatePoints();
+  }
+
+  while (iters--) {
+    TimeSeriesStream stream;
+    for (const auto& point : points) {
+      stream.append(point.first, point.second, 0);
+    }
+    folly::doNotOptimizeAway(stream.size());
+  }
+}
+
+BENCHMARK(dataLogAppend, iters) {
+  std::vector<std::pair<int64_t, double>> points;
+  BENCHMARK_SUSPEND {
+    points = generatePoints();
+  }
+
+  while (iters--) {
+    int64_t lastTimestamp = points[0].first;
+    double previousValue = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < points.size(); i++) {
+      folly::fbstring bits;
+      uint32_t numBits = 0;
+      BitWriter writer(bits, numBits);
+
+      double value = points[i].second;
+      uint64_t* v = (uint64_t*)&value;
+      uint64_t* previous = (uint64_t*)&previousValue;
+      DataLogUtil::appendId(i, writer);
+      DataLogUtil::appendTimestampDelta(
+          points[i].first - lastTimestamp, writer);
+      DataLogUtil::appendValueXor(*v ^ *previous, writer);
+      writer.flush();
+
+      lastTimestamp = points[i].first;
+      previousValue = value;
+      bytes += bits.size();
+    }
+    folly::doNotOptimizeAway(bytes);
+  }
+}
+
+int main(int argc, char** argv) {
+  folly::init(&argc, &argv);
+  folly::runBenchmarks();
+  return 0;
+}
@@ -9,7 +9,9 @@
 
 #include <gtest/gtest.h>
 
+#include "beringei/lib/BitReader.h"
 #include "beringei/lib/BitUtil.h"
+#include "beringei/lib/BitWriter.h"
 
 using namespace ::testing;
 using namespace facebook::gorilla;
@@ -141,3 +143,128 @@ TEST(BitUtilTest, ReadTooMuch) {
   folly::StringPiece data(str.c_str(), str.size());
   ASSERT_ANY_THROW(BitUtil::readValueThroughFirstZero(data, bitPos, 10));
 }
+
+TEST(BitUtilTest, BitReaderMatchesBitUtil) {
+  fbstring str;
+  uint32_t length = 0;
+
+  srandom(1);
+  std::vector<std::pair<uint64_t, uint32_t>> values;
+  for (int i = 0; i < 10000; i++) {
+    uint32_t bits = random() % 64 + 1;
+    uint64_t value = ((uint64_t)random() << 32 | random()) >> (64 - bits);
+    values.push_back(std::make_pair(value, bits));
+    BitUtil::addValueToBitString(value, bits, str, length);
+  }
+
+  folly::StringPiece data(str.c_str(), str.size());
+  BitReader reader(data);
+  uint64_t bitPos = 0;
+  for (auto& value : values) {
+    ASSERT_EQ(value.first, reader.read(value.second));
+    ASSERT_EQ(
+        value.first,
+        BitUtil::readValueFromBitString(data, bitPos, value.second));
+    ASSERT_EQ(bitPos, reader.bitPos());
+  }
+}
+
+TEST(BitUtilTest, BitReaderControlBits) {
+  fbstring str;
+  uint32_t length = 0;
+
+  BitUtil::addValueToBitString(0, 1, str, length); // 0
+  BitUtil::addValueToBitString(6, 3, str, length); // 110
+  BitUtil::addValueToBitString(15, 4, str, length); // 1111
+  BitUtil::addValueToBitString(2, 2, str, length); // 10
+
+  folly::StringPiece data(str.c_str(), str.size());
+  BitReader reader(data);
+  ASSERT_EQ(0, reader.findTheFirstZeroBit(4));
+  ASSERT_EQ(2, reader.findTheFirstZeroBit(4));
+  ASSERT_EQ(4, reader.findTheFirstZeroBit(4));
+  ASSERT_EQ(2, reader.readValueThroughFirstZero(3));
+  ASSERT_EQ(10, reader.bitPos());
+
+  // The rest of the byte is padding zeros.
+  ASSERT_EQ(0, reader.read(6));
+  ASSERT_ANY_THROW(reader.read(1));
+  ASSERT_ANY_THROW(reader.findTheFirstZeroBit(4));
+}
+
+TEST(BitUtilTest, BitWriterMatchesBitUtil) {
+  fbstring expected;
+  uint32_t expectedLength = 0;
+  fbstring str;
+  uint32_t length = 0;
+
+  srandom(2);
+  for (int i = 0; i < 1000; i++) {
+    // Use a new writer every few values to cover continuing from a
+    // partially filled byte.
+    BitWriter writer(str, length);
+    int values = random() % 10;
+    for (int j = 0; j < values; j++) {
+      uint32_t bits = random() % 65;
+      uint64_t value = bits == 0
+          ? 0
+          : ((uint64_t)random() << 32 | random()) >> (64 - bits);
+      BitUtil::addValueToBitString(value, bits, expected, expectedLength);
+      writer.write(value, bits);
+    }
+    writer.flush();
+    ASSERT_EQ(expectedLength, length);
+    ASSERT_EQ(expected, str);
+  }
+}
+
+TEST(BitUtilTest, BitWriterFlush) {
+  fbstring str;
+  uint32_t length = 0;
+
+  BitWriter writer(str, length);
+  writer.write(5, 3); // 101
+  ASSERT_EQ(3, length);
+  ASSERT_EQ(0, str.size());
+
+  writer.flush();
+  ASSERT_EQ(1, str.size());
+  ASSERT_EQ((char)0xA0, str[0]);
+
+  // Keeps filling the same byte after a flush.
+  writer.write(31, 5); // 11111
+  writer.write(1, 1); // 1
+  writer.flush();
+  ASSERT_EQ(9, length);
+  ASSERT_EQ(2, str.size());
+  ASSERT_EQ((char)0xBF, str[0]);
+  ASSERT_EQ((char)0x80, str[1]);
+
+  uint64_t bitPos = 0;
+  folly::StringPiece data(str.c_str(), str.size());
+  ASSERT_EQ(0x17F, BitUtil::readValueFromBitString(data, bitPos, 9));
+}
+
+TEST(BitUtilTest, BufferBitWriterMatchesBitWriter) {
+  srandom(3);
+  for (int i = 0; i < 1000; i++) {
+    fbstring expected;
+    uint32_t expectedLength = 0;
+    char buffer[128];
+    BufferBitWriter writer(buffer);
+    {
+      BitWriter expectedWriter(expected, expectedLength);
+      int values = random() % 15;
+      for (int j = 0; j < values; j++) {
+        uint32_t bits = random() % 65;
+        uint64_t value = bits == 0
+            ? 0
+            : ((uint64_t)random() << 32 | random()) >> (64 - bits);
+        expectedWriter.write(value, bits);
+        writer.write(value, bits);
+      }
+    }
+    ASSERT_EQ(expected.size(), writer.flush());
+    ASSERT_EQ(0, memcmp(expected.data(), buffer, expected.size()));
+  }
+}
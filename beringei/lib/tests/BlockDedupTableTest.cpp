@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/BlockDedupTable.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+TEST(BlockDedupTableTest, InsertAndFind) {
+  BlockDedupTable table;
+  auto any = [](uint64_t) { return true; };
+  EXPECT_EQ(0, table.find(1, any));
+
+  for (uint64_t i = 1; i <= 1000; i++) {
+    table.insert(i * 0x9E3779B97F4A7C15ULL, i);
+  }
+  EXPECT_EQ(1000, table.size());
+  EXPECT_LE(table.size() * 10, table.capacity() * 7);
+
+  for (uint64_t i = 1; i <= 1000; i++) {
+    EXPECT_EQ(i, table.find(i * 0x9E3779B97F4A7C15ULL, any));
+  }
+  EXPECT_EQ(0, table.find(1001 * 0x9E3779B97F4A7C15ULL, any));
+}
+
+TEST(BlockDedupTableTest, SameHash) {
+  BlockDedupTable table;
+  table.insert(5, 10);
+  table.insert(5, 20);
+  table.insert(5, 30);
+
+  EXPECT_EQ(20, table.find(5, [](uint64_t id) { return id == 20; }));
+  EXPECT_EQ(30, table.find(5, [](uint64_t id) { return id > 20; }));
+  EXPECT_EQ(0, table.find(5, [](uint64_t id) { return id == 40; }));
+}
+
+TEST(BlockDedupTableTest, Reset) {
+  BlockDedupTable table;
+  table.reset(1000);
+  size_t capacity = table.capacity();
+  EXPECT_LE(1000 * 10, capacity * 7);
+
+  for (uint64_t i = 1; i <= 1000; i++) {
+    table.insert(i, i);
+  }
+  EXPECT_EQ(capacity, table.capacity());
+
+  // Reused when the next bucket is about the same size.
+  table.reset(900);
+  EXPECT_EQ(0, table.size());
+  EXPECT_EQ(capacity, table.capacity());
+  EXPECT_EQ(0, table.find(1, [](uint64_t) { return true; }));
+
+  // Shrunk when it's much smaller.
+  table.reset(10);
+  EXPECT_LT(table.capacity(), capacity);
+
+  table.release();
+  EXPECT_EQ(0, table.capacity());
+  EXPECT_EQ(0, table.find(1, [](uint64_t) { return true; }));
+}
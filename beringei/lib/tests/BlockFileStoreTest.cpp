@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/BlockFileArchive.h"
+#include "beringei/lib/BlockFileStore.h"
+#include "beringei/lib/BucketStorage.h"
+#include "beringei/lib/FileUtils.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+TEST(BlockFileStoreTest, PutAndGet) {
+  TemporaryDirectory dir("gorilla_block_file_store");
+  DirectoryBlockFileStore store(dir.dirname());
+
+  string data;
+  EXPECT_FALSE(store.get(3, 100, data));
+  ASSERT_TRUE(store.put(3, 100, "block file"));
+  ASSERT_TRUE(store.get(3, 100, data));
+  EXPECT_EQ("block file", data);
+  EXPECT_FALSE(store.get(4, 100, data));
+
+  ASSERT_TRUE(store.put(3, 100, "replaced"));
+  ASSERT_TRUE(store.get(3, 100, data));
+  EXPECT_EQ("replaced", data);
+}
+
+TEST(BlockFileStoreTest, FinalizedBucketsAreArchived) {
+  TemporaryDirectory dataDir("gorilla_data_block");
+  TemporaryDirectory storeDir("gorilla_block_file_store");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dataDir.dirname(), "12"));
+  int64_t shardId = 12;
+  auto store = make_shared<DirectoryBlockFileStore>(storeDir.dirname());
+
+  vector<BucketStorage::BucketStorageId> ids;
+  {
+    BucketStorage storage(10, shardId, dataDir.dirname());
+    storage.setBlockFileStore(store);
+    for (int i = 0; i < 3; i++) {
+      string data(100 + i, 'a' + i);
+      ids.push_back(storage.store(100, data.c_str(), data.size(), 10 + i, i));
+      ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+    }
+    storage.finalizeBucket(100);
+  }
+  store->flush();
+
+  string local;
+  string archived;
+  FileUtils files(shardId, BucketStorage::kDataPrefix, dataDir.dirname());
+  ASSERT_TRUE(files.read(100, local));
+  ASSERT_TRUE(store->get(shardId, 100, archived));
+  EXPECT_EQ(local, archived);
+
+  // The bucket is read back from the store even when the local files
+  // are gone.
+  files.clearAll();
+  TemporaryDirectory cacheDir("gorilla_block_file_cache");
+  BlockFileArchive archive(shardId, store, cacheDir.dirname(), 2);
+  vector<TimeSeriesBlock> out0;
+  vector<TimeSeriesBlock> out2;
+  vector<TimeSeriesBlock> out7;
+  for (int repeat = 0; repeat < 2; repeat++) {
+    out0.clear();
+    out2.clear();
+    out7.clear();
+    ASSERT_TRUE(archive.get(100, {0, 2, 7}, {&out0, &out2, &out7}));
+    ASSERT_EQ(1, out0.size());
+    EXPECT_EQ(string(100, 'a'), out0[0].data);
+    EXPECT_EQ(10, out0[0].count);
+    ASSERT_EQ(1, out2.size());
+    EXPECT_EQ(string(102, 'c'), out2[0].data);
+    EXPECT_EQ(12, out2[0].count);
+    EXPECT_TRUE(out7.empty());
+  }
+
+  EXPECT_FALSE(archive.get(101, {0}, {&out0}));
+  EXPECT_EQ(1, out0.size());
+}
@@ -13,12 +13,21 @@
 #include "beringei/lib/BucketUtils.h"
 #include "beringei/lib/DataLog.h"
 #include "beringei/lib/FileUtils.h"
+#include "beringei/lib/LogReader.h"
+#include "beringei/lib/PartitionedBucketLogWriter.h"
 
 using namespace ::testing;
 using namespace facebook;
 using namespace facebook::gorilla;
 using namespace std;
 
+namespace facebook {
+namespace gorilla {
+DECLARE_int32(log_group_commit_ms);
+DECLARE_bool(combined_log);
+}
+} // facebook::gorilla
+
 class BucketLogWriterTest : public testing::Test {
  protected:
   void SetUp() override {
@@ -143,6 +152,31 @@ TEST_F(BucketLogWriterTest, ThreadedWrite) {
   readSingleValueFromLog(fileUtils, shardId, 40, ts4, 4.0, windowSize);
 }
 
+TEST_F(BucketLogWriterTest, GroupCommit) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "54"));
+
+  int shardId = 54;
+  int windowSize = 100;
+  int unixTime = 6480;
+  FileUtils fileUtils(shardId, "log", dir.dirname());
+  FLAGS_log_group_commit_ms = 10;
+
+  BucketLogWriter writer(windowSize, dir.dirname(), 10, 0);
+  writer.startShard(shardId);
+  writer.logData(shardId, 37, unixTime, 38.0);
+
+  // The entry is on disk after the group commit latency without
+  // flushing the queue or closing the file.
+  usleep(200000);
+  readSingleValueFromLog(fileUtils, shardId, 37, unixTime, 38.0, windowSize);
+
+  writer.stopShard(shardId);
+  writer.flushQueue();
+  FLAGS_log_group_commit_ms = 0;
+}
+
 TEST_F(BucketLogWriterTest, MultipleShards) {
   TemporaryDirectory dir("gorilla_test");
   boost::filesystem::create_directories(
@@ -171,3 +205,145 @@ TEST_F(BucketLogWriterTest, MultipleShards) {
   FileUtils fileUtils24(24, "log", dir.dirname());
   readSingleValueFromLog(fileUtils24, 24, 41, 5005, 5.0, windowSize);
 }
+
+TEST_F(BucketLogWriterTest, Partitioned) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "23"));
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "24"));
+
+  int windowSize = 100;
+  PartitionedBucketLogWriter writer(2, windowSize, dir.dirname(), 10, 0);
+  ASSERT_EQ(2, writer.partitions());
+  ASSERT_NE(writer.partition(23), writer.partition(24));
+
+  writer.startShard(23);
+  writer.startShard(24);
+  writer.logData(23, 38, 5002, 2.0);
+  writer.logDataBatch(24, {{41, 5005, 5.0}});
+  writer.stopShard(23);
+  writer.stopShard(24);
+  writer.flushQueue();
+
+  FileUtils fileUtils23(23, "log", dir.dirname());
+  readSingleValueFromLog(fileUtils23, 23, 38, 5002, 2.0, windowSize);
+
+  FileUtils fileUtils24(24, "log", dir.dirname());
+  readSingleValueFromLog(fileUtils24, 24, 41, 5005, 5.0, windowSize);
+}
+
+TEST_F(BucketLogWriterTest, CombinedLog) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "23"));
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "24"));
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "25"));
+
+  int windowSize = 100;
+  FLAGS_combined_log = true;
+  {
+    PartitionedBucketLogWriter writer(2, windowSize, dir.dirname(), 100, 0);
+    for (int shardId : {23, 24, 25}) {
+      writer.startShard(shardId);
+    }
+    for (int i = 0; i < 10; i++) {
+      for (int shardId : {23, 24, 25}) {
+        writer.logData(shardId, shardId + i, 5000 + i, shardId * i);
+      }
+    }
+    for (int shardId : {23, 24, 25}) {
+      writer.stopShard(shardId);
+    }
+    writer.flushQueue();
+  }
+  FLAGS_combined_log = false;
+
+  // No separate log files, but each shard is recovered from the
+  // combined log.
+  ASSERT_TRUE(FileUtils(23, "log", dir.dirname()).ls().empty());
+  for (int shardId : {23, 24, 25}) {
+    vector<uint32_t> ids;
+    vector<int64_t> times;
+    vector<double> values;
+    LocalLogReader reader(
+        shardId,
+        dir.dirname(),
+        windowSize,
+        [&](uint32_t id,
+            int64_t unixTime,
+            double value,
+            int16_t ms,
+            uint32_t& unknownKeys,
+            int64_t& lastTimestamp) {
+          ids.push_back(id);
+          times.push_back(unixTime);
+          values.push_back(value);
+        });
+
+    int64_t lastTimestamp = 0;
+    uint32_t unknownKeys = 0;
+    reader.readLog(0, lastTimestamp, unknownKeys);
+    ASSERT_EQ(10, ids.size());
+    for (int i = 0; i < 10; i++) {
+      ASSERT_EQ(shardId + i, ids[i]);
+      ASSERT_EQ(5000 + i, times[i]);
+      ASSERT_EQ(shardId * i, values[i]);
+    }
+  }
+}
+
+TEST_F(BucketLogWriterTest, Milliseconds) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "54"));
+
+  int shardId = 54;
+  int windowSize = 100;
+  int64_t unixTime = BucketUtils::floorTimestamp(5000, windowSize, shardId);
+  const int32_t longId = (1 << 21) + 5;
+
+  BucketLogWriter writer(windowSize, dir.dirname(), 100, 0);
+  writer.startShard(shardId);
+  writer.logData(shardId, 37, unixTime, 1.0, 250);
+  writer.logData(shardId, 37, unixTime, 2.0, 750);
+  writer.logData(shardId, 38, unixTime + 1, 3.0);
+  writer.logDataBatch(
+      shardId, {{39, unixTime + 1, 4.0, 999}, {longId, unixTime + 2, 5.0, 1}});
+  writer.stopShard(shardId);
+  writer.flushQueue();
+
+  vector<uint32_t> ids;
+  vector<int64_t> times;
+  vector<double> values;
+  vector<int16_t> ms;
+  LocalLogReader reader(
+      shardId,
+      dir.dirname(),
+      windowSize,
+      [&](uint32_t id,
+          int64_t unixTime,
+          double value,
+          int16_t pointMs,
+          uint32_t& unknownKeys,
+          int64_t& lastTimestamp) {
+        ids.push_back(id);
+        times.push_back(unixTime);
+        values.push_back(value);
+        ms.push_back(pointMs);
+      });
+
+  int64_t lastTimestamp = 0;
+  uint32_t unknownKeys = 0;
+  reader.readLog(0, lastTimestamp, unknownKeys);
+
+  EXPECT_EQ(vector<uint32_t>({37, 37, 38, 39, longId}), ids);
+  EXPECT_EQ(
+      vector<int64_t>(
+          {unixTime, unixTime, unixTime + 1, unixTime + 1, unixTime + 2}),
+      times);
+  EXPECT_EQ(vector<double>({1.0, 2.0, 3.0, 4.0, 5.0}), values);
+  EXPECT_EQ(vector<int16_t>({250, 750, 0, 999, 1}), ms);
+}
@@ -9,8 +9,12 @@
 
 #include <gtest/gtest.h>
 #include <atomic>
+#include <numeric>
+#include <thread>
 
+#include "beringei/lib/Aggregation.h"
 #include "beringei/lib/BucketMap.h"
+#include "beringei/lib/BucketUtils.h"
 #include "beringei/lib/BucketedTimeSeries.h"
 #include "beringei/lib/GorillaTimeConstants.h"
 #include "beringei/lib/TimeSeries.h"
@@ -32,6 +36,11 @@ const int kLoadTestRuns = 1;
 const string kDefaultKey = "key";
 
 DECLARE_int32(zippydb_batch_queue_element_size);
+DECLARE_double(key_list_compaction_dead_fraction);
+DECLARE_int32(deviation_index_threads);
+DECLARE_bool(gorilla_running_stats);
+DECLARE_string(rollup_tiers);
+DECLARE_string(gorilla_category_policies);
 
 class BucketMapTest : public testing::Test {
  public:
@@ -278,6 +287,200 @@ TEST_F(BucketMapTest, Reload) {
   ASSERT_EQ(1, o.size());
 }
 
+TEST_F(BucketMapTest, RequestedBlockFiles) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+
+  auto bucketLogWriter = std::make_shared<BucketLogWriter>(
+      4 * kGorillaSecondsPerHour, dir.dirname(), 100, 0);
+  bucketLogWriter->startShard(10);
+  {
+    auto keyWriter = std::make_shared<KeyListWriter>(dir.dirname(), 100);
+    keyWriter->startShard(10);
+    BucketMap map(
+        6,
+        4 * kGorillaSecondsPerHour,
+        10,
+        dir.dirname(),
+        keyWriter,
+        bucketLogWriter,
+        BucketMap::OWNED,
+        std::make_shared<LocalLogReaderFactory>(dir.dirname()));
+    for (int b = 1; b <= 4; b++) {
+      TimeValuePair tv;
+      tv.value = b;
+      tv.unixTime = map.timestamp(b);
+      map.put(kDefaultKey, tv, 0);
+      ASSERT_EQ(1, map.finalizeBuckets(b));
+    }
+    keyWriter->stopShard(10);
+    keyWriter->flushQueue();
+  }
+
+  auto keyWriter = std::make_shared<KeyListWriter>(dir.dirname(), 100);
+  keyWriter->startShard(10);
+  BucketMap map(
+      6,
+      4 * kGorillaSecondsPerHour,
+      10,
+      dir.dirname(),
+      keyWriter,
+      bucketLogWriter,
+      BucketMap::UNOWNED,
+      std::make_shared<LocalLogReaderFactory>(dir.dirname()));
+  map.setState(BucketMap::PRE_OWNED);
+  map.readKeyList();
+  map.readData();
+  ASSERT_EQ(BucketMap::READING_BLOCK_DATA, map.getState());
+
+  // The oldest bucket is read first once it's requested, even though
+  // the newest ones are read first otherwise.
+  ASSERT_EQ(1, map.requestBlockFiles(1, 1));
+  ASSERT_TRUE(map.readBlockFiles());
+  ASSERT_EQ(0, map.requestBlockFiles(1, 1));
+  ASSERT_EQ(1, map.requestBlockFiles(3, 3));
+  ASSERT_EQ(1, map.requestBlockFiles(4, 4));
+
+  // Requested block files can be read on their own, newest first.
+  ASSERT_TRUE(map.readRequestedBlockFiles());
+  ASSERT_EQ(0, map.requestBlockFiles(4, 4));
+  ASSERT_FALSE(map.readRequestedBlockFiles());
+  ASSERT_EQ(0, map.requestBlockFiles(3, 4));
+  ASSERT_FALSE(map.readRequestedBlockFiles());
+
+  while (map.readBlockFiles()) {
+  }
+  ASSERT_EQ(BucketMap::OWNED, map.getState());
+  ASSERT_EQ(0, map.requestBlockFiles(0, 4));
+
+  BucketedTimeSeries::Output out;
+  map.get(kDefaultKey)->second.get(1, 4, out, map.getStorage());
+  std::vector<TimeValuePair> values;
+  TimeSeries::getValues(out, values, 0, map.timestamp(5));
+  ASSERT_EQ(4, values.size());
+  for (int b = 1; b <= 4; b++) {
+    EXPECT_EQ(b, values[b - 1].value);
+  }
+}
+
+TEST_F(BucketMapTest, Snapshot) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+
+  const int kSnapshotKeys = 10;
+  auto bucketLogWriter = std::make_shared<BucketLogWriter>(
+      4 * kGorillaSecondsPerHour, dir.dirname(), 100, 0);
+  bucketLogWriter->startShard(10);
+
+  int64_t snapshotTime;
+  uint32_t openBucket;
+  {
+    auto keyWriter = std::make_shared<KeyListWriter>(dir.dirname(), 100);
+    keyWriter->startShard(10);
+    BucketMap map(
+        6,
+        4 * kGorillaSecondsPerHour,
+        10,
+        dir.dirname(),
+        keyWriter,
+        bucketLogWriter,
+        BucketMap::OWNED,
+        std::make_shared<LocalLogReaderFactory>(dir.dirname()));
+
+    // Nothing to snapshot before the previous bucket is finalized.
+    snapshotTime = time(nullptr);
+    openBucket = map.bucket(snapshotTime);
+    ASSERT_FALSE(map.writeSnapshot());
+
+    TimeValuePair tv;
+    tv.value = 100.0;
+    tv.unixTime = map.timestamp(openBucket - 1);
+    map.put(kDefaultKey, tv, 0);
+    ASSERT_EQ(1, map.finalizeBuckets(openBucket - 1));
+
+    for (int i = 0; i < kSnapshotKeys; i++) {
+      tv.unixTime = map.timestamp(openBucket);
+      tv.value = i;
+      map.put(keyList_.testStr(i), tv, 0);
+    }
+    bucketLogWriter->flushQueue();
+    ASSERT_TRUE(map.writeSnapshot());
+
+    for (int i = 0; i < kSnapshotKeys; i++) {
+      tv.unixTime = map.timestamp(openBucket) + kGorillaSecondsPerMinute;
+      tv.value = i + 0.5;
+      map.put(keyList_.testStr(i), tv, 0);
+    }
+    bucketLogWriter->stopShard(10);
+    bucketLogWriter->flushQueue();
+  }
+
+  // The points logged before the snapshot are only in the snapshot now.
+  FileUtils logFiles(10, BucketLogWriter::kLogFilePrefix, dir.dirname());
+  int removed = 0;
+  for (int64_t id : logFiles.ls()) {
+    if (id < snapshotTime &&
+        BucketUtils::bucket(id, 4 * kGorillaSecondsPerHour, 10) ==
+            openBucket) {
+      logFiles.remove(id);
+      removed++;
+    }
+  }
+  ASSERT_GT(removed, 0);
+
+  auto keyWriter = std::make_shared<KeyListWriter>(dir.dirname(), 100);
+  keyWriter->startShard(10);
+  BucketMap map(
+      6,
+      4 * kGorillaSecondsPerHour,
+      10,
+      dir.dirname(),
+      keyWriter,
+      bucketLogWriter,
+      BucketMap::OWNED,
+      std::make_shared<LocalLogReaderFactory>(dir.dirname()));
+  map.setState(BucketMap::PRE_UNOWNED);
+  map.setState(BucketMap::UNOWNED);
+  map.setState(BucketMap::PRE_OWNED);
+  map.readKeyList();
+  map.readData();
+  while (map.readBlockFiles()) {
+  }
+
+  for (int i = 0; i < kSnapshotKeys; i++) {
+    auto item = map.get(keyList_.testStr(i));
+    ASSERT_NE(nullptr, item.get());
+
+    BucketedTimeSeries::Output out;
+    item->second.get(openBucket, openBucket, out, map.getStorage());
+    std::vector<TimeValuePair> values;
+    TimeSeries::getValues(out, values, 0, map.timestamp(openBucket + 1));
+    ASSERT_EQ(2, values.size());
+    EXPECT_EQ(map.timestamp(openBucket), values[0].unixTime);
+    EXPECT_EQ(i, values[0].value);
+    EXPECT_EQ(
+        map.timestamp(openBucket) + kGorillaSecondsPerMinute,
+        values[1].unixTime);
+    EXPECT_EQ(i + 0.5, values[1].value);
+  }
+
+  // New points are still appended to the restored streams.
+  TimeValuePair tv;
+  tv.value = 1.0;
+  tv.unixTime = map.timestamp(openBucket) + 2 * kGorillaSecondsPerMinute;
+  map.put(keyList_.testStr(0), tv, 0);
+  BucketedTimeSeries::Output out;
+  map.get(keyList_.testStr(0))
+      ->second.get(openBucket, openBucket, out, map.getStorage());
+  std::vector<TimeValuePair> values;
+  TimeSeries::getValues(out, values, 0, map.timestamp(openBucket + 1));
+  ASSERT_EQ(3, values.size());
+  EXPECT_EQ(tv.unixTime, values[2].unixTime);
+  EXPECT_EQ(1.0, values[2].value);
+}
+
 TEST_F(BucketMapTest, Load) {
   // Repeatedly insert points for 5k timeseries 24 times.
   // Timestamps are in the range [1377721380, 1377730980], which conveniently
@@ -688,6 +891,126 @@ TEST_F(BucketMapTest, MultipleTimeSeriesWithDifferentDeviations) {
   }
 }
 
+TEST_F(BucketMapTest, DeviatingTimeSeriesInRange) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  int start = map->timestamp(0);
+  addTestData(map, start);
+  ASSERT_EQ(
+      10, map->indexDeviatingTimeSeries(start, start, start + 10 * 60, 2.0));
+
+  // Key i deviates in minute i. Minutes that start before `begin` count.
+  auto deviations =
+      map->getDeviatingTimeSeries(start + 3 * 60 + 30, start + 5 * 60);
+  ASSERT_EQ(3, deviations.size());
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(kDefaultKey + std::to_string(i + 3), deviations[i].item->first);
+    ASSERT_EQ(1, deviations[i].times.size());
+    EXPECT_EQ(start + (i + 3) * 60, deviations[i].times[0]);
+  }
+
+  EXPECT_EQ(10, map->getDeviatingTimeSeries(start, start + 599).size());
+  EXPECT_TRUE(map->getDeviatingTimeSeries(start + 60, start).empty());
+}
+
+TEST_F(BucketMapTest, DeviationsIndexedByManyThreads) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  int start = map->timestamp(0);
+  addTestData(map, start);
+
+  // More threads than rows, and ranges that don't divide evenly.
+  for (int threads : {3, 20}) {
+    FLAGS_deviation_index_threads = threads;
+    ASSERT_EQ(
+        10, map->indexDeviatingTimeSeries(start, start, start + 10 * 60, 2.0));
+    for (int i = 0; i < 10; i++) {
+      auto deviations = map->getDeviatingTimeSeries(start + i * 60);
+      ASSERT_EQ(1, deviations.size());
+      ASSERT_EQ(kDefaultKey + std::to_string(i), deviations[0]->first);
+    }
+  }
+  FLAGS_deviation_index_threads = 1;
+}
+
+TEST_F(BucketMapTest, RunningStats) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  FLAGS_gorilla_running_stats = true;
+
+  auto map = buildBucketMap(dir.dirname().c_str());
+  for (int i = 0; i < 4; i++) {
+    TimeValuePair value;
+    value.unixTime = map->timestamp(i / 2) + i * 60;
+    value.value = 1e9 + 1 + i * 2;
+    map->put(kDefaultKey, value, 0);
+  }
+
+  BucketedTimeSeries::Stats stats;
+  auto item = map->get(kDefaultKey);
+  ASSERT_TRUE(item->second.getStats(0, 1, map->getStorage(), stats));
+  EXPECT_EQ(4, stats.count);
+  EXPECT_EQ(1e9 + 4, stats.mean);
+  EXPECT_NEAR(5, stats.variance, 1e-6);
+  EXPECT_EQ(1e9 + 7, stats.last);
+
+  ASSERT_TRUE(item->second.getStats(1, 1, map->getStorage(), stats));
+  EXPECT_EQ(2, stats.count);
+  EXPECT_NEAR(1, stats.variance, 1e-6);
+
+  ASSERT_FALSE(item->second.getStats(2, 3, map->getStorage(), stats));
+  FLAGS_gorilla_running_stats = false;
+}
+
+TEST_F(BucketMapTest, DeviationsFromRunningStats) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  FLAGS_gorilla_running_stats = true;
+
+  auto map = buildBucketMap(dir.dirname().c_str());
+  int start = map->timestamp(0);
+
+  // The first key deviated in the past, the second one deviates now
+  // and the third one never does.
+  for (int i = 0; i < 10; i++) {
+    TimeValuePair value;
+    value.unixTime = start + i * 60;
+    for (int key = 0; key < 3; key++) {
+      value.value = (key == 0 && i == 0) || (key == 1 && i == 9) ? 10 : 1;
+      map->put(kDefaultKey + std::to_string(key), value, 0);
+    }
+  }
+
+  ASSERT_EQ(
+      2, map->indexDeviatingTimeSeries(start, start, start + 10 * 60, 2.0));
+  ASSERT_EQ(1, map->getDeviatingTimeSeries(start).size());
+  ASSERT_EQ(1, map->getDeviatingTimeSeries(start + 9 * 60).size());
+
+  auto top = map->getTopDeviatingTimeSeries(start, start + 10 * 60, 1);
+  ASSERT_EQ(1, top.size());
+  EXPECT_EQ(kDefaultKey + "1", top[0].first->first);
+  EXPECT_NEAR(3, top[0].second, 1e-9);
+
+  top = map->getTopDeviatingTimeSeries(start, start + 10 * 60, 5);
+  ASSERT_EQ(2, top.size());
+  EXPECT_EQ(kDefaultKey + "1", top[0].first->first);
+  EXPECT_EQ(kDefaultKey + "0", top[1].first->first);
+  EXPECT_NEAR(1.0 / 3, top[1].second, 1e-9);
+
+  FLAGS_gorilla_running_stats = false;
+  ASSERT_TRUE(map->getTopDeviatingTimeSeries(start, start + 600, 1).empty());
+}
+
 TEST_F(BucketMapTest, DoubleErase) {
   // This can happen due to a race condition in purging and blacklisting.
   TemporaryDirectory dir("gorilla_test");
@@ -723,3 +1046,1024 @@ TEST_F(BucketMapTest, DoubleErase) {
   ASSERT_EQ(1, everything.size());
   ASSERT_EQ(map->get(kDefaultKey), everything.front());
 }
+
+TEST_F(BucketMapTest, EraseBatch) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  TimeValuePair value;
+  value.unixTime = 1000;
+  value.value = 100;
+
+  auto map = buildBucketMap(dir.dirname().c_str());
+  for (int i = 0; i < 5; i++) {
+    map->put(kDefaultKey + std::to_string(i), value, 0);
+  }
+
+  std::vector<BucketMap::Item> everything;
+  map->getEverything(everything);
+  ASSERT_EQ(5, everything.size());
+
+  // The stale reference to row 0 isn't erased again.
+  map->erase(0, everything[0]);
+  map->put(kDefaultKey + "0", value, 0);
+  ASSERT_EQ(
+      2,
+      map->eraseBatch(
+          {0, 1, 3}, {everything[0], everything[1], everything[3]}));
+
+  for (int i = 0; i < 5; i++) {
+    auto item = map->get(kDefaultKey + std::to_string(i));
+    if (i == 1 || i == 3) {
+      ASSERT_EQ(nullptr, item);
+    } else {
+      ASSERT_NE(nullptr, item);
+    }
+  }
+}
+
+TEST_F(BucketMapTest, DeletedKeys) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  FLAGS_key_list_compaction_dead_fraction = 0.5;
+
+  auto bucketLogWriter = std::make_shared<BucketLogWriter>(
+      4 * kGorillaSecondsPerHour, dir.dirname(), 100, 0);
+  bucketLogWriter->startShard(10);
+  auto keyWriter = std::make_shared<KeyListWriter>(dir.dirname(), 100);
+  keyWriter->startShard(10);
+  FileUtils keyFiles(10, "key_list", dir.dirname());
+
+  TimeValuePair value;
+  value.unixTime = 1000;
+  value.value = 100;
+  {
+    BucketMap map(
+        6,
+        4 * kGorillaSecondsPerHour,
+        10,
+        dir.dirname(),
+        keyWriter,
+        bucketLogWriter,
+        BucketMap::OWNED,
+        std::make_shared<LocalLogReaderFactory>(dir.dirname()));
+    for (int i = 0; i < 4; i++) {
+      map.put(kDefaultKey + std::to_string(i), value, 0);
+    }
+
+    std::vector<BucketMap::Item> everything;
+    map.getEverything(everything);
+    map.erase(1, everything[1]);
+
+    // Two dead records out of five aren't enough to rewrite the list.
+    auto files = keyFiles.ls();
+    map.compactKeyList();
+    ASSERT_EQ(files, keyFiles.ls());
+  }
+  keyWriter->stopShard(10);
+  keyWriter->flushQueue();
+
+  BucketMap map(
+      6,
+      4 * kGorillaSecondsPerHour,
+      10,
+      dir.dirname(),
+      keyWriter,
+      bucketLogWriter,
+      BucketMap::UNOWNED,
+      std::make_shared<LocalLogReaderFactory>(dir.dirname()));
+  map.setState(BucketMap::PRE_OWNED);
+  map.readKeyList();
+  map.readData();
+  while (map.readBlockFiles()) {
+  }
+
+  // The deletion survived the restart.
+  EXPECT_NE(nullptr, map.get(kDefaultKey + "0"));
+  EXPECT_EQ(nullptr, map.get(kDefaultKey + "1"));
+  EXPECT_NE(nullptr, map.get(kDefaultKey + "2"));
+  EXPECT_NE(nullptr, map.get(kDefaultKey + "3"));
+
+  std::vector<BucketMap::Item> everything;
+  map.getEverything(everything);
+  map.erase(0, everything[0]);
+  map.erase(2, everything[2]);
+  keyWriter->flushQueue();
+
+  // Six of the seven records are dead now.
+  map.compactKeyList();
+  int keys = PersistentKeyList::readKeys(
+      10,
+      dir.dirname(),
+      [&](uint32_t id, const char* key, uint16_t, int32_t) {
+        EXPECT_EQ(3, id);
+        EXPECT_EQ(kDefaultKey + "3", key);
+        return true;
+      });
+  EXPECT_EQ(1, keys);
+
+  FLAGS_key_list_compaction_dead_fraction = 0;
+}
+
+TEST_F(BucketMapTest, ConcurrentNewKeys) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  const int kThreads = 8;
+  const int kKeysPerThread = 2000;
+
+  // Every thread adds its own keys and half of the keys of the next
+  // thread to race on the same keys.
+  std::atomic<int> added(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      TimeValuePair value;
+      value.unixTime = map->timestamp(1);
+      value.value = t;
+      for (int i = 0; i < kKeysPerThread; i++) {
+        int own = t * kKeysPerThread + i;
+        int other = ((t + 1) % kThreads) * kKeysPerThread + i / 2;
+        added += map->put(kDefaultKey + std::to_string(own), value, 0).first;
+        added += map->put(kDefaultKey + std::to_string(other), value, 0).first;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(kThreads * kKeysPerThread, added);
+
+  std::vector<BucketMap::Item> everything;
+  map->getEverything(everything);
+  ASSERT_EQ(kThreads * kKeysPerThread, everything.size());
+  std::set<std::string> keys;
+  for (auto& item : everything) {
+    ASSERT_NE(nullptr, item.get());
+    keys.insert(item->first);
+  }
+  ASSERT_EQ(kThreads * kKeysPerThread, keys.size());
+
+  for (int i = 0; i < kThreads * kKeysPerThread; i++) {
+    ASSERT_NE(nullptr, map->get(kDefaultKey + std::to_string(i)));
+  }
+}
+
+TEST_F(BucketMapTest, PutBatch) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  map->put(kDefaultKey + "0", value, 0);
+
+  // A point for an existing key, two points for a new key and one
+  // more new key.
+  std::vector<DataPoint> data(4);
+  for (int i = 0; i < data.size(); i++) {
+    data[i].key.key = kDefaultKey + std::to_string((i + 1) / 2);
+    data[i].key.shardId = 10;
+    data[i].value.unixTime = map->timestamp(1) + 60 * (i + 1);
+    data[i].value.value = i;
+  }
+
+  auto result = map->putBatch(data, {0, 1, 2}, true);
+  EXPECT_EQ(1, result.newRows);
+  EXPECT_EQ(3, result.added);
+  EXPECT_EQ(0, result.newKeysBlocked);
+  EXPECT_TRUE(result.notOwned.empty());
+  EXPECT_EQ(nullptr, map->get(kDefaultKey + "2"));
+
+  auto getValues = [&](const std::string& key) {
+    std::vector<TimeValuePair> values;
+    BucketedTimeSeries::Output blocks;
+    auto row = map->get(key);
+    if (row) {
+      row->second.get(0, 2, blocks, map->getStorage());
+      TimeSeries::getValues(blocks, values, 0, map->timestamp(2));
+    }
+    return values;
+  };
+
+  auto out = getValues(kDefaultKey + "0");
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(0, out[1].value);
+
+  out = getValues(kDefaultKey + "1");
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(1, out[0].value);
+  EXPECT_EQ(2, out[1].value);
+
+  // New keys can be blocked while existing keys are still added.
+  data[0].value.unixTime += 600;
+  result = map->putBatch(data, {0, 3}, false);
+  EXPECT_EQ(0, result.newRows);
+  EXPECT_EQ(1, result.added);
+  EXPECT_EQ(1, result.newKeysBlocked);
+  EXPECT_EQ(nullptr, map->get(kDefaultKey + "2"));
+
+  map->setState(BucketMap::PRE_UNOWNED);
+  map->setState(BucketMap::UNOWNED);
+  result = map->putBatch(data, {1, 3}, true);
+  EXPECT_EQ(0, result.added);
+  EXPECT_EQ(std::vector<uint32_t>({1, 3}), result.notOwned);
+}
+
+TEST_F(BucketMapTest, PutBatchWithKeyIds) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  map->put(kDefaultKey + "0", value, 0);
+
+  // Only the existing key gets an id.
+  std::vector<DataPoint> data(2);
+  for (int i = 0; i < data.size(); i++) {
+    data[i].key.key = kDefaultKey + std::to_string(i);
+    data[i].key.shardId = 10;
+    data[i].value.unixTime = map->timestamp(1) + 60;
+    data[i].value.value = 2;
+  }
+  KeyId none;
+  none.id = -1;
+  std::vector<KeyId> keyIds(data.size(), none);
+  auto result = map->putBatch(data, {0, 1}, true, &keyIds);
+  EXPECT_EQ(2, result.added);
+  EXPECT_LE(0, keyIds[0].id);
+  EXPECT_EQ(-1, keyIds[1].id);
+
+  std::vector<DataPointWithKeyId> withIds(3);
+  for (int i = 0; i < withIds.size(); i++) {
+    withIds[i].shardId = 10;
+    withIds[i].keyId = keyIds[0];
+    withIds[i].value.unixTime = map->timestamp(1) + 120;
+    withIds[i].value.value = 3;
+  }
+  withIds[1].keyId.tag++;
+  withIds[2].keyId.id = 1000;
+  result = map->putBatchWithKeyIds(withIds, {0, 1, 2});
+  EXPECT_EQ(1, result.added);
+  EXPECT_EQ(std::vector<uint32_t>({1, 2}), result.notOwned);
+
+  std::vector<TimeValuePair> values;
+  BucketedTimeSeries::Output blocks;
+  map->get(kDefaultKey + "0")->second.get(0, 2, blocks, map->getStorage());
+  TimeSeries::getValues(blocks, values, 0, map->timestamp(2));
+  ASSERT_EQ(3, values.size());
+  EXPECT_EQ(3, values[2].value);
+
+  map->setState(BucketMap::PRE_UNOWNED);
+  map->setState(BucketMap::UNOWNED);
+  result = map->putBatchWithKeyIds(withIds, {0});
+  EXPECT_EQ(0, result.added);
+  EXPECT_EQ(std::vector<uint32_t>({0}), result.notOwned);
+}
+
+TEST_F(BucketMapTest, PutEncoded) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  map->put(kDefaultKey + "0", value, 0);
+
+  // Three points for the existing key, one of them a duplicate, two
+  // for a new key and one for a key that is blocked.
+  std::vector<EncodedDataPoints> data(3);
+  std::vector<std::vector<TimeValuePair>> values(data.size());
+  for (int i = 0; i < data.size(); i++) {
+    data[i].key.key = kDefaultKey + std::to_string(i);
+    data[i].key.shardId = 10;
+  }
+  auto addValue = [&](int i, int64_t unixTime, double v) {
+    TimeValuePair point;
+    point.unixTime = unixTime;
+    point.value = v;
+    values[i].push_back(point);
+  };
+  addValue(0, map->timestamp(1), 5);
+  addValue(0, map->timestamp(1) + 60, 2);
+  addValue(0, map->timestamp(1) + 120, 3);
+  addValue(1, map->timestamp(1) + 60, 4);
+  addValue(1, map->timestamp(1) + 120, 5);
+  addValue(2, map->timestamp(1) + 60, 6);
+
+  auto result = map->putEncoded(data, values, {0, 1}, true);
+  EXPECT_EQ(1, result.newRows);
+  EXPECT_EQ(4, result.added);
+  EXPECT_EQ(0, result.newKeysBlocked);
+  EXPECT_TRUE(result.notOwned.empty());
+
+  auto getValues = [&](const std::string& key) {
+    std::vector<TimeValuePair> out;
+    BucketedTimeSeries::Output blocks;
+    auto row = map->get(key);
+    if (row) {
+      row->second.get(0, 2, blocks, map->getStorage());
+      TimeSeries::getValues(blocks, out, 0, map->timestamp(2));
+    }
+    return out;
+  };
+
+  auto out = getValues(kDefaultKey + "0");
+  ASSERT_EQ(3, out.size());
+  EXPECT_EQ(1, out[0].value);
+  EXPECT_EQ(2, out[1].value);
+  EXPECT_EQ(3, out[2].value);
+
+  out = getValues(kDefaultKey + "1");
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(4, out[0].value);
+  EXPECT_EQ(5, out[1].value);
+
+  result = map->putEncoded(data, values, {2}, false);
+  EXPECT_EQ(0, result.added);
+  EXPECT_EQ(1, result.newKeysBlocked);
+  EXPECT_EQ(nullptr, map->get(kDefaultKey + "2"));
+
+  map->setState(BucketMap::PRE_UNOWNED);
+  map->setState(BucketMap::UNOWNED);
+  result = map->putEncoded(data, values, {0, 2}, true);
+  EXPECT_EQ(0, result.added);
+  EXPECT_EQ(std::vector<uint32_t>({0, 2}), result.notOwned);
+}
+
+TEST_F(BucketMapTest, Subscriptions) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+  auto subscriptions = std::make_shared<SubscriptionManager>(20, 100, 10, 1000);
+  map->setSubscriptions(subscriptions);
+
+  std::vector<Key> keys(1);
+  keys[0].key = kDefaultKey + "0";
+  keys[0].shardId = 10;
+  int64_t id = subscriptions->subscribe(keys, "other", {10}, 0);
+  ASSERT_NE(0, id);
+
+  // A new key, an existing key, a batch and a key that isn't followed.
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  map->put(kDefaultKey + "0", value, 0);
+  value.unixTime += 60;
+  map->put(kDefaultKey + "0", value, 0);
+  map->put(kDefaultKey + "1", value, 0);
+
+  std::vector<DataPoint> data(2);
+  data[0].key.key = "OTHER";
+  data[1].key.key = kDefaultKey + "0";
+  for (auto& dp : data) {
+    dp.key.shardId = 10;
+    dp.value.unixTime = map->timestamp(1) + 120;
+    dp.value.value = 2;
+  }
+  map->putBatch(data, {0, 1}, true);
+  map->putBatch(data, {1}, true);
+
+  std::vector<DataPoint> points;
+  int64_t dropped;
+  ASSERT_TRUE(subscriptions->poll(id, 0, 0, points, dropped));
+  EXPECT_EQ(0, dropped);
+  ASSERT_EQ(4, points.size());
+  EXPECT_EQ(map->timestamp(1), points[0].value.unixTime);
+  EXPECT_EQ(kDefaultKey + "0", points[1].key.key);
+  EXPECT_EQ("OTHER", points[2].key.key);
+  EXPECT_EQ(10, points[2].key.shardId);
+  EXPECT_EQ(2, points[3].value.value);
+}
+
+TEST_F(BucketMapTest, Replication) {
+  TemporaryDirectory dir("gorilla_test");
+  TemporaryDirectory followerDir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(followerDir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+  EXPECT_FALSE(map->setFollower(true));
+  EXPECT_FALSE(map->isFollower());
+
+  std::unique_ptr<BucketMap> follower(new BucketMap(
+      6,
+      4 * kGorillaSecondsPerHour,
+      10,
+      followerDir.dirname().c_str(),
+      std::make_shared<KeyListWriter>(followerDir.dirname().c_str(), 100),
+      std::make_shared<BucketLogWriter>(
+          4 * kGorillaSecondsPerHour, followerDir.dirname().c_str(), 100, 0),
+      BucketMap::UNOWNED,
+      std::make_shared<LocalLogReaderFactory>(followerDir.dirname().c_str())));
+  ASSERT_TRUE(follower->setFollower(true));
+  follower->setState(BucketMap::PRE_OWNED);
+
+  auto replicator = std::make_shared<ShardReplicator>(
+      20,
+      100,
+      [&](const ShardReplicator::Host& host,
+          const AppendKeysRequest& keys,
+          const LogDataPointsRequest& points,
+          std::set<int64_t>& rejectedShards) {
+        std::vector<uint32_t> keyIndexes(keys.keys.size());
+        std::iota(keyIndexes.begin(), keyIndexes.end(), 0);
+        std::vector<uint32_t> pointIndexes(points.points.size());
+        std::iota(pointIndexes.begin(), pointIndexes.end(), 0);
+        if (follower->putReplicatedKeys(keys.keys, keyIndexes) ==
+                BucketMap::kNotOwned ||
+            follower->putReplicatedPoints(points.points, pointIndexes) ==
+                BucketMap::kNotOwned) {
+          rejectedShards.insert(10);
+        }
+        return true;
+      });
+  replicator->setFollowers(10, {{"follower", 9999}});
+  map->setReplicator(replicator);
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  map->put(kDefaultKey + "0", value, 3);
+  std::vector<DataPoint> data(2);
+  for (int i = 0; i < data.size(); i++) {
+    data[i].key.key = kDefaultKey + std::to_string(i);
+    data[i].key.shardId = 10;
+    data[i].value.unixTime = map->timestamp(1) + 60;
+    data[i].value.value = 2;
+  }
+  map->putBatch(data, {0, 1}, true);
+
+  // The follower isn't loaded yet, so everything stays queued.
+  EXPECT_EQ(0, replicator->flush());
+  EXPECT_EQ(3, replicator->getQueuedPoints());
+  follower->setState(BucketMap::OWNED);
+  EXPECT_EQ(3, replicator->flush());
+
+  std::vector<TimeValuePair> values;
+  BucketedTimeSeries::Output blocks;
+  auto row = follower->get(kDefaultKey + "0");
+  ASSERT_NE(nullptr, row.get());
+  EXPECT_EQ(3, row->second.getCategory());
+  row->second.get(0, 2, blocks, follower->getStorage());
+  TimeSeries::getValues(blocks, values, 0, map->timestamp(2));
+  ASSERT_EQ(2, values.size());
+  EXPECT_EQ(2, values[1].value);
+  ASSERT_NE(nullptr, follower->get(kDefaultKey + "1").get());
+
+  // Owners don't take replicated points.
+  EXPECT_EQ(BucketMap::kNotOwned, map->putReplicatedPoints({}, {}));
+
+  // A key that the owner gave another id replaces the old one.
+  std::vector<KeyMapping> keys(2);
+  keys[0].shardId = 10;
+  keys[0].keyId = 5;
+  keys[0].key = kDefaultKey + "0";
+  keys[1].shardId = 10;
+  keys[1].keyId = 5;
+  keys[1].key = kDefaultKey + "0";
+  EXPECT_EQ(1, follower->putReplicatedKeys(keys, {0, 1}));
+  row = follower->get(kDefaultKey + "0");
+  ASSERT_NE(nullptr, row.get());
+  blocks.clear();
+  values.clear();
+  row->second.get(0, 2, blocks, follower->getStorage());
+  TimeSeries::getValues(blocks, values, 0, map->timestamp(2));
+  EXPECT_TRUE(values.empty());
+
+  std::vector<DataPointWithID> points(2);
+  points[0].keyId = 5;
+  points[0].point.unixTime = map->timestamp(1) + 120;
+  points[0].point.value = 4;
+  points[1].keyId = 100;
+  points[1].point = points[0].point;
+  EXPECT_EQ(1, follower->putReplicatedPoints(points, {0, 1}));
+}
+
+TEST_F(BucketMapTest, Backfill) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto bucketLogWriter = std::make_shared<BucketLogWriter>(
+      4 * kGorillaSecondsPerHour, dir.dirname(), 100, 0);
+  bucketLogWriter->startShard(10);
+  auto buildMap = [&](BucketMap::State state) {
+    auto keyWriter = std::make_shared<KeyListWriter>(dir.dirname(), 100);
+    keyWriter->startShard(10);
+    return std::unique_ptr<BucketMap>(new BucketMap(
+        6,
+        4 * kGorillaSecondsPerHour,
+        10,
+        dir.dirname(),
+        keyWriter,
+        bucketLogWriter,
+        state,
+        std::make_shared<LocalLogReaderFactory>(dir.dirname())));
+  };
+  auto getValues = [](BucketMap& map, const std::string& key) {
+    BucketedTimeSeries::Output out;
+    map.get(key)->second.get(1, 5, out, map.getStorage());
+    std::vector<TimeValuePair> values;
+    TimeSeries::getValues(out, values, 0, map.timestamp(6));
+    return values;
+  };
+
+  auto map = buildMap(BucketMap::OWNED);
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1) + 10;
+  value.value = 1;
+  map->put("a", value, 0);
+  value.unixTime = map->timestamp(5);
+  value.value = 5;
+  map->put("a", value, 0);
+
+  // Nothing is backfilled before a bucket is finalized.
+  auto point = [](int64_t unixTime, double value) {
+    TimeValuePair tv;
+    tv.unixTime = unixTime;
+    tv.value = value;
+    return tv;
+  };
+  std::vector<BackfillData> data(2);
+  data[0].key.key = "a";
+  TimeSeries::writeValues(
+      {point(map->timestamp(1) + 10, 2),
+       point(map->timestamp(1) + 70, 3),
+       point(map->timestamp(2) + 10, 4),
+       point(map->timestamp(5) + 60, 7)},
+      data[0].block);
+  data[1].key.key = "b";
+  TimeSeries::writeValues({point(map->timestamp(3) + 10, 6)}, data[1].block);
+  EXPECT_EQ(
+      std::vector<uint32_t>({0, 1}), map->backfill(data, {0, 1}).notOwned);
+
+  map->finalizeBuckets(4);
+  auto result = map->backfill(data, {0, 1});
+  EXPECT_TRUE(result.notOwned.empty());
+  EXPECT_EQ(1, result.newRows);
+  EXPECT_EQ(4, result.added);
+  EXPECT_EQ(1, result.dropped);
+
+  // The backfilled point replaces the one with the same timestamp.
+  auto values = getValues(*map, "a");
+  ASSERT_EQ(4, values.size());
+  EXPECT_EQ(2, values[0].value);
+  EXPECT_EQ(map->timestamp(1) + 70, values[1].unixTime);
+  EXPECT_EQ(4, values[2].value);
+  EXPECT_EQ(5, values[3].value);
+  values = getValues(*map, "b");
+  ASSERT_EQ(1, values.size());
+  EXPECT_EQ(6, values[0].value);
+
+  // The block files and the keys have the backfilled data. The keys
+  // are written out when the map is destroyed.
+  map.reset();
+  map = buildMap(BucketMap::UNOWNED);
+  map->setState(BucketMap::PRE_OWNED);
+  map->readKeyList();
+  map->readData();
+  while (map->readBlockFiles()) {
+  }
+
+  values = getValues(*map, "a");
+  ASSERT_LE(3, values.size());
+  EXPECT_EQ(2, values[0].value);
+  EXPECT_EQ(4, values[2].value);
+  values = getValues(*map, "b");
+  ASSERT_EQ(1, values.size());
+  EXPECT_EQ(map->timestamp(3) + 10, values[0].unixTime);
+}
+
+TEST_F(BucketMapTest, GetBatch) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  std::vector<Key> keys(100);
+  for (int i = 0; i < keys.size(); i++) {
+    keys[i].key = kDefaultKey + std::to_string(i);
+    keys[i].shardId = 10;
+    if (i % 3 != 0) {
+      map->put(keys[i].key, value, 0);
+    }
+  }
+
+  std::vector<uint32_t> indexes;
+  for (int i = keys.size() - 1; i >= 0; i--) {
+    indexes.push_back(i);
+  }
+
+  std::vector<BucketMap::Item> rows;
+  map->getBatch(keys, indexes, rows);
+  ASSERT_EQ(indexes.size(), rows.size());
+  for (int j = 0; j < indexes.size(); j++) {
+    EXPECT_EQ(map->get(keys[indexes[j]].key), rows[j]);
+    EXPECT_EQ(indexes[j] % 3 != 0, rows[j] != nullptr);
+  }
+}
+
+TEST_F(BucketMapTest, SearchKeys) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  for (const char* key :
+       {"cpu.host2", "cpu.host1", "disk.host1", "CPU.host3"}) {
+    map->put(key, value, 0);
+  }
+
+  std::vector<BucketMap::Item> items;
+  EXPECT_FALSE(map->searchKeys("cpu.*", "", 10, items));
+  ASSERT_EQ(3, items.size());
+  EXPECT_EQ("cpu.host1", items[0]->first);
+  EXPECT_EQ("cpu.host2", items[1]->first);
+  EXPECT_EQ("CPU.host3", items[2]->first);
+  EXPECT_EQ(map->get("cpu.host1"), items[0]);
+
+  // Continue after the last key of a page.
+  items.clear();
+  EXPECT_TRUE(map->searchKeys("*.host1", "", 1, items));
+  ASSERT_EQ(1, items.size());
+  EXPECT_EQ("cpu.host1", items[0]->first);
+  items.clear();
+  EXPECT_FALSE(map->searchKeys("*.host1", "cpu.host1", 1, items));
+  ASSERT_EQ(1, items.size());
+  EXPECT_EQ("disk.host1", items[0]->first);
+
+  // Erased keys are removed from the index.
+  std::vector<BucketMap::Item> everything;
+  map->getEverything(everything);
+  for (int i = 0; i < everything.size(); i++) {
+    if (everything[i] && everything[i]->first == "cpu.host2") {
+      map->erase(i, everything[i]);
+    }
+  }
+  items.clear();
+  map->searchKeys("cpu.host?", "", 10, items);
+  ASSERT_EQ(2, items.size());
+  EXPECT_EQ("cpu.host1", items[0]->first);
+  EXPECT_EQ("CPU.host3", items[1]->first);
+
+  map->setState(BucketMap::PRE_UNOWNED);
+  map->setState(BucketMap::UNOWNED);
+  items.clear();
+  map->searchKeys("*", "", 10, items);
+  EXPECT_TRUE(items.empty());
+}
+
+TEST_F(BucketMapTest, GetUpdatedSince) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.value = 1;
+  for (int i = 0; i < 10; i++) {
+    value.unixTime = map->timestamp(1) + (i % 2 ? 100 : 0);
+    map->put(kDefaultKey + std::to_string(i), value, 0);
+  }
+
+  // Only the odd rows were updated at the later time, and the even
+  // ones don't count toward the limit.
+  std::vector<BucketMap::UpdatedItem> updated;
+  int next;
+  EXPECT_TRUE(map->getUpdatedSince(
+      map->timestamp(1) + 100, 0, 1000, 3, updated, next));
+  ASSERT_EQ(3, updated.size());
+  EXPECT_EQ(kDefaultKey + "1", updated[0].item->first);
+  EXPECT_EQ(kDefaultKey + "5", updated[2].item->first);
+  EXPECT_EQ(map->timestamp(1) + 100, updated[0].lastUpdateTime);
+  EXPECT_EQ(6, next);
+
+  updated.clear();
+  EXPECT_FALSE(map->getUpdatedSince(
+      map->timestamp(1) + 100, next, 1000, 3, updated, next));
+  ASSERT_EQ(2, updated.size());
+  EXPECT_EQ(kDefaultKey + "9", updated[1].item->first);
+  EXPECT_EQ(10, next);
+
+  // A bounded range stops at `end`.
+  updated.clear();
+  EXPECT_TRUE(map->getUpdatedSince(0, 2, 4, 10, updated, next));
+  ASSERT_EQ(2, updated.size());
+  EXPECT_EQ(kDefaultKey + "2", updated[0].item->first);
+  EXPECT_EQ(4, next);
+
+  // New points move the time forward.
+  value.unixTime = map->timestamp(1) + 200;
+  map->put(kDefaultKey + "4", value, 0);
+  updated.clear();
+  map->getUpdatedSince(map->timestamp(1) + 200, 0, 1000, 10, updated, next);
+  ASSERT_EQ(1, updated.size());
+  EXPECT_EQ(kDefaultKey + "4", updated[0].item->first);
+}
+
+TEST_F(BucketMapTest, GetResourceUsage) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  std::vector<DataPoint> data(8);
+  for (int i = 0; i < data.size(); i++) {
+    data[i].key.key = kDefaultKey + std::to_string(i % 4);
+    data[i].key.shardId = 10;
+    data[i].value.unixTime = map->timestamp(1) + 60 * (i / 4);
+    data[i].value.value = i;
+    data[i].categoryId = i % 4 == 0 ? 1 : 2;
+  }
+  std::vector<uint32_t> points(data.size());
+  std::iota(points.begin(), points.end(), 0);
+  EXPECT_EQ(8, map->putBatch(data, points, true).added);
+  map->get(kDefaultKey + "0");
+
+  BucketMap::ResourceUsage usage;
+  map->getResourceUsage(1, usage);
+  EXPECT_EQ(4, usage.numSeries);
+  EXPECT_EQ(8, usage.pointsAdded);
+  EXPECT_EQ(1, usage.keysQueried);
+  EXPECT_EQ(4, usage.keyListRecords);
+  EXPECT_GT(usage.activeStreamBytes, 0);
+  EXPECT_GE(usage.activeStreamSlackBytes, 0);
+  EXPECT_GE(usage.streamArenaFreeBytes, 0);
+  ASSERT_EQ(2, usage.categories.size());
+  EXPECT_EQ(1, usage.categories[1].numSeries);
+  EXPECT_EQ(3, usage.categories[2].numSeries);
+  EXPECT_EQ(
+      usage.activeStreamBytes,
+      usage.categories[1].activeStreamBytes +
+          usage.categories[2].activeStreamBytes);
+
+  // Sampling scales the streams of the sampled rows up.
+  BucketMap::ResourceUsage sampled;
+  map->getResourceUsage(2, sampled);
+  EXPECT_EQ(4, sampled.numSeries);
+  EXPECT_EQ(
+      4,
+      sampled.categories[1].numSeries + sampled.categories[2].numSeries);
+
+  // Finalizing moves the streams to the pages of the bucket.
+  map->finalizeBuckets(1);
+  BucketMap::ResourceUsage finalized;
+  map->getResourceUsage(1, finalized);
+  EXPECT_EQ(0, finalized.activeStreamBytes);
+  ASSERT_EQ(1, finalized.pageBytesByPosition.count(1));
+  EXPECT_GT(finalized.pageBytesByPosition[1], 0);
+}
+
+TEST_F(BucketMapTest, Rollups) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  for (auto tier : {"rollup_600/10", "rollup_3600/10"}) {
+    boost::filesystem::create_directories(
+        FileUtils::joinPaths(dir.dirname(), tier));
+  }
+  FLAGS_rollup_tiers = "600:10,3600:20,7:10";
+  auto map = buildBucketMap(dir.dirname().c_str());
+  FLAGS_rollup_tiers = "";
+
+  std::vector<Key> keys(3);
+  for (int i = 0; i < keys.size(); i++) {
+    keys[i].key = kDefaultKey + std::to_string(i);
+    keys[i].shardId = 10;
+  }
+
+  // Two of the keys get a point every minute in buckets 1 and 2.
+  for (int64_t t = map->timestamp(1); t < map->timestamp(3); t += 60) {
+    TimeValuePair value;
+    value.unixTime = t;
+    value.value = t % 1000;
+    map->put(keys[0].key, value, 0);
+    map->put(keys[2].key, value, 0);
+  }
+
+  int64_t begin = (map->timestamp(1) / 3600 + 1) * 3600;
+  int64_t end = map->timestamp(3) - 1;
+  EXPECT_EQ(-1, map->pickRollup(begin, 3600, AggregationType::SUM));
+
+  map->finalizeBuckets(1);
+  EXPECT_EQ(1, map->pickRollup(begin, 3600, AggregationType::SUM));
+  EXPECT_EQ(0, map->pickRollup(begin, 1800, AggregationType::SUM));
+  EXPECT_EQ(-1, map->pickRollup(begin + 60, 3600, AggregationType::SUM));
+  EXPECT_EQ(-1, map->pickRollup(begin, 3600, AggregationType::LAST));
+  EXPECT_EQ(-1, map->pickRollup(begin - 3600, 3600, AggregationType::SUM));
+
+  // Bucket 1 is from the rollups and bucket 2 from the raw data, which
+  // gives the same windows as downsampling the raw data.
+  std::vector<uint32_t> indexes = {2, 1, 0};
+  for (auto type : {AggregationType::SUM,
+                    AggregationType::COUNT,
+                    AggregationType::MIN,
+                    AggregationType::AVG}) {
+    std::vector<std::vector<double>> windows;
+    map->getRollups(1, keys, indexes, begin, end, 3600, type, windows);
+    ASSERT_EQ(3, windows.size());
+    EXPECT_TRUE(windows[1].empty());
+
+    BucketedTimeSeries::Output blocks;
+    map->get(keys[0].key)->second.get(
+        map->bucket(begin), map->bucket(end), blocks, map->getStorage());
+    std::vector<double> expected;
+    Aggregation::downsample(blocks, begin, end, 3600, type, expected);
+    ASSERT_EQ(expected.size(), windows[0].size());
+    for (int i = 0; i < expected.size(); i++) {
+      EXPECT_DOUBLE_EQ(expected[i], windows[0][i]);
+      EXPECT_DOUBLE_EQ(expected[i], windows[2][i]);
+    }
+  }
+}
+
+TEST_F(BucketMapTest, CategoryPolicies) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  FLAGS_gorilla_category_policies =
+      "1:series=2:retention=1:interval=120,2:interval=0:memory_mb=1";
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  // Category 1 takes two time series and a point every two minutes.
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  EXPECT_EQ(1, map->put("a", value, 1).first);
+  EXPECT_EQ(1, map->put("b", value, 1).first);
+  EXPECT_EQ(0, map->put("c", value, 1).second);
+  EXPECT_EQ(1, map->put("d", value, 0).first);
+  value.unixTime += 60;
+  EXPECT_EQ(0, map->put("a", value, 1).second);
+  EXPECT_EQ(1, map->put("d", value, 0).second);
+
+  // Erasing one of them makes room for another.
+  std::vector<BucketMap::Item> rows;
+  map->getEverything(rows);
+  for (int i = 0; i < rows.size(); i++) {
+    if (rows[i] && rows[i]->first == "b") {
+      map->erase(i, rows[i]);
+    }
+  }
+  EXPECT_EQ(1, map->put("c", value, 1).first);
+
+  // Category 2 takes new time series until its blocks would go over
+  // a megabyte in the six buckets.
+  for (int i = 0; i < 10; i++) {
+    for (int64_t t = map->timestamp(1); t < map->timestamp(2); t++) {
+      value.unixTime = t;
+      value.value = t * 7919 % 1009;
+      map->put("e" + std::to_string(i), value, 2);
+    }
+  }
+  value.unixTime = map->timestamp(2);
+  EXPECT_EQ(1, map->put("f", value, 2).first);
+  map->finalizeBuckets(1);
+  EXPECT_EQ(0, map->put("g", value, 2).second);
+  EXPECT_EQ(1, map->put("h", value, 3).first);
+
+  // Category 1 only keeps the last finalized bucket.
+  map->finalizeBuckets(2);
+  BucketedTimeSeries::Output out;
+  map->get("a")->second.get(1, 1, out, map->getStorage());
+  EXPECT_EQ(0, out.size());
+  EXPECT_FALSE(map->get("a")->second.hasDataPoints(6));
+  map->get("d")->second.get(1, 1, out, map->getStorage());
+  EXPECT_EQ(1, out.size());
+  EXPECT_TRUE(map->get("d")->second.hasDataPoints(6));
+  FLAGS_gorilla_category_policies = "";
+}
+
+TEST_F(BucketMapTest, ExpectedRotationBytes) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+  EXPECT_EQ(0, map->getExpectedRotationBytes());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  map->put(kDefaultKey, value, 0);
+  map->finalizeBuckets(1);
+
+  // Bucket 2 is expected to need as many pages as bucket 1.
+  EXPECT_EQ(kDataBlockSize, map->getExpectedRotationBytes());
+
+  value.unixTime = map->timestamp(2);
+  map->put(kDefaultKey, value, 0);
+  map->put(kDefaultKey + "2", value, 0);
+  map->finalizeBuckets(2);
+  EXPECT_EQ(kDataBlockSize, map->getExpectedRotationBytes());
+
+  // The pages of bucket 3 are written as the time series move on to
+  // bucket 4.
+  value.unixTime = map->timestamp(3);
+  map->put(kDefaultKey, value, 0);
+  EXPECT_EQ(kDataBlockSize, map->getExpectedRotationBytes());
+  value.unixTime = map->timestamp(4);
+  map->put(kDefaultKey, value, 0);
+  EXPECT_EQ(0, map->getExpectedRotationBytes());
+}
+
+TEST_F(BucketMapTest, RowReaderSubshard) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  for (int i = 0; i < 100; i++) {
+    map->put(kDefaultKey + std::to_string(i), value, 0);
+  }
+
+  // Every key is in exactly one subshard, at the same offset as in
+  // getSome().
+  std::vector<int> seen(100, 0);
+  for (int subshard = 0; subshard < 4; subshard++) {
+    int offset = 0;
+    bool more = true;
+    while (more) {
+      BucketMap::RowReader reader(map.get());
+      std::vector<BucketMap::Item> all;
+      std::vector<BucketMap::Row*> rows;
+      map->getSome(all, offset, 30);
+      more = reader.getSome(rows, offset, 30, 4, subshard);
+      ASSERT_EQ(all.size(), rows.size());
+      for (int i = 0; i < rows.size(); i++) {
+        if (rows[i]) {
+          EXPECT_EQ(all[i].get(), rows[i]);
+          seen[offset + i]++;
+        }
+      }
+      offset += rows.size();
+    }
+    EXPECT_EQ(100, offset);
+  }
+  EXPECT_EQ(std::vector<int>(100, 1), seen);
+
+  // A single subshard is the whole shard.
+  BucketMap::RowReader reader(map.get());
+  std::vector<BucketMap::Row*> rows;
+  EXPECT_FALSE(reader.getSome(rows, 0, 1000));
+  EXPECT_EQ(100, rows.size());
+  for (auto row : rows) {
+    EXPECT_TRUE(row);
+  }
+}
+
+TEST_F(BucketMapTest, RowReaderKeepsErasedRows) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  auto map = buildBucketMap(dir.dirname().c_str());
+
+  TimeValuePair value;
+  value.unixTime = map->timestamp(1);
+  value.value = 1;
+  for (int i = 0; i < 10; i++) {
+    map->put(kDefaultKey + std::to_string(i), value, 0);
+  }
+
+  std::vector<BucketMap::Item> all;
+  map->getSome(all, 0, 10);
+  std::weak_ptr<BucketMap::Row> erased = all[3];
+
+  {
+    BucketMap::RowReader reader(map.get());
+    std::vector<BucketMap::Row*> rows;
+    reader.getSome(rows, 0, 10);
+    ASSERT_EQ(10, rows.size());
+    all.clear();
+
+    EXPECT_EQ(1, map->eraseBatch({3}, std::vector<BucketMap::Row*>{rows[3]}));
+    EXPECT_EQ(0, map->eraseBatch({3}, std::vector<BucketMap::Row*>{rows[3]}));
+
+    // Still readable until the reader is gone.
+    ASSERT_FALSE(erased.expired());
+    EXPECT_EQ(kDefaultKey + "3", rows[3]->first);
+  }
+
+  EXPECT_TRUE(erased.expired());
+}
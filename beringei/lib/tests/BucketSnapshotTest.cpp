@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/BucketSnapshot.h"
+#include "beringei/lib/FileUtils.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+
+DECLARE_bool(gorilla_async_file_close);
+
+class BucketSnapshotTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    FLAGS_gorilla_async_file_close = false;
+  }
+
+  static BucketSnapshot::Entry entry(uint32_t id, int points) {
+    TimeSeriesStream stream;
+    for (int i = 0; i < points; i++) {
+      TimeValuePair tv;
+      tv.unixTime = 1000 + i * 60;
+      tv.value = id + i;
+      stream.append(tv, 0);
+    }
+
+    BucketSnapshot::Entry entry;
+    entry.timeSeriesId = id;
+    entry.keyHash = id * 31;
+    entry.count = points;
+    stream.getState(entry.state, entry.data);
+    return entry;
+  }
+};
+
+TEST_F(BucketSnapshotTest, WriteAndRead) {
+  TemporaryDirectory dir("gorilla_test");
+  FileUtils files(7, BucketSnapshot::kSnapshotPrefix, dir.dirname());
+  files.createDirectories();
+
+  BucketSnapshot snapshot(7, dir.dirname());
+  int64_t id;
+  uint32_t bucket;
+  std::vector<int64_t> logFiles;
+  std::vector<BucketSnapshot::Entry> entries;
+  ASSERT_FALSE(snapshot.readLatest(id, bucket, logFiles, entries));
+
+  ASSERT_TRUE(snapshot.write(100, 3, {10, 20}, {entry(1, 5), entry(4, 1)}));
+  ASSERT_TRUE(snapshot.write(200, 4, {30}, {entry(2, 3), entry(5, 0)}));
+
+  // Only the newest snapshot is kept.
+  ASSERT_EQ(std::vector<int64_t>{200}, files.ls());
+
+  ASSERT_TRUE(snapshot.readLatest(id, bucket, logFiles, entries));
+  ASSERT_EQ(200, id);
+  ASSERT_EQ(4, bucket);
+  ASSERT_EQ(std::vector<int64_t>{30}, logFiles);
+  ASSERT_EQ(2, entries.size());
+
+  auto expected = entry(2, 3);
+  EXPECT_EQ(2, entries[0].timeSeriesId);
+  EXPECT_EQ(2 * 31, entries[0].keyHash);
+  EXPECT_EQ(3, entries[0].count);
+  EXPECT_EQ(expected.data, entries[0].data);
+  EXPECT_EQ(expected.state.numBits, entries[0].state.numBits);
+  EXPECT_EQ(expected.state.previousValue, entries[0].state.previousValue);
+  EXPECT_EQ(expected.state.prevTimestamp, entries[0].state.prevTimestamp);
+
+  EXPECT_EQ(5, entries[1].timeSeriesId);
+  EXPECT_EQ(0, entries[1].count);
+  EXPECT_TRUE(entries[1].data.empty());
+
+  TimeSeriesStream restored;
+  ASSERT_TRUE(restored.setState(entries[0].state, entries[0].data));
+}
+
+TEST_F(BucketSnapshotTest, Corrupt) {
+  TemporaryDirectory dir("gorilla_test");
+  FileUtils files(7, BucketSnapshot::kSnapshotPrefix, dir.dirname());
+  files.createDirectories();
+
+  BucketSnapshot snapshot(7, dir.dirname());
+  ASSERT_TRUE(snapshot.write(100, 3, {}, {entry(1, 5)}));
+
+  // Replace the snapshot with a truncated copy.
+  std::string data;
+  ASSERT_TRUE(files.read(100, data));
+  auto file = files.open(100, "wb", 0);
+  fwrite(data.data(), 1, data.size() / 2, file.file);
+  FileUtils::closeFile(file, false);
+
+  int64_t id;
+  uint32_t bucket;
+  std::vector<int64_t> logFiles;
+  std::vector<BucketSnapshot::Entry> entries;
+  ASSERT_FALSE(snapshot.readLatest(id, bucket, logFiles, entries));
+}
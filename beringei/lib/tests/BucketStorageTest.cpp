@@ -7,11 +7,17 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 
+#include <folly/compression/Compression.h>
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <string>
 
+#include "beringei/lib/BlockFileCodec.h"
 #include "beringei/lib/BucketStorage.h"
+#include "beringei/lib/DataBlockAllocator.h"
 #include "beringei/lib/DataBlockReader.h"
+#include "beringei/lib/TimeSeriesStream.h"
 
 using namespace ::testing;
 using namespace facebook;
@@ -19,6 +25,15 @@ using namespace facebook::gorilla;
 using namespace google;
 using namespace std;
 
+DECLARE_string(block_file_codec);
+DECLARE_bool(data_block_huge_pages);
+DECLARE_int32(mmap_bucket_age);
+DECLARE_int32(compress_bucket_age);
+DECLARE_int32(compressed_page_group);
+DECLARE_int32(block_file_compression_threads);
+DECLARE_bool(block_file_shared_timestamps);
+DECLARE_bool(block_file_checksums);
+
 TEST(BucketStorageTest, SmallStoreAndFetch) {
   BucketStorage storage(5, 0, "");
 
@@ -26,7 +41,7 @@ TEST(BucketStorageTest, SmallStoreAndFetch) {
   ASSERT_NE(BucketStorage::kInvalidId, id);
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
 
   ASSERT_EQ(
       BucketStorage::FetchStatus::SUCCESS,
@@ -35,6 +50,48 @@ TEST(BucketStorageTest, SmallStoreAndFetch) {
   ASSERT_EQ(100, itemCount);
 }
 
+TEST(BucketStorageTest, HugePageBlocks) {
+  FLAGS_data_block_huge_pages = true;
+  size_t freeBlocks;
+  {
+    BucketStorage storage(5, 0, "");
+    auto id = storage.store(11, "test", 4, 100);
+    ASSERT_NE(BucketStorage::kInvalidId, id);
+    freeBlocks = DataBlockAllocator::freeBlocks();
+
+    string str;
+    uint32_t itemCount;
+    ASSERT_EQ(
+        BucketStorage::FetchStatus::SUCCESS,
+        storage.fetch(11, id, str, itemCount));
+    ASSERT_EQ("test", str);
+  }
+
+  // The page went back to the free list and is reused.
+  ASSERT_EQ(freeBlocks + 1, DataBlockAllocator::freeBlocks());
+  auto block = DataBlockAllocator::allocate();
+  ASSERT_EQ(freeBlocks, DataBlockAllocator::freeBlocks());
+  block.reset();
+  FLAGS_data_block_huge_pages = false;
+}
+
+TEST(BucketStorageTest, ReleaseFreeBlocks) {
+  FLAGS_data_block_huge_pages = true;
+  auto block = DataBlockAllocator::allocate();
+  memset(block->data, 'x', sizeof(block->data));
+  block.reset();
+
+  EXPECT_GT(DataBlockAllocator::releaseFreeBlocks(), 0);
+  EXPECT_EQ(0, DataBlockAllocator::releaseFreeBlocks());
+
+  // Released blocks can still be used.
+  block = DataBlockAllocator::allocate();
+  memset(block->data, 'y', sizeof(block->data));
+  block.reset();
+  EXPECT_EQ(1, DataBlockAllocator::releaseFreeBlocks());
+  FLAGS_data_block_huge_pages = false;
+}
+
 TEST(BucketStorageTest, DedupData) {
   BucketStorage storage(5, 0, "");
 
@@ -49,7 +106,7 @@ TEST(BucketStorageTest, DedupData) {
   ASSERT_EQ(id1, id3);
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
 
   ASSERT_EQ(
       BucketStorage::FetchStatus::SUCCESS,
@@ -86,7 +143,7 @@ TEST(BucketStorageTest, StoringOldData) {
   ASSERT_NE(BucketStorage::kInvalidId, thirdId);
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
 
   ASSERT_EQ(
       BucketStorage::FetchStatus::SUCCESS,
@@ -118,7 +175,7 @@ TEST(BucketStorageTest, SingleBucket) {
   }
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
   for (int i = 1; i < 9; i++) {
     ASSERT_EQ(
         BucketStorage::FetchStatus::FAILURE,
@@ -150,7 +207,7 @@ TEST(BucketStorageTest, BigData) {
   for (int i = 0; i < 5; i++) {
     string expectedData(30000, '0' + i);
     string str;
-    uint16_t itemCount;
+    uint32_t itemCount;
 
     ASSERT_EQ(
         BucketStorage::FetchStatus::SUCCESS,
@@ -219,7 +276,7 @@ TEST(BucketStorageTest, BigDataFromDisk) {
   for (int i = 0; i < 5; i++) {
     string expectedData(30000, '0' + i);
     string str;
-    uint16_t itemCount;
+    uint32_t itemCount;
 
     ASSERT_EQ(
         BucketStorage::FetchStatus::SUCCESS,
@@ -229,6 +286,521 @@ TEST(BucketStorageTest, BigDataFromDisk) {
   }
 }
 
+TEST(BucketStorageTest, PrefetchedPosition) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+
+  BucketStorage::BucketStorageId id;
+  {
+    BucketStorage storage(10, shardId, dir.dirname());
+    id = storage.store(100, "test", 4, 100, 7);
+    ASSERT_NE(BucketStorage::kInvalidId, id);
+    storage.finalizeBucket(100);
+  }
+
+  BucketStorage storage(10, shardId, dir.dirname());
+  storage.prefetchPosition(100);
+
+  // Prefetching a missing file doesn't break anything.
+  storage.prefetchPosition(90);
+
+  vector<uint32_t> timeSeriesIds;
+  vector<uint64_t> storageIds;
+  ASSERT_TRUE(storage.loadPosition(100, timeSeriesIds, storageIds));
+  ASSERT_EQ(vector<uint32_t>{7}, timeSeriesIds);
+  ASSERT_EQ(vector<uint64_t>{id}, storageIds);
+
+  string str;
+  uint32_t itemCount;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetch(100, id, str, itemCount));
+  ASSERT_EQ("test", str);
+}
+
+TEST(BucketStorageTest, BlockFileCodecs) {
+  for (const char* codecName : {"zlib", "zstd", "lz4", "none"}) {
+    BlockFileCodec::Type type;
+    ASSERT_TRUE(BlockFileCodec::parse(codecName, type));
+    ASSERT_EQ(codecName, BlockFileCodec::name(type));
+
+    TemporaryDirectory dir("gorilla_data_block");
+    boost::filesystem::create_directories(
+        FileUtils::joinPaths(dir.dirname(), "12"));
+    int64_t shardId = 12;
+    FLAGS_block_file_codec = codecName;
+
+    vector<BucketStorage::BucketStorageId> ids(5);
+    {
+      BucketStorage storage(10, shardId, dir.dirname());
+      for (int i = 0; i < 5; i++) {
+        string data(30000, '0' + i);
+        ids[i] = storage.store(100, data.c_str(), data.length(), 100 + i, i);
+        ASSERT_NE(BucketStorage::kInvalidId, ids[i]);
+      }
+      storage.finalizeBucket(100);
+      usleep(10000);
+    }
+
+    vector<uint32_t> timeSeriesIds;
+    vector<uint64_t> storageIds;
+    BucketStorage storage(10, shardId, dir.dirname());
+    ASSERT_TRUE(storage.loadPosition(100, timeSeriesIds, storageIds));
+    ASSERT_EQ(ids, storageIds);
+
+    for (int i = 0; i < 5; i++) {
+      string str;
+      uint32_t itemCount;
+      ASSERT_EQ(
+          BucketStorage::FetchStatus::SUCCESS,
+          storage.fetch(100, ids[i], str, itemCount));
+      ASSERT_EQ(string(30000, '0' + i), str);
+    }
+  }
+  FLAGS_block_file_codec = "zlib";
+
+  BlockFileCodec::Type type;
+  ASSERT_FALSE(BlockFileCodec::parse("snappy", type));
+}
+
+TEST(BucketStorageTest, MappedBuckets) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+  FLAGS_block_file_codec = "none";
+  FLAGS_mmap_bucket_age = 1;
+
+  BucketStorage storage(5, shardId, dir.dirname());
+  vector<BucketStorage::BucketStorageId> ids(5);
+  for (int i = 0; i < 5; i++) {
+    string data(30000, '0' + i);
+    ids[i] = storage.store(100, data.c_str(), data.length(), 100 + i, i);
+    ASSERT_NE(BucketStorage::kInvalidId, ids[i]);
+  }
+  storage.finalizeBucket(100);
+  ASSERT_EQ(3 * kDataBlockSize, storage.getPagesSize().second);
+
+  auto id = storage.store(101, "test", 4, 1, 0);
+  ASSERT_NE(BucketStorage::kInvalidId, id);
+  storage.finalizeBucket(101);
+
+  // Bucket 100 is now read from the block file, so only the page of
+  // bucket 101 is left in memory.
+  ASSERT_EQ(kDataBlockSize, storage.getPagesSize().second);
+  for (int i = 0; i < 5; i++) {
+    string str;
+    uint32_t itemCount;
+    ASSERT_EQ(
+        BucketStorage::FetchStatus::SUCCESS,
+        storage.fetch(100, ids[i], str, itemCount));
+    ASSERT_EQ(string(30000, '0' + i), str);
+    ASSERT_EQ(100 + i, itemCount);
+  }
+
+  // Mapped pages are dropped when the bucket is reused.
+  id = storage.store(105, "test", 4, 1, 0);
+  ASSERT_NE(BucketStorage::kInvalidId, id);
+  string str;
+  uint32_t itemCount;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetch(105, id, str, itemCount));
+  ASSERT_EQ("test", str);
+
+  FLAGS_mmap_bucket_age = 0;
+  FLAGS_block_file_codec = "zlib";
+}
+
+TEST(BucketStorageTest, MapOldestBucket) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+  BucketStorage storage(5, shardId, dir.dirname());
+
+  // Compressed block files can't be mapped.
+  ASSERT_NE(BucketStorage::kInvalidId, storage.store(99, "test", 4, 1, 0));
+  storage.finalizeBucket(99);
+  EXPECT_FALSE(storage.mapOldestBucket());
+
+  FLAGS_block_file_codec = "none";
+  vector<BucketStorage::BucketStorageId> ids;
+  for (uint32_t position = 100; position <= 102; position++) {
+    ids.push_back(storage.store(position, "test", 4, position, 0));
+    ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+    storage.finalizeBucket(position);
+  }
+  EXPECT_EQ(4 * kDataBlockSize, storage.getPagesSize().second);
+
+  EXPECT_TRUE(storage.mapOldestBucket());
+  EXPECT_TRUE(storage.mapOldestBucket());
+  EXPECT_TRUE(storage.mapOldestBucket());
+  EXPECT_FALSE(storage.mapOldestBucket());
+  EXPECT_EQ(kDataBlockSize, storage.getPagesSize().second);
+
+  for (uint32_t position = 100; position <= 102; position++) {
+    string str;
+    uint32_t itemCount;
+    ASSERT_EQ(
+        BucketStorage::FetchStatus::SUCCESS,
+        storage.fetch(position, ids[position - 100], str, itemCount));
+    ASSERT_EQ("test", str);
+    ASSERT_EQ(position, itemCount);
+  }
+  FLAGS_block_file_codec = "zlib";
+}
+
+TEST(BucketStorageTest, CompressedBuckets) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+  FLAGS_compress_bucket_age = 1;
+  FLAGS_compressed_page_group = 2;
+
+  BucketStorage storage(5, shardId, dir.dirname());
+  vector<BucketStorage::BucketStorageId> ids(5);
+  for (int i = 0; i < 5; i++) {
+    string data(30000, '0' + i);
+    ids[i] = storage.store(100, data.c_str(), data.length(), 100 + i, i);
+    ASSERT_NE(BucketStorage::kInvalidId, ids[i]);
+  }
+  string large(100000, 'x');
+  ids.push_back(storage.store(100, large.c_str(), large.length(), 50000, 5));
+  ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+  storage.finalizeBucket(100);
+  uint64_t pagesSize = storage.getPagesSize().second;
+
+  auto id = storage.store(101, "test", 4, 1, 0);
+  ASSERT_NE(BucketStorage::kInvalidId, id);
+  storage.finalizeBucket(101);
+
+  // Only the page of bucket 101 is left uncompressed.
+  EXPECT_LT(storage.getPagesSize().second, pagesSize);
+  EXPECT_LT(storage.getPagesSize().second, 2 * kDataBlockSize);
+  EXPECT_FALSE(storage.compressBucket(100));
+  EXPECT_EQ(
+      BucketStorage::kInvalidId, storage.storeBackfill(100, "test", 4, 1));
+
+  for (int i = 0; i < 5; i++) {
+    string str;
+    uint32_t itemCount;
+    ASSERT_EQ(
+        BucketStorage::FetchStatus::SUCCESS,
+        storage.fetch(100, ids[i], str, itemCount));
+    ASSERT_EQ(string(30000, '0' + i), str);
+    ASSERT_EQ(100 + i, itemCount);
+  }
+
+  string str;
+  uint32_t itemCount;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetch(100, ids[5], str, itemCount));
+  ASSERT_EQ(large, str);
+  ASSERT_EQ(50000, itemCount);
+
+  // The inflated page stays valid while the buffer holds it.
+  unique_ptr<folly::IOBuf> buffer;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetchBuffer(100, ids[4], buffer, itemCount));
+  vector<string> strs;
+  vector<uint32_t> itemCounts;
+  vector<BucketStorage::FetchStatus> statuses;
+  storage.fetchMany(100, ids, strs, itemCounts, statuses);
+  for (int i = 0; i < ids.size(); i++) {
+    ASSERT_EQ(BucketStorage::FetchStatus::SUCCESS, statuses[i]);
+  }
+  EXPECT_EQ(string(30000, '3'), strs[3]);
+  EXPECT_EQ(large, strs[5]);
+
+  // Compressed pages are dropped when the bucket is reused.
+  id = storage.store(105, "test", 4, 1, 0);
+  ASSERT_NE(BucketStorage::kInvalidId, id);
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetch(105, id, str, itemCount));
+  ASSERT_EQ("test", str);
+  EXPECT_EQ(
+      string(30000, '4'),
+      string((const char*)buffer->data(), buffer->length()));
+
+  FLAGS_compress_bucket_age = 0;
+  FLAGS_compressed_page_group = 16;
+}
+
+TEST(BucketStorageTest, ReadLegacyZlibBlockFile) {
+  // Block files used to be plain zlib streams without a header.
+  string data(10000, 'x');
+  auto codec = folly::io::getCodec(
+      folly::io::CodecType::ZLIB, folly::io::COMPRESSION_LEVEL_BEST);
+  auto input = folly::IOBuf::wrapBuffer(data.data(), data.length());
+  auto compressed = codec->compress(input.get());
+  compressed->coalesce();
+
+  auto uncompressed = BlockFileCodec::uncompress(
+      folly::ByteRange(compressed->data(), compressed->length()));
+  ASSERT_EQ(
+      data,
+      string((const char*)uncompressed->data(), uncompressed->length()));
+
+  auto withHeader = BlockFileCodec::compress(
+      folly::ByteRange((const uint8_t*)data.data(), data.length()),
+      BlockFileCodec::Type::ZLIB,
+      0);
+  ASSERT_GT(withHeader->length(), BlockFileCodec::kHeaderSize);
+  uncompressed = BlockFileCodec::uncompress(
+      folly::ByteRange(withHeader->data(), withHeader->length()));
+  ASSERT_EQ(
+      data,
+      string((const char*)uncompressed->data(), uncompressed->length()));
+}
+
+TEST(BucketStorageTest, ChunkedBlockFiles) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+  FLAGS_block_file_compression_threads = 3;
+
+  vector<BucketStorage::BucketStorageId> ids(10);
+  {
+    BucketStorage storage(10, shardId, dir.dirname());
+    for (int i = 0; i < 10; i++) {
+      string data(30000, '0' + i);
+      ids[i] = storage.store(100, data.c_str(), data.length(), 100 + i, i);
+      ASSERT_NE(BucketStorage::kInvalidId, ids[i]);
+    }
+    storage.finalizeBucket(100);
+    usleep(10000);
+  }
+  FLAGS_block_file_compression_threads = 0;
+
+  vector<uint32_t> timeSeriesIds;
+  vector<uint64_t> storageIds;
+  BucketStorage storage(10, shardId, dir.dirname());
+  ASSERT_TRUE(storage.loadPosition(100, timeSeriesIds, storageIds));
+  ASSERT_EQ(ids, storageIds);
+
+  for (int i = 0; i < 10; i++) {
+    string str;
+    uint32_t itemCount;
+    ASSERT_EQ(
+        BucketStorage::FetchStatus::SUCCESS,
+        storage.fetch(100, ids[i], str, itemCount));
+    ASSERT_EQ(string(30000, '0' + i), str);
+  }
+}
+
+TEST(BucketStorageTest, SharedTimestampBlockFiles) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+  FLAGS_block_file_shared_timestamps = true;
+
+  // Series written at the same times share their timestamps. The one
+  // with jitter and the block that isn't a stream stay in the pages.
+  vector<string> blocks;
+  for (int i = 0; i < 20; i++) {
+    TimeSeriesStream stream;
+    for (int j = 0; j < 100; j++) {
+      int64_t jitter = i == 19 ? j % 3 : 0;
+      stream.append(1000000000 + j * 60 + jitter, i * j + 0.5, 0);
+    }
+    blocks.emplace_back(stream.getDataPtr(), stream.size());
+  }
+  blocks.push_back("not a stream");
+
+  for (int threads : {0, 2}) {
+    FLAGS_block_file_compression_threads = threads;
+    vector<BucketStorage::BucketStorageId> ids;
+    {
+      BucketStorage storage(10, shardId, dir.dirname());
+      for (int i = 0; i < blocks.size(); i++) {
+        int itemCount = i < 20 ? 100 : 1;
+        ids.push_back(storage.store(
+            100, blocks[i].data(), blocks[i].size(), itemCount, i));
+        ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+      }
+
+      // A deduplicated block has two ids.
+      ids.push_back(storage.store(
+          100, blocks[0].data(), blocks[0].size(), 100, blocks.size()));
+      storage.finalizeBucket(100);
+      usleep(10000);
+    }
+
+    vector<uint32_t> timeSeriesIds;
+    vector<uint64_t> storageIds;
+    BucketStorage storage(10, shardId, dir.dirname());
+    ASSERT_TRUE(storage.loadPosition(100, timeSeriesIds, storageIds));
+    ASSERT_EQ(ids, storageIds);
+    ASSERT_FALSE(storage.mapOldestBucket());
+
+    for (int i = 0; i < ids.size(); i++) {
+      string str;
+      uint32_t itemCount;
+      ASSERT_EQ(
+          BucketStorage::FetchStatus::SUCCESS,
+          storage.fetch(100, ids[i], str, itemCount));
+      ASSERT_EQ(blocks[i % blocks.size()], str);
+    }
+  }
+  FLAGS_block_file_compression_threads = 0;
+  FLAGS_block_file_shared_timestamps = false;
+}
+
+TEST(BucketStorageTest, CompressChunks) {
+  vector<string> chunks = {"abc", string(10000, 'x'), "", string(500, 'y')};
+  vector<folly::ByteRange> ranges;
+  for (const auto& chunk : chunks) {
+    ranges.emplace_back((const uint8_t*)chunk.data(), chunk.length());
+  }
+
+  string file;
+  size_t written = BlockFileCodec::compressChunks(
+      ranges, BlockFileCodec::Type::ZLIB, 0, 2, [&](folly::ByteRange data) {
+        file.append((const char*)data.data(), data.size());
+      });
+  ASSERT_EQ(file.length(), written);
+
+  BlockFileCodec::Type type;
+  bool chunked = false;
+  ASSERT_TRUE(BlockFileCodec::readHeader(
+      folly::ByteRange((const uint8_t*)file.data(), file.length()),
+      type,
+      &chunked));
+  ASSERT_EQ(BlockFileCodec::Type::ZLIB, type);
+  ASSERT_TRUE(chunked);
+
+  auto uncompressed = BlockFileCodec::uncompress(
+      folly::ByteRange((const uint8_t*)file.data(), file.length()));
+  ASSERT_EQ(
+      chunks[0] + chunks[1] + chunks[2] + chunks[3],
+      string((const char*)uncompressed->data(), uncompressed->length()));
+
+  // Truncated files are rejected instead of returning partial data.
+  ASSERT_ANY_THROW(BlockFileCodec::uncompress(
+      folly::ByteRange((const uint8_t*)file.data(), file.length() - 10)));
+
+  // Chunked files can't be mapped, so they must be compressed.
+  ASSERT_ANY_THROW(BlockFileCodec::compressChunks(
+      ranges, BlockFileCodec::Type::NONE, 0, 1, [](folly::ByteRange) {}));
+}
+
+// Flips a byte in the compressed data of chunk `index` of a chunked
+// block file.
+static void damageChunk(string& file, int index) {
+  size_t offset = BlockFileCodec::kHeaderSize + sizeof(uint32_t);
+  for (int i = 0; i < index; i++) {
+    uint32_t compressedLength;
+    memcpy(&compressedLength, &file[offset + 4], sizeof(uint32_t));
+    offset += 3 * sizeof(uint32_t) + compressedLength;
+  }
+  file[offset + 3 * sizeof(uint32_t) + 5] ^= 0x55;
+}
+
+TEST(BucketStorageTest, CompressChecksummedChunks) {
+  vector<string> chunks = {"abc", string(10000, 'x'), "", string(500, 'y')};
+  vector<folly::ByteRange> ranges;
+  for (const auto& chunk : chunks) {
+    ranges.emplace_back((const uint8_t*)chunk.data(), chunk.length());
+  }
+
+  string file;
+  size_t written = BlockFileCodec::compressChunks(
+      ranges,
+      BlockFileCodec::Type::ZLIB,
+      0,
+      2,
+      [&](folly::ByteRange data) {
+        file.append((const char*)data.data(), data.size());
+      },
+      true);
+  ASSERT_EQ(file.length(), written);
+
+  auto uncompress = [](const string& data,
+                       int threads,
+                       vector<uint32_t>* damaged) {
+    auto uncompressed = BlockFileCodec::uncompress(
+        folly::ByteRange((const uint8_t*)data.data(), data.length()),
+        threads,
+        damaged);
+    return string((const char*)uncompressed->data(), uncompressed->length());
+  };
+  string all = chunks[0] + chunks[1] + chunks[2] + chunks[3];
+  ASSERT_EQ(all, uncompress(file, 1, nullptr));
+  ASSERT_EQ(all, uncompress(file, 3, nullptr));
+
+  // Without the index, the chunks are found from their headers.
+  string noIndex = file;
+  noIndex[noIndex.length() - 1] ^= 1;
+  ASSERT_EQ(all, uncompress(noIndex, 2, nullptr));
+
+  string damagedFile = file;
+  damageChunk(damagedFile, 1);
+  ASSERT_ANY_THROW(uncompress(damagedFile, 2, nullptr));
+
+  vector<uint32_t> damaged;
+  ASSERT_EQ(
+      chunks[0] + string(chunks[1].length(), '\0') + chunks[2] + chunks[3],
+      uncompress(damagedFile, 2, &damaged));
+  ASSERT_EQ(vector<uint32_t>({1}), damaged);
+}
+
+TEST(BucketStorageTest, ChecksummedBlockFiles) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+  FLAGS_block_file_compression_threads = 3;
+  FLAGS_block_file_checksums = true;
+
+  // Two blocks per page.
+  vector<BucketStorage::BucketStorageId> ids(10);
+  {
+    BucketStorage storage(10, shardId, dir.dirname());
+    for (int i = 0; i < 10; i++) {
+      string data(30000, '0' + i);
+      ids[i] = storage.store(100, data.c_str(), data.length(), 100 + i, i);
+      ASSERT_NE(BucketStorage::kInvalidId, ids[i]);
+    }
+    storage.finalizeBucket(100);
+    usleep(10000);
+  }
+  FLAGS_block_file_compression_threads = 0;
+  FLAGS_block_file_checksums = false;
+
+  // Chunk 2 is the second page.
+  FileUtils files(shardId, BucketStorage::kDataPrefix, dir.dirname());
+  string file;
+  ASSERT_TRUE(files.read(100, file));
+  damageChunk(file, 2);
+  FILE* f = files.open(100, "wb", 0).file;
+  fwrite(file.data(), sizeof(char), file.size(), f);
+  fclose(f);
+
+  vector<uint32_t> timeSeriesIds;
+  vector<uint64_t> storageIds;
+  BucketStorage storage(10, shardId, dir.dirname());
+  ASSERT_TRUE(storage.loadPosition(100, timeSeriesIds, storageIds));
+  ASSERT_EQ(vector<uint32_t>({0, 1, 4, 5, 6, 7, 8, 9}), timeSeriesIds);
+
+  for (int i = 0; i < timeSeriesIds.size(); i++) {
+    string str;
+    uint32_t itemCount;
+    ASSERT_EQ(
+        BucketStorage::FetchStatus::SUCCESS,
+        storage.fetch(100, storageIds[i], str, itemCount));
+    ASSERT_EQ(string(30000, '0' + timeSeriesIds[i]), str);
+  }
+}
+
 TEST(BucketStorageTest, BigDataStoreAfterCleanupWithoutFinalize) {
   TemporaryDirectory dir("gorilla_data_block");
   boost::filesystem::create_directories(
@@ -296,7 +868,7 @@ TEST(BucketStorageTest, DedupedDataFromDisk) {
 
   for (int i = 0; i < 2048; i++) {
     string str;
-    uint16_t itemCount;
+    uint32_t itemCount;
 
     ASSERT_EQ(
         BucketStorage::FetchStatus::SUCCESS,
@@ -344,7 +916,7 @@ TEST(BucketStorageTest, SpikeInData) {
   ASSERT_NE(BucketStorage::kInvalidId, id);
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
   ASSERT_EQ(
       BucketStorage::FetchStatus::SUCCESS,
       storage.fetch(101, id, str, itemCount));
@@ -372,7 +944,7 @@ TEST(BucketStorageTest, Disable) {
   storage.clearAndDisable();
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
 
   ASSERT_EQ(
       BucketStorage::FetchStatus::FAILURE,
@@ -389,7 +961,7 @@ TEST(BucketStorageTest, DisableAndEnable) {
   storage.enable();
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
 
   ASSERT_EQ(
       BucketStorage::FetchStatus::FAILURE,
@@ -409,7 +981,7 @@ TEST(BucketStorageTest, DisableAndEnableAndReuse) {
   ASSERT_NE(BucketStorage::kInvalidId, id);
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
   ASSERT_EQ(
       BucketStorage::FetchStatus::SUCCESS,
       storage.fetch(11, id, str, itemCount));
@@ -440,7 +1012,7 @@ TEST(BucketStorageTest, StoreAfterFinalize) {
   ASSERT_EQ(BucketStorage::kInvalidId, id5);
 
   string str;
-  uint16_t itemCount;
+  uint32_t itemCount;
 
   ASSERT_EQ(
       BucketStorage::FetchStatus::SUCCESS,
@@ -460,3 +1032,228 @@ TEST(BucketStorageTest, StoreAfterFinalize) {
   ASSERT_EQ("test4", str);
   ASSERT_EQ(104, itemCount);
 }
+
+TEST(BucketStorageTest, FetchedBuffersOutliveRotation) {
+  BucketStorage storage(1, 0, "");
+  auto id = storage.store(1, "test1", 5, 100);
+  ASSERT_NE(BucketStorage::kInvalidId, id);
+
+  std::unique_ptr<folly::IOBuf> buffer;
+  uint32_t itemCount;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetchBuffer(1, id, buffer, itemCount));
+  ASSERT_EQ(100, itemCount);
+
+  // The only bucket is reused while the buffer is still around.
+  auto newId = storage.store(2, "test2", 5, 101);
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::FAILURE,
+      storage.fetchBuffer(1, id, buffer, itemCount));
+  ASSERT_EQ(
+      "test1", string((const char*)buffer->data(), buffer->length()));
+
+  string str;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetch(2, newId, str, itemCount));
+  ASSERT_EQ("test2", str);
+  ASSERT_EQ(101, itemCount);
+}
+
+TEST(BucketStorageTest, PrepareBucket) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "0"));
+
+  BucketStorage storage(2, 0, dir.dirname());
+  vector<BucketStorage::BucketStorageId> ids;
+  for (int i = 0; i < 1000; i++) {
+    string data = to_string(i) + string(1000, 'a');
+    ids.push_back(storage.store(1, data.c_str(), data.size(), i));
+    ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+  }
+  storage.finalizeBucket(1);
+  uint64_t pagesSize = storage.getPagesSize().second;
+  ASSERT_LT(1, pagesSize / BucketStorage::kPageSize);
+
+  // The other bucket was never used, so all of its pages are prepared.
+  ASSERT_TRUE(storage.prepareBucket(2));
+  ASSERT_FALSE(storage.prepareBucket(2));
+  ASSERT_EQ(2 * pagesSize, storage.getPagesSize().second);
+
+  for (int i = 0; i < 1000; i++) {
+    string data = to_string(i) + string(1000, 'b');
+    ASSERT_NE(
+        BucketStorage::kInvalidId,
+        storage.store(2, data.c_str(), data.size(), i));
+  }
+  ASSERT_EQ(2 * pagesSize, storage.getPagesSize().second);
+  ASSERT_FALSE(storage.prepareBucket(2));
+
+  // Position 3 reuses the pages of position 1, except the one that is
+  // still referenced.
+  std::unique_ptr<folly::IOBuf> buffer;
+  uint32_t itemCount;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetchBuffer(1, ids[0], buffer, itemCount));
+  ASSERT_TRUE(storage.prepareBucket(3));
+  ASSERT_EQ(
+      2 * pagesSize + BucketStorage::kPageSize,
+      storage.getPagesSize().second);
+
+  auto id = storage.store(3, "test3", 5, 103);
+  ASSERT_EQ(2 * pagesSize, storage.getPagesSize().second);
+  ASSERT_EQ(
+      "0" + string(1000, 'a'),
+      string((const char*)buffer->data(), buffer->length()));
+  string str;
+  ASSERT_EQ(
+      BucketStorage::FetchStatus::SUCCESS,
+      storage.fetch(3, id, str, itemCount));
+  ASSERT_EQ("test3", str);
+  ASSERT_EQ(103, itemCount);
+}
+
+TEST(BucketStorageTest, LargeBlocks) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+
+  vector<string> data;
+  vector<BucketStorage::BucketStorageId> ids;
+  {
+    BucketStorage storage(10, shardId, dir.dirname());
+    for (int i = 0; i < 3; i++) {
+      data.emplace_back(100000 + i, '0' + i);
+      data.back()[i * 40000] = 'x';
+      ids.push_back(storage.store(
+          100, data.back().c_str(), data.back().length(), 70000 + i, i));
+      ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+    }
+
+    // Many items in little data.
+    data.push_back("test");
+    ids.push_back(storage.store(100, "test", 4, 40000, 3));
+    ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+
+    for (int i = 0; i < ids.size(); i++) {
+      std::unique_ptr<folly::IOBuf> buffer;
+      uint32_t itemCount;
+      ASSERT_EQ(
+          BucketStorage::FetchStatus::SUCCESS,
+          storage.fetchBuffer(100, ids[i], buffer, itemCount));
+      ASSERT_EQ(
+          data[i], string((const char*)buffer->data(), buffer->length()));
+    }
+    storage.finalizeBucket(100);
+  }
+
+  BucketStorage storage(10, shardId, dir.dirname());
+  vector<uint32_t> timeSeriesIds;
+  vector<uint64_t> storageIds;
+  ASSERT_TRUE(storage.loadPosition(100, timeSeriesIds, storageIds));
+  ASSERT_EQ(ids, storageIds);
+
+  vector<string> strs;
+  vector<uint32_t> itemCounts;
+  vector<BucketStorage::FetchStatus> statuses;
+  storage.fetchMany(100, ids, strs, itemCounts, statuses);
+  for (int i = 0; i < ids.size(); i++) {
+    ASSERT_EQ(BucketStorage::FetchStatus::SUCCESS, statuses[i]);
+    ASSERT_EQ(data[i], strs[i]);
+    ASSERT_EQ(i < 3 ? 70000 + i : 40000, itemCounts[i]);
+  }
+}
+
+TEST(BucketStorageTest, FinalizeDropsBlocks) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "12"));
+  int64_t shardId = 12;
+
+  vector<string> data;
+  vector<BucketStorage::BucketStorageId> ids;
+  {
+    BucketStorage storage(10, shardId, dir.dirname());
+    for (int i = 0; i < 6; i++) {
+      // Every third block is a large one.
+      data.emplace_back(i % 3 == 0 ? 50000 : 100, 'a' + i);
+      ids.push_back(storage.store(
+          100, data.back().c_str(), data.back().length(), 10, i));
+      ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+    }
+
+    // The blocks of the odd time series are dropped.
+    storage.finalizeBucket(
+        100, [](uint32_t id, BucketStorage::BucketStorageId) {
+          return id % 2 == 0;
+        });
+  }
+
+  BucketStorage storage(10, shardId, dir.dirname());
+  vector<uint32_t> timeSeriesIds;
+  vector<uint64_t> storageIds;
+  ASSERT_TRUE(storage.loadPosition(100, timeSeriesIds, storageIds));
+  ASSERT_EQ(vector<uint32_t>({0, 2, 4}), timeSeriesIds);
+  ASSERT_EQ(vector<uint64_t>({ids[0], ids[2], ids[4]}), storageIds);
+
+  vector<string> strs;
+  vector<uint32_t> itemCounts;
+  vector<BucketStorage::FetchStatus> statuses;
+  storage.fetchMany(100, ids, strs, itemCounts, statuses);
+  for (int i = 0; i < ids.size(); i++) {
+    if (i % 2 == 0) {
+      ASSERT_EQ(BucketStorage::FetchStatus::SUCCESS, statuses[i]);
+      ASSERT_EQ(data[i], strs[i]);
+    } else if (i % 3 != 0) {
+      // The bytes of the dropped small blocks were zeroed.
+      ASSERT_EQ(string(data[i].length(), '\0'), strs[i]);
+    }
+  }
+}
+
+TEST(BucketStorageTest, FetchViewsInPageOrder) {
+  BucketStorage storage(5, 0, "");
+
+  // Enough blocks for several pages, passed newest first.
+  vector<BucketStorage::BucketStorageId> ids;
+  vector<string> data;
+  for (int i = 0; i < 1000; i++) {
+    data.push_back(string(200, 'a' + i % 26) + to_string(i));
+    ids.push_back(
+        storage.store(1, data.back().c_str(), data.back().length(), i + 1));
+    ASSERT_NE(BucketStorage::kInvalidId, ids.back());
+  }
+  reverse(ids.begin(), ids.end());
+  reverse(data.begin(), data.end());
+  ids.push_back(BucketStorage::kInvalidId);
+
+  vector<size_t> visited;
+  EXPECT_EQ(
+      1000,
+      storage.fetchViews(
+          1, ids, [&](size_t i, folly::StringPiece view, uint32_t count) {
+            EXPECT_EQ(data[i], view.str());
+            EXPECT_EQ(1000 - i, count);
+            visited.push_back(i);
+          }));
+
+  ASSERT_EQ(1000, visited.size());
+  for (int i = 0; i < visited.size(); i++) {
+    EXPECT_EQ(999 - i, visited[i]);
+  }
+
+  // Nothing from an expired position.
+  storage.store(6, "test", 4, 1);
+  visited.clear();
+  EXPECT_EQ(
+      0,
+      storage.fetchViews(
+          1, ids, [&](size_t i, folly::StringPiece, uint32_t) {
+            visited.push_back(i);
+          }));
+  EXPECT_TRUE(visited.empty());
+}
@@ -7,6 +7,7 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 
+#include <gflags/gflags.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <tuple>
@@ -14,12 +15,19 @@
 #include "beringei/if/gen-cpp2/beringei_data_types.h"
 #include "beringei/lib/BucketStorage.h"
 #include "beringei/lib/BucketedTimeSeries.h"
+#include "beringei/lib/CoalescedBlockCache.h"
 #include "beringei/lib/TimeSeries.h"
 
 using namespace ::testing;
 using namespace facebook::gorilla;
 using namespace std;
 
+DECLARE_string(gorilla_high_resolution_categories);
+DECLARE_string(gorilla_millisecond_categories);
+DECLARE_bool(gorilla_count_repeated_points);
+DECLARE_double(lossy_compression_error);
+DECLARE_int32(reorder_window_secs);
+
 typedef vector<pair<uint8_t, vector<TimeValuePair>>> In;
 
 template <class T>
@@ -100,6 +108,181 @@ TEST_F(BucketedTimeSeriesTest, TimeSeries) {
   test<BucketedTimeSeries>(bucket, &storage, source0(), ts0());
 }
 
+TEST_F(BucketedTimeSeriesTest, GetMany) {
+  BucketStorage storage(5, 0, "");
+  vector<BucketedTimeSeries> series(3);
+  for (int i = 0; i < series.size(); i++) {
+    series[i].reset(5, 0, 0);
+  }
+
+  // The first two have the same data in different buckets and the
+  // last one is empty.
+  for (auto& bucket : source0()) {
+    for (auto& value : bucket.second) {
+      series[0].put(bucket.first, value, &storage, 0, nullptr);
+      series[1].put(bucket.first + 1, value, &storage, 1, nullptr);
+    }
+  }
+
+  for (auto& range : {make_pair(0, 100), make_pair(8, 9), make_pair(3, 4)}) {
+    vector<BucketedTimeSeries::Output> expected(series.size());
+    vector<BucketedTimeSeries::Output> output(series.size());
+    vector<BucketedTimeSeries*> seriesPtrs;
+    vector<BucketedTimeSeries::Output*> outs;
+    for (int i = 0; i < series.size(); i++) {
+      series[i].get(range.first, range.second, expected[i], &storage);
+      seriesPtrs.push_back(&series[i]);
+      outs.push_back(&output[i]);
+    }
+
+    BucketedTimeSeries::getMany(
+        seriesPtrs, range.first, range.second, outs, &storage);
+    for (int i = 0; i < series.size(); i++) {
+      ASSERT_EQ(expected[i].size(), output[i].size());
+      for (int j = 0; j < expected[i].size(); j++) {
+        EXPECT_EQ(expected[i][j].count, output[i][j].count);
+        EXPECT_EQ(expected[i][j], output[i][j]);
+      }
+    }
+  }
+}
+
+TEST_F(BucketedTimeSeriesTest, Coalesce) {
+  BucketedTimeSeries bucket;
+  bucket.reset(5, 0, 0);
+  BucketStorage storage(5, 0, "");
+  for (auto& bucketValues : source0()) {
+    for (auto& value : bucketValues.second) {
+      bucket.put(bucketValues.first, value, &storage, 0, nullptr);
+    }
+  }
+  auto next = makeTV(12.5, 360);
+  bucket.put(9, next, &storage, 0, nullptr);
+
+  CoalescedBlockCache cache(1 << 20);
+  BucketedTimeSeries::Coalesce coalesce;
+  coalesce.cache = &cache;
+  coalesce.keys = {"key"};
+
+  // The finalized buckets are one block and the active one another.
+  for (int i = 0; i < 2; i++) {
+    Block output;
+    bucket.get(0, 100, output, &storage, &coalesce);
+    ASSERT_EQ(2, output.size());
+    EXPECT_EQ(5, output[0].count);
+
+    vector<TimeValuePair> values;
+    TimeSeries::getValues(output, values, 0, 1000);
+    vector<TimeValuePair> expected(tv, tv + 5);
+    expected.push_back(next);
+    EXPECT_EQ(expected, values);
+    EXPECT_LT(0, cache.getMemoryUsage());
+  }
+
+  // Only the finalized buckets in the range.
+  Block output;
+  bucket.get(8, 8, output, &storage, &coalesce);
+  ASSERT_EQ(1, output.size());
+  EXPECT_EQ(blocks[1].data, output[0].data);
+
+  // The same without a cache.
+  coalesce.cache = nullptr;
+  output.clear();
+  bucket.get(7, 9, output, &storage, &coalesce);
+  ASSERT_EQ(2, output.size());
+  EXPECT_EQ(5, output[0].count);
+}
+
+TEST(BucketedTimeSeriesTest2, SparseBuckets) {
+  BucketedTimeSeries bucket;
+  bucket.reset(5, 0, 0);
+  BucketStorage storage(5, 0, "");
+  ASSERT_FALSE(bucket.hasDataPoints(5));
+
+  // Points in some of the buckets, wrapping around the ring.
+  for (int i : {1, 2, 4, 7, 8, 11}) {
+    for (int j = 0; j <= i; j++) {
+      bucket.put(i, makeTV(j, i * 1000 + j * 60), &storage, 0, nullptr);
+    }
+  }
+  ASSERT_TRUE(bucket.hasDataPoints(5));
+
+  // Buckets 7 and 8 are stored and 11 is the active one.
+  vector<TimeSeriesBlock> out;
+  bucket.get(0, 100, out, &storage);
+  ASSERT_EQ(3, out.size());
+  EXPECT_EQ(8, out[0].count);
+  EXPECT_EQ(9, out[1].count);
+  EXPECT_EQ(12, out[2].count);
+
+  // Only the empty active bucket is left once all the buckets have
+  // expired.
+  bucket.setCurrentBucket(17, &storage, 0);
+  ASSERT_FALSE(bucket.hasDataPoints(5));
+  out.clear();
+  bucket.get(0, 100, out, &storage);
+  ASSERT_EQ(1, out.size());
+  EXPECT_EQ(0, out[0].count);
+}
+
+TEST(BucketedTimeSeriesTest2, LossyCompression) {
+  FLAGS_lossy_compression_error = 0.01;
+  BucketedTimeSeries bucket;
+  bucket.reset(5, 0, 0);
+  BucketStorage storage(5, 0, "");
+
+  // A straight line in bucket 1 and noise in bucket 2.
+  for (int j = 0; j < 100; j++) {
+    bucket.put(1, makeTV(j * 2, j * 60), &storage, 0, nullptr);
+  }
+  for (int j = 100; j < 200; j++) {
+    bucket.put(2, makeTV(j * 7919 % 101, j * 60), &storage, 0, nullptr);
+  }
+  bucket.setCurrentBucket(3, &storage, 0);
+  FLAGS_lossy_compression_error = 0;
+
+  vector<TimeSeriesBlock> out;
+  bucket.get(1, 2, out, &storage);
+  ASSERT_EQ(2, out.size());
+
+  // The line keeps its ends and a point every --pla_period seconds.
+  // Noise can't be approximated in less space.
+  EXPECT_TRUE(TimeSeries::isApproximate(out[0]));
+  ASSERT_EQ(3, out[0].count);
+  EXPECT_FALSE(TimeSeries::isApproximate(out[1]));
+  EXPECT_EQ(100, out[1].count);
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(out, values, 0, 100000);
+  ASSERT_EQ(103, values.size());
+  EXPECT_EQ(makeTV(0, 0), values[0]);
+  EXPECT_EQ(makeTV(120, 60 * 60), values[1]);
+  EXPECT_EQ(makeTV(198, 99 * 60), values[2]);
+}
+
+TEST(BucketedTimeSeriesTest2, LargeBuckets) {
+  BucketedTimeSeries bucket;
+  bucket.reset(5, 0, 0);
+  BucketStorage storage(5, 0, "");
+
+  // More points and bytes than fit in a single block id.
+  for (int j = 0; j < 70000; j++) {
+    bucket.put(1, makeTV(j * 7919 % 101, j * 60), &storage, 0, nullptr);
+  }
+  bucket.setCurrentBucket(2, &storage, 0);
+
+  vector<TimeSeriesBlock> out;
+  bucket.get(1, 1, out, &storage);
+  ASSERT_EQ(1, out.size());
+  ASSERT_EQ(70000, out[0].count);
+  ASSERT_GT(out[0].data.size(), 32767);
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(out, values, 0, 70000 * 60);
+  ASSERT_EQ(70000, values.size());
+  EXPECT_EQ(makeTV(69999 * 7919 % 101, 69999 * 60), values.back());
+}
+
 TEST(BucketedTimeSeriesTest2, QueriedBucketsAgo) {
   BucketedTimeSeries bucket;
   bucket.reset(5, 0, 0);
@@ -191,6 +374,89 @@ TEST(BucketedTimeSeriesTest2, MinTimestampDeltaCheck) {
       bucket.put(bucketId, tvPair, &storage, timeSeriesId, timeSeriesCategory));
 }
 
+TEST(BucketedTimeSeriesTest2, HighResolutionCategories) {
+  FLAGS_gorilla_high_resolution_categories = "3, 7";
+  EXPECT_EQ(1, BucketedTimeSeries::minTimestampDelta(3));
+  EXPECT_EQ(1, BucketedTimeSeries::minTimestampDelta(7));
+  EXPECT_EQ(30, BucketedTimeSeries::minTimestampDelta(0));
+
+  BucketStorage storage(5, 0, "");
+  uint16_t category = 7;
+  BucketedTimeSeries highResolution;
+  highResolution.reset(5, 0, 0, category);
+  BucketedTimeSeries lowResolution;
+  lowResolution.reset(5, 0, 0);
+
+  TimeValuePair tvPair;
+  int accepted = 0;
+  for (tvPair.unixTime = 5; tvPair.unixTime < 65; tvPair.unixTime++) {
+    // The category of the time series is used when none is given.
+    if (highResolution.put(1, tvPair, &storage, 0, nullptr)) {
+      accepted++;
+    }
+    ASSERT_EQ(
+        tvPair.unixTime == 5 || tvPair.unixTime == 35,
+        lowResolution.put(1, tvPair, &storage, 1, nullptr));
+  }
+  ASSERT_EQ(60, accepted);
+
+  Block out;
+  highResolution.get(1, 1, out, &storage);
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(out, values, 0, 100);
+  ASSERT_EQ(60, values.size());
+  FLAGS_gorilla_high_resolution_categories = "";
+}
+
+TEST(BucketedTimeSeriesTest2, MillisecondCategories) {
+  FLAGS_gorilla_millisecond_categories = "4";
+  EXPECT_TRUE(BucketedTimeSeries::isMillisecondCategory(4));
+  EXPECT_FALSE(BucketedTimeSeries::isMillisecondCategory(3));
+
+  BucketStorage storage(5, 0, "");
+  uint16_t category = 4;
+  BucketedTimeSeries series;
+  series.reset(5, 0, 0, category);
+  BucketedTimeSeries batched;
+  batched.reset(5, 0, 0, category);
+
+  // Every 50ms, of which every other one is too soon.
+  vector<TimeValuePair> values;
+  vector<uint32_t> buckets;
+  for (int i = 0; i < 60; i++) {
+    TimeValuePair tvPair;
+    tvPair.unixTime = 100 + i * 50 / 1000;
+    tvPair.ms = i * 50 % 1000;
+    tvPair.value = i;
+    ASSERT_EQ(i % 2 == 0, series.put(1, tvPair, &storage, 0, nullptr));
+    values.push_back(tvPair);
+    buckets.push_back(1);
+  }
+  vector<bool> added;
+  EXPECT_EQ(30, batched.putMany(values, buckets, &storage, 1, nullptr, added));
+
+  // Milliseconds outside of the second are rejected.
+  TimeValuePair invalid;
+  invalid.unixTime = 110;
+  invalid.value = 1;
+  for (int16_t ms : {-1, 1000}) {
+    invalid.ms = ms;
+    EXPECT_FALSE(series.put(1, invalid, &storage, 0, nullptr));
+  }
+
+  for (auto* s : {&series, &batched}) {
+    Block out;
+    s->get(1, 1, out, &storage);
+    vector<TimeValuePair> read;
+    TimeSeries::getValues(out, read, 0, 1000);
+    ASSERT_EQ(30, read.size());
+    for (int i = 0; i < 30; i++) {
+      EXPECT_EQ(values[i * 2], read[i]);
+    }
+  }
+  FLAGS_gorilla_millisecond_categories = "";
+}
+
 TEST(BucketedTimeSeriesTest2, MinimumBucketAndTimestamp) {
   BucketedTimeSeries b;
   BucketStorage s(5, 0, "");
@@ -265,3 +531,147 @@ TEST(BucketedTimeSeriesTest2, MinimumBucketAndTimestamp) {
   b.reset(5, 10, 72121);
   EXPECT_EQ(0b0000, test());
 }
+
+TEST(BucketedTimeSeriesTest2, RepeatedPoints) {
+  BucketStorage storage(5, 0, "");
+  vector<BucketedTimeSeries> series(2);
+  for (int i = 0; i < series.size(); i++) {
+    FLAGS_gorilla_count_repeated_points = i == 0;
+    series[i].reset(5, 0, 0);
+    for (int j = 0; j < 200; j++) {
+      auto value = makeTV(j < 20 ? j : 7, 100000 + j * 60);
+      ASSERT_TRUE(series[i].put(1, value, &storage, i, nullptr));
+    }
+  }
+  FLAGS_gorilla_count_repeated_points = true;
+
+  // The points since the value stopped changing aren't in the stream.
+  EXPECT_EQ(200, get<0>(series[0].getActiveTimeSeriesStreamInfo()));
+  EXPECT_GE(
+      get<1>(series[1].getActiveTimeSeriesStreamInfo()),
+      get<1>(series[0].getActiveTimeSeriesStreamInfo()) + 40);
+
+  uint32_t bucket[2];
+  uint32_t count[2];
+  TimeSeriesStream::State state[2];
+  string data[2];
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(
+        series[i].getActiveStream(bucket[i], count[i], state[i], data[i]));
+  }
+  EXPECT_EQ(count[1], count[0]);
+  EXPECT_EQ(data[1], data[0]);
+  EXPECT_EQ(0, memcmp(&state[0], &state[1], sizeof(state[0])));
+
+  // Reads of the active and the finalized bucket are the same either
+  // way.
+  for (int pass = 0; pass < 2; pass++) {
+    Block out[2];
+    for (int i = 0; i < 2; i++) {
+      series[i].get(0, 10, out[i], &storage);
+      series[i].setCurrentBucket(2, &storage, i);
+    }
+    ASSERT_EQ(pass + 1, out[0].size());
+    ASSERT_EQ(out[1].size(), out[0].size());
+    EXPECT_EQ(200, out[0][0].count);
+    EXPECT_EQ(out[1][0].data, out[0][0].data);
+  }
+}
+
+TEST(BucketedTimeSeriesTest2, PutMany) {
+  BucketStorage storage(5, 0, "");
+  vector<TimeValuePair> values;
+  vector<uint32_t> buckets;
+  for (int j = 0; j < 300; j++) {
+    values.push_back(makeTV(j < 50 ? j : 7, 100000 + j * 60));
+    buckets.push_back(1 + j / 100);
+  }
+  // Too soon after the previous one, and in a bucket that was closed.
+  values[150].unixTime = values[149].unixTime + 1;
+  buckets[250] = 2;
+
+  for (bool countRepeats : {false, true}) {
+    FLAGS_gorilla_count_repeated_points = countRepeats;
+    BucketedTimeSeries expected;
+    BucketedTimeSeries series;
+    expected.reset(5, 0, 0);
+    series.reset(5, 0, 0);
+
+    vector<bool> expectedAdded;
+    uint16_t category = 3;
+    for (int j = 0; j < values.size(); j++) {
+      expectedAdded.push_back(
+          expected.put(buckets[j], values[j], &storage, 0, &category));
+    }
+    vector<bool> added;
+    EXPECT_EQ(
+        values.size() - 2,
+        series.putMany(values, buckets, &storage, 1, &category, added));
+    EXPECT_EQ(expectedAdded, added);
+    EXPECT_EQ(category, series.getCategory());
+    EXPECT_EQ(
+        get<0>(expected.getActiveTimeSeriesStreamInfo()),
+        get<0>(series.getActiveTimeSeriesStreamInfo()));
+
+    Block expectedOut;
+    Block out;
+    expected.get(0, 10, expectedOut, &storage);
+    series.get(0, 10, out, &storage);
+    ASSERT_EQ(3, out.size());
+    ASSERT_EQ(expectedOut.size(), out.size());
+    for (int i = 0; i < out.size(); i++) {
+      EXPECT_EQ(expectedOut[i].count, out[i].count);
+      EXPECT_EQ(expectedOut[i].data, out[i].data);
+    }
+  }
+  FLAGS_gorilla_count_repeated_points = true;
+}
+
+TEST(BucketedTimeSeriesTest2, ReorderWindow) {
+  FLAGS_reorder_window_secs = 120;
+  BucketStorage storage(5, 0, "");
+  BucketedTimeSeries series;
+  series.reset(5, 0, 0);
+
+  // Out of order by up to a minute.
+  for (int64_t t : {100060, 100000, 100180, 100120, 100240, 100300}) {
+    ASSERT_TRUE(series.put(1, makeTV(t, t), &storage, 0, nullptr));
+  }
+
+  // The points up to 100180 were appended to the stream.
+  EXPECT_EQ(4, get<0>(series.getActiveTimeSeriesStreamInfo()));
+  ASSERT_FALSE(series.put(1, makeTV(0, 100150), &storage, 0, nullptr));
+  ASSERT_TRUE(series.put(1, makeTV(100270, 100270), &storage, 0, nullptr));
+  EXPECT_EQ(4, get<0>(series.getActiveTimeSeriesStreamInfo()));
+
+  // The held back points are read with the active stream.
+  vector<int64_t> expected = {
+      100000, 100060, 100120, 100180, 100240, 100270, 100300};
+  uint32_t bucket;
+  uint32_t count;
+  TimeSeriesStream::State state;
+  string data;
+  ASSERT_TRUE(series.getActiveStream(bucket, count, state, data));
+  EXPECT_EQ(1, bucket);
+  EXPECT_EQ(expected.size(), count);
+
+  for (int pass = 0; pass < 2; pass++) {
+    Block out;
+    series.get(0, 10, out, &storage);
+    ASSERT_EQ(pass + 1, out.size());
+    EXPECT_EQ(expected.size(), out[0].count);
+
+    vector<TimeValuePair> values;
+    TimeSeries::getValues(out, values, 0, 200000);
+    ASSERT_EQ(expected.size(), values.size());
+    for (int i = 0; i < expected.size(); i++) {
+      EXPECT_EQ(expected[i], values[i].unixTime);
+      EXPECT_EQ(expected[i], values[i].value);
+    }
+
+    // Closing the bucket appends the rest first.
+    series.setCurrentBucket(2, &storage, 0);
+  }
+  EXPECT_EQ(0, get<0>(series.getActiveTimeSeriesStreamInfo()));
+  FLAGS_reorder_window_secs = 0;
+}
@@ -11,6 +11,7 @@
 #include <unordered_map>
 
 #include <folly/String.h>
+#include <folly/hash/SpookyHashV2.h>
 #include "TestKeyList.h"
 
 #include "beringei/lib/CaseUtils.h"
@@ -34,6 +35,22 @@ TEST(CaseUtilsTest, CaseHash) {
   EXPECT_NE(hash("foo"), hash("bar"));
 }
 
+TEST(CaseUtilsTest, CaseHashOfLowerCase) {
+  // The hash must not change, since it places keys in shards.
+  std::string key;
+  for (int i = 0; i < 1000; i++) {
+    key += "aZ.\x80\xC9@[`{"[i % 10];
+    std::string lower = key;
+    folly::toLowerAscii(&lower[0], lower.size());
+    for (uint64_t seed : {0, 42}) {
+      uint64_t expected = folly::hash::SpookyHashV2::Hash64(
+          lower.data(), lower.size(), seed);
+      EXPECT_EQ(expected, CaseHash::hash(key, seed));
+      EXPECT_EQ(expected, CaseHash::hash(lower, seed));
+    }
+  }
+}
+
 const static int kNumHashes = 10000000;
 const static int kKeyListSize = 400000;
 
@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/CategoryPolicy.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+TEST(CategoryPolicyTest, Parse) {
+  std::unordered_map<uint16_t, CategoryPolicy> policies;
+  ASSERT_TRUE(CategoryPolicy::parse(
+      "7:retention=2:series=10000, 9:interval=0:memory_mb=64,11", policies));
+  ASSERT_EQ(3, policies.size());
+
+  EXPECT_EQ(2, policies[7].retentionBuckets);
+  EXPECT_EQ(10000, policies[7].maxSeries);
+  EXPECT_EQ(-1, policies[7].minTimestampDelta);
+  EXPECT_EQ(0, policies[7].maxBytes);
+
+  EXPECT_EQ(0, policies[9].retentionBuckets);
+  EXPECT_EQ(0, policies[9].minTimestampDelta);
+  EXPECT_EQ(64 << 20, policies[9].maxBytes);
+
+  EXPECT_EQ(0, policies[11].maxSeries);
+  EXPECT_TRUE(CategoryPolicy::parse("", policies));
+}
+
+TEST(CategoryPolicyTest, ParseErrors) {
+  for (auto spec : {"x:series=1",
+                    "70000:series=1",
+                    "1:series",
+                    "1:series=-1",
+                    "1:retention=256",
+                    "1:unknown=1",
+                    "1:series=x"}) {
+    std::unordered_map<uint16_t, CategoryPolicy> policies;
+    EXPECT_FALSE(CategoryPolicy::parse(spec, policies)) << spec;
+  }
+}
+
+TEST(CategoryPolicyTest, NoPolicies) {
+  EXPECT_EQ(nullptr, CategoryPolicy::get(1));
+  EXPECT_EQ(6, CategoryPolicy::bucketsKept(1, 6));
+}
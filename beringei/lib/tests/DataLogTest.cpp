@@ -13,8 +13,10 @@
 #include <unistd.h>
 
 #include "beringei/if/gen-cpp2/beringei_data_types.h"
+#include "beringei/lib/BucketUtils.h"
 #include "beringei/lib/DataLog.h"
 #include "beringei/lib/FileUtils.h"
+#include "beringei/lib/LogReader.h"
 
 #include "TestDataLoader.h"
 
@@ -23,6 +25,8 @@ using namespace facebook;
 using namespace facebook::gorilla;
 using namespace std;
 
+DECLARE_int32(data_log_buffer_size);
+
 TEST(DataLogTest, writeAndRead) {
   FLAGS_gorilla_async_file_close = false;
 
@@ -181,3 +185,173 @@ TEST(DataLogTest, DISABLED_Fuzz) {
 
   ASSERT_EQ(dataPoints, readValues);
 }
+
+TEST(DataLogTest, LocalLogReaderKeepsFileOrder) {
+  FLAGS_gorilla_async_file_close = false;
+
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+
+  // One log file per bucket, more files than are decoded in parallel.
+  const int windowSize = 100;
+  FileUtils files(10, "log", dir.dirname());
+  vector<int64_t> expectedTimes;
+  for (int b = 1; b <= 5; b++) {
+    int64_t baseTime = BucketUtils::timestamp(b, windowSize, 10);
+    DataLogWriter writer(files.open(baseTime, "wb", 0), baseTime);
+    for (int i = 0; i < 3; i++) {
+      writer.append(i, baseTime + i, b);
+      expectedTimes.push_back(baseTime + i);
+    }
+  }
+
+  vector<int64_t> times;
+  vector<double> values;
+  LocalLogReader reader(
+      10,
+      dir.dirname(),
+      windowSize,
+      [&](uint32_t id,
+          int64_t unixTime,
+          double value,
+          int16_t ms,
+          uint32_t& unknownKeys,
+          int64_t& lastTimestamp) {
+        times.push_back(unixTime);
+        values.push_back(value);
+      });
+
+  int64_t lastTimestamp = 0;
+  uint32_t unknownKeys = 0;
+  reader.readLog(0, lastTimestamp, unknownKeys);
+
+  ASSERT_EQ(expectedTimes, times);
+  for (int i = 0; i < values.size(); i++) {
+    ASSERT_EQ(i / 3 + 1, values[i]);
+  }
+}
+
+namespace {
+// Serves the log files of another data directory.
+class DirectoryLogFileSource : public LogFileSource {
+ public:
+  DirectoryLogFileSource(const string& dir, uint32_t shardId)
+      : files_(shardId, "log", dir), shardId_(shardId) {}
+
+  bool listLogFiles(uint32_t shardId, vector<int64_t>& ids) override {
+    if (shardId != shardId_) {
+      return false;
+    }
+    ids = files_.ls();
+    return true;
+  }
+
+  bool readLogFile(uint32_t shardId, int64_t id, string& data) override {
+    reads++;
+    return files_.read(id, data);
+  }
+
+  atomic<int> reads{0};
+
+ private:
+  FileUtils files_;
+  uint32_t shardId_;
+};
+}
+
+TEST(DataLogTest, RemoteLogReader) {
+  FLAGS_gorilla_async_file_close = false;
+
+  TemporaryDirectory remote("gorilla_test");
+  TemporaryDirectory local("gorilla_test");
+  for (int shardId : {10, 11}) {
+    for (const auto& dir : {remote.dirname(), local.dirname()}) {
+      boost::filesystem::create_directories(
+          FileUtils::joinPaths(dir, to_string(shardId)));
+    }
+  }
+
+  // The source only has shard 10. Shard 11 is read locally.
+  const int windowSize = 100;
+  for (int shardId : {10, 11}) {
+    const auto& dir = shardId == 10 ? remote.dirname() : local.dirname();
+    FileUtils files(shardId, "log", dir);
+    for (int b = 1; b <= 3; b++) {
+      int64_t baseTime = BucketUtils::timestamp(b, windowSize, shardId);
+      DataLogWriter writer(files.open(baseTime, "wb", 0), baseTime);
+      writer.append(b, baseTime, b * 1.5);
+    }
+  }
+
+  auto source = make_shared<DirectoryLogFileSource>(remote.dirname(), 10);
+  RemoteLogReaderFactory factory(local.dirname(), source);
+  for (int shardId : {10, 11}) {
+    vector<uint32_t> ids;
+    vector<double> values;
+    auto reader = factory.getLogReader(
+        shardId,
+        windowSize,
+        [&](uint32_t id,
+            int64_t unixTime,
+            double value,
+            int16_t ms,
+            uint32_t& unknownKeys,
+            int64_t& lastTimestamp) {
+          ids.push_back(id);
+          values.push_back(value);
+        });
+
+    int64_t lastTimestamp = 0;
+    uint32_t unknownKeys = 0;
+    reader->readLog(0, lastTimestamp, unknownKeys);
+    ASSERT_EQ(vector<uint32_t>({1, 2, 3}), ids);
+    ASSERT_EQ(vector<double>({1.5, 3, 4.5}), values);
+  }
+  EXPECT_EQ(3, source->reads);
+}
+
+TEST(DataLogTest, SparseIds) {
+  FLAGS_gorilla_async_file_close = false;
+  FLAGS_data_log_buffer_size = 100;
+
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "10"));
+  FileUtils files(10, "test_log", dir.dirname());
+
+  // Ids far apart, repeated values and large deltas with a buffer
+  // that has to be flushed repeatedly.
+  vector<uint32_t> expectedIds;
+  vector<int64_t> expectedTimes;
+  vector<double> expectedValues;
+  for (int i = 0; i < 300; i++) {
+    expectedIds.push_back((i % 7) * 1234567);
+    expectedTimes.push_back(i % 2 ? 100 + i : 1 << 30);
+    expectedValues.push_back(i % 3 ? 1.5 : i * 123.456);
+  }
+
+  {
+    DataLogWriter writer(files.open(1, "wb", 0), 0);
+    for (int i = 0; i < expectedIds.size(); i++) {
+      writer.append(expectedIds[i], expectedTimes[i], expectedValues[i]);
+    }
+  }
+
+  vector<uint32_t> ids;
+  vector<int64_t> times;
+  vector<double> values;
+  auto testFile = files.open(1, "rb", 0);
+  DataLogReader::readLog(
+      testFile, 0, [&](uint32_t id, int64_t time, double value) {
+        ids.push_back(id);
+        times.push_back(time);
+        values.push_back(value);
+        return true;
+      });
+  FLAGS_data_log_buffer_size = 65536;
+
+  ASSERT_EQ(expectedIds, ids);
+  ASSERT_EQ(expectedTimes, times);
+  ASSERT_EQ(expectedValues, values);
+}
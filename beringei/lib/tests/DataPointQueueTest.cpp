@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+#include "beringei/lib/DataPointQueue.h"
+#include "beringei/lib/FileUtils.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+using namespace std;
+
+static DataPointQueue::Point makePoint(int i) {
+  DataPointQueue::Point point;
+  point.timeSeriesId = i;
+  point.unixTime = 1000 + i;
+  point.ms = i % 1000;
+  point.key = i % 2 ? "" : "key" + to_string(i);
+  point.value = i * 1.5;
+  point.category = i % 3;
+  return point;
+}
+
+TEST(DataPointQueueTest, SpillsInOrder) {
+  TemporaryDirectory dir("gorilla_test");
+  string spillFile = FileUtils::joinPaths(dir.dirname(), "queued");
+
+  {
+    DataPointQueue queue(10, spillFile, 1 << 24);
+    for (int i = 0; i < 100000; i++) {
+      ASSERT_TRUE(queue.write(makePoint(i)));
+    }
+    EXPECT_EQ(99990, queue.spilledPoints());
+    EXPECT_TRUE(boost::filesystem::exists(spillFile));
+
+    DataPointQueue::Point point;
+    for (int i = 0; i < 100000; i++) {
+      ASSERT_TRUE(queue.read(point));
+      auto expected = makePoint(i);
+      ASSERT_EQ(expected.timeSeriesId, point.timeSeriesId);
+      ASSERT_EQ(expected.unixTime, point.unixTime);
+      ASSERT_EQ(expected.ms, point.ms);
+      ASSERT_EQ(expected.key, point.key);
+      ASSERT_EQ(expected.value, point.value);
+      ASSERT_EQ(expected.category, point.category);
+
+      // Points written while reading go after the spilled ones.
+      if (i == 50000) {
+        ASSERT_TRUE(queue.write(makePoint(100000)));
+      }
+    }
+    ASSERT_TRUE(queue.read(point));
+    ASSERT_EQ(100000, point.timeSeriesId);
+    ASSERT_FALSE(queue.read(point));
+
+    // Back to memory once the spill file is empty.
+    ASSERT_TRUE(queue.write(makePoint(1)));
+    EXPECT_EQ(99991, queue.spilledPoints());
+    ASSERT_TRUE(queue.read(point));
+    ASSERT_EQ(1, point.timeSeriesId);
+  }
+
+  // Removed with the queue.
+  EXPECT_FALSE(boost::filesystem::exists(spillFile));
+}
+
+TEST(DataPointQueueTest, Limits) {
+  TemporaryDirectory dir("gorilla_test");
+  string spillFile = FileUtils::joinPaths(dir.dirname(), "queued");
+
+  DataPointQueue noSpill(2, spillFile, 0);
+  ASSERT_TRUE(noSpill.write(makePoint(0)));
+  ASSERT_TRUE(noSpill.write(makePoint(1)));
+  ASSERT_FALSE(noSpill.write(makePoint(2)));
+
+  // Two records with an empty key fit.
+  DataPointQueue small(1, spillFile, 48);
+  ASSERT_TRUE(small.write(makePoint(1)));
+  ASSERT_TRUE(small.write(makePoint(3)));
+  ASSERT_TRUE(small.write(makePoint(5)));
+  ASSERT_FALSE(small.write(makePoint(7)));
+
+  DataPointQueue::Point point;
+  for (int i : {1, 3, 5}) {
+    ASSERT_TRUE(small.read(point));
+    ASSERT_EQ(i, point.timeSeriesId);
+  }
+  ASSERT_FALSE(small.read(point));
+}
+
+TEST(DataPointQueueTest, ConcurrentWriters) {
+  TemporaryDirectory dir("gorilla_test");
+  DataPointQueue queue(
+      100, FileUtils::joinPaths(dir.dirname(), "queued"), 1 << 30);
+
+  vector<thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&queue, t]() {
+      for (int i = 0; i < 10000; i++) {
+        queue.write(makePoint(t * 10000 + i));
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // Points of each writer stay in order.
+  vector<int> last(4, -1);
+  DataPointQueue::Point point;
+  int count = 0;
+  while (queue.read(point)) {
+    int t = point.timeSeriesId / 10000;
+    ASSERT_LT(last[t], (int)point.timeSeriesId);
+    last[t] = point.timeSeriesId;
+    count++;
+  }
+  ASSERT_EQ(40000, count);
+}
@@ -71,3 +71,25 @@ TEST(FileUtilsTest, MultiWriter) {
 
   files2.clearTo(1000);
 }
+
+TEST(FileUtilsTest, Read) {
+  TemporaryDirectory dir("gorilla_data_block");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "7"));
+
+  FileUtils files(7, "test", dir.dirname());
+  FILE* f = files.open(1, "w", 0).file;
+  fputs("hello", f);
+  fclose(f);
+  fclose(files.open(2, "w", 0).file);
+
+  string data;
+  EXPECT_TRUE(files.read(1, data));
+  EXPECT_EQ("hello", data);
+  EXPECT_EQ("hello", files.readAsync(1).get());
+
+  // Empty and missing files.
+  EXPECT_FALSE(files.read(2, data));
+  EXPECT_FALSE(files.read(3, data));
+  EXPECT_EQ("", files.readAsync(3).get());
+}
@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "beringei/lib/FlatKeyTable.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+namespace {
+class FlatKeyTableTest : public Test {
+ protected:
+  int find(const std::string& key, uint32_t hash) {
+    return table_.find(
+        key.c_str(),
+        hash,
+        [this](int id) { return keys_[id].c_str(); },
+        [](const char* a, const char* b) { return strcmp(a, b) == 0; });
+  }
+
+  int add(const std::string& key, uint32_t hash) {
+    keys_.push_back(key);
+    table_.insert(hash, keys_.size() - 1);
+    return keys_.size() - 1;
+  }
+
+  std::vector<std::string> keys_;
+  FlatKeyTable table_;
+};
+}
+
+TEST_F(FlatKeyTableTest, InsertFindErase) {
+  EXPECT_EQ(-1, find("missing", 1));
+  EXPECT_FALSE(table_.erase(1, 0));
+
+  const int kKeys = 10000;
+  for (int i = 0; i < kKeys; i++) {
+    add("key" + std::to_string(i), i * 2654435761u);
+  }
+  EXPECT_EQ(kKeys, table_.size());
+
+  for (int i = 0; i < kKeys; i++) {
+    EXPECT_EQ(i, find("key" + std::to_string(i), i * 2654435761u));
+  }
+  EXPECT_EQ(-1, find("key" + std::to_string(kKeys), kKeys * 2654435761u));
+
+  for (int i = 0; i < kKeys; i += 2) {
+    EXPECT_TRUE(table_.erase(i * 2654435761u, i));
+  }
+  EXPECT_FALSE(table_.erase(0, 0));
+  EXPECT_EQ(kKeys / 2, table_.size());
+
+  for (int i = 0; i < kKeys; i++) {
+    EXPECT_EQ(i % 2 ? i : -1, find("key" + std::to_string(i), i * 2654435761u));
+  }
+}
+
+TEST_F(FlatKeyTableTest, Collisions) {
+  // Same hash for every key, so only the key comparison tells them
+  // apart.
+  for (int i = 0; i < 100; i++) {
+    add("key" + std::to_string(i), 7);
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(i, find("key" + std::to_string(i), 7));
+  }
+
+  // Erasing in the middle of a probe sequence must not hide the keys
+  // after it.
+  EXPECT_TRUE(table_.erase(7, 50));
+  EXPECT_EQ(-1, find("key50", 7));
+  EXPECT_EQ(99, find("key99", 7));
+
+  // Deleted slots are reused.
+  int id = add("key50", 7);
+  EXPECT_EQ(id, find("key50", 7));
+  EXPECT_EQ(100, table_.size());
+}
+
+TEST_F(FlatKeyTableTest, ChurnAndSwap) {
+  table_.reserve(100);
+
+  // Repeated inserts and deletes of the same number of keys should
+  // clean up the deleted slots instead of growing forever.
+  for (int round = 0; round < 100; round++) {
+    for (int i = 0; i < 50; i++) {
+      int id = add("k" + std::to_string(round * 50 + i), round * 50 + i);
+      EXPECT_EQ(id, round * 50 + i);
+    }
+    for (int i = 0; i < 50; i++) {
+      EXPECT_TRUE(table_.erase(round * 50 + i, round * 50 + i));
+    }
+  }
+  EXPECT_EQ(0, table_.size());
+
+  add("last", 1);
+  FlatKeyTable other;
+  other.swap(table_);
+  EXPECT_EQ(0, table_.size());
+  EXPECT_EQ(1, other.size());
+  EXPECT_EQ(-1, find("last", 1));
+}
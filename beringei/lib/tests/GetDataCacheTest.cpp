@@ -0,0 +1,219 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/GetDataCache.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+using namespace std;
+
+static GetDataRequest makeRequest(const string& key, int64_t begin) {
+  GetDataRequest req;
+  req.keys.resize(1);
+  req.keys[0].key = key;
+  req.keys[0].shardId = 1;
+  req.begin = begin;
+  req.end = begin + 3600;
+  return req;
+}
+
+static void makeResult(GetDataResult& result, StatusCode status) {
+  result.results.resize(1);
+  result.results[0].status = status;
+  result.results[0].data.resize(1);
+  result.results[0].data[0].count = 1;
+  result.results[0].data[0].data = "data";
+}
+
+TEST(GetDataCacheTest, Fingerprint) {
+  auto fingerprint = GetDataCache::fingerprint(makeRequest("key", 100));
+  EXPECT_EQ(fingerprint, GetDataCache::fingerprint(makeRequest("key", 100)));
+  EXPECT_NE(fingerprint, GetDataCache::fingerprint(makeRequest("key", 101)));
+  EXPECT_NE(fingerprint, GetDataCache::fingerprint(makeRequest("key2", 100)));
+
+  auto req = makeRequest("key", 100);
+  req.keys[0].shardId = 2;
+  EXPECT_NE(fingerprint, GetDataCache::fingerprint(req));
+
+  req = makeRequest("key", 100);
+  req.aggregation.step = 60;
+  req.aggregation.function = AggregationFunction::SUM;
+  EXPECT_NE(fingerprint, GetDataCache::fingerprint(req));
+
+  req = makeRequest("key", 100);
+  req.ranges.resize(1);
+  req.ranges[0].begin = 100;
+  req.ranges[0].end = 3700;
+  auto withRanges = GetDataCache::fingerprint(req);
+  EXPECT_NE(fingerprint, withRanges);
+  req.ranges[0].begin = 0;
+  EXPECT_NE(withRanges, GetDataCache::fingerprint(req));
+}
+
+TEST(GetDataCacheTest, Hit) {
+  GetDataCache cache(1 << 20);
+  int computed = 0;
+  auto compute = [&](GetDataResult& result) {
+    computed++;
+    makeResult(result, StatusCode::OK);
+  };
+
+  for (int i = 0; i < 3; i++) {
+    GetDataResult result;
+    cache.get("a", 60000, result, compute);
+    ASSERT_EQ(1, result.results.size());
+    EXPECT_EQ("data", result.results[0].data[0].data);
+  }
+  EXPECT_EQ(1, computed);
+  EXPECT_GT(cache.getMemoryUsage(), 0);
+
+  GetDataResult result;
+  cache.get("b", 60000, result, compute);
+  EXPECT_EQ(2, computed);
+
+  cache.clear();
+  EXPECT_EQ(0, cache.getMemoryUsage());
+  cache.get("a", 60000, result, compute);
+  EXPECT_EQ(3, computed);
+}
+
+TEST(GetDataCacheTest, NotKept) {
+  GetDataCache cache(1 << 20);
+  int computed = 0;
+  StatusCode status = StatusCode::OK;
+  auto compute = [&](GetDataResult& result) {
+    computed++;
+    makeResult(result, status);
+  };
+
+  // Expired right away.
+  GetDataResult result;
+  cache.get("a", 0, result, compute);
+  cache.get("a", 0, result, compute);
+  EXPECT_EQ(2, computed);
+
+  status = StatusCode::SHARD_IN_PROGRESS;
+  cache.get("b", 60000, result, compute);
+  cache.get("b", 60000, result, compute);
+  EXPECT_EQ(4, computed);
+
+  status = StatusCode::KEY_MISSING;
+  cache.get("c", 60000, result, compute);
+  cache.get("c", 60000, result, compute);
+  EXPECT_EQ(5, computed);
+
+  // Too large for the cache.
+  GetDataCache small(10);
+  status = StatusCode::OK;
+  small.get("a", 60000, result, compute);
+  small.get("a", 60000, result, compute);
+  EXPECT_EQ(7, computed);
+  EXPECT_EQ(0, small.getMemoryUsage());
+}
+
+TEST(GetDataCacheTest, Expiry) {
+  GetDataCache cache(1 << 20);
+  int computed = 0;
+  auto compute = [&](GetDataResult& result) {
+    computed++;
+    makeResult(result, StatusCode::OK);
+  };
+
+  GetDataResult result;
+  cache.get("a", 50, result, compute);
+  cache.get("a", 50, result, compute);
+  EXPECT_EQ(1, computed);
+
+  this_thread::sleep_for(chrono::milliseconds(100));
+  cache.get("a", 50, result, compute);
+  EXPECT_EQ(2, computed);
+}
+
+TEST(GetDataCacheTest, Eviction) {
+  GetDataCache cache(1 << 20);
+  GetDataResult result;
+  cache.get("a", 60000, result, [](GetDataResult& r) {
+    makeResult(r, StatusCode::OK);
+  });
+  size_t entrySize = cache.getMemoryUsage();
+
+  GetDataCache small(2 * entrySize);
+  int computed = 0;
+  auto compute = [&](GetDataResult& r) {
+    computed++;
+    makeResult(r, StatusCode::OK);
+  };
+  small.get("a", 60000, result, compute);
+  small.get("b", 60000, result, compute);
+  small.get("a", 60000, result, compute);
+  EXPECT_EQ(2, computed);
+
+  // Evicts "b", which was used least recently.
+  small.get("c", 60000, result, compute);
+  small.get("a", 60000, result, compute);
+  EXPECT_EQ(3, computed);
+  small.get("b", 60000, result, compute);
+  EXPECT_EQ(4, computed);
+}
+
+TEST(GetDataCacheTest, Coalesce) {
+  GetDataCache cache(1 << 20);
+  atomic<int> computed(0);
+  atomic<bool> release(false);
+  auto compute = [&](GetDataResult& result) {
+    computed++;
+    while (!release) {
+      this_thread::yield();
+    }
+    makeResult(result, StatusCode::OK);
+  };
+
+  // Not kept, but still shared with the requests that are waiting.
+  vector<thread> threads;
+  vector<GetDataResult> results(8);
+  for (int i = 0; i < results.size(); i++) {
+    threads.emplace_back(
+        [&, i]() { cache.get("a", 0, results[i], compute); });
+  }
+
+  this_thread::sleep_for(chrono::milliseconds(100));
+  release = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(1, computed);
+  for (const auto& result : results) {
+    ASSERT_EQ(1, result.results.size());
+    EXPECT_EQ("data", result.results[0].data[0].data);
+  }
+  EXPECT_EQ(0, cache.getMemoryUsage());
+}
+
+TEST(GetDataCacheTest, Exception) {
+  GetDataCache cache(1 << 20);
+  GetDataResult result;
+  auto fail = [](GetDataResult&) { throw runtime_error("failed"); };
+  EXPECT_THROW(cache.get("a", 60000, result, fail), runtime_error);
+
+  // The failed request isn't kept.
+  int computed = 0;
+  cache.get("a", 60000, result, [&](GetDataResult& r) {
+    computed++;
+    makeResult(r, StatusCode::OK);
+  });
+  EXPECT_EQ(1, computed);
+}
@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "beringei/lib/GorillaStatsManager.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+DECLARE_int32(gorilla_stats_flush_interval_ms);
+
+namespace {
+class TestStatsManager : public GorillaStatsManager {
+ public:
+  // key -> {sum, samples}
+  static std::map<std::string, std::pair<int64_t, int64_t>> values;
+
+ protected:
+  void addStatValueInternal(const std::string& key, int64_t value) override {
+    addStatValueAggregatedInternal(key, value, 1);
+  }
+  void addStatValueInternal(
+      const std::string& key,
+      int64_t value,
+      GorillaStatsExportType /*type*/) override {
+    addStatValueAggregatedInternal(key, value, 1);
+  }
+  void setCounterInternal(const std::string&, int64_t) override {}
+  void incrementCounterInternal(const std::string&, int64_t) override {}
+  void addStatValueAggregatedInternal(
+      const std::string& key,
+      int64_t sum,
+      int64_t numSamples) override {
+    values[key].first += sum;
+    values[key].second += numSamples;
+  }
+  void addStatExportTypeInternal(const std::string&, GorillaStatsExportType)
+      override {}
+  void addHistAndStatExportsInternal(
+      const std::string&,
+      const std::string&,
+      int64_t,
+      int64_t,
+      int64_t) override {}
+};
+
+std::map<std::string, std::pair<int64_t, int64_t>> TestStatsManager::values;
+}
+
+TEST(GorillaStatsManagerTest, PreRegisteredStats) {
+  // Flushed by hand.
+  FLAGS_gorilla_stats_flush_interval_ms = 0;
+  GorillaStatsManager::initialize(
+      "test", std::unique_ptr<GorillaStatsManager>(new TestStatsManager()));
+
+  GorillaStat stat("hot_path");
+  {
+    GorillaStat unused("unused");
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 20; i++) {
+      threads.emplace_back([&stat]() {
+        for (int j = 0; j < 1000; j++) {
+          stat.add(2);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    GorillaStatsManager::flushStats();
+  }
+
+  auto& values = TestStatsManager::values;
+  EXPECT_EQ(1, values.size());
+  EXPECT_EQ(40000, values["test.hot_path"].first);
+  EXPECT_EQ(20000, values["test.hot_path"].second);
+
+  // Only the values since the last flush are reported.
+  stat.add();
+  GorillaStatsManager::flushStats();
+  GorillaStatsManager::flushStats();
+  EXPECT_EQ(40001, values["test.hot_path"].first);
+  EXPECT_EQ(20001, values["test.hot_path"].second);
+
+  GorillaStatsManager::initialize("", nullptr);
+}
@@ -0,0 +1,55 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/CaseUtils.h"
+#include "beringei/lib/KeyFilter.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+using namespace std;
+
+TEST(KeyFilterTest, NoFalseNegatives) {
+  KeyFilter filter(10000);
+  for (int i = 0; i < 10000; i++) {
+    filter.add(CaseHash()(("key" + to_string(i)).c_str()));
+  }
+  EXPECT_FALSE(filter.full());
+
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_TRUE(filter.mayContain(CaseHash()(("key" + to_string(i)).c_str())));
+    ASSERT_TRUE(filter.mayContain(CaseHash()(("KEY" + to_string(i)).c_str())));
+  }
+
+  int falsePositives = 0;
+  for (int i = 0; i < 10000; i++) {
+    if (filter.mayContain(CaseHash()(("other" + to_string(i)).c_str()))) {
+      falsePositives++;
+    }
+  }
+  EXPECT_LT(falsePositives, 300);
+}
+
+TEST(KeyFilterTest, Full) {
+  KeyFilter empty(0);
+  EXPECT_FALSE(empty.mayContain(CaseHash()("key")));
+  empty.add(CaseHash()("key"));
+  EXPECT_TRUE(empty.mayContain(CaseHash()("key")));
+  EXPECT_TRUE(empty.full());
+
+  KeyFilter filter(10);
+  for (int i = 0; i < 20; i++) {
+    filter.add(i);
+  }
+  EXPECT_FALSE(filter.full());
+  filter.add(20);
+  EXPECT_TRUE(filter.full());
+}
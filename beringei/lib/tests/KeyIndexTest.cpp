@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/KeyIndex.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+static KeyIndex::Item makeItem(const std::string& key) {
+  auto item = std::make_shared<std::pair<std::string, BucketedTimeSeries>>();
+  item->first = key;
+  return item;
+}
+
+static std::vector<std::string> find(
+    const KeyIndex& index,
+    const std::string& pattern,
+    const std::string& after = "",
+    int limit = 100,
+    bool* more = nullptr) {
+  std::vector<KeyIndex::Item> items;
+  bool hasMore = index.find(pattern, after, limit, items);
+  if (more) {
+    *more = hasMore;
+  }
+
+  std::vector<std::string> keys;
+  for (const auto& item : items) {
+    keys.push_back(item->first);
+  }
+  return keys;
+}
+
+TEST(KeyIndexTest, Matches) {
+  EXPECT_TRUE(KeyIndex::matches("foo", "foo"));
+  EXPECT_TRUE(KeyIndex::matches("FOO", "foo"));
+  EXPECT_FALSE(KeyIndex::matches("foo", "foo1"));
+  EXPECT_TRUE(KeyIndex::matches("foo*", "foo"));
+  EXPECT_TRUE(KeyIndex::matches("foo*", "foo.bar"));
+  EXPECT_TRUE(KeyIndex::matches("*.bar", "foo.bar"));
+  EXPECT_FALSE(KeyIndex::matches("*.bar", "foo.baz"));
+  EXPECT_TRUE(KeyIndex::matches("f?o.*.baz", "fOo.bar.BAZ"));
+  EXPECT_FALSE(KeyIndex::matches("f?o", "fo"));
+  EXPECT_TRUE(KeyIndex::matches("*a*b*", "xxaxxbxx"));
+  EXPECT_FALSE(KeyIndex::matches("*a*b*", "xxbxxaxx"));
+  EXPECT_TRUE(KeyIndex::matches("**", ""));
+}
+
+TEST(KeyIndexTest, InsertAndErase) {
+  KeyIndex index;
+  auto item = makeItem("Foo.bar");
+  EXPECT_TRUE(index.insert(item));
+  EXPECT_FALSE(index.insert(makeItem("foo.BAR")));
+  EXPECT_EQ(1, index.size());
+
+  // Only the same time series is erased.
+  EXPECT_FALSE(index.erase(makeItem("foo.bar")));
+  EXPECT_TRUE(index.erase(item));
+  EXPECT_FALSE(index.erase(item));
+  EXPECT_EQ(0, index.size());
+}
+
+TEST(KeyIndexTest, Find) {
+  KeyIndex index;
+  index.insertBatch(
+      {makeItem("b.2"),
+       makeItem("a.1"),
+       nullptr,
+       makeItem("B.1"),
+       makeItem("b.10"),
+       makeItem("c.1")});
+
+  EXPECT_EQ(std::vector<std::string>({"B.1", "b.10"}), find(index, "b.1*"));
+  EXPECT_EQ(std::vector<std::string>({"b.2"}), find(index, "B.2"));
+  EXPECT_EQ(std::vector<std::string>(), find(index, "b."));
+  EXPECT_EQ(
+      std::vector<std::string>({"a.1", "B.1", "c.1"}), find(index, "*.1"));
+
+  bool more = false;
+  EXPECT_EQ(
+      std::vector<std::string>({"B.1", "b.10"}),
+      find(index, "b*", "", 2, &more));
+  EXPECT_TRUE(more);
+  EXPECT_EQ(
+      std::vector<std::string>({"b.2"}), find(index, "b*", "b.10", 2, &more));
+  EXPECT_FALSE(more);
+
+  // Keys before the prefix are skipped even if `after` is before them.
+  EXPECT_EQ(std::vector<std::string>({"c.1"}), find(index, "c*", "a.1"));
+
+  KeyIndex other;
+  other.swap(index);
+  EXPECT_EQ(0, index.size());
+  EXPECT_EQ(5, other.size());
+}
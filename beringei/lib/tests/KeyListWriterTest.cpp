@@ -141,3 +141,58 @@ TEST_F(KeyListWriterTest, CompactMore) {
 
   ASSERT_EQ(keys, keys2);
 }
+
+TEST_F(KeyListWriterTest, ShardsOnSeveralThreads) {
+  const int kShards = 5;
+  for (int shard = 1; shard < kShards; shard++) {
+    FileUtils files(321 + shard, "", dir_->dirname());
+    files.createDirectories();
+  }
+
+  KeyListWriter keyWriter(dir_->dirname(), 100, 3);
+  ASSERT_EQ(keyWriter.thread(321), keyWriter.thread(324));
+  ASSERT_NE(keyWriter.thread(321), keyWriter.thread(322));
+
+  for (int shard = 0; shard < kShards; shard++) {
+    keyWriter.startShard(321 + shard);
+  }
+
+  // Interleave the keys of the shards so that every batch a thread
+  // dequeues has several groups.
+  for (int i = 0; i < 20; i++) {
+    for (int shard = 0; shard < kShards; shard++) {
+      keyWriter.addKey(321 + shard, i, "key" + to_string(i), shard, i);
+    }
+  }
+  ASSERT_TRUE(keyWriter.deleteKey(323, 7));
+  keyWriter.addKey(323, 7, "again", 0, 100);
+
+  for (int shard = 0; shard < kShards; shard++) {
+    keyWriter.stopShard(321 + shard);
+  }
+  keyWriter.flushQueue();
+
+  for (int shard = 0; shard < kShards; shard++) {
+    vector<std::tuple<uint32_t, string, uint16_t, int32_t>> keys;
+    PersistentKeyList::readKeys(
+        321 + shard,
+        dir_->dirname(),
+        [&](uint32_t id,
+            const char* key,
+            uint16_t category,
+            int32_t timestamp) {
+          keys.push_back(
+              make_tuple(id, key ? key : "<deleted>", category, timestamp));
+          return true;
+        });
+
+    ASSERT_EQ(shard == 2 ? 22 : 20, keys.size());
+    for (int i = 0; i < 20; i++) {
+      EXPECT_EQ(make_tuple(i, "key" + to_string(i), shard, i), keys[i]);
+    }
+    if (shard == 2) {
+      EXPECT_EQ(make_tuple(7, "<deleted>", 0, 0), keys[20]);
+      EXPECT_EQ(make_tuple(7, "again", 0, 100), keys[21]);
+    }
+  }
+}
@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "beringei/lib/LastUpdateTimes.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+TEST(LastUpdateTimesTest, UpdateAndReset) {
+  LastUpdateTimes times(10000);
+  EXPECT_EQ(0, times.get(0));
+  EXPECT_EQ(0, times.get(9999));
+
+  times.update(5000, 100);
+  EXPECT_EQ(100, times.get(5000));
+  EXPECT_EQ(0, times.get(5001));
+
+  // Times only move forward.
+  times.update(5000, 50);
+  EXPECT_EQ(100, times.get(5000));
+  times.update(5000, 200);
+  EXPECT_EQ(200, times.get(5000));
+
+  times.reset(5000);
+  EXPECT_EQ(0, times.get(5000));
+
+  times.update(1, 10);
+  times.update(9999, 20);
+  times.resetAll();
+  EXPECT_EQ(0, times.get(1));
+  EXPECT_EQ(0, times.get(9999));
+}
+
+TEST(LastUpdateTimesTest, RowsPastTheEnd) {
+  LastUpdateTimes times(10);
+
+  // The last chunk still covers a few rows past the end, but not more.
+  times.update(100000, 100);
+  EXPECT_EQ(0, times.get(100000));
+  times.reset(100000);
+}
+
+TEST(LastUpdateTimesTest, ConcurrentUpdates) {
+  LastUpdateTimes times(100000);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&times, t]() {
+      for (uint32_t i = 0; i < 100000; i++) {
+        times.update(i, i + t);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (uint32_t i = 0; i < 100000; i++) {
+    ASSERT_EQ(i + 3, times.get(i));
+  }
+}
@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/FileUtils.h"
+#include "beringei/lib/MemoryStats.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+static void writeFile(
+    const std::string& dir,
+    const std::string& name,
+    const std::string& contents) {
+  std::ofstream file(FileUtils::joinPaths(dir, name));
+  file << contents;
+}
+
+TEST(MemoryStatsTest, ReadCgroup) {
+  TemporaryDirectory dir("gorilla_memory");
+  writeFile(dir.dirname(), "memory.current", "1000000\n");
+  writeFile(dir.dirname(), "memory.max", "4000000\n");
+  writeFile(
+      dir.dirname(),
+      "memory.stat",
+      "anon 600000\nfile 400000\nactive_file 100000\n"
+      "inactive_file 300000\n");
+
+  MemoryStats stats;
+  ASSERT_TRUE(MemoryStats::readCgroup(dir.dirname(), stats));
+  EXPECT_EQ(700000, stats.usedBytes);
+  EXPECT_EQ(300000, stats.reclaimableBytes);
+  EXPECT_EQ(4000000, stats.limitBytes);
+
+  writeFile(dir.dirname(), "memory.max", "max\n");
+  ASSERT_TRUE(MemoryStats::read(dir.dirname(), stats));
+  EXPECT_EQ(0, stats.limitBytes);
+}
+
+TEST(MemoryStatsTest, FallBackToRss) {
+  TemporaryDirectory dir("gorilla_memory");
+  MemoryStats stats;
+  EXPECT_FALSE(MemoryStats::readCgroup(dir.dirname(), stats));
+  ASSERT_TRUE(MemoryStats::read(dir.dirname(), stats));
+  EXPECT_GT(stats.usedBytes, 0);
+  EXPECT_EQ(0, stats.limitBytes);
+}
+
+TEST(MemoryStatsTest, FindCgroupDirectory) {
+  TemporaryDirectory dir("gorilla_memory");
+  auto file = FileUtils::joinPaths(dir.dirname(), "cgroup");
+  writeFile(
+      dir.dirname(), "cgroup", "1:name=systemd:/init.scope\n0::/a/b.slice\n");
+  EXPECT_EQ("/cg/a/b.slice", MemoryStats::findCgroupDirectory(file, "/cg"));
+
+  writeFile(dir.dirname(), "cgroup", "0::/\n");
+  EXPECT_EQ("/cg", MemoryStats::findCgroupDirectory(file, "/cg"));
+
+  writeFile(dir.dirname(), "cgroup", "4:memory:/a\n");
+  EXPECT_EQ("", MemoryStats::findCgroupDirectory(file, "/cg"));
+}
+
+TEST(MemoryStatsTest, Pressure) {
+  EXPECT_EQ(MemoryUsageGuardIf::NONE, MemoryStats::pressure(50, 90, 100, 1.1));
+  EXPECT_EQ(
+      MemoryUsageGuardIf::SLOW_NEW_KEYS,
+      MemoryStats::pressure(50, 100, 100, 1.1));
+  EXPECT_EQ(
+      MemoryUsageGuardIf::BLOCK_NEW_KEYS,
+      MemoryStats::pressure(100, 100, 100, 1.1));
+  EXPECT_EQ(
+      MemoryUsageGuardIf::EVICT_BUCKETS,
+      MemoryStats::pressure(120, 100, 100, 1.1));
+  EXPECT_EQ(MemoryUsageGuardIf::NONE, MemoryStats::pressure(110, 200, 0, 1.1));
+}
+
+TEST(MemoryStatsTest, GrowthEstimator) {
+  MemoryGrowthEstimator estimator(0.5);
+  estimator.add(0, 1000);
+  EXPECT_EQ(1000, estimator.predict(100));
+
+  estimator.add(10, 2000);
+  EXPECT_DOUBLE_EQ(50, estimator.getGrowthRate());
+  EXPECT_EQ(2000 + 50 * 60, estimator.predict(60));
+  EXPECT_EQ(2000 + 50 * 60 + 500, estimator.predict(60, 500));
+
+  // Shrinking never predicts less than now.
+  estimator.add(20, 0);
+  EXPECT_DOUBLE_EQ(-75, estimator.getGrowthRate());
+  EXPECT_EQ(0, estimator.predict(60));
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include "beringei/lib/FileUtils.h"
+#include "beringei/lib/NumaTopology.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+static void
+writeNode(const std::string& dir, int node, const std::string& cpus) {
+  std::string nodeDir =
+      FileUtils::joinPaths(dir, "node" + std::to_string(node));
+  boost::filesystem::create_directories(nodeDir);
+  std::ofstream file(FileUtils::joinPaths(nodeDir, "cpulist"));
+  file << cpus << "\n";
+}
+
+TEST(NumaTopologyTest, ParseCpuList) {
+  EXPECT_EQ(
+      std::vector<int>({0, 1, 2, 3, 8, 10, 11}),
+      NumaTopology::parseCpuList("0-3,8,10-11"));
+  EXPECT_EQ(std::vector<int>({5}), NumaTopology::parseCpuList("5"));
+  EXPECT_TRUE(NumaTopology::parseCpuList("").empty());
+  EXPECT_TRUE(NumaTopology::parseCpuList("1-x").empty());
+}
+
+TEST(NumaTopologyTest, ReadNodes) {
+  TemporaryDirectory dir("gorilla_numa");
+  writeNode(dir.dirname(), 1, "4-7");
+  writeNode(dir.dirname(), 0, "0-3");
+
+  // Nodes without CPUs are skipped.
+  writeNode(dir.dirname(), 2, "");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "power"));
+
+  NumaTopology numa(dir.dirname());
+  ASSERT_EQ(2, numa.numNodes());
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3}), numa.getCpus(0));
+  EXPECT_EQ(std::vector<int>({4, 5, 6, 7}), numa.getCpus(1));
+  EXPECT_EQ(1, numa.getNode(5));
+  EXPECT_EQ(0, numa.getNode(6));
+}
+
+TEST(NumaTopologyTest, NoNodes) {
+  TemporaryDirectory dir("gorilla_numa");
+  NumaTopology numa(FileUtils::joinPaths(dir.dirname(), "missing"));
+  ASSERT_EQ(1, numa.numNodes());
+  EXPECT_TRUE(numa.getCpus(0).empty());
+  EXPECT_EQ(0, numa.getNode(3));
+  EXPECT_FALSE(numa.bindThread(pthread_self(), 0));
+
+  // Binding to the single node does nothing.
+  NumaTopology::ScopedBinding binding(&numa, 3);
+}
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+
+#include "beringei/lib/PartialAggregate.h"
+#include "beringei/lib/TimeSeries.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static const double kNaN = numeric_limits<double>::quiet_NaN();
+
+TEST(PartialAggregateTest, MergeMatchesReduce) {
+  // Windows of five keys, split between two hosts. The last key wasn't
+  // found and the third one is shorter.
+  vector<vector<double>> windows = {
+      {1, kNaN, 3, 4},
+      {5, 6, kNaN, kNaN},
+      {-2, 8},
+      {kNaN, 1, 7, 2},
+      {},
+  };
+
+  for (auto type : {AggregationType::SUM,
+                    AggregationType::MIN,
+                    AggregationType::MAX,
+                    AggregationType::COUNT,
+                    AggregationType::AVG,
+                    AggregationType::LAST}) {
+    vector<TimeSeriesBlock> blocks;
+    Aggregation::reduce(type, 100, 60, windows, blocks);
+    ASSERT_EQ(1, blocks.size());
+    vector<TimeValuePair> expected;
+    TimeSeries::getValues(blocks[0], expected, 0, 1000);
+
+    PartialAggregate first(type);
+    PartialAggregate second(type);
+    for (int i = 0; i < windows.size(); i++) {
+      (i < 2 ? first : second).add(windows[i]);
+    }
+
+    PartialAggregate merged(type);
+    merged.merge(first.values(), first.counts());
+    merged.merge(second.values(), second.counts());
+
+    vector<TimeValuePair> out;
+    merged.finish(100, 60, out);
+    ASSERT_EQ(expected.size(), out.size());
+    for (int i = 0; i < out.size(); i++) {
+      EXPECT_EQ(expected[i].unixTime, out[i].unixTime);
+      EXPECT_DOUBLE_EQ(expected[i].value, out[i].value);
+    }
+  }
+}
+
+TEST(PartialAggregateTest, Counts) {
+  PartialAggregate partial(AggregationType::AVG);
+  partial.add({kNaN, 2, 4});
+  partial.add({kNaN, kNaN, 8});
+
+  ASSERT_EQ(3, partial.counts().size());
+  EXPECT_EQ(0, partial.counts()[0]);
+  EXPECT_EQ(1, partial.counts()[1]);
+  EXPECT_EQ(2, partial.counts()[2]);
+  EXPECT_TRUE(std::isnan(partial.values()[0]));
+  EXPECT_EQ(12, partial.values()[2]);
+
+  vector<TimeValuePair> out;
+  partial.finish(0, 10, out);
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(10, out[0].unixTime);
+  EXPECT_EQ(2, out[0].value);
+  EXPECT_EQ(20, out[1].unixTime);
+  EXPECT_EQ(6, out[1].value);
+
+  PartialAggregate empty(AggregationType::SUM);
+  empty.finish(0, 10, out);
+  EXPECT_TRUE(out.empty());
+}
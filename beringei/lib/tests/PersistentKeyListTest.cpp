@@ -16,6 +16,9 @@ using namespace facebook;
 using namespace facebook::gorilla;
 using namespace std;
 
+DECLARE_bool(binary_key_lists);
+DECLARE_bool(key_list_dictionary_compression);
+
 TEST(PersistentKeyListTest, writeAndRead) {
   TemporaryDirectory dir("gorilla_test");
   boost::filesystem::create_directories(
@@ -155,3 +158,130 @@ TEST(PersistentKeyListTest, NoTimestampFiles) {
   EXPECT_EQ(1, categories[0]);
   EXPECT_EQ(2, categories[1]);
 }
+
+TEST(PersistentKeyListTest, BinaryFormat) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "9"));
+  PersistentKeyList keys(9, dir.dirname());
+  keys.clearEntireListForTests();
+
+  vector<tuple<uint32_t, string, uint16_t, int32_t>> in = {
+      make_tuple(3, "cpu.user.host1", 1, 17),
+      make_tuple(1, "cpu.user.host12", 2, 18),
+      make_tuple(4, "cpu.sys", 3, 19),
+      make_tuple(9, "", 4, 20),
+      make_tuple(2, "memory", 5, -1)};
+
+  FLAGS_binary_key_lists = true;
+  int i = 0;
+  keys.compact([&]() {
+    if (i < in.size()) {
+      auto& key = in[i++];
+      return make_tuple(
+          get<0>(key), get<1>(key).c_str(), get<2>(key), get<3>(key));
+    }
+    return make_tuple<uint32_t, const char*, uint16_t, int32_t>(
+        0, nullptr, 0, 0);
+  });
+  FLAGS_binary_key_lists = false;
+
+  // Appends after the compaction are in the old format.
+  keys.appendKey(8, "cpu.idle", 6, 21);
+  keys.flush(true);
+
+  vector<tuple<uint32_t, string, uint16_t, int32_t>> out;
+  auto readAll = [&]() {
+    out.clear();
+    return PersistentKeyList::readKeys(
+        9,
+        dir.dirname(),
+        [&](uint32_t id,
+            const char* key,
+            uint16_t category,
+            int32_t timestamp) {
+          out.push_back(make_tuple(id, key, category, timestamp));
+          return true;
+        });
+  };
+
+  ASSERT_EQ(6, readAll());
+  for (int j = 0; j < in.size(); j++) {
+    EXPECT_EQ(in[j], out[j]);
+  }
+  EXPECT_EQ(make_tuple(8, "cpu.idle", 6, 21), out[5]);
+
+  // A truncated binary file is skipped.
+  FileUtils files(9, "key_list", dir.dirname());
+  auto ids = files.ls();
+  ASSERT_EQ(2, ids.size());
+  string data;
+  ASSERT_TRUE(files.read(ids[0], data));
+  FILE* f = files.open(ids[0], "wb", 0).file;
+  fwrite(data.data(), sizeof(char), data.size() - 1, f);
+  fclose(f);
+
+  ASSERT_EQ(1, readAll());
+  EXPECT_EQ(make_tuple(8, "cpu.idle", 6, 21), out[0]);
+}
+
+TEST(PersistentKeyListTest, DictionaryCompression) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "9"));
+
+  for (int numKeys : {3, 20000}) {
+    PersistentKeyList keys(9, dir.dirname());
+    keys.clearEntireListForTests();
+
+    vector<tuple<uint32_t, string, uint16_t, int32_t>> in;
+    for (int i = 0; i < numKeys; i++) {
+      in.push_back(make_tuple(
+          i,
+          "host" + to_string(i % 97) + ".region" + to_string(i % 5) +
+              ".service.metric" + to_string(i % 37) + ".p" + to_string(i),
+          i % 7,
+          1000 + i));
+    }
+
+    FLAGS_key_list_dictionary_compression = true;
+    int i = 0;
+    keys.compact([&]() {
+      if (i < in.size()) {
+        auto& key = in[i++];
+        return make_tuple(
+            get<0>(key), get<1>(key).c_str(), get<2>(key), get<3>(key));
+      }
+      return make_tuple<uint32_t, const char*, uint16_t, int32_t>(
+          0, nullptr, 0, 0);
+    });
+    FLAGS_key_list_dictionary_compression = false;
+
+    FileUtils files(9, "key_list", dir.dirname());
+    auto ids = files.ls();
+    ASSERT_EQ(2, ids.size());
+    string data;
+    ASSERT_TRUE(files.read(ids[0], data));
+    ASSERT_EQ('D', data[0]);
+
+    // Too few keys to train a dictionary on.
+    uint32_t dictionaryLength;
+    memcpy(&dictionaryLength, data.data() + 1, sizeof(dictionaryLength));
+    EXPECT_EQ(numKeys > 1000, dictionaryLength > 0);
+
+    vector<tuple<uint32_t, string, uint16_t, int32_t>> out;
+    ASSERT_EQ(
+        numKeys,
+        PersistentKeyList::readKeys(
+            9,
+            dir.dirname(),
+            [&](uint32_t id,
+                const char* key,
+                uint16_t category,
+                int32_t timestamp) {
+              out.push_back(make_tuple(id, key, category, timestamp));
+              return true;
+            }));
+    EXPECT_EQ(in, out);
+  }
+}
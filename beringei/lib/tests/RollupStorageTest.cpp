@@ -0,0 +1,133 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+#include <cmath>
+
+#include "beringei/lib/FileUtils.h"
+#include "beringei/lib/RollupStorage.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+static std::vector<TimeValuePair> makePoints(int64_t begin, int n) {
+  std::vector<TimeValuePair> points(n);
+  for (int i = 0; i < n; i++) {
+    points[i].unixTime = begin + i * 60;
+    points[i].value = i % 7;
+  }
+  return points;
+}
+
+TEST(RollupStorageTest, Summarize) {
+  std::vector<RollupStorage::Window> windows;
+  RollupStorage::summarize(makePoints(3000, 20), 300, windows);
+
+  // 3000, 3060, ..., 4140 falls into 4 windows of 300 seconds.
+  ASSERT_EQ(4, windows.size());
+  EXPECT_EQ(3000, windows[0].unixTime);
+  EXPECT_EQ(5, windows[0].count);
+  EXPECT_EQ(0, windows[0].min);
+  EXPECT_EQ(4, windows[0].max);
+  EXPECT_EQ(0 + 1 + 2 + 3 + 4, windows[0].sum);
+  EXPECT_EQ(3900, windows[3].unixTime);
+  EXPECT_EQ(5, windows[3].count);
+  EXPECT_EQ(1, windows[3].min);
+  EXPECT_EQ(5, windows[3].max);
+  EXPECT_EQ(1 + 2 + 3 + 4 + 5, windows[3].sum);
+}
+
+TEST(RollupStorageTest, EncodeAndDecode) {
+  std::vector<RollupStorage::Window> windows;
+  RollupStorage::summarize(makePoints(3000, 1000), 300, windows);
+
+  std::string data;
+  RollupStorage::encode(windows, data);
+  std::vector<RollupStorage::Window> decoded;
+  ASSERT_TRUE(RollupStorage::decode(data, windows.size(), decoded));
+  ASSERT_EQ(windows.size(), decoded.size());
+  for (int i = 0; i < windows.size(); i++) {
+    EXPECT_EQ(windows[i].unixTime, decoded[i].unixTime);
+    EXPECT_EQ(windows[i].min, decoded[i].min);
+    EXPECT_EQ(windows[i].max, decoded[i].max);
+    EXPECT_EQ(windows[i].sum, decoded[i].sum);
+    EXPECT_EQ(windows[i].count, decoded[i].count);
+  }
+
+  decoded.clear();
+  EXPECT_FALSE(RollupStorage::decode(
+      folly::StringPiece(data.data(), data.size() - 1),
+      windows.size(),
+      decoded));
+}
+
+TEST(RollupStorageTest, Value) {
+  RollupStorage::Window window = RollupStorage::emptyWindow(0);
+  EXPECT_EQ(0, RollupStorage::value(window, AggregationType::COUNT));
+  EXPECT_TRUE(std::isnan(RollupStorage::value(window, AggregationType::SUM)));
+
+  RollupStorage::merge(RollupStorage::Window{0, 2, 5, 7, 2}, window);
+  RollupStorage::merge(RollupStorage::Window{0, 1, 3, 4, 3}, window);
+  EXPECT_EQ(11, RollupStorage::value(window, AggregationType::SUM));
+  EXPECT_EQ(1, RollupStorage::value(window, AggregationType::MIN));
+  EXPECT_EQ(5, RollupStorage::value(window, AggregationType::MAX));
+  EXPECT_EQ(5, RollupStorage::value(window, AggregationType::COUNT));
+  EXPECT_DOUBLE_EQ(2.2, RollupStorage::value(window, AggregationType::AVG));
+  EXPECT_TRUE(std::isnan(RollupStorage::value(window, AggregationType::LAST)));
+}
+
+TEST(RollupStorageTest, AddAndReadBack) {
+  TemporaryDirectory dir("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir.dirname(), "rollup_300/7"));
+
+  std::vector<RollupStorage::Window> expected;
+  {
+    RollupStorage rollup(300, 3, 7, dir.dirname());
+    rollup.enable();
+    for (uint32_t position = 10; position < 14; position++) {
+      auto points = makePoints(position * 7200, 120);
+      rollup.add(0, position, points);
+      rollup.add(3, position, points);
+      rollup.finalizeBucket(position);
+    }
+    EXPECT_EQ(13, rollup.getNewestPosition());
+    EXPECT_EQ(11, rollup.getOldestPosition());
+
+    rollup.get(3, 12, 13, expected);
+    ASSERT_EQ(48, expected.size());
+    EXPECT_EQ(12 * 7200, expected.front().unixTime);
+
+    std::vector<RollupStorage::Window> windows;
+    rollup.get(1, 10, 13, windows);
+    EXPECT_TRUE(windows.empty());
+
+    rollup.erase(3);
+    rollup.get(3, 12, 13, windows);
+    EXPECT_TRUE(windows.empty());
+  }
+
+  // Only the positions that still fit in the storage are read back.
+  RollupStorage rollup(300, 3, 7, dir.dirname());
+  rollup.enable();
+  EXPECT_EQ(3, rollup.readBlockFiles());
+  EXPECT_EQ(13, rollup.getNewestPosition());
+  EXPECT_EQ(11, rollup.getOldestPosition());
+
+  std::vector<RollupStorage::Window> windows;
+  rollup.get(3, 12, 13, windows);
+  ASSERT_EQ(expected.size(), windows.size());
+  for (int i = 0; i < windows.size(); i++) {
+    EXPECT_EQ(expected[i].unixTime, windows[i].unixTime);
+    EXPECT_EQ(expected[i].sum, windows[i].sum);
+  }
+
+  rollup.clearAndDisable();
+  EXPECT_EQ(0, rollup.getNewestPosition());
+}
@@ -0,0 +1,149 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include <folly/FileUtil.h>
+
+#include "beringei/lib/BucketMap.h"
+#include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/ShardArchive.h"
+#include "beringei/lib/TimeSeries.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+
+DECLARE_bool(gorilla_async_file_close);
+
+const int64_t kShardId = 12;
+const int64_t kWindowSize = 4 * kGorillaSecondsPerHour;
+
+class ShardArchiveTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    FLAGS_gorilla_async_file_close = false;
+  }
+};
+
+TEST_F(ShardArchiveTest, DumpAndRestore) {
+  TemporaryDirectory from("gorilla_test");
+  TemporaryDirectory to("gorilla_test");
+  TemporaryDirectory archives("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(from.dirname(), std::to_string(kShardId)));
+
+  auto logWriter =
+      std::make_shared<BucketLogWriter>(kWindowSize, from.dirname(), 100, 0);
+  logWriter->startShard(kShardId);
+  uint32_t openBucket;
+  {
+    auto keyWriter = std::make_shared<KeyListWriter>(from.dirname(), 100);
+    keyWriter->startShard(kShardId);
+    BucketMap map(
+        6,
+        kWindowSize,
+        kShardId,
+        from.dirname(),
+        keyWriter,
+        logWriter,
+        BucketMap::OWNED,
+        std::make_shared<LocalLogReaderFactory>(from.dirname()));
+
+    openBucket = map.bucket(time(nullptr));
+    TimeValuePair tv;
+    for (int i = 0; i < 10; i++) {
+      tv.unixTime = map.timestamp(openBucket - 1);
+      tv.value = i;
+      map.put("key" + std::to_string(i), tv, 0);
+    }
+    ASSERT_EQ(1, map.finalizeBuckets(openBucket - 1));
+    keyWriter->stopShard(kShardId);
+    keyWriter->flushQueue();
+  }
+  logWriter->stopShard(kShardId);
+  logWriter->flushQueue();
+
+  std::string archive = FileUtils::joinPaths(archives.dirname(), "12.shard");
+  ASSERT_TRUE(ShardArchive::dump(kShardId, from.dirname(), archive, false));
+
+  int64_t shardId = 0;
+  ASSERT_TRUE(ShardArchive::restore(archive, to.dirname(), shardId));
+  ASSERT_EQ(kShardId, shardId);
+
+  // The logs weren't archived.
+  FileUtils logs(kShardId, BucketLogWriter::kLogFilePrefix, to.dirname());
+  ASSERT_TRUE(logs.ls().empty());
+
+  auto keyWriter = std::make_shared<KeyListWriter>(to.dirname(), 100);
+  auto toLogWriter =
+      std::make_shared<BucketLogWriter>(kWindowSize, to.dirname(), 100, 0);
+  BucketMap map(
+      6,
+      kWindowSize,
+      kShardId,
+      to.dirname(),
+      keyWriter,
+      toLogWriter,
+      BucketMap::UNOWNED,
+      std::make_shared<LocalLogReaderFactory>(to.dirname()));
+  ASSERT_TRUE(map.setState(BucketMap::PRE_OWNED));
+  map.readKeyList();
+  map.readData();
+  while (map.readBlockFiles()) {
+  }
+  ASSERT_EQ(BucketMap::OWNED, map.getState());
+
+  for (int i = 0; i < 10; i++) {
+    auto item = map.get("key" + std::to_string(i));
+    ASSERT_NE(nullptr, item.get());
+
+    BucketedTimeSeries::Output out;
+    item->second.get(openBucket - 1, openBucket, out, map.getStorage());
+    std::vector<TimeValuePair> values;
+    TimeSeries::getValues(out, values, 0, map.timestamp(openBucket + 1));
+    ASSERT_EQ(1, values.size());
+    EXPECT_EQ(i, values[0].value);
+  }
+}
+
+TEST_F(ShardArchiveTest, RejectsBadArchives) {
+  TemporaryDirectory dir("gorilla_test");
+  int64_t shardId;
+  std::string archive = FileUtils::joinPaths(dir.dirname(), "bad.shard");
+  ASSERT_FALSE(ShardArchive::restore(archive, dir.dirname(), shardId));
+  ASSERT_FALSE(ShardArchive::dump(kShardId, dir.dirname(), archive, true));
+
+  ASSERT_TRUE(folly::writeFile(std::string("not an archive"), archive.c_str()));
+  ASSERT_FALSE(ShardArchive::restore(archive, dir.dirname(), shardId));
+
+  // A truncated archive leaves no files behind.
+  FileUtils keys(kShardId, PersistentKeyList::kFilePrefix, dir.dirname());
+  keys.createDirectories();
+  auto f = keys.open(5, "wb", 0);
+  fputs("keys", f.file);
+  FileUtils::closeFile(f, false);
+
+  std::string good = FileUtils::joinPaths(dir.dirname(), "good.shard");
+  ASSERT_TRUE(ShardArchive::dump(kShardId, dir.dirname(), good, true));
+  std::string data;
+  ASSERT_TRUE(folly::readFile(good.c_str(), data));
+  data.resize(data.size() - 6);
+  ASSERT_TRUE(folly::writeFile(data, archive.c_str()));
+
+  TemporaryDirectory to("gorilla_test");
+  ASSERT_FALSE(ShardArchive::restore(archive, to.dirname(), shardId));
+  FileUtils restored(kShardId, PersistentKeyList::kFilePrefix, to.dirname());
+  ASSERT_TRUE(restored.ls().empty());
+
+  ASSERT_TRUE(ShardArchive::restore(good, to.dirname(), shardId));
+  ASSERT_EQ(kShardId, shardId);
+  ASSERT_TRUE(restored.read(5, data));
+  ASSERT_EQ("keys", data);
+}
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "beringei/lib/ShardExecutor.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+TEST(ShardExecutorTest, RunsShardsOnTheirThreads) {
+  ShardExecutor executor(3, 100);
+  ASSERT_EQ(3, executor.threads());
+  EXPECT_EQ(executor.thread(1), executor.thread(4));
+
+  std::vector<int64_t> shardIds = {1, 4, 2, 7, 0};
+  std::vector<std::thread::id> threads(shardIds.size());
+  std::vector<int> order;
+  executor.run(shardIds, [&](size_t i) {
+    threads[i] = std::this_thread::get_id();
+    if (executor.thread(shardIds[i]) == executor.thread(1)) {
+      order.push_back(i);
+    }
+  });
+
+  EXPECT_EQ(threads[0], threads[1]);
+  EXPECT_EQ(threads[0], threads[3]);
+  EXPECT_NE(threads[0], threads[2]);
+  EXPECT_NE(threads[0], threads[4]);
+  EXPECT_NE(std::this_thread::get_id(), threads[0]);
+  EXPECT_EQ(std::vector<int>({0, 1, 3}), order);
+
+  // Nothing to run returns right away.
+  int calls = 0;
+  executor.run({}, [&](size_t) { calls++; });
+  EXPECT_EQ(0, calls);
+}
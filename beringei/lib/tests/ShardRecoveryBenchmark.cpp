@@ -0,0 +1,234 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// Writes the files of a few shards like a server would and then times
+// loading them back, one stage at a time. Run it before and after a
+// change to the recovery path to see what it does to restart times.
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <folly/init/Init.h>
+#include <glog/logging.h>
+
+#include "beringei/lib/BucketLogWriter.h"
+#include "beringei/lib/BucketMap.h"
+#include "beringei/lib/BucketStorage.h"
+#include "beringei/lib/FileUtils.h"
+#include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/KeyListWriter.h"
+#include "beringei/lib/LogReader.h"
+#include "beringei/lib/PersistentKeyList.h"
+#include "beringei/lib/Timer.h"
+
+using namespace facebook::gorilla;
+
+DEFINE_int32(recovery_shards, 2, "Number of shards to write and load");
+DEFINE_int32(recovery_series, 20000, "Time series per shard");
+DEFINE_int32(
+    recovery_buckets,
+    5,
+    "Finalized buckets written to block files per shard. The points of "
+    "the open bucket are only in the logs.");
+DEFINE_int32(
+    recovery_point_interval_secs,
+    60,
+    "Seconds between two points of a time series");
+DEFINE_string(
+    recovery_data_directory,
+    "",
+    "Where to write the shards. A temporary directory if empty.");
+DEFINE_bool(
+    recovery_skip_write,
+    false,
+    "Load the shards already in --recovery_data_directory");
+
+namespace {
+
+const int kWindowSize = 2 * kGorillaSecondsPerHour;
+
+// One more bucket than the finalized ones for the open bucket.
+uint8_t numBuckets() {
+  return FLAGS_recovery_buckets + 1;
+}
+
+struct Writers {
+  explicit Writers(const std::string& dir)
+      : keyWriter(std::make_shared<KeyListWriter>(dir, 100000)),
+        logWriter(std::make_shared<BucketLogWriter>(
+            kWindowSize, dir, 1000000, kWindowSize / 2)) {}
+
+  std::shared_ptr<KeyListWriter> keyWriter;
+  std::shared_ptr<BucketLogWriter> logWriter;
+};
+
+std::unique_ptr<BucketMap> newMap(
+    int shardId,
+    const std::string& dir,
+    const Writers& writers) {
+  return std::make_unique<BucketMap>(
+      numBuckets(),
+      kWindowSize,
+      shardId,
+      dir,
+      writers.keyWriter,
+      writers.logWriter,
+      BucketMap::UNOWNED,
+      std::make_shared<LocalLogReaderFactory>(dir));
+}
+
+void writeShard(int shardId, const std::string& dir, Writers& writers) {
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(dir, std::to_string(shardId)));
+  auto map = newMap(shardId, dir, writers);
+  map->setState(BucketMap::PRE_OWNED);
+  map->setState(BucketMap::OWNED);
+
+  int64_t now = time(nullptr);
+  uint32_t current = map->bucket(now);
+  std::vector<DataPoint> data(FLAGS_recovery_series);
+  std::vector<uint32_t> points(data.size());
+  for (int i = 0; i < data.size(); i++) {
+    data[i].key.key = "recovery.shard" + std::to_string(shardId) +
+        ".host" + std::to_string(i % 1000) + ".metric" + std::to_string(i);
+    data[i].key.shardId = shardId;
+    data[i].categoryId = i % 4;
+    points[i] = i;
+  }
+
+  for (uint32_t b = current - FLAGS_recovery_buckets; b <= current; b++) {
+    for (int64_t t = map->timestamp(b);
+         t < map->timestamp(b + 1) && t <= now;
+         t += FLAGS_recovery_point_interval_secs) {
+      for (int i = 0; i < data.size(); i++) {
+        // Counters, gauges and constants.
+        data[i].value.unixTime = t;
+        data[i].value.value =
+            i % 3 == 0 ? t - map->timestamp(0) : i % 3 == 1 ? (t + i) % 97 : i;
+      }
+      map->putBatch(data, points, true);
+
+      // Keep the log writer from dropping points.
+      while (writers.logWriter->getQueueFill() > 0.5) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    if (b < current) {
+      map->finalizeBuckets(b);
+    }
+  }
+
+  writers.keyWriter->flushQueue();
+  writers.logWriter->flushQueue();
+}
+
+// Bytes in the files of the shard whose names start with `prefix`.
+uint64_t fileBytes(
+    int shardId,
+    const std::string& dir,
+    const std::string& prefix) {
+  uint64_t bytes = 0;
+  boost::filesystem::path path(
+      FileUtils::joinPaths(dir, std::to_string(shardId)));
+  for (boost::filesystem::directory_iterator it(path), end; it != end; ++it) {
+    if (it->path().filename().string().compare(0, prefix.size(), prefix) ==
+        0) {
+      bytes += boost::filesystem::file_size(it->path());
+    }
+  }
+  return bytes;
+}
+
+struct Stage {
+  const char* name;
+  uint64_t bytes = 0;
+  uint64_t items = 0;
+  const char* itemName;
+  Timer::TimeVal us = 0;
+
+  void report(int shards) const {
+    double seconds = std::max<double>(us, 1) / kGorillaUsecPerSecond;
+    LOG(INFO) << name << ": " << us / kGorillaUsecPerMs / shards
+              << " ms per shard, " << bytes / seconds / (1 << 20) << " MB/s, "
+              << items / seconds << " " << itemName << "/s";
+  }
+};
+} // namespace
+
+int main(int argc, char** argv) {
+  folly::init(&argc, &argv, true);
+
+  std::unique_ptr<TemporaryDirectory> tempDir;
+  std::string dir = FLAGS_recovery_data_directory;
+  if (dir.empty()) {
+    CHECK(!FLAGS_recovery_skip_write)
+        << "--recovery_skip_write needs --recovery_data_directory";
+    tempDir.reset(new TemporaryDirectory("gorilla_recovery"));
+    dir = tempDir->dirname();
+  }
+
+  if (!FLAGS_recovery_skip_write) {
+    Writers writers(dir);
+    for (int i = 0; i < FLAGS_recovery_shards; i++) {
+      Timer timer(true);
+      writeShard(i, dir, writers);
+      LOG(INFO) << "Wrote shard " << i << " in "
+                << timer.get() / kGorillaUsecPerMs << " ms";
+    }
+  }
+
+  // The points of the finalized buckets are in the block files and the
+  // ones of the open bucket only in the logs.
+  uint64_t pointsPerBucket =
+      (uint64_t)FLAGS_recovery_series * kWindowSize /
+      FLAGS_recovery_point_interval_secs;
+
+  Stage keys{"key lists"};
+  keys.itemName = "keys";
+  Stage logs{"logs"};
+  logs.itemName = "points";
+  Stage blocks{"block files"};
+  blocks.itemName = "points";
+
+  Writers writers(dir);
+  for (int i = 0; i < FLAGS_recovery_shards; i++) {
+    keys.bytes += fileBytes(i, dir, PersistentKeyList::kFilePrefix);
+    logs.bytes += fileBytes(i, dir, BucketLogWriter::kLogFilePrefix);
+    blocks.bytes += fileBytes(i, dir, BucketStorage::kDataPrefix);
+
+    auto map = newMap(i, dir, writers);
+    map->setState(BucketMap::PRE_OWNED);
+
+    Timer timer(true);
+    map->readKeyList();
+    keys.us += timer.reset();
+    keys.items += FLAGS_recovery_series;
+
+    map->readData();
+    logs.us += timer.reset();
+    int64_t now = time(nullptr);
+    logs.items += (uint64_t)FLAGS_recovery_series *
+        (now - map->timestamp(map->bucket(now))) /
+        FLAGS_recovery_point_interval_secs;
+
+    while (map->readBlockFiles()) {
+    }
+    blocks.us += timer.reset();
+    blocks.items += pointsPerBucket * FLAGS_recovery_buckets;
+    CHECK_EQ(BucketMap::OWNED, map->getState());
+  }
+
+  keys.report(FLAGS_recovery_shards);
+  logs.report(FLAGS_recovery_shards);
+  blocks.report(FLAGS_recovery_shards);
+  return 0;
+}
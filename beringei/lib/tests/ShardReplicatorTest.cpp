@@ -0,0 +1,152 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/ShardReplicator.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+using namespace std;
+
+namespace {
+struct Batch {
+  ShardReplicator::Host follower;
+  AppendKeysRequest keys;
+  LogDataPointsRequest points;
+};
+
+class FakeFollowers {
+ public:
+  ShardReplicator::Sender sender() {
+    return [this](
+               const ShardReplicator::Host& follower,
+               const AppendKeysRequest& keys,
+               const LogDataPointsRequest& points,
+               set<int64_t>& rejectedShards) {
+      if (down.count(follower) > 0) {
+        return false;
+      }
+      batches.push_back({follower, keys, points});
+      rejectedShards = rejected;
+      return true;
+    };
+  }
+
+  vector<Batch> batches;
+  set<ShardReplicator::Host> down;
+  set<int64_t> rejected;
+};
+}
+
+static const ShardReplicator::Host kFirst("first", 9999);
+static const ShardReplicator::Host kSecond("second", 9999);
+
+TEST(ShardReplicatorTest, KeysBeforePoints) {
+  FakeFollowers followers;
+  ShardReplicator replicator(4, 100, followers.sender());
+  replicator.setFollowers(1, {kFirst, kSecond});
+  replicator.setFollowers(2, {kFirst});
+
+  replicator.addPoint(1, 3, 100, 1.5);
+  replicator.addKey(1, 4, "a", 7, 90);
+  replicator.addPoints(2, {{5, 110, 2.5}, {6, 120, 3.5}});
+
+  // Shards without followers and invalid shards aren't replicated.
+  replicator.addPoint(0, 1, 100, 1);
+  replicator.addKey(3, 1, "b", 0, 100);
+  replicator.addPoint(4, 1, 100, 1);
+  EXPECT_EQ(4, replicator.getQueuedPoints());
+
+  EXPECT_EQ(4, replicator.flush());
+  EXPECT_EQ(0, replicator.getQueuedPoints());
+  ASSERT_EQ(2, followers.batches.size());
+
+  const Batch& first = followers.batches[0];
+  EXPECT_EQ(kFirst, first.follower);
+  ASSERT_EQ(1, first.keys.keys.size());
+  EXPECT_EQ(1, first.keys.keys[0].shardId);
+  EXPECT_EQ(4, first.keys.keys[0].keyId);
+  EXPECT_EQ("a", first.keys.keys[0].key);
+  EXPECT_EQ(7, first.keys.keys[0].categoryId);
+  EXPECT_EQ(90, first.keys.keys[0].creationTime);
+  ASSERT_EQ(3, first.points.points.size());
+  EXPECT_EQ(1, first.points.points[0].shardId);
+  EXPECT_EQ(3, first.points.points[0].keyId);
+  EXPECT_EQ(100, first.points.points[0].point.unixTime);
+  EXPECT_EQ(1.5, first.points.points[0].point.value);
+  EXPECT_EQ(2, first.points.points[2].shardId);
+  EXPECT_EQ(6, first.points.points[2].keyId);
+
+  const Batch& second = followers.batches[1];
+  EXPECT_EQ(kSecond, second.follower);
+  EXPECT_EQ(1, second.keys.keys.size());
+  ASSERT_EQ(1, second.points.points.size());
+  EXPECT_EQ(1, second.points.points[0].shardId);
+
+  // Nothing left to send.
+  EXPECT_EQ(0, replicator.flush());
+  EXPECT_EQ(2, followers.batches.size());
+}
+
+TEST(ShardReplicatorTest, Retries) {
+  FakeFollowers followers;
+  ShardReplicator replicator(4, 3, followers.sender());
+  replicator.setFollowers(1, {kFirst});
+  replicator.setFollowers(2, {kFirst});
+
+  followers.down.insert(kFirst);
+  replicator.addKey(1, 0, "a", 0, 100);
+  replicator.addPoints(1, {{0, 100, 1}, {0, 110, 2}});
+  EXPECT_EQ(0, replicator.flush());
+  EXPECT_TRUE(followers.batches.empty());
+
+  // The oldest points are dropped once the queue is full.
+  replicator.addPoints(1, {{0, 120, 3}, {0, 130, 4}});
+  replicator.addPoint(2, 1, 100, 5);
+  EXPECT_EQ(4, replicator.getQueuedPoints());
+
+  // Shard 2 isn't ready on the follower yet.
+  followers.down.clear();
+  followers.rejected = {2};
+  EXPECT_EQ(3, replicator.flush());
+  ASSERT_EQ(1, followers.batches.size());
+  ASSERT_EQ(1, followers.batches[0].keys.keys.size());
+  ASSERT_EQ(4, followers.batches[0].points.points.size());
+  EXPECT_EQ(110, followers.batches[0].points.points[0].point.unixTime);
+  EXPECT_EQ(130, followers.batches[0].points.points[2].point.unixTime);
+  EXPECT_EQ(1, replicator.getQueuedPoints());
+
+  followers.rejected.clear();
+  EXPECT_EQ(1, replicator.flush());
+  ASSERT_EQ(2, followers.batches.size());
+  ASSERT_EQ(1, followers.batches[1].points.points.size());
+  EXPECT_EQ(2, followers.batches[1].points.points[0].shardId);
+}
+
+TEST(ShardReplicatorTest, SetFollowers) {
+  FakeFollowers followers;
+  ShardReplicator replicator(4, 100, followers.sender());
+  replicator.setFollowers(1, {kFirst, kSecond});
+  replicator.addPoint(1, 0, 100, 1);
+
+  // The queue of the follower that stays is kept.
+  replicator.setFollowers(1, {kSecond});
+  EXPECT_EQ(
+      vector<ShardReplicator::Host>({kSecond}), replicator.getFollowers(1));
+  EXPECT_EQ(1, replicator.getQueuedPoints());
+
+  replicator.setFollowers(1, {});
+  EXPECT_TRUE(replicator.getFollowers(1).empty());
+  EXPECT_EQ(0, replicator.getQueuedPoints());
+  replicator.addPoint(1, 0, 110, 2);
+  EXPECT_EQ(0, replicator.flush());
+  EXPECT_TRUE(followers.batches.empty());
+}
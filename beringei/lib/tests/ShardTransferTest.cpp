@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/BucketMap.h"
+#include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/ShardTransfer.h"
+#include "beringei/lib/TimeSeries.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+
+DECLARE_bool(gorilla_async_file_close);
+
+const int64_t kShardId = 10;
+const int64_t kWindowSize = 4 * kGorillaSecondsPerHour;
+
+class ShardTransferTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    FLAGS_gorilla_async_file_close = false;
+  }
+
+  // Copies all the files of the shard in chunks of `chunkSize` bytes.
+  static void copy(
+      const std::string& from,
+      const std::string& to,
+      int64_t chunkSize) {
+    ShardTransfer source(kShardId, from);
+    ShardTransfer destination(kShardId, to);
+    auto files = source.listFiles(0);
+    for (const auto& file : files) {
+      int64_t offset = 0;
+      bool endOfFile = false;
+      while (!endOfFile) {
+        std::string data;
+        ASSERT_TRUE(
+            source.readFile(file, offset, chunkSize, data, endOfFile));
+        ASSERT_TRUE(destination.writeFile(file, offset, data));
+        offset += data.size();
+      }
+    }
+    destination.install(files);
+  }
+};
+
+TEST_F(ShardTransferTest, CopyShard) {
+  TemporaryDirectory from("gorilla_test");
+  TemporaryDirectory to("gorilla_test");
+  boost::filesystem::create_directories(
+      FileUtils::joinPaths(from.dirname(), "10"));
+
+  auto logWriter =
+      std::make_shared<BucketLogWriter>(kWindowSize, from.dirname(), 100, 0);
+  logWriter->startShard(kShardId);
+  uint32_t openBucket;
+  {
+    auto keyWriter = std::make_shared<KeyListWriter>(from.dirname(), 100);
+    keyWriter->startShard(kShardId);
+    BucketMap map(
+        6,
+        kWindowSize,
+        kShardId,
+        from.dirname(),
+        keyWriter,
+        logWriter,
+        BucketMap::OWNED,
+        std::make_shared<LocalLogReaderFactory>(from.dirname()));
+
+    openBucket = map.bucket(time(nullptr));
+    TimeValuePair tv;
+    for (int i = 0; i < 10; i++) {
+      tv.unixTime = map.timestamp(openBucket - 1);
+      tv.value = i;
+      map.put("key" + std::to_string(i), tv, 0);
+    }
+    ASSERT_EQ(1, map.finalizeBuckets(openBucket - 1));
+
+    for (int i = 0; i < 10; i++) {
+      tv.unixTime = map.timestamp(openBucket);
+      tv.value = i + 0.5;
+      map.put("key" + std::to_string(i), tv, 0);
+    }
+    logWriter->flushQueue();
+
+    // The previous owner is about to drop the shard.
+    ASSERT_TRUE(map.setState(BucketMap::PRE_UNOWNED));
+    ASSERT_TRUE(map.writeSnapshot());
+    keyWriter->stopShard(kShardId);
+    keyWriter->flushQueue();
+  }
+  logWriter->stopShard(kShardId);
+  logWriter->flushQueue();
+
+  // Files that were left from an earlier owner are replaced.
+  FileUtils oldLogs(kShardId, BucketLogWriter::kLogFilePrefix, to.dirname());
+  oldLogs.createDirectories();
+  FileUtils::File old = oldLogs.open(1, "wb", 0);
+  FileUtils::closeFile(old, false);
+
+  copy(from.dirname(), to.dirname(), 100);
+  for (int64_t id : oldLogs.ls()) {
+    ASSERT_NE(1, id);
+  }
+
+  auto keyWriter = std::make_shared<KeyListWriter>(to.dirname(), 100);
+  auto toLogWriter =
+      std::make_shared<BucketLogWriter>(kWindowSize, to.dirname(), 100, 0);
+  BucketMap map(
+      6,
+      kWindowSize,
+      kShardId,
+      to.dirname(),
+      keyWriter,
+      toLogWriter,
+      BucketMap::UNOWNED,
+      std::make_shared<LocalLogReaderFactory>(to.dirname()));
+  ASSERT_TRUE(map.setState(BucketMap::PRE_OWNED));
+  map.readKeyList();
+  map.readData();
+  while (map.readBlockFiles()) {
+  }
+  ASSERT_EQ(BucketMap::OWNED, map.getState());
+
+  for (int i = 0; i < 10; i++) {
+    auto item = map.get("key" + std::to_string(i));
+    ASSERT_NE(nullptr, item.get());
+
+    BucketedTimeSeries::Output out;
+    item->second.get(openBucket - 1, openBucket, out, map.getStorage());
+    std::vector<TimeValuePair> values;
+    TimeSeries::getValues(out, values, 0, map.timestamp(openBucket + 1));
+    ASSERT_EQ(2, values.size());
+    EXPECT_EQ(i, values[0].value);
+    EXPECT_EQ(i + 0.5, values[1].value);
+  }
+}
+
+TEST_F(ShardTransferTest, RejectsUnknownFiles) {
+  TemporaryDirectory dir("gorilla_test");
+  ShardTransfer transfer(kShardId, dir.dirname());
+  ASSERT_TRUE(transfer.listFiles(0).empty());
+
+  ShardTransfer::File file{"../../etc", 1};
+  std::string data;
+  bool endOfFile;
+  ASSERT_FALSE(transfer.readFile(file, 0, 0, data, endOfFile));
+  ASSERT_FALSE(transfer.writeFile(file, 0, "x"));
+
+  // Chunks have to be written in order.
+  file.prefix = BucketLogWriter::kLogFilePrefix;
+  ASSERT_TRUE(transfer.writeFile(file, 0, "abc"));
+  ASSERT_FALSE(transfer.writeFile(file, 5, "def"));
+  ASSERT_TRUE(transfer.writeFile(file, 3, "def"));
+  transfer.clear();
+}
@@ -0,0 +1,391 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <folly/Benchmark.h>
+#include <folly/init/Init.h>
+
+#include "beringei/lib/BitUtil.h"
+#include "beringei/lib/BucketStorage.h"
+#include "beringei/lib/BucketedTimeSeries.h"
+#include "beringei/lib/CaseUtils.h"
+#include "beringei/lib/DataLog.h"
+#include "beringei/lib/FileUtils.h"
+#include "beringei/lib/PersistentKeyList.h"
+#include "beringei/lib/TimeSeriesStream.h"
+
+using namespace facebook::gorilla;
+
+namespace {
+
+// Points in one 2h bucket of a series written every 60 seconds.
+const int kPointsPerBucket = 120;
+
+// Enough series to get out of the caches, like a real shard.
+const int kNumSeries = 10000;
+
+const int64_t kStartTime = 1500000000;
+
+enum Shape {
+  // Monotonic with a steady increment, like request counts.
+  COUNTER,
+  // Random walk with two decimals, like CPU usage.
+  GAUGE,
+  // The same value at every point. Common for health checks.
+  CONSTANT,
+  // A gauge written at 60s +- 3s instead of exactly every 60s.
+  JITTERED,
+};
+
+std::vector<TimeValuePair> generateSeries(Shape shape, int seed) {
+  std::mt19937_64 rng(seed);
+  std::vector<TimeValuePair> points(kPointsPerBucket);
+  int64_t unixTime = kStartTime;
+  double value = rng() % 1000;
+  for (auto& point : points) {
+    unixTime += shape == JITTERED ? 57 + rng() % 7 : 60;
+    switch (shape) {
+      case COUNTER:
+        value += 100 + rng() % 10;
+        break;
+      case GAUGE:
+      case JITTERED:
+        value = std::max(0.0, value + (double)((int)(rng() % 200) - 100) / 100);
+        break;
+      case CONSTANT:
+        break;
+    }
+    point.unixTime = unixTime;
+    point.value = value;
+  }
+  return points;
+}
+
+const std::vector<std::vector<TimeValuePair>>& series(Shape shape) {
+  static std::vector<std::vector<TimeValuePair>> kSeries[JITTERED + 1];
+  auto& out = kSeries[shape];
+  if (out.empty()) {
+    for (int i = 0; i < kNumSeries; i++) {
+      out.push_back(generateSeries(shape, i));
+    }
+  }
+  return out;
+}
+
+// The encoded bucket of each series.
+const std::vector<std::string>& blocks(Shape shape) {
+  static std::vector<std::string> kBlocks[JITTERED + 1];
+  auto& out = kBlocks[shape];
+  if (out.empty()) {
+    for (const auto& points : series(shape)) {
+      TimeSeriesStream stream;
+      for (const auto& point : points) {
+        stream.append(point, 0);
+      }
+      out.emplace_back();
+      stream.readData(out.back());
+    }
+  }
+  return out;
+}
+
+// Keys like "host123.service.metric_name.p99" with lengths between
+// about 20 and 100 bytes. Every fourth one has capitals.
+std::vector<std::string> generateKeys() {
+  std::mt19937_64 rng(1);
+  std::vector<std::string> keys;
+  for (int i = 0; i < kNumSeries; i++) {
+    std::string key = "host" + std::to_string(rng() % 5000) + ".service";
+    key += std::string(10 + rng() % 70, 'a' + rng() % 26);
+    key += i % 4 == 0 ? ".Count" : ".avg";
+    key += std::to_string(i);
+    keys.push_back(std::move(key));
+  }
+  return keys;
+}
+
+const std::vector<std::string>& keys() {
+  static const std::vector<std::string> kKeys = generateKeys();
+  return kKeys;
+}
+
+void streamAppend(size_t iters, Shape shape) {
+  const std::vector<std::vector<TimeValuePair>>* input;
+  BENCHMARK_SUSPEND {
+    input = &series(shape);
+  }
+  while (iters--) {
+    for (int i = 0; i < 100; i++) {
+      TimeSeriesStream stream;
+      for (const auto& point : (*input)[i]) {
+        stream.append(point, 0);
+      }
+      folly::doNotOptimizeAway(stream.size());
+    }
+  }
+}
+
+void streamReadValues(size_t iters, Shape shape) {
+  const std::vector<std::string>* input;
+  BENCHMARK_SUSPEND {
+    input = &blocks(shape);
+  }
+  std::vector<TimeValuePair> out;
+  out.reserve(kPointsPerBucket);
+  while (iters--) {
+    for (int i = 0; i < 100; i++) {
+      out.clear();
+      TimeSeriesStream::readValues(out, (*input)[i], kPointsPerBucket);
+      folly::doNotOptimizeAway(out.size());
+    }
+  }
+}
+
+void storageStore(size_t iters, Shape shape) {
+  const std::vector<std::string>* input;
+  BENCHMARK_SUSPEND {
+    input = &blocks(shape);
+  }
+  while (iters--) {
+    std::unique_ptr<BucketStorage> storage;
+    BENCHMARK_SUSPEND {
+      storage.reset(new BucketStorage(5, 0, ""));
+    }
+    for (int i = 0; i < input->size(); i++) {
+      const auto& block = (*input)[i];
+      folly::doNotOptimizeAway(
+          storage->store(1, block.data(), block.size(), kPointsPerBucket, i));
+    }
+    BENCHMARK_SUSPEND {
+      storage.reset();
+    }
+  }
+}
+
+void storageFetch(size_t iters, Shape shape) {
+  BucketStorage storage(5, 0, "");
+  std::vector<BucketStorage::BucketStorageId> ids;
+  BENCHMARK_SUSPEND {
+    const auto& input = blocks(shape);
+    for (int i = 0; i < input.size(); i++) {
+      ids.push_back(storage.store(
+          1, input[i].data(), input[i].size(), kPointsPerBucket, i));
+    }
+  }
+
+  std::string data;
+  uint32_t itemCount;
+  while (iters--) {
+    for (auto id : ids) {
+      storage.fetch(1, id, data, itemCount);
+      folly::doNotOptimizeAway(data.size());
+    }
+  }
+}
+
+void bucketedTimeSeriesPut(size_t iters, Shape shape) {
+  const std::vector<std::vector<TimeValuePair>>* input;
+  BENCHMARK_SUSPEND {
+    input = &series(shape);
+  }
+  while (iters--) {
+    std::unique_ptr<BucketStorage> storage;
+    std::vector<BucketedTimeSeries> timeSeries(100);
+    BENCHMARK_SUSPEND {
+      storage.reset(new BucketStorage(5, 0, ""));
+      for (auto& ts : timeSeries) {
+        ts.reset(5, 0, 0);
+      }
+    }
+    for (int i = 0; i < timeSeries.size(); i++) {
+      for (const auto& point : (*input)[i]) {
+        timeSeries[i].put(1, point, storage.get(), i, nullptr);
+      }
+    }
+  }
+}
+
+void bucketedTimeSeriesGet(size_t iters, Shape shape) {
+  BucketStorage storage(5, 0, "");
+  std::vector<BucketedTimeSeries> timeSeries(100);
+  BENCHMARK_SUSPEND {
+    const auto& input = series(shape);
+    for (int i = 0; i < timeSeries.size(); i++) {
+      timeSeries[i].reset(5, 0, 0);
+      // One finalized bucket and one active bucket.
+      for (const auto& point : input[i]) {
+        timeSeries[i].put(1, point, &storage, i, nullptr);
+      }
+      timeSeries[i].setCurrentBucket(2, &storage, i);
+      for (const auto& point : input[i + 1]) {
+        timeSeries[i].put(2, point, &storage, i, nullptr);
+      }
+    }
+  }
+
+  BucketedTimeSeries::Output out;
+  while (iters--) {
+    for (auto& ts : timeSeries) {
+      out.clear();
+      ts.get(0, 2, out, &storage);
+      folly::doNotOptimizeAway(out.size());
+    }
+  }
+}
+} // namespace
+
+BENCHMARK_NAMED_PARAM(streamAppend, counter, COUNTER);
+BENCHMARK_NAMED_PARAM(streamAppend, gauge, GAUGE);
+BENCHMARK_NAMED_PARAM(streamAppend, constant, CONSTANT);
+BENCHMARK_NAMED_PARAM(streamAppend, jittered, JITTERED);
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK_NAMED_PARAM(streamReadValues, counter, COUNTER);
+BENCHMARK_NAMED_PARAM(streamReadValues, gauge, GAUGE);
+BENCHMARK_NAMED_PARAM(streamReadValues, constant, CONSTANT);
+BENCHMARK_NAMED_PARAM(streamReadValues, jittered, JITTERED);
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(bitUtilReadValueFromBitString, iters) {
+  folly::fbstring bits;
+  uint32_t numBits = 0;
+  std::vector<uint32_t> sizes;
+  BENCHMARK_SUSPEND {
+    std::mt19937_64 rng(1);
+    for (int i = 0; i < 10000; i++) {
+      uint32_t size = 1 + rng() % 64;
+      BitUtil::addValueToBitString(rng(), size, bits, numBits);
+      sizes.push_back(size);
+    }
+  }
+
+  while (iters--) {
+    uint64_t bitPos = 0;
+    uint64_t sum = 0;
+    for (uint32_t size : sizes) {
+      sum += BitUtil::readValueFromBitString(bits, bitPos, size);
+    }
+    folly::doNotOptimizeAway(sum);
+  }
+}
+
+BENCHMARK(bitUtilFindTheFirstZeroBit, iters) {
+  folly::fbstring bits;
+  uint32_t numBits = 0;
+  BENCHMARK_SUSPEND {
+    // Control bit prefixes of 0 to 4 ones like the timestamp encoding.
+    std::mt19937_64 rng(1);
+    for (int i = 0; i < 10000; i++) {
+      uint32_t ones = rng() % 5;
+      BitUtil::addValueToBitString((1 << ones) - 1, ones + 1, bits, numBits);
+    }
+  }
+
+  while (iters--) {
+    uint64_t bitPos = 0;
+    uint64_t sum = 0;
+    for (int i = 0; i < 10000; i++) {
+      sum += BitUtil::findTheFirstZeroBit(bits, bitPos, 4);
+    }
+    folly::doNotOptimizeAway(sum);
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK_NAMED_PARAM(storageStore, gauge, GAUGE);
+BENCHMARK_NAMED_PARAM(storageStore, constant, CONSTANT);
+BENCHMARK_NAMED_PARAM(storageFetch, gauge, GAUGE);
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK_NAMED_PARAM(bucketedTimeSeriesPut, counter, COUNTER);
+BENCHMARK_NAMED_PARAM(bucketedTimeSeriesPut, jittered, JITTERED);
+BENCHMARK_NAMED_PARAM(bucketedTimeSeriesGet, counter, COUNTER);
+BENCHMARK_NAMED_PARAM(bucketedTimeSeriesGet, jittered, JITTERED);
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(caseHash, iters) {
+  const std::vector<std::string>* input;
+  BENCHMARK_SUSPEND {
+    input = &keys();
+  }
+  CaseHash hash;
+  while (iters--) {
+    size_t sum = 0;
+    for (const auto& key : *input) {
+      sum += hash(key.c_str());
+    }
+    folly::doNotOptimizeAway(sum);
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(dataLogWriterAppend, iters) {
+  const std::vector<std::vector<TimeValuePair>>* input;
+  BENCHMARK_SUSPEND {
+    input = &series(GAUGE);
+  }
+  while (iters--) {
+    // To /dev/null to measure the encoding and not the disk.
+    FileUtils::File file{fopen("/dev/null", "wb"), "/dev/null"};
+    DataLogWriter writer(std::move(file), kStartTime);
+    for (int i = 0; i < kPointsPerBucket; i++) {
+      for (int id = 0; id < 100; id++) {
+        const auto& point = (*input)[id][i];
+        writer.append(id, point.unixTime, point.value);
+      }
+    }
+  }
+}
+
+BENCHMARK(persistentKeyListReadKeys, iters) {
+  std::unique_ptr<TemporaryDirectory> dir;
+  BENCHMARK_SUSPEND {
+    dir.reset(new TemporaryDirectory("gorilla_bench"));
+    boost::filesystem::create_directories(
+        FileUtils::joinPaths(dir->dirname(), "0"));
+    PersistentKeyList list(0, dir->dirname());
+    PersistentKeyList::readKeys(
+        0, dir->dirname(), [](uint32_t, const char*, uint16_t, int32_t) {
+          return true;
+        });
+    const auto& input = keys();
+    for (int i = 0; i < input.size(); i++) {
+      list.appendKey(i, input[i].c_str(), i % 10, kStartTime);
+    }
+    list.flush(true);
+  }
+
+  while (iters--) {
+    size_t bytes = 0;
+    PersistentKeyList::readKeys(
+        0,
+        dir->dirname(),
+        [&](uint32_t, const char* key, uint16_t, int32_t) {
+          bytes += strlen(key);
+          return true;
+        });
+    folly::doNotOptimizeAway(bytes);
+  }
+}
+
+int main(int argc, char** argv) {
+  folly::init(&argc, &argv);
+  folly::runBenchmarks();
+  return 0;
+}
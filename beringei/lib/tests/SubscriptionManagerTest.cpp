@@ -0,0 +1,180 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "beringei/lib/SubscriptionManager.h"
+
+using namespace ::testing;
+using namespace facebook;
+using namespace facebook::gorilla;
+using namespace std;
+
+static vector<Key> makeKeys(const vector<string>& names, int64_t shardId) {
+  vector<Key> keys(names.size());
+  for (int i = 0; i < names.size(); i++) {
+    keys[i].key = names[i];
+    keys[i].shardId = shardId;
+  }
+  return keys;
+}
+
+static TimeValuePair makeValue(int64_t unixTime) {
+  TimeValuePair value;
+  value.unixTime = unixTime;
+  value.value = unixTime * 2;
+  return value;
+}
+
+TEST(SubscriptionManagerTest, Keys) {
+  SubscriptionManager subscriptions(4, 100, 10, 60000);
+  int64_t first = subscriptions.subscribe(makeKeys({"a", "b"}, 1), "", {}, 0);
+  int64_t second = subscriptions.subscribe(makeKeys({"B"}, 1), "", {}, 0);
+  ASSERT_NE(0, first);
+  ASSERT_NE(0, second);
+  EXPECT_NE(first, second);
+  EXPECT_EQ(2, subscriptions.numSubscriptions());
+
+  subscriptions.publish(1, "a", makeValue(1), 3);
+  subscriptions.publish(1, "b", makeValue(2), 0);
+  subscriptions.publish(1, "c", makeValue(3), 0);
+  subscriptions.publish(2, "a", makeValue(4), 0);
+  subscriptions.publish(5, "a", makeValue(5), 0);
+
+  vector<DataPoint> points;
+  int64_t dropped;
+  ASSERT_TRUE(subscriptions.poll(first, 0, 0, points, dropped));
+  ASSERT_EQ(2, points.size());
+  EXPECT_EQ("a", points[0].key.key);
+  EXPECT_EQ(1, points[0].key.shardId);
+  EXPECT_EQ(1, points[0].value.unixTime);
+  EXPECT_EQ(2, points[0].value.value);
+  EXPECT_EQ(3, points[0].categoryId);
+  EXPECT_EQ("b", points[1].key.key);
+  EXPECT_EQ(0, dropped);
+
+  points.clear();
+  ASSERT_TRUE(subscriptions.poll(second, 0, 0, points, dropped));
+  ASSERT_EQ(1, points.size());
+  EXPECT_EQ(2, points[0].value.unixTime);
+
+  points.clear();
+  ASSERT_TRUE(subscriptions.poll(first, 0, 0, points, dropped));
+  EXPECT_TRUE(points.empty());
+
+  EXPECT_TRUE(subscriptions.unsubscribe(first));
+  EXPECT_FALSE(subscriptions.unsubscribe(first));
+  EXPECT_FALSE(subscriptions.poll(first, 0, 0, points, dropped));
+
+  subscriptions.publish(1, "b", makeValue(6), 0);
+  ASSERT_TRUE(subscriptions.poll(second, 0, 0, points, dropped));
+  ASSERT_EQ(1, points.size());
+  EXPECT_EQ(6, points[0].value.unixTime);
+}
+
+TEST(SubscriptionManagerTest, Prefix) {
+  SubscriptionManager subscriptions(4, 100, 10, 60000);
+  int64_t id = subscriptions.subscribe(
+      makeKeys({"host.cpu", "other"}, 1), "HOST.", {1, 2}, 0);
+  ASSERT_NE(0, id);
+
+  subscriptions.publish(1, "host.cpu", makeValue(1), 0);
+  subscriptions.publish(2, "host.mem", makeValue(2), 0);
+  subscriptions.publish(3, "host.mem", makeValue(3), 0);
+  subscriptions.publish(2, "hos", makeValue(4), 0);
+  subscriptions.publish(1, "other", makeValue(5), 0);
+
+  // Points of keys that match twice are only returned once.
+  vector<DataPoint> points;
+  int64_t dropped;
+  ASSERT_TRUE(subscriptions.poll(id, 0, 0, points, dropped));
+  ASSERT_EQ(3, points.size());
+  EXPECT_EQ(1, points[0].value.unixTime);
+  EXPECT_EQ(2, points[1].value.unixTime);
+  EXPECT_EQ(2, points[1].key.shardId);
+  EXPECT_EQ(5, points[2].value.unixTime);
+}
+
+TEST(SubscriptionManagerTest, Buffer) {
+  SubscriptionManager subscriptions(4, 5, 10, 60000);
+  int64_t small = subscriptions.subscribe(makeKeys({"a"}, 0), "", {}, 2);
+  int64_t large = subscriptions.subscribe(makeKeys({"a"}, 0), "", {}, 100);
+  for (int i = 0; i < 10; i++) {
+    subscriptions.publish(0, "a", makeValue(i), 0);
+  }
+
+  // The oldest points are dropped.
+  vector<DataPoint> points;
+  int64_t dropped;
+  ASSERT_TRUE(subscriptions.poll(small, 0, 0, points, dropped));
+  ASSERT_EQ(2, points.size());
+  EXPECT_EQ(8, points[0].value.unixTime);
+  EXPECT_EQ(8, dropped);
+
+  // Capped to the limit and returned in pieces.
+  points.clear();
+  ASSERT_TRUE(subscriptions.poll(large, 0, 3, points, dropped));
+  ASSERT_EQ(3, points.size());
+  EXPECT_EQ(5, points[0].value.unixTime);
+  EXPECT_EQ(5, dropped);
+  ASSERT_TRUE(subscriptions.poll(large, 0, 3, points, dropped));
+  ASSERT_EQ(5, points.size());
+  EXPECT_EQ(9, points[4].value.unixTime);
+  EXPECT_EQ(0, dropped);
+}
+
+TEST(SubscriptionManagerTest, Limits) {
+  SubscriptionManager subscriptions(4, 100, 2, 100);
+  EXPECT_EQ(0, subscriptions.subscribe(makeKeys({"a"}, 4), "", {}, 0));
+  EXPECT_EQ(0, subscriptions.subscribe({}, "a", {-1}, 0));
+
+  int64_t first = subscriptions.subscribe(makeKeys({"a"}, 0), "", {}, 0);
+  int64_t second = subscriptions.subscribe(makeKeys({"a"}, 0), "", {}, 0);
+  ASSERT_NE(0, first);
+  ASSERT_NE(0, second);
+  EXPECT_EQ(0, subscriptions.subscribe(makeKeys({"a"}, 0), "", {}, 0));
+
+  // Subscriptions that aren't polled go away.
+  vector<DataPoint> points;
+  int64_t dropped;
+  this_thread::sleep_for(chrono::milliseconds(60));
+  ASSERT_TRUE(subscriptions.poll(second, 0, 0, points, dropped));
+  this_thread::sleep_for(chrono::milliseconds(60));
+  subscriptions.removeIdle();
+  EXPECT_EQ(1, subscriptions.numSubscriptions());
+  EXPECT_FALSE(subscriptions.poll(first, 0, 0, points, dropped));
+  EXPECT_TRUE(subscriptions.poll(second, 0, 0, points, dropped));
+  EXPECT_NE(0, subscriptions.subscribe(makeKeys({"a"}, 0), "", {}, 0));
+}
+
+TEST(SubscriptionManagerTest, Wait) {
+  SubscriptionManager subscriptions(4, 100, 10, 60000);
+  int64_t id = subscriptions.subscribe(makeKeys({"a"}, 0), "", {}, 0);
+
+  thread publisher([&]() {
+    this_thread::sleep_for(chrono::milliseconds(50));
+    subscriptions.publish(0, "a", makeValue(1), 0);
+  });
+
+  vector<DataPoint> points;
+  int64_t dropped;
+  ASSERT_TRUE(subscriptions.poll(id, 10000, 0, points, dropped));
+  publisher.join();
+  ASSERT_EQ(1, points.size());
+
+  // Removing a subscription wakes up its poll.
+  thread remover([&]() {
+    this_thread::sleep_for(chrono::milliseconds(50));
+    subscriptions.unsubscribe(id);
+  });
+  EXPECT_FALSE(subscriptions.poll(id, 10000, 0, points, dropped));
+  remover.join();
+}
@@ -7,13 +7,18 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 
 #include "TestDataLoader.h"
 #include "beringei/lib/GorillaTimeConstants.h"
+#include "beringei/lib/StreamArena.h"
 #include "beringei/lib/TimeSeriesStream.h"
 
+#include <string.h>
 #include <time.h>
+#include <algorithm>
+#include <cmath>
 #include <unordered_map>
 
 using namespace ::testing;
@@ -21,6 +26,10 @@ using namespace facebook;
 using namespace facebook::gorilla;
 using namespace std;
 
+DECLARE_bool(gorilla_integer_values);
+DECLARE_int64(gorilla_blacklisted_time_min);
+DECLARE_int64(gorilla_blacklisted_time_max);
+
 bool append(
     TimeSeriesStream& stream,
     int64_t unixTime,
@@ -238,3 +247,766 @@ TEST(TimeSeriesStreamTest, GetFirstTimeStamp) {
 
   ASSERT_EQ(100, stream.getFirstTimeStamp());
 }
+
+TEST(TimeSeriesStreamTest, ReadColumnar) {
+  srandom(3);
+
+  TimeSeriesStream stream;
+  int64_t t = 1000;
+  for (int i = 0; i < 1000; i++) {
+    t += random() % 100 + 30;
+    append(stream, t, doubleRand(-1000, 1000), 30);
+  }
+
+  string data;
+  stream.readData(data);
+
+  // Compare against the row based decoding for a few ranges.
+  vector<pair<int64_t, int64_t>> ranges = {
+      {0, std::numeric_limits<int64_t>::max()},
+      {20000, 40000},
+      {0, 999},
+      {t, t},
+      {t + 1, t + 100}};
+  for (auto& range : ranges) {
+    vector<TimeValuePair> expected;
+    TimeSeriesStream::readValues(
+        expected, data, 1000, range.first, range.second);
+
+    vector<int64_t> timestamps(1000);
+    vector<double> values(1000);
+    int count = TimeSeriesStream::readValues(
+        timestamps.data(),
+        values.data(),
+        data,
+        1000,
+        range.first,
+        range.second);
+
+    ASSERT_EQ(expected.size(), count);
+    for (int i = 0; i < count; i++) {
+      ASSERT_EQ(expected[i].unixTime, timestamps[i]);
+      ASSERT_EQ(expected[i].value, values[i]);
+    }
+  }
+}
+
+TEST(TimeSeriesStreamTest, ReadWithBlacklist) {
+  TimeSeriesStream stream;
+  vector<TimeValuePair> all;
+  for (int i = 0; i < 100; i++) {
+    TimeValuePair tv;
+    tv.unixTime = 1000 + i * 60;
+    tv.value = i;
+    ASSERT_TRUE(stream.append(tv, 0));
+    all.push_back(tv);
+  }
+
+  string data;
+  stream.readData(data);
+
+  // Every combination of a range end and an overlapping blacklist
+  // gives the same values as filtering them one by one.
+  vector<pair<int64_t, int64_t>> blacklists = {{0, 0}, {2000, 3000}};
+  vector<pair<int64_t, int64_t>> ranges = {
+      {0, std::numeric_limits<int64_t>::max()},
+      {1500, std::numeric_limits<int64_t>::max()},
+      {0, 4000},
+      {2500, 4000}};
+  for (auto& blacklist : blacklists) {
+    FLAGS_gorilla_blacklisted_time_min = blacklist.first;
+    FLAGS_gorilla_blacklisted_time_max = blacklist.second;
+    for (auto& range : ranges) {
+      vector<TimeValuePair> expected;
+      for (const auto& tv : all) {
+        if (tv.unixTime >= range.first && tv.unixTime <= range.second &&
+            (tv.unixTime < blacklist.first || tv.unixTime > blacklist.second)) {
+          expected.push_back(tv);
+        }
+      }
+
+      vector<TimeValuePair> out;
+      ASSERT_EQ(
+          expected.size(),
+          TimeSeriesStream::readValues(
+              out, data, 100, range.first, range.second));
+      ASSERT_EQ(expected.size(), out.size());
+      for (size_t i = 0; i < out.size(); i++) {
+        ASSERT_EQ(expected[i].unixTime, out[i].unixTime);
+        ASSERT_EQ(expected[i].value, out[i].value);
+      }
+
+      vector<int64_t> timestamps(100);
+      vector<double> values(100);
+      ASSERT_EQ(
+          expected.size(),
+          TimeSeriesStream::readValues(
+              timestamps.data(),
+              values.data(),
+              data,
+              100,
+              range.first,
+              range.second));
+      for (size_t i = 0; i < expected.size(); i++) {
+        ASSERT_EQ(expected[i].unixTime, timestamps[i]);
+      }
+    }
+  }
+  FLAGS_gorilla_blacklisted_time_min = 0;
+  FLAGS_gorilla_blacklisted_time_max = 0;
+}
+
+TEST(TimeSeriesStreamTest, ReadWithCheckpoints) {
+  srandom(4);
+
+  TimeSeriesStream stream;
+  int64_t t = 1000;
+  vector<int64_t> times;
+  for (int i = 0; i < 1000; i++) {
+    t += random() % 100 + 30;
+    times.push_back(t);
+    append(stream, t, random() % 3 ? doubleRand(-1000, 1000) : 1.0, 30);
+  }
+
+  string data;
+  stream.readData(data);
+  string checkpoints;
+  TimeSeriesStream::writeCheckpoints(data, 1000, 16, checkpoints);
+  ASSERT_EQ(62 * 32, checkpoints.size());
+
+  // The index of the first checkpoint is a little-endian 32-bit value
+  // after the previous value, the previous timestamp and the bit
+  // position.
+  EXPECT_EQ(string("\x10\0\0\0", 4), checkpoints.substr(20, 4));
+  EXPECT_EQ(string("\x20\0\0\0", 4), checkpoints.substr(32 + 20, 4));
+
+  for (int i = 0; i < 200; i++) {
+    int64_t begin = times[random() % times.size()] - random() % 2;
+    int64_t end = begin + random() % 10000;
+
+    vector<TimeValuePair> expected;
+    TimeSeriesStream::readValues(expected, data, 1000, begin, end);
+
+    vector<TimeValuePair> out;
+    TimeSeriesStream::readValues(out, data, checkpoints, 1000, begin, end);
+    ASSERT_EQ(expected, out);
+
+    vector<int64_t> timestamps(1000);
+    vector<double> values(1000);
+    int count = TimeSeriesStream::readValues(
+        timestamps.data(), values.data(), data, checkpoints, 1000, begin, end);
+    ASSERT_EQ(expected.size(), count);
+    for (int j = 0; j < count; j++) {
+      ASSERT_EQ(expected[j].unixTime, timestamps[j]);
+      ASSERT_EQ(expected[j].value, values[j]);
+    }
+  }
+
+  // Checkpoints of the wrong size are ignored.
+  vector<TimeValuePair> out;
+  TimeSeriesStream::readValues(
+      out, data, folly::StringPiece(checkpoints.data(), 31), 1000, 0, t);
+  ASSERT_EQ(1000, out.size());
+}
+
+TEST(TimeSeriesStreamTest, RestoreState) {
+  TimeSeriesStream stream;
+  TimeSeriesStream copy;
+  TimeSeriesStream expected;
+  for (int i = 0; i < 20; i++) {
+    append(stream, 1000 + i * 60, i * 1.5);
+    append(expected, 1000 + i * 60, i * 1.5);
+  }
+  stream.extraData = 7;
+
+  TimeSeriesStream::State state;
+  string data;
+  stream.getState(state, data);
+  ASSERT_FALSE(copy.setState(state, data.substr(1)));
+  ASSERT_TRUE(copy.setState(state, data));
+  ASSERT_EQ(7, copy.extraData);
+
+  // Appending to the restored stream continues the same encoding.
+  for (int i = 20; i < 40; i++) {
+    ASSERT_TRUE(append(copy, 1000 + i * 60, i * 1.5));
+    append(expected, 1000 + i * 60, i * 1.5);
+  }
+  ASSERT_FALSE(append(copy, 1000, 1.0));
+
+  string copyData;
+  string expectedData;
+  copy.readData(copyData);
+  expected.readData(expectedData);
+  ASSERT_EQ(expectedData, copyData);
+
+  vector<TimeValuePair> out;
+  TimeSeriesStream::readValues(out, copyData, 40);
+  ASSERT_EQ(40, out.size());
+  for (int i = 0; i < 40; i++) {
+    EXPECT_EQ(1000 + i * 60, out[i].unixTime);
+    EXPECT_EQ(i * 1.5, out[i].value);
+  }
+}
+
+TEST(TimeSeriesStreamTest, Arena) {
+  StreamArena* arena = StreamArena::get(1000);
+  TimeSeriesStream stream;
+  TimeSeriesStream expected;
+  stream.useArena(arena);
+  size_t slabBytes = arena->getMemoryUsage();
+  EXPECT_GT(slabBytes, 0);
+
+  // Grows through the size classes and then past the largest one.
+  for (int i = 0; i < 3000; i++) {
+    append(stream, 1000 + i * 60, i * 1.1);
+    append(expected, 1000 + i * 60, i * 1.1);
+    if (i == 100) {
+      EXPECT_LT(stream.size(), StreamArena::kMaxCapacity);
+    }
+  }
+  EXPECT_GT(stream.size(), StreamArena::kMaxCapacity);
+
+  string data;
+  string expectedData;
+  stream.readData(data);
+  expected.readData(expectedData);
+  EXPECT_EQ(expectedData, data);
+
+  TimeSeriesStream copy(stream);
+  copy.readData(data);
+  EXPECT_EQ(expectedData, data);
+
+  // The buffers the stream grew out of are reused by the next streams.
+  vector<TimeSeriesStream> streams(10);
+  for (auto& other : streams) {
+    other.useArena(arena);
+    for (int i = 0; i < 100; i++) {
+      append(other, 1000 + i * 60, i * 1.1);
+    }
+    other.readData(data);
+    vector<TimeValuePair> out;
+    TimeSeriesStream::readValues(out, data, 100);
+    ASSERT_EQ(100, out.size());
+    EXPECT_EQ(99 * 1.1, out[99].value);
+  }
+  EXPECT_EQ(slabBytes, arena->getMemoryUsage());
+
+  // Streams in an arena go back to it when they are reset.
+  size_t freeBytes = arena->getFreeBytes();
+  streams[0].reset();
+  streams[0].reset();
+  EXPECT_GT(arena->getFreeBytes(), freeBytes);
+  streams.clear();
+  EXPECT_EQ(slabBytes, arena->getMemoryUsage());
+}
+
+class TimeSeriesStreamIntegerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    FLAGS_gorilla_integer_values = true;
+  }
+
+  void TearDown() override {
+    FLAGS_gorilla_integer_values = false;
+  }
+};
+
+TEST_F(TimeSeriesStreamIntegerTest, InsertAndRead) {
+  vector<double> values = {0.0, 1.0, 2.0, 3.0, 3.0, 3.0, -5.0, 1000.0,
+                           -123456789.0, 9007199254740992.0,
+                           -9007199254740992.0, 42.0};
+  TimeSeriesStream stream;
+  for (int i = 0; i < values.size(); i++) {
+    ASSERT_TRUE(append(stream, 1000 + i * 60, values[i]));
+  }
+
+  string data;
+  stream.readData(data);
+  ASSERT_EQ(1000, TimeSeriesStream::getFirstTimeStamp(data));
+  ASSERT_EQ(1000, stream.getFirstTimeStamp());
+
+  vector<TimeValuePair> out;
+  ASSERT_EQ(
+      values.size(),
+      TimeSeriesStream::readValues(out, data, values.size()));
+  vector<int64_t> timestamps(values.size());
+  vector<double> columnar(values.size());
+  ASSERT_EQ(
+      values.size(),
+      TimeSeriesStream::readValues(
+          timestamps.data(), columnar.data(), data, values.size()));
+  for (int i = 0; i < values.size(); i++) {
+    EXPECT_EQ(1000 + i * 60, out[i].unixTime);
+    EXPECT_EQ(values[i], out[i].value);
+    EXPECT_EQ(1000 + i * 60, timestamps[i]);
+    EXPECT_EQ(values[i], columnar[i]);
+  }
+
+  // Integer streams don't have checkpoints but decode the same.
+  string checkpoints;
+  TimeSeriesStream::writeCheckpoints(data, values.size(), 2, checkpoints);
+  ASSERT_TRUE(checkpoints.empty());
+}
+
+TEST_F(TimeSeriesStreamIntegerTest, SmallerThanXor) {
+  TimeSeriesStream integers;
+  int64_t counter = 1000000;
+  for (int i = 0; i < 120; i++) {
+    counter += i % 10 == 0 ? 150 : 100;
+    append(integers, 1000 + i * 60, counter);
+  }
+
+  FLAGS_gorilla_integer_values = false;
+  TimeSeriesStream doubles;
+  counter = 1000000;
+  for (int i = 0; i < 120; i++) {
+    counter += i % 10 == 0 ? 150 : 100;
+    append(doubles, 1000 + i * 60, counter);
+  }
+
+  EXPECT_LT(integers.size() * 2, doubles.size());
+}
+
+TEST_F(TimeSeriesStreamIntegerTest, SwitchToXor) {
+  vector<double> values = {10.0, 20.0, 20.5, 30.0, -0.0, NAN, 1e300, 7.0};
+  TimeSeriesStream stream;
+  for (int i = 0; i < values.size(); i++) {
+    ASSERT_TRUE(append(stream, 1000 + i * 60, values[i]));
+  }
+
+  string data;
+  stream.readData(data);
+  vector<TimeValuePair> out;
+  TimeSeriesStream::readValues(out, data, values.size());
+  ASSERT_EQ(values.size(), out.size());
+  for (int i = 0; i < values.size(); i++) {
+    EXPECT_EQ(1000 + i * 60, out[i].unixTime);
+    EXPECT_EQ(0, memcmp(&values[i], &out[i].value, sizeof(double)))
+        << "Value " << i;
+  }
+
+  EXPECT_FALSE(TimeSeriesStream::isIntegerValue(-0.0));
+  EXPECT_FALSE(TimeSeriesStream::isIntegerValue(NAN));
+  EXPECT_FALSE(TimeSeriesStream::isIntegerValue(1e300));
+  EXPECT_TRUE(TimeSeriesStream::isIntegerValue(-3.0));
+}
+
+TEST_F(TimeSeriesStreamIntegerTest, DeltaOfDeltaTooWide) {
+  // The third delta of delta is 2^55, which no integer code holds, so
+  // the stream switches to XORs there.
+  double max = 9007199254740992.0;
+  vector<double> values = {max, -max, max, 5.0, 7.0};
+  TimeSeriesStream stream;
+  for (int i = 0; i < values.size(); i++) {
+    ASSERT_TRUE(append(stream, 1000 + i * 60, values[i]));
+  }
+
+  string data;
+  stream.readData(data);
+  vector<TimeValuePair> out;
+  ASSERT_EQ(
+      values.size(), TimeSeriesStream::readValues(out, data, values.size()));
+  for (int i = 0; i < values.size(); i++) {
+    EXPECT_EQ(1000 + i * 60, out[i].unixTime);
+    EXPECT_EQ(values[i], out[i].value);
+  }
+}
+
+TEST_F(TimeSeriesStreamIntegerTest, RestoreState) {
+  TimeSeriesStream stream;
+  TimeSeriesStream copy;
+  TimeSeriesStream expected;
+  for (int i = 0; i < 20; i++) {
+    append(stream, 1000 + i * 60, i * i);
+    append(expected, 1000 + i * 60, i * i);
+  }
+
+  TimeSeriesStream::State state;
+  string data;
+  stream.getState(state, data);
+  ASSERT_TRUE(copy.setState(state, data));
+
+  // The restored stream continues the deltas of the integers.
+  for (int i = 20; i < 40; i++) {
+    ASSERT_TRUE(append(copy, 1000 + i * 60, i * i));
+    append(expected, 1000 + i * 60, i * i);
+  }
+
+  string copyData;
+  string expectedData;
+  copy.readData(copyData);
+  expected.readData(expectedData);
+  ASSERT_EQ(expectedData, copyData);
+
+  vector<TimeValuePair> out;
+  TimeSeriesStream::readValues(out, copyData, 40);
+  ASSERT_EQ(40, out.size());
+  for (int i = 0; i < 40; i++) {
+    EXPECT_EQ(i * i, out[i].value);
+  }
+
+  // A state that doesn't match the data is rejected.
+  state.previousValue++;
+  ASSERT_FALSE(copy.setState(state, data));
+}
+
+TEST_F(TimeSeriesStreamIntegerTest, FirstTimestampIsTheMarker) {
+  FLAGS_gorilla_integer_values = false;
+  int64_t marker = ((int64_t)1 << 31) - 1;
+  TimeSeriesStream stream;
+  append(stream, marker, 0.5);
+
+  string data;
+  stream.readData(data);
+  ASSERT_EQ(marker, TimeSeriesStream::getFirstTimeStamp(data));
+  vector<TimeValuePair> out;
+  TimeSeriesStream::readValues(out, data, 1);
+  ASSERT_EQ(1, out.size());
+  EXPECT_EQ(marker, out[0].unixTime);
+  EXPECT_EQ(0.5, out[0].value);
+}
+
+TEST(TimeSeriesStreamTest, Approximate) {
+  for (bool integers : {false, true}) {
+    FLAGS_gorilla_integer_values = integers;
+    TimeSeriesStream stream;
+    stream.setApproximate();
+    for (int i = 0; i < 20; i++) {
+      append(stream, 1000 + i * 60, i * 3);
+    }
+
+    string data;
+    stream.readData(data);
+    EXPECT_TRUE(TimeSeriesStream::isApproximate(data));
+    EXPECT_EQ(1000, TimeSeriesStream::getFirstTimeStamp(data));
+    vector<TimeValuePair> out;
+    ASSERT_EQ(20, TimeSeriesStream::readValues(out, data, 20));
+    for (int i = 0; i < 20; i++) {
+      EXPECT_EQ(1000 + i * 60, out[i].unixTime);
+      EXPECT_EQ(i * 3, out[i].value);
+    }
+
+    // Cleared by reset().
+    stream.reset();
+    append(stream, 1000, 1);
+    stream.readData(data);
+    EXPECT_FALSE(TimeSeriesStream::isApproximate(data));
+  }
+  FLAGS_gorilla_integer_values = false;
+}
+
+TEST(TimeSeriesStreamTest, FirstTimestampIsTheApproximateMarker) {
+  int64_t marker = ((int64_t)1 << 31) - 2;
+  for (bool approximate : {false, true}) {
+    TimeSeriesStream stream;
+    if (approximate) {
+      stream.setApproximate();
+    }
+    append(stream, marker, 0.5);
+
+    string data;
+    stream.readData(data);
+    EXPECT_EQ(approximate, TimeSeriesStream::isApproximate(data));
+    ASSERT_EQ(marker, TimeSeriesStream::getFirstTimeStamp(data));
+    vector<TimeValuePair> out;
+    ASSERT_EQ(1, TimeSeriesStream::readValues(out, data, 1));
+    EXPECT_EQ(marker, out[0].unixTime);
+    EXPECT_EQ(0.5, out[0].value);
+  }
+}
+
+TEST(TimeSeriesStreamTest, Repeats) {
+  for (bool integers : {false, true}) {
+    FLAGS_gorilla_integer_values = integers;
+    TimeSeriesStream stream;
+    TimeSeriesStream expected;
+    for (auto* s : {&stream, &expected}) {
+      append(*s, 1000, 1.5);
+      append(*s, 1060, 4);
+    }
+
+    // Only the same value at the same interval repeats.
+    EXPECT_TRUE(stream.isRepeat(1120, 4, 0, 60));
+    EXPECT_TRUE(stream.isRepeat(1240, 4, 2, 60));
+    EXPECT_FALSE(stream.isRepeat(1120, 4, 0, 61));
+    EXPECT_FALSE(stream.isRepeat(1121, 4, 0, 60));
+    EXPECT_FALSE(stream.isRepeat(1120, 4.5, 0, 60));
+    EXPECT_FALSE(stream.isRepeat(1120, -0.0, 0, 60));
+    EXPECT_EQ(1240, stream.getRepeatTimeStamp(3));
+
+    // Appending the repeats later writes the same bits.
+    stream.appendRepeats(10);
+    for (int i = 1; i <= 10; i++) {
+      append(expected, 1060 + i * 60, 4);
+    }
+    string data;
+    string expectedData;
+    stream.readData(data);
+    expected.readData(expectedData);
+    EXPECT_EQ(expectedData, data);
+    EXPECT_EQ(1660, stream.getPreviousTimeStamp());
+
+    TimeSeriesStream empty;
+    EXPECT_FALSE(empty.isRepeat(1000, 0, 0, 0));
+  }
+  FLAGS_gorilla_integer_values = false;
+}
+
+TEST(TimeSeriesStreamTest, AppendBatch) {
+  vector<TimeValuePair> values;
+  for (int i = 0; i < 300; i++) {
+    TimeValuePair value;
+    value.unixTime = 1000 + i * 60 + (i == 100 ? 30 : 0);
+    value.value = i < 150 ? i % 7 : 2.5;
+    values.push_back(value);
+  }
+  // Too soon after the previous one.
+  values[201].unixTime = values[200].unixTime + 10;
+
+  for (bool integers : {false, true}) {
+    FLAGS_gorilla_integer_values = integers;
+    TimeSeriesStream expected;
+    vector<bool> expectedAdded;
+    for (const auto& value : values) {
+      expectedAdded.push_back(expected.append(value, 60));
+    }
+    string expectedData;
+    expected.readData(expectedData);
+
+    for (bool countRepeats : {false, true}) {
+      // In a few batches, the first one with a single value.
+      TimeSeriesStream stream;
+      vector<bool> added(values.size());
+      uint16_t repeats = 0;
+      int count = 0;
+      for (size_t begin : {0, 1, 120}) {
+        size_t end = begin == 0 ? 1 : begin == 1 ? 120 : values.size();
+        count += stream.appendBatch(
+            values, begin, end, 60, added, countRepeats ? &repeats : nullptr);
+      }
+      EXPECT_EQ(countRepeats, repeats > 0);
+      stream.appendRepeats(repeats);
+
+      string data;
+      stream.readData(data);
+      EXPECT_EQ(expectedData, data);
+      EXPECT_EQ(expectedAdded, added);
+      EXPECT_EQ(std::count(added.begin(), added.end(), true), count);
+    }
+  }
+  FLAGS_gorilla_integer_values = false;
+}
+
+TEST(TimeSeriesStreamTest, SplitAndJoin) {
+  for (bool integers : {false, true}) {
+    FLAGS_gorilla_integer_values = integers;
+    TimeSeriesStream a;
+    TimeSeriesStream b;
+    for (int i = 0; i < 200; i++) {
+      int64_t unixTime = 1000000 + i * 60 + (i % 7 == 0 ? 3 : 0);
+      append(a, unixTime, i % 10, 0);
+      append(b, unixTime, i * 0.25, 0);
+    }
+    string dataA;
+    string dataB;
+    a.readData(dataA);
+    b.readData(dataB);
+
+    // Series written at the same times get the same timestamp bits.
+    string timestampsA;
+    string valuesA;
+    string timestampsB;
+    string valuesB;
+    ASSERT_TRUE(TimeSeriesStream::split(dataA, 200, timestampsA, valuesA));
+    ASSERT_TRUE(TimeSeriesStream::split(dataB, 200, timestampsB, valuesB));
+    EXPECT_EQ(timestampsA, timestampsB);
+
+    string joined;
+    ASSERT_TRUE(TimeSeriesStream::join(timestampsA, valuesA, 200, joined));
+    EXPECT_EQ(dataA, joined);
+    ASSERT_TRUE(TimeSeriesStream::join(timestampsA, valuesB, 200, joined));
+    EXPECT_EQ(dataB, joined);
+
+    EXPECT_FALSE(TimeSeriesStream::split("", 1, timestampsA, valuesA));
+    EXPECT_FALSE(TimeSeriesStream::split(dataA, 100, timestampsA, valuesA));
+    EXPECT_FALSE(TimeSeriesStream::join("", valuesA, 200, joined));
+  }
+  FLAGS_gorilla_integer_values = false;
+}
+
+TEST(TimeSeriesStreamTest, Milliseconds) {
+  for (bool integers : {false, true}) {
+    FLAGS_gorilla_integer_values = integers;
+    int64_t start = 1500000000LL * kGorillaMsPerSecond + 250;
+    vector<int64_t> times;
+    TimeSeriesStream stream;
+    for (int i = 0; i < 100; i++) {
+      // Every 100ms with some jitter, and a gap of a few minutes.
+      int64_t unixTimeMs = start + i * 100 + (i % 3) * 7 +
+          (i >= 50 ? 5 * kGorillaMsPerMinute : 0);
+      ASSERT_TRUE(stream.appendMilliseconds(unixTimeMs, i, 50));
+      times.push_back(unixTimeMs);
+    }
+
+    // Too soon after the previous one.
+    ASSERT_FALSE(stream.appendMilliseconds(times.back() + 49, 0, 50));
+    ASSERT_FALSE(stream.appendMilliseconds(times.back() - 1, 0, 0));
+    EXPECT_EQ(
+        times.back() / kGorillaMsPerSecond, stream.getPreviousTimeStamp());
+    EXPECT_FALSE(stream.isRepeat(
+        times.back() / kGorillaMsPerSecond + 1, 99, 0, 0));
+
+    string data;
+    stream.readData(data);
+    EXPECT_TRUE(TimeSeriesStream::isMilliseconds(data));
+    EXPECT_EQ(
+        start / kGorillaMsPerSecond,
+        TimeSeriesStream::getFirstTimeStamp(data));
+
+    vector<TimeValuePair> out;
+    ASSERT_EQ(100, TimeSeriesStream::readValues(out, data, 100));
+    for (int i = 0; i < 100; i++) {
+      EXPECT_EQ(times[i] / kGorillaMsPerSecond, out[i].unixTime);
+      EXPECT_EQ(times[i] % kGorillaMsPerSecond, out[i].ms);
+      EXPECT_EQ(i, out[i].value);
+    }
+
+    // Ranges and the other readers are in seconds.
+    int64_t begin = times[20] / kGorillaMsPerSecond;
+    int64_t end = times[60] / kGorillaMsPerSecond;
+    vector<TimeValuePair> expected;
+    for (const auto& value : out) {
+      if (value.unixTime >= begin && value.unixTime <= end) {
+        expected.push_back(value);
+      }
+    }
+    out.clear();
+    TimeSeriesStream::readValues(out, data, 100, begin, end);
+    EXPECT_EQ(expected, out);
+
+    string checkpoints;
+    TimeSeriesStream::writeCheckpoints(data, 100, 10, checkpoints);
+    EXPECT_EQ(integers, checkpoints.empty());
+    out.clear();
+    TimeSeriesStream::readValues(out, data, checkpoints, 100, begin, end);
+    EXPECT_EQ(expected, out);
+
+    int64_t timestamps[100];
+    double values[100];
+    ASSERT_EQ(
+        (int)expected.size(),
+        TimeSeriesStream::readValues(
+            timestamps, values, data, 100, begin, end));
+    TimeSeriesStream::Reader reader(data, checkpoints, 100, begin, end);
+    int64_t unixTime;
+    double value;
+    for (size_t i = 0; i < expected.size(); i++) {
+      EXPECT_EQ(expected[i].unixTime, timestamps[i]);
+      EXPECT_EQ(expected[i].value, values[i]);
+      ASSERT_TRUE(reader.next(unixTime, value));
+      EXPECT_EQ(expected[i].unixTime, unixTime);
+      EXPECT_EQ(expected[i].value, value);
+    }
+    EXPECT_FALSE(reader.next(unixTime, value));
+
+    string timestampBits;
+    string valueBits;
+    string joined;
+    ASSERT_TRUE(TimeSeriesStream::split(data, 100, timestampBits, valueBits));
+    ASSERT_TRUE(TimeSeriesStream::join(timestampBits, valueBits, 100, joined));
+    EXPECT_EQ(data, joined);
+
+    // Points in seconds keep the stream in milliseconds.
+    int64_t next = times.back() / kGorillaMsPerSecond + 1;
+    ASSERT_TRUE(append(stream, next, 100, 0));
+    stream.readData(data);
+    out.clear();
+    ASSERT_EQ(101, TimeSeriesStream::readValues(out, data, 101));
+    EXPECT_EQ(next, out.back().unixTime);
+    EXPECT_EQ(0, out.back().ms);
+
+    // The next bucket goes back to seconds from the last timestamp.
+    stream.reset();
+    EXPECT_EQ(next, stream.getPreviousTimeStamp());
+    ASSERT_FALSE(append(stream, next + 10, 1, 60));
+    ASSERT_TRUE(append(stream, next + 60, 1, 60));
+    stream.readData(data);
+    EXPECT_FALSE(TimeSeriesStream::isMilliseconds(data));
+  }
+  FLAGS_gorilla_integer_values = false;
+}
+
+TEST(TimeSeriesStreamTest, MillisecondsSpan) {
+  int64_t start = 1500000000LL * kGorillaMsPerSecond;
+  TimeSeriesStream stream;
+  ASSERT_TRUE(stream.appendMilliseconds(start, 1, 0));
+  ASSERT_TRUE(stream.appendMilliseconds(
+      start + TimeSeriesStream::kMaxMillisecondSpan, 2, 0));
+  ASSERT_FALSE(stream.appendMilliseconds(
+      start + TimeSeriesStream::kMaxMillisecondSpan + 1, 3, 0));
+  ASSERT_FALSE(stream.appendMilliseconds(-1, 3, 0));
+
+  string data;
+  stream.readData(data);
+  vector<TimeValuePair> out;
+  ASSERT_EQ(2, TimeSeriesStream::readValues(out, data, 2));
+  int64_t last = start + TimeSeriesStream::kMaxMillisecondSpan;
+  EXPECT_EQ(last / kGorillaMsPerSecond, out[1].unixTime);
+  EXPECT_EQ(last % kGorillaMsPerSecond, out[1].ms);
+}
+
+TEST(TimeSeriesStreamTest, MillisecondsInSecondStreams) {
+  // Streams that started in seconds round the milliseconds down.
+  TimeSeriesStream stream;
+  append(stream, 1000, 1, 0);
+  ASSERT_FALSE(stream.appendMilliseconds(1000999, 2, 1000));
+  ASSERT_TRUE(stream.appendMilliseconds(1001999, 2, 1000));
+
+  string data;
+  stream.readData(data);
+  EXPECT_FALSE(TimeSeriesStream::isMilliseconds(data));
+  vector<TimeValuePair> out;
+  ASSERT_EQ(2, TimeSeriesStream::readValues(out, data, 2));
+  EXPECT_EQ(1001, out[1].unixTime);
+  EXPECT_EQ(0, out[1].ms);
+
+  // A second stream that starts at the time of the marker.
+  int64_t marker = ((int64_t)1 << 31) - 3;
+  TimeSeriesStream markerStream;
+  append(markerStream, marker, 0.5);
+  markerStream.readData(data);
+  EXPECT_FALSE(TimeSeriesStream::isMilliseconds(data));
+  out.clear();
+  ASSERT_EQ(1, TimeSeriesStream::readValues(out, data, 1));
+  EXPECT_EQ(marker, out[0].unixTime);
+  EXPECT_EQ(0.5, out[0].value);
+}
+
+TEST(TimeSeriesStreamTest, MillisecondsApproximateAndState) {
+  int64_t start = 1500000000LL * kGorillaMsPerSecond + 1;
+  TimeSeriesStream stream;
+  stream.setApproximate();
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(stream.appendMilliseconds(start + i * 250, i * 0.5, 0));
+  }
+
+  TimeSeriesStream::State state;
+  string data;
+  stream.getState(state, data);
+  EXPECT_TRUE(TimeSeriesStream::isApproximate(data));
+  EXPECT_TRUE(TimeSeriesStream::isMilliseconds(data));
+
+  // A restored stream keeps appending milliseconds.
+  TimeSeriesStream copy;
+  ASSERT_TRUE(copy.setState(state, data));
+  ASSERT_TRUE(copy.appendMilliseconds(start + 10 * 250, 5, 0));
+  copy.readData(data);
+  vector<TimeValuePair> out;
+  ASSERT_EQ(11, TimeSeriesStream::readValues(out, data, 11));
+  for (int i = 0; i < 11; i++) {
+    int64_t unixTimeMs = start + i * 250;
+    EXPECT_EQ(unixTimeMs / kGorillaMsPerSecond, out[i].unixTime);
+    EXPECT_EQ(unixTimeMs % kGorillaMsPerSecond, out[i].ms);
+    EXPECT_EQ(i * 0.5, out[i].value);
+  }
+}
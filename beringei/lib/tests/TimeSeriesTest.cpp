@@ -89,3 +89,277 @@ TEST_F(TimeSeriesTest, FillAndVerifyNoData) {
 
   ASSERT_EQ(0, values.size());
 }
+
+TEST_F(TimeSeriesTest, FillAndVerifyColumnar) {
+  vector<TimeSeriesBlock> blocks(2);
+  fill(blocks[0]);
+  fill(blocks[1]);
+
+  vector<int64_t> timestamps(8);
+  vector<double> values(8);
+  int count =
+      TimeSeries::getValues(blocks, timestamps.data(), values.data(), 6, 7);
+
+  ASSERT_EQ(4, count);
+  for (int i = 0; i < count; i += 2) {
+    EXPECT_EQ(t2_.unixTime, timestamps[i]);
+    EXPECT_EQ(t2_.value, values[i]);
+    EXPECT_EQ(t3_.unixTime, timestamps[i + 1]);
+    EXPECT_EQ(t3_.value, values[i + 1]);
+  }
+}
+
+TEST_F(TimeSeriesTest, FillAndVerifyWithCheckpoints) {
+  TimeSeriesBlock block;
+  TimeSeries::writeValues({t1_, t2_, t3_, t4_}, block, 2);
+  ASSERT_FALSE(block.checkpoints.empty());
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(block, values, 7, 10);
+
+  ASSERT_EQ(2, values.size());
+  EXPECT_EQ(t3_, values[0]);
+  EXPECT_EQ(t4_, values[1]);
+}
+
+TEST_F(TimeSeriesTest, WriteCheckpointsOfBlocks) {
+  vector<TimeSeriesBlock> blocks(2);
+  TimeSeries::writeValues({t1_, t2_, t3_, t4_}, blocks[0]);
+  TimeSeries::writeValues({t1_, t2_}, blocks[1]);
+  TimeSeries::writeCheckpoints(blocks, 2);
+
+  // Only the block with more values than the interval gets them.
+  EXPECT_EQ(32, blocks[0].checkpoints.size());
+  EXPECT_TRUE(blocks[1].checkpoints.empty());
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(blocks[0], values, 7, 10);
+  ASSERT_EQ(2, values.size());
+  EXPECT_EQ(t3_, values[0]);
+  EXPECT_EQ(t4_, values[1]);
+}
+
+TEST_F(TimeSeriesTest, ColumnarResult) {
+  TimeSeriesData first;
+  first.data.resize(2);
+  fill(first.data[0]);
+  fill(first.data[1]);
+
+  TimeSeriesData missing;
+  missing.status = StatusCode::KEY_MISSING;
+
+  TimeSeriesData last;
+  last.data.resize(1);
+  TimeSeries::writeValues({t3_, t4_}, last.data[0]);
+
+  GetDataColumnarResult result;
+  TimeSeries::appendColumnar(first, result);
+  TimeSeries::appendColumnar(missing, result);
+  TimeSeries::appendColumnar(last, result);
+
+  ASSERT_EQ(3, result.statuses.size());
+  EXPECT_EQ(StatusCode::OK, result.statuses[0]);
+  EXPECT_EQ(StatusCode::KEY_MISSING, result.statuses[1]);
+  EXPECT_EQ(StatusCode::OK, result.statuses[2]);
+  ASSERT_EQ(8, TimeSeries::getCount(result, 0));
+  ASSERT_EQ(0, TimeSeries::getCount(result, 1));
+  ASSERT_EQ(2, TimeSeries::getCount(result, 2));
+  ASSERT_EQ(0, TimeSeries::getCount(result, 3));
+
+  vector<int64_t> timestamps(10);
+  vector<double> values(10);
+  int count = TimeSeries::getValues(
+      result, 0, timestamps.data(), values.data(), 6, 10);
+  ASSERT_EQ(6, count);
+  EXPECT_EQ(t2_.unixTime, timestamps[0]);
+  EXPECT_EQ(t4_.value, values[5]);
+
+  count = TimeSeries::getValues(
+      result, 1, timestamps.data(), values.data(), 0, 10);
+  ASSERT_EQ(0, count);
+
+  count = TimeSeries::getValues(
+      result, 2, timestamps.data(), values.data(), 0, 10);
+  ASSERT_EQ(2, count);
+  EXPECT_EQ(t3_.unixTime, timestamps[0]);
+  EXPECT_EQ(t3_.value, values[0]);
+  EXPECT_EQ(t4_.unixTime, timestamps[1]);
+  EXPECT_EQ(t4_.value, values[1]);
+}
+
+TEST_F(TimeSeriesTest, TrimBlocks) {
+  vector<TimeSeriesBlock> blocks(3);
+  for (int i = 0; i < blocks.size(); i++) {
+    vector<TimeValuePair> values = {t1_, t2_, t3_, t4_};
+    for (auto& value : values) {
+      value.unixTime += i * 100;
+    }
+    TimeSeries::writeValues(values, blocks[i]);
+  }
+
+  // Blocks that are all in the range are kept as they are.
+  auto trimmed = blocks;
+  TimeSeries::trimBlocks(trimmed, 100, 300);
+  ASSERT_EQ(2, trimmed.size());
+  EXPECT_EQ(blocks[1].data, trimmed[0].data);
+  EXPECT_EQ(blocks[2].data, trimmed[1].data);
+
+  trimmed = blocks;
+  TimeSeries::trimBlocks(trimmed, 106, 150);
+  ASSERT_EQ(1, trimmed.size());
+  ASSERT_EQ(3, trimmed[0].count);
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(trimmed, values, 0, 1000);
+  ASSERT_EQ(3, values.size());
+  EXPECT_EQ(106, values[0].unixTime);
+  EXPECT_EQ(t2_.value, values[0].value);
+  EXPECT_EQ(108, values[2].unixTime);
+
+  trimmed = blocks;
+  TimeSeries::trimBlocks(trimmed, 10, 20);
+  ASSERT_TRUE(trimmed.empty());
+}
+
+TEST_F(TimeSeriesTest, CoalesceBlocks) {
+  vector<TimeSeriesBlock> blocks(4);
+  vector<TimeValuePair> all;
+  for (int i = 0; i < blocks.size(); i++) {
+    vector<TimeValuePair> values = {t1_, t2_, t3_, t4_};
+    for (auto& value : values) {
+      value.unixTime += i * 100;
+    }
+    TimeSeries::writeValues(values, blocks[i]);
+    all.insert(all.end(), values.begin(), values.end());
+  }
+
+  // Only the blocks in the range are replaced.
+  auto coalesced = blocks;
+  ASSERT_TRUE(TimeSeries::coalesceBlocks(coalesced, 1, 3));
+  ASSERT_EQ(3, coalesced.size());
+  EXPECT_EQ(blocks[0].data, coalesced[0].data);
+  EXPECT_EQ(8, coalesced[1].count);
+  EXPECT_EQ(blocks[3].data, coalesced[2].data);
+
+  vector<TimeValuePair> values;
+  TimeSeries::getValues(coalesced, values, 0, 1000);
+  EXPECT_EQ(all, values);
+
+  // Approximate blocks aren't mixed with exact ones.
+  coalesced = blocks;
+  coalesced[2] = TimeSeriesBlock();
+  TimeSeries::writeValues({t1_}, coalesced[2], 0, true);
+  EXPECT_FALSE(TimeSeries::coalesceBlocks(coalesced, 0, 4));
+  EXPECT_EQ(4, coalesced.size());
+}
+
+TEST_F(TimeSeriesTest, ApproximateBlocks) {
+  vector<TimeValuePair> values = {t1_, t2_, t3_, t4_};
+  vector<TimeSeriesBlock> blocks(1);
+  TimeSeries::writeValues(values, blocks[0]);
+  EXPECT_FALSE(TimeSeries::isApproximate(blocks[0]));
+
+  blocks[0] = TimeSeriesBlock();
+  TimeSeries::writeValues(values, blocks[0], 0, true);
+  EXPECT_TRUE(TimeSeries::isApproximate(blocks[0]));
+  vector<TimeValuePair> out;
+  TimeSeries::getValues(blocks, out, 0, 1000);
+  EXPECT_EQ(values, out);
+
+  // Trimmed blocks are still approximate.
+  TimeSeries::trimBlocks(blocks, t2_.unixTime, t3_.unixTime);
+  ASSERT_EQ(1, blocks.size());
+  EXPECT_EQ(2, blocks[0].count);
+  EXPECT_TRUE(TimeSeries::isApproximate(blocks[0]));
+}
+
+TEST_F(TimeSeriesTest, MergeMany) {
+  // Three copies with a few points missing from each, in two blocks
+  // with checkpoints. One value of each block of the last copy doesn't
+  // match.
+  vector<vector<TimeSeriesBlock>> copies(3);
+  for (int copy = 0; copy < copies.size(); copy++) {
+    for (int block = 0; block < 2; block++) {
+      vector<TimeValuePair> values;
+      for (int i = 0; i < 50; i++) {
+        int64_t unixTime = 1000 + block * 3000 + i * 60;
+        if ((unixTime / 60) % 7 == copy) {
+          continue;
+        }
+        TimeValuePair value;
+        value.unixTime = unixTime;
+        value.value = i + (copy == 2 && i == 10 ? 0.5 : 0);
+        values.push_back(value);
+      }
+      copies[copy].emplace_back();
+      TimeSeries::writeValues(values, copies[copy].back(), 8);
+    }
+  }
+
+  // Same points as merging the copies one at a time.
+  vector<TimeValuePair> expected;
+  for (const auto& blocks : copies) {
+    TimeSeries::mergeValues(
+        blocks, expected, 1500, 5000, 30, false, 0, nullptr, nullptr);
+  }
+
+  vector<const vector<TimeSeriesBlock>*> in;
+  for (const auto& blocks : copies) {
+    in.push_back(&blocks);
+  }
+  vector<TimeValuePair> out = {t1_};
+  vector<TimeSeries::MergeStats> stats;
+  TimeSeries::mergeValues(in, out, 1500, 5000, 30, true, 0.01, &stats);
+  EXPECT_EQ(expected, out);
+
+  ASSERT_EQ(3, stats.size());
+  int64_t total = 0;
+  for (int copy = 0; copy < 3; copy++) {
+    vector<TimeValuePair> values;
+    TimeSeries::getValues(copies[copy], values, 1500, 5000);
+    EXPECT_EQ(values.size(), stats[copy].in);
+    total += stats[copy].added;
+  }
+  EXPECT_EQ(out.size(), total);
+
+  // The first copy misses the points at minutes 7n, which the second
+  // copy adds, and the third one only adds the points that both of the
+  // others miss, which are none.
+  EXPECT_EQ(0, stats[0].missing);
+  EXPECT_EQ(stats[1].added, stats[1].missing + stats[0].in - stats[1].in);
+  EXPECT_EQ(0, stats[2].added);
+  EXPECT_EQ(0, stats[0].mismatches);
+  EXPECT_EQ(0, stats[1].mismatches);
+  EXPECT_EQ(2, stats[2].mismatches);
+
+  // No inputs.
+  TimeSeries::mergeValues({}, out, 0, 10000, 30, false, 0, nullptr);
+  EXPECT_TRUE(out.empty());
+}
+
+TEST_F(TimeSeriesTest, MergeManyKeepsCloseValuesOfOneInput) {
+  vector<TimeValuePair> values;
+  for (int i = 0; i < 100; i++) {
+    TimeValuePair value;
+    value.unixTime = 1000 + i;
+    value.value = i;
+    values.push_back(value);
+  }
+  vector<TimeSeriesBlock> blocks(1);
+  TimeSeries::writeValues(values, blocks[0]);
+
+  vector<TimeValuePair> out;
+  TimeSeries::mergeValues({&blocks}, out, 0, 10000, 30, false, 0, nullptr);
+  EXPECT_EQ(values, out);
+
+  // The points of another copy are dropped when they are too close to
+  // the merged ones, whichever copy comes first.
+  vector<TimeSeriesBlock> copy(1);
+  TimeSeries::writeValues({values[10], values[50]}, copy[0]);
+  TimeSeries::mergeValues(
+      {&blocks, &copy}, out, 0, 10000, 30, false, 0, nullptr);
+  EXPECT_EQ(values, out);
+  TimeSeries::mergeValues(
+      {&copy, &blocks}, out, 0, 10000, 30, false, 0, nullptr);
+  EXPECT_EQ(values, out);
+}
@@ -9,6 +9,7 @@
 
 #include <folly/Random.h>
 #include <gtest/gtest.h>
+#include <thread>
 
 #include "beringei/lib/Timer.h"
 
@@ -107,5 +108,18 @@ TEST(TimerTest, Reset) {
   EXPECT_TRUE(timer.running());
   timer.stop();
 }
+
+TEST(TimerTest, TscTimer) {
+  TscTimer tscTimer(true);
+  ASSERT_TRUE(tscTimer.running());
+  Timer timer(true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  int64_t us = timer.get();
+  int64_t tscUs = tscTimer.get();
+
+  // The TSC timer started first.
+  EXPECT_GE(tscUs, 19000);
+  EXPECT_LT(tscUs, us * 1.1 + 1000);
+}
 }
 } // facebook::gorilla
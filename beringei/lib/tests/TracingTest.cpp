@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "beringei/lib/Tracing.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+
+static TraceBuffer::Span makeSpan(uint64_t traceId, int64_t shardId) {
+  TraceBuffer::Span span;
+  span.traceId = traceId;
+  span.name = "test";
+  span.shardId = shardId;
+  span.startUs = 100;
+  span.durationUs = 5;
+  return span;
+}
+
+TEST(TracingTest, CollectsNewSpans) {
+  TraceBuffer buffer(4);
+  std::vector<TraceBuffer::Span> spans;
+  ASSERT_EQ(0, buffer.collect(0, spans));
+  ASSERT_TRUE(spans.empty());
+
+  buffer.record(makeSpan(1, 10));
+  buffer.record(makeSpan(1, 11));
+  uint64_t position = buffer.collect(0, spans);
+  ASSERT_EQ(2, position);
+  ASSERT_EQ(2, spans.size());
+  EXPECT_EQ(10, spans[0].shardId);
+  EXPECT_EQ(11, spans[1].shardId);
+  EXPECT_STREQ("test", spans[1].name);
+
+  // Only the last 4 spans are kept.
+  for (int i = 0; i < 6; i++) {
+    buffer.record(makeSpan(2, i));
+  }
+  spans.clear();
+  ASSERT_EQ(8, buffer.collect(position, spans));
+  ASSERT_EQ(4, spans.size());
+  EXPECT_EQ(2, spans[0].shardId);
+  EXPECT_EQ(5, spans[3].shardId);
+}
+
+TEST(TracingTest, ConcurrentWriters) {
+  TraceBuffer buffer(1000);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&buffer, i]() {
+      for (int j = 0; j < 250; j++) {
+        buffer.record(makeSpan(i + 1, j));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<TraceBuffer::Span> spans;
+  ASSERT_EQ(1000, buffer.collect(0, spans));
+  ASSERT_EQ(1000, spans.size());
+  std::vector<int> counts(5, 0);
+  for (const auto& span : spans) {
+    ASSERT_LT(span.traceId, 5);
+    counts[span.traceId]++;
+  }
+  for (int i = 1; i < 5; i++) {
+    EXPECT_EQ(250, counts[i]);
+  }
+}
+
+TEST(TracingTest, Scopes) {
+  std::vector<TraceBuffer::Span> spans;
+  uint64_t position = Tracing::collect(0, spans);
+  spans.clear();
+
+  // Nothing is recorded without a trace.
+  ASSERT_EQ(0, Tracing::current());
+  { Tracing::SpanScope span("untraced"); }
+  ASSERT_EQ(position, Tracing::collect(position, spans));
+
+  {
+    Tracing::TraceScope trace(42);
+    ASSERT_EQ(42, Tracing::current());
+    {
+      Tracing::TraceScope inner(7);
+      Tracing::SpanScope span("inner", 3);
+    }
+    ASSERT_EQ(42, Tracing::current());
+    Tracing::SpanScope span("outer");
+  }
+  ASSERT_EQ(0, Tracing::current());
+
+  position = Tracing::collect(position, spans);
+  ASSERT_EQ(2, spans.size());
+  EXPECT_EQ(7, spans[0].traceId);
+  EXPECT_STREQ("inner", spans[0].name);
+  EXPECT_EQ(3, spans[0].shardId);
+  EXPECT_EQ(42, spans[1].traceId);
+  EXPECT_EQ(-1, spans[1].shardId);
+  EXPECT_GE(spans[1].durationUs, 0);
+}
+
+TEST(TracingTest, Headers) {
+  EXPECT_EQ("00000000000000ff", Tracing::format(255));
+  EXPECT_EQ(255, Tracing::parse(Tracing::format(255)));
+  EXPECT_EQ(0xfedcba9876543210ULL, Tracing::parse("fedcba9876543210"));
+  EXPECT_EQ(0, Tracing::parse("not a trace"));
+  EXPECT_EQ(0, Tracing::parse(""));
+
+  double rate = FLAGS_gorilla_trace_sample_rate;
+  FLAGS_gorilla_trace_sample_rate = 0;
+  EXPECT_EQ(0, Tracing::sample());
+  FLAGS_gorilla_trace_sample_rate = 1;
+  EXPECT_NE(0, Tracing::sample());
+  FLAGS_gorilla_trace_sample_rate = rate;
+}
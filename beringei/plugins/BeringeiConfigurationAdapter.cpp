@@ -9,6 +9,8 @@
 
 #include "BeringeiConfigurationAdapter.h"
 
+#include <sys/stat.h>
+
 #include <folly/String.h>
 
 #include "beringei/lib/CaseUtils.h"
@@ -34,12 +36,31 @@ DEFINE_string(
     "Name of the shadow beringei service. "
     "Only shadow shards will be sent to it");
 
+DEFINE_int32(
+    beringei_configuration_watch_ms,
+    250,
+    "How often to check whether the configuration file changed, so that "
+    "clients stop sending data points of moved shards to their old hosts. "
+    "0 only reads it every minute.");
+
 namespace facebook {
 namespace gorilla {
 
 const uint32_t BeringeiConfigurationAdapter::kConfigurationUpdateIntervalSecs =
     60;
 
+static std::tuple<int64_t, int64_t, int64_t> getFileVersion(
+    const std::string& path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return std::make_tuple(0, 0, 0);
+  }
+  return std::make_tuple(
+      info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec,
+      info.st_size,
+      info.st_ino);
+}
+
 std::vector<std::string> parseServices(const std::string& servicesString) {
   std::vector<std::string> parts;
   std::vector<std::string> result;
@@ -65,18 +86,27 @@ BeringeiConfigurationAdapter::BeringeiConfigurationAdapter(
                << "configuration path with --beringei_configuration_path.";
   }
 
+  configurationFilePath_ = configurationFilePath;
+  fileVersion_ = getFileVersion(configurationFilePath_);
   auto configuration = loader_.loadFromJsonFile(configurationFilePath);
   if (!loader_.isValidConfiguration(configuration)) {
     throw std::runtime_error("Invalid Beringei Configuration");
   }
 
-  configuration_ = loader_.getInternalConfiguration(configuration);
+  setConfiguration(loader_.getInternalConfiguration(configuration));
 
   if (autoRefresh) {
     configurationRefresher_.addFunction(
         std::bind(&BeringeiConfigurationAdapter::refreshConfiguration, this),
         std::chrono::seconds(kConfigurationUpdateIntervalSecs),
         "refreshConfiguration");
+    if (FLAGS_beringei_configuration_watch_ms > 0) {
+      configurationRefresher_.addFunction(
+          std::bind(
+              &BeringeiConfigurationAdapter::checkConfigurationFile, this),
+          std::chrono::milliseconds(FLAGS_beringei_configuration_watch_ms),
+          "checkConfigurationFile");
+    }
     configurationRefresher_.start();
   }
 
@@ -85,6 +115,11 @@ BeringeiConfigurationAdapter::BeringeiConfigurationAdapter(
   shadowServices_ = parseServices(FLAGS_beringei_shadow_write_services);
 };
 
+BeringeiConfigurationAdapter::~BeringeiConfigurationAdapter() {
+  // The refreshes use the members below the scheduler.
+  configurationRefresher_.shutdown();
+}
+
 int BeringeiConfigurationAdapter::getShardCount(
     const std::string& serviceName) {
   int shardCount = 0;
@@ -105,26 +140,19 @@ bool BeringeiConfigurationAdapter::getHostForShardId(
     int shardId,
     const std::string& serviceName,
     std::pair<std::string, int>& hostInfo) {
-  SYNCHRONIZED(configuration_) {
-    auto serviceIterator = configuration_.serviceMap.find(serviceName);
-
-    if (serviceIterator == configuration_.serviceMap.end()) {
-      return false;
-    }
-
-    auto& service = serviceIterator->second;
-
-    if (shardId >= service.shardMap.size() || shardId < 0) {
-      return false;
-    }
-    const auto& shardHostInfo = service.shardMap.at(shardId);
+  auto shardHosts = shardHosts_.load();
+  auto serviceIterator = shardHosts->find(serviceName);
+  if (serviceIterator == shardHosts->end()) {
+    return false;
+  }
 
-    hostInfo.first = shardHostInfo.hostAddress;
-    hostInfo.second = shardHostInfo.port;
-    return true;
+  const auto& hosts = *serviceIterator->second;
+  if (shardId >= hosts.size() || shardId < 0) {
+    return false;
   }
 
-  return false;
+  hostInfo = hosts[shardId];
+  return true;
 }
 
 void BeringeiConfigurationAdapter::getShardsForHost(
@@ -151,6 +179,49 @@ void BeringeiConfigurationAdapter::getShardsForHost(
   return;
 }
 
+void BeringeiConfigurationAdapter::getFollowersForShardId(
+    int shardId,
+    const std::string& serviceName,
+    std::vector<std::pair<std::string, int>>& followers) {
+  followers.clear();
+  SYNCHRONIZED(configuration_) {
+    auto serviceIterator = configuration_.serviceMap.find(serviceName);
+    if (serviceIterator == configuration_.serviceMap.end()) {
+      return;
+    }
+
+    const auto& followerMap = serviceIterator->second.followerMap;
+    if (shardId < 0 || shardId >= followerMap.size()) {
+      return;
+    }
+
+    for (const auto& follower : followerMap[shardId]) {
+      followers.emplace_back(follower.hostAddress, follower.port);
+    }
+  }
+}
+
+void BeringeiConfigurationAdapter::getFollowedShardsForHost(
+    const std::pair<std::string, int>& hostInfo,
+    const std::string& serviceName,
+    std::set<int64_t>& shardList) {
+  shardList.clear();
+  SYNCHRONIZED(configuration_) {
+    auto serviceIterator = configuration_.serviceMap.find(serviceName);
+    if (serviceIterator == configuration_.serviceMap.end()) {
+      return;
+    }
+    const auto& followed = serviceIterator->second.followedShardsPerHostMap;
+
+    std::string compactHostInfo =
+        hostInfo.first + ":" + folly::to<std::string>(hostInfo.second);
+    auto it = followed.find(compactHostInfo);
+    if (it != followed.end()) {
+      shardList = it->second;
+    }
+  }
+}
+
 uint64_t BeringeiConfigurationAdapter::getShardForKey(
     folly::StringPiece key,
     uint64_t totalShards,
@@ -201,9 +272,22 @@ bool BeringeiConfigurationAdapter::isLoggingNewKeysEnabled(
   return false;
 }
 
+uint32_t BeringeiConfigurationAdapter::getTransportCompressionMinBytes(
+    const std::string& serviceName) {
+  SYNCHRONIZED(configuration_) {
+    auto serviceIterator = configuration_.serviceMap.find(serviceName);
+
+    if (serviceIterator != configuration_.serviceMap.end()) {
+      return serviceIterator->second.transportCompressionMinBytes;
+    }
+  }
+
+  return 0;
+}
+
 // if there is an error, continue running with the stale configuration
 void BeringeiConfigurationAdapter::refreshConfiguration() {
-  if (FLAGS_beringei_configuration_path.empty()) {
+  if (configurationFilePath_.empty()) {
     LOG(ERROR) << "Cannot refresh BeringeiConfiguration without "
                << "a path to the configuration file";
     return;
@@ -211,7 +295,7 @@ void BeringeiConfigurationAdapter::refreshConfiguration() {
 
   ConfigurationInfo configuration;
   try {
-    configuration = loader_.loadFromJsonFile(FLAGS_beringei_configuration_path);
+    configuration = loader_.loadFromJsonFile(configurationFilePath_);
   } catch (std::exception& e) {
     LOG(ERROR)
         << "Encountered exception when refreshing Beringei Configuration: "
@@ -225,9 +309,78 @@ void BeringeiConfigurationAdapter::refreshConfiguration() {
     return;
   }
 
+  setConfiguration(loader_.getInternalConfiguration(configuration));
+}
+
+void BeringeiConfigurationAdapter::checkConfigurationFile() {
+  auto version = getFileVersion(configurationFilePath_);
+  if (version == fileVersion_) {
+    return;
+  }
+
+  // A file that is being written may not parse yet, in which case it's
+  // read again on the next change or refresh.
+  fileVersion_ = version;
+  refreshConfiguration();
+}
+
+void BeringeiConfigurationAdapter::setConfiguration(
+    BeringeiInternalConfiguration&& configuration) {
+  auto shardHosts = std::make_shared<ShardHostsMap>();
+  for (const auto& service : configuration.serviceMap) {
+    auto hosts = std::make_shared<ShardHosts>();
+    hosts->reserve(service.second.shardMap.size());
+    for (const auto& host : service.second.shardMap) {
+      hosts->emplace_back(host.hostAddress, host.port);
+    }
+    shardHosts->emplace(service.first, std::move(hosts));
+  }
+
   SYNCHRONIZED(configuration_) {
-    configuration_ = loader_.getInternalConfiguration(configuration);
+    configuration_ = std::move(configuration);
+  }
+  auto oldShardHosts = shardHosts_.load();
+  shardHosts_.store(shardHosts);
+  if (!oldShardHosts) {
+    return;
   }
+
+  std::lock_guard<std::mutex> guard(subscribersMutex_);
+  if (subscribers_.empty()) {
+    return;
+  }
+
+  for (const auto& service : *oldShardHosts) {
+    const auto& oldHosts = *service.second;
+    auto it = shardHosts->find(service.first);
+    std::vector<int64_t> moved;
+    for (size_t i = 0; i < oldHosts.size(); i++) {
+      if (it == shardHosts->end() || i >= it->second->size() ||
+          (*it->second)[i] != oldHosts[i]) {
+        moved.push_back(i);
+      }
+    }
+
+    if (!moved.empty()) {
+      LOG(INFO) << moved.size() << " shards of " << service.first << " moved";
+      for (const auto& subscriber : subscribers_) {
+        subscriber.second(service.first, moved);
+      }
+    }
+  }
+}
+
+int64_t BeringeiConfigurationAdapter::subscribeToShardChanges(
+    ShardsChangedCallback callback) {
+  std::lock_guard<std::mutex> guard(subscribersMutex_);
+  int64_t id = nextSubscriberId_++;
+  subscribers_[id] = std::move(callback);
+  return id;
+}
+
+void BeringeiConfigurationAdapter::unsubscribeFromShardChanges(int64_t id) {
+  std::lock_guard<std::mutex> guard(subscribersMutex_);
+  subscribers_.erase(id);
 }
 
 bool isValidService(
@@ -11,13 +11,20 @@
 
 #include "BeringeiConfigurationLoader.h"
 
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include <folly/io/async/EventBaseManager.h>
 #include "beringei/client/BeringeiConfigurationAdapterIf.h"
 
 #include <folly/Synchronized.h>
+#include <folly/concurrency/AtomicSharedPtr.h>
 #include <folly/experimental/FunctionScheduler.h>
 
 namespace facebook {
@@ -30,6 +37,8 @@ class BeringeiConfigurationAdapter : public BeringeiConfigurationAdapterIf {
       // used by tests instead of setting the GFLAG
       std::string configurationFilePath = "");
 
+  ~BeringeiConfigurationAdapter() override;
+
   int getShardCount(const std::string& serviceName) override;
 
   bool getHostForShardId(
@@ -42,6 +51,16 @@ class BeringeiConfigurationAdapter : public BeringeiConfigurationAdapterIf {
       const std::string& serviceName,
       std::set<int64_t>& shardList) override;
 
+  void getFollowersForShardId(
+      int shardId,
+      const std::string& serviceName,
+      std::vector<std::pair<std::string, int>>& followers) override;
+
+  void getFollowedShardsForHost(
+      const std::pair<std::string, int>& hostInfo,
+      const std::string& serviceName,
+      std::set<int64_t>& shardList) override;
+
   uint64_t getShardForKey(
       folly::StringPiece key,
       uint64_t totalShards,
@@ -59,14 +78,45 @@ class BeringeiConfigurationAdapter : public BeringeiConfigurationAdapterIf {
 
   bool isValidReadService(const std::string& serviceName) override;
 
+  uint32_t getTransportCompressionMinBytes(
+      const std::string& serviceName) override;
+
+  int64_t subscribeToShardChanges(ShardsChangedCallback callback) override;
+
+  void unsubscribeFromShardChanges(int64_t id) override;
+
  private:
+  // The host of each shard of a service, indexed by shard id.
+  using ShardHosts = std::vector<std::pair<std::string, int>>;
+  using ShardHostsMap =
+      std::unordered_map<std::string, std::shared_ptr<const ShardHosts>>;
+
   void refreshConfiguration();
 
+  // Refreshes the configuration if the file changed since it was last
+  // checked.
+  void checkConfigurationFile();
+
+  void setConfiguration(BeringeiInternalConfiguration&& configuration);
+
   BeringeiConfigurationLoader loader_;
   folly::Synchronized<BeringeiInternalConfiguration> configuration_;
 
+  // Rebuilt from the configuration on every refresh and swapped in whole,
+  // so that routing a key to its host doesn't take any lock.
+  folly::atomic_shared_ptr<const ShardHostsMap> shardHosts_;
+
   static const uint32_t kConfigurationUpdateIntervalSecs;
   folly::FunctionScheduler configurationRefresher_;
+  std::string configurationFilePath_;
+
+  // The modification time, size and inode of the file when it was last
+  // checked, so that both edits and replacements are noticed.
+  std::tuple<int64_t, int64_t, int64_t> fileVersion_;
+
+  std::mutex subscribersMutex_;
+  std::map<int64_t, ShardsChangedCallback> subscribers_;
+  int64_t nextSubscriberId_ = 1;
 
   std::vector<std::string> readServices_;
   std::vector<std::string> writeServices_;
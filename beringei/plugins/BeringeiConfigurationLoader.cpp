@@ -9,6 +9,8 @@
 
 #include "BeringeiConfigurationLoader.h"
 
+#include <algorithm>
+
 #include <folly/FileUtil.h>
 #include <thrift/lib/cpp/util/ThriftSerializer.h>
 #include <thrift/lib/cpp2/protocol/Serializer.h>
@@ -74,6 +76,21 @@ bool BeringeiConfigurationLoader::isValidConfiguration(
         return logInvalidAndReturn("Invalid Shard Id");
       }
 
+      for (auto& follower : shard.followers) {
+        if (follower.port <= 0 || follower.hostAddress.empty()) {
+          return logInvalidAndReturn("Invalid follower address");
+        }
+
+        if (follower.hostAddress == shard.hostAddress &&
+            follower.port == shard.port) {
+          return logInvalidAndReturn(
+              folly::format(
+                  "The owner of shard {0} can't also follow it",
+                  shard.shardId)
+                  .str());
+        }
+      }
+
       if (shardList[shard.shardId]) {
         return logInvalidAndReturn(
             folly::format(
@@ -104,7 +121,10 @@ BeringeiConfigurationLoader::getInternalConfiguration(
     BeringeiInternalServiceInfo serviceInfo;
     serviceInfo.location = service.location;
     serviceInfo.isLoggingNewKeysEnabled = service.isLoggingNewKeysEnabled;
+    serviceInfo.transportCompressionMinBytes =
+        std::max(0, service.transportCompressionMinBytes);
     serviceInfo.shardMap.resize(service.shardMap.size());
+    serviceInfo.followerMap.resize(configuration.shardCount);
 
     for (auto& shard : service.shardMap) {
       BeringeiInternalHostInfo hostInfo;
@@ -116,6 +136,18 @@ BeringeiConfigurationLoader::getInternalConfiguration(
 
       serviceInfo.shardMap[shard.shardId] = std::move(hostInfo);
       serviceInfo.shardsPerHostMap[compactHostInfo].insert(shard.shardId);
+
+      for (auto& follower : shard.followers) {
+        BeringeiInternalHostInfo followerInfo;
+        followerInfo.hostAddress = follower.hostAddress;
+        followerInfo.port = follower.port;
+        serviceInfo.followedShardsPerHostMap
+            [followerInfo.hostAddress + ":" +
+             folly::to<std::string>(followerInfo.port)]
+                .insert(shard.shardId);
+        serviceInfo.followerMap[shard.shardId].push_back(
+            std::move(followerInfo));
+      }
     }
 
     out.serviceMap[service.serviceName] = std::move(serviceInfo);
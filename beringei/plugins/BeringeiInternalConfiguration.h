@@ -29,10 +29,17 @@ class BeringeiInternalServiceInfo {
 
   bool isLoggingNewKeysEnabled;
 
+  uint32_t transportCompressionMinBytes = 0;
+
   // map of <shardId, InternalHostInfo>
   std::vector<BeringeiInternalHostInfo> shardMap;
 
   std::unordered_map<std::string, std::set<int64_t>> shardsPerHostMap;
+
+  // The followers of each shard, indexed like shardMap.
+  std::vector<std::vector<BeringeiInternalHostInfo>> followerMap;
+
+  std::unordered_map<std::string, std::set<int64_t>> followedShardsPerHostMap;
 };
 
 class BeringeiInternalConfiguration {
@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "beringei/plugins/ShardPlacementPlanner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+
+namespace facebook {
+namespace gorilla {
+
+std::vector<double> ShardPlacementPlanner::getLoads(
+    const std::vector<ShardMetrics>& metrics,
+    const Weights& weights) {
+  ShardMetrics totals;
+  for (const auto& shard : metrics) {
+    totals.series += shard.series;
+    totals.bytes += shard.bytes;
+    totals.ingestRate += shard.ingestRate;
+    totals.queryRate += shard.queryRate;
+  }
+
+  auto fraction = [](double value, double total) {
+    return total > 0 ? value / total : 0;
+  };
+
+  std::vector<double> loads;
+  double totalLoad = 0;
+  for (const auto& shard : metrics) {
+    double load = weights.series * fraction(shard.series, totals.series) +
+        weights.bytes * fraction(shard.bytes, totals.bytes) +
+        weights.ingestRate * fraction(shard.ingestRate, totals.ingestRate) +
+        weights.queryRate * fraction(shard.queryRate, totals.queryRate);
+    loads.push_back(load);
+    totalLoad += load;
+  }
+
+  if (totalLoad <= 0) {
+    std::fill(loads.begin(), loads.end(), 1.0);
+  }
+  return loads;
+}
+
+std::vector<std::string> ShardPlacementPlanner::plan(
+    const std::vector<std::string>& hosts,
+    const std::vector<double>& loads,
+    const std::vector<std::string>& current,
+    double tolerance,
+    int& moves) {
+  moves = 0;
+  if (hosts.empty()) {
+    return std::vector<std::string>(loads.size());
+  }
+
+  std::unordered_map<std::string, size_t> hostIndexes;
+  for (size_t i = 0; i < hosts.size(); i++) {
+    hostIndexes.emplace(hosts[i], i);
+  }
+
+  std::vector<int> assignment(loads.size(), -1);
+  std::vector<double> hostLoads(hosts.size(), 0);
+  std::vector<size_t> unplaced;
+  for (size_t shard = 0; shard < loads.size(); shard++) {
+    auto it = shard < current.size() ? hostIndexes.find(current[shard])
+                                     : hostIndexes.end();
+    if (it == hostIndexes.end()) {
+      unplaced.push_back(shard);
+    } else {
+      assignment[shard] = it->second;
+      hostLoads[it->second] += loads[shard];
+    }
+  }
+
+  auto leastLoaded = [&]() {
+    return std::min_element(hostLoads.begin(), hostLoads.end()) -
+        hostLoads.begin();
+  };
+  auto mostLoaded = [&]() {
+    return std::max_element(hostLoads.begin(), hostLoads.end()) -
+        hostLoads.begin();
+  };
+
+  std::stable_sort(unplaced.begin(), unplaced.end(), [&](size_t a, size_t b) {
+    return loads[a] > loads[b];
+  });
+  for (size_t shard : unplaced) {
+    size_t host = leastLoaded();
+    assignment[shard] = host;
+    hostLoads[host] += loads[shard];
+  }
+
+  double mean = std::accumulate(loads.begin(), loads.end(), 0.0) /
+      hosts.size();
+  double limit = mean * (1 + tolerance);
+
+  // Each move lowers the sum of the squares of the host loads, so the
+  // moves can't go around in circles.
+  size_t maxMoves = loads.size() * hosts.size();
+  for (size_t i = 0; i < maxMoves; i++) {
+    size_t from = mostLoaded();
+    size_t to = leastLoaded();
+    double gap = hostLoads[from] - hostLoads[to];
+    if (hostLoads[from] <= limit || from == to) {
+      break;
+    }
+
+    // The shard that brings the two hosts closest to each other.
+    int best = -1;
+    for (size_t shard = 0; shard < loads.size(); shard++) {
+      if (assignment[shard] != from || loads[shard] <= 0 ||
+          loads[shard] >= gap) {
+        continue;
+      }
+      if (best < 0 ||
+          std::abs(loads[shard] - gap / 2) <
+              std::abs(loads[best] - gap / 2)) {
+        best = shard;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+
+    assignment[best] = to;
+    hostLoads[from] -= loads[best];
+    hostLoads[to] += loads[best];
+  }
+
+  std::vector<std::string> result;
+  for (size_t shard = 0; shard < loads.size(); shard++) {
+    result.push_back(hosts[assignment[shard]]);
+    if (shard < current.size() && !current[shard].empty() &&
+        current[shard] != result.back()) {
+      moves++;
+    }
+  }
+  return result;
+}
+}
+} // facebook::gorilla
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace gorilla {
+
+// class ShardPlacementPlanner
+//
+// Assigns shards to hosts so that the hosts get about the same load,
+// moving as few shards away from their current hosts as possible.
+class ShardPlacementPlanner {
+ public:
+  struct ShardMetrics {
+    double series = 0;
+    double bytes = 0;
+    double ingestRate = 0;
+    double queryRate = 0;
+  };
+
+  struct Weights {
+    double series = 1;
+    double bytes = 1;
+    double ingestRate = 1;
+    double queryRate = 1;
+  };
+
+  // Combines the metrics of each shard into one load. Each metric counts
+  // as its fraction of the total of all the shards, times its weight.
+  // Every shard gets the same load if there are no metrics at all.
+  static std::vector<double> getLoads(
+      const std::vector<ShardMetrics>& metrics,
+      const Weights& weights);
+
+  // Returns the host of each shard. `current` has the current host of
+  // each shard, or an empty string for shards that don't have one.
+  // Shards of hosts that aren't in `hosts` are placed on the hosts with
+  // the least load first, the biggest shards first. Then shards are
+  // moved from the busiest host to the least busy one until no host is
+  // more than `tolerance` above the mean load or no move helps. Sets
+  // `moves` to the number of shards that changed hosts.
+  static std::vector<std::string> plan(
+      const std::vector<std::string>& hosts,
+      const std::vector<double>& loads,
+      const std::vector<std::string>& current,
+      double tolerance,
+      int& moves);
+};
+}
+} // facebook::gorilla
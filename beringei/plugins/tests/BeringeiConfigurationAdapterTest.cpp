@@ -7,9 +7,18 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 
+#include <gflags/gflags.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
 #include <set>
 
 #include "beringei/plugins/BeringeiConfigurationAdapter.h"
@@ -17,6 +26,14 @@
 using namespace ::testing;
 using namespace facebook::gorilla;
 
+DECLARE_int32(beringei_configuration_watch_ms);
+
+static void copyFile(const std::string& from, const std::string& to) {
+  std::ifstream in(from);
+  std::ofstream out(to, std::ios::trunc);
+  out << in.rdbuf();
+}
+
 class BeringeiConfigurationAdapterTest : public testing::Test {
  public:
   const std::string configFile1_ =
@@ -168,3 +185,90 @@ TEST_F(BeringeiConfigurationAdapterTest, IsLoggingNewKeysEnabledTest) {
   EXPECT_FALSE(
       configurationAdapter1_.isLoggingNewKeysEnabled("invalid-service"));
 }
+
+TEST_F(BeringeiConfigurationAdapterTest, TransportCompressionTest) {
+  EXPECT_EQ(
+      0,
+      configurationAdapter1_.getTransportCompressionMinBytes(westServiceName_));
+  EXPECT_EQ(
+      65536,
+      configurationAdapter2_.getTransportCompressionMinBytes(westServiceName_));
+  EXPECT_EQ(
+      0,
+      configurationAdapter2_.getTransportCompressionMinBytes(
+          invalidServiceName_));
+}
+
+TEST_F(BeringeiConfigurationAdapterTest, FollowersTest) {
+  std::vector<std::pair<std::string, int>> followers;
+  configurationAdapter2_.getFollowersForShardId(
+      0, westServiceName_, followers);
+  ASSERT_EQ(2, followers.size());
+  EXPECT_EQ("beringei-host-2", followers[0].first);
+  EXPECT_EQ(9999, followers[0].second);
+  EXPECT_EQ("beringei-host-3", followers[1].first);
+
+  configurationAdapter2_.getFollowersForShardId(
+      1, westServiceName_, followers);
+  EXPECT_TRUE(followers.empty());
+  configurationAdapter2_.getFollowersForShardId(
+      0, invalidServiceName_, followers);
+  EXPECT_TRUE(followers.empty());
+  configurationAdapter1_.getFollowersForShardId(
+      0, westServiceName_, followers);
+  EXPECT_TRUE(followers.empty());
+
+  std::set<int64_t> shards;
+  configurationAdapter2_.getFollowedShardsForHost(
+      std::make_pair(std::string("beringei-host-3"), 9999),
+      westServiceName_,
+      shards);
+  EXPECT_EQ(std::set<int64_t>({0}), shards);
+  configurationAdapter2_.getFollowedShardsForHost(
+      std::make_pair(std::string("beringei-host-1"), 9999),
+      westServiceName_,
+      shards);
+  EXPECT_TRUE(shards.empty());
+}
+
+TEST_F(BeringeiConfigurationAdapterTest, ShardChangesTest) {
+  FLAGS_beringei_configuration_watch_ms = 10;
+  char path[] = "/tmp/beringei_config_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  close(fd);
+  copyFile(configFile1_, path);
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::pair<std::string, std::vector<int64_t>>> changes;
+  {
+    BeringeiConfigurationAdapter adapter(true, path);
+    int64_t id = adapter.subscribeToShardChanges(
+        [&](const std::string& serviceName,
+            const std::vector<int64_t>& shardIds) {
+          std::lock_guard<std::mutex> guard(mutex);
+          changes.emplace_back(serviceName, shardIds);
+          changed.notify_all();
+        });
+    ASSERT_NE(0, id);
+
+    // Shards 1 and 2 move to other hosts and shard 3 goes away.
+    copyFile(configFile2_, path);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait_for(
+          lock, std::chrono::seconds(10), [&]() { return !changes.empty(); });
+    }
+    adapter.unsubscribeFromShardChanges(id);
+
+    std::pair<std::string, int> hostInfo;
+    ASSERT_TRUE(adapter.getHostForShardId(1, westServiceName_, hostInfo));
+    EXPECT_EQ("beringei-host-2", hostInfo.first);
+  }
+  unlink(path);
+
+  ASSERT_EQ(1, changes.size());
+  EXPECT_EQ(westServiceName_, changes[0].first);
+  EXPECT_EQ(std::vector<int64_t>({1, 2, 3}), changes[0].second);
+}
@@ -71,6 +71,19 @@ TEST_F(BeringeiConfigurationValidationTest, NegativePort) {
   EXPECT_FALSE(loader_.isValidConfiguration(configuration));
 }
 
+TEST_F(BeringeiConfigurationValidationTest, InvalidFollower) {
+  auto configuration = configurationBase_;
+  configuration.serviceMap[0].shardMap[0].followers[0].port = 0;
+  EXPECT_FALSE(loader_.isValidConfiguration(configuration));
+}
+
+TEST_F(BeringeiConfigurationValidationTest, OwnerFollowsItsShard) {
+  auto configuration = configurationBase_;
+  configuration.serviceMap[0].shardMap[0].followers[0].hostAddress =
+      "beringei-host-1";
+  EXPECT_FALSE(loader_.isValidConfiguration(configuration));
+}
+
 // Valid Configuration Tests
 TEST_F(BeringeiConfigurationValidationTest, LoadValidConfig) {
   EXPECT_TRUE(loader_.isValidConfiguration(configurationBase_));
@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+#include "beringei/plugins/ShardPlacementPlanner.h"
+
+using namespace ::testing;
+using namespace facebook::gorilla;
+using namespace std;
+
+static double maxHostLoad(
+    const vector<string>& hosts,
+    const vector<double>& loads,
+    const vector<string>& assignment) {
+  double result = 0;
+  for (const auto& host : hosts) {
+    double load = 0;
+    for (size_t i = 0; i < loads.size(); i++) {
+      if (assignment[i] == host) {
+        load += loads[i];
+      }
+    }
+    result = max(result, load);
+  }
+  return result;
+}
+
+TEST(ShardPlacementPlannerTest, RoundRobin) {
+  int moves = -1;
+  auto assignment = ShardPlacementPlanner::plan(
+      {"a", "b", "c"}, vector<double>(6, 1), {}, 0.05, moves);
+  EXPECT_EQ(vector<string>({"a", "b", "c", "a", "b", "c"}), assignment);
+  EXPECT_EQ(0, moves);
+}
+
+TEST(ShardPlacementPlannerTest, KeepsBalancedHosts) {
+  vector<string> current = {"a", "a", "b", "b", "c", "c"};
+  int moves = -1;
+  auto assignment = ShardPlacementPlanner::plan(
+      {"a", "b", "c"}, {3, 1, 2, 2, 1, 3}, current, 0.05, moves);
+  EXPECT_EQ(current, assignment);
+  EXPECT_EQ(0, moves);
+}
+
+TEST(ShardPlacementPlannerTest, MovesFromHotHost) {
+  vector<double> loads = {10, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+  vector<string> hosts = {"a", "b"};
+  vector<string> current(loads.size(), "a");
+  current[1] = "b";
+
+  int moves = 0;
+  auto assignment =
+      ShardPlacementPlanner::plan(hosts, loads, current, 0.1, moves);
+  EXPECT_EQ(10, maxHostLoad(hosts, loads, assignment));
+  EXPECT_EQ(2, moves);
+  EXPECT_EQ(1, count(assignment.begin(), assignment.end(), assignment[0]));
+}
+
+TEST(ShardPlacementPlannerTest, ReplacesRemovedHosts) {
+  vector<string> current = {"a", "b", "c", "a", "b", "c"};
+  int moves = 0;
+  auto assignment = ShardPlacementPlanner::plan(
+      {"a", "b"}, vector<double>(6, 1), current, 0, moves);
+  EXPECT_EQ(2, moves);
+  EXPECT_EQ(3, count(assignment.begin(), assignment.end(), "a"));
+  EXPECT_EQ(3, count(assignment.begin(), assignment.end(), "b"));
+  for (int i : {0, 1, 3, 4}) {
+    EXPECT_EQ(current[i], assignment[i]);
+  }
+}
+
+TEST(ShardPlacementPlannerTest, Loads) {
+  vector<ShardPlacementPlanner::ShardMetrics> metrics(2);
+  metrics[0].series = 3;
+  metrics[1].series = 1;
+  metrics[0].queryRate = 10;
+  ShardPlacementPlanner::Weights weights;
+  weights.queryRate = 2;
+
+  auto loads = ShardPlacementPlanner::getLoads(metrics, weights);
+  ASSERT_EQ(2, loads.size());
+  EXPECT_DOUBLE_EQ(0.75 + 2, loads[0]);
+  EXPECT_DOUBLE_EQ(0.25, loads[1]);
+
+  // Without metrics every shard counts the same.
+  loads = ShardPlacementPlanner::getLoads(
+      vector<ShardPlacementPlanner::ShardMetrics>(3), weights);
+  EXPECT_EQ(vector<double>({1, 1, 1}), loads);
+}
@@ -17,12 +17,14 @@
 #include <thrift/lib/cpp/concurrency/Mutex.h>
 #include <thrift/lib/cpp/concurrency/PosixThreadFactory.h>
 #include <thrift/lib/cpp/concurrency/Thread.h>
+#include <thrift/lib/cpp/concurrency/ThreadManager.h>
 #include <thrift/lib/cpp/transport/THeader.h>
 #include <thrift/lib/cpp/util/ScopedServerThread.h>
 #include <thrift/lib/cpp2/async/AsyncProcessor.h>
 #include <thrift/lib/cpp2/server/BaseThriftServer.h>
 #include <thrift/lib/cpp2/server/ThriftServer.h>
 
+#include <array>
 #include <chrono>
 
 DEFINE_int32(port, 9999, "Port for the server thrift service");
@@ -35,6 +37,27 @@ DEFINE_int32(
     num_thrift_pool_threads,
     64,
     "Number of thrift pool threads. Recommended value is 2x # of cores");
+DEFINE_int32(
+    num_thrift_read_threads,
+    0,
+    "Run getData calls on their own pool of this many threads, with "
+    "putDataPoints and scanShard on pools of their own too, so that scans "
+    "and writes don't delay reads. 0 runs all the calls on the "
+    "--num_thrift_pool_threads pool.");
+DEFINE_int32(
+    num_thrift_write_threads,
+    16,
+    "Number of threads for putDataPoints with --num_thrift_read_threads");
+DEFINE_int32(
+    num_thrift_scan_threads,
+    4,
+    "Number of threads for scanShard with --num_thrift_read_threads");
+DEFINE_int32(
+    transport_compression_min_bytes,
+    0,
+    "Responses of at least this many bytes to clients that compress their "
+    "requests are compressed with the same transform, e.g. zstd for the "
+    "clients in other regions. 0 leaves all responses uncompressed.");
 DEFINE_int64(
     task_expire_time_ms,
     10000, // 10 second default
@@ -47,6 +70,10 @@ DEFINE_string(
 
 using namespace facebook;
 using namespace facebook::gorilla;
+using apache::thrift::concurrency::PriorityThreadManager;
+
+// Threads for the calls without a priority of their own.
+const int kOtherThriftThreads = 2;
 
 BeringeiServiceHandler* handlerPtr;
 std::shared_ptr<apache::thrift::ThriftServer> server;
@@ -70,10 +97,29 @@ int main(int argc, char** argv) {
   server->setPort(FLAGS_port);
   server->setInterface(std::move(handler));
   server->setNWorkerThreads(fLI::FLAGS_num_thrift_worker_threads);
-  server->setNPoolThreads(fLI::FLAGS_num_thrift_pool_threads);
+  if (fLI::FLAGS_num_thrift_read_threads > 0) {
+    // Pools in the order of apache::thrift::concurrency::PRIORITY.
+    std::array<size_t, apache::thrift::concurrency::N_PRIORITIES> threads = {{
+        1, // HIGH_IMPORTANT
+        (size_t)fLI::FLAGS_num_thrift_read_threads, // HIGH
+        (size_t)std::max(1, fLI::FLAGS_num_thrift_write_threads), // IMPORTANT
+        kOtherThriftThreads, // NORMAL
+        (size_t)std::max(1, fLI::FLAGS_num_thrift_scan_threads), // BEST_EFFORT
+    }};
+    auto threadManager =
+        PriorityThreadManager::newPriorityThreadManager(threads);
+    threadManager->setNamePrefix("beringei");
+    threadManager->start();
+    server->setThreadManager(threadManager);
+  } else {
+    server->setNPoolThreads(fLI::FLAGS_num_thrift_pool_threads);
+  }
   server->setTaskExpireTime(
       std::chrono::milliseconds(fLI64::FLAGS_task_expire_time_ms));
   server->setStopWorkersOnStopListening(false);
+  if (fLI::FLAGS_transport_compression_min_bytes > 0) {
+    server->setMinCompressBytes(fLI::FLAGS_transport_compression_min_bytes);
+  }
   LOG(INFO) << fLS::FLAGS_service_name
             << " brought up on port: " << fLI::FLAGS_port << ", with "
             << fLI::FLAGS_num_thrift_worker_threads
@@ -10,22 +10,36 @@
 #include "beringei/service/BeringeiServiceHandler.h"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <set>
 
 #include <folly/Random.h>
 #include <folly/experimental/FunctionScheduler.h>
+#include <thrift/lib/cpp/async/TAsyncSocket.h>
+#include <thrift/lib/cpp2/async/HeaderClientChannel.h>
 
+#include "beringei/lib/Aggregation.h"
+#include "beringei/lib/BlockFileStore.h"
 #include "beringei/lib/BucketLogWriter.h"
 #include "beringei/lib/BucketMap.h"
 #include "beringei/lib/BucketStorage.h"
 #include "beringei/lib/BucketUtils.h"
 #include "beringei/lib/FileUtils.h"
+#include "beringei/lib/GetDataCache.h"
 #include "beringei/lib/GorillaStatsManager.h"
 #include "beringei/lib/GorillaTimeConstants.h"
 #include "beringei/lib/KeyListWriter.h"
 #include "beringei/lib/NetworkUtils.h"
+#include "beringei/lib/PartitionedBucketLogWriter.h"
+#include "beringei/lib/ShardTransfer.h"
 #include "beringei/lib/TimeSeries.h"
 #include "beringei/lib/Timer.h"
+#include "beringei/lib/Tracing.h"
 
 DECLARE_int32(gorilla_shards);
 DEFINE_int32(buckets, 13, "Number of historical buckets to use");
@@ -57,10 +71,117 @@ DEFINE_int32(
     1000,
     "The size of queue for each log writer thread");
 DEFINE_int32(log_writer_threads, 8, "The number of log writer threads");
+DEFINE_int32(
+    shard_executor_threads,
+    0,
+    "Add the points of each shard on one of this many threads that owns "
+    "the shard, instead of on the thrift threads. Matching "
+    "--log_writer_threads and --key_writer_threads makes the threads of a "
+    "shard have the same index. 0 adds them on the thrift threads.");
+DEFINE_int32(
+    shard_executor_queue_size,
+    10000,
+    "The size of the inbox of each shard executor thread");
+DEFINE_int32(
+    shard_executor_first_cpu,
+    -1,
+    "Pin shard executor thread i to CPU i plus this. Negative doesn't pin "
+    "the threads, or binds them to the NUMA node of their shards with "
+    "--numa_shards.");
 DEFINE_int32(
     block_writer_threads,
     4,
     "The number of threads for writing completed blocks");
+DEFINE_int32(
+    maintenance_threads,
+    4,
+    "The number of threads for purging time series and cleaning shards");
+DEFINE_int64(
+    heavy_read_cost,
+    0,
+    "getData requests for more than this many key buckets (keys times "
+    "buckets in the time range) only run --max_concurrent_heavy_reads at a "
+    "time, so that they can't take all the threads from the cheap ones. 0 "
+    "disables it.");
+DEFINE_int32(
+    max_concurrent_heavy_reads,
+    4,
+    "The number of getData requests over --heavy_read_cost that can run at "
+    "the same time");
+DEFINE_bool(
+    trim_get_data_blocks,
+    true,
+    "Trim the blocks returned by getData to the requested time range "
+    "instead of returning whole buckets.");
+DEFINE_int32(
+    get_data_checkpoint_interval,
+    512,
+    "Add a decoder checkpoint every this many values to the blocks "
+    "returned by getData that have more values, so that clients can "
+    "decode a part of a long block without reading it from the start. 0 "
+    "disables checkpoints.");
+DEFINE_int32(
+    aggregate_batch_size,
+    10000,
+    "Number of keys that aggregate reads and reduces at a time, which "
+    "bounds the blocks held in memory");
+DEFINE_bool(
+    coalesce_get_data_blocks,
+    false,
+    "Return the finalized buckets of each key in getData as one block "
+    "instead of one block per bucket.");
+DEFINE_int32(
+    coalesced_block_cache_mb,
+    0,
+    "Keep this many MB of the blocks coalesced by "
+    "--coalesce_get_data_blocks, so that historical ranges that are read "
+    "often aren't re-encoded every time. 0 disables the cache.");
+DEFINE_int32(
+    get_data_cache_mb,
+    0,
+    "Keep the results of this many MB of recent getData requests, so that "
+    "the same request from many dashboards is only run once. Identical "
+    "requests that arrive while one is running wait for its result. 0 "
+    "disables the cache.");
+DEFINE_int32(
+    get_data_cache_open_ttl_ms,
+    0,
+    "Keep the results of the getData requests that read buckets that can "
+    "still change for this long. Results of finalized buckets are kept "
+    "until the next bucket is finalized. 0 only shares them with the "
+    "identical requests that are running.");
+DEFINE_string(
+    block_file_store_directory,
+    "",
+    "Copy finalized block files to this directory, e.g. a mounted "
+    "S3-compatible bucket, and read the buckets older than the ones in "
+    "memory from there in getData. Empty keeps block files only locally.");
+DEFINE_double(
+    put_shed_queue_fill,
+    0,
+    "Reject puts with OVERLOADED while a key or log writer queue is fuller "
+    "than this fraction, instead of letting the queue drop them. 0 "
+    "disables it.");
+DEFINE_bool(
+    put_shed_when_low_on_memory,
+    false,
+    "Reject all puts with OVERLOADED while low on memory, not only the ones "
+    "for new time series");
+DEFINE_int64(
+    put_shed_latency_us,
+    0,
+    "Reject a growing fraction of the puts with OVERLOADED while the moving "
+    "average of the put latency is above this. 0 disables it.");
+DEFINE_double(
+    new_keys_fraction_when_memory_grows,
+    0.1,
+    "Fraction of the puts that can create new time series while the "
+    "memory usage is predicted to go over the cap soon");
+DEFINE_int32(
+    memory_pressure_interval_secs,
+    10,
+    "How often to check the memory pressure and evict the oldest finalized "
+    "bucket of each shard while it's high. 0 disables.");
 DEFINE_bool(
     create_directories,
     false,
@@ -69,11 +190,65 @@ DEFINE_int64(
     sleep_between_bucket_finalization_secs,
     600, // 10 min
     "Time to sleep between finalizing buckets");
+DEFINE_int32(
+    snapshot_interval_secs,
+    0,
+    "Write a snapshot of the open bucket of each owned shard this often, so "
+    "that restarting only replays the logs written after it. 0 disables.");
+DEFINE_int32(
+    deviation_index_interval_secs,
+    0,
+    "Index the values of the owned shards that are more than "
+    "--deviation_index_sigma standard deviations from their mean this "
+    "often, for getDeviatingKeys. 0 disables the index.");
+DEFINE_double(
+    deviation_index_sigma,
+    3.0,
+    "Number of standard deviations from the mean that a value has to be to "
+    "be indexed");
+DEFINE_int32(
+    deviation_window_secs,
+    facebook::gorilla::kGorillaSecondsPerHour,
+    "The mean and standard deviation of the index are computed over the "
+    "values of this many seconds before now");
+DEFINE_bool(
+    shard_transfer,
+    false,
+    "Copy the files of a shard from its previous owner before loading it, "
+    "instead of expecting them in the data directory already.");
+DEFINE_bool(
+    remote_shard_logs,
+    false,
+    "With --shard_transfer, read the log files of a shard straight from its "
+    "previous owner while loading it instead of copying them first, so that "
+    "the points it logged during the transfer aren't lost.");
 DEFINE_bool(
     disable_shard_refresh,
     false,
     "Disable shard refresh thread. Primarily used by tests, affects default "
     "shard map ownership assumptions.");
+DEFINE_int32(
+    subscription_buffer_size,
+    100000,
+    "The most data points kept for a subscriber between polls");
+DEFINE_int32(max_subscriptions, 1000, "The number of subscriptions allowed");
+DEFINE_int32(
+    subscription_idle_timeout_secs,
+    60,
+    "Remove subscriptions that haven't been polled for this long");
+DEFINE_int32(
+    max_subscription_poll_ms,
+    10000,
+    "The longest pollSubscription waits for new data points");
+DEFINE_int32(
+    replication_interval_ms,
+    1000,
+    "How often the new keys and data points of the owned shards are sent "
+    "to the hosts that follow them");
+DEFINE_int32(
+    replication_queue_points,
+    1000000,
+    "The most data points queued per shard for a follower that is behind");
 
 namespace facebook {
 namespace gorilla {
@@ -82,18 +257,46 @@ const static std::string kPurgedTimeSeries = "purged_time_series";
 const static std::string kPurgedTimeSeriesInCategoryPrefix =
     "purged_time_series_in_category_";
 const int kPurgeInterval = facebook::gorilla::kGorillaSecondsPerHour;
+const static std::string kMsPerPurge = "ms_per_purge";
+const static std::string kEvictedBuckets = "memory_pressure_evicted_buckets";
+
+// Rows checked and erased at a time when purging.
+const int kPurgeBatchSize = 10000;
 const static std::string kMsPerKeyListCompact = "ms_per_key_list_compact";
 const int kCleanInterval = 6 * facebook::gorilla::kGorillaSecondsPerHour;
 const static std::string kTooSlowToFinalizeBuckets =
     "too_slow_to_finalize_buckets";
 const static std::string kMsPerFinalizeShardBucket =
     "ms_per_finalize_shard_bucket";
+const static std::string kMsPerFinalizeBuckets = "ms_per_finalize_buckets";
+const static std::string kMsPerShardFinalize = "ms_per_shard_finalize";
+const static std::string kMsPerShardTransfer = "ms_per_shard_transfer";
+const static std::string kShardTransferBytes = "shard_transfer_bytes";
+const static std::string kShardTransferBytesSent = "shard_transfer_bytes_sent";
+const static std::string kShardTransferFailures = "shard_transfer_failures";
 const static std::string kUsPerGet = "us_per_get";
+const static std::string kGetDataCost = "get_data_cost";
+const static std::string kHeavyReads = "heavy_reads";
+const static std::string kMsWaitingForHeavyRead = "ms_waiting_for_heavy_read";
 const static std::string kUsPerGetPerKey = "us_per_get_per_key";
 const static std::string kUsPerPut = "us_per_put";
+const static std::string kUsPerScanShard = "us_per_scan_shard";
 const static std::string kUsPerPutPerKey = "us_per_put_per_key";
 const static std::string kKeysPut = "keys_put";
+const static std::string kPutsShed = "puts_shed";
+const static std::string kDatapointsShed = "datapoints_shed";
+const static std::string kDatapointsWithKeyIds = "datapoints_with_key_ids";
+const static std::string kKeyIdsRejected = "key_ids_rejected";
+const static std::string kEncodedDatapoints = "encoded_datapoints";
+const static std::string kEncodedEntriesRejected = "encoded_entries_rejected";
+
+// Weight of the newest put in the moving average of the latency.
+const int kPutLatencyAverageWeight = 16;
+
+// Some of the puts always go through so that the latency is measured.
+const double kMaxPutShedFraction = 0.9;
 const static std::string kKeysGot = "keys_got";
+const static std::string kKeysGotFromRollups = "keys_got_from_rollups";
 static const std::string kMissingTooMuchData = "status_missing_too_much_data";
 const static std::string kNewKeys = "new_keys";
 const static std::string kDatapointsAdded = "datapoints_added";
@@ -110,14 +313,236 @@ const static std::string kShardsBeingAdded = "shards_being_added";
 const static std::string kShardsDropped = "shards_dropped";
 const static std::string kUsPerGetLastUpdateTimes =
     "us_per_get_last_update_times";
+const static std::string kUsPerSearchKeys = "us_per_search_keys";
+const static std::string kUsPerGetResourceUsage = "us_per_get_resource_usage";
+const static std::string kKeysSearched = "keys_searched";
+const static std::string kUsPerAggregate = "us_per_aggregate";
+const static std::string kMsPerDeviationIndex = "ms_per_deviation_index";
+const static std::string kDeviationsIndexed = "deviations_indexed";
+const static std::string kUsPerGetDeviatingKeys = "us_per_get_deviating_keys";
+const static std::string kKeysAggregated = "keys_aggregated";
+const static std::string kMsPerBackfill = "ms_per_backfill";
+const static std::string kBackfilledDatapoints = "backfilled_datapoints";
+const static std::string kBackfillDroppedDatapoints =
+    "backfill_dropped_datapoints";
+
+// Added for single data points.
+static GorillaStat datapointsBehindStat(kDatapointsBehind);
+static GorillaStat datapointsAheadStat(kDatapointsAhead);
+static GorillaStat tooLongKeysStat(kTooLongKeys);
 
 // Max size for ODS key is 256 and entity 128. This will fit those and
 // some extra characters.
 const int kMaxKeyLength = 400;
 const int kRefreshShardMapInterval = 60; // poll every minute
 
-// Unique hash seed for the `scanShard` thrift call.
-const uint64_t kDataScanSeed = 0xDA7A5CA9;
+// Number of rows copied out of the map at a time by `scanShard`.
+const int64_t kScanShardBatchSize = 10000;
+
+// Most bytes of a file sent by one `transferShard` call.
+const int32_t kShardTransferChunkBytes = 16 * 1024 * 1024;
+const int kShardTransferTimeoutMs = 60000;
+const int kReplicationTimeoutMs = 10000;
+
+namespace {
+
+// Holds one of the --max_concurrent_heavy_reads slots while in scope.
+class HeavyReadSlot {
+ public:
+  HeavyReadSlot(
+      std::mutex& mutex,
+      std::condition_variable& condition,
+      int& active)
+      : mutex_(mutex), condition_(condition), active_(active) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_.wait(lock, [this]() {
+      return active_ < std::max(1, FLAGS_max_concurrent_heavy_reads);
+    });
+    active_++;
+  }
+
+  ~HeavyReadSlot() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      active_--;
+    }
+    condition_.notify_one();
+  }
+
+ private:
+  std::mutex& mutex_;
+  std::condition_variable& condition_;
+  int& active_;
+};
+}
+
+// Reads the log files of the shards that were copied from another host
+// from that host, through transferShard().
+class ShardOwnerLogFileSource : public LogFileSource {
+ public:
+  void setOwner(int64_t shardId, const std::pair<std::string, int>& owner) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    owners_[shardId] = owner;
+  }
+
+  bool listLogFiles(uint32_t shardId, std::vector<int64_t>& ids) override {
+    std::pair<std::string, int> owner;
+    if (!getOwner(shardId, owner)) {
+      return false;
+    }
+
+    try {
+      TransferShardRequest request;
+      request.shardId = shardId;
+      TransferShardResult result;
+      call(owner, request, result);
+      if (result.status != StatusCode::OK) {
+        return false;
+      }
+
+      for (const auto& file : result.files) {
+        if (file.prefix == BucketLogWriter::kLogFilePrefix) {
+          ids.push_back(file.id);
+        }
+      }
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Listing the log files of shard " << shardId << " on "
+                 << owner.first << " failed: " << e.what();
+      return false;
+    }
+    std::sort(ids.begin(), ids.end());
+    return true;
+  }
+
+  bool readLogFile(uint32_t shardId, int64_t id, std::string& data) override {
+    std::pair<std::string, int> owner;
+    if (!getOwner(shardId, owner)) {
+      return false;
+    }
+
+    try {
+      TransferShardRequest request;
+      request.shardId = shardId;
+      request.file.prefix = BucketLogWriter::kLogFilePrefix;
+      request.file.id = id;
+      request.maxBytes = kShardTransferChunkBytes;
+
+      bool endOfFile = false;
+      while (!endOfFile) {
+        TransferShardResult chunk;
+        call(owner, request, chunk);
+        if (chunk.status != StatusCode::OK) {
+          return false;
+        }
+        data.append(chunk.data);
+        request.offset += chunk.data.size();
+        endOfFile = chunk.endOfFile || chunk.data.empty();
+      }
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Reading log file " << id << " of shard " << shardId
+                 << " on " << owner.first << " failed: " << e.what();
+      return false;
+    }
+    GorillaStatsManager::addStatValue(kShardTransferBytes, data.size());
+    return true;
+  }
+
+ private:
+  bool getOwner(int64_t shardId, std::pair<std::string, int>& owner) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = owners_.find(shardId);
+    if (it == owners_.end()) {
+      return false;
+    }
+    owner = it->second;
+    return true;
+  }
+
+  // Log files are read on several threads, so each call gets a client of
+  // its own.
+  static void call(
+      const std::pair<std::string, int>& owner,
+      const TransferShardRequest& request,
+      TransferShardResult& result) {
+    folly::EventBase eb;
+    folly::SocketAddress address(owner.first, owner.second, true);
+    auto channel = apache::thrift::HeaderClientChannel::newChannel(
+        apache::thrift::async::TAsyncSocket::newSocket(&eb, address));
+    channel->setTimeout(kShardTransferTimeoutMs);
+    BeringeiServiceAsyncClient client(std::move(channel));
+    client.sync_transferShard(result, request);
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<int64_t, std::pair<std::string, int>> owners_;
+};
+
+// Sends the batches of the ShardReplicator to the followers. Only used
+// from the replication thread, which keeps a client per follower.
+class ReplicationSender {
+ public:
+  bool send(
+      const std::pair<std::string, int>& follower,
+      const AppendKeysRequest& keys,
+      const LogDataPointsRequest& points,
+      std::set<int64_t>& rejectedShards) {
+    try {
+      auto& client = getClient(follower);
+      if (!keys.keys.empty()) {
+        ReplicationResult result;
+        client.sync_appendKeys(result, keys);
+        rejectedShards.insert(
+            result.rejectedShards.begin(), result.rejectedShards.end());
+      }
+
+      // The points of the shards whose keys were rejected are sent again
+      // with the keys.
+      LogDataPointsRequest accepted;
+      const LogDataPointsRequest* request = &points;
+      if (!rejectedShards.empty()) {
+        for (const auto& point : points.points) {
+          if (rejectedShards.count(point.shardId) == 0) {
+            accepted.points.push_back(point);
+          }
+        }
+        request = &accepted;
+      }
+
+      if (!request->points.empty()) {
+        ReplicationResult result;
+        client.sync_logDataPoints(result, *request);
+        rejectedShards.insert(
+            result.rejectedShards.begin(), result.rejectedShards.end());
+      }
+    } catch (std::exception& e) {
+      LOG(ERROR) << "Replicating to " << follower.first << ":"
+                 << follower.second << " failed: " << e.what();
+      clients_.erase(follower);
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  BeringeiServiceAsyncClient& getClient(
+      const std::pair<std::string, int>& follower) {
+    auto& client = clients_[follower];
+    if (!client) {
+      folly::SocketAddress address(follower.first, follower.second, true);
+      auto channel = apache::thrift::HeaderClientChannel::newChannel(
+          apache::thrift::async::TAsyncSocket::newSocket(&eb_, address));
+      channel->setTimeout(kReplicationTimeoutMs);
+      client = std::make_unique<BeringeiServiceAsyncClient>(std::move(channel));
+    }
+    return *client;
+  }
+
+  folly::EventBase eb_;
+  std::map<
+      std::pair<std::string, int>,
+      std::unique_ptr<BeringeiServiceAsyncClient>>
+      clients_;
+};
 
 BeringeiServiceHandler::BeringeiServiceHandler(
     std::shared_ptr<BeringeiConfigurationAdapterIf> configAdapter,
@@ -132,7 +557,15 @@ BeringeiServiceHandler::BeringeiServiceHandler(
       port_(port),
       adjustTimestamps_(adjustTimestamps),
       logReaderFactory_(
-          std::make_shared<LocalLogReaderFactory>(FLAGS_data_directory)) {
+          std::make_shared<LocalLogReaderFactory>(FLAGS_data_directory)),
+      heavyReads_(0),
+      putLatencyUs_(0) {
+  if (FLAGS_shard_transfer && FLAGS_remote_shard_logs) {
+    logFileSource_ = std::make_shared<ShardOwnerLogFileSource>();
+    logReaderFactory_ = std::make_shared<RemoteLogReaderFactory>(
+        FLAGS_data_directory, logFileSource_);
+  }
+
   // the number of threads for each thread pool must exceed 0
   CHECK_GT(fLI::FLAGS_key_writer_threads, 0);
   CHECK_GT(fLI::FLAGS_log_writer_threads, 0);
@@ -154,39 +587,76 @@ BeringeiServiceHandler::BeringeiServiceHandler(
   KeyListWriter::startMonitoring();
   BucketStorage::startMonitoring();
 
-  std::vector<std::shared_ptr<KeyListWriter>> keyWriters;
-  for (int i = 0; i < FLAGS_key_writer_threads; i++) {
-    keyWriters.emplace_back(
-        new KeyListWriter(FLAGS_data_directory, FLAGS_key_writer_queue_size));
+  if (!FLAGS_block_file_store_directory.empty()) {
+    BlockFileStore::setInstance(std::make_shared<DirectoryBlockFileStore>(
+        FLAGS_block_file_store_directory));
   }
 
-  std::vector<std::shared_ptr<BucketLogWriter>> bucketLogWriters;
-  for (int i = 0; i < FLAGS_log_writer_threads; i++) {
-    bucketLogWriters.emplace_back(new BucketLogWriter(
-        FLAGS_bucket_size,
-        FLAGS_data_directory,
-        FLAGS_log_writer_queue_size,
-        FLAGS_allowed_timestamp_behind));
+  if (FLAGS_shard_executor_threads > 0) {
+    shardExecutor_ = std::make_unique<ShardExecutor>(
+        FLAGS_shard_executor_threads,
+        FLAGS_shard_executor_queue_size,
+        FLAGS_shard_executor_first_cpu,
+        shards_.getNumaTopology());
+  }
+
+  if (FLAGS_coalesce_get_data_blocks && FLAGS_coalesced_block_cache_mb > 0) {
+    coalescedBlockCache_ = std::make_unique<CoalescedBlockCache>(
+        (size_t)FLAGS_coalesced_block_cache_mb << 20);
+  }
+
+  if (FLAGS_get_data_cache_mb > 0) {
+    getDataCache_ =
+        std::make_unique<GetDataCache>((size_t)FLAGS_get_data_cache_mb << 20);
   }
 
+  // Like the log writers, the key writer threads each get the shards
+  // with the same id modulo the number of threads.
+  keyWriter_ = std::make_shared<KeyListWriter>(
+      FLAGS_data_directory,
+      FLAGS_key_writer_queue_size,
+      FLAGS_key_writer_threads);
+
+  // Shards are assigned to the log writer threads by modulo so that
+  // every thread gets the same number of shards.
+  logWriter_ = std::make_shared<PartitionedBucketLogWriter>(
+      FLAGS_log_writer_threads,
+      FLAGS_bucket_size,
+      FLAGS_data_directory,
+      FLAGS_log_writer_queue_size,
+      FLAGS_allowed_timestamp_behind);
+
+  subscriptions_ = std::make_shared<SubscriptionManager>(
+      FLAGS_gorilla_shards,
+      std::max(1, FLAGS_subscription_buffer_size),
+      std::max(0, FLAGS_max_subscriptions),
+      (int64_t)FLAGS_subscription_idle_timeout_secs * kGorillaMsPerSecond);
+
+  auto sender = std::make_shared<ReplicationSender>();
+  replicator_ = std::make_shared<ShardReplicator>(
+      FLAGS_gorilla_shards,
+      std::max(1, FLAGS_replication_queue_points),
+      [sender](
+          const std::pair<std::string, int>& follower,
+          const AppendKeysRequest& keys,
+          const LogDataPointsRequest& points,
+          std::set<int64_t>& rejectedShards) {
+        return sender->send(follower, keys, points, rejectedShards);
+      });
+
   srandom(folly::randomNumberSeed());
   for (int i = 0; i < FLAGS_gorilla_shards; i++) {
-    // Select the bucket log writer and block writer for each shard by
-    // random instead of by modulo to allow better distribution
-    // because sharding algorithm used by Shard Manager is
-    // unknown. The distribution doesn't have to be even. As long as
-    // it's somewhat distributed it should be fine.
-    auto keyWriter = keyWriters[random() % keyWriters.size()];
-    auto bucketLogWriter = bucketLogWriters[random() % bucketLogWriters.size()];
     auto map = std::make_unique<BucketMap>(
         FLAGS_buckets,
         FLAGS_bucket_size,
         i,
         FLAGS_data_directory,
-        keyWriter,
-        bucketLogWriter,
+        keyWriter_,
+        logWriter_,
         BucketMap::UNOWNED,
         logReaderFactory_);
+    map->setSubscriptions(subscriptions_);
+    map->setReplicator(replicator_);
 
     if (FLAGS_create_directories) {
       FileUtils utils(i, "", FLAGS_data_directory);
@@ -208,6 +678,11 @@ BeringeiServiceHandler::BeringeiServiceHandler(
     shards_.initialize(i, std::move(map));
   }
 
+  if (FLAGS_shard_transfer) {
+    shards_.setShardTransferCallback(
+        [this](int64_t shardId) { transferShardFiles(shardId); });
+  }
+
   // If we should be refreshing from a shard map, read the config and add shards
   // we should own.
   if (!fLB::FLAGS_disable_shard_refresh) {
@@ -239,6 +714,42 @@ BeringeiServiceHandler::BeringeiServiceHandler(
       std::chrono::seconds(FLAGS_sleep_between_bucket_finalization_secs));
   bucketFinalizerThread_.start();
 
+  if (FLAGS_snapshot_interval_secs > 0) {
+    snapshotThread_.addFunction(
+        std::bind(&BeringeiServiceHandler::snapshotThread, this),
+        std::chrono::seconds(FLAGS_snapshot_interval_secs),
+        "Snapshot Thread",
+        std::chrono::seconds(FLAGS_snapshot_interval_secs));
+    snapshotThread_.start();
+  }
+
+  if (FLAGS_deviation_index_interval_secs > 0) {
+    deviationIndexThread_.addFunction(
+        std::bind(&BeringeiServiceHandler::deviationIndexThread, this),
+        std::chrono::seconds(FLAGS_deviation_index_interval_secs),
+        "Deviation Index Thread",
+        std::chrono::seconds(FLAGS_deviation_index_interval_secs));
+    deviationIndexThread_.start();
+  }
+
+  if (FLAGS_memory_pressure_interval_secs > 0) {
+    memoryPressureThread_.addFunction(
+        std::bind(&BeringeiServiceHandler::memoryPressureThread, this),
+        std::chrono::seconds(FLAGS_memory_pressure_interval_secs),
+        "Memory Pressure Thread",
+        std::chrono::seconds(FLAGS_memory_pressure_interval_secs));
+    memoryPressureThread_.start();
+  }
+
+  if (FLAGS_replication_interval_ms > 0) {
+    replicationThread_.addFunction(
+        [this]() { replicator_->flush(); },
+        std::chrono::milliseconds(FLAGS_replication_interval_ms),
+        "Replication Thread",
+        std::chrono::milliseconds(FLAGS_replication_interval_ms));
+    replicationThread_.start();
+  }
+
   if (!FLAGS_disable_shard_refresh) {
     refreshShardConfigThread_.addFunction(
         std::bind(&BeringeiServiceHandler::refreshShardConfig, this),
@@ -250,9 +761,24 @@ BeringeiServiceHandler::BeringeiServiceHandler(
 
   GorillaStatsManager::addStatExportType(kUsPerGet, AVG);
   GorillaStatsManager::addStatExportType(kUsPerGet, COUNT);
+  GorillaStatsManager::addPercentileExports(kUsPerGet, kGorillaUsecPerSecond);
+  GorillaStatsManager::addStatExportType(kGetDataCost, AVG);
+  GorillaStatsManager::addStatExportType(kHeavyReads, SUM);
+  GorillaStatsManager::addStatExportType(kMsWaitingForHeavyRead, AVG);
   GorillaStatsManager::addStatExportType(kUsPerGetPerKey, AVG);
   GorillaStatsManager::addStatExportType(kUsPerPut, AVG);
   GorillaStatsManager::addStatExportType(kUsPerPut, COUNT);
+  GorillaStatsManager::addPercentileExports(kUsPerPut, kGorillaUsecPerSecond);
+  GorillaStatsManager::addStatExportType(kUsPerScanShard, AVG);
+  GorillaStatsManager::addStatExportType(kUsPerScanShard, COUNT);
+  GorillaStatsManager::addPercentileExports(
+      kUsPerScanShard, 10 * kGorillaUsecPerSecond);
+  GorillaStatsManager::addStatExportType(kPutsShed, SUM);
+  GorillaStatsManager::addStatExportType(kDatapointsShed, SUM);
+  GorillaStatsManager::addStatExportType(kDatapointsWithKeyIds, SUM);
+  GorillaStatsManager::addStatExportType(kKeyIdsRejected, SUM);
+  GorillaStatsManager::addStatExportType(kEncodedDatapoints, SUM);
+  GorillaStatsManager::addStatExportType(kEncodedEntriesRejected, SUM);
   GorillaStatsManager::addStatExportType(kUsPerPutPerKey, AVG);
 
   GorillaStatsManager::addStatExportType(kKeysPut, AVG);
@@ -260,6 +786,7 @@ BeringeiServiceHandler::BeringeiServiceHandler(
 
   GorillaStatsManager::addStatExportType(kKeysGot, AVG);
   GorillaStatsManager::addStatExportType(kKeysGot, SUM);
+  GorillaStatsManager::addStatExportType(kKeysGotFromRollups, SUM);
 
   GorillaStatsManager::addStatExportType(kNewKeys, SUM);
   GorillaStatsManager::addStatExportType(kDatapointsAdded, SUM);
@@ -268,9 +795,19 @@ BeringeiServiceHandler::BeringeiServiceHandler(
   GorillaStatsManager::addStatExportType(kDatapointsAhead, SUM);
   GorillaStatsManager::addStatExportType(kNewTimeSeriesBlocked, SUM);
   GorillaStatsManager::addStatExportType(kPurgedTimeSeries, SUM);
+  GorillaStatsManager::addStatExportType(kMsPerPurge, AVG);
 
   GorillaStatsManager::addStatExportType(kMsPerFinalizeShardBucket, AVG);
   GorillaStatsManager::addStatExportType(kMsPerFinalizeShardBucket, COUNT);
+  GorillaStatsManager::addStatExportType(kMsPerFinalizeBuckets, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerFinalizeBuckets, COUNT);
+  GorillaStatsManager::addPercentileExports(
+      kMsPerShardFinalize, kGorillaMsPerMinute);
+
+  GorillaStatsManager::addStatExportType(kMsPerShardTransfer, AVG);
+  GorillaStatsManager::addStatExportType(kShardTransferBytes, SUM);
+  GorillaStatsManager::addStatExportType(kShardTransferBytesSent, SUM);
+  GorillaStatsManager::addStatExportType(kShardTransferFailures, SUM);
   GorillaStatsManager::addStatExportType(kTooSlowToFinalizeBuckets, SUM);
 
   GorillaStatsManager::addStatExportType(kMsPerKeyListCompact, AVG);
@@ -281,19 +818,41 @@ BeringeiServiceHandler::BeringeiServiceHandler(
 
   GorillaStatsManager::addStatExportType(kUsPerGetLastUpdateTimes, AVG);
   GorillaStatsManager::addStatExportType(kUsPerGetLastUpdateTimes, COUNT);
+
+  GorillaStatsManager::addStatExportType(kUsPerSearchKeys, AVG);
+  GorillaStatsManager::addStatExportType(kUsPerSearchKeys, COUNT);
+  GorillaStatsManager::addStatExportType(kUsPerGetResourceUsage, AVG);
+  GorillaStatsManager::addStatExportType(kUsPerGetResourceUsage, COUNT);
+  GorillaStatsManager::addStatExportType(kKeysSearched, SUM);
+  GorillaStatsManager::addStatExportType(kUsPerAggregate, AVG);
+  GorillaStatsManager::addStatExportType(kUsPerAggregate, COUNT);
+  GorillaStatsManager::addStatExportType(kKeysAggregated, SUM);
+  GorillaStatsManager::addStatExportType(kMsPerDeviationIndex, AVG);
+  GorillaStatsManager::addStatExportType(kDeviationsIndexed, SUM);
+  GorillaStatsManager::addStatExportType(kUsPerGetDeviatingKeys, AVG);
+  GorillaStatsManager::addStatExportType(kUsPerGetDeviatingKeys, COUNT);
+  GorillaStatsManager::addStatExportType(kEvictedBuckets, SUM);
+  GorillaStatsManager::addStatExportType(kMsPerBackfill, AVG);
+  GorillaStatsManager::addStatExportType(kMsPerBackfill, COUNT);
+  GorillaStatsManager::addStatExportType(kBackfilledDatapoints, SUM);
+  GorillaStatsManager::addStatExportType(kBackfillDroppedDatapoints, SUM);
 }
 
 BeringeiServiceHandler::~BeringeiServiceHandler() {
   purgeThread_.shutdown();
   cleanThread_.shutdown();
   bucketFinalizerThread_.shutdown();
+  snapshotThread_.shutdown();
   refreshShardConfigThread_.shutdown();
+  memoryPressureThread_.shutdown();
+  deviationIndexThread_.shutdown();
+  replicationThread_.shutdown();
 }
 
 void BeringeiServiceHandler::putDataPoints(
     PutDataResult& response,
     std::unique_ptr<PutDataRequest> req) {
-  Timer timer(true);
+  TscTimer timer(true);
 
   int newTimeSeries = 0;
   int datapointsAdded = 0;
@@ -301,201 +860,904 @@ void BeringeiServiceHandler::putDataPoints(
   int notOwned = 0;
   int newTimeSeriesBlocked = 0;
 
-  for (auto& dp : req->data) {
-    auto originalUnixTime = dp.value.unixTime;
+  // Adjust 0, late, or early timestamps to now. Disable only for testing.
+  auto adjustTimestamp = [&](TimeValuePair& value) {
+    if (!adjustTimestamps_) {
+      return;
+    }
 
-    // Adjust 0, late, or early timestamps to now. Disable only for testing.
-    if (adjustTimestamps_) {
-      if (dp.value.unixTime == 0) {
-        dp.value.unixTime = now;
-      }
+    if (value.unixTime == 0) {
+      value.unixTime = now;
+    }
 
-      if (dp.value.unixTime < now - FLAGS_allowed_timestamp_behind) {
-        dp.value.unixTime = now;
-        GorillaStatsManager::addStatValue(kDatapointsBehind);
-      }
+    if (value.unixTime < now - FLAGS_allowed_timestamp_behind) {
+      value.unixTime = now;
+      datapointsBehindStat.add();
+    }
 
-      if (dp.value.unixTime > now + FLAGS_allowed_timestamp_ahead) {
-        dp.value.unixTime = now;
-        GorillaStatsManager::addStatValue(kDatapointsAhead);
-      }
+    if (value.unixTime > now + FLAGS_allowed_timestamp_ahead) {
+      value.unixTime = now;
+      datapointsAheadStat.add();
     }
+  };
+
+  // Group the data points by shard so that each shard is handled with
+  // one BucketMap::putBatch call.
+  std::unordered_map<int64_t, std::vector<uint32_t>> pointsByShard;
+  std::vector<int64_t> originalUnixTimes(req->data.size());
+  for (uint32_t i = 0; i < req->data.size(); i++) {
+    auto& dp = req->data[i];
+    originalUnixTimes[i] = dp.value.unixTime;
+    adjustTimestamp(dp.value);
 
     if (dp.key.key.length() > kMaxKeyLength) {
-      GorillaStatsManager::addStatValue(kTooLongKeys);
+      tooLongKeysStat.add();
       continue;
     }
 
-    auto map = shards_.getShardMap(dp.key.shardId);
-    if (!map) {
+    pointsByShard[dp.key.shardId].push_back(i);
+  }
+
+  // Points sent with key ids don't need their timestamps back because
+  // the client resends its own copies of the rejected ones.
+  std::unordered_map<int64_t, std::vector<uint32_t>> idPointsByShard;
+  for (uint32_t i = 0; i < req->dataWithKeyIds.size(); i++) {
+    auto& dp = req->dataWithKeyIds[i];
+    adjustTimestamp(dp.value);
+    idPointsByShard[dp.shardId].push_back(i);
+  }
+
+  // Encoded entries are decoded once and their points are added one
+  // key at a time.
+  std::unordered_map<int64_t, std::vector<uint32_t>> entriesByShard;
+  std::vector<std::vector<TimeValuePair>> encodedValues(
+      req->encodedData.size());
+  int encodedPoints = 0;
+  for (uint32_t i = 0; i < req->encodedData.size(); i++) {
+    const auto& entry = req->encodedData[i];
+    auto& values = encodedValues[i];
+    TimeSeries::getValues(
+        entry.block,
+        values,
+        std::numeric_limits<int64_t>::min(),
+        std::numeric_limits<int64_t>::max());
+    encodedPoints += values.size();
+    if (entry.key.key.length() > kMaxKeyLength) {
+      tooLongKeysStat.add();
       continue;
     }
 
-    if (map->get(dp.key.key) == nullptr &&
-        memoryUsageGuard_->weAreLowOnMemory()) {
-      ++newTimeSeriesBlocked;
-      continue;
+    for (auto& value : values) {
+      adjustTimestamp(value);
+    }
+    std::stable_sort(
+        values.begin(),
+        values.end(),
+        [](const TimeValuePair& a, const TimeValuePair& b) {
+          return a.unixTime < b.unixTime;
+        });
+    entriesByShard[entry.key.shardId].push_back(i);
+  }
+  int totalPoints =
+      req->data.size() + req->dataWithKeyIds.size() + encodedPoints;
+
+  if (shouldShedPuts()) {
+    // The client retries the points later.
+    response.status = StatusCode::OVERLOADED;
+    for (const auto& shard : pointsByShard) {
+      for (uint32_t i : shard.second) {
+        response.data.push_back(req->data[i]);
+        response.data.back().value.unixTime = originalUnixTimes[i];
+      }
     }
+    for (uint32_t i = 0; i < req->dataWithKeyIds.size(); i++) {
+      response.rejectedKeyIds.push_back(i);
+    }
+    for (uint32_t i = 0; i < req->encodedData.size(); i++) {
+      response.rejectedEncoded.push_back(i);
+    }
+    GorillaStatsManager::addStatValue(kPutsShed);
+    GorillaStatsManager::addStatValue(
+        kDatapointsShed,
+        response.data.size() + response.rejectedKeyIds.size() +
+            encodedPoints);
+    return;
+  }
 
-    // The put call will do the check for the shard ownership
-    auto ret = map->put(dp.key.key, dp.value, dp.categoryId);
+  if (req->wantKeyIds) {
+    KeyId none;
+    none.id = -1;
+    none.tag = 0;
+    response.keyIds.assign(req->data.size(), none);
+  }
 
-    if (ret.first == BucketMap::kNotOwned) {
-      dp.value.unixTime = originalUnixTime;
-      response.data.push_back(dp);
-      notOwned++;
-    } else {
-      newTimeSeries += ret.first;
-      datapointsAdded += ret.second;
+  auto pressure = memoryUsageGuard_->getPressure();
+  bool allowNewKeys = pressure == MemoryUsageGuardIf::NONE ||
+      (pressure == MemoryUsageGuardIf::SLOW_NEW_KEYS &&
+       folly::Random::randDouble01() <
+           FLAGS_new_keys_fraction_when_memory_grows);
+  // The points of each shard are added in one task, on the thread that
+  // owns the shard with --shard_executor_threads, and the results are
+  // merged once all of them are done.
+  struct ShardPuts {
+    BucketMap* map = nullptr;
+    const std::vector<uint32_t>* points = nullptr;
+    const std::vector<uint32_t>* idPoints = nullptr;
+    const std::vector<uint32_t>* entries = nullptr;
+    BucketMap::PutBatchResult ret;
+    BucketMap::PutBatchResult idRet;
+    BucketMap::PutBatchResult encodedRet;
+  };
+  std::unordered_map<int64_t, ShardPuts> puts;
+  for (const auto& shard : pointsByShard) {
+    puts[shard.first].points = &shard.second;
+  }
+  for (const auto& shard : idPointsByShard) {
+    puts[shard.first].idPoints = &shard.second;
+  }
+  for (const auto& shard : entriesByShard) {
+    puts[shard.first].entries = &shard.second;
+  }
+
+  std::vector<int64_t> shardIds;
+  std::vector<ShardPuts*> shardPuts;
+  for (auto& shard : puts) {
+    shard.second.map = shards_.getShardMap(shard.first);
+    if (shard.second.map) {
+      shardIds.push_back(shard.first);
+      shardPuts.push_back(&shard.second);
+    }
+  }
+
+  // The put calls do the check for the shard ownership. Each shard
+  // sets its own key ids.
+  auto putShard = [&](size_t i) {
+    ShardPuts& shard = *shardPuts[i];
+
+    // Followers only take the points their owner replicates.
+    if (shard.map->isFollower()) {
+      if (shard.points) {
+        shard.ret.notOwned = *shard.points;
+      }
+      if (shard.idPoints) {
+        shard.idRet.notOwned = *shard.idPoints;
+      }
+      if (shard.entries) {
+        shard.encodedRet.notOwned = *shard.entries;
+      }
+      return;
+    }
+
+    if (shard.points) {
+      shard.ret = shard.map->putBatch(
+          req->data,
+          *shard.points,
+          allowNewKeys,
+          req->wantKeyIds ? &response.keyIds : nullptr);
+    }
+    if (shard.idPoints) {
+      shard.idRet =
+          shard.map->putBatchWithKeyIds(req->dataWithKeyIds, *shard.idPoints);
+    }
+    if (shard.entries) {
+      shard.encodedRet = shard.map->putEncoded(
+          req->encodedData, encodedValues, *shard.entries, allowNewKeys);
+    }
+  };
+  if (shardExecutor_) {
+    shardExecutor_->run(shardIds, putShard);
+  } else {
+    for (size_t i = 0; i < shardIds.size(); i++) {
+      putShard(i);
+    }
+  }
+
+  for (const auto& shard : puts) {
+    const ShardPuts& shardPut = shard.second;
+    if (!shardPut.map) {
+      if (shardPut.idPoints) {
+        response.rejectedKeyIds.insert(
+            response.rejectedKeyIds.end(),
+            shardPut.idPoints->begin(),
+            shardPut.idPoints->end());
+      }
+      continue;
+    }
+
+    for (uint32_t i : shardPut.ret.notOwned) {
+      response.data.push_back(req->data[i]);
+      response.data.back().value.unixTime = originalUnixTimes[i];
+    }
+    response.rejectedKeyIds.insert(
+        response.rejectedKeyIds.end(),
+        shardPut.idRet.notOwned.begin(),
+        shardPut.idRet.notOwned.end());
+    response.rejectedEncoded.insert(
+        response.rejectedEncoded.end(),
+        shardPut.encodedRet.notOwned.begin(),
+        shardPut.encodedRet.notOwned.end());
+    notOwned += shardPut.ret.notOwned.size();
+    for (uint32_t i : shardPut.encodedRet.notOwned) {
+      notOwned += encodedValues[i].size();
     }
+    newTimeSeries += shardPut.ret.newRows + shardPut.encodedRet.newRows;
+    datapointsAdded += shardPut.ret.added + shardPut.idRet.added +
+        shardPut.encodedRet.added;
+    newTimeSeriesBlocked +=
+        shardPut.ret.newKeysBlocked + shardPut.encodedRet.newKeysBlocked;
+  }
+
+  if (!req->encodedData.empty()) {
+    GorillaStatsManager::addStatValue(kEncodedDatapoints, encodedPoints);
+    GorillaStatsManager::addStatValue(
+        kEncodedEntriesRejected, response.rejectedEncoded.size());
+  }
+
+  if (!req->dataWithKeyIds.empty()) {
+    GorillaStatsManager::addStatValue(
+        kDatapointsWithKeyIds, req->dataWithKeyIds.size());
+    GorillaStatsManager::addStatValue(
+        kKeyIdsRejected, response.rejectedKeyIds.size());
   }
 
   GorillaStatsManager::addStatValue(kUsPerPut, timer.get());
+  shards_.reportPutLatency(timer.get());
+  int64_t average = putLatencyUs_;
+  putLatencyUs_ = average + (timer.get() - average) / kPutLatencyAverageWeight;
   GorillaStatsManager::addStatValue(
-      kUsPerPutPerKey, timer.get() / (double)req->data.size());
-  GorillaStatsManager::addStatValue(kKeysPut, req->data.size());
+      kUsPerPutPerKey, timer.get() / (double)totalPoints);
+  GorillaStatsManager::addStatValue(kKeysPut, totalPoints);
   GorillaStatsManager::addStatValue(kNewKeys, newTimeSeries);
   GorillaStatsManager::addStatValue(kDatapointsAdded, datapointsAdded);
   GorillaStatsManager::addStatValue(
-      kDatapointsDropped, req->data.size() - datapointsAdded);
+      kDatapointsDropped, totalPoints - datapointsAdded);
   GorillaStatsManager::addStatValue(kDatapointsNotOwned, notOwned);
   GorillaStatsManager::addStatValue(
       kNewTimeSeriesBlocked, newTimeSeriesBlocked);
 }
 
-void BeringeiServiceHandler::getData(
-    GetDataResult& ret,
-    std::unique_ptr<GetDataRequest> req) {
+int BeringeiServiceHandler::findKeys(
+    const GetDataRequest& req,
+    std::vector<TimeSeriesData>& results,
+    const FetchFunction& fetch) {
   Timer timer(true);
-  ret.results.resize(req->keys.size());
+
+  int64_t cost = estimateReadCost(req);
+  GorillaStatsManager::addStatValue(kGetDataCost, cost);
+  std::unique_ptr<HeavyReadSlot> heavyRead;
+  if (FLAGS_heavy_read_cost > 0 && cost > FLAGS_heavy_read_cost) {
+    GorillaStatsManager::addStatValue(kHeavyReads);
+    heavyRead.reset(
+        new HeavyReadSlot(heavyReadsMutex_, heavyReadsCondition_, heavyReads_));
+    GorillaStatsManager::addStatValue(
+        kMsWaitingForHeavyRead, timer.get() / kGorillaUsecPerMs);
+  }
+
+  results.resize(req.keys.size());
   int keysFound = 0;
 
-  for (int i = 0; i < req->keys.size(); i++) {
-    const Key& key = req->keys[i];
-    auto map = shards_.getShardMap(key.shardId);
-    if (!map || key.key.length() > kMaxKeyLength) {
-      ret.results[i].status = StatusCode::KEY_MISSING;
+  // Group the keys by shard so that each shard is looked up once and
+  // its blocks are fetched together.
+  std::unordered_map<int64_t, std::vector<uint32_t>> keysByShard;
+  for (uint32_t i = 0; i < req.keys.size(); i++) {
+    const Key& key = req.keys[i];
+    if (key.key.length() > kMaxKeyLength) {
+      results[i].status = StatusCode::KEY_MISSING;
+    } else {
+      keysByShard[key.shardId].push_back(i);
+    }
+  }
+
+  uint64_t traceId = Tracing::current();
+  for (const auto& shard : keysByShard) {
+    int64_t lookupUs = traceId != 0 ? Tracing::nowUs() : 0;
+    const auto& indexes = shard.second;
+    auto map = shards_.getShardMap(shard.first);
+    if (!map) {
+      for (uint32_t i : indexes) {
+        results[i].status = StatusCode::KEY_MISSING;
+      }
       continue;
     }
 
     BucketMap::State state = map->getState();
     if (state == BucketMap::UNOWNED) {
       // Not owning this shard, caller has stale shard information.
-      ret.results[i].status = StatusCode::DONT_OWN_SHARD;
+      for (uint32_t i : indexes) {
+        results[i].status = StatusCode::DONT_OWN_SHARD;
+      }
+      continue;
     } else if (
         state >= BucketMap::PRE_OWNED &&
         state < BucketMap::READING_BLOCK_DATA) {
       // Not ready to serve reads yet.
-      ret.results[i].status = StatusCode::SHARD_IN_PROGRESS;
-    } else {
-      auto row = map->get(key.key);
-      if (row.get()) {
-        keysFound++;
-        row->second.get(
-            map->bucket(req->begin),
-            map->bucket(req->end),
-            ret.results[i].data,
-            map->getStorage());
-        row->second.setQueried();
-        if (state == BucketMap::READING_BLOCK_DATA) {
-          // Some of the data hasn't been read yet. Let the client
-          // decide what to do with the results, i.e., ask the other
-          // coast if possible.
-          ret.results[i].status = StatusCode::SHARD_IN_PROGRESS;
-        } else if (req->begin < map->getReliableDataStartTime()) {
-          ret.results[i].status = StatusCode::MISSING_TOO_MUCH_DATA;
-          GorillaStatsManager::addStatValue(kMissingTooMuchData, 1);
-        } else {
-          ret.results[i].status = StatusCode::OK;
-        }
-      } else {
+      for (uint32_t i : indexes) {
+        results[i].status = StatusCode::SHARD_IN_PROGRESS;
+      }
+      continue;
+    }
+
+    // Block files that haven't been read yet are read before any others
+    // once they are queried. The results are complete if all the
+    // queried buckets are in memory already.
+    bool missingBlocks = state == BucketMap::READING_BLOCK_DATA &&
+        shards_.requestBlockFiles(
+            shard.first, map->bucket(req.begin), map->bucket(req.end)) > 0;
+
+    std::vector<BucketMap::Item> rows;
+    map->getBatch(req.keys, indexes, rows);
+
+    std::vector<uint32_t> foundIndexes;
+    std::vector<BucketedTimeSeries*> series;
+    for (int j = 0; j < indexes.size(); j++) {
+      uint32_t i = indexes[j];
+      if (!rows[j]) {
         // There's no such key.
-        ret.results[i].status = StatusCode::KEY_MISSING;
+        results[i].status = StatusCode::KEY_MISSING;
+        continue;
+      }
+
+      keysFound++;
+      foundIndexes.push_back(i);
+      series.push_back(&rows[j]->second);
+      rows[j]->second.setQueried();
+
+      if (missingBlocks) {
+        // Some of the data hasn't been read yet. Let the client
+        // decide what to do with the results, i.e., ask the other
+        // coast if possible.
+        results[i].status = StatusCode::SHARD_IN_PROGRESS;
+      } else if (req.begin < map->getReliableDataStartTime()) {
+        results[i].status = StatusCode::MISSING_TOO_MUCH_DATA;
+        GorillaStatsManager::addStatValue(kMissingTooMuchData, 1);
+      } else {
+        results[i].status = StatusCode::OK;
       }
     }
+
+    Tracing::record(traceId, "shard_lookup", lookupUs, shard.first);
+    Tracing::SpanScope span("fetch_blocks", shard.first);
+    fetch(map, foundIndexes, series);
   }
 
-  GorillaStatsManager::addStatValue(kUsPerGet, timer.get());
-  GorillaStatsManager::addStatValue(
-      kUsPerGetPerKey, timer.get() / (double)req->keys.size());
-  GorillaStatsManager::addStatValue(kKeysGot, keysFound);
+  return keysFound;
 }
 
-void BeringeiServiceHandler::getShardDataBucket(
-    GetShardDataBucketResult& ret,
-    int64_t beginTs,
-    int64_t endTs,
-    int64_t shardId,
-    int32_t offset,
-    int32_t limit) {
-  beginTs = BucketUtils::floorTimestamp(beginTs, FLAGS_bucket_size, shardId);
-  endTs = BucketUtils::floorTimestamp(endTs, FLAGS_bucket_size, shardId);
-
-  LOG(INFO) << "Fetching data for shard " << shardId << " between time "
-            << beginTs << " and " << endTs;
-
-  Timer timer(true);
+// The trace that the client sent with the request, or a new one for the
+// requests that the server samples itself.
+static uint64_t getTraceId(apache::thrift::Cpp2RequestContext* context) {
+  if (context && context->getHeader()) {
+    const auto& headers = context->getHeader()->getHeaders();
+    auto it = headers.find(Tracing::kHeader);
+    if (it != headers.end()) {
+      return Tracing::parse(it->second);
+    }
+  }
+  return Tracing::sample();
+}
 
-  ret.moreEntries = false;
-  auto map = shards_.getShardMap(shardId);
-  if (!map) {
-    ret.status = StatusCode::RPC_FAIL;
+void BeringeiServiceHandler::getData(
+    GetDataResult& ret,
+    std::unique_ptr<GetDataRequest> req) {
+  Tracing::TraceScope trace(getTraceId(getConnectionContext()));
+  Tracing::SpanScope span("get_data");
+  if (!getDataCache_) {
+    getDataUncached(ret, *req);
     return;
   }
-  auto state = map->getState();
-  if (state != BucketMap::OWNED) {
-    ret.status = state <= BucketMap::UNOWNED ? StatusCode::DONT_OWN_SHARD
-                                             : StatusCode::SHARD_IN_PROGRESS;
-    return;
+
+  // Buckets before the one that accepts late data points don't change
+  // until the cache is cleared when the next bucket is finalized.
+  int64_t ttlMs = FLAGS_get_data_cache_open_ttl_ms;
+  int64_t finalizedBefore = time(nullptr) - FLAGS_allowed_timestamp_behind -
+      kGorillaSecondsPerMinute - 2 * (int64_t)FLAGS_bucket_size;
+  if (req->end < finalizedBefore) {
+    ttlMs = (int64_t)FLAGS_bucket_size * kGorillaMsPerSecond;
   }
 
-  // Don't allow data fetches until the bucket has been finalized.
-  if (map->bucket(endTs) > map->getLastFinalizedBucket()) {
-    ret.status = StatusCode::BUCKET_NOT_FINALIZED;
+  getDataCache_->get(
+      GetDataCache::fingerprint(*req),
+      ttlMs,
+      ret,
+      [&](GetDataResult& result) { getDataUncached(result, *req); });
+}
+
+void BeringeiServiceHandler::getDataUncached(
+    GetDataResult& ret,
+    const GetDataRequest& req,
+    PartialAggregate* partial) {
+  if (!req.ranges.empty()) {
+    getDataRanges(ret, req);
     return;
   }
 
-  std::vector<BucketMap::Item> rows;
-  ret.moreEntries = map->getSome(rows, offset, limit);
-  auto storage = map->getStorage();
+  TscTimer timer(true);
+
+  std::vector<bool> found(req.keys.size(), false);
+
+  // Keys downsampled from the rollup tiers, with their windows.
+  AggregationType type;
+  bool downsample =
+      Aggregation::isValid(req.aggregation, req.begin, req.end) &&
+      Aggregation::fromThrift(req.aggregation.function, type);
+  std::vector<bool> fromRollups(req.keys.size(), false);
+  std::vector<std::vector<double>> rollupWindows(req.keys.size());
+  int keysFromRollups = 0;
+
+  int keysFound = findKeys(
+      req,
+      ret.results,
+      [&](BucketMap* map,
+          const std::vector<uint32_t>& indexes,
+          const std::vector<BucketedTimeSeries*>& series) {
+        int tier = downsample
+            ? map->pickRollup(req.begin, req.aggregation.step, type)
+            : -1;
+        if (tier >= 0) {
+          std::vector<std::vector<double>> windows;
+          map->getRollups(
+              tier,
+              req.keys,
+              indexes,
+              req.begin,
+              req.end,
+              req.aggregation.step,
+              type,
+              windows);
+          for (int j = 0; j < indexes.size(); j++) {
+            uint32_t i = indexes[j];
+            found[i] = true;
+            fromRollups[i] = true;
+            Aggregation::windowsToBlocks(
+                type,
+                req.begin,
+                req.aggregation.step,
+                windows[j],
+                ret.results[i].data);
+            rollupWindows[i] = std::move(windows[j]);
+          }
+          keysFromRollups += indexes.size();
+          return;
+        }
 
-  ret.keys.reserve(rows.size());
-  ret.data.reserve(rows.size());
+        std::vector<BucketedTimeSeries::Output*> outs;
+        for (uint32_t i : indexes) {
+          found[i] = true;
+          outs.push_back(&ret.results[i].data);
+        }
 
-  uint32_t begin = map->bucket(beginTs);
-  uint32_t end = map->bucket(endTs);
+        // Older buckets come first.
+        map->getArchived(
+            req.keys,
+            indexes,
+            map->bucket(req.begin),
+            map->bucket(req.end),
+            outs);
+
+        // Coalesced blocks are cached by shard and key.
+        BucketedTimeSeries::Coalesce coalesce;
+        if (FLAGS_coalesce_get_data_blocks) {
+          coalesce.cache = coalescedBlockCache_.get();
+          for (uint32_t i = 0; coalesce.cache && i < indexes.size(); i++) {
+            const Key& key = req.keys[indexes[i]];
+            coalesce.keys.push_back(
+                std::to_string(key.shardId) + ':' + key.key);
+          }
+        }
 
-  for (auto& row : rows) {
-    if (row.get()) {
-      std::vector<TimeSeriesBlock> blocks;
-      row->second.get(begin, end, blocks, storage);
+        BucketedTimeSeries::getMany(
+            series,
+            map->bucket(req.begin),
+            map->bucket(req.end),
+            outs,
+            map->getStorage(),
+            FLAGS_coalesce_get_data_blocks ? &coalesce : nullptr);
+      });
+
+  // Downsampled values of every key, kept only for the cross key
+  // reduction.
+  AggregationType crossKeyType;
+  bool reduce = Aggregation::isValid(req.aggregation, req.begin, req.end) &&
+      Aggregation::fromThrift(req.aggregation.crossKeyFunction, crossKeyType);
+  std::vector<std::vector<double>> keyWindows;
+  auto addWindows = [&](std::vector<double>&& windows) {
+    if (partial) {
+      partial->add(windows);
+    } else {
+      keyWindows.push_back(std::move(windows));
+    }
+  };
+
+  // Downsampled blocks only cover the range already.
+  if (FLAGS_trim_get_data_blocks &&
+      !Aggregation::isValid(req.aggregation, req.begin, req.end)) {
+    for (int i = 0; i < req.keys.size(); i++) {
+      if (found[i]) {
+        TimeSeries::trimBlocks(ret.results[i].data, req.begin, req.end);
+      }
+    }
+  }
 
-      if (blocks.size() > 0) {
-        ret.keys.push_back(row->first);
-        ret.data.push_back(std::move(blocks));
-        ret.recentRead.push_back(
-            row->second.getQueriedBucketsAgo() <=
-            map->buckets(kGorillaSecondsPerDay));
+  // Downsampled blocks are short and decoded by the server itself.
+  if (FLAGS_get_data_checkpoint_interval > 0 &&
+      !Aggregation::isValid(req.aggregation, req.begin, req.end)) {
+    for (int i = 0; i < req.keys.size(); i++) {
+      if (found[i]) {
+        TimeSeries::writeCheckpoints(
+            ret.results[i].data, FLAGS_get_data_checkpoint_interval);
       }
     }
   }
 
-  LOG(INFO) << "Data fetch for shard " << shardId << " complete in "
-            << timer.get() << "us with " << ret.keys.size() << " keys returned";
-}
+  // Downsample in the order of the keys so that the cross key
+  // reduction doesn't depend on the shards.
+  for (int i = 0; i < req.keys.size(); i++) {
+    if (fromRollups[i]) {
+      if (reduce) {
+        addWindows(std::move(rollupWindows[i]));
+      }
+      continue;
+    }
 
-void BeringeiServiceHandler::scanShard(
-    ScanShardResult& ret,
-    std::unique_ptr<ScanShardRequest> req) {
-  req->begin =
-      BucketUtils::floorTimestamp(req->begin, FLAGS_bucket_size, req->shardId);
-  req->end =
+    std::vector<double> windows;
+    if (found[i] &&
+        Aggregation::downsampleBlocks(
+            req.aggregation,
+            req.begin,
+            req.end,
+            ret.results[i].data,
+            windows) &&
+        reduce) {
+      addWindows(std::move(windows));
+    }
+  }
+
+  if (reduce && !partial) {
+    Aggregation::reduce(
+        crossKeyType,
+        req.begin,
+        req.aggregation.step,
+        keyWindows,
+        ret.reduced.data);
+  }
+
+  GorillaStatsManager::addStatValue(kUsPerGet, timer.get());
+  GorillaStatsManager::addStatValue(
+      kUsPerGetPerKey, timer.get() / (double)req.keys.size());
+  GorillaStatsManager::addStatValue(kKeysGot, keysFound);
+  GorillaStatsManager::addStatValue(kKeysGotFromRollups, keysFromRollups);
+}
+
+void BeringeiServiceHandler::getDataRanges(
+    GetDataResult& ret,
+    const GetDataRequest& req) {
+  ret.results.resize(req.keys.size());
+  if (req.ranges.size() != req.keys.size()) {
+    LOG(ERROR) << "getData request with " << req.ranges.size()
+               << " ranges for " << req.keys.size() << " keys";
+    for (auto& result : ret.results) {
+      result.status = StatusCode::RPC_FAIL;
+    }
+    return;
+  }
+
+  // Keys with the same range are read with one request.
+  std::map<std::pair<int64_t, int64_t>, std::vector<uint32_t>> keysByRange;
+  for (uint32_t i = 0; i < req.keys.size(); i++) {
+    keysByRange[{req.ranges[i].begin, req.ranges[i].end}].push_back(i);
+  }
+
+  for (const auto& range : keysByRange) {
+    GetDataRequest rangeReq;
+    rangeReq.begin = range.first.first;
+    rangeReq.end = range.first.second;
+    rangeReq.aggregation = req.aggregation;
+    rangeReq.aggregation.crossKeyFunction = AggregationFunction::NONE;
+    for (uint32_t i : range.second) {
+      rangeReq.keys.push_back(req.keys[i]);
+    }
+
+    GetDataResult rangeResult;
+    getDataUncached(rangeResult, rangeReq);
+    for (int j = 0; j < range.second.size(); j++) {
+      ret.results[range.second[j]] = std::move(rangeResult.results[j]);
+    }
+  }
+}
+
+void BeringeiServiceHandler::aggregate(
+    AggregateResult& ret,
+    std::unique_ptr<AggregateRequest> req) {
+  Tracing::TraceScope trace(getTraceId(getConnectionContext()));
+  Tracing::SpanScope span("aggregate");
+
+  AggregationType type;
+  AggregationType crossKeyType;
+  if (!Aggregation::isValid(req->aggregation, req->begin, req->end) ||
+      !Aggregation::fromThrift(req->aggregation.function, type) ||
+      !Aggregation::fromThrift(
+          req->aggregation.crossKeyFunction, crossKeyType) ||
+      req->prefix.length() > kMaxKeyLength) {
+    LOG(ERROR) << "Invalid aggregate request";
+    ret.status = StatusCode::RPC_FAIL;
+    return;
+  }
+
+  Timer timer(true);
+  ret.status = StatusCode::OK;
+  PartialAggregate partial(crossKeyType);
+  size_t batchSize = std::max(1, FLAGS_aggregate_batch_size);
+
+  std::vector<Key> keys;
+  for (const auto& key : req->keys) {
+    keys.push_back(key);
+    if (keys.size() >= batchSize) {
+      aggregateKeys(*req, keys, partial, ret);
+    }
+  }
+  aggregateKeys(*req, keys, partial, ret);
+
+  // The keys of the prefix are found a page at a time from the key
+  // index of each shard.
+  std::string pattern = req->prefix + "*";
+  std::set<int64_t> prefixShards;
+  if (!req->prefix.empty()) {
+    prefixShards.insert(req->prefixShards.begin(), req->prefixShards.end());
+  }
+  for (int64_t shardId : prefixShards) {
+    auto map = getShardMap(shardId);
+    if (!map || map->getState() == BucketMap::UNOWNED) {
+      ret.unownedShards.push_back(shardId);
+      continue;
+    } else if (map->getState() != BucketMap::OWNED) {
+      // The key index isn't complete until the shard is loaded.
+      ret.status = StatusCode::SHARD_IN_PROGRESS;
+      continue;
+    }
+
+    std::string after;
+    bool more = true;
+    while (more) {
+      std::vector<BucketMap::Item> items;
+      more = map->searchKeys(pattern, after, batchSize, items);
+      if (items.empty()) {
+        break;
+      }
+      after = items.back()->first;
+
+      for (const auto& item : items) {
+        keys.emplace_back();
+        keys.back().key = item->first;
+        keys.back().shardId = shardId;
+      }
+      aggregateKeys(*req, keys, partial, ret);
+    }
+  }
+
+  std::sort(ret.unownedShards.begin(), ret.unownedShards.end());
+  ret.unownedShards.erase(
+      std::unique(ret.unownedShards.begin(), ret.unownedShards.end()),
+      ret.unownedShards.end());
+  ret.values = partial.values();
+  ret.counts = partial.counts();
+  GorillaStatsManager::addStatValue(kUsPerAggregate, timer.get());
+  GorillaStatsManager::addStatValue(kKeysAggregated, ret.keysReduced);
+}
+
+void BeringeiServiceHandler::aggregateKeys(
+    const AggregateRequest& req,
+    std::vector<Key>& keys,
+    PartialAggregate& partial,
+    AggregateResult& ret) {
+  if (keys.empty()) {
+    return;
+  }
+
+  GetDataRequest getReq;
+  getReq.keys.swap(keys);
+  getReq.begin = req.begin;
+  getReq.end = req.end;
+  getReq.aggregation = req.aggregation;
+
+  GetDataResult result;
+  getDataUncached(result, getReq, &partial);
+
+  for (int i = 0; i < result.results.size(); i++) {
+    switch (result.results[i].status) {
+      case StatusCode::OK:
+        ret.keysReduced++;
+        break;
+      case StatusCode::KEY_MISSING:
+        break;
+      case StatusCode::DONT_OWN_SHARD:
+        ret.unownedShards.push_back(getReq.keys[i].shardId);
+        break;
+      default:
+        // Reduced, but some of the data is missing.
+        ret.keysReduced++;
+        if (ret.status == StatusCode::OK) {
+          ret.status = result.results[i].status;
+        }
+        break;
+    }
+  }
+}
+
+int64_t BeringeiServiceHandler::estimateReadCost(const GetDataRequest& req) {
+  int64_t range = std::max<int64_t>(0, req.end - req.begin);
+  return req.keys.size() * (1 + range / std::max(1, FLAGS_bucket_size));
+}
+
+void BeringeiServiceHandler::getDataColumnar(
+    GetDataColumnarResult& ret,
+    std::unique_ptr<GetDataRequest> req) {
+  if (Aggregation::isValid(req->aggregation, req->begin, req->end) ||
+      !req->ranges.empty()) {
+    // Downsampled results and the results of per key ranges are built
+    // from the blocks of getData().
+    GetDataResult result;
+    getData(result, std::move(req));
+
+    size_t numBlocks = 0;
+    size_t dataSize = 0;
+    for (const auto& data : result.results) {
+      numBlocks += data.data.size();
+      for (const auto& block : data.data) {
+        dataSize += block.data.size();
+      }
+    }
+
+    ret.data.reserve(dataSize);
+    ret.blockOffsets.reserve(numBlocks);
+    ret.blockCounts.reserve(numBlocks);
+    ret.keyBlockOffsets.reserve(result.results.size());
+    ret.statuses.reserve(result.results.size());
+    for (const auto& data : result.results) {
+      TimeSeries::appendColumnar(data, ret);
+    }
+    return;
+  }
+
+  TscTimer timer(true);
+
+  // The blocks point into the pages of the storage, so they are only
+  // copied once, into `ret.data`.
+  std::vector<std::vector<BucketedTimeSeries::Buffer>> buffers(
+      req->keys.size());
+  std::vector<TimeSeriesData> results;
+  int keysFound = findKeys(
+      *req,
+      results,
+      [&](BucketMap* map,
+          const std::vector<uint32_t>& indexes,
+          const std::vector<BucketedTimeSeries*>& series) {
+        for (int j = 0; j < indexes.size(); j++) {
+          series[j]->getBuffers(
+              map->bucket(req->begin),
+              map->bucket(req->end),
+              buffers[indexes[j]],
+              map->getStorage());
+        }
+      });
+
+  size_t numBlocks = 0;
+  size_t dataSize = 0;
+  for (const auto& key : buffers) {
+    numBlocks += key.size();
+    for (const auto& block : key) {
+      dataSize += block.data->length();
+    }
+  }
+
+  ret.data.reserve(dataSize);
+  ret.blockOffsets.reserve(numBlocks);
+  ret.blockCounts.reserve(numBlocks);
+  ret.keyBlockOffsets.reserve(results.size());
+  ret.statuses.reserve(results.size());
+  for (int i = 0; i < results.size(); i++) {
+    ret.keyBlockOffsets.push_back(ret.blockOffsets.size());
+    ret.statuses.push_back(results[i].status);
+    for (const auto& block : buffers[i]) {
+      ret.blockOffsets.push_back(ret.data.size());
+      ret.blockCounts.push_back(block.count);
+      ret.data.append(
+          reinterpret_cast<const char*>(block.data->data()),
+          block.data->length());
+    }
+  }
+
+  GorillaStatsManager::addStatValue(kUsPerGet, timer.get());
+  GorillaStatsManager::addStatValue(
+      kUsPerGetPerKey, timer.get() / (double)req->keys.size());
+  GorillaStatsManager::addStatValue(kKeysGot, keysFound);
+}
+
+void BeringeiServiceHandler::getShardDataBucket(
+    GetShardDataBucketResult& ret,
+    int64_t beginTs,
+    int64_t endTs,
+    int64_t shardId,
+    int32_t offset,
+    int32_t limit) {
+  beginTs = BucketUtils::floorTimestamp(beginTs, FLAGS_bucket_size, shardId);
+  endTs = BucketUtils::floorTimestamp(endTs, FLAGS_bucket_size, shardId);
+
+  LOG(INFO) << "Fetching data for shard " << shardId << " between time "
+            << beginTs << " and " << endTs;
+
+  Timer timer(true);
+
+  ret.moreEntries = false;
+  auto map = shards_.getShardMap(shardId);
+  if (!map) {
+    ret.status = StatusCode::RPC_FAIL;
+    return;
+  }
+  auto state = map->getState();
+  if (state != BucketMap::OWNED) {
+    ret.status = state <= BucketMap::UNOWNED ? StatusCode::DONT_OWN_SHARD
+                                             : StatusCode::SHARD_IN_PROGRESS;
+    return;
+  }
+
+  // Don't allow data fetches until the bucket has been finalized.
+  if (map->bucket(endTs) > map->getLastFinalizedBucket()) {
+    ret.status = StatusCode::BUCKET_NOT_FINALIZED;
+    return;
+  }
+
+  std::vector<BucketMap::Item> rows;
+  ret.moreEntries = map->getSome(rows, offset, limit);
+  auto storage = map->getStorage();
+
+  ret.keys.reserve(rows.size());
+  ret.data.reserve(rows.size());
+
+  uint32_t begin = map->bucket(beginTs);
+  uint32_t end = map->bucket(endTs);
+
+  for (auto& row : rows) {
+    if (row.get()) {
+      std::vector<TimeSeriesBlock> blocks;
+      row->second.get(begin, end, blocks, storage);
+
+      if (blocks.size() > 0) {
+        ret.keys.push_back(row->first);
+        ret.data.push_back(std::move(blocks));
+        ret.recentRead.push_back(
+            row->second.getQueriedBucketsAgo() <=
+            map->buckets(kGorillaSecondsPerDay));
+      }
+    }
+  }
+
+  LOG(INFO) << "Data fetch for shard " << shardId << " complete in "
+            << timer.get() << "us with " << ret.keys.size() << " keys returned";
+}
+
+void BeringeiServiceHandler::scanShard(
+    ScanShardResult& ret,
+    std::unique_ptr<ScanShardRequest> req) {
+  req->begin =
+      BucketUtils::floorTimestamp(req->begin, FLAGS_bucket_size, req->shardId);
+  req->end =
       BucketUtils::floorTimestamp(req->end, FLAGS_bucket_size, req->shardId);
 
   LOG(INFO) << "Fetching data for shard " << req->shardId << " between time "
             << req->begin << " and " << req->end;
 
-  Timer timer(true);
+  TscTimer timer(true);
+  Tracing::TraceScope trace(getTraceId(getConnectionContext()));
+  Tracing::SpanScope span("scan_shard", req->shardId);
+
+  if (req->numSubshards < 1 || req->subshard < 0 ||
+      req->subshard >= req->numSubshards ||
+      req->numSubshards > std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR) << "Invalid subshard " << req->subshard << " of "
+               << req->numSubshards;
+    ret.status = StatusCode::RPC_FAIL;
+    return;
+  }
 
   auto map = shards_.getShardMap(req->shardId);
   if (!map) {
@@ -515,41 +1777,65 @@ void BeringeiServiceHandler::scanShard(
     return;
   }
 
-  std::vector<BucketMap::Item> rows;
-  map->getEverything(rows);
   auto storage = map->getStorage();
-
-  size_t sizeEstimate = (req->numSubshards <= 1)
-      ? rows.size()
-      : rows.size() / (req->numSubshards - 1);
-  ret.keys.reserve(sizeEstimate);
-  ret.data.reserve(sizeEstimate);
-  ret.queriedRecently.reserve(sizeEstimate);
-
   uint32_t begin = map->bucket(req->begin);
   uint32_t end = map->bucket(req->end);
 
-  for (auto& row : rows) {
-    if (row.get()) {
-      folly::StringPiece key(row->first);
-      if (configAdapter_->getShardForKey(
-              key, req->numSubshards, kDataScanSeed) != req->subshard) {
+  // Rows are read in batches to bound the time the map lock is held.
+  // The reader keeps erased rows alive until the batch has been served.
+  int64_t offset = std::max(req->offset, (int64_t)0);
+  int64_t lastOffset = req->limit > 0 ? offset + req->limit
+                                      : std::numeric_limits<int64_t>::max();
+  int64_t bytes = 0;
+  bool moreRows = true;
+  bool full = false;
+  std::vector<BucketMap::Row*> rows;
+
+  Tracing::SpanScope fetchSpan("fetch_blocks", req->shardId);
+  while (moreRows && !full && offset < lastOffset) {
+    BucketMap::RowReader reader(map);
+    rows.clear();
+    moreRows = reader.getSome(
+        rows,
+        offset,
+        std::min(lastOffset - offset, kScanShardBatchSize),
+        req->numSubshards,
+        req->subshard);
+
+    size_t i = 0;
+    for (; i < rows.size() && !full; i++) {
+      auto row = rows[i];
+      if (!row) {
         continue;
       }
 
+      folly::StringPiece key(row->first);
       std::vector<TimeSeriesBlock> blocks;
       row->second.get(begin, end, blocks, storage);
 
       if (blocks.size() > 0) {
+        for (const auto& block : blocks) {
+          bytes += block.data.size();
+        }
         ret.keys.push_back(key.str());
         ret.data.push_back(std::move(blocks));
         ret.queriedRecently.push_back(
             row->second.getQueriedBucketsAgo() <=
             map->buckets(kGorillaSecondsPerDay));
+        full = req->maxBytes > 0 && bytes >= req->maxBytes;
       }
     }
+
+    offset += i;
+    if (i < rows.size()) {
+      moreRows = true;
+    }
   }
 
+  ret.moreEntries = moreRows;
+  ret.nextOffset = offset;
+
+  GorillaStatsManager::addStatValue(kUsPerScanShard, timer.get());
   LOG(INFO) << "Data fetch for shard " << req->shardId << " complete in "
             << timer.get() << "us with " << ret.keys.size() << " keys returned";
 }
@@ -561,34 +1847,476 @@ void BeringeiServiceHandler::refreshShardConfig() {
   // ShardList will be populated by getShardsForHost.
   std::set<int64_t> shardList;
   configAdapter_->getShardsForHost(hostInfo, serviceName_, shardList);
+  if (FLAGS_shard_transfer) {
+    updateShardOwners(shardList);
+  }
 
-  // We will addShard everything we should own and dropShard all other shards.
-  // For anything we already own and should (or do not own and shouldn't), this
-  // is a noop.
-  shards_.setShards(shardList);
+  std::set<int64_t> followedShards;
+  configAdapter_->getFollowedShardsForHost(
+      hostInfo, serviceName_, followedShards);
+
+  for (int i = 0; i < FLAGS_gorilla_shards; i++) {
+    std::vector<std::pair<std::string, int>> followers;
+    if (shardList.count(i) > 0) {
+      configAdapter_->getFollowersForShardId(i, serviceName_, followers);
+    }
+    replicator_->setFollowers(i, followers);
+  }
+
+  // A shard keeps the role it was added with until it's dropped, so a
+  // shard that moves between owned and followed is dropped here and
+  // added back with its new role by a later refresh.
+  std::set<int64_t> shards;
+  std::set_union(
+      shardList.begin(),
+      shardList.end(),
+      followedShards.begin(),
+      followedShards.end(),
+      std::inserter(shards, shards.end()));
+  for (auto it = shards.begin(); it != shards.end();) {
+    auto map = shards_.getShardMap(*it);
+    if (map && !map->setFollower(shardList.count(*it) == 0)) {
+      it = shards.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // We will addShard everything we should own or follow and dropShard all
+  // other shards. For anything we already have and should (or do not have
+  // and shouldn't), this is a noop.
+  shards_.setShards(shards);
+}
+
+void BeringeiServiceHandler::updateShardOwners(
+    const std::set<int64_t>& ownedShards) {
+  std::lock_guard<std::mutex> guard(shardOwnersMutex_);
+  for (int i = 0; i < FLAGS_gorilla_shards; i++) {
+    // Owned shards keep the owner they had before this host got them
+    // until they have been copied.
+    if (ownedShards.count(i) > 0) {
+      continue;
+    }
+
+    std::pair<std::string, int> owner;
+    if (configAdapter_->getHostForShardId(i, serviceName_, owner)) {
+      shardOwners_[i] = owner;
+    } else {
+      shardOwners_.erase(i);
+    }
+  }
+}
+
+void BeringeiServiceHandler::transferShardFiles(int64_t shardId) {
+  std::pair<std::string, int> owner;
+  {
+    std::lock_guard<std::mutex> guard(shardOwnersMutex_);
+    auto it = shardOwners_.find(shardId);
+    if (it == shardOwners_.end()) {
+      // The owner isn't known right after starting.
+      return;
+    }
+    owner = it->second;
+    shardOwners_.erase(it);
+  }
+
+  if (owner == std::make_pair(NetworkUtils::getLocalHost(), (int)port_)) {
+    return;
+  }
+
+  LOG(INFO) << "Copying shard " << shardId << " from " << owner.first << ":"
+            << owner.second;
+  Timer timer(true);
+  ShardTransfer transfer(shardId, FLAGS_data_directory);
+  transfer.clear();
+
+  int64_t bytes = 0;
+  std::vector<ShardTransfer::File> files;
+  try {
+    folly::EventBase eb;
+    folly::SocketAddress address(owner.first, owner.second, true);
+    auto channel = apache::thrift::HeaderClientChannel::newChannel(
+        apache::thrift::async::TAsyncSocket::newSocket(&eb, address));
+    channel->setTimeout(kShardTransferTimeoutMs);
+    BeringeiServiceAsyncClient client(std::move(channel));
+
+    TransferShardRequest request;
+    request.shardId = shardId;
+    TransferShardResult result;
+    client.sync_transferShard(result, request);
+    if (result.status != StatusCode::OK) {
+      throw std::runtime_error("Listing the files failed");
+    }
+
+    request.maxBytes = kShardTransferChunkBytes;
+    for (const auto& file : result.files) {
+      // Log files are read from the owner when the shard is loaded.
+      if (logFileSource_ && file.prefix == BucketLogWriter::kLogFilePrefix) {
+        continue;
+      }
+
+      files.push_back(ShardTransfer::File{file.prefix, file.id});
+      request.file = file;
+      request.offset = 0;
+
+      bool endOfFile = false;
+      while (!endOfFile) {
+        TransferShardResult chunk;
+        client.sync_transferShard(chunk, request);
+        if (chunk.status != StatusCode::OK ||
+            !transfer.writeFile(files.back(), request.offset, chunk.data)) {
+          throw std::runtime_error(
+              "Copying " + file.prefix + "." + std::to_string(file.id) +
+              " failed");
+        }
+        request.offset += chunk.data.size();
+        bytes += chunk.data.size();
+        endOfFile = chunk.endOfFile;
+      }
+    }
+  } catch (std::exception& e) {
+    LOG(ERROR) << "Copying shard " << shardId << " from " << owner.first
+               << " failed, loading it from the data directory: " << e.what();
+    GorillaStatsManager::addStatValue(kShardTransferFailures);
+    transfer.clear();
+    return;
+  }
+
+  transfer.install(files);
+  if (logFileSource_) {
+    logFileSource_->setOwner(shardId, owner);
+  }
+  GorillaStatsManager::addStatValue(kShardTransferBytes, bytes);
+  GorillaStatsManager::addStatValue(
+      kMsPerShardTransfer, timer.get() / kGorillaUsecPerMs);
+  LOG(INFO) << "Copied " << files.size() << " files and " << bytes
+            << " bytes of shard " << shardId << " in " << timer.get() << "us";
+}
+
+void BeringeiServiceHandler::transferShard(
+    TransferShardResult& ret,
+    std::unique_ptr<TransferShardRequest> req) {
+  auto map = shards_.getShardMap(req->shardId);
+  if (!map) {
+    ret.status = StatusCode::RPC_FAIL;
+    return;
+  }
+
+  // Followers don't write the files of the shard.
+  if (map->isFollower()) {
+    ret.status = StatusCode::DONT_OWN_SHARD;
+    return;
+  }
+
+  // The previous owner normally has the shard in PRE_UNOWNED state while
+  // the next one is loading it.
+  auto state = map->getState();
+  if (state != BucketMap::OWNED && state != BucketMap::PRE_UNOWNED) {
+    ret.status = state == BucketMap::UNOWNED ? StatusCode::DONT_OWN_SHARD
+                                             : StatusCode::SHARD_IN_PROGRESS;
+    return;
+  }
+
+  ShardTransfer transfer(req->shardId, FLAGS_data_directory);
+  if (req->file.prefix.empty()) {
+    // The snapshot covers the logs of the open bucket written so far.
+    map->writeSnapshot();
+    uint32_t lastFinalized = map->getLastFinalizedBucket();
+    int64_t firstLogFileId =
+        lastFinalized > 0 ? map->timestamp(lastFinalized + 1) : 0;
+    for (const auto& file : transfer.listFiles(firstLogFileId)) {
+      ShardFile shardFile;
+      shardFile.prefix = file.prefix;
+      shardFile.id = file.id;
+      ret.files.push_back(std::move(shardFile));
+    }
+
+    LOG(INFO) << "Sending " << ret.files.size() << " files of shard "
+              << req->shardId;
+    ret.status = StatusCode::OK;
+    return;
+  }
+
+  int32_t maxBytes = req->maxBytes > 0
+      ? std::min(req->maxBytes, kShardTransferChunkBytes)
+      : kShardTransferChunkBytes;
+  ShardTransfer::File file{req->file.prefix, req->file.id};
+  if (!transfer.readFile(
+          file, req->offset, maxBytes, ret.data, ret.endOfFile)) {
+    ret.status = StatusCode::RPC_FAIL;
+    return;
+  }
+
+  GorillaStatsManager::addStatValue(kShardTransferBytesSent, ret.data.size());
+  ret.status = StatusCode::OK;
+}
+
+void BeringeiServiceHandler::subscribe(
+    SubscribeResult& ret,
+    std::unique_ptr<SubscribeRequest> req) {
+  // Only the points of the shards owned by this host are published
+  // here.
+  std::set<int64_t> shardIds;
+  if (!req->prefix.empty()) {
+    shardIds.insert(req->prefixShards.begin(), req->prefixShards.end());
+  }
+  for (const auto& key : req->keys) {
+    shardIds.insert(key.shardId);
+  }
+  for (int64_t shardId : shardIds) {
+    auto map = shards_.getShardMap(shardId);
+    if (!map || map->getState() == BucketMap::UNOWNED) {
+      ret.status = StatusCode::DONT_OWN_SHARD;
+      return;
+    }
+  }
+
+  ret.subscriptionId = subscriptions_->subscribe(
+      req->keys,
+      req->prefix,
+      req->prefixShards,
+      std::max(0, req->bufferSize));
+  ret.status =
+      ret.subscriptionId != 0 ? StatusCode::OK : StatusCode::OVERLOADED;
+}
+
+void BeringeiServiceHandler::pollSubscription(
+    PollSubscriptionResult& ret,
+    std::unique_ptr<PollSubscriptionRequest> req) {
+  int64_t timeoutMs = std::min(
+      std::max(0, req->timeoutMs), std::max(0, FLAGS_max_subscription_poll_ms));
+  if (!subscriptions_->poll(
+          req->subscriptionId,
+          timeoutMs,
+          std::max(0, req->maxPoints),
+          ret.points,
+          ret.droppedPoints)) {
+    ret.status = StatusCode::KEY_MISSING;
+    return;
+  }
+  ret.status = StatusCode::OK;
+}
+
+void BeringeiServiceHandler::unsubscribe(int64_t subscriptionId) {
+  subscriptions_->unsubscribe(subscriptionId);
+}
+
+void BeringeiServiceHandler::backfill(
+    BackfillResult& ret,
+    std::unique_ptr<BackfillRequest> req) {
+  Timer timer(true);
+
+  std::unordered_map<int64_t, std::vector<uint32_t>> dataByShard;
+  for (uint32_t i = 0; i < req->data.size(); i++) {
+    if (req->data[i].key.key.length() > kMaxKeyLength) {
+      tooLongKeysStat.add();
+      ret.pointsDropped += req->data[i].block.count;
+      continue;
+    }
+    dataByShard[req->data[i].key.shardId].push_back(i);
+  }
+
+  for (const auto& shard : dataByShard) {
+    auto map = shards_.getShardMap(shard.first);
+    if (!map || map->isFollower()) {
+      ret.rejected.insert(
+          ret.rejected.end(), shard.second.begin(), shard.second.end());
+      continue;
+    }
+
+    auto result = map->backfill(req->data, shard.second);
+    ret.rejected.insert(
+        ret.rejected.end(), result.notOwned.begin(), result.notOwned.end());
+    ret.pointsAdded += result.added;
+    ret.pointsDropped += result.dropped;
+    GorillaStatsManager::addStatValue(kNewKeys, result.newRows);
+  }
+
+  ret.status =
+      ret.rejected.empty() ? StatusCode::OK : StatusCode::DONT_OWN_SHARD;
+
+  // Cached results of the backfilled buckets are stale.
+  if (ret.pointsAdded > 0 && getDataCache_) {
+    getDataCache_->clear();
+  }
+
+  GorillaStatsManager::addStatValue(kBackfilledDatapoints, ret.pointsAdded);
+  GorillaStatsManager::addStatValue(
+      kBackfillDroppedDatapoints, ret.pointsDropped);
+  GorillaStatsManager::addStatValue(
+      kMsPerBackfill, timer.get() / kGorillaUsecPerMs);
+}
+
+void BeringeiServiceHandler::appendKeys(
+    ReplicationResult& ret,
+    std::unique_ptr<AppendKeysRequest> req) {
+  std::map<int64_t, std::vector<uint32_t>> keysByShard;
+  for (uint32_t i = 0; i < req->keys.size(); i++) {
+    keysByShard[req->keys[i].shardId].push_back(i);
+  }
+
+  for (const auto& shard : keysByShard) {
+    auto map = shards_.getShardMap(shard.first);
+    if (!map ||
+        map->putReplicatedKeys(req->keys, shard.second) ==
+            BucketMap::kNotOwned) {
+      ret.rejectedShards.push_back(shard.first);
+    }
+  }
+}
+
+void BeringeiServiceHandler::logDataPoints(
+    ReplicationResult& ret,
+    std::unique_ptr<LogDataPointsRequest> req) {
+  std::map<int64_t, std::vector<uint32_t>> pointsByShard;
+  for (uint32_t i = 0; i < req->points.size(); i++) {
+    pointsByShard[req->points[i].shardId].push_back(i);
+  }
+
+  int added = 0;
+  for (const auto& shard : pointsByShard) {
+    auto map = shards_.getShardMap(shard.first);
+    int result = map ? map->putReplicatedPoints(req->points, shard.second)
+                     : BucketMap::kNotOwned;
+    if (result == BucketMap::kNotOwned) {
+      ret.rejectedShards.push_back(shard.first);
+    } else {
+      added += result;
+    }
+  }
+  GorillaStatsManager::addStatValue(kDatapointsAdded, added);
 }
 
 void BeringeiServiceHandler::purgeThread() {
+  subscriptions_->removeIdle();
   int numPurged = purgeTimeSeries(FLAGS_buckets);
   LOG(INFO) << "Purged " << numPurged << " time series.";
   GorillaStatsManager::addStatValue(kPurgedTimeSeries, numPurged);
 }
 
+void BeringeiServiceHandler::memoryPressureThread() {
+  shards_.exportNumaStats();
+
+  std::atomic<int64_t> growth(0);
+  std::atomic<int> evicted(0);
+  bool evict =
+      memoryUsageGuard_->getPressure() >= MemoryUsageGuardIf::EVICT_BUCKETS;
+  forEachOwnedShard([&](BucketMap* bucketMap) {
+    growth += bucketMap->getExpectedRotationBytes();
+    if (evict && bucketMap->getStorage()->mapOldestBucket()) {
+      evicted++;
+    }
+  });
+
+  memoryUsageGuard_->setExpectedGrowth(growth);
+  if (evicted > 0) {
+    LOG(WARNING) << "Evicted " << evicted << " buckets to their block files "
+                 << "because of memory pressure";
+    GorillaStatsManager::addStatValue(kEvictedBuckets, evicted);
+  }
+}
+
 void BeringeiServiceHandler::cleanThread() {
   Timer timer(true);
   LOG(INFO) << "Compressing key lists and deleting old block files";
-  for (auto& bucketMap : shards_) {
-    if (bucketMap->getState() != BucketMap::OWNED) {
-      continue;
-    }
+  forEachOwnedShard([](BucketMap* bucketMap) {
     bucketMap->compactKeyList();
     bucketMap->deleteOldBlockFiles();
-  }
+  });
   LOG(INFO) << "Done compressing key lists and deleting old block files";
   GorillaStatsManager::addStatValue(
       kMsPerKeyListCompact, timer.get() / kGorillaUsecPerMs);
 }
 
+bool BeringeiServiceHandler::shouldShedPuts() {
+  if (FLAGS_put_shed_queue_fill > 0 &&
+      std::max(keyWriter_->getQueueFill(), logWriter_->getQueueFill()) >
+          FLAGS_put_shed_queue_fill) {
+    return true;
+  }
+
+  if (FLAGS_put_shed_when_low_on_memory &&
+      memoryUsageGuard_->weAreLowOnMemory()) {
+    return true;
+  }
+
+  if (FLAGS_put_shed_latency_us > 0 &&
+      putLatencyUs_ > FLAGS_put_shed_latency_us) {
+    // Twice the allowed latency sheds as many puts as possible.
+    double fraction = std::min(
+        kMaxPutShedFraction,
+        (double)(putLatencyUs_ - FLAGS_put_shed_latency_us) /
+            FLAGS_put_shed_latency_us);
+    return folly::Random::randDouble01() < fraction;
+  }
+
+  return false;
+}
+
+void BeringeiServiceHandler::forEachOwnedShard(
+    const std::function<void(BucketMap*)>& fn) {
+  folly::MPMCQueue<uint32_t> queue(FLAGS_gorilla_shards);
+  for (int i = 0; i < FLAGS_gorilla_shards; i++) {
+    queue.write(i);
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::max(1, FLAGS_maintenance_threads); i++) {
+    threads.emplace_back([&]() {
+      uint32_t shardId;
+      while (queue.read(shardId)) {
+        BucketMap* bucketMap = shards_[shardId];
+        if (bucketMap->getState() != BucketMap::OWNED) {
+          continue;
+        }
+
+        try {
+          fn(bucketMap);
+        } catch (std::exception& e) {
+          LOG(ERROR) << e.what();
+        }
+      }
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void BeringeiServiceHandler::snapshotThread() {
+  LOG(INFO) << "Writing open bucket snapshots";
+  int count = 0;
+  for (auto& bucketMap : shards_) {
+    if (bucketMap->writeSnapshot()) {
+      count++;
+    }
+  }
+  LOG(INFO) << "Wrote open bucket snapshots for " << count << " shards";
+}
+
+void BeringeiServiceHandler::deviationIndexThread() {
+  Timer timer(true);
+  uint32_t now = time(nullptr);
+
+  // Minutes that can still get late data points are indexed again.
+  uint32_t indexingStart = now -
+      std::max(FLAGS_deviation_index_interval_secs,
+               FLAGS_allowed_timestamp_behind);
+  uint32_t deviationStart =
+      std::min(indexingStart, now - FLAGS_deviation_window_secs);
+
+  std::atomic<int> deviations(0);
+  forEachOwnedShard([&](BucketMap* map) {
+    deviations += map->indexDeviatingTimeSeries(
+        deviationStart, indexingStart, now, FLAGS_deviation_index_sigma);
+  });
+
+  GorillaStatsManager::addStatValue(
+      kMsPerDeviationIndex, timer.get() / kGorillaUsecPerMs);
+  GorillaStatsManager::addStatValue(kDeviationsIndexed, deviations);
+}
+
 BucketMap* BeringeiServiceHandler::getShardMap(int64_t shardId) {
   return shards_[shardId];
 }
@@ -609,65 +2337,235 @@ void BeringeiServiceHandler::getLastUpdateTimes(
 
   Timer timer(true);
 
-  std::vector<BucketMap::Item> timeSeriesData;
-  ret.moreResults = map->getSome(timeSeriesData, req->offset, req->limit);
+  // Without the cursor only the rows in [offset, offset + limit) are
+  // looked at, like before.
+  int end = req->useCursor ? std::numeric_limits<int>::max()
+                           : req->offset + std::max(0, req->limit);
+  int next;
+  std::vector<BucketMap::UpdatedItem> updated;
+  ret.moreResults = map->getUpdatedSince(
+      req->minLastUpdateTime, req->offset, end, req->limit, updated, next);
+  ret.nextOffset = next;
+
+  for (auto& timeSeries : updated) {
+    KeyUpdateTime key;
+    key.key = timeSeries.item->first;
+
+    key.categoryId = timeSeries.item->second.getCategory();
+    key.updateTime = timeSeries.lastUpdateTime;
+
+    uint8_t queriedBucketsAgo = timeSeries.item->second.getQueriedBucketsAgo();
+    key.queriedRecently =
+        queriedBucketsAgo <= map->buckets(kGorillaSecondsPerDay);
+
+    ret.keys.push_back(std::move(key));
+  }
+
+  GorillaStatsManager::addStatValue(kUsPerGetLastUpdateTimes, timer.get());
+}
+
+void BeringeiServiceHandler::searchKeys(
+    SearchKeysResult& ret,
+    std::unique_ptr<SearchKeysRequest> req) {
+  auto map = getShardMap(req->shardId);
+  if (!map || map->getState() != BucketMap::OWNED) {
+    ret.status = StatusCode::DONT_OWN_SHARD;
+    return;
+  }
+
+  if (req->pattern.length() > kMaxKeyLength || req->limit <= 0) {
+    LOG(ERROR) << "Invalid key search for shard " << req->shardId;
+    ret.status = StatusCode::RPC_FAIL;
+    return;
+  }
 
-  for (auto& timeSeries : timeSeriesData) {
-    if (timeSeries.get()) {
-      uint32_t lastUpdateTime =
-          timeSeries->second.getLastUpdateTime(map->getStorage(), *map);
-      if (lastUpdateTime >= req->minLastUpdateTime) {
-        KeyUpdateTime key;
-        key.key = timeSeries->first;
+  Timer timer(true);
 
-        key.categoryId = timeSeries->second.getCategory();
-        key.updateTime = lastUpdateTime;
+  std::vector<BucketMap::Item> items;
+  ret.moreResults =
+      map->searchKeys(req->pattern, req->after, req->limit, items);
+  if (!items.empty()) {
+    ret.lastKey = items.back()->first;
+  }
 
-        uint8_t queriedBucketsAgo = timeSeries->second.getQueriedBucketsAgo();
-        key.queriedRecently =
-            queriedBucketsAgo <= map->buckets(kGorillaSecondsPerDay);
+  uint32_t begin = map->bucket(req->begin);
+  uint32_t end = map->bucket(req->end);
+  for (auto& timeSeries : items) {
+    uint32_t lastUpdateTime =
+        timeSeries->second.getLastUpdateTime(map->getStorage(), *map);
+    if (lastUpdateTime < req->begin) {
+      continue;
+    }
 
-        ret.keys.push_back(std::move(key));
+    KeyUpdateTime key;
+    key.key = timeSeries->first;
+    key.categoryId = timeSeries->second.getCategory();
+    key.updateTime = lastUpdateTime;
+    uint8_t queriedBucketsAgo = timeSeries->second.getQueriedBucketsAgo();
+    key.queriedRecently =
+        queriedBucketsAgo <= map->buckets(kGorillaSecondsPerDay);
+    ret.keys.push_back(std::move(key));
+
+    if (req->withData) {
+      ret.data.emplace_back();
+      timeSeries->second.get(
+          begin, end, ret.data.back().data, map->getStorage());
+      if (FLAGS_trim_get_data_blocks) {
+        TimeSeries::trimBlocks(ret.data.back().data, req->begin, req->end);
       }
     }
   }
 
-  GorillaStatsManager::addStatValue(kUsPerGetLastUpdateTimes, timer.get());
+  ret.status = StatusCode::OK;
+  GorillaStatsManager::addStatValue(kUsPerSearchKeys, timer.get());
+  GorillaStatsManager::addStatValue(kKeysSearched, items.size());
 }
 
-int BeringeiServiceHandler::purgeTimeSeries(uint8_t numBuckets) {
-  int purgedTimeSeries = 0;
+void BeringeiServiceHandler::getDeviatingKeys(
+    GetDeviatingKeysResult& ret,
+    std::unique_ptr<GetDeviatingKeysRequest> req) {
+  auto map = getShardMap(req->shardId);
+  if (!map || map->getState() != BucketMap::OWNED) {
+    ret.status = StatusCode::DONT_OWN_SHARD;
+    return;
+  }
 
-  try {
-    std::unordered_map<int32_t, int64_t> purgedTSPerCategory;
-    for (auto& bucketMap : shards_) {
-      if (bucketMap->getState() != BucketMap::OWNED) {
-        continue;
+  if (req->limit <= 0 || req->begin < 0 || req->end < req->begin) {
+    LOG(ERROR) << "Invalid deviating keys request for shard "
+               << req->shardId;
+    ret.status = StatusCode::RPC_FAIL;
+    return;
+  }
+
+  Timer timer(true);
+
+  auto deviations = map->getDeviatingTimeSeries(req->begin, req->end);
+  ret.moreResults = deviations.size() > req->limit;
+  if (ret.moreResults) {
+    deviations.resize(req->limit);
+  }
+
+  uint32_t begin = map->bucket(req->begin);
+  uint32_t end = map->bucket(req->end);
+  for (auto& deviation : deviations) {
+    ret.keys.emplace_back();
+    ret.keys.back().key = deviation.item->first;
+    ret.keys.back().times.assign(
+        deviation.times.begin(), deviation.times.end());
+
+    if (req->withData) {
+      ret.data.emplace_back();
+      deviation.item->second.get(
+          begin, end, ret.data.back().data, map->getStorage());
+      if (FLAGS_trim_get_data_blocks) {
+        TimeSeries::trimBlocks(ret.data.back().data, req->begin, req->end);
       }
+    }
+  }
+
+  ret.status = StatusCode::OK;
+  GorillaStatsManager::addStatValue(kUsPerGetDeviatingKeys, timer.get());
+}
+
+void BeringeiServiceHandler::getResourceUsage(
+    GetResourceUsageResult& ret,
+    std::unique_ptr<GetResourceUsageRequest> req) {
+  Timer timer(true);
+
+  std::vector<int64_t> shardIds = req->shardIds;
+  if (shardIds.empty()) {
+    for (int i = 0; i < FLAGS_gorilla_shards; i++) {
+      shardIds.push_back(i);
+    }
+  }
 
-      std::vector<BucketMap::Item> timeSeriesData;
-      bucketMap->getEverything(timeSeriesData);
+  for (int64_t shardId : shardIds) {
+    auto map = getShardMap(shardId);
+    if (!map || map->getState() != BucketMap::OWNED) {
+      continue;
+    }
+
+    BucketMap::ResourceUsage usage;
+    map->getResourceUsage(req->sampleEvery, usage);
+
+    ShardResourceUsage shard;
+    shard.shardId = shardId;
+    shard.numSeries = usage.numSeries;
+    for (const auto& bucket : usage.pageBytesByPosition) {
+      shard.pageBytesPerBucket[bucket.first] = bucket.second;
+    }
+    shard.activeStreamBytes = usage.activeStreamBytes;
+    shard.activeStreamSlackBytes = usage.activeStreamSlackBytes;
+    shard.dedupHitRate = usage.dedupHitRate;
+    shard.pointsAdded = usage.pointsAdded;
+    shard.keysQueried = usage.keysQueried;
+    shard.pointsAddedPerSecond = usage.pointsAddedPerSecond;
+    shard.keysQueriedPerSecond = usage.keysQueriedPerSecond;
+    shard.keyListRecords = usage.keyListRecords;
+    for (const auto& category : usage.categories) {
+      auto& out = shard.categories[category.first];
+      out.numSeries = category.second.numSeries;
+      out.activeStreamBytes = category.second.activeStreamBytes;
+    }
+    ret.shards.push_back(std::move(shard));
+  }
+
+  GorillaStatsManager::addStatValue(kUsPerGetResourceUsage, timer.get());
+}
+
+int BeringeiServiceHandler::purgeTimeSeries(uint8_t numBuckets) {
+  Timer timer(true);
+  std::atomic<int> purgedTimeSeries(0);
+  std::mutex purgedMutex;
+  std::unordered_map<int32_t, int64_t> purgedTSPerCategory;
+
+  forEachOwnedShard([&](BucketMap* bucketMap) {
+    // Followers keep the rows until the owner gives their ids to other
+    // keys.
+    if (bucketMap->isFollower()) {
+      return;
+    }
+
+    std::unordered_map<int32_t, int64_t> purgedPerCategory;
+    std::vector<BucketMap::Row*> timeSeriesData;
+    std::vector<int> indexes;
+    std::vector<BucketMap::Row*> items;
+    bool more = true;
+    for (int offset = 0; more; offset += kPurgeBatchSize) {
+      BucketMap::RowReader reader(bucketMap);
+      timeSeriesData.clear();
+      more = reader.getSome(timeSeriesData, offset, kPurgeBatchSize);
+
+      indexes.clear();
+      items.clear();
       for (int i = 0; i < timeSeriesData.size(); i++) {
-        if (timeSeriesData[i].get()) {
-          uint16_t category = timeSeriesData[i]->second.getCategory();
-          if (!timeSeriesData[i]->second.hasDataPoints(numBuckets)) {
-            bucketMap->erase(i, timeSeriesData[i]);
-            ++purgedTimeSeries;
-            ++purgedTSPerCategory[category];
-          }
+        if (timeSeriesData[i] &&
+            !timeSeriesData[i]->second.hasDataPoints(numBuckets)) {
+          indexes.push_back(offset + i);
+          items.push_back(timeSeriesData[i]);
+          ++purgedPerCategory[timeSeriesData[i]->second.getCategory()];
         }
       }
+
+      if (!items.empty()) {
+        purgedTimeSeries += bucketMap->eraseBatch(indexes, items);
+      }
     }
 
-    for (auto item : purgedTSPerCategory) {
-      GorillaStatsManager::setCounter(
-          kPurgedTimeSeriesInCategoryPrefix + std::to_string(item.first),
-          item.second);
+    std::lock_guard<std::mutex> guard(purgedMutex);
+    for (auto item : purgedPerCategory) {
+      purgedTSPerCategory[item.first] += item.second;
     }
-  } catch (std::exception& e) {
-    LOG(ERROR) << e.what();
+  });
+
+  for (auto item : purgedTSPerCategory) {
+    GorillaStatsManager::setCounter(
+        kPurgedTimeSeriesInCategoryPrefix + std::to_string(item.first),
+        item.second);
   }
 
+  GorillaStatsManager::addStatValue(
+      kMsPerPurge, timer.get() / kGorillaUsecPerMs);
   return purgedTimeSeries;
 }
 
@@ -698,10 +2596,12 @@ void BeringeiServiceHandler::finalizeBucketsThread() {
 
 void BeringeiServiceHandler::finalizeBucket(const uint64_t timestamp) {
   LOG(INFO) << "Finalizing buckets at time " << timestamp;
+  Timer totalTimer(true);
 
   // Put all the shards in the queue even if they are not owned
   // because they might be owned 5 minutes later.
   folly::MPMCQueue<uint32_t> queue(FLAGS_gorilla_shards);
+  std::atomic<bool> finalized(false);
   for (int i = 0; i < FLAGS_gorilla_shards; i++) {
     queue.write(i);
   }
@@ -725,6 +2625,11 @@ void BeringeiServiceHandler::finalizeBucket(const uint64_t timestamp) {
 
         GorillaStatsManager::addStatValueAggregated(
             kMsPerFinalizeShardBucket, timer.get() / kGorillaUsecPerMs, count);
+        if (count > 0) {
+          finalized = true;
+          GorillaStatsManager::addStatValue(
+              kMsPerShardFinalize, timer.get() / kGorillaUsecPerMs);
+        }
       }
     });
   }
@@ -733,6 +2638,15 @@ void BeringeiServiceHandler::finalizeBucket(const uint64_t timestamp) {
     t.join();
   }
 
+  // The cached results of finalized buckets are kept until the next
+  // rotation.
+  if (finalized && getDataCache_) {
+    getDataCache_->clear();
+  }
+
+  // Wall time for all the shards of this host.
+  GorillaStatsManager::addStatValue(
+      kMsPerFinalizeBuckets, totalTimer.get() / kGorillaUsecPerMs);
   LOG(INFO) << "Finished finalizing buckets at time " << timestamp;
 }
 
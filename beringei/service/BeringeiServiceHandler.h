@@ -9,7 +9,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <mutex>
+#include <unordered_map>
 
 #include <folly/SharedMutex.h>
 #include <folly/experimental/FunctionScheduler.h>
@@ -17,9 +21,15 @@
 #include "beringei/client/BeringeiConfigurationAdapterIf.h"
 #include "beringei/if/gen-cpp2/BeringeiService.h"
 #include "beringei/lib/BucketMap.h"
+#include "beringei/lib/CoalescedBlockCache.h"
+#include "beringei/lib/GetDataCache.h"
 #include "beringei/lib/LogReader.h"
 #include "beringei/lib/MemoryUsageGuardIf.h"
+#include "beringei/lib/PartialAggregate.h"
 #include "beringei/lib/ShardData.h"
+#include "beringei/lib/ShardExecutor.h"
+#include "beringei/lib/ShardReplicator.h"
+#include "beringei/lib/SubscriptionManager.h"
 
 /* using override */
 using facebook::gorilla::BeringeiServiceSvIf;
@@ -29,6 +39,8 @@ class BeringeiServiceHandlerTest;
 namespace facebook {
 namespace gorilla {
 
+class ShardOwnerLogFileSource;
+
 class BeringeiServiceHandler : virtual public BeringeiServiceSvIf {
   friend class ::BeringeiServiceHandlerTest;
 
@@ -48,6 +60,17 @@ class BeringeiServiceHandler : virtual public BeringeiServiceSvIf {
   void getData(GetDataResult& ret, std::unique_ptr<GetDataRequest> req)
       override;
 
+  void getDataColumnar(
+      GetDataColumnarResult& ret,
+      std::unique_ptr<GetDataRequest> req) override;
+
+  void aggregate(AggregateResult& ret, std::unique_ptr<AggregateRequest> req)
+      override;
+
+  // Number of key buckets a getData request reads: the number of keys
+  // times the number of buckets in its time range.
+  static int64_t estimateReadCost(const GetDataRequest& req);
+
   void putDataPoints(
       PutDataResult& response,
       std::unique_ptr<PutDataRequest> req) override;
@@ -70,21 +93,120 @@ class BeringeiServiceHandler : virtual public BeringeiServiceSvIf {
       GetLastUpdateTimesResult& ret,
       std::unique_ptr<GetLastUpdateTimesRequest> req) override;
 
+  void searchKeys(
+      SearchKeysResult& ret,
+      std::unique_ptr<SearchKeysRequest> req) override;
+
+  void getDeviatingKeys(
+      GetDeviatingKeysResult& ret,
+      std::unique_ptr<GetDeviatingKeysRequest> req) override;
+
+  void getResourceUsage(
+      GetResourceUsageResult& ret,
+      std::unique_ptr<GetResourceUsageRequest> req) override;
+
+  void transferShard(
+      TransferShardResult& ret,
+      std::unique_ptr<TransferShardRequest> req) override;
+
+  void subscribe(
+      SubscribeResult& ret,
+      std::unique_ptr<SubscribeRequest> req) override;
+
+  void pollSubscription(
+      PollSubscriptionResult& ret,
+      std::unique_ptr<PollSubscriptionRequest> req) override;
+
+  void unsubscribe(int64_t subscriptionId) override;
+
+  void backfill(
+      BackfillResult& ret,
+      std::unique_ptr<BackfillRequest> req) override;
+
+  void appendKeys(
+      ReplicationResult& ret,
+      std::unique_ptr<AppendKeysRequest> req) override;
+
+  void logDataPoints(
+      ReplicationResult& ret,
+      std::unique_ptr<LogDataPointsRequest> req) override;
+
   void purgeThread();
   void cleanThread();
+  void snapshotThread();
+
+  // Tells the memory usage guard how much the next bucket rotation will
+  // add and evicts buckets when it's under pressure.
+  void memoryPressureThread();
+
+  // Indexes the values of the recent minutes of the owned shards that
+  // deviate from their mean.
+  void deviationIndexThread();
 
   // Purges time series that have no data in the active bucket and not
-  // in any of the `numBuckets` older buckets.
+  // in any of the `numBuckets` older buckets, or of the retention of
+  // their category if it's shorter.
   int purgeTimeSeries(uint8_t numBuckets);
 
   void finalizeBucket(const uint64_t timestamp);
   void finalizeBucketsThread();
 
  private:
+  // Returns true if the puts of a request should be rejected with
+  // OVERLOADED because the writer queues are about to drop entries,
+  // memory is low or puts have become too slow.
+  bool shouldShedPuts();
+
+  // Runs a getData request without --get_data_cache_mb. With `partial`,
+  // the cross key reduction is added to it instead of `ret.reduced`.
+  void getDataUncached(
+      GetDataResult& ret,
+      const GetDataRequest& req,
+      PartialAggregate* partial = nullptr);
+
+  // Reduces `keys` between the times of `req` into `partial`. Adds the
+  // shards of the keys that aren't owned to `ret.unownedShards` and sets
+  // `ret.status` if some keys are missing data.
+  void aggregateKeys(
+      const AggregateRequest& req,
+      std::vector<Key>& keys,
+      PartialAggregate& partial,
+      AggregateResult& ret);
+
+  // Runs a getData request with per key ranges once for each range.
+  void getDataRanges(GetDataResult& ret, const GetDataRequest& req);
+
+  // Looks up the keys of `req` shard by shard and sets their statuses
+  // in `results`. Calls `fetch` once per shard with the indexes of the
+  // keys that were found and their time series. Returns the number of
+  // keys found.
+  typedef std::function<void(
+      BucketMap* map,
+      const std::vector<uint32_t>& indexes,
+      const std::vector<BucketedTimeSeries*>& series)>
+      FetchFunction;
+  int findKeys(
+      const GetDataRequest& req,
+      std::vector<TimeSeriesData>& results,
+      const FetchFunction& fetch);
+
+  // Calls `fn` for each owned shard on --maintenance_threads threads.
+  void forEachOwnedShard(const std::function<void(BucketMap*)>& fn);
+
   // Reads shard map (via configAdapter_) to learn of shards that have been
   // added or dropped.  Invoked periodically via function scheduler.
   void refreshShardConfig();
 
+  // Remembers the owners of the shards this host doesn't own, so that
+  // the files of a shard can be copied from its previous owner when
+  // this host gets it. Used with --shard_transfer.
+  void updateShardOwners(const std::set<int64_t>& ownedShards);
+
+  // Copies the files of a shard that is being added from its previous
+  // owner. The shard is loaded from whatever files there are if this
+  // fails.
+  void transferShardFiles(int64_t shardId);
+
   ShardData shards_;
 
   std::shared_ptr<BeringeiConfigurationAdapterIf> configAdapter_;
@@ -96,8 +218,46 @@ class BeringeiServiceHandler : virtual public BeringeiServiceSvIf {
   folly::FunctionScheduler purgeThread_;
   folly::FunctionScheduler cleanThread_;
   folly::FunctionScheduler bucketFinalizerThread_;
+  folly::FunctionScheduler snapshotThread_;
   folly::FunctionScheduler refreshShardConfigThread_;
+  folly::FunctionScheduler memoryPressureThread_;
+  folly::FunctionScheduler deviationIndexThread_;
+  folly::FunctionScheduler replicationThread_;
   std::shared_ptr<LogReaderFactory> logReaderFactory_;
+
+  // Set with --remote_shard_logs.
+  std::shared_ptr<ShardOwnerLogFileSource> logFileSource_;
+
+  // Number of getData requests over --heavy_read_cost that are running.
+  std::mutex heavyReadsMutex_;
+  std::condition_variable heavyReadsCondition_;
+  int heavyReads_;
+
+  // Kept to check how full their queues are before accepting puts.
+  std::shared_ptr<KeyListWriter> keyWriter_;
+  std::shared_ptr<BucketLogWriterIf> logWriter_;
+
+  // Moving average of the put latency in microseconds.
+  std::atomic<int64_t> putLatencyUs_;
+
+  std::mutex shardOwnersMutex_;
+  std::unordered_map<int64_t, std::pair<std::string, int>> shardOwners_;
+
+  // Set with --coalesce_get_data_blocks and --coalesced_block_cache_mb.
+  std::unique_ptr<CoalescedBlockCache> coalescedBlockCache_;
+
+  // Set with --get_data_cache_mb.
+  std::unique_ptr<GetDataCache> getDataCache_;
+
+  // Gets the data points added to all the shards.
+  std::shared_ptr<SubscriptionManager> subscriptions_;
+
+  // Sends the new keys and data points of the owned shards to the hosts
+  // that follow them.
+  std::shared_ptr<ShardReplicator> replicator_;
+
+  // Set with --shard_executor_threads.
+  std::unique_ptr<ShardExecutor> shardExecutor_;
 };
 
 } // namespace gorilla
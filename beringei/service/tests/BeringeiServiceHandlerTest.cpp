@@ -9,9 +9,11 @@
 
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <set>
 
 #include "beringei/client/tests/MockConfigurationAdapter.h"
 #include "beringei/lib/BucketMap.h"
+#include "beringei/lib/BucketStorage.h"
 #include "beringei/lib/FileUtils.h"
 #include "beringei/lib/GorillaStatsManager.h"
 #include "beringei/lib/GorillaTimeConstants.h"
@@ -35,6 +37,8 @@ DECLARE_int32(allowed_timestamp_behind);
 DECLARE_int32(gorilla_shards);
 DECLARE_int32(allowed_timestamp_ahead);
 DECLARE_bool(disable_shard_refresh);
+DECLARE_bool(put_shed_when_low_on_memory);
+DECLARE_double(deviation_index_sigma);
 
 const double kDefaultValue = 12345;
 
@@ -517,6 +521,121 @@ TEST_F(BeringeiServiceHandlerTest, GetShardDataBucket) {
   }
 }
 
+TEST_F(BeringeiServiceHandlerTest, ScanShardInChunks) {
+  TemporaryDirectory dir("beringei_data_block");
+  FLAGS_data_directory = dir.dirname();
+  FLAGS_allowed_timestamp_ahead = kGorillaSecondsPerHour * 30;
+
+  BeringeiServiceHandlerForTest handler;
+
+  int64_t oneBucketBack = time(nullptr) - FLAGS_bucket_size;
+  int64_t startTime = oneBucketBack - oneBucketBack % FLAGS_bucket_size;
+  int64_t endTime = startTime + FLAGS_bucket_size;
+
+  int64_t shardId = 0;
+  auto putRequest =
+      generatePutRequest(1000, startTime, endTime, "key", shardId);
+  putDataPoints(handler, std::move(putRequest));
+  handler.finalizeBucket(endTime);
+
+  set<string> keys;
+  int chunks = 0;
+  std::unique_ptr<ScanShardRequest> request(new ScanShardRequest);
+  request->shardId = shardId;
+  request->begin = startTime;
+  request->end = startTime;
+  request->limit = 300;
+  while (true) {
+    ScanShardResult result;
+    handler.scanShard(result, std::make_unique<ScanShardRequest>(*request));
+    ASSERT_EQ(StatusCode::OK, result.status);
+    ASSERT_LE(result.keys.size(), 300);
+    ASSERT_EQ(result.keys.size(), result.data.size());
+    for (const auto& key : result.keys) {
+      EXPECT_TRUE(keys.insert(key).second);
+    }
+    chunks++;
+
+    if (!result.moreEntries) {
+      break;
+    }
+    EXPECT_GT(result.nextOffset, request->offset);
+    request->offset = result.nextOffset;
+  }
+
+  EXPECT_EQ(1000, keys.size());
+  EXPECT_EQ(4, chunks);
+
+  // A byte limit stops after the first key with data.
+  ScanShardResult result;
+  request->offset = 0;
+  request->limit = 0;
+  request->maxBytes = 1;
+  handler.scanShard(result, std::move(request));
+  ASSERT_EQ(StatusCode::OK, result.status);
+  EXPECT_EQ(1, result.keys.size());
+  EXPECT_TRUE(result.moreEntries);
+}
+
+TEST_F(BeringeiServiceHandlerTest, TransferShard) {
+  TemporaryDirectory dir("beringei_data_block");
+  FLAGS_data_directory = dir.dirname();
+  FLAGS_allowed_timestamp_ahead = kGorillaSecondsPerHour * 30;
+
+  BeringeiServiceHandlerForTest handler;
+
+  int64_t oneBucketBack = time(nullptr) - FLAGS_bucket_size;
+  int64_t startTime = oneBucketBack - oneBucketBack % FLAGS_bucket_size;
+  int64_t endTime = startTime + FLAGS_bucket_size;
+
+  int64_t shardId = 0;
+  auto putRequest = generatePutRequest(100, startTime, endTime, "key", shardId);
+  putDataPoints(handler, std::move(putRequest));
+  handler.finalizeBucket(endTime);
+
+  TransferShardResult files;
+  auto request = std::make_unique<TransferShardRequest>();
+  request->shardId = shardId;
+  handler.transferShard(
+      files, std::make_unique<TransferShardRequest>(*request));
+  ASSERT_EQ(StatusCode::OK, files.status);
+
+  bool hasBlockFile = false;
+  for (const auto& file : files.files) {
+    hasBlockFile |= file.prefix == BucketStorage::kDataPrefix;
+
+    // Read each file in small chunks and compare with the original.
+    std::string data;
+    request->file = file;
+    request->offset = 0;
+    request->maxBytes = 1000;
+    while (true) {
+      TransferShardResult chunk;
+      handler.transferShard(
+          chunk, std::make_unique<TransferShardRequest>(*request));
+      ASSERT_EQ(StatusCode::OK, chunk.status);
+      ASSERT_LE(chunk.data.size(), 1000);
+      data += chunk.data;
+      request->offset += chunk.data.size();
+      if (chunk.endOfFile) {
+        break;
+      }
+    }
+
+    std::string expected;
+    FileUtils(shardId, file.prefix, dir.dirname()).read(file.id, expected);
+    EXPECT_EQ(expected, data) << file.prefix << "." << file.id;
+  }
+  EXPECT_TRUE(hasBlockFile);
+
+  // Files that aren't part of a shard can't be read.
+  TransferShardResult result;
+  request->file.prefix = "..";
+  request->offset = 0;
+  handler.transferShard(result, std::move(request));
+  EXPECT_EQ(StatusCode::RPC_FAIL, result.status);
+}
+
 TEST_F(BeringeiServiceHandlerTest, OneHourOfOneMinuteData) {
   TemporaryDirectory dir("beringei_data_block");
   FLAGS_data_directory = dir.dirname();
@@ -884,3 +1003,266 @@ TEST_F(BeringeiServiceHandlerTest, GetLastUpdateTimesWithNoMatches) {
 
   EXPECT_EQ(0, result.keys.size());
 }
+
+TEST_F(BeringeiServiceHandlerTest, GetLastUpdateTimesWithCursor) {
+  TemporaryDirectory dir("beringei_data_block");
+  FLAGS_data_directory = dir.dirname();
+
+  BeringeiServiceHandlerForTest handler;
+
+  int64_t startTime = time(nullptr) - 300;
+  int64_t endTime = startTime + 300;
+
+  putDataPoints(handler, generatePutRequest(50, startTime, startTime, "old"));
+  putDataPoints(handler, generatePutRequest(50, startTime, endTime, "new"));
+
+  // The stale keys are skipped without counting toward the limit.
+  std::unique_ptr<GetLastUpdateTimesRequest> req(new GetLastUpdateTimesRequest);
+  req->shardId = 0;
+  req->minLastUpdateTime = endTime;
+  req->limit = 30;
+  req->useCursor = true;
+
+  std::set<std::string> keys;
+  for (int i = 0; i < 10; i++) {
+    GetLastUpdateTimesResult result;
+    handler.getLastUpdateTimes(
+        result, std::make_unique<GetLastUpdateTimesRequest>(*req));
+    for (auto& key : result.keys) {
+      EXPECT_EQ(endTime, key.updateTime);
+      EXPECT_EQ(0, key.key.find("new"));
+      keys.insert(key.key);
+    }
+    if (!result.moreResults) {
+      break;
+    }
+    EXPECT_GT(result.nextOffset, req->offset);
+    req->offset = result.nextOffset;
+  }
+  EXPECT_EQ(50, keys.size());
+}
+
+TEST_F(BeringeiServiceHandlerTest, SearchKeys) {
+  TemporaryDirectory dir("beringei_data_block");
+  FLAGS_data_directory = dir.dirname();
+
+  BeringeiServiceHandlerForTest handler;
+
+  int64_t startTime = time(nullptr) - 300;
+  int64_t endTime = startTime + 300;
+
+  putDataPoints(handler, generatePutRequest(20, startTime, endTime, "cpu."));
+  putDataPoints(handler, generatePutRequest(20, startTime, endTime, "mem."));
+
+  std::unique_ptr<SearchKeysRequest> req(new SearchKeysRequest);
+  req->shardId = 0;
+  req->pattern = "CPU.1*";
+  req->begin = startTime;
+  req->end = endTime;
+  req->limit = 5;
+  req->withData = true;
+
+  // cpu.1 and cpu.10 to cpu.19 in two pages.
+  SearchKeysResult result;
+  handler.searchKeys(result, std::make_unique<SearchKeysRequest>(*req));
+  EXPECT_EQ(StatusCode::OK, result.status);
+  EXPECT_TRUE(result.moreResults);
+  ASSERT_EQ(5, result.keys.size());
+  ASSERT_EQ(5, result.data.size());
+  EXPECT_EQ("cpu.1", result.keys[0].key);
+  EXPECT_EQ(endTime, result.keys[0].updateTime);
+  EXPECT_FALSE(result.data[0].data.empty());
+  EXPECT_EQ("cpu.13", result.lastKey);
+
+  req->after = result.lastKey;
+  req->limit = 10;
+  req->withData = false;
+  SearchKeysResult next;
+  handler.searchKeys(next, std::move(req));
+  EXPECT_FALSE(next.moreResults);
+  ASSERT_EQ(6, next.keys.size());
+  EXPECT_EQ("cpu.14", next.keys[0].key);
+  EXPECT_EQ("cpu.19", next.keys[5].key);
+  EXPECT_TRUE(next.data.empty());
+
+  // Keys not updated since `begin` are skipped.
+  req.reset(new SearchKeysRequest);
+  req->shardId = 0;
+  req->pattern = "mem.*";
+  req->begin = endTime + 1;
+  req->limit = 100;
+  SearchKeysResult none;
+  handler.searchKeys(none, std::move(req));
+  EXPECT_EQ(StatusCode::OK, none.status);
+  EXPECT_TRUE(none.keys.empty());
+
+  dropShardAndWait(&handler, 0);
+  req.reset(new SearchKeysRequest);
+  req->shardId = 0;
+  req->pattern = "cpu.*";
+  req->limit = 100;
+  SearchKeysResult notOwned;
+  handler.searchKeys(notOwned, std::move(req));
+  EXPECT_EQ(StatusCode::DONT_OWN_SHARD, notOwned.status);
+}
+
+TEST_F(BeringeiServiceHandlerTest, Aggregate) {
+  TemporaryDirectory dir("beringei_data_block");
+  FLAGS_data_directory = dir.dirname();
+
+  BeringeiServiceHandlerForTest handler;
+
+  int64_t startTime = time(nullptr) - 300;
+  int64_t endTime = startTime + 300;
+
+  putDataPoints(handler, generatePutRequest(20, startTime, endTime, "cpu."));
+  putDataPoints(handler, generatePutRequest(20, startTime, endTime, "mem."));
+
+  // cpu.1 and cpu.10 to cpu.19 from the prefix, and one more key.
+  std::unique_ptr<AggregateRequest> req(new AggregateRequest);
+  req->keys.resize(2);
+  req->keys[0].key = "mem.0";
+  req->keys[1].key = "mem.missing";
+  req->prefix = "CPU.1";
+  req->prefixShards = {0};
+  req->begin = startTime;
+  req->end = endTime;
+  req->aggregation.step = 60;
+  req->aggregation.function = AggregationFunction::AVG;
+  req->aggregation.crossKeyFunction = AggregationFunction::SUM;
+
+  AggregateResult result;
+  handler.aggregate(result, std::make_unique<AggregateRequest>(*req));
+  EXPECT_EQ(StatusCode::OK, result.status);
+  EXPECT_EQ(12, result.keysReduced);
+  EXPECT_TRUE(result.unownedShards.empty());
+  ASSERT_EQ(result.values.size(), result.counts.size());
+  ASSERT_FALSE(result.values.empty());
+  for (int i = 0; i < result.values.size(); i++) {
+    if (result.counts[i] > 0) {
+      EXPECT_EQ(12, result.counts[i]);
+      EXPECT_DOUBLE_EQ(12 * kDefaultValue, result.values[i]);
+    }
+  }
+
+  // The cross key function is required.
+  req->aggregation.crossKeyFunction = AggregationFunction::NONE;
+  AggregateResult invalid;
+  handler.aggregate(invalid, std::make_unique<AggregateRequest>(*req));
+  EXPECT_EQ(StatusCode::RPC_FAIL, invalid.status);
+
+  dropShardAndWait(&handler, 0);
+  req->aggregation.crossKeyFunction = AggregationFunction::SUM;
+  AggregateResult notOwned;
+  handler.aggregate(notOwned, std::move(req));
+  EXPECT_EQ(StatusCode::OK, notOwned.status);
+  EXPECT_EQ(0, notOwned.keysReduced);
+  ASSERT_EQ(1, notOwned.unownedShards.size());
+  EXPECT_EQ(0, notOwned.unownedShards[0]);
+}
+
+TEST_F(BeringeiServiceHandlerTest, GetDeviatingKeys) {
+  TemporaryDirectory dir("beringei_data_block");
+  FLAGS_data_directory = dir.dirname();
+  double sigma = FLAGS_deviation_index_sigma;
+  FLAGS_deviation_index_sigma = 2;
+
+  BeringeiServiceHandlerForTest handler;
+
+  // dev.3 has one spike.
+  int64_t startTime = time(nullptr) - 300;
+  int64_t spikeTime = startTime + 120;
+  std::unique_ptr<PutDataRequest> put(new PutDataRequest);
+  for (int i = 0; i < 5; i++) {
+    for (int64_t t = startTime; t <= startTime + 300; t += 60) {
+      DataPoint dp;
+      dp.key.key = "dev." + to_string(i);
+      dp.key.shardId = 0;
+      dp.value.unixTime = t;
+      dp.value.value = i == 3 && t == spikeTime ? 100 : 1;
+      put->data.push_back(dp);
+    }
+  }
+  putDataPoints(handler, std::move(put));
+
+  handler.deviationIndexThread();
+
+  std::unique_ptr<GetDeviatingKeysRequest> req(new GetDeviatingKeysRequest);
+  req->shardId = 0;
+  req->begin = startTime;
+  req->end = startTime + 300;
+  req->limit = 10;
+  req->withData = true;
+
+  GetDeviatingKeysResult result;
+  handler.getDeviatingKeys(
+      result, std::make_unique<GetDeviatingKeysRequest>(*req));
+  EXPECT_EQ(StatusCode::OK, result.status);
+  EXPECT_FALSE(result.moreResults);
+  ASSERT_EQ(1, result.keys.size());
+  EXPECT_EQ("dev.3", result.keys[0].key);
+  ASSERT_EQ(1, result.keys[0].times.size());
+  EXPECT_EQ(spikeTime / 60 * 60, result.keys[0].times[0]);
+  ASSERT_EQ(1, result.data.size());
+  EXPECT_FALSE(result.data[0].data.empty());
+
+  // Minutes without deviations.
+  req->begin = spikeTime + 60;
+  GetDeviatingKeysResult none;
+  handler.getDeviatingKeys(
+      none, std::make_unique<GetDeviatingKeysRequest>(*req));
+  EXPECT_EQ(StatusCode::OK, none.status);
+  EXPECT_TRUE(none.keys.empty());
+
+  dropShardAndWait(&handler, 0);
+  GetDeviatingKeysResult notOwned;
+  handler.getDeviatingKeys(notOwned, std::move(req));
+  EXPECT_EQ(StatusCode::DONT_OWN_SHARD, notOwned.status);
+
+  FLAGS_deviation_index_sigma = sigma;
+}
+
+TEST_F(BeringeiServiceHandlerTest, EstimateReadCost) {
+  GetDataRequest req;
+  req.keys.resize(3);
+  req.begin = 0;
+  req.end = FLAGS_bucket_size;
+  EXPECT_EQ(6, BeringeiServiceHandler::estimateReadCost(req));
+
+  req.end = req.begin;
+  EXPECT_EQ(3, BeringeiServiceHandler::estimateReadCost(req));
+
+  req.keys.clear();
+  EXPECT_EQ(0, BeringeiServiceHandler::estimateReadCost(req));
+}
+
+TEST_F(BeringeiServiceHandlerTest, ShedPutsWhenLowOnMemory) {
+  TemporaryDirectory dir("beringei_data_block");
+  FLAGS_data_directory = dir.dirname();
+  FLAGS_put_shed_when_low_on_memory = true;
+
+  auto memoryUsageGuard = std::make_shared<MockMemoryUsageGuard>();
+  BeringeiServiceHandler handler(
+      std::make_shared<MockConfigurationAdapter>(),
+      memoryUsageGuard,
+      "mock_beringei_service",
+      9999,
+      false);
+
+  int64_t startTime = time(nullptr) - 300;
+  memoryUsageGuard->setMemoryIsLow(true);
+  PutDataResult shed;
+  handler.putDataPoints(
+      shed, generatePutRequest(10, startTime, startTime + 60));
+  EXPECT_EQ(StatusCode::OVERLOADED, shed.status);
+  EXPECT_EQ(20, shed.data.size());
+
+  memoryUsageGuard->setMemoryIsLow(false);
+  PutDataResult accepted;
+  handler.putDataPoints(
+      accepted, generatePutRequest(10, startTime, startTime + 60));
+  EXPECT_EQ(StatusCode::OK, accepted.status);
+  EXPECT_EQ(0, accepted.data.size());
+
+  FLAGS_put_shed_when_low_on_memory = false;
+}
@@ -0,0 +1,116 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+* This source code is licensed under the BSD-style license found in the
+* LICENSE file in the root directory of this source tree. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include "beringei/client/BeringeiClient.h"
+#include "beringei/lib/TimeSeries.h"
+#include "beringei/plugins/BeringeiConfigurationAdapter.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <folly/init/Init.h>
+
+using namespace facebook;
+
+DECLARE_string(beringei_configuration_path);
+DEFINE_int32(
+    backfill_batch_keys,
+    1000,
+    "Number of keys sent in one backfill request to each service.");
+DEFINE_int32(category_id, 0, "Category of the keys that don't exist yet.");
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "[<options>] [<file>]\n"
+      "Reads lines of '<key> <value> <timestamp>' from the file or stdin "
+      "and writes them into the finalized buckets of the shards.");
+  folly::init(&argc, &argv, true);
+
+  auto beringeiConfig =
+      std::make_shared<gorilla::BeringeiConfigurationAdapter>(true);
+  auto beringeiClient =
+      std::make_shared<gorilla::BeringeiClient>(beringeiConfig, 1, 0, true);
+
+  int shardCount = beringeiClient->getNumShardsFromWriteClient();
+  LOG(INFO) << "Beringei has " << shardCount << " shards";
+  if (shardCount == 0) {
+    LOG(FATAL) << "Shard count can't be zero, though.";
+  }
+
+  std::ifstream file;
+  if (argc > 1) {
+    file.open(argv[1]);
+    if (!file) {
+      LOG(FATAL) << "Can't open " << argv[1];
+    }
+  }
+  std::istream& in = argc > 1 ? file : std::cin;
+
+  std::map<std::string, std::vector<gorilla::TimeValuePair>> values;
+  std::string line;
+  int64_t lines = 0;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    gorilla::TimeValuePair value;
+    if (!(fields >> key >> value.value >> value.unixTime)) {
+      LOG(ERROR) << "Skipping line " << lines + 1 << ": " << line;
+    } else {
+      values[key].push_back(value);
+    }
+    lines++;
+  }
+  LOG(INFO) << "Read " << lines << " lines for " << values.size() << " keys";
+
+  std::vector<gorilla::BackfillData> data;
+  int64_t added = 0;
+  int64_t dropped = 0;
+  bool success = true;
+  auto send = [&]() {
+    if (!beringeiClient->backfill(data, added, dropped)) {
+      success = false;
+    }
+    data.clear();
+  };
+
+  for (auto& key : values) {
+    std::stable_sort(
+        key.second.begin(),
+        key.second.end(),
+        [](const gorilla::TimeValuePair& a, const gorilla::TimeValuePair& b) {
+          return a.unixTime < b.unixTime;
+        });
+    data.emplace_back();
+    data.back().key.key = key.first;
+    data.back().key.shardId = beringeiConfig->getShardForKey(
+        key.first,
+        shardCount,
+        gorilla::BeringeiConfigurationAdapterIf::kClientShardSeed);
+    data.back().categoryId = FLAGS_category_id;
+    gorilla::TimeSeries::writeValues(key.second, data.back().block);
+
+    if (data.size() >= FLAGS_backfill_batch_keys) {
+      send();
+    }
+  }
+  if (!data.empty()) {
+    send();
+  }
+
+  LOG(INFO) << "Backfilled " << added << " data points, dropped " << dropped;
+  if (!success) {
+    LOG(ERROR) << "Some of the keys weren't backfilled";
+    return 1;
+  }
+  return 0;
+}
@@ -9,10 +9,13 @@
 
 #include <folly/FileUtil.h>
 #include <folly/init/Init.h>
+#include <folly/json.h>
 #include <thrift/lib/cpp2/protocol/Serializer.h>
 #include <iostream>
 
 #include "beringei/if/gen-cpp2/beringei_data_types_custom_protocol.h"
+#include "beringei/plugins/BeringeiConfigurationLoader.h"
+#include "beringei/plugins/ShardPlacementPlanner.h"
 
 using apache::thrift::SimpleJSONSerializer;
 using namespace facebook::gorilla;
@@ -28,6 +31,31 @@ DEFINE_int32(num_shards, 100, "Total number of shards to use");
 
 DEFINE_string(file_path, "", "Location to save the configuration");
 
+DEFINE_string(
+    current_file_path,
+    "",
+    "Current configuration. Shards stay on their hosts unless moving them "
+    "evens out the load.");
+
+DEFINE_string(
+    shard_stats_path,
+    "",
+    "JSON file with the metrics of the shards, as in "
+    "{\"shards\": [{\"shardId\": 0, \"series\": 1000, \"bytes\": 5000, "
+    "\"ingestRate\": 10, \"queryRate\": 1}]}. Shards without metrics "
+    "count as empty. Without the file every shard counts the same.");
+
+DEFINE_double(series_weight, 1, "Weight of the number of series of shards");
+DEFINE_double(bytes_weight, 1, "Weight of the bytes of shards");
+DEFINE_double(ingest_weight, 1, "Weight of the ingest rate of shards");
+DEFINE_double(query_weight, 1, "Weight of the query rate of shards");
+
+DEFINE_double(
+    balance_tolerance,
+    0.05,
+    "How far above the mean load a host can be before shards are moved "
+    "away from it, as a fraction of the mean");
+
 std::vector<string> parseHostNames(string hostNames) {
   std::vector<std::string> parts;
   folly::split(',', hostNames, parts);
@@ -55,10 +83,63 @@ int main(int argc, char** argv) {
   serviceMap.serviceName = fLS::FLAGS_service_name;
   serviceMap.location = "facebook";
 
+  std::vector<string> current(fLI::FLAGS_num_shards);
+  if (!FLAGS_current_file_path.empty()) {
+    BeringeiConfigurationLoader loader;
+    auto currentConfiguration =
+        loader.loadFromJsonFile(FLAGS_current_file_path);
+    for (const auto& service : currentConfiguration.serviceMap) {
+      if (service.serviceName != fLS::FLAGS_service_name) {
+        continue;
+      }
+      for (const auto& shard : service.shardMap) {
+        if (shard.shardId >= 0 && shard.shardId < current.size()) {
+          current[shard.shardId] = shard.hostAddress;
+        }
+      }
+    }
+  }
+
+  std::vector<ShardPlacementPlanner::ShardMetrics> metrics(
+      fLI::FLAGS_num_shards);
+  if (!FLAGS_shard_stats_path.empty()) {
+    string json;
+    if (!folly::readFile(FLAGS_shard_stats_path.c_str(), json)) {
+      std::cout << "ERROR: failed to read " << FLAGS_shard_stats_path
+                << std::endl;
+      return 1;
+    }
+    for (const auto& shard : folly::parseJson(json)["shards"]) {
+      int64_t shardId = shard["shardId"].asInt();
+      if (shardId < 0 || shardId >= metrics.size()) {
+        continue;
+      }
+      metrics[shardId].series = shard.getDefault("series", 0).asDouble();
+      metrics[shardId].bytes = shard.getDefault("bytes", 0).asDouble();
+      metrics[shardId].ingestRate =
+          shard.getDefault("ingestRate", 0).asDouble();
+      metrics[shardId].queryRate = shard.getDefault("queryRate", 0).asDouble();
+    }
+  }
+
+  ShardPlacementPlanner::Weights weights;
+  weights.series = FLAGS_series_weight;
+  weights.bytes = FLAGS_bytes_weight;
+  weights.ingestRate = FLAGS_ingest_weight;
+  weights.queryRate = FLAGS_query_weight;
+  auto loads = ShardPlacementPlanner::getLoads(metrics, weights);
+
+  int moves = 0;
+  auto hosts = ShardPlacementPlanner::plan(
+      hostNames, loads, current, FLAGS_balance_tolerance, moves);
+  if (!FLAGS_current_file_path.empty()) {
+    std::cout << moves << " shards move to other hosts" << std::endl;
+  }
+
   for (int i = 0; i < fLI::FLAGS_num_shards; i++) {
     ShardInfo shardInfo;
     shardInfo.shardId = i;
-    shardInfo.hostAddress = hostNames[i % hostNames.size()];
+    shardInfo.hostAddress = hosts[i];
     shardInfo.port = fLI::FLAGS_port;
 
     serviceMap.shardMap.push_back(shardInfo);
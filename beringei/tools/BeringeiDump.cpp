@@ -0,0 +1,143 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+* This source code is licensed under the BSD-style license found in the
+* LICENSE file in the root directory of this source tree. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include "beringei/lib/FileUtils.h"
+#include "beringei/lib/ShardArchive.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <folly/Conv.h>
+#include <folly/String.h>
+#include <folly/init/Init.h>
+
+using namespace facebook;
+
+DEFINE_string(data_directory, "", "Data directory of the shards");
+DEFINE_string(archive_directory, "", "Directory of the shard archives");
+DEFINE_string(
+    shards,
+    "",
+    "Shards to dump or restore, separated by commas. All of them if empty.");
+DEFINE_bool(
+    include_logs,
+    false,
+    "Also dump the snapshot of the open bucket and the logs after it. "
+    "Without them only the finalized buckets are dumped.");
+DEFINE_int32(dump_threads, 8, "Number of shards dumped or restored at once");
+
+static const std::string kArchiveSuffix = ".shard";
+
+static std::string archivePath(int64_t shardId) {
+  return gorilla::FileUtils::joinPaths(
+      FLAGS_archive_directory, std::to_string(shardId) + kArchiveSuffix);
+}
+
+// The shards in `directory`, found from the names of its entries.
+static std::vector<int64_t> listShards(
+    const std::string& directory,
+    const std::string& suffix) {
+  std::vector<int64_t> shards;
+  boost::system::error_code ec;
+  for (boost::filesystem::directory_iterator it(directory, ec), end;
+       !ec && it != end;
+       it.increment(ec)) {
+    std::string name = it->path().filename().string();
+    if (name.size() <= suffix.size() ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) !=
+            0) {
+      continue;
+    }
+    auto shardId =
+        folly::tryTo<int64_t>(name.substr(0, name.size() - suffix.size()));
+    if (shardId.hasValue()) {
+      shards.push_back(shardId.value());
+    }
+  }
+  return shards;
+}
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "[<options>] dump|restore\n"
+      "Dumps the shards in --data_directory to one archive per shard in "
+      "--archive_directory, or restores them from there. Restoring "
+      "replaces the files of the shards.");
+  folly::init(&argc, &argv, true);
+
+  std::string command = argc > 1 ? argv[1] : "";
+  if ((command != "dump" && command != "restore") ||
+      FLAGS_data_directory.empty() || FLAGS_archive_directory.empty()) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "BeringeiDump");
+    return 1;
+  }
+  bool dump = command == "dump";
+
+  std::vector<int64_t> shards;
+  if (!FLAGS_shards.empty()) {
+    std::vector<folly::StringPiece> parts;
+    folly::split(',', FLAGS_shards, parts);
+    for (auto part : parts) {
+      shards.push_back(folly::to<int64_t>(part));
+    }
+  } else if (dump) {
+    shards = listShards(FLAGS_data_directory, "");
+  } else {
+    shards = listShards(FLAGS_archive_directory, kArchiveSuffix);
+  }
+  LOG(INFO) << (dump ? "Dumping " : "Restoring ") << shards.size()
+            << " shards";
+
+  if (dump) {
+    boost::filesystem::create_directories(FLAGS_archive_directory);
+  }
+
+  std::atomic<size_t> next{0};
+  std::atomic<int> failed{0};
+  auto run = [&]() {
+    size_t i;
+    while ((i = next++) < shards.size()) {
+      bool success;
+      if (dump) {
+        success = gorilla::ShardArchive::dump(
+            shards[i],
+            FLAGS_data_directory,
+            archivePath(shards[i]),
+            FLAGS_include_logs);
+      } else {
+        int64_t shardId;
+        success = gorilla::ShardArchive::restore(
+            archivePath(shards[i]), FLAGS_data_directory, shardId);
+        if (success && shardId != shards[i]) {
+          LOG(WARNING) << archivePath(shards[i]) << " was restored to shard "
+                       << shardId;
+        }
+      }
+      if (!success) {
+        failed++;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < FLAGS_dump_threads; i++) {
+    threads.emplace_back(run);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (failed > 0) {
+    LOG(ERROR) << failed << " of " << shards.size() << " shards failed";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,243 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+* This source code is licensed under the BSD-style license found in the
+* LICENSE file in the root directory of this source tree. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include "beringei/client/BeringeiClient.h"
+#include "beringei/plugins/BeringeiConfigurationAdapter.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <folly/FileUtil.h>
+#include <folly/Format.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/init/Init.h>
+
+using namespace facebook;
+
+DECLARE_string(beringei_configuration_path);
+DEFINE_string(export_dir, "", "Directory to write the partitions to");
+DEFINE_int64(
+    start_time,
+    0,
+    "Unix timestamp of the start time to export. 0 means a day ago.");
+DEFINE_int64(
+    end_time,
+    0,
+    "Unix timestamp of the end time to export. 0 means 'now'.");
+DEFINE_int32(
+    export_subshards,
+    4,
+    "Number of partitions each shard is scanned and written as");
+DEFINE_int32(export_scan_threads, 16, "Number of partitions scanned at once");
+DEFINE_int32(export_decode_threads, 8, "Threads decoding the scanned data");
+DEFINE_int32(
+    export_retries,
+    3,
+    "Number of times a failed partition is scanned again");
+
+template <class T>
+std::chrono::seconds to_epoch(T tp) {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+      tp.time_since_epoch());
+}
+
+// Columns of a partition. Keys are stored once and referenced by index.
+struct Partition {
+  std::vector<std::string> keys;
+  std::vector<uint32_t> keyIndexes;
+  std::vector<int64_t> unixTimes;
+  std::vector<double> values;
+};
+
+template <class T>
+static void append(std::string& out, const T* data, size_t count) {
+  out.append(reinterpret_cast<const char*>(data), count * sizeof(T));
+}
+
+// Layout, in host byte order: the number of keys as uint64, each key as a
+// uint32 length and its bytes, the number of rows as uint64, then the
+// columns one after another: key indexes as uint32, unix times as int64
+// and values as double.
+static std::string encode(const Partition& partition) {
+  std::string out;
+  uint64_t numKeys = partition.keys.size();
+  append(out, &numKeys, 1);
+  for (const auto& key : partition.keys) {
+    uint32_t length = key.size();
+    append(out, &length, 1);
+    out += key;
+  }
+
+  uint64_t numRows = partition.unixTimes.size();
+  append(out, &numRows, 1);
+  append(out, partition.keyIndexes.data(), numRows);
+  append(out, partition.unixTimes.data(), numRows);
+  append(out, partition.values.data(), numRows);
+  return out;
+}
+
+static std::string partitionPath(int64_t shardId, int64_t subshard) {
+  return folly::sformat(
+      "{}/shard-{}-{}.col", FLAGS_export_dir, shardId, subshard);
+}
+
+static bool exists(const std::string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0;
+}
+
+// Scans one partition and writes it, returning false if it has to be
+// scanned again. The file is written under a temporary name and renamed
+// into place, so a partition that exists is complete.
+static bool exportPartition(
+    gorilla::BeringeiClient& client,
+    folly::Executor* executor,
+    int64_t shardId,
+    int64_t subshard,
+    int64_t& rows) {
+  gorilla::ScanShardRequest request;
+  request.shardId = shardId;
+  request.begin = FLAGS_start_time;
+  request.end = FLAGS_end_time;
+  request.subshard = subshard;
+  request.numSubshards = FLAGS_export_subshards;
+
+  auto result = client.scanShard(request);
+  if (result.status != gorilla::StatusCode::OK) {
+    LOG(ERROR) << "Scanning shard " << shardId << " subshard " << subshard
+               << " failed with status " << (int)result.status;
+    return false;
+  }
+
+  Partition partition;
+  {
+    gorilla::BeringeiScanShardDecoder decoder(result, executor);
+    size_t index;
+    std::vector<gorilla::TimeValuePair> values;
+    while (decoder.next(index, values)) {
+      if (values.empty()) {
+        continue;
+      }
+
+      uint32_t keyIndex = partition.keys.size();
+      partition.keys.push_back(std::move(result.keys[index]));
+      for (const auto& value : values) {
+        partition.keyIndexes.push_back(keyIndex);
+        partition.unixTimes.push_back(value.unixTime);
+        partition.values.push_back(value.value);
+      }
+      values.clear();
+    }
+  }
+
+  std::string path = partitionPath(shardId, subshard);
+  std::string tmpPath = path + ".tmp";
+  if (!folly::writeFile(encode(partition), tmpPath.c_str()) ||
+      rename(tmpPath.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Writing " << path << " failed";
+    return false;
+  }
+
+  rows = partition.unixTimes.size();
+  return true;
+}
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "[<options>]\n"
+      "Writes the data points of all the shards to --export_dir, one file "
+      "per shard and subshard. Files that already exist are skipped, so an "
+      "export that was interrupted can be resumed by running it again.");
+  folly::init(&argc, &argv, true);
+
+  if (FLAGS_export_dir.empty() || FLAGS_export_subshards < 1) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "BeringeiExport");
+    return 1;
+  }
+
+  if (FLAGS_start_time == 0) {
+    FLAGS_start_time =
+        to_epoch(std::chrono::system_clock::now() - std::chrono::hours(24))
+            .count();
+  }
+  if (FLAGS_end_time == 0) {
+    FLAGS_end_time = to_epoch(std::chrono::system_clock::now()).count();
+  }
+
+  auto beringeiConfig =
+      std::make_shared<gorilla::BeringeiConfigurationAdapter>(true);
+  auto beringeiClient =
+      std::make_shared<gorilla::BeringeiClient>(beringeiConfig, 1, 0, false);
+
+  int64_t shardCount = beringeiClient->getMaxNumShards();
+  LOG(INFO) << "Beringei has " << shardCount << " shards";
+  if (shardCount == 0) {
+    LOG(FATAL) << "Shard count can't be zero, though.";
+  }
+
+  folly::CPUThreadPoolExecutor decoders(FLAGS_export_decode_threads);
+  int64_t numPartitions = shardCount * FLAGS_export_subshards;
+  std::atomic<int64_t> nextPartition{0};
+  std::atomic<int64_t> exported{0};
+  std::atomic<int64_t> skipped{0};
+  std::atomic<int64_t> failed{0};
+  std::atomic<int64_t> totalRows{0};
+
+  auto scan = [&]() {
+    int64_t partition;
+    while ((partition = nextPartition++) < numPartitions) {
+      int64_t shardId = partition / FLAGS_export_subshards;
+      int64_t subshard = partition % FLAGS_export_subshards;
+      if (exists(partitionPath(shardId, subshard))) {
+        skipped++;
+        continue;
+      }
+
+      int64_t rows = 0;
+      bool success = false;
+      for (int attempt = 0; !success && attempt <= FLAGS_export_retries;
+           attempt++) {
+        if (attempt > 0) {
+          std::this_thread::sleep_for(std::chrono::seconds(1 << attempt));
+        }
+        success = exportPartition(
+            *beringeiClient, &decoders, shardId, subshard, rows);
+      }
+
+      if (success) {
+        exported++;
+        totalRows += rows;
+      } else {
+        failed++;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < FLAGS_export_scan_threads; i++) {
+    threads.emplace_back(scan);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  LOG(INFO) << "Exported " << totalRows << " data points in " << exported
+            << " partitions, skipped " << skipped << " that already existed";
+  if (failed > 0) {
+    LOG(ERROR) << failed << " partitions failed, run again to retry them";
+    return 1;
+  }
+  return 0;
+}
@@ -81,7 +81,10 @@ int main(int argc, char** argv) {
   std::string keyName = std::string(argv[1]);
 
   if (FLAGS_shard_id == -1) {
-    FLAGS_shard_id = std::hash<std::string>()(keyName) % shardCount;
+    FLAGS_shard_id = beringeiConfig->getShardForKey(
+        keyName,
+        shardCount,
+        gorilla::BeringeiConfigurationAdapterIf::kClientShardSeed);
   }
 
   LOG(INFO) << "Key is in shard_id: " << FLAGS_shard_id;
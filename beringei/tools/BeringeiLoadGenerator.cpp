@@ -0,0 +1,353 @@
+/**
+* Copyright (c) 2016-present, Facebook, Inc.
+* All rights reserved.
+* This source code is licensed under the BSD-style license found in the
+* LICENSE file in the root directory of this source tree. An additional grant
+* of patent rights can be found in the PATENTS file in the same directory.
+*/
+
+#include "beringei/client/BeringeiClient.h"
+#include "beringei/plugins/BeringeiConfigurationAdapter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <folly/Format.h>
+#include <folly/init/Init.h>
+
+using namespace facebook;
+
+DEFINE_int64(load_series, 1000000, "Number of time series to write");
+DEFINE_int32(
+    load_put_interval_secs,
+    60,
+    "Seconds between two points of the same time series");
+DEFINE_int32(load_key_length_min, 30, "Shortest generated key");
+DEFINE_int32(load_key_length_max, 120, "Longest generated key");
+DEFINE_string(load_key_prefix, "load_test.", "Prefix of the generated keys");
+DEFINE_int32(load_put_batch_size, 1000, "Data points per putDataPoints call");
+DEFINE_int32(load_writer_threads, 4, "Threads generating data points");
+DEFINE_int32(
+    load_client_writer_threads,
+    8,
+    "Writer threads of the client that send the queued points");
+DEFINE_int32(
+    load_client_queue_capacity,
+    1000000,
+    "Data points the client can queue before dropping");
+DEFINE_double(load_get_qps, 10, "getData requests per second");
+DEFINE_int32(load_get_keys, 100, "Keys per getData request");
+DEFINE_int32(load_get_range_secs, 3600, "Time range of each getData");
+DEFINE_double(load_scan_qps, 0, "scanShard requests per second");
+DEFINE_int32(load_scan_range_secs, 7200, "Time range of each scanShard");
+DEFINE_int32(load_reader_threads, 4, "Threads sending getData and scanShard");
+DEFINE_int32(load_duration_secs, 600, "How long to run for, 0 for forever");
+DEFINE_int32(load_report_interval_secs, 10, "Seconds between two reports");
+
+namespace {
+
+int64_t nowSecs() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// The keys are generated from their number so that the readers can
+// ask for keys that the writers write without sharing them.
+std::string makeKey(int64_t index) {
+  std::mt19937_64 rng(index);
+  std::string key = FLAGS_load_key_prefix + std::to_string(index) + ".";
+  int range =
+      std::max(0, FLAGS_load_key_length_max - FLAGS_load_key_length_min);
+  size_t length = FLAGS_load_key_length_min + rng() % (range + 1);
+  while (key.size() < length) {
+    key += 'a' + rng() % 26;
+  }
+  return key;
+}
+
+// Collects latencies and counts between two reports. Thread-safe.
+class IntervalStats {
+ public:
+  void add(int64_t latencyUs, bool success) {
+    std::lock_guard<std::mutex> guard(lock_);
+    latencies_.push_back(latencyUs);
+    if (!success) {
+      failures_++;
+    }
+  }
+
+  void addItems(int64_t items) {
+    items_ += items;
+  }
+
+  // Returns the rates, failures and latency percentiles since the
+  // last call as one line and resets the stats.
+  std::string report(double seconds) {
+    std::vector<int64_t> latencies;
+    int64_t failures;
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      latencies.swap(latencies_);
+      failures = failures_;
+      failures_ = 0;
+    }
+    int64_t items = items_.exchange(0);
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> int64_t {
+      if (latencies.empty()) {
+        return 0;
+      }
+      return latencies[std::min(
+          latencies.size() - 1, (size_t)(p * latencies.size()))];
+    };
+
+    return folly::sformat(
+        "{:.1f} req/s {:.1f} items/s failed={} "
+        "p50={}us p90={}us p99={}us max={}us",
+        latencies.size() / seconds,
+        items / seconds,
+        failures,
+        percentile(0.5),
+        percentile(0.9),
+        percentile(0.99),
+        latencies.empty() ? 0 : latencies.back());
+  }
+
+ private:
+  std::mutex lock_;
+  std::vector<int64_t> latencies_;
+  int64_t failures_ = 0;
+  std::atomic<int64_t> items_{0};
+};
+
+std::atomic<bool> stopping{false};
+
+// Paces a loop to `rate` iterations per second.
+class Pacer {
+ public:
+  explicit Pacer(double rate)
+      : rate_(rate), start_(std::chrono::steady_clock::now()) {}
+
+  // Sleeps until the next iteration is due. Returns false once asked
+  // to stop.
+  bool wait() {
+    while (!stopping) {
+      double elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start_)
+                           .count();
+      if (done_ < elapsed * rate_) {
+        done_++;
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  }
+
+ private:
+  const double rate_;
+  const std::chrono::steady_clock::time_point start_;
+  int64_t done_ = 0;
+};
+
+int64_t elapsedUs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void writeLoop(
+    int thread,
+    gorilla::BeringeiClient* client,
+    gorilla::BeringeiConfigurationAdapter* config,
+    int shardCount,
+    IntervalStats& puts,
+    std::atomic<int64_t>& droppedPoints) {
+  // Every thread writes its own slice of the series.
+  int64_t begin = FLAGS_load_series * thread / FLAGS_load_writer_threads;
+  int64_t end = FLAGS_load_series * (thread + 1) / FLAGS_load_writer_threads;
+  std::vector<gorilla::Key> keys;
+  for (int64_t i = begin; i < end; i++) {
+    keys.emplace_back();
+    keys.back().key = makeKey(i);
+    keys.back().shardId = config->getShardForKey(
+        keys.back().key,
+        shardCount,
+        gorilla::BeringeiConfigurationAdapterIf::kClientShardSeed);
+  }
+  if (keys.empty()) {
+    return;
+  }
+
+  double pointsPerSecond = (double)keys.size() / FLAGS_load_put_interval_secs;
+  Pacer pacer(pointsPerSecond / FLAGS_load_put_batch_size);
+  std::mt19937_64 rng(thread);
+  size_t next = 0;
+  while (pacer.wait()) {
+    std::vector<gorilla::DataPoint> points(FLAGS_load_put_batch_size);
+    int64_t unixTime = nowSecs();
+    for (auto& point : points) {
+      point.key = keys[next];
+      point.value.unixTime = unixTime;
+      point.value.value = (double)(rng() % 10000) / 100;
+      next = (next + 1) % keys.size();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool pushed = client->putDataPoints(points);
+    puts.add(elapsedUs(start), pushed);
+    puts.addItems(FLAGS_load_put_batch_size);
+    if (!pushed) {
+      droppedPoints += FLAGS_load_put_batch_size;
+    }
+  }
+}
+
+void readLoop(
+    int thread,
+    gorilla::BeringeiClient* client,
+    gorilla::BeringeiConfigurationAdapter* config,
+    int shardCount,
+    IntervalStats& gets,
+    IntervalStats& scans) {
+  double getQps = FLAGS_load_get_qps / FLAGS_load_reader_threads;
+  double scanQps = FLAGS_load_scan_qps / FLAGS_load_reader_threads;
+  if (getQps + scanQps <= 0) {
+    return;
+  }
+
+  Pacer pacer(getQps + scanQps);
+  std::mt19937_64 rng(thread);
+  std::uniform_real_distribution<double> dist(0, getQps + scanQps);
+  while (pacer.wait()) {
+    int64_t now = nowSecs();
+    if (dist(rng) < getQps) {
+      gorilla::GetDataRequest request;
+      request.begin = now - FLAGS_load_get_range_secs;
+      request.end = now;
+      for (int i = 0; i < FLAGS_load_get_keys; i++) {
+        request.keys.emplace_back();
+        request.keys.back().key = makeKey(rng() % FLAGS_load_series);
+        request.keys.back().shardId = config->getShardForKey(
+            request.keys.back().key,
+            shardCount,
+            gorilla::BeringeiConfigurationAdapterIf::kClientShardSeed);
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      auto result = client->get(request);
+      gets.add(elapsedUs(start), result.allSuccess);
+      int64_t values = 0;
+      for (const auto& series : result.results) {
+        values += series.size();
+      }
+      gets.addItems(values);
+    } else {
+      gorilla::ScanShardRequest request;
+      request.shardId = rng() % shardCount;
+      request.begin = now - FLAGS_load_scan_range_secs;
+      request.end = now;
+
+      auto start = std::chrono::steady_clock::now();
+      auto result = client->scanShard(request);
+      scans.add(
+          elapsedUs(start),
+          result.status == gorilla::StatusCode::OK && result.allSuccess);
+      scans.addItems(result.keys.size());
+    }
+  }
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage(
+      "Writes --load_series time series and reads them back while "
+      "reporting throughput and latencies");
+  folly::init(&argc, &argv, true);
+
+  if (FLAGS_load_series <= 0 || FLAGS_load_put_batch_size <= 0 ||
+      FLAGS_load_put_interval_secs <= 0) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "BeringeiLoadGenerator.cpp");
+    return 1;
+  }
+
+  auto beringeiConfig =
+      std::make_shared<gorilla::BeringeiConfigurationAdapter>(true);
+  auto beringeiClient = std::make_shared<gorilla::BeringeiClient>(
+      beringeiConfig,
+      FLAGS_load_client_queue_capacity,
+      FLAGS_load_client_writer_threads);
+
+  int shardCount = beringeiClient->getNumShardsFromWriteClient();
+  if (shardCount == 0) {
+    LOG(FATAL) << "Shard count can't be zero";
+  }
+  LOG(INFO) << "Writing " << FLAGS_load_series << " time series every "
+            << FLAGS_load_put_interval_secs << "s to " << shardCount
+            << " shards";
+
+  IntervalStats puts;
+  IntervalStats gets;
+  IntervalStats scans;
+  std::atomic<int64_t> droppedPoints(0);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < FLAGS_load_writer_threads; i++) {
+    threads.emplace_back(
+        writeLoop,
+        i,
+        beringeiClient.get(),
+        beringeiConfig.get(),
+        shardCount,
+        std::ref(puts),
+        std::ref(droppedPoints));
+  }
+  for (int i = 0; i < FLAGS_load_reader_threads; i++) {
+    threads.emplace_back(
+        readLoop,
+        i,
+        beringeiClient.get(),
+        beringeiConfig.get(),
+        shardCount,
+        std::ref(gets),
+        std::ref(scans));
+  }
+
+  // The put latencies are the time to queue the points in the client.
+  // The server side latencies are exported by the servers as the
+  // us_per_put and us_per_get percentiles.
+  auto start = std::chrono::steady_clock::now();
+  auto lastReport = start;
+  while (FLAGS_load_duration_secs == 0 ||
+         std::chrono::steady_clock::now() - start <
+             std::chrono::seconds(FLAGS_load_duration_secs)) {
+    std::this_thread::sleep_for(
+        std::chrono::seconds(FLAGS_load_report_interval_secs));
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastReport).count();
+    lastReport = now;
+
+    LOG(INFO) << "put: " << puts.report(seconds);
+    LOG(INFO) << "get: " << gets.report(seconds);
+    LOG(INFO) << "scan: " << scans.report(seconds);
+    LOG(INFO) << "dropped points: " << droppedPoints.load()
+              << " retry queue: "
+              << beringeiClient->getNumRetryQueuedDataPoints();
+  }
+
+  stopping = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  beringeiClient->flushQueue();
+  return 0;
+}
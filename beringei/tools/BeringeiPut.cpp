@@ -49,8 +49,10 @@ int main(int argc, char** argv) {
   std::vector<gorilla::DataPoint> dps;
   dps.emplace_back();
   dps.back().key.key = std::string(argv[1]);
-  dps.back().key.shardId =
-      std::hash<std::string>()(dps.back().key.key) % shardCount;
+  dps.back().key.shardId = beringeiConfig->getShardForKey(
+      dps.back().key.key,
+      shardCount,
+      gorilla::BeringeiConfigurationAdapterIf::kClientShardSeed);
   dps.back().value.unixTime =
       std::chrono::duration_cast<std::chrono::seconds>(
           std::chrono::system_clock::now().time_since_epoch())
@@ -27,9 +27,16 @@ GrafanaServiceFactory::GrafanaServiceFactory() : RequestHandlerFactory() {
 }
 
 void GrafanaServiceFactory::onServerStart(
-    folly::EventBase* /* unused */) noexcept {}
+    folly::EventBase* /* unused */) noexcept {
+  client_.reset(new BeringeiClient(
+      configurationAdapter_, 1, BeringeiClient::kNoWriterThreads));
+  shardRouter_.reset(new ShardRouter(configurationAdapter_));
+}
 
-void GrafanaServiceFactory::onServerStop() noexcept {}
+void GrafanaServiceFactory::onServerStop() noexcept {
+  client_.reset();
+  shardRouter_.reset();
+}
 
 proxygen::RequestHandler* GrafanaServiceFactory::onRequest(
     proxygen::RequestHandler* /* unused */,
@@ -43,7 +50,7 @@ proxygen::RequestHandler* GrafanaServiceFactory::onRequest(
     return new TestConnectionHandler();
   } else if (path == "/query") {
     // grafana request querying for data
-    return new QueryHandler(configurationAdapter_);
+    return new QueryHandler(client_.get(), shardRouter_.get());
   }
 
   // return not found for all other uris
@@ -8,10 +8,14 @@
  */
 #pragma once
 
+#include "ShardRouter.h"
+
+#include "beringei/client/BeringeiClient.h"
 #include "beringei/client/BeringeiConfigurationAdapterIf.h"
 
 #include <folly/Memory.h>
 #include <folly/Portability.h>
+#include <folly/ThreadLocal.h>
 #include <folly/io/async/EventBaseManager.h>
 #include <gflags/gflags.h>
 #include <proxygen/httpserver/HTTPServer.h>
@@ -35,6 +39,11 @@ class GrafanaServiceFactory : public proxygen::RequestHandlerFactory {
 
  private:
   std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter_;
+
+  // A client for each server thread, created when the thread starts so
+  // that every query reuses its read clients and connections.
+  folly::ThreadLocalPtr<BeringeiClient> client_;
+  folly::ThreadLocalPtr<ShardRouter> shardRouter_;
 };
 }
 } // facebook::gorilla
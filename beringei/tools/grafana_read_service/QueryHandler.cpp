@@ -9,12 +9,22 @@
 
 #include "QueryHandler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <unordered_map>
 #include <utility>
 
 #include "DateUtils.h"
 
-#include <folly/DynamicConverter.h>
+#include "beringei/lib/Aggregation.h"
+#include "beringei/lib/GorillaTimeConstants.h"
+
+#include <folly/Conv.h>
 #include <folly/io/IOBuf.h>
+#include <folly/io/async/EventBaseManager.h>
+#include <folly/json.h>
+#include <gflags/gflags.h>
 #include <proxygen/httpserver/ResponseBuilder.h>
 #include <thrift/lib/cpp/util/ThriftSerializer.h>
 #include <thrift/lib/cpp2/protocol/Serializer.h>
@@ -25,9 +35,32 @@ using namespace proxygen;
 namespace facebook {
 namespace gorilla {
 
-QueryHandler::QueryHandler(
-    std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter)
-    : RequestHandler(), configurationAdapter_(configurationAdapter) {}
+DEFINE_int32(
+    max_concurrent_queries,
+    100,
+    "Queries waiting for Beringei at the same time across all the threads. "
+    "Further queries are rejected with 503 until some of them return.");
+
+DEFINE_string(
+    downsampling,
+    "avg",
+    "How panels with maxDataPoints are downsampled. avg, min, max and last "
+    "are aggregated by the storage nodes in windows of at least intervalMs. "
+    "lttb fetches the raw points and keeps maxDataPoints of them with the "
+    "Largest Triangle Three Buckets algorithm. none returns every point.");
+
+// Queries waiting for Beringei.
+static std::atomic<int> queriesInFlight(0);
+
+// The response body is sent in chunks of about this size.
+static const size_t kResponseChunkBytes = 64 * 1024;
+
+QueryHandler::QueryHandler(BeringeiClient* client, ShardRouter* shardRouter)
+    : RequestHandler(),
+      client_(client),
+      shardRouter_(shardRouter),
+      inFlight_(false),
+      closed_(false) {}
 
 void QueryHandler::onRequest(
     std::unique_ptr<HTTPMessage> /* unused */) noexcept {
@@ -43,24 +76,90 @@ void QueryHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {
 }
 
 void QueryHandler::onEOM() noexcept {
+  if (!body_) {
+    sendError(400, "Bad Request");
+    return;
+  }
   auto body = body_->moveToFbString();
 
-  auto request = SimpleJSONSerializer::deserialize<QueryRequest>(body);
+  QueryRequest request;
+  try {
+    request = SimpleJSONSerializer::deserialize<QueryRequest>(body);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Invalid query: " << e.what();
+    sendError(400, "Bad Request");
+    return;
+  }
   logRequest(request);
 
-  BeringeiClient client(
-      configurationAdapter_, 1, BeringeiClient::kNoWriterThreads);
+  if (++queriesInFlight > FLAGS_max_concurrent_queries) {
+    --queriesInFlight;
+    LOG(ERROR) << "Too many queries in flight";
+    sendError(503, "Service Unavailable");
+    return;
+  }
 
-  int numShards = client.getMaxNumShards();
-  std::vector<std::pair<Key, std::vector<TimeValuePair>>> beringeiResult;
+  int numShards = client_->getMaxNumShards();
   auto beringeiRequest = createBeringeiRequest(request, numShards);
-  client.get(beringeiRequest, beringeiResult);
 
-  ResponseBuilder(downstream_)
-      .status(200, "OK")
-      .header("Content-Type", "application/json")
-      .body(createJsonResponse(request.targets, beringeiResult))
-      .sendWithEOM();
+  // The requests are sent from this thread's event base, and the
+  // response is sent from it once they return, so that the thread keeps
+  // serving other queries in the meantime.
+  auto eb = folly::EventBaseManager::get()->getEventBase();
+  inFlight_ = true;
+  client_->futureGet(beringeiRequest, eb)
+      .via(eb)
+      .then([this,
+             targets = std::move(request.targets),
+             lttb = FLAGS_downsampling == "lttb" && request.maxDataPoints > 0,
+             maxDataPoints = request.maxDataPoints](
+                folly::Try<BeringeiGetResult>&& result) {
+        --queriesInFlight;
+        inFlight_ = false;
+        if (closed_) {
+          delete this;
+          return;
+        }
+
+        if (result.hasException()) {
+          LOG(ERROR) << "Query failed: " << result.exception().what();
+          sendError(500, "Internal Server Error");
+          return;
+        }
+
+        // The results are in the order of the targets.
+        auto& results = result.value().results;
+        ResponseBuilder(downstream_)
+            .status(200, "OK")
+            .header("Content-Type", "application/json")
+            .send();
+
+        std::string chunk = "[";
+        for (size_t i = 0; i < targets.size() && i < results.size(); i++) {
+          if (i > 0) {
+            chunk += ',';
+          }
+          if (lttb) {
+            std::vector<TimeValuePair> points;
+            Aggregation::largestTriangleThreeBuckets(
+                results[i], maxDataPoints, points);
+            results[i].swap(points);
+          }
+          appendTargetJson(targets[i].target, results[i], chunk);
+          std::vector<TimeValuePair>().swap(results[i]);
+
+          if (chunk.size() >= kResponseChunkBytes) {
+            ResponseBuilder(downstream_)
+                .body(folly::IOBuf::copyBuffer(chunk))
+                .send();
+            chunk.clear();
+          }
+        }
+        chunk += ']';
+        ResponseBuilder(downstream_)
+            .body(folly::IOBuf::copyBuffer(chunk))
+            .sendWithEOM();
+      });
 }
 
 void QueryHandler::onUpgrade(UpgradeProtocol /* unused */) noexcept {
@@ -76,11 +175,21 @@ void QueryHandler::requestComplete() noexcept {
 
 void QueryHandler::onError(ProxygenError /* unused */) noexcept {
   LOG(ERROR) << "Proxygen reported error";
+  // The query that is still in flight deletes the handler when it returns.
+  if (inFlight_) {
+    closed_ = true;
+    return;
+  }
+
   // In GrafanaServiceFactory, we created this handler using new.
   // Proxygen does not delete the handler.
   delete this;
 }
 
+void QueryHandler::sendError(int code, const std::string& message) {
+  ResponseBuilder(downstream_).status(code, message).sendWithEOM();
+}
+
 /* Sample Grafana Query Request
 
   {
@@ -141,59 +250,46 @@ milliseconds
 ]
 */
 
-folly::fbstring QueryHandler::createJsonResponse(
-    const std::vector<QueryTarget>& targets,
-    const std::vector<std::pair<Key, std::vector<TimeValuePair>>>&
-        beringeiResponse) {
-  folly::fbstring responseBody = "[";
-  bool first = true;
-  for (auto target : targets) {
-    if (!first) {
-      responseBody += ",";
-    }
-    first = false;
-    auto response = createResponseObject(target.target, beringeiResponse);
-    responseBody += folly::toJson(response);
-  }
-  responseBody += "]";
-
-  return responseBody;
-}
-
-folly::dynamic QueryHandler::createResponseObject(
+void QueryHandler::appendTargetJson(
     const std::string& target,
-    const std::vector<std::pair<Key, std::vector<TimeValuePair>>>&
-        beringeiResponse) {
-  std::locale loc;
-  folly::dynamic response = folly::dynamic::object;
-  response["target"] = target;
-  response["datapoints"] = folly::dynamic::array();
-
-  for (const auto& responsePair : beringeiResponse) {
-    if (responsePair.first.key == target) {
-      folly::dynamic datapoints = folly::dynamic::array();
-      for (const auto& dp : responsePair.second) {
-        datapoints.push_back(
-            folly::toDynamic(std::make_pair(dp.value, dp.unixTime * 1000)));
-      }
-
-      response["datapoints"] = datapoints;
-      break;
+    const std::vector<TimeValuePair>& points,
+    std::string& out) {
+  out += "{\"target\":";
+  folly::json::escapeString(target, out, folly::json::serialization_opts());
+  out += ",\"datapoints\":[";
+  for (size_t i = 0; i < points.size(); i++) {
+    if (i > 0) {
+      out += ',';
+    }
+    out += '[';
+    // JSON has no NaN or infinity.
+    if (std::isfinite(points[i].value)) {
+      folly::toAppend(points[i].value, &out);
+    } else {
+      out += "null";
     }
+    out += ',';
+    folly::toAppend(points[i].unixTime * 1000, &out);
+    out += ']';
   }
-
-  return response;
+  out += "]}";
 }
 
-int QueryHandler::getShardId(const std::string& key, const int numShards) {
-  std::hash<std::string> hash;
-  size_t hashValue = hash(key);
-
-  if (numShards != 0) {
-    return hashValue % numShards;
-  } else {
-    return hashValue;
+bool QueryHandler::getAggregationFunction(AggregationFunction& function) {
+  static const std::unordered_map<std::string, AggregationFunction>
+      functions = {
+          {"avg", AggregationFunction::AVG},
+          {"min", AggregationFunction::MIN},
+          {"max", AggregationFunction::MAX},
+          {"last", AggregationFunction::LAST},
+      };
+
+  auto it = functions.find(FLAGS_downsampling);
+  if (it == functions.end()) {
+    return false;
   }
+  function = it->second;
+  return true;
 }
 
 GetDataRequest QueryHandler::createBeringeiRequest(
@@ -208,11 +304,23 @@ GetDataRequest QueryHandler::createBeringeiRequest(
   beringeiRequest.begin = fromTime;
   beringeiRequest.end = toTime;
 
+  // Let the storage nodes aggregate the points down to what the panel
+  // can display instead of fetching every raw point.
+  AggregationFunction function;
+  if (getAggregationFunction(function) && request.maxDataPoints > 0 &&
+      toTime > fromTime) {
+    int64_t range = toTime - fromTime;
+    beringeiRequest.aggregation.step = std::max<int64_t>(
+        (range + request.maxDataPoints - 1) / request.maxDataPoints,
+        request.intervalMs / kGorillaMsPerSecond);
+    beringeiRequest.aggregation.function = function;
+  }
+
   for (auto& target : request.targets) {
     Key beringeiKey;
     auto lowerCaseKey = target.target;
     beringeiKey.key = lowerCaseKey;
-    beringeiKey.shardId = getShardId(lowerCaseKey, numShards);
+    beringeiKey.shardId = shardRouter_->getShardId(lowerCaseKey, numShards);
     beringeiRequest.keys.push_back(beringeiKey);
   }
 
@@ -10,11 +10,11 @@
 #pragma once
 
 #include <folly/Memory.h>
-#include <folly/dynamic.h>
 #include <proxygen/httpserver/RequestHandler.h>
 
+#include "ShardRouter.h"
+
 #include "beringei/client/BeringeiClient.h"
-#include "beringei/client/BeringeiConfigurationAdapterIf.h"
 #include "beringei/if/gen-cpp2/beringei_grafana_types_custom_protocol.h"
 
 namespace facebook {
@@ -22,8 +22,8 @@ namespace gorilla {
 
 class QueryHandler : public proxygen::RequestHandler {
  public:
-  explicit QueryHandler(
-      std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter);
+  // `client` and `shardRouter` must outlive the handler.
+  QueryHandler(BeringeiClient* client, ShardRouter* shardRouter);
   void onRequest(
       std::unique_ptr<proxygen::HTTPMessage> headers) noexcept override;
 
@@ -40,24 +40,30 @@ class QueryHandler : public proxygen::RequestHandler {
  private:
   void logRequest(QueryRequest request);
 
-  int getShardId(const std::string& key, const int numShards);
+  // The server side aggregation of --downsampling. Returns false if the
+  // points aren't aggregated by Beringei.
+  static bool getAggregationFunction(AggregationFunction& function);
 
   GetDataRequest createBeringeiRequest(
       const QueryRequest& request,
       const int numShards);
 
-  folly::fbstring createJsonResponse(
-      const std::vector<QueryTarget>& targets,
-      const std::vector<std::pair<Key, std::vector<TimeValuePair>>>&
-          beringeiResponse);
-
-  folly::dynamic createResponseObject(
+  // Appends the Grafana JSON object of one target to `out`.
+  static void appendTargetJson(
       const std::string& target,
-      const std::vector<std::pair<Key, std::vector<TimeValuePair>>>&
-          beringeiResponse);
+      const std::vector<TimeValuePair>& points,
+      std::string& out);
 
-  std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter_;
+  void sendError(int code, const std::string& message);
+
+  BeringeiClient* client_;
+  ShardRouter* shardRouter_;
   std::unique_ptr<folly::IOBuf> body_;
+
+  // Set while waiting for Beringei. The handler is only deleted once the
+  // query has returned, even if the connection is closed before.
+  bool inFlight_;
+  bool closed_;
 };
 }
 } // facebook::gorilla
@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "ShardRouter.h"
+
+namespace facebook {
+namespace gorilla {
+
+ShardRouter::ShardRouter(
+    std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter,
+    size_t maxKeys)
+    : configurationAdapter_(configurationAdapter),
+      maxKeys_(maxKeys),
+      numShards_(0) {}
+
+int64_t ShardRouter::getShardId(const std::string& key, int64_t numShards) {
+  if (numShards <= 0) {
+    return 0;
+  }
+
+  if (numShards != numShards_ || shards_.size() >= maxKeys_) {
+    shards_.clear();
+    numShards_ = numShards;
+  }
+
+  auto it = shards_.find(key);
+  if (it != shards_.end()) {
+    return it->second;
+  }
+
+  int64_t shardId = configurationAdapter_->getShardForKey(
+      key, numShards, BeringeiConfigurationAdapterIf::kClientShardSeed);
+  shards_[key] = shardId;
+  return shardId;
+}
+}
+} // facebook::gorilla
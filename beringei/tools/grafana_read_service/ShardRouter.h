@@ -0,0 +1,44 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "beringei/client/BeringeiConfigurationAdapterIf.h"
+
+namespace facebook {
+namespace gorilla {
+
+// class ShardRouter
+//
+// Assigns keys to shards the same way as the writers, with the
+// configuration adapter's getShardForKey(), and remembers the shards of
+// the keys that were queried since dashboards ask for the same keys over
+// and over. Not thread safe: the server keeps one for each thread.
+class ShardRouter {
+ public:
+  explicit ShardRouter(
+      std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter,
+      size_t maxKeys = 100000);
+
+  int64_t getShardId(const std::string& key, int64_t numShards);
+
+ private:
+  std::shared_ptr<BeringeiConfigurationAdapterIf> configurationAdapter_;
+  const size_t maxKeys_;
+
+  // The shards are forgotten when the number of shards changes.
+  int64_t numShards_;
+  std::unordered_map<std::string, int64_t> shards_;
+};
+}
+} // facebook::gorilla